@@ -79,12 +79,22 @@ KERNELFLINGER_CFLAGS += -DBOARD_BOOTIMAGE_PARTITION_SIZE=$(BOARD_BOOTIMAGE_PARTI
 # disabled allowed on a USER build for security reasons:
 ifneq ($(TARGET_BUILD_VARIANT),user)
     KERNELFLINGER_CFLAGS += -DCRASHMODE_USE_ADB
+    ifneq ($(KERNELFLINGER_CRASHDUMP_PARTITION),)
+        KERNELFLINGER_CFLAGS += -DCRASHDUMP_PARTITION=\"$(KERNELFLINGER_CRASHDUMP_PARTITION)\"
+    endif
+    ifneq ($(KERNELFLINGER_CRASHDUMP_SOURCE),)
+        KERNELFLINGER_CFLAGS += -DCRASHDUMP_SOURCE=\"$(KERNELFLINGER_CRASHDUMP_SOURCE)\"
+    endif
 endif
 
 ifneq ($(strip $(KERNELFLINGER_USE_UI)),false)
     KERNELFLINGER_CFLAGS += -DUSE_UI
 endif
 
+ifneq ($(KERNELFLINGER_LOG_PARTITION),)
+    KERNELFLINGER_CFLAGS += -DLOG_PARTITION=\"$(KERNELFLINGER_LOG_PARTITION)\"
+endif
+
 ifneq ($(strip $(TARGET_BOOTLOADER_POLICY)),)
     KERNELFLINGER_CFLAGS += -DBOOTLOADER_POLICY=$(TARGET_BOOTLOADER_POLICY)
     # Double negation to enforce the use of the EFI variable storage
@@ -112,6 +122,30 @@ ifeq ($(BOARD_SLOT_AB_ENABLE),true)
     KERNELFLINGER_CFLAGS += -DUSE_SLOT
 endif
 
+ifeq ($(KERNELFLINGER_USE_HASH_MANIFEST),true)
+    KERNELFLINGER_CFLAGS += -DUSE_HASH_MANIFEST
+endif
+
+ifneq ($(KERNELFLINGER_FILL_QUEUE_DEPTH),)
+    KERNELFLINGER_CFLAGS += -DFILL_QUEUE_DEPTH=$(KERNELFLINGER_FILL_QUEUE_DEPTH)
+endif
+
+ifeq ($(KERNELFLINGER_AVB_PARALLEL_CHAINS),true)
+    KERNELFLINGER_CFLAGS += -DAVB_PARALLEL_CHAINS
+endif
+
+ifeq ($(KERNELFLINGER_BOOTTRACE_CMDLINE),true)
+    KERNELFLINGER_CFLAGS += -DBOOTTRACE_CMDLINE
+endif
+
+ifeq ($(KERNELFLINGER_BOOT_HARNESS),true)
+    ifneq ($(TARGET_BUILD_VARIANT),user)
+        KERNELFLINGER_CFLAGS += -DBOOT_HARNESS
+    else
+        $(warning The boot harness is only supported in eng and userdebug build)
+    endif
+endif
+
 ifeq ($(KERNELFLINGER_SUPPORT_USB_STORAGE),true)
     KERNELFLINGER_CFLAGS += -DUSB_STORAGE
     ifeq ($(KERNELFLINGER_SUPPORT_LIVE_BOOT),true)
@@ -123,6 +157,26 @@ ifeq ($(KERNELFLINGER_SUPPORT_USB_STORAGE),true)
     endif
 endif
 
+# Storage backends compiled in.  Leaving KERNELFLINGER_STORAGE_BACKENDS
+# empty builds all of them; listing a single backend (without USB
+# storage) also replaces the backend table walk by a direct probe.
+KERNELFLINGER_STORAGE_BACKENDS_ALL := emmc ufs sdcard sata nvme virtual general_block
+ifneq ($(KERNELFLINGER_STORAGE_BACKENDS),)
+    ifneq ($(filter-out $(KERNELFLINGER_STORAGE_BACKENDS_ALL),$(KERNELFLINGER_STORAGE_BACKENDS)),)
+        $(error Unknown storage backend: $(filter-out $(KERNELFLINGER_STORAGE_BACKENDS_ALL),$(KERNELFLINGER_STORAGE_BACKENDS)))
+    endif
+    KERNELFLINGER_STORAGE_BACKENDS_BUILT := $(sort $(KERNELFLINGER_STORAGE_BACKENDS))
+    KERNELFLINGER_CFLAGS += -DSTORAGE_BACKEND_SELECT \
+        $(foreach b,$(KERNELFLINGER_STORAGE_BACKENDS_BUILT),-DSTORAGE_BACKEND_$(call to-upper,$(b)))
+    ifeq ($(words $(KERNELFLINGER_STORAGE_BACKENDS_BUILT)),1)
+        ifneq ($(KERNELFLINGER_SUPPORT_USB_STORAGE),true)
+            KERNELFLINGER_CFLAGS += -DSTORAGE_BACKEND_SINGLE=STORAGE_$(call to-upper,$(KERNELFLINGER_STORAGE_BACKENDS_BUILT))
+        endif
+    endif
+else
+    KERNELFLINGER_STORAGE_BACKENDS_BUILT := $(KERNELFLINGER_STORAGE_BACKENDS_ALL)
+endif
+
 ifeq ($(KERNELFLINGER_USE_RPMB),true)
     KERNELFLINGER_CFLAGS += -DRPMB_STORAGE
 endif
@@ -135,6 +189,22 @@ ifeq ($(KERNELFLINGER_USE_NVME_RPMB),true)
     KERNELFLINGER_CFLAGS += -DNVME_RPMB
 endif
 
+ifeq ($(KERNELFLINGER_USE_RPMB_MEMORY),true)
+    ifneq ($(TARGET_BUILD_VARIANT),user)
+        KERNELFLINGER_CFLAGS += -DRPMB_MEMORY
+    else
+        $(warning The memory RPMB is only supported in eng and userdebug build)
+    endif
+endif
+
+ifeq ($(KERNELFLINGER_MEMTRACK),true)
+    ifneq ($(TARGET_BUILD_VARIANT),user)
+        KERNELFLINGER_CFLAGS += -DMEMTRACK
+    else
+        $(warning The allocation tracking is only supported in eng and userdebug build)
+    endif
+endif
+
 ifeq ($(KERNELFLINGER_USE_RPMB_SIMULATE),true)
     KERNELFLINGER_CFLAGS += -DSECURE_STORAGE_EFIVAR
 else  # KERNELFLINGER_USE_RPMB_SIMULATE == false
@@ -290,6 +360,10 @@ endif
 
 LOCAL_CFLAGS := $(SHARED_CFLAGS)
 
+ifeq ($(KERNELFLINGER_USE_IPP_SHA256),true)
+    LOCAL_CFLAGS += -DUSE_IPP_SHA256
+endif
+
 ifeq ($(PRODUCTS.$(INTERNAL_PRODUCT).PRODUCT_SUPPORTS_VERITY), true)
 LOCAL_OBJCOPY_FLAGS := -j .oemkeys
 endif
@@ -95,7 +95,7 @@ endif
 
 LOCAL_SRC_FILES := \
     libavb/avb_chain_partition_descriptor.c \
-    libavb/avb_crc32.c \
+    libavb/uefi_avb_crc32.c \
     libavb/avb_crypto.c \
     libavb/avb_cmdline.c \
     libavb/avb_descriptor.c \
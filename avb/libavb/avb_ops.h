@@ -76,6 +76,16 @@ typedef enum {
   AVB_IO_RESULT_ERROR_INSUFFICIENT_SPACE,
 } AvbIOResult;
 
+/* Callback receiving each segment of a streamed partition read. */
+typedef void (*AvbSegmentCallback)(void* user_data,
+                                   const uint8_t* data,
+                                   size_t size);
+
+/* Work function run concurrently by |run_parallel_start| for each
+ * |index| of a run.
+ */
+typedef void (*AvbParallelWork)(void* user_data, size_t index);
+
 struct AvbOps;
 typedef struct AvbOps AvbOps;
 
@@ -308,6 +318,41 @@ struct AvbOps {
                                         const char* name,
                                         size_t value_size,
                                         const uint8_t* value);
+
+  /* Reads like |read_from_partition| but calls |segment_cb| with
+   * |user_data| on each segment of |buffer|, in order, as soon as it
+   * has been read and while the following segments are still being
+   * read. This lets the caller hash the data while the I/O is in
+   * flight.
+   *
+   * This function pointer can be set to NULL, |read_from_partition| is
+   * then used and the whole buffer is handed to the caller at once.
+   */
+  AvbIOResult (*read_from_partition_streamed)(AvbOps* ops,
+                                              const char* partition,
+                                              int64_t offset,
+                                              size_t num_bytes,
+                                              void* buffer,
+                                              size_t* out_num_read,
+                                              AvbSegmentCallback segment_cb,
+                                              void* user_data);
+
+  /* Starts calling |work| with |user_data| for each index in [0,
+   * |count|), possibly on other processors, and returns without
+   * waiting for their completion. |work| must not call any operation
+   * of |ops|, must not allocate memory and must not log. Only one run
+   * can be in progress at a time, |run_parallel_wait| waits for its
+   * completion.
+   *
+   * These function pointers can be set to NULL, the
+   * AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS flag of avb_slot_verify()
+   * is then ignored.
+   */
+  AvbIOResult (*run_parallel_start)(AvbOps* ops,
+                                    size_t count,
+                                    AvbParallelWork work,
+                                    void* user_data);
+  AvbIOResult (*run_parallel_wait)(AvbOps* ops);
 };
 
 #ifdef __cplusplus
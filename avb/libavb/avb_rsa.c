@@ -37,13 +37,44 @@
 #include "avb_util.h"
 #include "avb_vbmeta_image.h"
 
+/* On x86_64 the modular exponentiation is done on 64-bit limbs
+ * using the MULX and ADCX/ADOX instructions when the CPU supports
+ * them (BMI2 and ADX extensions).
+ */
+#if defined(__x86_64__)
+#define AVB_RSA_MULX
+#include <cpuid.h>
+#include <immintrin.h>
+#define AVB_TARGET_MULX __attribute__((target("bmi2,adx")))
+#endif
+
+/* Number of parsed public keys kept around. A boot verifies the
+ * vbmeta image and a few chained partitions, usually signed by one
+ * or two keys.
+ */
+#define AVB_RSA_KEY_CACHE_SIZE 4
+
 typedef struct IAvbKey {
   unsigned int len; /* Length of n[] in number of uint32_t */
   uint32_t n0inv;   /* -1 / n[0] mod 2^32 */
   uint32_t* n;      /* modulus as array (host-byte order) */
   uint32_t* rr;     /* R^2 as array (host-byte order) */
+#ifdef AVB_RSA_MULX
+  uint64_t n0inv64; /* -1 / n[0] mod 2^64 */
+  uint64_t* n64;    /* modulus as array of 64-bit limbs */
+  uint64_t* rr64;   /* R^2 as array of 64-bit limbs */
+#endif
 } IAvbKey;
 
+typedef struct IAvbKeyCacheEntry {
+  uint8_t* data; /* Serialized key, as given to avb_rsa_verify() */
+  size_t length;
+  IAvbKey* key;
+} IAvbKeyCacheEntry;
+
+static IAvbKeyCacheEntry key_cache[AVB_RSA_KEY_CACHE_SIZE];
+static unsigned int key_cache_next;
+
 static IAvbKey* iavb_parse_key_data(const uint8_t* data, size_t length) {
   AvbRSAPublicKeyHeader h;
   IAvbKey* key = NULL;
@@ -76,7 +107,11 @@ static IAvbKey* iavb_parse_key_data(const uint8_t* data, size_t length) {
   /* Store n and rr following the key header so we only have to do one
    * allocation.
    */
+#ifdef AVB_RSA_MULX
+  key = (IAvbKey*)(avb_malloc(sizeof(IAvbKey) + 4 * h.key_num_bits / 8));
+#else
   key = (IAvbKey*)(avb_malloc(sizeof(IAvbKey) + 2 * h.key_num_bits / 8));
+#endif
   if (key == NULL) {
     goto fail;
   }
@@ -94,6 +129,25 @@ static IAvbKey* iavb_parse_key_data(const uint8_t* data, size_t length) {
     key->n[i] = avb_be32toh(((uint32_t*)n)[key->len - i - 1]);
     key->rr[i] = avb_be32toh(((uint32_t*)rr)[key->len - i - 1]);
   }
+
+#ifdef AVB_RSA_MULX
+  /* R = 2^(32 * len) = 2^(64 * len / 2) so R^2 does not change, only
+   * the limb size does. The 32-bit inverse is lifted to 64 bits with
+   * one Newton iteration: x = x * (2 - n * x) mod 2^64.
+   */
+  key->n64 = (uint64_t*)(key->rr + key->len);
+  key->rr64 = key->n64 + key->len / 2;
+  for (i = 0; i < key->len / 2; i++) {
+    key->n64[i] = ((uint64_t)key->n[2 * i + 1] << 32) | key->n[2 * i];
+    key->rr64[i] = ((uint64_t)key->rr[2 * i + 1] << 32) | key->rr[2 * i];
+  }
+  {
+    uint64_t x = (uint32_t)-key->n0inv; /* 1 / n[0] mod 2^32 */
+    x *= 2 - key->n64[0] * x;
+    key->n0inv64 = -x;
+  }
+#endif
+
   return key;
 
 fail:
@@ -107,6 +161,56 @@ static void iavb_free_parsed_key(IAvbKey* key) {
   avb_free(key);
 }
 
+/* Returns the parsed version of the key |data| of |length| bytes,
+ * from the cache when the very same key has been used before. The
+ * key is added to the cache otherwise, possibly evicting the oldest
+ * entry. |*out_cached| tells whether the cache owns the returned key
+ * or whether it must be released with iavb_free_parsed_key().
+ */
+static IAvbKey* iavb_get_key(const uint8_t* data,
+                             size_t length,
+                             bool* out_cached) {
+  IAvbKeyCacheEntry* entry;
+  IAvbKey* key;
+  uint8_t* copy;
+  unsigned int i;
+
+  *out_cached = false;
+
+  for (i = 0; i < AVB_RSA_KEY_CACHE_SIZE; i++) {
+    entry = &key_cache[i];
+    if (entry->key != NULL && entry->length == length &&
+        avb_memcmp(entry->data, data, length) == 0) {
+      *out_cached = true;
+      return entry->key;
+    }
+  }
+
+  key = iavb_parse_key_data(data, length);
+  if (key == NULL) {
+    return NULL;
+  }
+
+  copy = (uint8_t*)avb_malloc(length);
+  if (copy == NULL) {
+    return key;
+  }
+  avb_memcpy(copy, data, length);
+
+  entry = &key_cache[key_cache_next];
+  key_cache_next = (key_cache_next + 1) % AVB_RSA_KEY_CACHE_SIZE;
+  if (entry->key != NULL) {
+    avb_free(entry->data);
+    iavb_free_parsed_key(entry->key);
+  }
+  entry->data = copy;
+  entry->length = length;
+  entry->key = key;
+
+  *out_cached = true;
+  return key;
+}
+
 /* a[] -= mod */
 static void subM(const IAvbKey* key, uint32_t* a) {
   int64_t A = 0;
@@ -225,6 +329,160 @@ out:
   }
 }
 
+#ifdef AVB_RSA_MULX
+static bool mulx_is_supported(void) {
+  static enum { UNKNOWN, NO, YES } mulx = UNKNOWN;
+  unsigned int eax, ebx = 0, ecx, edx;
+
+  if (mulx == UNKNOWN) {
+    if (__get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    }
+    /* EBX bit 8: BMI2 (MULX), EBX bit 19: ADX (ADCX/ADOX) */
+    mulx = (ebx & (1 << 8)) && (ebx & (1 << 19)) ? YES : NO;
+  }
+
+  return mulx == YES;
+}
+
+/* Returns the low 64 bits of a * b + c + d and stores the high 64
+ * bits in |hi|. It cannot overflow: (2^64 - 1)^2 + 2 * (2^64 - 1) is
+ * 2^128 - 1.
+ */
+static inline AVB_TARGET_MULX uint64_t
+mac64(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t* hi) {
+  unsigned long long lo, h;
+
+  lo = _mulx_u64(a, b, &h);
+  h += _addcarryx_u64(0, lo, c, &lo);
+  h += _addcarryx_u64(0, lo, d, &lo);
+  *hi = h;
+  return lo;
+}
+
+/* a[] -= mod, on 64-bit limbs */
+static void subM64(const IAvbKey* key, uint64_t* a) {
+  unsigned char borrow = 0;
+  unsigned long long r;
+  uint32_t i;
+  for (i = 0; i < key->len / 2; ++i) {
+    borrow = _subborrow_u64(borrow, a[i], key->n64[i], &r);
+    a[i] = r;
+  }
+}
+
+/* return a[] >= mod, on 64-bit limbs */
+static int geM64(const IAvbKey* key, uint64_t* a) {
+  uint32_t i;
+  for (i = key->len / 2; i;) {
+    --i;
+    if (a[i] < key->n64[i]) {
+      return 0;
+    }
+    if (a[i] > key->n64[i]) {
+      return 1;
+    }
+  }
+  return 1; /* equal */
+}
+
+/* montgomery c[] += a * b[] / R % mod, on 64-bit limbs */
+static AVB_TARGET_MULX void montMulAdd64(const IAvbKey* key,
+                                         uint64_t* c,
+                                         const uint64_t a,
+                                         const uint64_t* b) {
+  uint32_t len = key->len / 2;
+  uint64_t A_hi, B_hi, A_lo, d0;
+  unsigned long long top;
+  uint32_t i;
+
+  A_lo = mac64(a, b[0], c[0], 0, &A_hi);
+  d0 = A_lo * key->n0inv64;
+  (void)mac64(d0, key->n64[0], A_lo, 0, &B_hi); /* Low limb is zero. */
+
+  for (i = 1; i < len; ++i) {
+    A_lo = mac64(a, b[i], c[i], A_hi, &A_hi);
+    c[i - 1] = mac64(d0, key->n64[i], A_lo, B_hi, &B_hi);
+  }
+
+  if (_addcarryx_u64(0, A_hi, B_hi, &top)) {
+    c[i - 1] = top;
+    subM64(key, c);
+  } else {
+    c[i - 1] = top;
+  }
+}
+
+/* montgomery c[] = a[] * b[] / R % mod, on 64-bit limbs */
+static AVB_TARGET_MULX void montMul64(const IAvbKey* key,
+                                      uint64_t* c,
+                                      uint64_t* a,
+                                      uint64_t* b) {
+  uint32_t i;
+  for (i = 0; i < key->len / 2; ++i) {
+    c[i] = 0;
+  }
+  for (i = 0; i < key->len / 2; ++i) {
+    montMulAdd64(key, c, a[i], b);
+  }
+}
+
+/* Same as modpowF4() using 64-bit limbs and MULX/ADX. */
+static AVB_TARGET_MULX void modpowF4_mulx(const IAvbKey* key,
+                                          uint8_t* inout) {
+  uint32_t len = key->len / 2;
+  uint64_t* a = (uint64_t*)avb_malloc(len * sizeof(uint64_t));
+  uint64_t* aR = (uint64_t*)avb_malloc(len * sizeof(uint64_t));
+  uint64_t* aaR = (uint64_t*)avb_malloc(len * sizeof(uint64_t));
+  if (a == NULL || aR == NULL || aaR == NULL) {
+    goto out;
+  }
+
+  uint64_t* aaa = aaR; /* Re-use location. */
+  int i, j;
+
+  /* Convert from big endian byte array to little endian limb array. */
+  for (i = 0; i < (int)len; ++i) {
+    uint64_t tmp = 0;
+    for (j = 0; j < 8; j++) {
+      tmp = (tmp << 8) | inout[((len - 1 - i) * 8) + j];
+    }
+    a[i] = tmp;
+  }
+
+  montMul64(key, aR, a, key->rr64); /* aR = a * RR / R mod M   */
+  for (i = 0; i < 16; i += 2) {
+    montMul64(key, aaR, aR, aR);  /* aaR = aR * aR / R mod M */
+    montMul64(key, aR, aaR, aaR); /* aR = aaR * aaR / R mod M */
+  }
+  montMul64(key, aaa, aR, a); /* aaa = aR * a / R mod M */
+
+  /* Make sure aaa < mod; aaa is at most 1x mod too large. */
+  if (geM64(key, aaa)) {
+    subM64(key, aaa);
+  }
+
+  /* Convert to bigendian byte array */
+  for (i = (int)len - 1; i >= 0; --i) {
+    uint64_t tmp = aaa[i];
+    for (j = 56; j >= 0; j -= 8) {
+      *inout++ = (uint8_t)(tmp >> j);
+    }
+  }
+
+out:
+  if (a != NULL) {
+    avb_free(a);
+  }
+  if (aR != NULL) {
+    avb_free(aR);
+  }
+  if (aaR != NULL) {
+    avb_free(aaR);
+  }
+}
+#endif
+
 /* Verify a RSA PKCS1.5 signature against an expected hash.
  * Returns false on failure, true on success.
  */
@@ -238,6 +496,7 @@ bool avb_rsa_verify(const uint8_t* key,
                     size_t padding_num_bytes) {
   uint8_t* buf = NULL;
   IAvbKey* parsed_key = NULL;
+  bool key_cached = false;
   bool success = false;
 
   if (key == NULL || sig == NULL || hash == NULL || padding == NULL) {
@@ -245,7 +504,7 @@ bool avb_rsa_verify(const uint8_t* key,
     goto out;
   }
 
-  parsed_key = iavb_parse_key_data(key, key_num_bytes);
+  parsed_key = iavb_get_key(key, key_num_bytes, &key_cached);
   if (parsed_key == NULL) {
     avb_error("Error parsing key.\n");
     goto out;
@@ -268,7 +527,15 @@ bool avb_rsa_verify(const uint8_t* key,
   }
   avb_memcpy(buf, sig, sig_num_bytes);
 
+#ifdef AVB_RSA_MULX
+  if (mulx_is_supported()) {
+    modpowF4_mulx(parsed_key, buf);
+  } else {
+    modpowF4(parsed_key, buf);
+  }
+#else
   modpowF4(parsed_key, buf);
+#endif
 
   /* Check padding bytes.
    *
@@ -289,7 +556,7 @@ bool avb_rsa_verify(const uint8_t* key,
   success = true;
 
 out:
-  if (parsed_key != NULL) {
+  if (parsed_key != NULL && !key_cached) {
     iavb_free_parsed_key(parsed_key);
   }
   if (buf != NULL) {
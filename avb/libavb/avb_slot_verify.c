@@ -74,13 +74,19 @@ static inline bool result_should_continue(AvbSlotVerifyResult result) {
   return false;
 }
 
+/* If |segment_cb| is not NULL it is called on the loaded data, segment
+ * by segment while the partition is being read when the ops support it.
+ */
 static AvbSlotVerifyResult load_full_partition(AvbOps* ops,
                                                const char* part_name,
                                                uint64_t image_size,
                                                uint8_t** out_image_buf,
-                                               bool* out_image_preloaded) {
+                                               bool* out_image_preloaded,
+                                               AvbSegmentCallback segment_cb,
+                                               void* segment_user_data) {
   size_t part_num_read;
   AvbIOResult io_ret;
+  bool streamed = false;
 
   /* Make sure that we do not overwrite existing data. */
   avb_assert(*out_image_buf == NULL);
@@ -120,12 +126,24 @@ static AvbSlotVerifyResult load_full_partition(AvbOps* ops,
       return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
     }
 
-    io_ret = ops->read_from_partition(ops,
-                                      part_name,
-                                      0 /* offset */,
-                                      image_size,
-                                      *out_image_buf,
-                                      &part_num_read);
+    if (segment_cb != NULL && ops->read_from_partition_streamed != NULL) {
+      io_ret = ops->read_from_partition_streamed(ops,
+                                                 part_name,
+                                                 0 /* offset */,
+                                                 image_size,
+                                                 *out_image_buf,
+                                                 &part_num_read,
+                                                 segment_cb,
+                                                 segment_user_data);
+      streamed = true;
+    } else {
+      io_ret = ops->read_from_partition(ops,
+                                        part_name,
+                                        0 /* offset */,
+                                        image_size,
+                                        *out_image_buf,
+                                        &part_num_read);
+    }
     if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
       return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
     } else if (io_ret != AVB_IO_RESULT_OK) {
@@ -138,9 +156,77 @@ static AvbSlotVerifyResult load_full_partition(AvbOps* ops,
     }
   }
 
+  if (segment_cb != NULL && !streamed) {
+    segment_cb(segment_user_data, *out_image_buf, image_size);
+  }
+
   return AVB_SLOT_VERIFY_RESULT_OK;
 }
 
+/* Hashes the first |remaining| bytes of a partition as it is loaded. */
+typedef struct {
+  bool sha256;
+  union {
+    AvbSHA256Ctx sha256_ctx;
+    AvbSHA512Ctx sha512_ctx;
+  } u;
+  uint64_t remaining;
+} HashImageCtx;
+
+static void hash_image_segment(void* user_data,
+                               const uint8_t* data,
+                               size_t size) {
+  HashImageCtx* ctx = user_data;
+
+  if (size > ctx->remaining) {
+    size = ctx->remaining;
+  }
+  if (ctx->sha256) {
+    avb_sha256_update(&ctx->u.sha256_ctx, data, size);
+  } else {
+    avb_sha512_update(&ctx->u.sha512_ctx, data, size);
+  }
+  ctx->remaining -= size;
+}
+
+/* Largest salt of a hash descriptor whose partition can be prefetched. */
+#define PREFETCH_MAX_SALT_SIZE 64
+
+/* A chained vbmeta image loaded and verified ahead of time. */
+typedef struct {
+  char part_name[AVB_PART_NAME_MAX_SIZE];
+  uint8_t* vbmeta_buf;
+  size_t vbmeta_num_read;
+  AvbVBMetaVerifyResult verify_result;
+  const uint8_t* pk_data;
+  size_t pk_len;
+} PrefetchedVBMeta;
+
+/* A hash descriptor partition loaded and hashed ahead of time. */
+typedef struct {
+  char part_name[AVB_PART_NAME_MAX_SIZE];
+  uint64_t image_size;
+  uint8_t salt[PREFETCH_MAX_SALT_SIZE];
+  uint32_t salt_len;
+  HashImageCtx hash_ctx;
+  const uint8_t* digest;
+  size_t digest_len;
+  uint8_t* image_buf;
+  bool image_preloaded;
+} PrefetchedPartition;
+
+/* What has been prefetched for AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS.
+ * The serial verification takes the buffers it needs from here
+ * instead of reading them; whatever is left is freed at the end.
+ */
+typedef struct {
+  PrefetchedVBMeta vbmeta_images[MAX_NUMBER_OF_VBMETA_IMAGES];
+  size_t num_vbmeta_images;
+  PrefetchedPartition partitions[MAX_NUMBER_OF_LOADED_PARTITIONS];
+  size_t num_partitions;
+  bool running; /* A run_parallel_start() is in progress. */
+} AvbPrefetch;
+
 /* Reads a persistent digest stored as a named persistent value corresponding to
  * the given |part_name|. The value is returned in |out_digest| which must point
  * to |expected_digest_size| bytes. If there is no digest stored for |part_name|
@@ -275,13 +361,42 @@ static AvbSlotVerifyResult initialize_persistent_digest(
   return ret;
 }
 
+/* Returns the prefetched partition |part_name| if it has been loaded
+ * with the same size, hash algorithm and salt, NULL otherwise.
+ */
+static PrefetchedPartition* find_prefetched_partition(AvbPrefetch* prefetch,
+                                                      const char* part_name,
+                                                      uint64_t image_size,
+                                                      bool sha256,
+                                                      const uint8_t* salt,
+                                                      uint32_t salt_len) {
+  PrefetchedPartition* p;
+  size_t n;
+
+  if (prefetch == NULL) {
+    return NULL;
+  }
+
+  for (n = 0; n < prefetch->num_partitions; n++) {
+    p = &prefetch->partitions[n];
+    if (p->image_buf != NULL && avb_strcmp(p->part_name, part_name) == 0 &&
+        p->image_size == image_size && p->hash_ctx.sha256 == sha256 &&
+        p->salt_len == salt_len && avb_memcmp(p->salt, salt, salt_len) == 0) {
+      return p;
+    }
+  }
+
+  return NULL;
+}
+
 static AvbSlotVerifyResult load_and_verify_hash_partition(
     AvbOps* ops,
     const char* const* requested_partitions,
     const char* ab_suffix,
     bool allow_verification_error,
     const AvbDescriptor* descriptor,
-    AvbSlotVerifyData* slot_data) {
+    AvbSlotVerifyData* slot_data,
+    AvbPrefetch* prefetch) {
   AvbHashDescriptor hash_desc;
   const uint8_t* desc_partition_name = NULL;
   const uint8_t* desc_salt;
@@ -298,6 +413,8 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
   size_t expected_digest_len = 0;
   uint8_t expected_digest_buf[AVB_SHA512_DIGEST_SIZE];
   const uint8_t* expected_digest = NULL;
+  HashImageCtx hash_ctx;
+  PrefetchedPartition* prefetched;
 
   if (!avb_hash_descriptor_validate_and_byteswap(
           (const AvbHashDescriptor*)descriptor, &hash_desc)) {
@@ -380,31 +497,55 @@ static AvbSlotVerifyResult load_and_verify_hash_partition(
     avb_debugv(part_name, ": Loading entire partition.\n", NULL);
   }
 
-  ret = load_full_partition(
-      ops, part_name, image_size, &image_buf, &image_preloaded);
-  if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
-    goto out;
-  }
-
+  /* The image is hashed while it is being read. */
   if (avb_strcmp((const char*)hash_desc.hash_algorithm, "sha256") == 0) {
-    AvbSHA256Ctx sha256_ctx;
-    avb_sha256_init(&sha256_ctx);
-    avb_sha256_update(&sha256_ctx, desc_salt, hash_desc.salt_len);
-    avb_sha256_update(&sha256_ctx, image_buf, hash_desc.image_size);
-    digest = avb_sha256_final(&sha256_ctx);
-    digest_len = AVB_SHA256_DIGEST_SIZE;
+    hash_ctx.sha256 = true;
+    avb_sha256_init(&hash_ctx.u.sha256_ctx);
+    avb_sha256_update(&hash_ctx.u.sha256_ctx, desc_salt, hash_desc.salt_len);
   } else if (avb_strcmp((const char*)hash_desc.hash_algorithm, "sha512") == 0) {
-    AvbSHA512Ctx sha512_ctx;
-    avb_sha512_init(&sha512_ctx);
-    avb_sha512_update(&sha512_ctx, desc_salt, hash_desc.salt_len);
-    avb_sha512_update(&sha512_ctx, image_buf, hash_desc.image_size);
-    digest = avb_sha512_final(&sha512_ctx);
-    digest_len = AVB_SHA512_DIGEST_SIZE;
+    hash_ctx.sha256 = false;
+    avb_sha512_init(&hash_ctx.u.sha512_ctx);
+    avb_sha512_update(&hash_ctx.u.sha512_ctx, desc_salt, hash_desc.salt_len);
   } else {
     avb_errorv(part_name, ": Unsupported hash algorithm.\n", NULL);
     ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
     goto out;
   }
+  hash_ctx.remaining = hash_desc.image_size;
+
+  prefetched = find_prefetched_partition(prefetch,
+                                         part_name,
+                                         image_size,
+                                         hash_ctx.sha256,
+                                         desc_salt,
+                                         hash_desc.salt_len);
+  if (prefetched != NULL) {
+    /* Already loaded and hashed, take it over. */
+    image_buf = prefetched->image_buf;
+    image_preloaded = prefetched->image_preloaded;
+    prefetched->image_buf = NULL;
+    digest = (uint8_t*)prefetched->digest;
+    digest_len = prefetched->digest_len;
+  } else {
+    ret = load_full_partition(ops,
+                              part_name,
+                              image_size,
+                              &image_buf,
+                              &image_preloaded,
+                              hash_image_segment,
+                              &hash_ctx);
+    if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+      goto out;
+    }
+
+    if (hash_ctx.sha256) {
+      digest = avb_sha256_final(&hash_ctx.u.sha256_ctx);
+      digest_len = AVB_SHA256_DIGEST_SIZE;
+    } else {
+      digest = avb_sha512_final(&hash_ctx.u.sha512_ctx);
+      digest_len = AVB_SHA512_DIGEST_SIZE;
+    }
+  }
 
   if (hash_desc.digest_len == 0) {
     /* Expect a match to a persistent digest. */
@@ -509,7 +650,7 @@ static AvbSlotVerifyResult load_requested_partitions(
     avb_debugv(part_name, ": Loading entire partition.\n", NULL);
 
     ret = load_full_partition(
-        ops, part_name, image_size, &image_buf, &image_preloaded);
+        ops, part_name, image_size, &image_buf, &image_preloaded, NULL, NULL);
     if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
       goto out;
     }
@@ -546,67 +687,23 @@ out:
   return ret;
 }
 
-static AvbSlotVerifyResult load_and_verify_vbmeta(
-    AvbOps* ops,
-    const char* const* requested_partitions,
-    const char* ab_suffix,
-    bool allow_verification_error,
-    AvbVBMetaImageFlags toplevel_vbmeta_flags,
-    int rollback_index_location,
-    const char* partition_name,
-    size_t partition_name_len,
-    const uint8_t* expected_public_key,
-    size_t expected_public_key_length,
-    AvbSlotVerifyData* slot_data,
-    AvbAlgorithmType* out_algorithm_type,
-    AvbCmdlineSubstList* out_additional_cmdline_subst) {
-  char full_partition_name[AVB_PART_NAME_MAX_SIZE];
-  AvbSlotVerifyResult ret;
+/* Reads the vbmeta image of |full_partition_name|. Unless it is a
+ * vbmeta partition, the image is located through the footer. On
+ * success |*out_vbmeta_buf| must be freed by the caller. If the read
+ * of the image itself fails, |*out_io_ret| is set to the error.
+ */
+static AvbSlotVerifyResult read_vbmeta_image(AvbOps* ops,
+                                             const char* full_partition_name,
+                                             bool is_vbmeta_partition,
+                                             uint8_t** out_vbmeta_buf,
+                                             size_t* out_vbmeta_num_read,
+                                             AvbIOResult* out_io_ret) {
   AvbIOResult io_ret;
   size_t vbmeta_offset;
   size_t vbmeta_size;
-  uint8_t* vbmeta_buf = NULL;
-  size_t vbmeta_num_read;
-  AvbVBMetaVerifyResult vbmeta_ret;
-  const uint8_t* pk_data;
-  size_t pk_len;
-  AvbVBMetaImageHeader vbmeta_header;
-  uint64_t stored_rollback_index;
-  const AvbDescriptor** descriptors = NULL;
-  size_t num_descriptors;
-  size_t n;
-  bool is_main_vbmeta;
-  bool is_vbmeta_partition;
-  AvbVBMetaData* vbmeta_image_data = NULL;
-
-  ret = AVB_SLOT_VERIFY_RESULT_OK;
-
-  avb_assert(slot_data != NULL);
-
-  /* Since we allow top-level vbmeta in 'boot', use
-   * rollback_index_location to determine whether we're the main
-   * vbmeta struct.
-   */
-  is_main_vbmeta = (rollback_index_location == 0);
-  is_vbmeta_partition = (avb_strcmp(partition_name, "vbmeta") == 0);
+  uint8_t* vbmeta_buf;
 
-  if (!avb_validate_utf8((const uint8_t*)partition_name, partition_name_len)) {
-    avb_error("Partition name is not valid UTF-8.\n");
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
-    goto out;
-  }
-
-  /* Construct full partition name e.g. system_a. */
-  if (!avb_str_concat(full_partition_name,
-                      sizeof full_partition_name,
-                      partition_name,
-                      partition_name_len,
-                      ab_suffix,
-                      avb_strlen(ab_suffix))) {
-    avb_error("Partition name and suffix does not fit.\n");
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
-    goto out;
-  }
+  *out_io_ret = AVB_IO_RESULT_OK;
 
   /* If we're loading from the main vbmeta partition, the vbmeta struct is in
    * the beginning. Otherwise we may have to locate it via a footer... if no
@@ -628,12 +725,10 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
                                       footer_buf,
                                       &footer_num_read);
     if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
-      ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
-      goto out;
+      return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
     } else if (io_ret != AVB_IO_RESULT_OK) {
       avb_errorv(full_partition_name, ": Error loading footer.\n", NULL);
-      ret = AVB_SLOT_VERIFY_RESULT_ERROR_IO;
-      goto out;
+      return AVB_SLOT_VERIFY_RESULT_ERROR_IO;
     }
     avb_assert(footer_num_read == AVB_FOOTER_SIZE);
 
@@ -654,8 +749,7 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
 
   vbmeta_buf = avb_malloc(vbmeta_size);
   if (vbmeta_buf == NULL) {
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
-    goto out;
+    return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
   }
 
   if (vbmeta_offset != 0) {
@@ -675,46 +769,444 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
                                     vbmeta_offset,
                                     vbmeta_size,
                                     vbmeta_buf,
-                                    &vbmeta_num_read);
-  if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
-    ret = AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
-    goto out;
-  } else if (io_ret != AVB_IO_RESULT_OK) {
-    /* If we're looking for 'vbmeta' but there is no such partition,
-     * go try to get it from the boot partition instead.
-     */
-    if (is_main_vbmeta && io_ret == AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION &&
-        is_vbmeta_partition) {
-      avb_debugv(full_partition_name,
-                 ": No such partition. Trying 'boot' instead.\n",
-                 NULL);
-      ret = load_and_verify_vbmeta(ops,
-                                   requested_partitions,
-                                   ab_suffix,
-                                   allow_verification_error,
-                                   0 /* toplevel_vbmeta_flags */,
-                                   0 /* rollback_index_location */,
-                                   "boot",
-                                   avb_strlen("boot"),
-                                   NULL /* expected_public_key */,
-                                   0 /* expected_public_key_length */,
-                                   slot_data,
-                                   out_algorithm_type,
-                                   out_additional_cmdline_subst);
-      goto out;
+                                    out_vbmeta_num_read);
+  if (io_ret != AVB_IO_RESULT_OK) {
+    avb_free(vbmeta_buf);
+    if (io_ret == AVB_IO_RESULT_ERROR_OOM) {
+      return AVB_SLOT_VERIFY_RESULT_ERROR_OOM;
+    }
+    *out_io_ret = io_ret;
+    return AVB_SLOT_VERIFY_RESULT_ERROR_IO;
+  }
+  avb_assert(*out_vbmeta_num_read <= vbmeta_size);
+
+  *out_vbmeta_buf = vbmeta_buf;
+  return AVB_SLOT_VERIFY_RESULT_OK;
+}
+
+/* Hashes a prefetched partition. Called through run_parallel_start(),
+ * possibly on another processor.
+ */
+static void hash_prefetched_partition(void* user_data, size_t index) {
+  PrefetchedPartition* p = user_data;
+
+  hash_image_segment(&p->hash_ctx, p->image_buf, p->image_size);
+  if (p->hash_ctx.sha256) {
+    p->digest = avb_sha256_final(&p->hash_ctx.u.sha256_ctx);
+    p->digest_len = AVB_SHA256_DIGEST_SIZE;
+  } else {
+    p->digest = avb_sha512_final(&p->hash_ctx.u.sha512_ctx);
+    p->digest_len = AVB_SHA512_DIGEST_SIZE;
+  }
+}
+
+static void prefetch_wait(AvbOps* ops, AvbPrefetch* prefetch) {
+  if (prefetch->running) {
+    ops->run_parallel_wait(ops);
+    prefetch->running = false;
+  }
+}
+
+/* Loads the requested partitions of the hash descriptors in
+ * |descriptors|. Each one is hashed by the other processors while the
+ * next one is read. Failures are not reported: the partition is then
+ * simply loaded again, and the error reported, by the verification.
+ */
+static void prefetch_hash_partitions(AvbOps* ops,
+                                     const char* const* requested_partitions,
+                                     const char* ab_suffix,
+                                     const AvbDescriptor** descriptors,
+                                     size_t num_descriptors,
+                                     AvbPrefetch* prefetch) {
+  size_t n;
+
+  for (n = 0; n < num_descriptors; n++) {
+    AvbDescriptor desc;
+    AvbHashDescriptor hash_desc;
+    const uint8_t* desc_partition_name;
+    const uint8_t* desc_salt;
+    PrefetchedPartition* p;
+    AvbSlotVerifyResult ret;
+    bool sha256;
+
+    if (prefetch->num_partitions == MAX_NUMBER_OF_LOADED_PARTITIONS) {
+      break;
+    }
+
+    if (!avb_descriptor_validate_and_byteswap(descriptors[n], &desc) ||
+        desc.tag != AVB_DESCRIPTOR_TAG_HASH ||
+        !avb_hash_descriptor_validate_and_byteswap(
+            (const AvbHashDescriptor*)descriptors[n], &hash_desc)) {
+      continue;
+    }
+
+    /* Persistent digests are left to the verification. */
+    if (hash_desc.digest_len == 0 ||
+        hash_desc.salt_len > PREFETCH_MAX_SALT_SIZE) {
+      continue;
+    }
+
+    desc_partition_name =
+        ((const uint8_t*)descriptors[n]) + sizeof(AvbHashDescriptor);
+    desc_salt = desc_partition_name + hash_desc.partition_name_len;
+
+    if (avb_strv_find_str(requested_partitions,
+                          (const char*)desc_partition_name,
+                          hash_desc.partition_name_len) == NULL) {
+      continue;
+    }
+
+    if (avb_strcmp((const char*)hash_desc.hash_algorithm, "sha256") == 0) {
+      sha256 = true;
+    } else if (avb_strcmp((const char*)hash_desc.hash_algorithm, "sha512") ==
+               0) {
+      sha256 = false;
     } else {
-      avb_errorv(full_partition_name, ": Error loading vbmeta data.\n", NULL);
-      ret = AVB_SLOT_VERIFY_RESULT_ERROR_IO;
-      goto out;
+      continue;
+    }
+
+    p = &prefetch->partitions[prefetch->num_partitions];
+    if ((hash_desc.flags & AVB_HASH_DESCRIPTOR_FLAGS_DO_NOT_USE_AB) != 0) {
+      if (hash_desc.partition_name_len >= AVB_PART_NAME_MAX_SIZE) {
+        continue;
+      }
+      avb_memcpy(
+          p->part_name, desc_partition_name, hash_desc.partition_name_len);
+      p->part_name[hash_desc.partition_name_len] = '\0';
+    } else if (!avb_str_concat(p->part_name,
+                               sizeof p->part_name,
+                               (const char*)desc_partition_name,
+                               hash_desc.partition_name_len,
+                               ab_suffix,
+                               avb_strlen(ab_suffix))) {
+      continue;
+    }
+
+    if (find_prefetched_partition(prefetch,
+                                  p->part_name,
+                                  hash_desc.image_size,
+                                  sha256,
+                                  desc_salt,
+                                  hash_desc.salt_len) != NULL) {
+      continue;
+    }
+
+    p->image_size = hash_desc.image_size;
+    p->salt_len = hash_desc.salt_len;
+    avb_memcpy(p->salt, desc_salt, hash_desc.salt_len);
+    p->hash_ctx.sha256 = sha256;
+    if (sha256) {
+      avb_sha256_init(&p->hash_ctx.u.sha256_ctx);
+      avb_sha256_update(&p->hash_ctx.u.sha256_ctx, p->salt, p->salt_len);
+    } else {
+      avb_sha512_init(&p->hash_ctx.u.sha512_ctx);
+      avb_sha512_update(&p->hash_ctx.u.sha512_ctx, p->salt, p->salt_len);
+    }
+    p->hash_ctx.remaining = p->image_size;
+
+    ret = load_full_partition(ops,
+                              p->part_name,
+                              p->image_size,
+                              &p->image_buf,
+                              &p->image_preloaded,
+                              NULL,
+                              NULL);
+    if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+      if (p->image_buf != NULL && !p->image_preloaded) {
+        avb_free(p->image_buf);
+      }
+      avb_memset(p, 0, sizeof(*p));
+      continue;
+    }
+
+    /* Only one run at a time: the previous partition must be hashed. */
+    prefetch_wait(ops, prefetch);
+    prefetch->num_partitions++;
+    if (ops->run_parallel_start(ops, 1, hash_prefetched_partition, p) ==
+        AVB_IO_RESULT_OK) {
+      prefetch->running = true;
+    } else {
+      hash_prefetched_partition(p, 0);
     }
   }
-  avb_assert(vbmeta_num_read <= vbmeta_size);
+}
+
+/* Loads the vbmeta images chained from the main vbmeta image
+ * |descriptors| and the requested partitions of the main and chained
+ * hash descriptors, for AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS. The
+ * chained vbmeta images are verified here but nothing is trusted yet:
+ * load_and_verify_vbmeta() and load_and_verify_hash_partition() still
+ * do all the checks, in the usual order, on the prefetched buffers.
+ */
+static void prefetch_partitions(AvbOps* ops,
+                                const char* const* requested_partitions,
+                                const char* ab_suffix,
+                                const AvbDescriptor** descriptors,
+                                size_t num_descriptors,
+                                AvbPrefetch* prefetch) {
+  size_t n, m;
+
+  for (n = 0; n < num_descriptors; n++) {
+    AvbDescriptor desc;
+    AvbChainPartitionDescriptor chain_desc;
+    const char* chain_partition_name;
+    PrefetchedVBMeta* v;
+    AvbIOResult io_ret;
+    bool is_vbmeta_partition;
 
-  /* Check if the image is properly signed and get the public key used
-   * to sign the image.
+    if (prefetch->num_vbmeta_images == MAX_NUMBER_OF_VBMETA_IMAGES) {
+      break;
+    }
+
+    if (!avb_descriptor_validate_and_byteswap(descriptors[n], &desc) ||
+        desc.tag != AVB_DESCRIPTOR_TAG_CHAIN_PARTITION ||
+        !avb_chain_partition_descriptor_validate_and_byteswap(
+            (AvbChainPartitionDescriptor*)descriptors[n], &chain_desc)) {
+      continue;
+    }
+
+    chain_partition_name = (const char*)descriptors[n] +
+                           sizeof(AvbChainPartitionDescriptor);
+    is_vbmeta_partition =
+        chain_desc.partition_name_len == avb_strlen("vbmeta") &&
+        avb_memcmp(chain_partition_name, "vbmeta", avb_strlen("vbmeta")) == 0;
+
+    v = &prefetch->vbmeta_images[prefetch->num_vbmeta_images];
+    if (!avb_str_concat(v->part_name,
+                        sizeof v->part_name,
+                        chain_partition_name,
+                        chain_desc.partition_name_len,
+                        ab_suffix,
+                        avb_strlen(ab_suffix))) {
+      continue;
+    }
+
+    for (m = 0; m < prefetch->num_vbmeta_images; m++) {
+      if (avb_strcmp(prefetch->vbmeta_images[m].part_name, v->part_name) ==
+          0) {
+        break;
+      }
+    }
+    if (m != prefetch->num_vbmeta_images) {
+      continue;
+    }
+
+    if (read_vbmeta_image(ops,
+                          v->part_name,
+                          is_vbmeta_partition,
+                          &v->vbmeta_buf,
+                          &v->vbmeta_num_read,
+                          &io_ret) != AVB_SLOT_VERIFY_RESULT_OK) {
+      avb_memset(v, 0, sizeof(*v));
+      continue;
+    }
+
+    v->verify_result = avb_vbmeta_image_verify(
+        v->vbmeta_buf, v->vbmeta_num_read, &v->pk_data, &v->pk_len);
+    prefetch->num_vbmeta_images++;
+  }
+
+  prefetch_hash_partitions(ops,
+                           requested_partitions,
+                           ab_suffix,
+                           descriptors,
+                           num_descriptors,
+                           prefetch);
+
+  for (n = 0; n < prefetch->num_vbmeta_images; n++) {
+    PrefetchedVBMeta* v = &prefetch->vbmeta_images[n];
+    const AvbDescriptor** chain_descriptors;
+    size_t num_chain_descriptors;
+
+    if (v->verify_result != AVB_VBMETA_VERIFY_RESULT_OK) {
+      continue;
+    }
+
+    chain_descriptors = avb_descriptor_get_all(
+        v->vbmeta_buf, v->vbmeta_num_read, &num_chain_descriptors);
+    if (chain_descriptors == NULL) {
+      continue;
+    }
+    prefetch_hash_partitions(ops,
+                             requested_partitions,
+                             ab_suffix,
+                             chain_descriptors,
+                             num_chain_descriptors,
+                             prefetch);
+    avb_free(chain_descriptors);
+  }
+
+  prefetch_wait(ops, prefetch);
+}
+
+/* Hands the prefetched vbmeta image of |full_partition_name| over
+ * to the caller. Returns false if it has not been prefetched.
+ */
+static bool take_prefetched_vbmeta(AvbPrefetch* prefetch,
+                                   const char* full_partition_name,
+                                   uint8_t** out_vbmeta_buf,
+                                   size_t* out_vbmeta_num_read,
+                                   AvbVBMetaVerifyResult* out_verify_result,
+                                   const uint8_t** out_pk_data,
+                                   size_t* out_pk_len) {
+  PrefetchedVBMeta* v;
+  size_t n;
+
+  if (prefetch == NULL) {
+    return false;
+  }
+
+  for (n = 0; n < prefetch->num_vbmeta_images; n++) {
+    v = &prefetch->vbmeta_images[n];
+    if (v->vbmeta_buf != NULL &&
+        avb_strcmp(v->part_name, full_partition_name) == 0) {
+      *out_vbmeta_buf = v->vbmeta_buf;
+      *out_vbmeta_num_read = v->vbmeta_num_read;
+      *out_verify_result = v->verify_result;
+      *out_pk_data = v->pk_data;
+      *out_pk_len = v->pk_len;
+      v->vbmeta_buf = NULL;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void prefetch_free(AvbPrefetch* prefetch) {
+  size_t n;
+
+  for (n = 0; n < prefetch->num_vbmeta_images; n++) {
+    if (prefetch->vbmeta_images[n].vbmeta_buf != NULL) {
+      avb_free(prefetch->vbmeta_images[n].vbmeta_buf);
+    }
+  }
+  for (n = 0; n < prefetch->num_partitions; n++) {
+    PrefetchedPartition* p = &prefetch->partitions[n];
+    if (p->image_buf != NULL && !p->image_preloaded) {
+      avb_free(p->image_buf);
+    }
+  }
+  avb_free(prefetch);
+}
+
+static AvbSlotVerifyResult load_and_verify_vbmeta(
+    AvbOps* ops,
+    const char* const* requested_partitions,
+    const char* ab_suffix,
+    bool allow_verification_error,
+    AvbVBMetaImageFlags toplevel_vbmeta_flags,
+    int rollback_index_location,
+    const char* partition_name,
+    size_t partition_name_len,
+    const uint8_t* expected_public_key,
+    size_t expected_public_key_length,
+    AvbSlotVerifyData* slot_data,
+    AvbAlgorithmType* out_algorithm_type,
+    AvbCmdlineSubstList* out_additional_cmdline_subst,
+    AvbPrefetch* prefetch) {
+  char full_partition_name[AVB_PART_NAME_MAX_SIZE];
+  AvbSlotVerifyResult ret;
+  AvbIOResult io_ret;
+  uint8_t* vbmeta_buf = NULL;
+  size_t vbmeta_num_read;
+  AvbVBMetaVerifyResult vbmeta_ret;
+  const uint8_t* pk_data;
+  size_t pk_len;
+  AvbVBMetaImageHeader vbmeta_header;
+  uint64_t stored_rollback_index;
+  const AvbDescriptor** descriptors = NULL;
+  size_t num_descriptors;
+  size_t n;
+  bool is_main_vbmeta;
+  bool is_vbmeta_partition;
+  AvbVBMetaData* vbmeta_image_data = NULL;
+
+  ret = AVB_SLOT_VERIFY_RESULT_OK;
+
+  avb_assert(slot_data != NULL);
+
+  /* Since we allow top-level vbmeta in 'boot', use
+   * rollback_index_location to determine whether we're the main
+   * vbmeta struct.
    */
-  vbmeta_ret =
-      avb_vbmeta_image_verify(vbmeta_buf, vbmeta_num_read, &pk_data, &pk_len);
+  is_main_vbmeta = (rollback_index_location == 0);
+  is_vbmeta_partition = (avb_strcmp(partition_name, "vbmeta") == 0);
+
+  if (!avb_validate_utf8((const uint8_t*)partition_name, partition_name_len)) {
+    avb_error("Partition name is not valid UTF-8.\n");
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
+    goto out;
+  }
+
+  /* Construct full partition name e.g. system_a. */
+  if (!avb_str_concat(full_partition_name,
+                      sizeof full_partition_name,
+                      partition_name,
+                      partition_name_len,
+                      ab_suffix,
+                      avb_strlen(ab_suffix))) {
+    avb_error("Partition name and suffix does not fit.\n");
+    ret = AVB_SLOT_VERIFY_RESULT_ERROR_INVALID_METADATA;
+    goto out;
+  }
+
+  if (!is_main_vbmeta && take_prefetched_vbmeta(prefetch,
+                                                full_partition_name,
+                                                &vbmeta_buf,
+                                                &vbmeta_num_read,
+                                                &vbmeta_ret,
+                                                &pk_data,
+                                                &pk_len)) {
+    avb_debugv(full_partition_name, ": Using prefetched vbmeta.\n", NULL);
+  } else {
+    ret = read_vbmeta_image(ops,
+                            full_partition_name,
+                            is_vbmeta_partition,
+                            &vbmeta_buf,
+                            &vbmeta_num_read,
+                            &io_ret);
+    if (io_ret != AVB_IO_RESULT_OK) {
+      /* If we're looking for 'vbmeta' but there is no such partition,
+       * go try to get it from the boot partition instead.
+       */
+      if (is_main_vbmeta && io_ret == AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION &&
+          is_vbmeta_partition) {
+        avb_debugv(full_partition_name,
+                   ": No such partition. Trying 'boot' instead.\n",
+                   NULL);
+        ret = load_and_verify_vbmeta(ops,
+                                     requested_partitions,
+                                     ab_suffix,
+                                     allow_verification_error,
+                                     0 /* toplevel_vbmeta_flags */,
+                                     0 /* rollback_index_location */,
+                                     "boot",
+                                     avb_strlen("boot"),
+                                     NULL /* expected_public_key */,
+                                     0 /* expected_public_key_length */,
+                                     slot_data,
+                                     out_algorithm_type,
+                                     out_additional_cmdline_subst,
+                                     prefetch);
+        goto out;
+      } else {
+        avb_errorv(
+            full_partition_name, ": Error loading vbmeta data.\n", NULL);
+        ret = AVB_SLOT_VERIFY_RESULT_ERROR_IO;
+        goto out;
+      }
+    } else if (ret != AVB_SLOT_VERIFY_RESULT_OK) {
+      goto out;
+    }
+
+    /* Check if the image is properly signed and get the public key used
+     * to sign the image.
+     */
+    vbmeta_ret =
+        avb_vbmeta_image_verify(vbmeta_buf, vbmeta_num_read, &pk_data, &pk_len);
+  }
+
   switch (vbmeta_ret) {
     case AVB_VBMETA_VERIFY_RESULT_OK:
       avb_assert(pk_data != NULL && pk_len > 0);
@@ -905,6 +1397,14 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
    */
   descriptors =
       avb_descriptor_get_all(vbmeta_buf, vbmeta_num_read, &num_descriptors);
+  if (is_main_vbmeta && prefetch != NULL) {
+    prefetch_partitions(ops,
+                        requested_partitions,
+                        ab_suffix,
+                        descriptors,
+                        num_descriptors,
+                        prefetch);
+  }
   for (n = 0; n < num_descriptors; n++) {
     AvbDescriptor desc;
 
@@ -922,7 +1422,8 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
                                                  ab_suffix,
                                                  allow_verification_error,
                                                  descriptors[n],
-                                                 slot_data);
+                                                 slot_data,
+                                                 prefetch);
         if (sub_ret != AVB_SLOT_VERIFY_RESULT_OK) {
           ret = sub_ret;
           if (!allow_verification_error || !result_should_continue(ret)) {
@@ -981,7 +1482,8 @@ static AvbSlotVerifyResult load_and_verify_vbmeta(
                                    chain_desc.public_key_len,
                                    slot_data,
                                    NULL, /* out_algorithm_type */
-                                   NULL /* out_additional_cmdline_subst */);
+                                   NULL, /* out_additional_cmdline_subst */
+                                   prefetch);
         if (sub_ret != AVB_SLOT_VERIFY_RESULT_OK) {
           ret = sub_ret;
           if (!result_should_continue(ret)) {
@@ -1327,6 +1829,7 @@ AvbSlotVerifyResult avb_slot_verify(AvbOps* ops,
   bool allow_verification_error =
       (flags & AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR);
   AvbCmdlineSubstList* additional_cmdline_subst = NULL;
+  AvbPrefetch* prefetch = NULL;
 
   /* Fail early if we're missing the AvbOps needed for slot verification. */
   avb_assert(ops->read_is_device_unlocked != NULL);
@@ -1389,6 +1892,13 @@ AvbSlotVerifyResult avb_slot_verify(AvbOps* ops,
     goto fail;
   }
 
+  if ((flags & AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS) &&
+      !allow_verification_error && ops->run_parallel_start != NULL &&
+      ops->run_parallel_wait != NULL) {
+    /* Not fatal, the verification is just serial without it. */
+    prefetch = avb_calloc(sizeof(AvbPrefetch));
+  }
+
   ret = load_and_verify_vbmeta(ops,
                                requested_partitions,
                                ab_suffix,
@@ -1401,7 +1911,11 @@ AvbSlotVerifyResult avb_slot_verify(AvbOps* ops,
                                0 /* expected_public_key_length */,
                                slot_data,
                                &algorithm_type,
-                               additional_cmdline_subst);
+                               additional_cmdline_subst,
+                               prefetch);
+  if (prefetch != NULL) {
+    prefetch_free(prefetch);
+  }
   if (!allow_verification_error && ret != AVB_SLOT_VERIFY_RESULT_OK) {
     goto fail;
   }
@@ -117,11 +117,21 @@ typedef enum {
  * should be set if using AVB_HASHTREE_ERROR_MODE_MANAGED_RESTART_AND_EIO
  * and the reason the boot loader is running is because the device
  * was restarted by the dm-verity driver.
+ *
+ * If AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS is set, the chained vbmeta
+ * images and the requested partitions of all the hash descriptors are
+ * loaded before the verification. Each partition is hashed by the
+ * |run_parallel_start| operation while the next one is read. The
+ * verification itself, and so the resulting |AvbSlotVerifyData|, is
+ * unchanged. This flag is ignored if the |run_parallel_start| and
+ * |run_parallel_wait| operations are not implemented or if
+ * AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR is set.
  */
 typedef enum {
   AVB_SLOT_VERIFY_FLAGS_NONE = 0,
   AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR = (1 << 0),
-  AVB_SLOT_VERIFY_FLAGS_RESTART_CAUSED_BY_HASHTREE_CORRUPTION = (1 << 1)
+  AVB_SLOT_VERIFY_FLAGS_RESTART_CAUSED_BY_HASHTREE_CORRUPTION = (1 << 1),
+  AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS = (1 << 2)
 } AvbSlotVerifyFlags;
 
 /* Get a textual representation of |result|. */
@@ -28,6 +28,12 @@
 #include "uefi_avb_util.h"
 #include "vars.h"
 #include "gpt.h"
+#include "async_io.h"
+#include "mp_pool.h"
+#include "prefetch.h"
+#include "blkcache.h"
+#include "misc.h"
+#include "boottrace.h"
 #include "lib.h"
 #include "log.h"
 #ifdef RPMB_STORAGE
@@ -39,37 +45,90 @@ extern char _binary_avb_pk_end;
 #define avb_pk (&_binary_avb_pk_start)
 #define avb_pk_size (&_binary_avb_pk_end - &_binary_avb_pk_start)
 
-static AvbIOResult read_from_partition(__attribute__((unused)) AvbOps* ops,
+/* Resolves |partition_name| through the per-AvbOps partition cache.
+ * AVB issues many small reads on the same few partitions, the label
+ * conversion and GPT lookup are only done on a cache miss.
+ */
+static AvbIOResult get_partition(AvbOps* ops,
+                                 const char* partition_name,
+                                 UEFIAvbPartition** out_part) {
+  UEFIAvbOpsData* data = ops->user_data;
+  UEFIAvbPartition* part;
+  struct gpt_partition_interface gpart;
+  CHAR16 label[GPT_NAME_LEN + 1];
+  EFI_STATUS efi_ret;
+  size_t i;
+
+  if (data->gpt_generation != gpt_cache_generation()) {
+    data->num_partitions = 0;
+    data->next_partition = 0;
+    data->gpt_generation = gpt_cache_generation();
+  }
+
+  for (i = 0; i < data->num_partitions; i++) {
+    if (!strcmp((CHAR8*)data->partitions[i].name, (CHAR8*)partition_name)) {
+      *out_part = &data->partitions[i];
+      return AVB_IO_RESULT_OK;
+    }
+  }
+
+  for (i = 0; partition_name[i]; i++) {
+    if (i == GPT_NAME_LEN) {
+      error(L"Partition %a not found", partition_name);
+      return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+    }
+    label[i] = partition_name[i];
+  }
+  label[i] = 0;
+
+  efi_ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
+  if (EFI_ERROR(efi_ret)) {
+    error(L"Partition %s not found", label);
+    return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
+  }
+
+  /* The lookup may have reloaded the partition table. */
+  if (data->gpt_generation != gpt_cache_generation()) {
+    data->num_partitions = 0;
+    data->next_partition = 0;
+    data->gpt_generation = gpt_cache_generation();
+  }
+
+  part = &data->partitions[data->next_partition];
+  part->gpart = gpart;
+  memcpy(part->name, partition_name, i + 1);
+  part->offset = part->gpart.part.starting_lba * part->gpart.bio->Media->BlockSize;
+  part->size = (part->gpart.part.ending_lba - part->gpart.part.starting_lba + 1) *
+               part->gpart.bio->Media->BlockSize;
+
+  if (data->num_partitions < UEFI_AVB_PARTITION_CACHE_SIZE)
+    data->num_partitions++;
+  data->next_partition = (data->next_partition + 1) % UEFI_AVB_PARTITION_CACHE_SIZE;
+
+  *out_part = part;
+  return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult read_from_partition(AvbOps* ops,
                                        const char* partition_name,
                                        int64_t offset_from_partition,
                                        size_t num_bytes,
                                        void* buf,
                                        size_t* out_num_read) {
   EFI_STATUS efi_ret;
-  struct gpt_partition_interface gpart;
+  UEFIAvbPartition* part;
   int64_t partition_size;
-  const CHAR16 *label;
+  AvbIOResult io_ret;
 
   avb_assert(partition_name != NULL);
   avb_assert(buf != NULL);
   avb_assert(out_num_read != NULL);
 
-  label = stra_to_str((const CHAR8 *)partition_name);
+  io_ret = get_partition(ops, partition_name, &part);
+  if (io_ret != AVB_IO_RESULT_OK)
+    return io_ret;
 
-  if (!label) {
-    error(L"out of memory");
-    return AVB_IO_RESULT_ERROR_OOM;
-  }
-
-  efi_ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
-  if (EFI_ERROR(efi_ret)) {
-    error(L"Partition %s not found", label);
-    return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
-  }
-
-  partition_size =
-      (gpart.part.ending_lba - gpart.part.starting_lba + 1) *
-      gpart.bio->Media->BlockSize;
+  partition_size = part->size;
 
   if (offset_from_partition < 0) {
     if ((-offset_from_partition) > partition_size) {
@@ -87,15 +146,22 @@ static AvbIOResult read_from_partition(__attribute__((unused)) AvbOps* ops,
   else
     *out_num_read = num_bytes;
 
-  efi_ret = uefi_call_wrapper(
-      gpart.dio->ReadDisk,
-      5,
-      gpart.dio,
-      gpart.bio->Media->MediaId,
-      (gpart.part.starting_lba * gpart.bio->Media->BlockSize) +
-          offset_from_partition,
-      *out_num_read,
-      buf);
+  boottrace_begin(BT_AVB_READ, *out_num_read);
+  /* The A/B metadata is read from the in-memory copy of misc. */
+  efi_ret = EFI_NOT_FOUND;
+  if (!strcmp((CHAR8*)partition_name, (CHAR8*)"misc"))
+    efi_ret = misc_read(offset_from_partition, *out_num_read, buf);
+  if (efi_ret == EFI_NOT_FOUND)
+    efi_ret = prefetch_read(&part->gpart,
+                            part->offset + offset_from_partition,
+                            *out_num_read,
+                            buf);
+  if (efi_ret == EFI_NOT_FOUND)
+    efi_ret = blkcache_read(&part->gpart,
+                            part->offset + offset_from_partition,
+                            *out_num_read,
+                            buf);
+  boottrace_end(BT_AVB_READ, *out_num_read);
   if (EFI_ERROR(efi_ret)) {
     avb_error("Could not read from Disk.\n");
     *out_num_read = 0;
@@ -105,34 +171,173 @@ static AvbIOResult read_from_partition(__attribute__((unused)) AvbOps* ops,
   return AVB_IO_RESULT_OK;
 }
 
-static AvbIOResult write_to_partition(__attribute__((unused)) AvbOps* ops,
+/* Segment size of the streamed partition reads. */
+#define STREAM_SEGMENT_SIZE (2 * 1024 * 1024)
+
+static AvbIOResult read_from_partition_streamed(AvbOps* ops,
+                                                const char* partition_name,
+                                                int64_t offset_from_partition,
+                                                size_t num_bytes,
+                                                void* buf,
+                                                size_t* out_num_read,
+                                                AvbSegmentCallback segment_cb,
+                                                void* user_data) {
+  EFI_STATUS efi_ret;
+  UEFIAvbPartition* part;
+  struct async_io* aio;
+  UINTN ids[ASYNC_IO_MAX_REQUESTS];
+  int64_t partition_size;
+  size_t len, nb_seg, submitted, done, seg_off, seg_len;
+  AvbIOResult io_ret;
+
+  avb_assert(partition_name != NULL);
+  avb_assert(buf != NULL);
+  avb_assert(out_num_read != NULL);
+  avb_assert(segment_cb != NULL);
+
+  io_ret = get_partition(ops, partition_name, &part);
+  if (io_ret != AVB_IO_RESULT_OK)
+    return io_ret;
+
+  partition_size = part->size;
+
+  if (offset_from_partition < 0) {
+    if ((-offset_from_partition) > partition_size) {
+      avb_error("Offset outside range.\n");
+      return AVB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
+    }
+    offset_from_partition = partition_size - (-offset_from_partition);
+  }
+
+  if (num_bytes > (size_t)(partition_size - offset_from_partition))
+    len = partition_size - offset_from_partition;
+  else
+    len = num_bytes;
+
+  /* Prefetched data only needs to be hashed. */
+  boottrace_begin(BT_AVB_READ, len);
+  efi_ret = prefetch_read(&part->gpart, part->offset + offset_from_partition,
+                          len, buf);
+  boottrace_end(BT_AVB_READ, len);
+  if (efi_ret == EFI_SUCCESS) {
+    for (seg_off = 0; seg_off < len; seg_off += seg_len) {
+      seg_len = min(len - seg_off, (size_t)STREAM_SEGMENT_SIZE);
+      boottrace_begin(BT_AVB_HASH, seg_len);
+      segment_cb(user_data, (uint8_t*)buf + seg_off, seg_len);
+      boottrace_end(BT_AVB_HASH, seg_len);
+    }
+    *out_num_read = len;
+    return AVB_IO_RESULT_OK;
+  }
+
+  efi_ret = async_io_open(&part->gpart, &aio);
+  if (EFI_ERROR(efi_ret)) {
+    *out_num_read = 0;
+    return efi_ret == EFI_OUT_OF_RESOURCES ? AVB_IO_RESULT_ERROR_OOM :
+                                             AVB_IO_RESULT_ERROR_IO;
+  }
+
+  /* Keep up to ASYNC_IO_MAX_REQUESTS segments in flight and hand each
+   * segment over in order as soon as it has been read.
+   */
+  nb_seg = (len + STREAM_SEGMENT_SIZE - 1) / STREAM_SEGMENT_SIZE;
+  for (submitted = 0, done = 0; done < nb_seg; done++) {
+    for (; submitted < nb_seg && submitted - done < ASYNC_IO_MAX_REQUESTS;
+         submitted++) {
+      seg_off = submitted * STREAM_SEGMENT_SIZE;
+      efi_ret = async_io_read(aio,
+                              part->offset + offset_from_partition + seg_off,
+                              min(len - seg_off, (size_t)STREAM_SEGMENT_SIZE),
+                              (uint8_t*)buf + seg_off,
+                              &ids[submitted % ASYNC_IO_MAX_REQUESTS]);
+      if (EFI_ERROR(efi_ret))
+        goto error;
+    }
+
+    /* Only the time spent waiting for the storage is traced as a
+     * read: the next segments are read while this one is hashed.
+     */
+    seg_off = done * STREAM_SEGMENT_SIZE;
+    seg_len = min(len - seg_off, (size_t)STREAM_SEGMENT_SIZE);
+    boottrace_begin(BT_AVB_READ, seg_len);
+    efi_ret = async_io_wait(aio, ids[done % ASYNC_IO_MAX_REQUESTS]);
+    boottrace_end(BT_AVB_READ, seg_len);
+    if (EFI_ERROR(efi_ret))
+      goto error;
+
+    boottrace_begin(BT_AVB_HASH, seg_len);
+    segment_cb(user_data, (uint8_t*)buf + seg_off, seg_len);
+    boottrace_end(BT_AVB_HASH, seg_len);
+  }
+
+  async_io_close(aio);
+  *out_num_read = len;
+  return AVB_IO_RESULT_OK;
+
+error:
+  async_io_close(aio);
+  avb_error("Could not read from Disk.\n");
+  *out_num_read = 0;
+  return AVB_IO_RESULT_ERROR_IO;
+}
+
+/* Only one run at a time, see mp_pool_start(). */
+static struct {
+  AvbParallelWork work;
+  void* user_data;
+} parallel_run;
+
+static void parallel_run_range(UINTN start, UINTN end, VOID* ctx) {
+  for (; start < end; start++)
+    parallel_run.work(parallel_run.user_data, start);
+}
+
+static AvbIOResult run_parallel_start(__attribute__((unused)) AvbOps* ops,
+                                      size_t count,
+                                      AvbParallelWork work,
+                                      void* user_data) {
+  EFI_STATUS efi_ret;
+
+  parallel_run.work = work;
+  parallel_run.user_data = user_data;
+
+  efi_ret = mp_pool_start(count, 1, parallel_run_range, NULL);
+  if (EFI_ERROR(efi_ret)) {
+    efi_perror(efi_ret, L"Failed to start the parallel run");
+    return AVB_IO_RESULT_ERROR_IO;
+  }
+
+  return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult run_parallel_wait(__attribute__((unused)) AvbOps* ops) {
+  EFI_STATUS efi_ret;
+
+  efi_ret = mp_pool_wait();
+  if (EFI_ERROR(efi_ret))
+    return AVB_IO_RESULT_ERROR_IO;
+
+  return AVB_IO_RESULT_OK;
+}
+
+static AvbIOResult write_to_partition(AvbOps* ops,
                                       const char* partition_name,
                                       int64_t offset_from_partition,
                                       size_t num_bytes,
                                       const void* buf) {
   EFI_STATUS efi_ret;
-  struct gpt_partition_interface gpart;
+  UEFIAvbPartition* part;
   uint64_t partition_size;
-  const CHAR16 * label;
+  AvbIOResult io_ret;
 
   avb_assert(partition_name != NULL);
   avb_assert(buf != NULL);
 
-  label = stra_to_str((const CHAR8 *)partition_name);
-  if (!label) {
-    error(L"out of memory");
-    return AVB_IO_RESULT_ERROR_OOM;
-  }
+  io_ret = get_partition(ops, partition_name, &part);
+  if (io_ret != AVB_IO_RESULT_OK)
+    return io_ret;
 
-  efi_ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
-  if (EFI_ERROR(efi_ret)) {
-    error(L"Partition %s not found", label);
-    return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
-  }
-
-  partition_size =
-      (gpart.part.ending_lba - gpart.part.starting_lba + 1) *
-      gpart.bio->Media->BlockSize;
+  partition_size = part->size;
 
   if (offset_from_partition < 0) {
     if ((-offset_from_partition) > (int)partition_size) {
@@ -150,13 +355,29 @@ static AvbIOResult write_to_partition(__attribute__((unused)) AvbOps* ops,
     return AVB_IO_RESULT_ERROR_RANGE_OUTSIDE_PARTITION;
   }
 
+  /* The A/B metadata updates must reach the disk right away. */
+  if (!strcmp((CHAR8*)partition_name, (CHAR8*)"misc")) {
+    efi_ret = misc_write(offset_from_partition, num_bytes, buf);
+    if (efi_ret == EFI_SUCCESS)
+      efi_ret = misc_commit();
+    if (efi_ret != EFI_NOT_FOUND) {
+      if (EFI_ERROR(efi_ret)) {
+        avb_error("Could not write to Disk.\n");
+        return AVB_IO_RESULT_ERROR_IO;
+      }
+      return AVB_IO_RESULT_OK;
+    }
+  }
+
+  blkcache_invalidate(part->gpart.bio,
+                      part->offset + offset_from_partition,
+                      num_bytes);
   efi_ret = uefi_call_wrapper(
-      gpart.dio->WriteDisk,
+      part->gpart.dio->WriteDisk,
       5,
-      gpart.dio,
-      gpart.bio->Media->MediaId,
-      (gpart.part.starting_lba * gpart.bio->Media->BlockSize) +
-          offset_from_partition,
+      part->gpart.dio,
+      part->gpart.bio->Media->MediaId,
+      part->offset + offset_from_partition,
       num_bytes,
       (void *)buf);
 
@@ -168,34 +389,20 @@ static AvbIOResult write_to_partition(__attribute__((unused)) AvbOps* ops,
   return AVB_IO_RESULT_OK;
 }
 
-static AvbIOResult get_size_of_partition(__attribute__((unused)) AvbOps* ops,
+static AvbIOResult get_size_of_partition(AvbOps* ops,
                                          const char* partition_name,
                                          uint64_t* out_size) {
-  EFI_STATUS efi_ret;
-  struct gpt_partition_interface gpart;
-  uint64_t partition_size;
-  const CHAR16 * label;
+  UEFIAvbPartition* part;
+  AvbIOResult io_ret;
 
   avb_assert(partition_name != NULL);
 
-  label = stra_to_str((const CHAR8 *)partition_name);
-  if (!label) {
-    error(L"out of memory");
-    return AVB_IO_RESULT_ERROR_OOM;
-  }
-
-  efi_ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
-  if (EFI_ERROR(efi_ret)) {
-    error(L"Partition %s not found", label);
-    return AVB_IO_RESULT_ERROR_NO_SUCH_PARTITION;
-  }
-
-  partition_size =
-      (gpart.part.ending_lba - gpart.part.starting_lba + 1) *
-      gpart.bio->Media->BlockSize;
+  io_ret = get_partition(ops, partition_name, &part);
+  if (io_ret != AVB_IO_RESULT_OK)
+    return io_ret;
 
   if (out_size != NULL) {
-    *out_size = partition_size;
+    *out_size = part->size;
   }
 
   return AVB_IO_RESULT_OK;
@@ -296,38 +503,27 @@ static void set_hex(char* buf, uint8_t value) {
   buf[1] = hex_digits[value & 0x0f];
 }
 
-static AvbIOResult get_unique_guid_for_partition(__attribute__((unused)) AvbOps* ops,
+static AvbIOResult get_unique_guid_for_partition(AvbOps* ops,
                                                  const char* partition,
                                                  char* guid_buf,
                                                  size_t guid_buf_size) {
-  EFI_STATUS efi_ret;
-  struct gpt_partition_interface gpart;
+  UEFIAvbPartition* part;
   uint8_t * unique_guid;
-  const CHAR16 * label;
-
-
+  AvbIOResult io_ret;
 
   avb_assert(partition != NULL);
   avb_assert(guid_buf != NULL);
 
-  label = stra_to_str((const CHAR8 *)partition);
-  if (!label) {
-    error(L"out of memory");
-    return AVB_IO_RESULT_ERROR_OOM;
-  }
-
-  efi_ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
-  if (EFI_ERROR(efi_ret)) {
-    error(L"Partition %s not found", label);
+  io_ret = get_partition(ops, partition, &part);
+  if (io_ret != AVB_IO_RESULT_OK)
     return AVB_IO_RESULT_ERROR_IO;
-  }
 
   if (guid_buf_size < 37) {
     avb_error("GUID buffer size too small.\n");
     return AVB_IO_RESULT_ERROR_IO;
   }
 
-  unique_guid =(uint8_t *)&(gpart.part.unique);
+  unique_guid =(uint8_t *)&(part->gpart.part.unique);
   /* The GUID encoding is somewhat peculiar in terms of byte order. It
    * is what it is.
    */
@@ -368,12 +564,19 @@ AvbOps* uefi_avb_ops_new(void) {
       return NULL;
   }
 
-  data = avb_calloc(sizeof(UEFIAvbOpsData));
+  /* The ops are cached by their users: keep them out of the arena */
+  data = AllocateZeroPool(sizeof(UEFIAvbOpsData));
+  if (!data) {
+      avb_error("Failed to allocate the AvbOps data.\n");
+      return NULL;
+  }
   data->ops.user_data = data;
   data->ops.ab_ops = NULL;
   data->block_io = gparti.bio;
   data->disk_io  = gparti.dio;
+  data->gpt_generation = gpt_cache_generation();
   data->ops.read_from_partition = read_from_partition;
+  data->ops.read_from_partition_streamed = read_from_partition_streamed;
   data->ops.write_to_partition = write_to_partition;
   data->ops.get_size_of_partition = get_size_of_partition;
   data->ops.validate_vbmeta_public_key = validate_vbmeta_public_key;
@@ -381,6 +584,8 @@ AvbOps* uefi_avb_ops_new(void) {
   data->ops.write_rollback_index = write_rollback_index;
   data->ops.read_is_device_unlocked = read_is_device_unlocked;
   data->ops.get_unique_guid_for_partition = get_unique_guid_for_partition;
+  data->ops.run_parallel_start = run_parallel_start;
+  data->ops.run_parallel_wait = run_parallel_wait;
 
   return &data->ops;
 }
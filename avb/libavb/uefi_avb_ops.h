@@ -27,12 +27,30 @@
 
 #include <efi.h>
 #include "libavb/libavb.h"
+#include "gpt.h"
+
+/* Number of partitions resolved by the AVB callbacks kept in cache. */
+#define UEFI_AVB_PARTITION_CACHE_SIZE 8
+
+/* A partition resolved by name for the AvbOps callbacks. */
+typedef struct UEFIAvbPartition {
+  char name[GPT_NAME_LEN + 1];
+  struct gpt_partition_interface gpart;
+  uint64_t offset;
+  uint64_t size;
+} UEFIAvbPartition;
+
 /* The |user_data| member of AvbOps points to a struct of this type. */
 typedef struct UEFIAvbOpsData {
   AvbOps ops;
   //AVbops_AB ops_ab;
   EFI_BLOCK_IO* block_io;
   EFI_DISK_IO* disk_io;
+  /* Partition cache, valid for |gpt_generation|. */
+  UEFIAvbPartition partitions[UEFI_AVB_PARTITION_CACHE_SIZE];
+  size_t num_partitions;
+  size_t next_partition;
+  UINT32 gpt_generation;
 } UEFIAvbOpsData;
 
 /* Returns an AvbOps for use with UEFI. */
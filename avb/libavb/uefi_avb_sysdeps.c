@@ -31,6 +31,7 @@
 #include "uefi_avb_util.h"
 #include "lib.h"
 #include "log.h"
+#include "arena.h"
 
 int avb_memcmp(const void* src1, const void* src2, size_t n) {
   return (int)CompareMem((VOID*)src1, (VOID*)src2, (UINTN)n);
@@ -101,27 +102,15 @@ void avb_printv_ui(const char* message, ...) {
 }
 #endif
 
+/* The many small descriptor, digest and name buffers of
+ * avb_slot_verify() come from the boot flow arena when a scope is
+ * open. */
 void* avb_malloc_(size_t size) {
-  EFI_STATUS err;
-  void* x;
-
-  err = uefi_call_wrapper(
-      BS->AllocatePool, 3, EfiBootServicesData, (UINTN)size, &x);
-  if (EFI_ERROR(err)) {
-    return NULL;
-  }
-
-  return x;
+  return arena_pool_alloc((UINTN)size);
 }
 
 void avb_free(void* ptr) {
-  EFI_STATUS err;
-  err = uefi_call_wrapper(BS->FreePool, 1, ptr);
-
-  if (EFI_ERROR(err)) {
-    Print(L"Warning: Bad avb_free: %r\n", err);
-    uefi_call_wrapper(BS->Stall, 1, 3 * 1000 * 1000);
-  }
+  arena_pool_free(ptr);
 }
 
 size_t avb_strlen(const char* str) {
@@ -65,3 +65,15 @@ set(LIBEFIWRAPPER_DRIVERS
 	tco_wdt
 	mmc_serial
 	)
+
+# storage backends built in kernelflinger, among:
+# emmc ufs sdcard sata nvme virtual general_block
+set(KERNELFLINGER_STORAGE_BACKENDS
+	emmc
+	ufs
+	sdcard
+	sata
+	nvme
+	virtual
+	general_block
+	)
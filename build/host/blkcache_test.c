@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Host test of the block cache coherency with the prefetched regions:
+   the boot I/O profile replay prefetches disk regions which the block
+   cache fills are served from.  Once a write overlaps a region, reads
+   of the written range must return the new data, whether the region
+   read had completed before the write or was still in flight.  The
+   disk is a memory buffer and the async I/O layer is stubbed out: a
+   read gets the disk data at submission, the way a DMA transfer may
+   have before a write, and completes when it is waited for.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "blkcache.c"
+#include "prefetch.c"
+
+#define BLOCK_SIZE	512
+#define DISK_SIZE	(16 * 1024 * 1024)
+#define REGION_OFFSET	(1024 * 1024)
+#define REGION_SIZE	(2 * 1024 * 1024)
+
+static UINT8 disk[DISK_SIZE];
+
+static EFI_STATUS EFIAPI host_read_disk(EFI_DISK_IO *dio, UINT32 media_id,
+					UINT64 offset, UINTN size, VOID *buf)
+{
+	if (offset > DISK_SIZE || size > DISK_SIZE - offset)
+		return EFI_INVALID_PARAMETER;
+	memcpy(buf, disk + offset, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_BLOCK_IO_MEDIA media = {
+	.MediaId = 1,
+	.BlockSize = BLOCK_SIZE,
+	.LastBlock = DISK_SIZE / BLOCK_SIZE - 1
+};
+static EFI_BLOCK_IO bio = { .Media = &media };
+static EFI_DISK_IO dio = { .ReadDisk = (EFI_DISK_READ)host_read_disk };
+static struct gpt_partition_interface gparti = { .bio = &bio, .dio = &dio };
+
+/* Async I/O, one read per context as prefetch_disk() does */
+struct async_io {
+	BOOLEAN pending;
+};
+
+EFI_STATUS async_io_open(struct gpt_partition_interface *gpart,
+			 struct async_io **aio_p)
+{
+	*aio_p = calloc(1, sizeof(**aio_p));
+	return *aio_p ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+EFI_STATUS async_io_read(struct async_io *aio, UINT64 offset, UINTN size,
+			 VOID *buf, UINTN *id)
+{
+	aio->pending = TRUE;
+	*id = 0;
+	return host_read_disk(&dio, media.MediaId, offset, size, buf);
+}
+
+EFI_STATUS async_io_wait(struct async_io *aio, UINTN id)
+{
+	aio->pending = FALSE;
+	return EFI_SUCCESS;
+}
+
+void async_io_close(struct async_io *aio)
+{
+	free(aio);
+}
+
+EFI_STATUS gpt_get_partition_by_label(const CHAR16 *label,
+				      struct gpt_partition_interface *gpart,
+				      logical_unit_t log_unit)
+{
+	return EFI_NOT_FOUND;
+}
+
+void bootprof_record(EFI_BLOCK_IO *b, UINT64 offset, UINTN size) { }
+void misc_invalidate(EFI_BLOCK_IO *b, UINT64 offset, UINT64 size) { }
+
+static void disk_write(UINT64 offset, UINTN size, UINT8 pattern)
+{
+	memset(disk + offset, pattern, size);
+	blkcache_invalidate(&bio, offset, size);
+}
+
+static int check(const char *what, UINT64 offset, UINTN size, UINT8 pattern)
+{
+	static UINT8 buf[BLKCACHE_SEGMENT_SIZE];
+	EFI_STATUS ret;
+	UINTN i;
+
+	ret = blkcache_read(&gparti, offset, size, buf);
+	if (EFI_ERROR(ret)) {
+		fprintf(stderr, "%s: read failed\n", what);
+		return 1;
+	}
+	for (i = 0; i < size; i++)
+		if (buf[i] != pattern) {
+			fprintf(stderr, "%s: byte %llu is 0x%02x, 0x%02x expected\n",
+				what, (unsigned long long)(offset + i), buf[i],
+				pattern);
+			return 1;
+		}
+
+	return 0;
+}
+
+int main(void)
+{
+	UINT64 offset = REGION_OFFSET + REGION_SIZE / 2;
+	int failed = 0;
+
+	/* Region read completed before the write */
+	memset(disk, 0xAA, sizeof(disk));
+	if (EFI_ERROR(prefetch_disk(&gparti, REGION_OFFSET, REGION_SIZE)))
+		return 1;
+	failed |= check("prefetched", REGION_OFFSET, BLOCK_SIZE, 0xAA);
+	disk_write(offset, BLOCK_SIZE, 0x55);
+	failed |= check("written after the prefetch", offset, BLOCK_SIZE, 0x55);
+
+	/* Region read still in flight when the disk is written */
+	blkcache_invalidate(NULL, 0, 0);
+	if (EFI_ERROR(prefetch_disk(&gparti, REGION_OFFSET, REGION_SIZE)))
+		return 1;
+	disk_write(offset, BLOCK_SIZE, 0x66);
+	failed |= check("written during the prefetch", offset, BLOCK_SIZE, 0x66);
+
+	/* Cached segment, then the whole cache dropped */
+	failed |= check("cached", offset, BLOCK_SIZE, 0x66);
+	memset(disk + offset, 0x77, BLOCK_SIZE);
+	blkcache_invalidate(NULL, 0, 0);
+	failed |= check("written after a full invalidation", offset,
+			BLOCK_SIZE, 0x77);
+
+	prefetch_release();
+	if (!failed)
+		printf("Block cache and prefetch regions coherent\n");
+	return failed;
+}
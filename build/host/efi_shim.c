@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* The services of the firmware and of libkernelflinger used by the
+   host benchmark sources: the pool allocations are mapped on the C
+   library, the variable writes are counted and the flash functions
+   write to a file backed disk image.  String functions come from the
+   C library, lib.h only declares them.  */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <vars.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cpuid.h>
+
+#include "flash.h"
+#include "host_shim.h"
+
+const EFI_GUID fastboot_guid = { 0x1ac80a82, 0x4f0c, 0x456b,
+	{0x9a, 0x99, 0xde, 0xbe, 0xb4, 0x31, 0xfc, 0xc1} };
+const EFI_GUID loader_guid = { 0x4a67b082, 0x0a4c, 0x41cf,
+	{0xb6, 0xc7, 0x44, 0x0b, 0x29, 0xbb, 0x8c, 0x4f} };
+
+UINT8 log_levels[LOG_MODULE_COUNT] = {
+	[0 ... LOG_MODULE_COUNT - 1] = LOG_LEVEL_WARNING
+};
+
+UINT64 host_variable_writes;
+
+static EFI_STATUS EFIAPI host_set_variable(CHAR16 *name _unused,
+					   EFI_GUID *guid _unused,
+					   UINT32 attributes _unused,
+					   UINTN size _unused, VOID *data _unused)
+{
+	host_variable_writes++;
+	return EFI_SUCCESS;
+}
+
+static EFI_RUNTIME_SERVICES host_rt = {
+	.SetVariable = (EFI_SET_VARIABLE)host_set_variable
+};
+
+static EFI_BOOT_SERVICES host_bs;
+static EFI_SYSTEM_TABLE host_st = {
+	.BootServices = &host_bs,
+	.RuntimeServices = &host_rt
+};
+
+EFI_SYSTEM_TABLE *ST = &host_st;
+EFI_BOOT_SERVICES *BS = &host_bs;
+EFI_RUNTIME_SERVICES *RT = &host_rt;
+
+VOID *AllocatePool(UINTN size)
+{
+	return malloc(size ? size : 1);
+}
+
+VOID *AllocateZeroPool(UINTN size)
+{
+	return calloc(1, size ? size : 1);
+}
+
+VOID FreePool(VOID *p)
+{
+	free(p);
+}
+
+INTN StrCmp(CONST CHAR16 *s1, CONST CHAR16 *s2)
+{
+	for (; *s1 && *s1 == *s2; s1++, s2++)
+		;
+	return *s1 - *s2;
+}
+
+VOID cpuid(UINT32 op, UINT32 reg[4])
+{
+	__cpuid_count(op, 0, reg[0], reg[1], reg[2], reg[3]);
+}
+
+VOID cpuid_count(UINT32 op, UINT32 count, UINT32 reg[4])
+{
+	__cpuid_count(op, count, reg[0], reg[1], reg[2], reg[3]);
+}
+
+const void *mem_find(const void *s, int c, UINTN n)
+{
+	const UINT8 *p = s;
+
+	for (; n; n--, p++)
+		if (*p == (UINT8)c)
+			return p;
+	return NULL;
+}
+
+CHAR16 *stran_to_str(const CHAR8 *stra, UINTN len)
+{
+	CHAR16 *str;
+	UINTN i;
+
+	str = AllocatePool((len + 1) * sizeof(CHAR16));
+	if (!str)
+		return NULL;
+	for (i = 0; i < len; i++)
+		str[i] = stra[i];
+	str[i] = 0;
+	return str;
+}
+
+EFI_STATUS stra_to_guid(const char *str, EFI_GUID *g)
+{
+	unsigned int d[11];
+	int n = 0;
+	UINTN i;
+
+	if (!str || !g)
+		return EFI_INVALID_PARAMETER;
+
+	if (sscanf(str, "%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x%n",
+		   &d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6], &d[7],
+		   &d[8], &d[9], &d[10], &n) != 11 || n != 36)
+		return EFI_INVALID_PARAMETER;
+
+	g->Data1 = d[0];
+	g->Data2 = d[1];
+	g->Data3 = d[2];
+	for (i = 0; i < 8; i++)
+		g->Data4[i] = d[i + 3];
+	return EFI_SUCCESS;
+}
+
+/* The variable store starts empty: every oemvars definition is
+   written */
+EFI_STATUS get_efi_variable(const EFI_GUID *guid _unused, CHAR16 *key _unused,
+			    UINTN *size_p _unused, VOID **data_p _unused,
+			    UINT32 *flags_p _unused)
+{
+	return EFI_NOT_FOUND;
+}
+
+void efi_variable_cache_invalidate(const EFI_GUID *guid _unused,
+				   CHAR16 *key _unused)
+{
+}
+
+/* Enough of the UEFI Print() format for the log messages: %a, %s,
+   %c, %d, %u, %x, %X and %r with the l modifier and a width.  */
+static void host_vprint(const CHAR16 *fmt, va_list args)
+{
+	char spec[16];
+	UINTN n;
+	BOOLEAN is_long;
+	const CHAR16 *s;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			fputc(*fmt, stderr);
+			continue;
+		}
+
+		spec[0] = '%';
+		for (n = 1, fmt++; n < sizeof(spec) - 3 &&
+			     ((*fmt >= '0' && *fmt <= '9') || *fmt == '-'); fmt++)
+			spec[n++] = *fmt;
+		is_long = *fmt == 'l';
+		if (is_long)
+			fmt++;
+
+		switch (*fmt) {
+		case 'a':
+			spec[n++] = 's';
+			spec[n] = '\0';
+			fprintf(stderr, spec, va_arg(args, char *));
+			break;
+		case 's':
+			for (s = va_arg(args, CHAR16 *); s && *s; s++)
+				fputc(*s, stderr);
+			break;
+		case 'c':
+			fputc(va_arg(args, int), stderr);
+			break;
+		case 'r':
+			fprintf(stderr, "status 0x%lx",
+				(unsigned long)va_arg(args, EFI_STATUS));
+			break;
+		case 'd':
+		case 'u':
+		case 'x':
+		case 'X':
+			spec[n++] = 'l';
+			spec[n++] = *fmt == 'd' ? 'd' : *fmt;
+			spec[n] = '\0';
+			if (*fmt == 'd')
+				fprintf(stderr, spec, is_long ? va_arg(args, INT64) :
+					(INT64)va_arg(args, INTN));
+			else
+				fprintf(stderr, spec, is_long ? va_arg(args, UINT64) :
+					(UINT64)va_arg(args, UINTN));
+			break;
+		case '%':
+			fputc('%', stderr);
+			break;
+		case '\0':
+			return;
+		default:
+			fputc('?', stderr);
+			break;
+		}
+	}
+}
+
+void vlog_at(UINT8 level, const CHAR16 *fmt, va_list args)
+{
+	if (level >= LOG_LEVEL_WARNING)
+		host_vprint(fmt, args);
+}
+
+void log_at(UINT8 level, const CHAR16 *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vlog_at(level, fmt, args);
+	va_end(args);
+}
+
+void log(const CHAR16 *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vlog_at(LOG_LEVEL_INFO, fmt, args);
+	va_end(args);
+}
+
+EFI_STATUS log_flush_to_var(BOOLEAN nonvol _unused)
+{
+	return EFI_SUCCESS;
+}
+
+/* File backed disk image, the data is discarded if there is none */
+static FILE *disk;
+static UINT64 disk_offset;
+
+EFI_STATUS host_disk_open(const char *path)
+{
+	disk = fopen(path, "w");
+	disk_offset = 0;
+	return disk ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+void host_disk_rewind(void)
+{
+	disk_offset = 0;
+}
+
+void host_disk_close(void)
+{
+	if (disk)
+		fclose(disk);
+	disk = NULL;
+}
+
+EFI_STATUS flash_skip(UINT64 size)
+{
+	disk_offset += size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_write(VOID *data, UINTN size)
+{
+	if (disk && (fseeko(disk, disk_offset, SEEK_SET) ||
+		     fwrite(data, 1, size, disk) != size))
+		return EFI_DEVICE_ERROR;
+
+	disk_offset += size;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
+{
+	static UINT32 buf[16 * 1024];
+	EFI_STATUS ret;
+	UINTN i, len;
+
+	for (i = 0; i < ARRAY_SIZE(buf); i++)
+		buf[i] = pattern;
+
+	for (; size; size -= len) {
+		len = min(size, sizeof(buf));
+		ret = flash_write(buf, len);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
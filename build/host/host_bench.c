@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Host benchmark of the parsing and crypto kernels:
+
+     kf_host_bench <kernel> <file> [iterations] [disk image]
+
+   FILE is loaded once then handed to the kernel ITERATIONS times.
+   The sparse kernel writes the expanded image to DISK IMAGE if any.
+   Run it under perf record, valgrind or a sanitizer build.  */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "crc32.h"
+#include "oemvars.h"
+#include "text_parser.h"
+#include "upng.h"
+#include "sparse.h"
+#include "libavb/libavb.h"
+#include "host_shim.h"
+
+#define DEFAULT_ITERATIONS 100
+
+static EFI_STATUS bench_crc32(VOID *data, UINTN size)
+{
+	static volatile UINT32 crc;
+
+	crc = crc32_update(0, data, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS count_line(text_slice_t *line _unused, VOID *ctx)
+{
+	(*(UINTN *)ctx)++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS bench_text(VOID *data, UINTN size)
+{
+	UINTN lines = 0;
+
+	return parse_text_slices(data, size, count_line, &lines);
+}
+
+static EFI_STATUS bench_oemvars(VOID *data, UINTN size)
+{
+	return flash_oemvars(data, size);
+}
+
+static EFI_STATUS bench_sparse(VOID *data, UINTN size)
+{
+	if (!is_sparse_image(data, size))
+		return EFI_INVALID_PARAMETER;
+
+	host_disk_rewind();
+	return flash_sparse(data, size);
+}
+
+static EFI_STATUS bench_upng(VOID *data, UINTN size)
+{
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+	UINTN width, height;
+	EFI_STATUS ret;
+
+	ret = upng_load(data, size, &blt, &width, &height);
+	if (!EFI_ERROR(ret))
+		FreePool(blt);
+	return ret;
+}
+
+static EFI_STATUS bench_vbmeta(VOID *data, UINTN size)
+{
+	AvbVBMetaVerifyResult res;
+
+	res = avb_vbmeta_image_verify(data, size, NULL, NULL);
+	return res == AVB_VBMETA_VERIFY_RESULT_OK ? EFI_SUCCESS : EFI_SECURITY_VIOLATION;
+}
+
+static const struct kernel {
+	const char *name;
+	EFI_STATUS (*run)(VOID *data, UINTN size);
+} KERNELS[] = {
+	{ "crc32", bench_crc32 },
+	{ "text", bench_text },
+	{ "oemvars", bench_oemvars },
+	{ "sparse", bench_sparse },
+	{ "upng", bench_upng },
+	{ "vbmeta", bench_vbmeta }
+};
+
+static UINT64 now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	UINT64 x = *(const UINT64 *)a, y = *(const UINT64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static VOID *load_file(const char *path, UINTN *size)
+{
+	FILE *f;
+	VOID *data = NULL;
+	long len;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	if (!fseek(f, 0, SEEK_END) && (len = ftell(f)) > 0 &&
+	    !fseek(f, 0, SEEK_SET)) {
+		data = malloc(len);
+		if (data && fread(data, 1, len, f) != (size_t)len) {
+			free(data);
+			data = NULL;
+		}
+		*size = len;
+	}
+
+	fclose(f);
+	return data;
+}
+
+static void usage(const char *prog)
+{
+	UINTN i;
+
+	fprintf(stderr, "usage: %s <kernel> <file> [iterations] [disk image]\nkernels:", prog);
+	for (i = 0; i < ARRAY_SIZE(KERNELS); i++)
+		fprintf(stderr, " %s", KERNELS[i].name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+	const struct kernel *kernel = NULL;
+	UINT64 *samples, start, median;
+	UINTN i, size, iterations = DEFAULT_ITERATIONS;
+	VOID *data, *copy;
+	EFI_STATUS ret;
+
+	if (argc < 3) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(KERNELS); i++)
+		if (!strcmp((CHAR8 *)KERNELS[i].name, (CHAR8 *)argv[1]))
+			kernel = &KERNELS[i];
+	if (!kernel) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	data = load_file(argv[2], &size);
+	if (!data) {
+		fprintf(stderr, "Failed to load %s\n", argv[2]);
+		return 1;
+	}
+
+	if (argc > 3)
+		iterations = max(strtoul(argv[3], NULL, 0), 1UL);
+	if (argc > 4 && EFI_ERROR(host_disk_open(argv[4]))) {
+		fprintf(stderr, "Failed to open %s\n", argv[4]);
+		return 1;
+	}
+
+	samples = malloc(iterations * sizeof(*samples));
+	copy = malloc(size);
+	if (!samples || !copy)
+		return 1;
+
+	/* The kernels may modify their input, each run gets a fresh copy */
+	for (i = 0; i < iterations; i++) {
+		memcpy(copy, data, size);
+		start = now_nsec();
+		ret = kernel->run(copy, size);
+		samples[i] = now_nsec() - start;
+		if (EFI_ERROR(ret)) {
+			fprintf(stderr, "%s failed on run %lu, status 0x%lx\n",
+				kernel->name, (unsigned long)i, (unsigned long)ret);
+			return 1;
+		}
+	}
+
+	qsort(samples, iterations, sizeof(*samples), cmp_u64);
+	median = max(samples[iterations / 2], (UINT64)1);
+	printf("%s %lu bytes, %lu runs: min %lu median %lu p99 %lu usec, %lu MB/s\n",
+	       kernel->name, (unsigned long)size, (unsigned long)iterations,
+	       (unsigned long)(samples[0] / 1000), (unsigned long)(median / 1000),
+	       (unsigned long)(samples[(iterations * 99) / 100] / 1000),
+	       (unsigned long)((UINT64)size * 1000 / median));
+	if (host_variable_writes)
+		printf("%lu variable writes\n", (unsigned long)host_variable_writes);
+
+	host_disk_close();
+	free(copy);
+	free(samples);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Host test of the fastboot UDP transport receive path: a download is
+   sent as packets whose payload does not divide the transport reads,
+   the way oem flash-stream reads its segments.  Each packet must be
+   acknowledged once its data is entirely handed out, whatever the
+   read boundaries, and the data must arrive intact.  Packets larger
+   than the negotiated size must be dropped unacknowledged.  The
+   transport is built here with the USB, TCP and UDP layers stubbed
+   out.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fastboot_transport.c"
+
+/* Host packets of the minimal size, 508 bytes of payload */
+#define HOST_PACKET_SIZE	UDP_MIN_PACKET_SIZE
+#define PAYLOAD_SIZE		(HOST_PACKET_SIZE - sizeof(udp_header_t))
+#define SEGMENT_SIZE		100000
+#define IMAGE_SIZE		(3 * SEGMENT_SIZE + 1234)
+#define MAX_RETRIES		8
+
+/* Lower layers */
+EFI_STATUS usb_start(UINT8 subclass, UINT8 protocol, CHAR16 *str_configuration,
+		     CHAR16 *str_interface, start_callback_t start_cb,
+		     data_callback_t rx_cb, data_callback_t tx_cb)
+{
+	return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS usb_stop(void) { return EFI_SUCCESS; }
+EFI_STATUS usb_pause(void) { return EFI_SUCCESS; }
+EFI_STATUS usb_run(void) { return EFI_SUCCESS; }
+EFI_STATUS usb_read(void *buf, UINT32 size) { return EFI_UNSUPPORTED; }
+EFI_STATUS usb_write(void *buf, UINT32 size) { return EFI_UNSUPPORTED; }
+
+EFI_STATUS tcp_start(UINT32 port, start_callback_t start_cb,
+		     data_callback_t rx_cb, data_callback_t tx_cb,
+		     EFI_IPv4_ADDRESS *station_address)
+{
+	return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS tcp_stop(void) { return EFI_SUCCESS; }
+EFI_STATUS tcp_run(void) { return EFI_SUCCESS; }
+EFI_STATUS tcp_read(void *buf, UINT32 size) { return EFI_UNSUPPORTED; }
+EFI_STATUS tcp_write(void *buf, UINT32 size) { return EFI_UNSUPPORTED; }
+
+EFI_STATUS transport_register(transport_t *trans, UINTN nb) { return EFI_SUCCESS; }
+void transport_unregister(void) { }
+EFI_STATUS transport_read(void *buf, UINT32 len) { return EFI_UNSUPPORTED; }
+EFI_STATUS transport_write(void *buf, UINT32 len) { return EFI_UNSUPPORTED; }
+void ui_print(CHAR16 *fmt, ...) { }
+
+EFI_STATUS udp_start(UINT32 port, udp_rx_callback_t rx_cb,
+		     EFI_IPv4_ADDRESS *station_address)
+{
+	memset(station_address, 0, sizeof(*station_address));
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS udp_stop(void) { return EFI_SUCCESS; }
+EFI_STATUS udp_run(void) { return EFI_SUCCESS; }
+
+/* Sequence number of the last acknowledged data packet */
+static int last_ack = -1;
+
+EFI_STATUS udp_send(EFI_UDP4_SESSION_DATA *session, void *buf, UINT32 size)
+{
+	udp_header_t *hdr = buf;
+
+	if (hdr->id == UDP_ID_FASTBOOT && size == sizeof(*hdr))
+		last_ack = be16toh(hdr->seq);
+
+	return EFI_SUCCESS;
+}
+
+/* Device side: consecutive SEGMENT_SIZE reads, as the streaming flash
+   does, checked against the image pattern.  */
+static UINT8 segment[SEGMENT_SIZE];
+static UINT32 received;
+static BOOLEAN corrupted;
+
+static UINT8 pattern(UINT32 offset)
+{
+	return (offset * 31) ^ (offset >> 11);
+}
+
+static void read_next(void)
+{
+	if (received < IMAGE_SIZE)
+		fastboot_udp_read(segment, min((UINT32)SEGMENT_SIZE,
+					       IMAGE_SIZE - received));
+}
+
+static void device_start_cb(void)
+{
+	read_next();
+}
+
+static void device_rx_cb(void *buf, UINT32 len)
+{
+	UINT32 i;
+
+	for (i = 0; i < len; i++)
+		if (segment[i] != pattern(received + i))
+			corrupted = TRUE;
+	received += len;
+	read_next();
+}
+
+static void device_tx_cb(void *buf, UINT32 len) { }
+
+static void host_send(UINT8 id, UINT8 flags, UINT16 seq,
+		      const void *data, UINT32 len)
+{
+	static EFI_UDP4_SESSION_DATA session;
+	UINT8 pkt[UDP_MAX_PACKET_SIZE + 1];
+	udp_header_t *hdr = (udp_header_t *)pkt;
+
+	hdr->id = id;
+	hdr->flags = flags;
+	hdr->seq = htobe16(seq);
+	memcpy(pkt + sizeof(*hdr), data, len);
+	transport_udp_rx_cb(&session, pkt, sizeof(*hdr) + len);
+}
+
+int main(void)
+{
+	UINT8 data[PAYLOAD_SIZE + 1];
+	UINT16 init[2], seq = 0;
+	UINT32 sent, len, i;
+	UINTN retries;
+
+	if (EFI_ERROR(fastboot_udp_start(device_start_cb, device_rx_cb,
+					 device_tx_cb))) {
+		fprintf(stderr, "Failed to start the UDP transport\n");
+		return EXIT_FAILURE;
+	}
+
+	init[0] = htobe16(UDP_PROTOCOL_VERSION);
+	init[1] = htobe16(HOST_PACKET_SIZE);
+	host_send(UDP_ID_INIT, 0, seq++, init, sizeof(init));
+
+	/* An oversized packet, with data the image check would reject */
+	memset(data, 0xff, sizeof(data));
+	host_send(UDP_ID_FASTBOOT, UDP_FLAG_CONTINUATION, seq, data,
+		  PAYLOAD_SIZE + 1);
+	if (last_ack == seq) {
+		fprintf(stderr, "Oversized packet acknowledged\n");
+		return EXIT_FAILURE;
+	}
+
+	for (sent = 0; sent < IMAGE_SIZE; sent += len, seq++) {
+		len = min((UINT32)PAYLOAD_SIZE, IMAGE_SIZE - sent);
+		for (i = 0; i < len; i++)
+			data[i] = pattern(sent + i);
+
+		for (retries = 0; last_ack != seq; retries++) {
+			if (retries == MAX_RETRIES) {
+				fprintf(stderr, "Packet %u at offset %u never acknowledged\n",
+					seq, sent);
+				return EXIT_FAILURE;
+			}
+			host_send(UDP_ID_FASTBOOT,
+				  sent + len < IMAGE_SIZE ? UDP_FLAG_CONTINUATION : 0,
+				  seq, data, len);
+			fastboot_udp_run();
+		}
+	}
+
+	if (received != IMAGE_SIZE || corrupted) {
+		fprintf(stderr, "Received %u bytes of %u%s\n", received,
+			IMAGE_SIZE, corrupted ? ", corrupted" : "");
+		return EXIT_FAILURE;
+	}
+
+	printf("%u bytes received in %u bytes packets and %u bytes reads\n",
+	       IMAGE_SIZE, HOST_PACKET_SIZE, SEGMENT_SIZE);
+	return EXIT_SUCCESS;
+}
@@ -171,6 +171,7 @@ set(LIB_FASTBOOT_SOURCES
 	${LIB_FASTBOOT_SOURCE}/fastboot_flashing.c
 	${LIB_FASTBOOT_SOURCE}/flash.c
 	${LIB_FASTBOOT_SOURCE}/sparse.c
+	${LIB_FASTBOOT_SOURCE}/fetch.c
 	${LIB_FASTBOOT_SOURCE}/info.c
 	${LIB_FASTBOOT_SOURCE}/intel_variables.c
 	${LIB_FASTBOOT_SOURCE}/bootmgr.c
@@ -193,11 +194,7 @@ set(LIB_KERNELFLINGER_SOURCES
 	${LIB_KERNELFLINGER_SOURCE}/gpt.c
 	${LIB_KERNELFLINGER_SOURCE}/storage.c
 	${LIB_KERNELFLINGER_SOURCE}/pci.c
-	${LIB_KERNELFLINGER_SOURCE}/mmc.c
-	${LIB_KERNELFLINGER_SOURCE}/ufs.c
-	${LIB_KERNELFLINGER_SOURCE}/sdcard.c
 	${LIB_KERNELFLINGER_SOURCE}/sdio.c
-	${LIB_KERNELFLINGER_SOURCE}/sata.c
 	${LIB_KERNELFLINGER_SOURCE}/uefi_utils.c
 	${LIB_KERNELFLINGER_SOURCE}/targets.c
 	${LIB_KERNELFLINGER_SOURCE}/smbios.c
@@ -207,19 +204,61 @@ set(LIB_KERNELFLINGER_SOURCES
 	${LIB_KERNELFLINGER_SOURCE}/life_cycle.c
 	${LIB_KERNELFLINGER_SOURCE}/qsort.c
 	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb.c
-	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_emmc.c
-	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_ufs.c
-	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_virtual.c
+	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_memory.c
 	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_storage_common.c
-	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_nvme.c
-	${LIB_KERNELFLINGER_SOURCE}/nvme.c
 	${LIB_KERNELFLINGER_SOURCE}/timer.c
-	${LIB_KERNELFLINGER_SOURCE}/virtual_media.c
-	${LIB_KERNELFLINGER_SOURCE}/general_block.c
 	${LIB_KERNELFLINGER_SOURCE}/slot.c
+	${LIB_KERNELFLINGER_SOURCE}/slot_parts.c
 	${LIB_KERNELFLINGER_SOURCE}/pae.c
 	${LIB_KERNELFLINGER_SOURCE}/signature.c
 	${LIB_KERNELFLINGER_SOURCE}/ias_sig.c
 	${LIB_KERNELFLINGER_SOURCE}/no_ui.c
 	${LIB_KERNELFLINGER_SOURCE}/ui_color.c
+	${LIB_KERNELFLINGER_SOURCE}/crc32.c
+	${LIB_KERNELFLINGER_SOURCE}/lz4.c
+	${LIB_KERNELFLINGER_SOURCE}/async_io.c
+	${LIB_KERNELFLINGER_SOURCE}/mp_pool.c
+	${LIB_KERNELFLINGER_SOURCE}/random.c
+	${LIB_KERNELFLINGER_SOURCE}/aesni.c
+	${LIB_KERNELFLINGER_SOURCE}/sha256_mb.c
+	${LIB_KERNELFLINGER_SOURCE}/cmdline.c
+	${LIB_KERNELFLINGER_SOURCE}/boottrace.c
+	${LIB_KERNELFLINGER_SOURCE}/boot_harness.c
+	${LIB_KERNELFLINGER_SOURCE}/arena.c
+	${LIB_KERNELFLINGER_SOURCE}/memtrack.c
+	${LIB_KERNELFLINGER_SOURCE}/memmap.c
+	${LIB_KERNELFLINGER_SOURCE}/prefetch.c
+	${LIB_KERNELFLINGER_SOURCE}/bootprof.c
+	${LIB_KERNELFLINGER_SOURCE}/blkcache.c
+	${LIB_KERNELFLINGER_SOURCE}/misc.c
+	${LIB_KERNELFLINGER_SOURCE}/storage_bench.c
+	${LIB_KERNELFLINGER_SOURCE}/io_buffer.c
+	${LIB_KERNELFLINGER_SOURCE}/protocol.c
+	)
+
+# Per storage backend sources, selected by KERNELFLINGER_STORAGE_BACKENDS
+set(STORAGE_BACKEND_emmc_SOURCES
+	${LIB_KERNELFLINGER_SOURCE}/mmc.c
+	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_emmc.c
+	)
+set(STORAGE_BACKEND_ufs_SOURCES
+	${LIB_KERNELFLINGER_SOURCE}/ufs.c
+	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_ufs.c
+	)
+set(STORAGE_BACKEND_sdcard_SOURCES
+	${LIB_KERNELFLINGER_SOURCE}/sdcard.c
+	)
+set(STORAGE_BACKEND_sata_SOURCES
+	${LIB_KERNELFLINGER_SOURCE}/sata.c
+	)
+set(STORAGE_BACKEND_nvme_SOURCES
+	${LIB_KERNELFLINGER_SOURCE}/nvme.c
+	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_nvme.c
+	)
+set(STORAGE_BACKEND_virtual_SOURCES
+	${LIB_KERNELFLINGER_SOURCE}/virtual_media.c
+	${LIB_KERNELFLINGER_SOURCE}/rpmb/rpmb_virtual.c
+	)
+set(STORAGE_BACKEND_general_block_SOURCES
+	${LIB_KERNELFLINGER_SOURCE}/general_block.c
 	)
@@ -57,10 +57,14 @@ typedef struct adb_msg {
 } adb_msg_t;
 
 #define ADB_MIN_PAYLOAD 4096
-#define ADB_MAX_PAYLOAD 262144
+#define ADB_MAX_PAYLOAD (1024 * 1024)
 
 /* Negociated (CONNECT hand-shake) maximum buffer size */
 extern UINT32 adb_max_payload;
+/* The host negociated the delayed acknowledgement: the OKAY packets
+   carry the number of bytes acknowledged and several WRTE packets can
+   be sent without waiting for an OKAY.  */
+extern BOOLEAN adb_delayed_ack;
 
 typedef struct adb_pkt {
 	adb_msg_t msg;
@@ -74,5 +78,9 @@ enum boot_target adb_get_boot_target(void);
 void adb_set_boot_target(enum boot_target bt);
 
 EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1);
+/* Same as adb_send_pkt() but PENDING is incremented until the packet
+   has been handed over to the transport.  */
+EFI_STATUS adb_queue_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0,
+			 UINT32 arg1, UINT32 *pending);
 
 #endif	/* _ADB_H_ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _IPCFG_H_
+#define _IPCFG_H_
+
+#include <efi.h>
+#include <efitcp.h>
+
+/* IPv4 configuration applied to the TCP and UDP transports without
+   waiting for DHCP.  It is either the static configuration of the
+   NetworkConfig oemvar, "<address>/<prefix length>[,<gateway>]", or
+   the last DHCP configuration which is cached for
+   NET_LEASE_CACHE_SEC seconds.  */
+struct ipcfg {
+	EFI_IPv4_ADDRESS address;
+	EFI_IPv4_ADDRESS mask;
+	EFI_IPv4_ADDRESS gateway;
+	BOOLEAN has_gateway;
+	BOOLEAN is_static;
+};
+
+/* Return EFI_NOT_FOUND if there is neither a static configuration
+   nor a valid cached one */
+EFI_STATUS ipcfg_get(struct ipcfg *cfg);
+/* Cache the configuration obtained by DHCP */
+void ipcfg_save(EFI_IP4_MODE_DATA *mode);
+/* A host has reached the device with the cached configuration: it is
+   still valid, restart its cache period */
+void ipcfg_validated(void);
+/* The cached configuration has been rejected, forget it */
+void ipcfg_discard(void);
+
+#endif	/* _IPCFG_H_ */
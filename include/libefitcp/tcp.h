@@ -43,5 +43,8 @@ EFI_STATUS tcp_stop(void);
 EFI_STATUS tcp_run(void);
 EFI_STATUS tcp_read(void *buf, UINT32 size);
 EFI_STATUS tcp_write(void *buf, UINT32 size);
+/* Write the IOVCNT buffers of IOV in one transmit, see transport_t
+   writev() */
+EFI_STATUS tcp_writev(const transport_iov_t *iov, UINTN iovcnt);
 
 #endif	/* _TCP_H_ */
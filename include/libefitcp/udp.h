@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _UDP_H_
+#define _UDP_H_
+
+#include <efiudp.h>
+#include <transport.h>
+
+/* Largest datagram udp_send() can send and the receive path can
+   re-assemble.  */
+#define UDP_MAX_DATAGRAM_SIZE 8192
+
+/* Called for each datagram received.  SESSION describes the sender
+   and can be given to udp_send() to reply.  BUF is only valid until
+   the callback returns.  */
+typedef void (*udp_rx_callback_t)(EFI_UDP4_SESSION_DATA *session,
+				  void *buf, UINT32 len);
+
+EFI_STATUS udp_start(UINT32 port, udp_rx_callback_t rx_cb,
+		     EFI_IPv4_ADDRESS *station_address);
+EFI_STATUS udp_stop(void);
+EFI_STATUS udp_run(void);
+
+/* Send SIZE bytes of BUF to the sender of SESSION.  The data is
+   copied so BUF can be re-used as soon as the function returns.  */
+EFI_STATUS udp_send(EFI_UDP4_SESSION_DATA *session, void *buf, UINT32 size);
+
+#endif	/* _UDP_H_ */
@@ -61,6 +61,16 @@ struct download_buffer {
 };
 
 struct download_buffer *fastboot_download_buffer(void);
+EFI_STATUS fastboot_set_flash_stream(const CHAR8 *label);
+/* Like fastboot_set_flash_stream() but the next download is the rest
+   of the interrupted stream to LABEL, see flash_stream_resume() */
+EFI_STATUS fastboot_set_flash_resume(const CHAR8 *label);
+/* Split the download buffer in two to receive the next image while
+   the previous one is flashed */
+EFI_STATUS fastboot_set_flash_pipeline(BOOLEAN enable);
+/* The first SIZE bytes of the download buffer are sent to the host
+   by the next upload command */
+EFI_STATUS fastboot_stage(UINTN size);
 
 struct fastboot_cmd *fastboot_get_root_cmd(const char *name);
 EFI_STATUS fastboot_register(struct fastboot_cmd *cmd);
@@ -70,6 +80,12 @@ void fastboot_run_cmd(cmdlist_t list, const char *name, INTN argc, CHAR8 **argv)
 void fastboot_run_root_cmd(const char *name, INTN argc, CHAR8 **argv);
 
 EFI_STATUS fastboot_publish(const char *name, const char *value);
+EFI_STATUS fastboot_publish_dynamic(const char *name, const char *(get_value)(void));
+/* Like fastboot_publish_dynamic() but GET_VALUE is only called on the
+   first getvar of the fastboot session, its result is then kept.  For
+   values which are expensive to compute and cannot change while
+   fastboot runs.  */
+EFI_STATUS fastboot_publish_lazy(const char *name, const char *(get_value)(void));
 void fastboot_okay(const char *fmt, ...);
 void fastboot_fail(const char *fmt, ...);
 void fastboot_info(const char *fmt, ...);
@@ -81,6 +97,11 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage,
 EFI_STATUS fastboot_stop(void *bootimage, void *efiimage, UINTN imagesize,
 			 enum boot_target target);
 void fastboot_free(void);
+/* Release a boot or EFI image returned by fastboot_start() */
+void fastboot_free_image(void *image);
+/* Microseconds from fastboot_start() to the first command received,
+   zero until then */
+UINT64 fastboot_get_startup_usec(void);
 EFI_STATUS refresh_partition_var(void);
 
 void fastboot_reboot(enum boot_target target, CHAR16 *msg);
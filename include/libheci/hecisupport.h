@@ -46,4 +46,12 @@ typedef struct _GEN_END_OF_POST
 extern BOOLEAN heci_is_eop_received(void);
 extern EFI_STATUS heci_end_of_post(void);
 
+/* heci_end_of_post_async() sends the End Of Post message and returns
+   without waiting for the CSE to acknowledge it, so that the CSE
+   processing overlaps with the kernel loading.
+   heci_end_of_post_wait() must be called before handing over to the
+   kernel: it reads the acknowledgement, if any is pending.  */
+extern EFI_STATUS heci_end_of_post_async(void);
+extern EFI_STATUS heci_end_of_post_wait(void);
+
 #endif   /*  _HECISUPPORT_H_  */
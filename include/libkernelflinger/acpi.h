@@ -153,6 +153,14 @@ enum acpi_src_type {
  * SIGNATURE to specify which one is required.  For instance, with
  * SIGNATURE set to "SSDT2", the second SSDT table is returned.  */
 EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table);
+
+/* The tables referenced by the XSDT are indexed, and their checksum
+ * verified, on the first lookup.  acpi_get_table_by_index() returns
+ * the INDEX-th table in XSDT order.  The index is rebuilt after
+ * install_acpi_table() adds a table.  */
+UINTN acpi_table_count(void);
+EFI_STATUS acpi_get_table_by_index(UINTN index, struct ACPI_DESC_HEADER **table);
+void acpi_invalidate_index(void);
 UINT16 oem1_get_ia_apps_run(void);
 UINT8 oem1_get_ia_apps_cap(void);
 UINT8 oem1_get_ia_apps_to_use(void);
@@ -164,8 +172,15 @@ UINT8 oem1_get_ia_apps_to_use(void);
 EFI_STATUS install_acpi_table_from_partitions(VOID *image,
 					      const char *part_name);
 EFI_STATUS install_acpi_table_from_recovery_acpio(VOID *image);
+/* While a batch is open, see acpi_install_begin(), the table is only
+ * queued: it must stay valid until acpi_install_commit() and TABLEKEY
+ * is zero.  */
 EFI_STATUS install_acpi_table(VOID *acpi_table, UINTN acpi_table_size,
 			      UINTN *tablekey);
+/* Queue the tables installed until acpi_install_commit() which
+ * installs them back to back and rebuilds the XSDT index once.  */
+void acpi_install_begin(void);
+EFI_STATUS acpi_install_commit(void);
 EFI_STATUS acpi_parse_selected_table_id(CHAR8 *selected_id_str,
 					UINT32 selected_id_str_len);
 EFI_STATUS acpi_image_get_length(const CHAR16 *label, struct ACPI_INFO **acpi_info);
@@ -52,4 +52,8 @@ int aes_256_gcm_decrypt(const struct gcm_key *key,
 		const void *aad, size_t aad_size,
 		const void *cipher, size_t cipher_size,
 		void *out, size_t *out_size);
+
+/* Use the OpenSSL implementation even if the processor supports the
+   AES-NI one, to compare them.  */
+void aes_gcm_force_software(BOOLEAN force);
 #endif
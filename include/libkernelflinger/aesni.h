@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _AESNI_H_
+#define _AESNI_H_
+
+#include <efi.h>
+
+/* AES-256 block encryption with the AES-NI instructions.  Callers
+   must check aesni_is_supported() first.  */
+#define AESNI_BLOCK_SIZE	16
+#define AESNI_256_KEY_SIZE	32
+#define AESNI_256_ROUNDS	14
+
+struct aesni_256_key {
+	UINT8 rk[AESNI_256_ROUNDS + 1][AESNI_BLOCK_SIZE] __attribute__((aligned(16)));
+};
+
+BOOLEAN aesni_is_supported(void);
+/* PCLMULQDQ, used for the GCM GHASH */
+BOOLEAN aesni_pclmul_is_supported(void);
+
+void aesni_256_set_key(const UINT8 key[AESNI_256_KEY_SIZE],
+		       struct aesni_256_key *k);
+/* Encrypt the NB blocks of IN into OUT, which may be IN */
+void aesni_256_encrypt(const struct aesni_256_key *k, const UINT8 *in,
+		       UINT8 *out, UINTN nb);
+
+#endif	/* _AESNI_H_ */
@@ -24,6 +24,7 @@
 #include "blobstore.h"
 #endif
 #include "targets.h"
+#include "cmdline.h"
 #include "android_vb.h"
 
 #define BOOT_MAGIC "ANDROID!"
@@ -269,6 +270,14 @@ EFI_STATUS android_image_load_partition(
                 IN const CHAR16 *label,
                 OUT VOID **bootimage_p);
 
+/* Start reading the Android image of the LABEL partition in the
+   background, see prefetch_partition().  */
+EFI_STATUS android_image_prefetch_partition(IN const CHAR16 *label);
+
+/* Free a boot image loaded by android_image_load_partition() or
+ * allocated with AllocatePool() */
+VOID android_free_bootimage(VOID *bootimage);
+
 EFI_STATUS android_image_load_file(
                 IN EFI_HANDLE device,
                 IN CHAR16 *loader,
@@ -286,6 +295,18 @@ EFI_STATUS write_bcb(
 /* Perform a security  RAM wipe */
 EFI_STATUS android_clear_memory(void);
 
+/* Progress of the RAM wipe: DONE out of TOTAL bytes are cleared after
+   ELAPSED milliseconds.  It is called on the BSP at TPL_NOTIFY and
+   must not allocate memory, which could be cleared afterwards.  */
+typedef void (*clear_progress_t)(UINT64 done, UINT64 total, UINT32 elapsed,
+                                 VOID *ctx);
+
+/* Same as android_clear_memory() reporting the progress to PROGRESS
+   if not NULL.  If VERIFY is TRUE, a random sample of the cleared
+   pages is read back.  */
+EFI_STATUS android_clear_memory_progress(clear_progress_t progress,
+                                         VOID *progress_ctx, BOOLEAN verify);
+
 /* True if the current Android configuration use slot and does not
  * have a recovery partition.  When true, it means that the current
  * Android configuration requires to boot using the system partiton as
@@ -324,9 +345,7 @@ EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
 /* Get a pointer and size to the 2ndstage area of a boot image */
 EFI_STATUS get_bootimage_2nd(VOID *bootimage, VOID **second, UINT32 *size);
 
-EFI_STATUS prepend_command_line(CHAR16 **cmdline, CHAR16 *fmt, ...);
-
-EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
+EFI_STATUS prepend_slot_command_line(cmdline_t *cmdline,
                                      enum boot_target boot_target,
                                      VBDATA *vb_data);
 
@@ -19,10 +19,11 @@
 
 #include <openssl/x509.h>
 #include "targets.h"
+#include "cmdline.h"
 
 typedef X509 VBDATA;
 
-EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
+EFI_STATUS prepend_slot_command_line(cmdline_t *cmdline,
         enum boot_target boot_target,
         VBDATA *vb_data);
 
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <efi.h>
+
+/* Boot flow arena.  Within a scope opened by arena_mark(), the small
+   allocations made through arena_pool_alloc() are carved out of
+   page-allocated chunks and arena_pool_free() is a no-op:
+   arena_release() drops all of them at once.  The chunks are kept
+   for the next scope so the firmware memory map is not touched
+   again.  Outside of any scope, or when the arena is exhausted,
+   arena_pool_alloc() falls back to AllocatePool().
+
+   The arena is not thread-safe: it must not be used from the MP pool
+   work functions.  Objects which outlive the scope, such as cached
+   protocol data, must be allocated with AllocatePool().  */
+
+#define ARENA_CHUNK_PAGES	256	/* 1 MB */
+#define ARENA_MAX_CHUNKS	8
+#define ARENA_MAX_ALLOC		(4 * 1024)
+
+typedef struct arena_mark {
+	UINTN chunk;
+	UINTN used;
+} arena_mark_t;
+
+arena_mark_t arena_mark(void);
+void arena_release(arena_mark_t mark);
+/* Close all the scopes, e.g. when the boot flow is abandoned for
+   fastboot.  */
+void arena_reset(void);
+BOOLEAN arena_owns(const void *ptr);
+
+void *arena_pool_alloc(UINTN size);
+void arena_pool_free(void *ptr);
+
+#endif	/* _ARENA_H_ */
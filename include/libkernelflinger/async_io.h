@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef _ASYNC_IO_H_
+#define _ASYNC_IO_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Number of requests which can be in flight on one context */
+#define ASYNC_IO_MAX_REQUESTS	4
+
+/* Asynchronous disk I/O on top of EFI_DISK_IO2 when the firmware
+   provides it, falling back to synchronous EFI_DISK_IO requests
+   otherwise.  Offsets are absolute disk byte offsets, like for
+   EFI_DISK_IO.  A request buffer must stay valid until the request
+   has been waited for.
+
+   Requests complete in submission order from the caller point of
+   view: submitting a request while ASYNC_IO_MAX_REQUESTS are in
+   flight first waits for the oldest one.  */
+struct async_io;
+
+EFI_STATUS async_io_open(struct gpt_partition_interface *gparti,
+			 struct async_io **aio_p);
+EFI_STATUS async_io_read(struct async_io *aio, UINT64 offset, UINTN size,
+			 VOID *buf, UINTN *id);
+EFI_STATUS async_io_write(struct async_io *aio, UINT64 offset, UINTN size,
+			  VOID *buf, UINTN *id);
+EFI_STATUS async_io_wait(struct async_io *aio, UINTN id);
+EFI_STATUS async_io_wait_all(struct async_io *aio);
+BOOLEAN async_io_is_async(struct async_io *aio);
+/* Wait for all the pending requests and free the context */
+void async_io_close(struct async_io *aio);
+
+#endif	/* _ASYNC_IO_H_ */
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _BLKCACHE_H_
+#define _BLKCACHE_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Disk data is cached by aligned segments of BLKCACHE_SEGMENT_SIZE
+   bytes, BLKCACHE_SEGMENTS of them at most by default, the least
+   recently used one being evicted first.  A cache miss reads one segment, or up to
+   BLKCACHE_MAX_READAHEAD segments when the reads are sequential.  */
+#define BLKCACHE_SEGMENT_SIZE	(64 * 1024)
+#define BLKCACHE_SEGMENTS	16
+#define BLKCACHE_MAX_READAHEAD	4
+
+/* Profile of the slow media, live boot from USB or SD and virtual
+   media, where each small random read costs milliseconds: an 8 MiB
+   cache and up to 2 MiB of sequential read-ahead.  */
+#define BLKCACHE_SLOW_SEGMENTS		128
+#define BLKCACHE_SLOW_MAX_READAHEAD	32
+
+/* Read SIZE bytes at the absolute disk byte OFFSET of GPARTI's disk.
+   Reads larger than the maximum read-ahead bypass the cache.  */
+EFI_STATUS blkcache_read(struct gpt_partition_interface *gparti,
+			 UINT64 offset, UINTN size, VOID *buf);
+/* Drop the cached data of [OFFSET, OFFSET + SIZE) on BIO's disk, or
+   all the cached data if BIO is NULL, including the prefetched
+   regions a cache fill could be served from.  Any code writing to the
+   disk must call it.  */
+void blkcache_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size);
+/* Select the slow media profile if SLOW is TRUE, the default one
+   otherwise.  Changing the profile drops all the cached data.  */
+void blkcache_set_slow_media(BOOLEAN slow);
+
+#endif	/* _BLKCACHE_H_ */
@@ -51,4 +51,15 @@ struct blobstore *blobstore_get(void *mem, unsigned int size);
 int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
 		       void **data, unsigned int *size);
 
+/* Hash of a blob key.  It does not depend on the blob type nor on the
+ * blobstore: a key looked up several times only needs to be hashed
+ * once */
+unsigned int blobstore_key_hash(const char *key);
+
+/* Same as blobstore_get_item() with the KEY_HASH blobstore_key_hash()
+ * of KEY */
+int blobstore_get_item_hashed(struct blobstore *bs, const char *key,
+			      unsigned int key_hash, enum blobtype type,
+			      void **data, unsigned int *size);
+
 #endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _BOOT_HARNESS_H_
+#define _BOOT_HARNESS_H_
+
+#include <efi.h>
+
+/* Boot time regression harness.  Once armed with a number of runs,
+   the boot flow stops just before the kernel handover: the stage
+   durations and the cumulated boot trace times of the run are saved
+   and checked against the budgets, then the device reboots, into
+   the next run or into Fastboot after the last one.
+
+   Runs and budgets are "<name>:<usec>,..." strings where the names
+   are the construct_stages_boottime() stages (LIS, VBS, ..., SKS)
+   and the boottrace_summary() events.  */
+
+#define BOOT_HARNESS_RUNS_VAR		L"BootHarnessRuns"
+#define BOOT_HARNESS_BUDGET_VAR		L"BootHarnessBudget"
+#define BOOT_HARNESS_RESULTS_VAR	L"BootHarnessResults"
+
+#define BOOT_HARNESS_MAX_RUNS		16
+
+/* Number of runs left, 0 if the harness is not armed */
+UINTN boot_harness_runs(void);
+
+/* Arm the harness for RUNS runs and clear the previous results.
+   Zero disarms it.  */
+EFI_STATUS boot_harness_arm(UINTN runs);
+
+/* Set the budgets, NULL removes them */
+EFI_STATUS boot_harness_set_budget(const CHAR8 *budget);
+
+/* Record the current boot as a harness run and reboot */
+VOID boot_harness_run_done(VOID) __attribute__((noreturn));
+
+/* The budgets and the results, one run per line, as NUL terminated
+   strings to be freed by the caller or NULL if there are none.  */
+CHAR8 *boot_harness_get_budget(void);
+CHAR8 *boot_harness_get_results(void);
+
+/* Call REPORT for each entry of the LEN bytes RUN over its budget in
+   BUDGET and return the number of regressions.  */
+typedef void (*boot_harness_report_t)(const CHAR8 *name, UINT64 usec,
+				      UINT64 budget);
+UINTN boot_harness_check(const CHAR8 *run, UINTN len, const CHAR8 *budget,
+			 boot_harness_report_t report);
+
+#endif	/* _BOOT_HARNESS_H_ */
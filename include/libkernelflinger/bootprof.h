@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _BOOTPROF_H_
+#define _BOOTPROF_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Boot I/O profile.  The disk reads the block cache makes during a
+   normal boot are recorded and stored in a non-volatile EFI variable
+   along with a key identifying the build, the vbmeta digest.  On the
+   next boot, bootprof_replay() submits these reads, sorted by disk
+   offset and merged, through the prefetch layer, so that the
+   verification metadata, footers and image headers are already in
+   memory when the boot flow asks for them.  */
+#define BOOTPROF_MAX_EXTENTS	32
+#define BOOTPROF_MAX_REGIONS	6
+#define BOOTPROF_KEY_SIZE	32
+
+/* Start recording the block cache reads of the boot disk */
+void bootprof_start(void);
+/* Record a SIZE bytes read at the absolute disk byte OFFSET of BIO's
+   disk, called by the block cache */
+void bootprof_record(EFI_BLOCK_IO *bio, UINT64 offset, UINTN size);
+/* Stop recording without storing anything, the boot flow has been
+   abandoned */
+void bootprof_stop(void);
+/* Prefetch the reads of the stored profile */
+EFI_STATUS bootprof_replay(void);
+/* Stop recording and store the recorded profile under KEY if it
+   differs from the stored one.  KEY can be NULL if the build cannot
+   be identified.  */
+EFI_STATUS bootprof_commit(const UINT8 *key, UINTN key_size);
+
+#endif	/* _BOOTPROF_H_ */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef _BOOTTRACE_H_
+#define _BOOTTRACE_H_
+
+#include <efi.h>
+
+/* Boot tracing.  Events are recorded with their Time Stamp Counter
+   value in a fixed size ring: once it is full, the oldest records
+   are overwritten.  Recording is cheap enough for the hot paths but
+   it is not thread-safe: it must not be used from the MP pool work
+   functions.  */
+
+enum boottrace_event {
+	BT_STAGE = 0,		/* set_boottime_stamp(), ARG is the TM_POINT */
+	BT_GPT_LOAD,		/* ARG is the logical unit */
+	BT_BOOTIMG_LOAD,	/* ARG is the image size */
+	BT_AVB_VERIFY,
+	BT_AVB_READ,		/* ARG is the number of bytes */
+	BT_AVB_HASH,		/* ARG is the number of bytes */
+	BT_TRUSTY_LOAD,
+	BT_TRUSTY_START,
+	BT_ACPI_INSTALL,
+	BT_UI_DRAW,		/* ARG is the number of pixels */
+	BT_VAR_READ,		/* ARG is the variable size */
+	BT_TPM_CMD,		/* BEGIN ARG is the command code, END ARG
+				   the request and response sizes in the
+				   upper and lower 16 bits */
+	BT_HECI_CMD,		/* BEGIN ARG is the MKHI header, END ARG
+				   as BT_TPM_CMD */
+	BT_EXIT_BS,		/* END ARG is the number of ExitBootServices()
+				   attempts */
+	BT_EVENT_LAST
+};
+
+enum boottrace_type {
+	BT_POINT = 0,
+	BT_BEGIN,
+	BT_END
+};
+
+struct boottrace_record {
+	UINT64 tsc;
+	UINT16 event;
+	UINT16 type;
+	UINT32 arg;
+};
+
+#define BOOTTRACE_SIZE	1024
+
+void boottrace(enum boottrace_event event, enum boottrace_type type, UINT32 arg);
+
+static inline void boottrace_begin(enum boottrace_event event, UINT32 arg)
+{
+	boottrace(event, BT_BEGIN, arg);
+}
+
+static inline void boottrace_end(enum boottrace_event event, UINT32 arg)
+{
+	boottrace(event, BT_END, arg);
+}
+
+/* Number of records in the ring and the INDEX-th record, the oldest
+   first, or NULL if INDEX is out of range.  */
+UINTN boottrace_count(void);
+const struct boottrace_record *boottrace_get(UINTN index);
+
+const char *boottrace_event_name(UINT16 event);
+
+/* Cumulated time in microseconds of the begin/end scopes of EVENT */
+UINT64 boottrace_total_usec(enum boottrace_event event);
+
+/* Write a "<event>:<usec>,..." summary of the cumulated scope times
+   of the events which were traced to BUF.  */
+void boottrace_summary(CHAR8 *buf, UINTN size);
+
+#endif	/* _BOOTTRACE_H_ */
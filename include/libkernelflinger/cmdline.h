@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef _CMDLINE_H_
+#define _CMDLINE_H_
+
+#include <efi.h>
+
+/* Kernel command line builder.  Fragments are collected as CHAR8
+   slices and the command line is assembled only once, in a buffer
+   of the exact final size.  Prepended fragments end up in front of
+   the command line, the last prepended first, appended fragments at
+   its end in the order they were added.  Fragments are separated by
+   a space.  */
+
+struct cmdline_frag {
+	const CHAR8 *str;
+	UINTN len;
+	BOOLEAN front;
+	BOOLEAN owned;
+};
+
+typedef struct cmdline {
+	struct cmdline_frag *frags;
+	UINTN nb;
+	UINTN max;
+} cmdline_t;
+
+void cmdline_init(cmdline_t *cl);
+void cmdline_free(cmdline_t *cl);
+
+/* Format a fragment and add a CHAR8 copy of it.  Return
+   EFI_INVALID_PARAMETER if it contains non-ascii characters.  */
+EFI_STATUS cmdline_prepend(cmdline_t *cl, CHAR16 *fmt, ...);
+EFI_STATUS cmdline_append(cmdline_t *cl, CHAR16 *fmt, ...);
+
+/* Add LEN bytes of STR without copying them.  STR must stay valid
+   until cmdline_build() has been called.  */
+EFI_STATUS cmdline_prepend_ref(cmdline_t *cl, const CHAR8 *str, UINTN len);
+EFI_STATUS cmdline_append_ref(cmdline_t *cl, const CHAR8 *str, UINTN len);
+
+/* Length of the command line, the terminating NUL excluded */
+UINTN cmdline_len(cmdline_t *cl);
+
+/* Write the NUL terminated command line to BUF which must be at
+   least cmdline_len() + 1 bytes long.  */
+EFI_STATUS cmdline_build(cmdline_t *cl, CHAR8 *buf, UINTN size);
+
+#endif	/* _CMDLINE_H_ */
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <efi.h>
+
+/* Standard CRC32 (IEEE 802.3, zlib polynomial).  CRC is the value
+   returned by a previous call, or 0 to start a new computation.  */
+UINT32 crc32_update(UINT32 crc, const VOID *data, UINTN size);
+
+/* Return the CRC32 of the concatenation of two buffers, CRC1 being
+   the CRC32 of the first one and CRC2 the CRC32 of the second one of
+   LEN2 bytes.  */
+UINT32 crc32_combine(UINT32 crc1, UINT32 crc2, UINT64 len2);
+
+/* Update CRC with COUNT repetitions of the SIZE bytes of DATA without
+   walking through all the repetitions.  */
+UINT32 crc32_repeat(UINT32 crc, const VOID *data, UINTN size, UINT64 count);
+
+#endif	/* _CRC32_H_ */
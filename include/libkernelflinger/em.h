@@ -37,4 +37,11 @@ BOOLEAN is_charger_plugged_in(void);
 BOOLEAN is_battery_below_boot_OS_threshold(void);
 EFI_STATUS get_battery_voltage(UINTN *voltage);
 
+/* Refresh the battery and charger status every PERIOD_MS milliseconds
+   from a timer event.  The functions above then return the last
+   polled status right away instead of querying the charging
+   protocol.  */
+EFI_STATUS em_start_polling(UINT32 period_ms);
+void em_stop_polling(void);
+
 #endif  /* _EM_H_ */
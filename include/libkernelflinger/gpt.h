@@ -93,12 +93,49 @@ EFI_STATUS gpt_list_partition(struct gpt_partition_interface **gpartlist, UINTN
 EFI_STATUS gpt_create(struct gpt_header *gh, UINTN gh_size,
 		      UINT64 start_lba, UINTN part_count, struct gpt_bin_part *gbp, logical_unit_t log_unit);
 void gpt_free_cache(void);
+/* Changes whenever partition information previously returned may be
+   stale, for callers keeping their own partition cache */
+UINT32 gpt_cache_generation(void);
+/* Flush the data, see gpt_sync_data(), and make the firmware rebuild
+   its partition handles, right away unless the refresh is deferred.
+   The cached partition table is kept.  */
 EFI_STATUS gpt_refresh(void);
+/* While deferred, gpt_refresh() only calls gpt_sync_data() and the
+   partition handles are rebuilt once by gpt_commit_refresh(), or
+   before gpt_get_partition_handle() looks them up.  Disabling the
+   deferral commits the pending refresh.  */
+void gpt_defer_refresh(BOOLEAN defer);
+EFI_STATUS gpt_commit_refresh(void);
 EFI_STATUS gpt_get_root_disk(struct gpt_partition_interface *gpart, logical_unit_t log_unit);
+/* Disk I/O at the absolute byte OFFSET of the GPART disk, like
+   ReadDisk() and WriteDisk() but block aligned transfers go straight
+   to the Block I/O protocol */
+EFI_STATUS gpt_disk_read(struct gpt_partition_interface *gpart,
+			 UINT64 offset, UINTN size, VOID *buf);
+EFI_STATUS gpt_disk_write(struct gpt_partition_interface *gpart,
+			  UINT64 offset, UINTN size, VOID *buf);
 EFI_STATUS gpt_get_partition_uuid(const CHAR16 *label, EFI_GUID *uuid, logical_unit_t log_unit);
 EFI_STATUS gpt_get_partition_type(const CHAR16 *label, EFI_GUID *type, logical_unit_t log_unit);
 EFI_STATUS gpt_swap_partition(const CHAR16 *label1, const CHAR16 *label2, logical_unit_t log_unit);
+/* Flush the disk write cache.  Used when the data written must be
+   durable right away: partition table, bootloader.  */
 EFI_STATUS gpt_sync(void);
+/* Flush after partition data writes.  While the flushes are deferred,
+   the data stays in the device write cache until gpt_flush_pending()
+   is called at the end of a batch of commands, or until gpt_sync().  */
+EFI_STATUS gpt_sync_data(void);
+EFI_STATUS gpt_flush_pending(void);
+EFI_STATUS gpt_defer_flush(BOOLEAN defer);
+BOOLEAN gpt_flush_deferred(void);
+
+struct gpt_flush_stats {
+	UINT64 flushes;		/* FlushBlocks() calls */
+	UINT64 usec;		/* Time spent in FlushBlocks() */
+	UINT64 deferred;	/* Flushes left to gpt_flush_pending() */
+};
+
+const struct gpt_flush_stats *gpt_get_flush_stats(void);
+void gpt_reset_flush_stats(void);
 EFI_STATUS gpt_get_partition_handle(const CHAR16 *label, logical_unit_t log_unit, EFI_HANDLE *handle);
 EFI_STATUS gpt_get_header(struct gpt_header **header, UINTN *size, logical_unit_t log_unit);
 EFI_STATUS gpt_get_partitions(struct gpt_partition **partitions, UINTN *size, logical_unit_t log_unit);
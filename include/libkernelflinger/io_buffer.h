@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _IO_BUFFER_H_
+#define _IO_BUFFER_H_
+
+#include <efi.h>
+#include "async_io.h"
+
+/* Large I/O buffers shared by the disk fill and wipe paths.  They are
+   allocated on first use and kept for the following calls, so that
+   the multi-MB buffers are not allocated and freed on every fill.  A
+   buffer is only reallocated if a device needs a larger size or a
+   stricter alignment.
+
+   The buffer size is IO_BUFFER_SIZE rounded up to the device optimal
+   transfer length, when the Block I/O protocol reports it, without
+   exceeding IO_BUFFER_MAX_SIZE.  */
+#define IO_BUFFER_COUNT		2
+#define IO_BUFFER_SIZE		(4 * 1024 * 1024)
+#define IO_BUFFER_MAX_SIZE	(16 * 1024 * 1024)
+
+/* Number of fill writes in flight */
+#ifndef FILL_QUEUE_DEPTH
+#define FILL_QUEUE_DEPTH	ASYNC_IO_MAX_REQUESTS
+#endif
+#if FILL_QUEUE_DEPTH < 1 || FILL_QUEUE_DEPTH > ASYNC_IO_MAX_REQUESTS
+#error "FILL_QUEUE_DEPTH must be between 1 and ASYNC_IO_MAX_REQUESTS"
+#endif
+
+UINTN io_buffer_size(EFI_BLOCK_IO *bio);
+
+/* Return buffer INDEX, suitable for BIO, and its usable SIZE.  The
+   content is undefined.  */
+EFI_STATUS io_buffer_get(EFI_BLOCK_IO *bio, UINTN index, VOID **buf, UINTN *size);
+
+/* Same as io_buffer_get() but the buffer is filled up with the 32
+   bits PATTERN.  The fill is skipped if the buffer already holds
+   PATTERN.  */
+EFI_STATUS io_buffer_get_pattern(EFI_BLOCK_IO *bio, UINTN index, UINT32 pattern,
+				 VOID **buf, UINTN *size);
+
+#endif	/* _IO_BUFFER_H_ */
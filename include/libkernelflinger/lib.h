@@ -95,6 +95,36 @@ EFI_STATUS set_efi_variable(const EFI_GUID *guid, CHAR16 *key,
 EFI_STATUS set_efi_variable_str(const EFI_GUID *guid, CHAR16 *key,
                 BOOLEAN nonvol, BOOLEAN runtime, CHAR16 *val);
 
+/* The loader and fastboot GUID variables are only written by
+   Kernelflinger: their reads are cached and the helpers above keep
+   the cache in sync.  Code calling RT->SetVariable() directly must
+   invalidate the cached copy.  */
+void efi_variable_cache_invalidate(const EFI_GUID *guid, CHAR16 *key);
+
+/* Index of the variable names of the store.  It is built once, with
+   GetNextVariableName(), and rebuilt after Kernelflinger created or
+   deleted a variable or after efi_variable_cache_invalidate().  The
+   returned array is valid until then.  */
+struct efi_var_name {
+        EFI_GUID guid;
+        CHAR16 *name;
+        UINT32 hash;
+};
+
+EFI_STATUS efi_variable_list(const struct efi_var_name **names, UINTN *nb);
+/* Find the GUID of the only variable named NAME, including the
+   deferred writes.  Return EFI_UNSUPPORTED if several GUIDs have a
+   variable with this name.  */
+EFI_STATUS efi_variable_find(CHAR16 *name, EFI_GUID *guid);
+
+/* While deferred, the non-volatile writes of cached variables only
+   update the cache.  They reach the variable store on
+   efi_variable_commit(), which must be called before leaving
+   Kernelflinger (reboot, kernel or image start).  Disabling the
+   deferral commits the pending writes.  */
+void efi_variable_defer_writes(BOOLEAN defer);
+EFI_STATUS efi_variable_commit(void);
+
 /*
  * File I/O
  */
@@ -110,6 +140,8 @@ EFI_STATUS file_read(IN EFI_FILE_HANDLE dir, IN const CHAR16 *name,
  * String manipulation
  */
 CHAR16 *stra_to_str(const CHAR8 *stra);
+/* LEN characters of STRA, which does not need to be NUL terminated */
+CHAR16 *stran_to_str(const CHAR8 *stra, UINTN len);
 
 EFI_STATUS str_to_stra(CHAR8 *dst, const CHAR16 *src, UINTN len);
 
@@ -213,6 +245,11 @@ VOID halt_system(VOID) __attribute__ ((noreturn));
 
 VOID pause(UINTN seconds);
 
+/* Wait at most TIMEOUT_USECS microseconds for a key stroke to be
+ * pending on the console input.  Return TRUE as soon as one is, FALSE
+ * on timeout. */
+BOOLEAN wait_for_key(UINT64 timeout_usecs);
+
 VOID reboot(CHAR16 *target, EFI_RESET_TYPE type) __attribute__ ((noreturn));
 
 void *memset(void *s, int c, size_t n)
@@ -221,14 +258,22 @@ void *memset(void *s, int c, size_t n)
 int memcmp(const void *s1, const void *s2, size_t n)
     __attribute__((weak));
 
+/* Zero memory with non-temporal stores so that the caches are not
+   polluted.  It does not call any UEFI service and can run on the
+   Application Processors.  */
+void zero_memory_nt(VOID *buf, UINTN len);
+
+/* memchr() with SSE2 for large buffers: return a pointer to the
+   first byte equal to C in the N bytes at S or NULL.  */
+const void *mem_find(const void *s, int c, UINTN n);
+
 EFI_STATUS alloc_aligned(VOID **free_addr, VOID **aligned_addr,
                          UINTN size, UINTN align);
 
-void sort_memory_map(void *descr, UINTN nr_descr, UINTN descr_sz);
-
 UINT64 efi_time_to_ctime(EFI_TIME *time);
 
 VOID cpuid(UINT32 op, UINT32 reg[4]);
+VOID cpuid_count(UINT32 op, UINT32 count, UINT32 reg[4]);
 
 EFI_STATUS generate_random_numbers(CHAR8 *data, UINTN size);
 
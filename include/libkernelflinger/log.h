@@ -39,9 +39,87 @@
 
 EFI_STATUS log_flush_to_var(BOOLEAN nonvol);
 
+/* When Kernelflinger is built with KERNELFLINGER_LOG_PARTITION, the
+   log is appended to a ring in that partition instead of the LOG_VAR
+   EFI variable.  The messages are buffered and only written, with
+   block aligned writes, by log_flush_to_partition().  The log is kept
+   across boots, it is lost on a device state transition.
+
+   The partition starts with a log_part_header block.  The data ring
+   begins at LOG_PART_DATA_OFFSET, HEAD is the offset of the next
+   write in the ring and WRITTEN the total number of bytes written.
+   These functions return EFI_UNSUPPORTED if the log partition is not
+   configured.  */
+#define LOG_PART_MAGIC		"KFLOGS"
+#define LOG_PART_VERSION	1
+#define LOG_PART_DATA_OFFSET	4096
+
+struct log_part_header {
+	CHAR8 magic[8];
+	UINT32 version;
+	UINT32 block_size;
+	UINT64 data_offset;
+	UINT64 data_size;
+	UINT64 head;
+	UINT64 written;
+};
+
+EFI_STATUS log_flush_to_partition(void);
+/* Return the log saved in the partition, oldest first.  BUF must be
+   freed with FreePool().  */
+EFI_STATUS log_read_partition(CHAR8 **buf, UINTN *size);
+EFI_STATUS log_reset_partition(void);
+
+enum log_level {
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_ERROR
+};
+
+/* The messages are recorded in a ring buffer and written to the
+   serial port by log_flush(), which is called at idle points such as
+   the transport loop or before the kernel handover.  The warning and
+   error messages are written right away.  log() and debug() can be
+   used by the MP pool work functions.  */
+void log_at(UINT8 level, const CHAR16 *fmt, ...);
+void vlog_at(UINT8 level, const CHAR16 *fmt, va_list args);
+void log_flush(void);
+
 void log(const CHAR16 *fmt, ...);
 void vlog(const CHAR16 *fmt, va_list args);
 
+/* Each module has a runtime log level, the messages below it are
+   skipped by the debug(), info() and warning() macros before their
+   arguments are evaluated.  A source file selects its module by
+   defining LOG_MODULE before including any header, the other files
+   and the log() function use LOG_MODULE_DEFAULT.  The levels are
+   saved in the LOG_LEVEL_VAR EFI variable, one byte per module.  */
+enum log_module {
+	LOG_MODULE_DEFAULT,
+	LOG_MODULE_GPT,
+	LOG_MODULE_SPARSE,
+	LOG_MODULE_FLASH,
+	LOG_MODULE_FASTBOOT,
+	LOG_MODULE_COUNT
+};
+
+#ifndef LOG_MODULE
+#define LOG_MODULE LOG_MODULE_DEFAULT
+#endif
+
+extern UINT8 log_levels[LOG_MODULE_COUNT];
+
+#define log_enabled(level) ((level) >= log_levels[LOG_MODULE])
+
+EFI_STATUS log_load_levels(void);
+EFI_STATUS log_save_levels(void);
+const char *log_module_name(UINTN module);
+const char *log_level_name(UINT8 level);
+/* Return the module or level matching NAME, -1 if none */
+INTN log_module_from_name(const char *name);
+INTN log_level_from_name(const char *name);
+
 #ifdef __DISABLE_DEBUG_PRINT
 #define DEBUG_MESSAGES 0
 #else
@@ -54,12 +132,14 @@ void vlog(const CHAR16 *fmt, va_list args);
 
 #if DEBUG_MESSAGES
 #define debug(fmt, ...) do { \
-    log(fmt "\n", ##__VA_ARGS__); \
+    if (log_enabled(LOG_LEVEL_DEBUG)) \
+      log_at(LOG_LEVEL_DEBUG, fmt "\n", ##__VA_ARGS__); \
 } while(0)
 
 #ifdef USE_UI
 #define info(fmt, ...) do { \
-  log(fmt "\n", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_INFO)) \
+    log_at(LOG_LEVEL_INFO, fmt "\n", ##__VA_ARGS__); \
   if (ui_is_ready()) { \
     ui_info(fmt, ##__VA_ARGS__); \
   } else \
@@ -68,7 +148,8 @@ void vlog(const CHAR16 *fmt, va_list args);
 } while(0)
 
 #define info_n(fmt, ...) do { \
-  log(fmt "", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_INFO)) \
+    log_at(LOG_LEVEL_INFO, fmt "", ##__VA_ARGS__); \
   if (ui_is_ready()) { \
     ui_info_n(fmt, ##__VA_ARGS__); \
   } else \
@@ -77,7 +158,8 @@ void vlog(const CHAR16 *fmt, va_list args);
 } while(0)
 
 #define warning(fmt, ...) do { \
-  log(fmt "\n", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_WARNING)) \
+    log_at(LOG_LEVEL_WARNING, fmt "\n", ##__VA_ARGS__); \
   if (ui_is_ready()) { \
     ui_print(fmt, ##__VA_ARGS__); \
   } else \
@@ -86,7 +168,8 @@ void vlog(const CHAR16 *fmt, va_list args);
 } while(0)
 
 #define warning_n(fmt, ...) do { \
-  log(fmt "", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_WARNING)) \
+    log_at(LOG_LEVEL_WARNING, fmt "", ##__VA_ARGS__); \
   if (ui_is_ready()) { \
     ui_warning(fmt, ##__VA_ARGS__); \
   } else \
@@ -95,22 +178,26 @@ void vlog(const CHAR16 *fmt, va_list args);
 } while(0)
 #else /* USE_UI */
 #define warning(fmt, ...) do { \
-  log(fmt "\n", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_WARNING)) \
+    log_at(LOG_LEVEL_WARNING, fmt "\n", ##__VA_ARGS__); \
   log_flush_to_var(TRUE); \
 } while(0)
 
 #define warning_n(fmt, ...) do { \
-  log(fmt "", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_WARNING)) \
+    log_at(LOG_LEVEL_WARNING, fmt "", ##__VA_ARGS__); \
   log_flush_to_var(TRUE); \
 } while(0)
 
 #define info(fmt, ...) do { \
-  log(fmt "\n", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_INFO)) \
+    log_at(LOG_LEVEL_INFO, fmt "\n", ##__VA_ARGS__); \
   log_flush_to_var(TRUE); \
 } while(0)
 
 #define info_n(fmt, ...) do { \
-  log(fmt "", ##__VA_ARGS__); \
+  if (log_enabled(LOG_LEVEL_INFO)) \
+    log_at(LOG_LEVEL_INFO, fmt "", ##__VA_ARGS__); \
   log_flush_to_var(TRUE); \
 } while(0)
 #endif /* USE_UI */
@@ -126,7 +213,7 @@ void vlog(const CHAR16 *fmt, va_list args);
 
 #ifdef USE_UI
 #define error(x, ...) do { \
-  log(x "\n", ##__VA_ARGS__); \
+  log_at(LOG_LEVEL_ERROR, x "\n", ##__VA_ARGS__); \
   if (ui_is_ready()) { \
     ui_error(x, ##__VA_ARGS__); \
   } else \
@@ -135,7 +222,7 @@ void vlog(const CHAR16 *fmt, va_list args);
 } while(0)
 #else
 #define error(x, ...) do { \
-  log(x "\n", ##__VA_ARGS__); \
+  log_at(LOG_LEVEL_ERROR, x "\n", ##__VA_ARGS__); \
   log_flush_to_var(TRUE); \
 } while(0)
 #endif  /* USE_UI */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _LP_METADATA_H_
+#define _LP_METADATA_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Logical partitions of the dynamic partitions "super" partition, as
+   described by its LP metadata (geometry, header, partition and
+   extent tables).  */
+
+#define LP_NAME_LEN	36
+
+/* A logical partition extent, a range of the super partition.  ZERO
+   extents have no storage and read as zeroes.  */
+struct lp_extent {
+	UINT64 offset;		/* In bytes, from the super partition start */
+	UINT64 size;		/* In bytes */
+	BOOLEAN zero;
+};
+
+struct lp_partition {
+	CHAR16 name[LP_NAME_LEN + 1];
+	UINT32 attributes;
+	UINT64 size;		/* Sum of the extent sizes */
+	UINT32 nb_extents;
+	struct lp_extent *extents;
+};
+
+/* Find the logical partition NAME, or NAME with the active slot
+   suffix, in the metadata slot of the active slot.  The parsed
+   metadata is kept until the GPT cache or the active slot changes,
+   *PART and SUPER, if not NULL, are only valid until then.  SUPER
+   gets the super partition.  */
+EFI_STATUS lp_get_partition(const CHAR16 *name, const struct lp_partition **part,
+			    struct gpt_partition_interface *super);
+
+/* Fill GPARTI as a virtual partition spanning the single extent of
+   the logical partition NAME, see lp_get_partition().  Such a
+   partition can be read, hashed or written like a GPT partition.  It
+   has the super partition GUIDs.  EFI_UNSUPPORTED is returned if the
+   logical partition is not made of a single storage extent.  */
+EFI_STATUS lp_get_partition_interface(const CHAR16 *name,
+				      struct gpt_partition_interface *gparti);
+
+/* Drop the parsed metadata if [OFFSET, OFFSET + SIZE) of BIO's disk
+   overlaps the super partition metadata, or unconditionally if BIO
+   is NULL.  It is called by blkcache_invalidate().  */
+void lp_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size);
+
+#endif	/* _LP_METADATA_H_ */
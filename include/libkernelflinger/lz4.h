@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#include <efi.h>
+
+/* Callback receiving the decompressed data */
+typedef EFI_STATUS (*lz4_output_t)(VOID *data, UINTN size);
+
+BOOLEAN is_lz4_frame(VOID *data, UINTN size);
+
+/* Resumable LZ4 frame decoder.  The compressed data can be provided
+   in fragments of arbitrary size.  The decompressed data is handed to
+   OUTPUT block by block, the memory used is bounded by the maximum
+   block size of the frame plus the 64 KB history window.  */
+EFI_STATUS lz4_stream_start(lz4_output_t output);
+EFI_STATUS lz4_stream_write(VOID *data, UINTN size);
+EFI_STATUS lz4_stream_end(void);
+
+/* LZ4 frame encoder producing independent blocks of up to
+   LZ4_FRAME_BLOCK_SIZE bytes without checksum.  It does not make any
+   memory allocation nor call any UEFI service so the blocks can be
+   compressed on the Application Processors.  */
+#define LZ4_FRAME_BLOCK_SIZE	(1024 * 1024)
+#define LZ4_FRAME_HEADER_SIZE	7
+#define LZ4_BLOCK_HEADER_SIZE	4
+#define LZ4_FRAME_END_SIZE	4
+#define LZ4_HASH_LOG		12
+#define LZ4_HASH_SIZE		(1 << LZ4_HASH_LOG)
+/* Size of the buffer receiving a block of SIZE bytes */
+#define LZ4_FRAME_BLOCK_BOUND(size)	(LZ4_BLOCK_HEADER_SIZE + (size))
+
+UINTN lz4_frame_header(VOID *buf);
+/* Compress the SIZE bytes of SRC, at most LZ4_FRAME_BLOCK_SIZE, as a
+   block into DST using the LZ4_HASH_SIZE entries TABLE.  Return the
+   block size, header included.  */
+UINTN lz4_frame_block(const VOID *src, UINTN size, VOID *dst, UINT32 *table);
+UINTN lz4_frame_end(VOID *buf);
+
+/* LZ4 legacy format, used for the Linux kernel initramfs: a magic
+   number followed by independent blocks which all decompress to
+   LZ4_LEGACY_BLOCK_SIZE bytes but the last one.  The blocks are
+   decompressed in parallel on the Application Processors into
+   LZ4_LEGACY_BLOCK_SIZE slots of DST, DST_SIZE must be large enough
+   for lz4_legacy_block_count() of them.  */
+#define LZ4_LEGACY_BLOCK_SIZE	(8 * 1024 * 1024)
+#define LZ4_LEGACY_MAX_BLOCKS	64
+
+BOOLEAN is_lz4_legacy(VOID *data, UINTN size);
+EFI_STATUS lz4_legacy_block_count(VOID *data, UINTN size, UINTN *count);
+EFI_STATUS lz4_legacy_decompress(VOID *src, UINTN size, VOID *dst,
+				 UINTN dst_size, UINTN *produced);
+
+#endif	/* _LZ4_H_ */
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MEMMAP_H_
+#define _MEMMAP_H_
+
+#include <efi.h>
+
+/* Descriptor arrays of up to MEMMAP_MAX_DESCR entries of at most
+   MEMMAP_MAX_DESCR_SZ bytes are sorted without any allocation:
+   insertion sort while the array is nearly sorted, which is the
+   common case for a firmware memory map, radix sort on the page
+   number otherwise.  Larger arrays fall back to qsort().  The
+   scratch buffers are static: these functions must not be used from
+   the MP pool work functions.  */
+#define MEMMAP_MAX_DESCR	512
+#define MEMMAP_MAX_DESCR_SZ	128
+
+/* Sort by physical start address, in place */
+void sort_memory_map(void *descr, UINTN nr_descr, UINTN descr_sz);
+
+/* Merge the adjacent descriptors of a sorted array which have the
+   same type and attributes.  Return the new number of
+   descriptors.  */
+UINTN memmap_coalesce(void *descr, UINTN nr_descr, UINTN descr_sz);
+
+/* Sorted and coalesced copy of the current memory map.  The memory
+   map is fetched in a buffer kept across calls and the copy is only
+   rebuilt when the memory map key changes.  The returned array
+   belongs to this module and is valid until the next call.  KEY is
+   optional.
+
+   The copy must not be handed over to the kernel: it does not
+   describe the firmware memory map descriptor by descriptor.  */
+EFI_STATUS memmap_get(CHAR8 **descr, UINTN *nr_descr, UINTN *descr_sz,
+		      UINTN *key);
+
+#endif	/* _MEMMAP_H_ */
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+#ifndef _MEMTRACK_H_
+#define _MEMTRACK_H_
+
+#include <efi.h>
+#include <efilib.h>
+
+/* Allocation tracking.  When built with MEMTRACK, the allocations
+   made through the mt_* wrappers are recorded with their call site
+   and accounted, live and peak bytes, per subsystem tag.  Without
+   MEMTRACK, the wrappers are the plain UEFI allocation calls.
+
+   Freeing a tracked buffer with a plain FreePool() only leaves a
+   stale record, shown as live.  The tracking is not thread-safe: it
+   must not be used from the MP pool work functions.  */
+
+enum memtrack_tag {
+	MT_MISC = 0,
+	MT_DOWNLOAD,		/* fastboot download buffer */
+	MT_FLASH,		/* write-behind and delta flash buffers */
+	MT_SPARSE,
+	MT_HASH,		/* get-hashes and verify-hashtree segments */
+	MT_BOOTIMG,
+	MT_AVB,			/* libavb allocations and arena chunks */
+	MT_TAG_LAST
+};
+
+#ifdef MEMTRACK
+
+#define MEMTRACK_MAX_RECORDS	1024
+
+struct memtrack_stats {
+	UINT64 live;		/* Bytes */
+	UINT64 peak;
+	UINT64 allocs;
+	UINT64 frees;
+	UINT64 failures;
+	UINT64 last_failure;	/* Size of the last failed allocation */
+};
+
+struct memtrack_site {
+	const char *file;
+	UINT32 line;
+	enum memtrack_tag tag;
+	UINTN count;		/* Live allocations */
+	UINT64 live;
+};
+
+void memtrack_add(enum memtrack_tag tag, const void *ptr, UINTN size,
+		  const char *file, UINT32 line);
+void memtrack_del(const void *ptr);
+void memtrack_failure(enum memtrack_tag tag, UINTN size,
+		      const char *file, UINT32 line);
+
+void *memtrack_pool(enum memtrack_tag tag, UINTN size, BOOLEAN zero,
+		    const char *file, UINT32 line);
+void memtrack_free_pool(void *ptr);
+EFI_STATUS memtrack_alloc_aligned(enum memtrack_tag tag, VOID **free_addr,
+				  VOID **aligned_addr, UINTN size, UINTN align,
+				  const char *file, UINT32 line);
+
+const char *memtrack_tag_name(enum memtrack_tag tag);
+/* Per tag statistics, MT_TAG_LAST is the total.  */
+const struct memtrack_stats *memtrack_get_stats(enum memtrack_tag tag);
+/* Fill SITES with up to MAX call sites, largest live bytes first.
+   Return the number of sites.  */
+UINTN memtrack_get_sites(struct memtrack_site *sites, UINTN max);
+/* Number of allocations which could not be recorded.  */
+UINT64 memtrack_dropped(void);
+/* Restart the peak measurements from the live bytes.  */
+void memtrack_reset_peaks(void);
+
+#define mt_pool_alloc(tag, size) \
+	memtrack_pool(tag, size, FALSE, __FILE__, __LINE__)
+#define mt_pool_zalloc(tag, size) \
+	memtrack_pool(tag, size, TRUE, __FILE__, __LINE__)
+#define mt_pool_free(ptr) memtrack_free_pool(ptr)
+#define mt_alloc_aligned(tag, free_addr, aligned_addr, size, align)	\
+	memtrack_alloc_aligned(tag, free_addr, aligned_addr, size, align, \
+			       __FILE__, __LINE__)
+/* Record allocations made by other means, e.g. AllocatePages() */
+#define mt_track(tag, ptr, size) \
+	memtrack_add(tag, ptr, size, __FILE__, __LINE__)
+#define mt_untrack(ptr) memtrack_del(ptr)
+#define mt_failure(tag, size) \
+	memtrack_failure(tag, size, __FILE__, __LINE__)
+
+#else
+
+#define mt_pool_alloc(tag, size) AllocatePool(size)
+#define mt_pool_zalloc(tag, size) AllocateZeroPool(size)
+#define mt_pool_free(ptr) FreePool(ptr)
+#define mt_alloc_aligned(tag, free_addr, aligned_addr, size, align)	\
+	alloc_aligned(free_addr, aligned_addr, size, align)
+#define mt_track(tag, ptr, size) do { (void)(ptr); (void)(size); } while (0)
+#define mt_untrack(ptr) do { (void)(ptr); } while (0)
+#define mt_failure(tag, size) do { (void)(size); } while (0)
+
+#endif	/* MEMTRACK */
+
+#endif	/* _MEMTRACK_H_ */
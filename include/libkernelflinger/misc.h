@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _MISC_H_
+#define _MISC_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Access to the head of the misc partition which holds the BCB and
+   the slot metadata (struct bootloader_message_ab).  The whole
+   region is read in one aligned read at first use and the later reads
+   are served from memory.  The writes update the in-memory copy, the
+   modified blocks reach the disk in a single aligned write on
+   misc_commit(), right away unless the writes are deferred.  OFFSET
+   is relative to the partition start, a range which is not in the
+   region returns EFI_NOT_FOUND.  */
+EFI_STATUS misc_read(UINT64 offset, UINTN size, VOID *buf);
+EFI_STATUS misc_write(UINT64 offset, UINTN size, const VOID *buf);
+EFI_STATUS misc_commit(void);
+
+/* While deferred, misc_write() only updates the in-memory copy.
+   misc_commit() must be called before leaving Kernelflinger.
+   Disabling the deferral commits the pending writes.  */
+void misc_defer_writes(BOOLEAN defer);
+
+/* Drop the in-memory copy if [OFFSET, OFFSET + SIZE) of BIO's disk
+   overlaps it, or unconditionally if BIO is NULL.  It is called by
+   blkcache_invalidate() so any disk write keeps it coherent.  */
+void misc_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size);
+
+#endif	/* _MISC_H_ */
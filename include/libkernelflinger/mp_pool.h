@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifndef _MP_POOL_H_
+#define _MP_POOL_H_
+
+#include <efi.h>
+
+/* Work function processing the items [START, END) of a job.  It is
+   run concurrently on the Application Processors: it must not call
+   any UEFI service, must not log but with log() and debug() and must
+   only touch data which is private to its range or protected by
+   atomic operations.  */
+typedef void (*mp_work_t)(UINTN start, UINTN end, VOID *ctx);
+
+/* Worker pool on top of EFI_MP_SERVICES_PROTOCOL.  The COUNT items of
+   a job are handed out by chunks of CHUNK items to the APs and to the
+   BSP.  When the MP services are not available, or there is no
+   enabled AP, jobs are run serially on the BSP.  Only one job can be
+   in progress at a time.  */
+
+/* Start a job on the APs and return immediately.  The completion is
+   reported through firmware timer events: the caller must run at
+   TPL_APPLICATION until mp_pool_wait() returns.  */
+EFI_STATUS mp_pool_start(UINTN count, UINTN chunk, mp_work_t fn, VOID *ctx);
+/* The BSP helps with the job then waits for the APs to complete */
+EFI_STATUS mp_pool_wait(void);
+/* Start a detached job: it does not hold the pool, starting another
+   job first completes it.  *STATUS is EFI_NOT_READY until the job is
+   completed, it is then the mp_pool_wait() status.  A detached job
+   must be joined before raising the TPL or leaving the boot services.
+   */
+EFI_STATUS mp_pool_start_detached(UINTN count, UINTN chunk, mp_work_t fn,
+				  VOID *ctx, EFI_STATUS *status);
+/* Complete the detached job reporting to STATUS if it is still in
+   progress */
+EFI_STATUS mp_pool_join(EFI_STATUS *status);
+/* Run a job to completion.  The APs are started in blocking mode so it
+   can be called at a raised TPL; the BSP processes whatever the APs
+   left.  */
+EFI_STATUS parallel_for(UINTN count, UINTN chunk, mp_work_t fn, VOID *ctx);
+
+/* Number of processors running the jobs, BSP included */
+UINTN mp_pool_cpu_count(void);
+
+#endif	/* _MP_POOL_H_ */
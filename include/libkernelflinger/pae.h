@@ -35,6 +35,8 @@
 
 EFI_STATUS pae_init(CHAR8 *entries, UINTN nr_entries, UINTN entry_sz);
 EFI_STATUS pae_map(EFI_PHYSICAL_ADDRESS addr, unsigned char **to, UINT64 *len);
+/* Longest run of memory a single pae_map() call can return */
+UINT64 pae_max_map_size(void);
 EFI_STATUS pae_exit(void);
 
 #endif	/* _PAE_H_ */
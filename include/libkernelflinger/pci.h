@@ -83,4 +83,65 @@ EFI_STATUS get_pci_device(IN EFI_DEVICE_PATH *p, OUT EFI_PCI_IO **p_pciio);
  */
 EFI_STATUS get_pci_ids(IN EFI_PCI_IO *pciio, OUT pci_device_ids_t *ids);
 
+/* Maximum size of a function configuration space, only the first 256
+ * bytes are reachable without MMCONFIG */
+#define PCI_CONFIG_SIZE		4096
+#define PCI_LEGACY_CONFIG_SIZE	256
+
+struct pci_function {
+	UINT8 bus;
+	UINT8 device;
+	UINT8 function;
+	UINT8 header_type;
+	UINT16 vendor_id;
+	UINT16 device_id;
+	UINT8 revision;
+	UINT8 class_interface;
+	UINT8 class_sub;
+	UINT8 class_base;
+	UINT32 bar[6];
+};
+
+/**
+ * pci_config_read:
+ * @bus, @device, @function - Function address on segment 0
+ * @offset - Byte offset in the configuration space, 32-bit aligned
+ * @buf - Destination buffer
+ * @size - Number of bytes to read, multiple of 4
+ *
+ * Reads the configuration space through the MMCONFIG (ECAM) window
+ * described by the ACPI MCFG table, or through the 0xCF8/0xCFC I/O
+ * ports if there is no MCFG table.
+ *
+ * Returns:
+ * EFI_SUCCESS - The operation succeeded
+ * EFI_INVALID_PARAMETER if the range is misaligned or out of the
+ * reachable configuration space
+ */
+EFI_STATUS pci_config_read(UINT8 bus, UINT8 device, UINT8 function,
+			   UINT16 offset, VOID *buf, UINTN size);
+
+/**
+ * pci_get_functions:
+ * @functions - Set to the array of PCI functions present
+ * @count - Set to the number of entries of @functions
+ *
+ * The bus is scanned on the first call only, the array belongs to
+ * this module and must not be freed.
+ *
+ * Returns:
+ * EFI_SUCCESS - The operation succeeded
+ * EFI_OUT_OF_RESOURCES if the snapshot could not be allocated
+ */
+EFI_STATUS pci_get_functions(const struct pci_function **functions,
+			     UINTN *count);
+
+/**
+ * pci_config_size:
+ *
+ * Returns: the number of configuration space bytes that
+ * pci_config_read() can reach per function
+ */
+UINTN pci_config_size(void);
+
 #endif	/* _PCI_H_ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+/* Number of regions which can be prefetched at the same time and
+   their total size limit.  */
+#define PREFETCH_MAX_REGIONS	12
+#define PREFETCH_MAX_SIZE	(64 * 1024 * 1024)
+
+/* Partition data prefetch.  prefetch_partition() submits the read of
+   SIZE bytes at OFFSET of the LABEL partition through the async I/O
+   layer, SIZE being clamped to the partition end, and returns right
+   away, so that the data is read while the
+   caller does something else.  A later read covered by a prefetched
+   region is served from memory by prefetch_read(), which first waits
+   for the region to be read if needed.  Prefetching a region which is
+   already covered is a no-op.  */
+EFI_STATUS prefetch_partition(const CHAR16 *label, UINT64 offset, UINTN size);
+/* Same as prefetch_partition() for SIZE bytes at the absolute disk byte
+   OFFSET of GPARTI's disk */
+EFI_STATUS prefetch_disk(struct gpt_partition_interface *gparti,
+			 UINT64 offset, UINTN size);
+/* Copy SIZE bytes at the absolute disk byte OFFSET of GPARTI's disk
+   into BUF.  Return EFI_NOT_FOUND if no prefetched region covers the
+   range, the caller must then read the disk itself.  */
+EFI_STATUS prefetch_read(struct gpt_partition_interface *gparti,
+			 UINT64 offset, UINTN size, VOID *buf);
+/* Drop the regions overlapping [OFFSET, OFFSET + SIZE) on BIO's disk,
+   or all of them if BIO is NULL.  It is called by
+   blkcache_invalidate().  */
+void prefetch_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size);
+/* Wait for the pending reads and free all the regions */
+void prefetch_release(void);
+
+#endif	/* _PREFETCH_H_ */
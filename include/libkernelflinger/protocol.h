@@ -89,4 +89,41 @@ locate_device_path(EFI_GUID *protocol, EFI_DEVICE_PATH **device_path,
 				 handle);
 }
 
+/**
+ * handle_protocol_cached - handle_protocol() through the protocol cache
+ * @handle: the handle being queried
+ * @protocol: the GUID of the protocol
+ * @interface: used to return the protocol interface
+ *
+ * The result of the lookup is kept until an interface of @protocol is
+ * installed or reinstalled, or protocol_cache_invalidate() is called.
+ */
+EFI_STATUS handle_protocol_cached(EFI_HANDLE handle, EFI_GUID *protocol,
+				  void **interface);
+
+/**
+ * locate_protocol_cached - Return the first interface of @protocol,
+ * like LibLocateProtocol(), through the protocol cache
+ * @protocol: the GUID of the protocol
+ * @interface: used to return the protocol interface
+ */
+EFI_STATUS locate_protocol_cached(EFI_GUID *protocol, void **interface);
+
+/**
+ * device_protocol_cached - Return the @protocol interface of the handle
+ * closest to @handle on its device path, through the protocol cache
+ * @handle: the device handle, a block device for instance
+ * @protocol: the protocol of the controller, an erase or pass through
+ *            protocol for instance
+ * @interface: used to return the protocol interface
+ */
+EFI_STATUS device_protocol_cached(EFI_HANDLE handle, EFI_GUID *protocol,
+				  void **interface);
+
+/**
+ * protocol_cache_invalidate - Drop all the cached lookups, to be called
+ * when handles may have been removed
+ */
+void protocol_cache_invalidate(void);
+
 #endif /* __PROTOCOL_H__ */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RANDOM_H_
+#define _RANDOM_H_
+
+#include <efi.h>
+
+/* Random data.  random_get() reads the RDRAND generator directly, it
+   is meant for the small security sensitive requests such as keys,
+   nonces or IVs.  random_bulk() expands an AES-256 counter mode DRBG
+   seeded from RDSEED, or RDRAND when RDSEED is not available, and is
+   meant for large amounts of data such as disk wipes.  The DRBG key
+   is replaced after every request and the DRBG is reseeded every
+   RANDOM_RESEED_SIZE bytes.  Both return EFI_UNSUPPORTED if the CPU
+   lacks the required instructions and EFI_DEVICE_ERROR if the
+   hardware generator keeps failing.  */
+#define RANDOM_RESEED_SIZE	(1ULL << 30)
+
+EFI_STATUS random_get(VOID *buf, UINTN size);
+EFI_STATUS random_bulk(VOID *buf, UINTN size);
+
+#endif	/* _RANDOM_H_ */
@@ -60,6 +60,13 @@ EFI_STATUS read_rpmb_data_frame(void *rpmb_dev, const rpmb_data_frame *data_in_f
 EFI_STATUS write_rpmb_data_frame(void *rpmb_dev, const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
         rpmb_data_frame *data_out_frame, UINT32 out_cnt);
 
+/* The requests issued between rpmb_session_begin() and
+   rpmb_session_end() share a single switch to the RPMB partition and
+   back.  No other access to the storage device is allowed while the
+   session is open.  Sessions can be nested.  */
+EFI_STATUS rpmb_session_begin(void *rpmb_dev);
+EFI_STATUS rpmb_session_end(void *rpmb_dev);
+
 
 EFI_STATUS simulate_get_rpmb_counter(UINT32 *write_counter, const void *key,
 		RPMB_RESPONSE_RESULT *result);
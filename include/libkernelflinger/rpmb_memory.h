@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RPMB_MEMORY_H_
+#define _RPMB_MEMORY_H_
+
+#include "rpmb_storage_common.h"
+
+/* The memory RPMB keeps the RPMB content, the authentication key and
+   the write counter in RAM.  It implements the requests the way an
+   eMMC does, MAC and write counter checks included, so that the RPMB
+   users can be regression-tested and benchmarked without hardware.
+   Everything is lost on reboot.  */
+
+#define RPMB_MEMORY_BLOCKS		16384	/* 4 MB */
+
+struct rpmb_memory_stats {
+	UINT64 requests;		/* Request/response exchanges */
+	UINT64 frames;			/* Frames sent to or read from the device */
+	UINT64 hmacs;			/* HMAC-SHA256 computations, both sides */
+	UINT64 partition_switches;
+	UINT64 blocks_read;
+	UINT64 blocks_written;
+};
+
+rpmb_ops_func_t *get_memory_storage_rpmb_ops(void);
+
+const struct rpmb_memory_stats *rpmb_memory_get_stats(void);
+void rpmb_memory_reset_stats(void);
+
+/* Erase the content, the key and the write counter */
+void rpmb_memory_reset(void);
+
+#endif	/* _RPMB_MEMORY_H_ */
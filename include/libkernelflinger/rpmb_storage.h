@@ -80,4 +80,13 @@ EFI_STATUS read_rpmb_rollback_index(size_t index, UINT64 *out_rollback_index);
 
 EFI_STATUS write_rpmb_keybox_magic(UINT16 offset, void *buffer);
 EFI_STATUS read_rpmb_keybox_magic(UINT16 offset, void *buffer);
+
+/* The physical RPMB device state and rollback index blocks are cached
+   in memory.  Their modified blocks are written back by
+   rpmb_storage_commit(), right away unless the writes are deferred.
+   While deferred, rpmb_storage_commit() must be called before leaving
+   Kernelflinger.  Disabling the deferral commits the pending
+   writes.  */
+EFI_STATUS rpmb_storage_commit(void);
+void rpmb_storage_defer_writes(BOOLEAN defer);
 #endif
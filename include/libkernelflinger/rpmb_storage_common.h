@@ -124,9 +124,20 @@ typedef struct rpmb_ops_func {
 	EFI_STATUS (*write_rpmb_data_frame)(void *rpmb_dev, const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
         rpmb_data_frame *data_out_frame, UINT32 out_cnt);
 
+	/* Optional, for the storage which selects the RPMB partition
+	   before each request */
+	EFI_STATUS (*session_begin)(void *rpmb_dev);
+	EFI_STATUS (*session_end)(void *rpmb_dev);
 }rpmb_ops_func_t;
 
 INT32 rpmb_check_mac(const UINT8 *key, rpmb_data_frame *frames, UINT8 cnt);
+
+/* With the SHA extensions, the inner and outer key pads of the last
+   key are kept to skip the key schedule of the following HMACs.
+   rpmb_hmac_set_key() computes them ahead of time and
+   rpmb_hmac_clear_key() wipes them.  */
+void rpmb_hmac_set_key(const UINT8 key[RPMB_KEY_SIZE]);
+void rpmb_hmac_clear_key(void);
 INT32 rpmb_calc_hmac_sha256(rpmb_data_frame *frames, UINT8 blocks_cnt,
 		const UINT8 key[], UINT32 key_size,
 		UINT8 mac[], UINT32 mac_size);
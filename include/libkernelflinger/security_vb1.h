@@ -48,6 +48,16 @@ UINT8 verify_android_boot_image(
         OUT CHAR16 *target,
         OUT X509 **verifier_cert);
 
+/* Feed the SHA256 state used by verify_android_boot_image() with the
+ * LEN bytes at OFFSET of the BOOTIMAGE boot image as it is loaded.  The
+ * calls must cover the image bytes in order, starting at offset 0, and
+ * stop at the end of the image as reported by its header.  Any other
+ * sequence makes the verification hash the image again.
+ */
+void bootimage_hash_update(const VOID *bootimage, UINTN offset, UINTN len);
+/* Forget the state of BOOTIMAGE, to be called before it is freed */
+void bootimage_hash_discard(const VOID *bootimage);
+
 /* Given a X509 certificate, build the following string:
  * COMMON_NAME:#PUBLIC_KEY_SHA1
  * Where COMMON_NAME is the certificate issuer CN and PUBLIC_KEY_SHA1
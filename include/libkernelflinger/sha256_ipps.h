@@ -31,15 +31,19 @@
 #ifndef __SHA256_IPPS_H__
 #define __SHA256_IPPS_H__
 
+#include <efi.h>
 #include <stdint.h>
 
 typedef struct __attribute__((aligned (16))) __sha256_ipps {
 	uint32_t h[8];
-	uint32_t len;
+	uint64_t len;
 	uint32_t data[16];
 }
 SHA256_IPPS_CTX;
 
+/* The implementation relies on the SHA extensions, check that the CPU
+   provides them before use.  */
+BOOLEAN sha256_ipps_is_supported(void);
 void ippsSHA256_Init(SHA256_IPPS_CTX *ctx);
 void ippsSHA256_Update(SHA256_IPPS_CTX *ctx, uint8_t *buf, int size);
 void ippsSHA256_Final(SHA256_IPPS_CTX *ctx, uint32_t *out);
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _SHA256_MB_H_
+#define _SHA256_MB_H_
+
+#include <efi.h>
+
+/* Multi-buffer SHA-256.  Independent messages are hashed together,
+   one per 32-bit lane of the AVX2 (8 lanes) or AVX-512 (16 lanes)
+   registers.  Jobs are submitted to a manager which returns them as
+   they complete, possibly out of order; sha256_mb_flush() returns
+   the remaining ones once there is nothing left to submit.
+
+   Without a wide SIMD unit enabled on the running processor, or when
+   the SHA extensions are available and beat the 8 AVX2 lanes, the
+   manager has no lane and sha256_mb_submit() hashes the job right
+   away.  No memory is allocated: the manager can be used on the APs.  */
+#define SHA256_MB_DIGEST_SIZE	32
+#define SHA256_MB_BLOCK_SIZE	64
+#define SHA256_MB_MAX_LANES	16
+
+struct sha256_mb_job {
+	/* Message: PREFIX, if any, followed by DATA */
+	const UINT8 *prefix;
+	UINTN prefix_len;
+	const UINT8 *data;
+	UINTN len;
+	UINT8 *digest;		/* SHA256_MB_DIGEST_SIZE bytes */
+	VOID *priv;		/* left to the caller */
+};
+
+struct sha256_mb_lane {
+	struct sha256_mb_job *job;
+	UINT64 block;
+	UINT64 nb_blocks;
+};
+
+struct sha256_mb_mgr {
+	/* Transposed state: word I of lane L is state[I][L] */
+	UINT32 state[8][SHA256_MB_MAX_LANES] __attribute__((aligned(64)));
+	/* Current message block, transposed as well */
+	UINT32 block[16][SHA256_MB_MAX_LANES] __attribute__((aligned(64)));
+	struct sha256_mb_lane lane[SHA256_MB_MAX_LANES];
+	struct sha256_mb_job *done[SHA256_MB_MAX_LANES];
+	UINTN nb_lanes;
+	UINTN busy;
+	UINTN nb_done;
+};
+
+/* Number of lanes available on the running processor, 0 when only
+   the one stream implementations can be used.  */
+UINTN sha256_mb_lanes(void);
+
+void sha256_mb_init(struct sha256_mb_mgr *mgr);
+
+/* Return a completed job, not necessarily JOB, or NULL.  */
+struct sha256_mb_job *sha256_mb_submit(struct sha256_mb_mgr *mgr,
+				       struct sha256_mb_job *job);
+
+/* Return a completed job, NULL when all the submitted jobs have been
+   returned.  */
+struct sha256_mb_job *sha256_mb_flush(struct sha256_mb_mgr *mgr);
+
+#endif	/* _SHA256_MB_H_ */
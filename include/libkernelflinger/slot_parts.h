@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _SLOT_PARTS_H_
+#define _SLOT_PARTS_H_
+
+#include <efi.h>
+#include "gpt.h"
+
+#define SLOT_PARTS_MAX_SLOT	4
+
+/* The partitions of the user logical unit with a slot suffix ("_a",
+   "_b"...), grouped by base name.  NB_SLOT is the number of
+   consecutive slots starting from "_a", LABELS[i] is the label of the
+   slot I partition or an empty string if there is none.  */
+struct slot_part {
+	CHAR16 base[GPT_NAME_LEN];
+	UINTN nb_slot;
+	CHAR16 labels[SLOT_PARTS_MAX_SLOT][GPT_NAME_LEN];
+};
+
+/* Return the slot partitions of BASE, NULL if there are none.  The
+   table is built with a single partition listing after each change
+   of the GPT cache, see gpt_cache_generation(), and the returned
+   entry stays valid until the next change.  */
+const struct slot_part *slot_part_lookup(const CHAR16 *base);
+
+/* Return the slot partitions of which LABEL is one of the slot
+   partitions, NULL if there are none.  */
+const struct slot_part *slot_part_lookup_label(const CHAR16 *label);
+
+#endif	/* _SLOT_PARTS_H_ */
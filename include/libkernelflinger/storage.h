@@ -36,6 +36,19 @@
 #include <efi.h>
 #include "timer.h"
 
+/* The storage backends built in are selected with
+ * KERNELFLINGER_STORAGE_BACKENDS.  Without an explicit selection
+ * every backend is built. */
+#ifndef STORAGE_BACKEND_SELECT
+#define STORAGE_BACKEND_EMMC
+#define STORAGE_BACKEND_UFS
+#define STORAGE_BACKEND_SDCARD
+#define STORAGE_BACKEND_SATA
+#define STORAGE_BACKEND_NVME
+#define STORAGE_BACKEND_VIRTUAL
+#define STORAGE_BACKEND_GENERAL_BLOCK
+#endif
+
 enum storage_type {
 	STORAGE_EMMC,
 	STORAGE_UFS,
@@ -64,6 +77,10 @@ typedef enum {
 
 struct storage {
 	EFI_STATUS (*erase_blocks)(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
+	/* Optional.  Make the blocks read back as zeroes without
+	 * transferring them.  Must return EFI_UNSUPPORTED if the
+	 * device does not guarantee that the blocks read as zeroes. */
+	EFI_STATUS (*write_zeroes)(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
 	EFI_STATUS (*check_logical_unit)(EFI_DEVICE_PATH *p, logical_unit_t log_unit);
 	EFI_STATUS (*get_erase_block_size)(EFI_HANDLE handle, UINTN *erase_blk_size);
 	EFI_STATUS (*set_logical_unit)(UINT64 user_lun,UINT64 factory_lun);
@@ -82,7 +99,29 @@ EFI_STATUS get_boot_device_type(enum storage_type *type);
 EFI_STATUS storage_set_boot_device(EFI_HANDLE device);
 EFI_STATUS storage_check_logical_unit(EFI_DEVICE_PATH *p, logical_unit_t log_unit);
 EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
+/* Start erasing [START, END] in the background through the Erase Block
+ * protocol and return once the request is queued.  Only one erase runs
+ * at a time, a previous one is waited for first.  Return EFI_UNSUPPORTED
+ * if the device has no Erase Block protocol.  storage_erase_wait() waits
+ * for the completion and returns the erase status, once; nothing may be
+ * written to the range before it returns.
+ */
+EFI_STATUS storage_erase_blocks_async(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				      EFI_LBA start, EFI_LBA end);
+EFI_STATUS storage_erase_wait(void);
+EFI_STATUS storage_write_zeroes(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
 EFI_STATUS storage_get_erase_block_size(UINTN *erase_blk_size);
+
+/* LBA range, END is inclusive */
+struct lba_range {
+	EFI_LBA start;
+	EFI_LBA end;
+};
+
+/* Sort the NB ranges and merge the overlapping or adjacent ones in
+   place.  Return the number of merged ranges.  */
+UINTN merge_lba_ranges(struct lba_range *ranges, UINTN nb);
+
 EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 		     VOID *pattern, UINTN pattern_blocks);
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end);
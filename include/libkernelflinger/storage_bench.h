@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _STORAGE_BENCH_H_
+#define _STORAGE_BENCH_H_
+
+#include <efi.h>
+
+#define STORAGE_BENCH_DEFAULT_SIZE	(64 * 1024 * 1024)
+#define STORAGE_BENCH_MAX_BLOCK_SIZE	(4 * 1024 * 1024)
+/* 4 tests, 3 default block sizes and 2 default queue depths */
+#define STORAGE_BENCH_MAX_RESULTS	24
+
+typedef enum storage_bench_test {
+	STORAGE_BENCH_SEQ_READ,
+	STORAGE_BENCH_RAND_READ,
+	STORAGE_BENCH_SEQ_WRITE,
+	STORAGE_BENCH_RAND_WRITE
+} storage_bench_test_t;
+
+struct storage_bench_result {
+	storage_bench_test_t test;
+	UINTN block_size;
+	UINTN queue_depth;
+	UINT64 bytes;
+	UINT64 ops;
+	UINT64 usec;
+};
+
+/* Run the storage benchmark on the LABEL partition of the user
+   logical unit.  The tests cover the first SIZE bytes of the
+   partition, with the BLOCK_SIZE and QUEUE_DEPTH request size and
+   number of requests in flight.  A zero SIZE, BLOCK_SIZE or
+   QUEUE_DEPTH selects the default values, several block sizes and
+   queue depths being tested then.
+
+   The write tests are only run if the partition is a scratch
+   partition (see storage_bench_is_scratch()) and WRITE is TRUE.
+   They fill up the test area with zeroes.
+
+   RESULTS must hold STORAGE_BENCH_MAX_RESULTS entries, the number of
+   results is returned in NB_RESULTS.  */
+EFI_STATUS storage_bench(const CHAR16 *label, UINT64 size, UINTN block_size,
+			 UINTN queue_depth, BOOLEAN write,
+			 struct storage_bench_result *results, UINTN *nb_results);
+
+/* Return TRUE if LABEL content can be destroyed by the write tests */
+BOOLEAN storage_bench_is_scratch(const CHAR16 *label);
+
+const char *storage_bench_test_name(storage_bench_test_t test);
+UINT64 storage_bench_kib_per_sec(const struct storage_bench_result *result);
+UINT64 storage_bench_iops(const struct storage_bench_result *result);
+
+#endif	/* _STORAGE_BENCH_H_ */
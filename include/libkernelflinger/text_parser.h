@@ -37,8 +37,44 @@
 #include <efiapi.h>
 
 void skip_whitespace(char **line);
+
+/* Call PARSE_LINE on each non-blank line of DATA, as a NUL
+   terminated copy, leading and trailing whitespace removed, which
+   PARSE_LINE may modify.  */
 EFI_STATUS parse_text_buffer(VOID *data, UINTN size,
 			     EFI_STATUS (*parse_line)(char *line, VOID *ctx),
 			     VOID *context);
 
+/* A piece of text, not NUL terminated.  */
+typedef struct text_slice {
+	const char *str;
+	UINTN len;
+} text_slice_t;
+
+typedef struct text_iter {
+	const char *cur;
+	const char *end;
+	UINTN lineno;
+} text_iter_t;
+
+/* Line iterator over SIZE bytes of DATA.  DATA is not modified and
+   does not need to be NUL terminated: the lines point into it.  */
+void text_iter_init(text_iter_t *iter, const VOID *data, UINTN size);
+/* Get the next non-blank line, leading and trailing whitespace
+   removed.  Return FALSE past the last line.  */
+BOOLEAN text_iter_next(text_iter_t *iter, text_slice_t *line);
+
+/* Same as parse_text_buffer() without any copy: the lines passed to
+   PARSE_LINE point into DATA.  */
+EFI_STATUS parse_text_slices(const VOID *data, UINTN size,
+			     EFI_STATUS (*parse_line)(text_slice_t *line, VOID *ctx),
+			     VOID *context);
+
+void slice_skip_whitespace(text_slice_t *s);
+/* Split S at the first occurrence of C: S is truncated before C and
+   REST, if not NULL, gets what follows C.  Return FALSE if C is not
+   found, S is then left untouched.  */
+BOOLEAN slice_split(text_slice_t *s, char c, text_slice_t *rest);
+BOOLEAN slice_starts_with(const text_slice_t *s, const char *prefix);
+
 #endif	/* _TEXT_PARSER_H_ */
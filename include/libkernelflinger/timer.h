@@ -45,10 +45,22 @@ enum TM_POINT {
 	TM_POINT_LAST
 };
 
+/* TSC frequency in MHz.  It is read from CPUID when the processor
+   or the hypervisor reports it and measured against the firmware
+   Stall() service otherwise.  */
 uint32_t get_cpu_freq(void);
 uint32_t boottime_in_msec(void);
+uint64_t boottime_in_usec(void);
 void set_boottime_stamp(int num);
 void set_efi_enter_point(unsigned int value);
 void construct_stages_boottime(CHAR8 *time_str, size_t buf_len);
+/* Name, as in construct_stages_boottime(), of the stage ending at
+   the NUM TM_POINT */
+const char *boottime_stage_name(int num);
+
+/* Time Stamp Counter based timing of short operations.
+   ticks_to_usec() returns 0 if the CPU frequency is unknown.  */
+uint64_t timer_ticks(void);
+uint64_t ticks_to_usec(uint64_t ticks);
 
 #endif
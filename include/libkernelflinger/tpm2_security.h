@@ -42,6 +42,12 @@
 EFI_STATUS tpm2_init(void);
 EFI_STATUS tpm2_end(void);
 
+/* The NV index reads, writes and locks issued between
+   tpm2_batch_begin() and tpm2_batch_end() share a single PCR policy
+   session.  Batches nest.  */
+EFI_STATUS tpm2_batch_begin(void);
+EFI_STATUS tpm2_batch_end(void);
+
 EFI_STATUS tpm2_fuse_trusty_seed(void);
 EFI_STATUS tpm2_read_trusty_seed(UINT8 seed[TRUSTY_SEED_SIZE]);
 
@@ -56,6 +62,26 @@ EFI_STATUS tpm2_show_index(UINT32 index, uint8_t *out_buffer, UINTN out_buffer_s
 EFI_STATUS tpm2_delete_index(UINT32 index);
 #endif  // USER
 
+enum tpm2_bench_test {
+	TPM2_BENCH_GET_CAPABILITY,
+	TPM2_BENCH_GET_RANDOM,
+	TPM2_BENCH_NV_READ_PUBLIC,
+	TPM2_BENCH_PCR_READ,
+	TPM2_BENCH_LAST
+};
+
+struct tpm2_bench_result {
+	UINTN count;		/* Number of successful commands */
+	UINT64 total_usec;
+	UINT64 max_usec;
+};
+
+/* Run each test ITERATIONS times.  A test whose command fails, like
+   the NV public area read when the Trusty seed index is not
+   provisioned, gets a zero COUNT.  */
+EFI_STATUS tpm2_bench(UINTN iterations, struct tpm2_bench_result results[TPM2_BENCH_LAST]);
+const char *tpm2_bench_test_name(enum tpm2_bench_test test);
+
 EFI_STATUS tpm2_fuse_lock_owner(void);
 EFI_STATUS tpm2_fuse_provision_seed(void);
 #endif /* _TPM2_SECURITY_H_ */
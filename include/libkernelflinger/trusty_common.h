@@ -35,5 +35,9 @@
 #include "efilib.h"
 
 EFI_STATUS load_tos_image(OUT VOID **bootimage);
+/* Start reading the TOS image in the background so that it is read
+   while the Android images are verified.  load_tos_image() then uses
+   the prefetched data.  */
+EFI_STATUS tos_image_prefetch(void);
 
 #endif /* _TRUSTY_COMMON_H_ */
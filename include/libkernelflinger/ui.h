@@ -61,7 +61,14 @@ typedef struct image {
 EFI_STATUS ui_image_draw(ui_image_t *image, UINTN x, UINTN y);
 EFI_STATUS ui_image_draw_scale(ui_image_t *image, UINTN x,
 			       UINTN y, UINTN width, UINTN height);
+/* Allocate SCALED->blt with a copy of IMAGE scaled to fit in WIDTH x
+   HEIGHT.  The caller frees SCALED->blt.  */
+EFI_STATUS ui_image_scale(ui_image_t *image, UINTN width, UINTN height,
+			  ui_image_t *scaled);
 ui_image_t *ui_image_get(const char *name);
+/* Return the image NAME without decoding it, its blt field is NULL
+   until ui_image_get() is called.  */
+ui_image_t *ui_image_find(const char *name);
 
 /* Font */
 typedef struct ui_font {
@@ -76,6 +83,19 @@ typedef struct ui_font {
 EFI_STATUS ui_font_init(void);
 ui_font_t *ui_font_get_default(void);
 ui_font_t *ui_font_get(char *name);
+
+/* Return the character C of FONT blended with COLOR over a BG
+   background, a cwidth x cheight BLT tile owned by the glyphs cache.
+   Return NULL if the tile cannot be allocated.  */
+EFI_GRAPHICS_OUTPUT_BLT_PIXEL *ui_font_get_glyph(ui_font_t *font, char c, BOOLEAN bold,
+						 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
+						 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg);
+/* Blend the character C of FONT with COLOR over DST, a BLT buffer
+   of DST_WIDTH pixels wide lines.  */
+void ui_font_blend_glyph(ui_font_t *font, char c, BOOLEAN bold,
+			 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
+			 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *dst, UINTN dst_width);
+void ui_font_free_glyphs(void);
 extern ui_font_t ui_fonts[];
 extern UINTN ui_fonts_nb;
 
@@ -86,6 +106,17 @@ typedef struct textline {
 	BOOLEAN bold;
 } ui_textline_t;
 
+/* Characters and colour of a textarea line as drawn in the BLT
+   buffer */
+typedef struct ui_textarea_line {
+	char *chars;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL color;
+	BOOLEAN bold;
+	/* Columns redrawn by the last refresh, none if first > last */
+	UINTN first;
+	UINTN last;
+} ui_textarea_line_t;
+
 typedef struct ui_textarea {
 	UINTN line_nb;
 	UINTN row_nb;
@@ -97,6 +128,13 @@ typedef struct ui_textarea {
 	UINTN width;
 	UINTN height;
 	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+	/* BLT buffer content, NULL if not tracked */
+	ui_textarea_line_t *drawn;
+	BOOLEAN drawn_valid;
+	/* Screen position of the last draw */
+	BOOLEAN on_screen;
+	UINTN screen_x;
+	UINTN screen_y;
 } ui_textarea_t;
 
 ui_textarea_t *ui_textarea_create(UINTN line_nb, UINTN row_nb, ui_font_t *font,
@@ -118,6 +156,10 @@ void ui_textarea_n(ui_textarea_t *textarea, char *str,
 EFI_STATUS ui_textarea_draw_scale(ui_textarea_t *textarea, UINTN x, UINTN *y,
 				  UINTN width, UINTN height);
 EFI_STATUS ui_textarea_draw(ui_textarea_t *textarea, UINTN x, UINTN y);
+/* Same as ui_textarea_draw() but only the lines and columns which
+   changed since the last draw at the same position are sent to the
+   screen.  */
+EFI_STATUS ui_textarea_update(ui_textarea_t *textarea, UINTN x, UINTN y);
 
 /* EFI Scan codes */
 #ifdef USE_POWER_BUTTON
@@ -171,6 +213,12 @@ EFI_STATUS ui_init(UINTN *width, UINTN *height);
 BOOLEAN ui_is_ready();
 void ui_free(void);
 EFI_STATUS ui_display_vendor_splash(VOID);
+/* Decode the vendor splash on an Application Processor while the
+   caller goes on.  It is drawn by ui_vendor_splash_join(), which is
+   called by the next UI drawing and must be called before raising
+   the TPL or leaving the boot services.  */
+EFI_STATUS ui_display_vendor_splash_async(VOID);
+EFI_STATUS ui_vendor_splash_join(VOID);
 EFI_STATUS ui_fill_area(UINTN x, UINTN y, UINTN width, UINTN height,
 			EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color);
 EFI_STATUS ui_clear_area(UINTN x, UINTN y, UINTN width, UINTN height);
@@ -179,6 +227,11 @@ EFI_STATUS ui_display_texts(const ui_textline_t **texts, UINTN x, UINTN y,
 			    UINTN linesarea, UINTN colsarea);
 EFI_STATUS ui_draw_blt(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, UINTN x, UINTN y,
 		       UINTN width, UINTN height);
+/* Draw the WIDTH x HEIGHT rectangle at SRC_X, SRC_Y of the BLT_WIDTH
+   pixels wide BLT buffer */
+EFI_STATUS ui_draw_blt_rect(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, UINTN blt_width,
+			    UINTN src_x, UINTN src_y, UINTN x, UINTN y,
+			    UINTN width, UINTN height);
 void ui_print(CHAR16 *fmt, ...);
 void ui_info(CHAR16 *fmt, ...);
 void ui_info_n(CHAR16 *fmt, ...);
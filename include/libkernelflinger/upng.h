@@ -39,4 +39,16 @@ EFI_STATUS upng_load(const char *data, UINTN size,
 		     EFI_GRAPHICS_OUTPUT_BLT_PIXEL **blt,
 		     UINTN *width, UINTN *height);
 
+/* upng_load() in three steps.  upng_load_start() parses the PNG
+   headers and allocates the buffers, upng_load_run() decodes the
+   image and upng_load_end() returns the result and releases the
+   decoder.  upng_load_run() does not call any UEFI service: it can
+   be run on an Application Processor.  */
+typedef struct upng upng_t;
+
+EFI_STATUS upng_load_start(const char *data, UINTN size, upng_t **upng,
+			   UINTN *width, UINTN *height);
+void upng_load_run(upng_t *upng);
+EFI_STATUS upng_load_end(upng_t *upng, EFI_GRAPHICS_OUTPUT_BLT_PIXEL **blt);
+
 #endif	/* _UPNG_H_ */
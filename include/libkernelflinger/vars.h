@@ -80,6 +80,19 @@ extern const UINTN FASTBOOT_SECURED_VARS_SIZE;
 /* EFI variable to store the kernelflinger logs.  */
 #define LOG_VAR			L"KernelflingerLogs"
 
+/* EFI variable holding the runtime log level of each module, see
+   log.h.  */
+#define LOG_LEVEL_VAR		L"KernelflingerLogLevel"
+
+/* EFI variable caching the partitions digests computed by Fastboot,
+   see libfastboot/hashes.c.  It is deleted when an OS is started as
+   the OS can write the partitions.  */
+#define HASH_MANIFEST_VAR	L"HashManifest"
+
+/* EFI variable holding the fingerprint of the last boot device
+   chosen by a full storage scan, see libkernelflinger/storage.c.  */
+#define BOOT_DEVICE_FP_VAR	L"BootDeviceFingerprint"
+
 #ifndef USER
 #define CMDLINE_PREPEND_VAR     L"PrependCmdline"
 #define CMDLINE_APPEND_VAR      L"AppendCmdline"
@@ -40,17 +40,78 @@
 typedef void (*data_callback_t)(void *buf, unsigned len);
 typedef void (*start_callback_t)(void);
 
+/* Maximum number of buffers of a vectored write */
+#define TRANSPORT_MAX_IOV	4
+
+typedef struct transport_iov {
+	void *buf;
+	UINT32 len;
+} transport_iov_t;
+
 typedef struct transport {
 	const char *name;
 	EFI_STATUS (*start)(start_callback_t start_cb,
 			    data_callback_t rx_cb,
 			    data_callback_t tx_cb);
 	EFI_STATUS (*stop)(void);
+	/* Optional: end the session but keep the link up, the next
+	   start() resumes it without a new host enumeration.  */
+	EFI_STATUS (*pause)(void);
 	EFI_STATUS (*run)(void);
 	EFI_STATUS (*read)(void *buf, UINT32 size);
 	EFI_STATUS (*write)(void *buf, UINT32 size);
+	/* Optional, stream transports only: write the IOVCNT buffers
+	   of IOV as one transfer, straight from the caller memory.
+	   Several transfers can be in flight.  */
+	EFI_STATUS (*writev)(const transport_iov_t *iov, UINTN iovcnt);
+	/* Preferred read size: the transport completes reads of a
+	   multiple of it without splitting them.  0 if it has none.  */
+	UINT32 transfer_unit;
 } transport_t;
 
+/* A transfer which takes longer than TRANSPORT_STALL_USEC to complete
+   is counted as a stall.  */
+#define TRANSPORT_STALL_USEC	(100 * 1000)
+
+/* Transfer time histogram: bucket N counts the transfers which took
+   less than 2^N microseconds and, but for the first bucket, at least
+   2^(N - 1).  The last bucket also counts the longer transfers.  */
+#define TRANSPORT_HISTOGRAM_SIZE	24
+
+typedef struct transport_dir_stats {
+	UINT64 bytes;
+	UINT64 transfers;
+	UINT64 usec;		/* Cumulated time from request to completion */
+	UINT64 max_usec;
+	UINT64 stalls;
+	UINT64 histogram[TRANSPORT_HISTOGRAM_SIZE];
+	/* Completion sizes.  A partial transfer completed with less
+	   bytes than requested: short packet or network fragment.  */
+	UINT64 min_len;
+	UINT64 max_len;
+	UINT64 partial;
+} transport_dir_stats_t;
+
+typedef struct transport_stats {
+	transport_dir_stats_t rx;
+	transport_dir_stats_t tx;
+	/* Time between a read completion and the next read request */
+	UINT64 rearm_usec;
+	UINT64 rearm_max_usec;
+	UINT64 rearms;
+	/* Time spent waiting for the firmware timer while idle */
+	UINT64 sleep_usec;
+	UINT64 idle_tasks;
+} transport_stats_t;
+
+/* All the registered transports, up to TRANSPORT_MAX, are started
+   together.  The session goes to the first one on which the host
+   sends data: until then, the session first read is posted on every
+   connected transport with at most TRANSPORT_PROBE_SIZE bytes, and
+   the other transports are stopped once one is selected.  */
+#define TRANSPORT_MAX		4
+#define TRANSPORT_PROBE_SIZE	1024
+
 EFI_STATUS transport_register(transport_t *trans, UINTN nb);
 void transport_unregister(void);
 
@@ -58,8 +119,45 @@ EFI_STATUS transport_start(start_callback_t start_cb,
 			   data_callback_t rx_cb,
 			   data_callback_t tx_cb);
 EFI_STATUS transport_stop(void);
+/* Like transport_stop() but the selected transport is paused if it
+   supports it.  The next transport_start() resumes it, or stops it if
+   it is not registered anymore.  */
+EFI_STATUS transport_pause(void);
 EFI_STATUS transport_run(void);
 EFI_STATUS transport_read(void *buf, UINT32 len);
 EFI_STATUS transport_write(void *buf, UINT32 len);
+/* EFI_UNSUPPORTED if the selected transport has no writev().  The
+   IOV array can be reused once the function returns, the buffers must
+   stay untouched until the TX event.  */
+EFI_STATUS transport_writev(const transport_iov_t *iov, UINTN iovcnt);
+BOOLEAN transport_has_writev(void);
+
+/* Preferred read size of the selected transport, 0 if none */
+UINT32 transport_transfer_unit(void);
+
+const transport_stats_t *transport_get_stats(void);
+void transport_reset_stats(void);
+
+/* Histogram bucket of a USEC long transfer */
+UINTN transport_histogram_bucket(UINT64 usec);
+
+/* transport_run() is the fastboot and adb event loop body.  When an
+   iteration completes no transfer, the loop is quiet: the log is
+   flushed and the oldest queued idle task is run.  Once no transfer
+   completed for TRANSPORT_IDLE_SLEEP_USEC and no task is queued, the
+   BSP waits for a firmware timer tick instead of spinning, the
+   transfer completion handlers still run from the firmware timer
+   and event notifications.
+
+   Idle tasks are one-shot and run to completion on the BSP: they must
+   be short to not delay the transfers.  A task can queue itself
+   again to process more work.  */
+#define TRANSPORT_IDLE_SLEEP_USEC	(10 * 1000)
+#define TRANSPORT_IDLE_SLEEP_TICK	10000	/* 1 ms, in 100 ns units */
+#define TRANSPORT_MAX_IDLE_TASKS	8
+
+typedef void (*idle_task_t)(void *ctx);
+
+EFI_STATUS transport_queue_idle_task(idle_task_t task, void *ctx);
 
 #endif	/* _TRANSPORT_H_ */
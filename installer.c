@@ -34,6 +34,7 @@
 #include <efilib.h>
 #include <stdio.h>
 #include <transport.h>
+#include <timer.h>
 #include <version.h>
 
 #include "lib.h"
@@ -81,6 +82,8 @@ static void do_erase(INTN argc, CHAR8 **argv)
 	flush_tx_buffer();
 }
 
+static BOOLEAN pre_erased(void);
+
 static EFI_STATUS find_partition(CHAR8 *target)
 {
 	EFI_STATUS ret;
@@ -150,6 +153,12 @@ static void installer_erase(INTN argc, CHAR8 **argv)
 	if (!argv[1])
 		return;
 
+	if (pre_erased()) {
+		info(L"%a already erased", argv[1]);
+		fastboot_okay("");
+		return;
+	}
+
 	do_erase(argc, argv);
 }
 
@@ -187,490 +196,334 @@ static EFI_STATUS read_file(EFI_FILE *file, UINTN size, void *data)
 	return ret;
 }
 
-typedef struct flash_buffer {
-	struct sparse_header sph;
-	struct chunk_header skip_ckh;
-	union {
-		struct chunk_header ckh;
-		char data[1];
-	} d;
-	char ckh_data[1];
-} __attribute__((__packed__)) flash_buffer_t;
-
-/*when flash big chunks and in two image should add read_flags*/
-static EFI_STATUS installer_flash_big_chunk_multiple(EFI_FILE **file, UINTN *read_flags,
-	UINTN file_size, UINTN *remaining_data, flash_buffer_t *fb, UINTN argc, CHAR8 **argv)
+/* Images larger than the 4 GB FAT32 file size limit are split on the
+   installer medium: IMAGE is then made of the IMAGE.000, IMAGE.001...
+   parts.  */
+#define SPLIT_MAX_PARTS		1000
+
+struct image_files {
+	UINTN num;
+	struct image_file {
+		CHAR16 *name;
+		UINTN size;
+	} *file;
+	UINT64 total;
+};
+
+static BOOLEAN file_available(CHAR16 *filename)
 {
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
-	UINTN payload_size, read_size, already_read, ckh_blks, data_size;
-	const UINTN MAX_DATA_SIZE = dl->max_size - offsetof(flash_buffer_t, ckh_data);
-	const UINTN MAX_BLKS = MAX_DATA_SIZE / fb->sph.blk_sz;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	struct chunk_header *ckh;
-	void *read_ptr;
-
-	ckh = &fb->d.ckh;
-	payload_size = ckh->total_sz - sizeof(*ckh);
-	fb->sph.total_chunks = 2; /* skip and data chunks. */
-
-	for (ckh_blks = ckh->chunk_sz; ckh_blks; ckh_blks -= ckh->chunk_sz) {
-		ckh->chunk_sz = min(MAX_BLKS, ckh_blks);
-		data_size = ckh->chunk_sz * fb->sph.blk_sz;
-		ckh->total_sz = sizeof(*ckh) + data_size;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz + ckh->chunk_sz;
-		installer_flash_buffer(fb, ckh->total_sz + HEADER_SIZE, argc, argv);
-		if (!last_cmd_succeeded)
-			return EFI_INVALID_PARAMETER;
+	EFI_FILE *file;
 
-		payload_size -= data_size;
-		if (!payload_size)
-			break;
+	if (EFI_ERROR(uefi_open_file(file_io_interface, filename, &file)))
+		return FALSE;
 
-		/* Move the incomplete data from the end to the
-		   beginning of the buffer. */
-		read_ptr = fb->ckh_data;
-		read_size = min(payload_size, MAX_DATA_SIZE);
-		if (data_size < MAX_DATA_SIZE) {
-			already_read = MAX_DATA_SIZE - data_size;
-			memcpy(read_ptr, fb->d.data + ckh->total_sz, already_read);
-			read_size -= already_read;
-			read_ptr += already_read;
-			if (read_size > file_size) {
-				ret = read_file(file[*read_flags], file_size, read_ptr);
-				if (EFI_ERROR(ret))
-					return ret;
-				read_size -= file_size;
-				read_ptr += file_size;
-				*remaining_data -= file_size;
-				(*read_flags)++;
-				}
-		}
-		ret = read_file(file[*read_flags], read_size, read_ptr);
-		if (EFI_ERROR(ret))
-			return ret;
-		*remaining_data -= read_size;
+	uefi_call_wrapper(file->Close, 1, file);
+	return TRUE;
+}
+
+static void free_image_files(struct image_files *files)
+{
+	UINTN i;
+
+	for (i = 0; i < files->num; i++)
+		FreePool(files->file[i].name);
+	if (files->file)
+		FreePool(files->file);
+	memset(files, 0, sizeof(*files));
+}
+
+/* Append NAME, which is consumed, to FILES */
+static EFI_STATUS add_image_file(struct image_files *files, CHAR16 *name)
+{
+	EFI_STATUS ret;
+	struct image_file *new_file;
+	UINTN size;
+
+	ret = uefi_get_file_size(file_io_interface, name, &size);
+	if (EFI_ERROR(ret))
+		goto err;
 
-		fb->skip_ckh.chunk_sz += ckh->chunk_sz;
+	new_file = AllocatePool((files->num + 1) * sizeof(*new_file));
+	if (!new_file) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto err;
 	}
 
-	if (payload_size)
-		return EFI_INVALID_PARAMETER;
+	memcpy(new_file, files->file, files->num * sizeof(*new_file));
+	if (files->file)
+		FreePool(files->file);
+	files->file = new_file;
+
+	files->file[files->num].name = name;
+	files->file[files->num].size = size;
+	files->total += size;
+	files->num++;
 
 	return EFI_SUCCESS;
+
+err:
+	FreePool(name);
+	return ret;
 }
 
-/* This function splits a chunk too large to fit into a
-   dl->max_size buffer into smaller chunks and flash them. */
-static EFI_STATUS installer_flash_big_chunk(EFI_FILE *file, UINTN *remaining_data,
-					    flash_buffer_t *fb, UINTN argc, CHAR8 **argv)
+static EFI_STATUS add_split_parts(struct image_files *files, CHAR8 *image)
 {
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
-	UINTN payload_size, read_size, already_read, ckh_blks, data_size;
-	const UINTN MAX_DATA_SIZE = dl->max_size - offsetof(flash_buffer_t, ckh_data);
-	const UINTN MAX_BLKS = MAX_DATA_SIZE / fb->sph.blk_sz;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	struct chunk_header *ckh;
-	void *read_ptr;
-
-	ckh = &fb->d.ckh;
-	payload_size = ckh->total_sz - sizeof(*ckh);
-	fb->sph.total_chunks = 2; /* skip and data chunks. */
-
-	for (ckh_blks = ckh->chunk_sz; ckh_blks; ckh_blks -= ckh->chunk_sz) {
-		ckh->chunk_sz = min(MAX_BLKS, ckh_blks);
-		data_size = ckh->chunk_sz * fb->sph.blk_sz;
-		ckh->total_sz = sizeof(*ckh) + data_size;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz + ckh->chunk_sz;
-
-		installer_flash_buffer(fb, ckh->total_sz + HEADER_SIZE, argc, argv);
-		if (!last_cmd_succeeded)
-			return EFI_INVALID_PARAMETER;
+	EFI_STATUS ret;
+	CHAR16 *name;
+	UINTN part;
 
-		payload_size -= data_size;
-		if (!payload_size)
-			break;
+	for (part = 0; part < SPLIT_MAX_PARTS; part++) {
+		name = PoolPrint(L"%a.%03d", image, part);
+		if (!name)
+			return EFI_OUT_OF_RESOURCES;
 
-		/* Move the incomplete data from the end to the
-		   beginning of the buffer. */
-		read_ptr = fb->ckh_data;
-		read_size = min(payload_size, MAX_DATA_SIZE);
-		if (data_size < MAX_DATA_SIZE) {
-			already_read = MAX_DATA_SIZE - data_size;
-			memcpy(read_ptr, fb->d.data + ckh->total_sz, already_read);
-			read_size -= already_read;
-			read_ptr += already_read;
+		if (part > 0 && !file_available(name)) {
+			FreePool(name);
+			break;
 		}
 
-		ret = read_file(file, read_size, read_ptr);
+		ret = add_image_file(files, name);
 		if (EFI_ERROR(ret))
 			return ret;
-		*remaining_data -= read_size;
-
-		fb->skip_ckh.chunk_sz += ckh->chunk_sz;
 	}
 
-	if (payload_size)
-		return EFI_INVALID_PARAMETER;
-
 	return EFI_SUCCESS;
 }
-/*this function splits a huge sparse file and put together the two image*/
-static void installer_split_and_joint_flash(CHAR16 **filename,
-						UINTN *size, UINTN num, UINTN argc, CHAR8 **argv)
+
+/* Build the list of the files making the NUM NAMES images.  An image
+   missing on the installer medium is looked up as split parts.  */
+static EFI_STATUS get_image_files(struct image_files *files,
+				  CHAR8 **names, INTN num)
 {
 	EFI_STATUS ret;
-	flash_buffer_t *fb;
-	UINTN  read_flags = 0;
-	struct sparse_header sph;
-	struct chunk_header *ckh;
-	UINTN read_size, flash_size, already_read = 0, remaining_data = 0;
-	void *read_ptr;
-	INTN nb_chunks;
-	EFI_FILE *file[num];
-	UINT32 blk_count;
-
-	memset(file, 0, sizeof(file));
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	const UINTN MAX_DATA_SIZE = dl->max_size - HEADER_SIZE;
-	for (UINTN i = 0; i < num; i++) {
-		remaining_data = remaining_data + size[i];
-		ret = uefi_open_file(file_io_interface, filename[i], &file[i]);
-		if (EFI_ERROR(ret)) {
-			inst_perror(ret, "Failed to open %s file", filename[i]);
-			return;
+	CHAR16 *name;
+	INTN i;
+
+	memset(files, 0, sizeof(*files));
+
+	for (i = 0; i < num; i++) {
+		name = stra_to_str(names[i]);
+		if (!name) {
+			ret = EFI_OUT_OF_RESOURCES;
+			goto err;
 		}
-	}
 
-	ret = read_file(file[0], sizeof(sph), &sph);
-	if (EFI_ERROR(ret))
-		return;
-	remaining_data -= sizeof(sph);
-	size[read_flags] -=  sizeof(sph);
-	if (!is_sparse_image((void *) &sph, sizeof(sph))) {
-		fastboot_fail("sparse file expected");
-		return;
-	}
-	fb = dl->data;
-	memcpy(&fb->sph, &sph, sizeof(sph));
-	/* Sparse skip chunk. */
-	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
-	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
-	nb_chunks = sph.total_chunks;
-	read_size = MAX_DATA_SIZE;
-	read_ptr = fb->d.data;
-	blk_count = 0;
-	while (nb_chunks > 0 && remaining_data > 0) {
-		fb->sph.total_chunks = 1;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
-		if (remaining_data < read_size)
-			read_size = remaining_data;
-		/* Read a new piece of the input sparse file. */
-		ret = read_file(file[read_flags], read_size, read_ptr);
-		if (EFI_ERROR(ret))
-			goto exit;
-		remaining_data -= read_size;
-		size[read_flags] -= read_size;
-		/* Process the loaded chunks to build the new header
-		   and the skip chunk. */
-		flash_size = HEADER_SIZE;
-		ckh = &fb->d.ckh;
-		while ((void *)ckh + sizeof(*ckh) <= read_ptr + read_size &&
-				(void *)ckh + ckh->total_sz <= read_ptr + read_size) {
-			if (nb_chunks == 0)
-				goto exit;
-			flash_size += ckh->total_sz;
-			fb->sph.total_blks += ckh->chunk_sz;
-			blk_count += ckh->chunk_sz;
-			fb->sph.total_chunks++;
-			nb_chunks--;
-			ckh = (void *)ckh + ckh->total_sz;
+		if (file_available(name)) {
+			ret = add_image_file(files, name);
+		} else {
+			FreePool(name);
+			ret = add_split_parts(files, names[i]);
 		}
-		/* chunk is too big to fit in the download buffer. */
-		if (flash_size == HEADER_SIZE) {
-			if (ckh->chunk_type != CHUNK_TYPE_RAW ||
-					remaining_data < ckh->total_sz - MAX_DATA_SIZE) {
-				fastboot_fail("Corrupted sparse file");
-				goto exit;
-			}
+		if (EFI_ERROR(ret))
+			goto err;
+	}
 
-			blk_count += ckh->chunk_sz;
-			nb_chunks--;
+	return EFI_SUCCESS;
 
-			ret = installer_flash_big_chunk_multiple(file, &read_flags,
-						size[read_flags], &remaining_data, fb, argc, argv);
-			if (EFI_ERROR(ret))
-				goto exit;
+err:
+	free_image_files(files);
+	return ret;
+}
 
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-			continue;
-		}
+/* The image files are read as a single stream by INSTALLER_READ_SIZE
+   pieces which are streamed to the partition: the write of a piece
+   is in flight while the next one is read, see flash_stream_write().
+   A piece spans the file boundaries so that the number and the size
+   of the files do not change the size of the writes.  */
+#define INSTALLER_READ_SIZE	(4 * 1024 * 1024)
 
-		installer_flash_buffer(dl->data, flash_size, argc, argv);
-		if (!last_cmd_succeeded)
-			goto exit;
-		/* Move the incomplete chunk from the end to the
-		   beginning of the buffer. */
+struct image_reader {
+	struct image_files *files;
+	UINTN cur;
+	EFI_FILE *file;
+	UINTN left;
+};
 
-		if (dl->data + flash_size < read_ptr + read_size) {
-			already_read = read_ptr + read_size - (void *)ckh;
-			memcpy(fb->d.data, ckh, already_read);
-			read_size = MAX_DATA_SIZE - already_read;
-			read_ptr = fb->d.data + already_read;
+static void image_reader_close(struct image_reader *reader)
+{
+	if (reader->file)
+		uefi_call_wrapper(reader->file->Close, 1, reader->file);
+	reader->file = NULL;
+}
 
-		} else {
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-		}
-		if ((read_size > size[read_flags]) && (read_flags != (num - 1))) {
-			ret = read_file(file[read_flags], size[read_flags], read_ptr);
-			if (EFI_ERROR(ret))
-				goto exit;
-			memcpy(fb->d.data+already_read, read_ptr, size[read_flags]);
-			read_size = read_size - size[read_flags];
-			remaining_data  -= size[read_flags];
-			read_ptr = fb->d.data+already_read+size[read_flags];
-			read_flags++;
+static EFI_STATUS image_reader_read(struct image_reader *reader,
+				    CHAR8 *buf, UINTN len)
+{
+	EFI_STATUS ret;
+	CHAR16 *filename;
+	UINTN n;
+
+	while (len) {
+		if (!reader->file) {
+			if (reader->cur == reader->files->num)
+				return EFI_END_OF_FILE;
+			filename = reader->files->file[reader->cur].name;
+			ret = uefi_open_file(file_io_interface, filename,
+					     &reader->file);
+			if (EFI_ERROR(ret)) {
+				inst_perror(ret, "Failed to open %s file", filename);
+				return ret;
 			}
+			reader->left = reader->files->file[reader->cur].size;
+		}
+
+		n = min(len, reader->left);
+		ret = read_file(reader->file, n, buf);
+		if (EFI_ERROR(ret))
+			return ret;
+		buf += n;
+		len -= n;
+		reader->left -= n;
+
+		if (!reader->left) {
+			image_reader_close(reader);
+			reader->cur++;
+		}
 	}
-exit:
-	for (UINTN i = 0; i < num; i++)
-		uefi_call_wrapper(file[i]->Close, 1, file[i]);
+
+	return EFI_SUCCESS;
 }
-/* This function splits a huge sparse file into smaller ones and flash
-   them. */
-static void installer_split_and_flash(CHAR16 *filename, UINTN size,
-				      UINTN argc, CHAR8 **argv)
+
+/* Flash the concatenation of the FILES to LABEL */
+static void installer_stream_flash(struct image_files *files, CHAR8 *label)
 {
 	EFI_STATUS ret;
-	flash_buffer_t *fb;
-	struct sparse_header sph;
-	struct chunk_header *ckh;
-	UINTN read_size, flash_size, already_read, remaining_data = size;
-	void *read_ptr;
-	INTN nb_chunks;
-	EFI_FILE *file;
-	UINT32 blk_count;
-	const UINTN HEADER_SIZE = offsetof(flash_buffer_t, d);
-	const UINTN MAX_DATA_SIZE = dl->max_size - HEADER_SIZE;
+	struct image_reader reader = { .files = files };
+	CHAR16 *label16;
+	UINT64 size;
+	UINTN len, read_size;
 
-	ret = uefi_open_file(file_io_interface, filename, &file);
-	if (EFI_ERROR(ret)) {
-		inst_perror(ret, "Failed to open %s file", filename);
+	label16 = stra_to_str(label);
+	if (!label16) {
+		fastboot_fail("Failed to convert CHAR8 label to CHAR16");
 		return;
 	}
 
-	ret = read_file(file, sizeof(sph), &sph);
-	if (EFI_ERROR(ret))
-		return;
-	remaining_data -= sizeof(sph);
-
-	if (!is_sparse_image((void *) &sph, sizeof(sph))) {
-		fastboot_fail("sparse file expected");
-		return;
+	info(L"Flashing %s ...", label16);
+	ret = flash_stream_start(label16, files->total);
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Cannot stream to %a", label);
+		goto exit;
 	}
 
-	fb = dl->data;
-
-	/* New sparse header. */
-	memcpy(&fb->sph, &sph, sizeof(sph));
-
-	/* Sparse skip chunk. */
-	fb->skip_ckh.chunk_type = CHUNK_TYPE_DONT_CARE;
-	fb->skip_ckh.total_sz = sizeof(fb->skip_ckh);
-
-	nb_chunks = sph.total_chunks;
-	read_size = MAX_DATA_SIZE;
-	read_ptr = fb->d.data;
-	blk_count = 0;
-
-	while (nb_chunks > 0 && remaining_data > 0) {
-		fb->sph.total_chunks = 1;
-		fb->sph.total_blks = fb->skip_ckh.chunk_sz = blk_count;
-
-		if (remaining_data < read_size)
-			read_size = remaining_data;
-
-		/* Read a new piece of the input sparse file. */
-		ret = read_file(file, read_size, read_ptr);
+	read_size = min(dl->max_size, (UINTN)INSTALLER_READ_SIZE);
+	for (size = files->total; size; size -= len) {
+		len = min(size, (UINT64)read_size);
+		ret = image_reader_read(&reader, dl->data, len);
 		if (EFI_ERROR(ret))
-			goto exit;
-		remaining_data -= read_size;
-
-		/* Process the loaded chunks to build the new header
-		   and the skip chunk. */
-		flash_size = HEADER_SIZE;
-		ckh = &fb->d.ckh;
-		while ((void *)ckh + sizeof(*ckh) <= read_ptr + read_size &&
-				(void *)ckh + ckh->total_sz <= read_ptr + read_size) {
-			if (nb_chunks == 0) {
-				fastboot_fail("Corrupted sparse file: too many chunks");
-				goto exit;
-			}
-			flash_size += ckh->total_sz;
-			fb->sph.total_blks += ckh->chunk_sz;
-			blk_count += ckh->chunk_sz;
-			fb->sph.total_chunks++;
-			nb_chunks--;
-			ckh = (void *)ckh + ckh->total_sz;
-		}
-
-		/* chunk is too big to fit in the download buffer. */
-		if (flash_size == HEADER_SIZE) {
-			if (ckh->chunk_type != CHUNK_TYPE_RAW ||
-					remaining_data < ckh->total_sz - MAX_DATA_SIZE) {
-				fastboot_fail("Corrupted sparse file");
-				goto exit;
-			}
-
-			blk_count += ckh->chunk_sz;
-			nb_chunks--;
-
-			ret = installer_flash_big_chunk(file, &remaining_data,
-					fb, argc, argv);
-			if (EFI_ERROR(ret))
-				goto exit;
+			break;
 
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-			continue;
+		ret = flash_stream_write(dl->data, len);
+		if (EFI_ERROR(ret)) {
+			inst_perror(ret, "Failed to flash %a", label);
+			break;
 		}
+	}
+	image_reader_close(&reader);
+	if (EFI_ERROR(ret)) {
+		flash_stream_abort();
+		goto exit;
+	}
 
-		installer_flash_buffer(dl->data, flash_size, argc, argv);
-		if (!last_cmd_succeeded)
-			goto exit;
-
-		/* Move the incomplete chunk from the end to the
-		   beginning of the buffer. */
-		if (dl->data + flash_size < read_ptr + read_size) {
-			already_read = read_ptr + read_size - (void *)ckh;
-			memcpy(fb->d.data, ckh, already_read);
-			read_size = MAX_DATA_SIZE - already_read;
-			read_ptr = fb->d.data + already_read;
-		} else {
-			read_size = MAX_DATA_SIZE;
-			read_ptr = fb->d.data;
-		}
+	ret = flash_stream_end(label16);
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Flash failure");
+		goto exit;
 	}
 
+	gpt_sync();
+	info(L"Flash done.");
+	fastboot_okay("");
+
 exit:
-	uefi_call_wrapper(file->Close, 1, file);
+	FreePool(label16);
 }
 
 static void installer_flash_cmd(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
-	CHAR16 *filename;
-	INTN num = argc - 2;
-	CHAR16 *numname[num];
+	struct image_files files;
+	CHAR16 *label = NULL;
 	void *data;
 	UINTN size;
-	UINTN numsize[num];
+
 	if (argc < 3) {
 		fastboot_fail("Flash command requires exactly more then 3 arguments");
 		return;
 	}
-	if (argc > 4) {
-		argc = 2;
-		for (int i = 0; i <  num; i++) {
-			numname[i] = stra_to_str(argv[i+2]);
-			if (!numname[i]) {
-				fastboot_fail("Failed to convert CHAR8 numname to CHAR16");
-				return;
-			}
-			ret = uefi_get_file_size(file_io_interface, numname[i], &numsize[i]);
-			if (EFI_ERROR(ret)) {
-				inst_perror(ret, "Failed to get %s file size", numname[i]);
-				goto exit;
-			}
-		}
-		if (get_current_state() == LOCKED) {
-			error(L"Installer: Flash %a is prohibited in %a state.", argv[1],
-					get_current_state_string());
-			fastboot_fail("Installer: Prohibited command in %a state.",
-					get_current_state_string());
-			return;
-		}
-		argv[1] = get_target(argv[1]);
-		if (!argv[1])
-			goto exit;
 
-		ret = find_partition(argv[1]);
-		switch (ret) {
-		case EFI_SUCCESS:
-			do_erase(argc, argv);
-			if (!last_cmd_succeeded)
-				goto exit;
-			break;
-		case EFI_NOT_FOUND:
-			break;
-		default:
-			inst_perror(ret, "Failed to get partition information");
-			goto exit;
-		}
+	if (get_current_state() == LOCKED) {
+		error(L"Installer: Flash %a is prohibited in %a state.", argv[1],
+		      get_current_state_string());
+		fastboot_fail("Installer: Prohibited command in %a state.",
+			      get_current_state_string());
+		return;
+	}
 
-		installer_split_and_joint_flash(numname, numsize, num, argc, argv);
-	} else {
-		/* The fastboot flash command does not want the file parameter. */
-		argc--;
+	ret = get_image_files(&files, argv + 2, argc - 2);
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Failed to get the %a image files", argv[1]);
+		return;
+	}
 
-		filename = stra_to_str(argv[2]);
-		if (!filename) {
-			fastboot_fail("Failed to convert CHAR8 filename to CHAR16");
-			return;
-		}
-		if (get_current_state() == LOCKED) {
-			error(L"Installer: Flash %a is prohibited in %a state.", argv[1],
-				get_current_state_string());
-			fastboot_fail("Installer: Prohibited command in %a state.",
-				get_current_state_string());
-			return;
-		}
-		ret = uefi_get_file_size(file_io_interface, filename, &size);
-		if (EFI_ERROR(ret)) {
-			inst_perror(ret, "Failed to get %s file size", filename);
-			goto exit;
-		}
+	/* The fastboot flash and erase commands do not want the file
+	   parameters. */
+	argc = 2;
 
-		argv[1] = get_target(argv[1]);
-		if (!argv[1])
-			goto exit;
+	argv[1] = get_target(argv[1]);
+	if (!argv[1])
+		goto exit;
 
-		ret = find_partition(argv[1]);
-		switch (ret) {
-		case EFI_SUCCESS:
-			do_erase(argc, argv);
-			if (!last_cmd_succeeded)
-				goto exit;
+	ret = find_partition(argv[1]);
+	switch (ret) {
+	case EFI_SUCCESS:
+		if (pre_erased())
 			break;
-		case EFI_NOT_FOUND:
-			break;
-		default:
-			inst_perror(ret, "Failed to get partition information");
+		do_erase(argc, argv);
+		if (!last_cmd_succeeded)
 			goto exit;
-		}
+		break;
+	case EFI_NOT_FOUND:
+		break;
+	default:
+		inst_perror(ret, "Failed to get partition information");
+		goto exit;
+	}
 
-		if (size > dl->max_size) {
-			installer_split_and_flash(filename, size, argc, argv);
-			goto exit;
-		}
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Failed to convert CHAR8 label to CHAR16");
+		goto exit;
+	}
 
-		ret = uefi_read_file(file_io_interface, filename, &data, &size);
-		if (EFI_ERROR(ret)) {
-			inst_perror(ret, "Unable to read file %s", filename);
-			goto exit;
-		}
+	if (flash_stream_supported(label)) {
+		installer_stream_flash(&files, argv[1]);
+		goto exit;
+	}
 
-		installer_flash_buffer(data, size, argc, argv);
-		FreePool(data);
+	/* The special labels need the whole image at once */
+	if (files.num != 1) {
+		fastboot_fail("%a cannot be flashed from several files", argv[1]);
+		goto exit;
 	}
-exit:
-	if (num == 1) {
-		FreePool(filename);
-	} else {
-		for (INTN i = 0; i < num; i++)
-			FreePool(numname[i]);
+	if (files.file[0].size > dl->max_size) {
+		fastboot_fail("%s does not fit in the download buffer", files.file[0].name);
+		goto exit;
 	}
+
+	ret = uefi_read_file(file_io_interface, files.file[0].name, &data, &size);
+	if (EFI_ERROR(ret)) {
+		inst_perror(ret, "Unable to read file %s", files.file[0].name);
+		goto exit;
+	}
+
+	installer_flash_buffer(data, size, argc, argv);
+	FreePool(data);
+
+exit:
+	if (label)
+		FreePool(label);
+	free_image_files(&files);
 }
 
 static CHAR16 *get_format_image_filename(CHAR8 *label)
@@ -684,18 +537,12 @@ static CHAR16 *get_format_image_filename(CHAR8 *label)
 
 	label_length = strlena(label);
 	filename = AllocateZeroPool(label_length + 5);
-	if (!filename) {
-		fastboot_fail("Unable to allocate CHAR8 filename buffer");
+	if (!filename)
 		return NULL;
-	}
 	memcpy(filename, label, label_length);
 	memcpy(filename + label_length, ".img", 4);
 	filename16 = stra_to_str(filename);
 	FreePool(filename);
-	if (!filename16) {
-		fastboot_fail("Unable to allocate CHAR16 filename buffer");
-		return NULL;
-	}
 
 	return filename16;
 }
@@ -717,8 +564,10 @@ static void installer_format(INTN argc, CHAR8 **argv)
 	}
 
 	filename = get_format_image_filename(argv[1]);
-	if (!filename)
+	if (!filename) {
+		fastboot_fail("Unable to allocate format image filename");
 		return;
+	}
 
 	ret = uefi_read_file(file_io_interface, filename, &data, &size);
 	if (ret == EFI_NOT_FOUND && !StrCmp(L"userdata.img", filename)) {
@@ -733,9 +582,11 @@ static void installer_format(INTN argc, CHAR8 **argv)
 	if (!argv[1])
 		goto free_data;
 
-	do_erase(argc, argv);
-	if (!last_cmd_succeeded)
-		goto free_data;
+	if (!pre_erased()) {
+		do_erase(argc, argv);
+		if (!last_cmd_succeeded)
+			goto free_data;
+	}
 
 	if (data)
 		installer_flash_buffer(data, size, argc, argv);
@@ -782,10 +633,13 @@ static void installer_boot(INTN argc, CHAR8 **argv)
 
 static struct command {
 	BOOLEAN optional;
+	BOOLEAN erased;		/* Partition erased at the start of the run */
 	char *cmd;
 } *commands;
 static UINTN command_nb;
+static UINTN command_max;
 static UINTN current_command;
+static UINTN run_end;
 
 static void free_commands(void)
 {
@@ -801,24 +655,28 @@ static void free_commands(void)
 	FreePool(commands);
 	commands = NULL;
 	command_nb = 0;
+	command_max = 0;
 	current_command = 0;
+	run_end = 0;
 }
 
-static EFI_STATUS create_new_command(struct command *command, char *str)
+static EFI_STATUS create_new_command(struct command *command,
+				     const text_slice_t *line)
 {
-	char *cmd = str;
+	text_slice_t cmd = *line, opts;
+	UINTN i;
 
 	command->optional = FALSE;
+	command->erased = FALSE;
 
-	if (*str == '[') {
-		str++;
-		cmd = (char *)strchr((CHAR8 *)str, ']');
-		if (!cmd)
+	if (cmd.len && *cmd.str == '[') {
+		opts.str = cmd.str + 1;
+		opts.len = cmd.len - 1;
+		if (!slice_split(&opts, ']', &cmd))
 			return EFI_INVALID_PARAMETER;
-		*cmd++ = '\0';
 
-		while (*str) {
-			switch (*str++) {
+		for (i = 0; i < opts.len; i++) {
+			switch (opts.str[i]) {
 			case 'o':
 				command->optional = TRUE;
 				break;
@@ -827,39 +685,46 @@ static EFI_STATUS create_new_command(struct command *command, char *str)
 			}
 		}
 
-		while (*cmd && isspace(*cmd))
-			cmd++;
-		if (!*cmd)
+		slice_skip_whitespace(&cmd);
+		if (!cmd.len)
 			return EFI_INVALID_PARAMETER;
 	}
 
-	command->cmd = strdup(cmd);
+	command->cmd = AllocatePool(cmd.len + 1);
 	if (!command->cmd)
 		return EFI_OUT_OF_RESOURCES;
+	memcpy(command->cmd, cmd.str, cmd.len);
+	command->cmd[cmd.len] = '\0';
 
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS store_command(char *command, VOID *context _unused)
+#define COMMANDS_STEP 32
+
+static EFI_STATUS store_command(text_slice_t *line, VOID *context _unused)
 {
 	EFI_STATUS ret;
 	struct command *new_commands;
-
-	new_commands = AllocatePool((command_nb + 1) * sizeof(*new_commands));
-	if (!new_commands) {
-		free_commands();
-		return EFI_OUT_OF_RESOURCES;
+	UINTN cap;
+
+	if (command_nb == command_max) {
+		cap = command_max + max(command_max, (UINTN)COMMANDS_STEP);
+		new_commands = ReallocatePool(commands,
+					      command_nb * sizeof(*commands),
+					      cap * sizeof(*commands));
+		if (!new_commands) {
+			free_commands();
+			return EFI_OUT_OF_RESOURCES;
+		}
+		commands = new_commands;
+		command_max = cap;
 	}
 
-	memcpy(new_commands, commands, command_nb * sizeof(*commands));
-	ret = create_new_command(&new_commands[command_nb], command);
+	ret = create_new_command(&commands[command_nb], line);
 	if (EFI_ERROR(ret)) {
 		free_commands();
 		return ret;
 	}
-	if (commands)
-		FreePool(commands);
-	commands = new_commands;
 	command_nb++;
 
 	return EFI_SUCCESS;
@@ -875,6 +740,147 @@ static char *next_command()
 	return commands[current_command++].cmd;
 }
 
+static BOOLEAN pre_erased(void)
+{
+	return current_command && commands[current_command - 1].erased;
+}
+
+/* Resolve TARGET as get_target() does and return the partition label
+   if it exists on the user logical unit.  */
+static CHAR16 *run_label(CHAR8 *target)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	const CHAR16 *label;
+	CHAR16 *target16, *res = NULL;
+
+	target16 = stra_to_str(target);
+	if (!target16)
+		return NULL;
+
+	ret = gpt_get_partition_by_label(target16, &gparti, LOGICAL_UNIT_USER);
+	if (!EFI_ERROR(ret))
+		return target16;
+
+	/* slot_label() only returns another label if it exists */
+	if (ret == EFI_NOT_FOUND) {
+		label = slot_label(target16);
+		if (label && label != target16)
+			res = StrDuplicate(label);
+	}
+
+	FreePool(target16);
+	return res;
+}
+
+/* Return the label of the partition the COMMAND works on if it can
+   be part of a run: an erase, a format or a streamed flash of an
+   existing partition whose files are available.  Any other command
+   is a barrier.  */
+static CHAR16 *run_command_label(const char *command)
+{
+	char buf[sizeof(command_buffer)];
+	CHAR8 *argv[8];
+	struct image_files files;
+	CHAR16 *label, *filename;
+	BOOLEAN flash, available = TRUE;
+	INTN argc;
+
+	if (strlena((CHAR8 *)command) >= sizeof(buf))
+		return NULL;
+	strcpy((CHAR8 *)buf, (CHAR8 *)command);
+
+	if (EFI_ERROR(string_to_argv(buf, &argc, argv, ARRAY_SIZE(argv), " ", " ")))
+		return NULL;
+
+	flash = !strcmp(argv[0], (CHAR8 *)"flash");
+	if (flash) {
+		if (argc < 3)
+			return NULL;
+	} else if (strcmp(argv[0], (CHAR8 *)"erase") &&
+		   strcmp(argv[0], (CHAR8 *)"format"))
+		return NULL;
+	else if (argc != 2)
+		return NULL;
+
+	label = run_label(argv[1]);
+	if (!label)
+		return NULL;
+
+	/* The slot variables are refreshed on misc erase */
+	if (!StrCmp(label, SLOT_STORAGE_PART) ||
+	    (flash && !flash_stream_supported(label)))
+		goto barrier;
+
+	/* A command which fails must not have erased its partition */
+	if (flash) {
+		available = !EFI_ERROR(get_image_files(&files, argv + 2, argc - 2));
+		if (available)
+			free_image_files(&files);
+	} else if (!strcmp(argv[0], (CHAR8 *)"format")) {
+		filename = get_format_image_filename(argv[1]);
+		available = filename && (file_available(filename) ||
+					 !StrCmp(L"userdata.img", filename));
+		if (filename)
+			FreePool(filename);
+	}
+	if (available)
+		return label;
+
+barrier:
+	FreePool(label);
+	return NULL;
+}
+
+/* The flash, erase and format commands of distinct partitions which
+   follow each other in the batch are independent: they form a run
+   which ends at the first other command (gpt flash, oem, flashing,
+   set_active, reboot...).  The partitions of a run, including the
+   ones erased before being flashed or formatted, are erased at once
+   so that the adjacent ones are merged in a single storage request.  */
+static void schedule_run(void)
+{
+	CHAR16 *labels[ERASE_MAX_PARTITIONS];
+	EFI_STATUS ret;
+	UINTN i, j, nb = 0;
+
+	run_end = current_command + 1;
+	if (get_current_state() == LOCKED)
+		return;
+
+	for (i = current_command; i < command_nb && nb < ARRAY_SIZE(labels); i++) {
+		labels[nb] = run_command_label(commands[i].cmd);
+		if (!labels[nb])
+			break;
+		for (j = 0; j < nb; j++)
+			if (!StrCmp(labels[j], labels[nb]))
+				break;
+		if (j < nb) {
+			FreePool(labels[nb]);
+			break;
+		}
+		nb++;
+	}
+
+	if (nb < 2)
+		goto out;
+
+	run_end = current_command + nb;
+	Print(L"Erasing the %d partitions of the next commands\n", nb);
+	ret = erase_by_labels(labels, nb);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Run erase failed, erasing one partition at a time");
+		goto out;
+	}
+
+	for (i = 0; i < nb; i++)
+		commands[current_command + i].erased = TRUE;
+
+out:
+	for (i = 0; i < nb; i++)
+		FreePool(labels[i]);
+}
+
 static void batch(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
@@ -901,7 +907,7 @@ static void batch(INTN argc, CHAR8 **argv)
 	}
 	FreePool(filename);
 
-	ret = parse_text_buffer(data, size, store_command, NULL);
+	ret = parse_text_slices(data, size, store_command, NULL);
 	FreePool(data);
 	if (EFI_ERROR(ret))
 		inst_perror(ret, "Failed to parse batch file");
@@ -1045,6 +1051,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *_table)
 	BOOLEAN include_self = FALSE;
 
 	InitializeLib(image, _table);
+	log_load_levels();
 	g_parent_image = image;
 
 	ret = handle_protocol(image, &LoadedImageProtocol, (void **)&loaded_img);
@@ -1151,9 +1158,11 @@ EFI_STATUS installer_transport_stop(void)
 EFI_STATUS installer_transport_run(void)
 {
 	static BOOLEAN initialized = FALSE;
+	static UINT64 start, start_bytes;
 	EFI_STATUS ret;
 	char *cmd;
 	UINTN cmd_len;
+	UINT64 bytes, usec;
 
 	if (!initialized) {
 		ret = installer_replace_functions();
@@ -1164,6 +1173,8 @@ EFI_STATUS installer_transport_run(void)
 			return ret;
 		}
 		initialized = TRUE;
+		start = timer_ticks();
+		start_bytes = flash_get_perf()->bytes;
 	}
 
 	if (current_command > 0) {
@@ -1177,6 +1188,9 @@ EFI_STATUS installer_transport_run(void)
 		}
 	}
 
+	if (current_command >= run_end)
+		schedule_run();
+
 	cmd = next_command();
 	if (!cmd)
 		goto stop;
@@ -1196,6 +1210,12 @@ EFI_STATUS installer_transport_run(void)
 	return EFI_SUCCESS;
 
 stop:
+	bytes = flash_get_perf()->bytes - start_bytes;
+	usec = ticks_to_usec(timer_ticks() - start);
+	if (bytes)
+		Print(L"%ld MiB written in %ld s (%ld KiB/s)\n",
+		      bytes / 1024 / 1024, usec / 1000000,
+		      usec ? bytes * 1000000 / 1024 / usec : 0);
 	fastboot_stop(NULL, NULL, 0, EXIT_SHELL);
 	return EFI_SUCCESS;
 }
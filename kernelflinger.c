@@ -55,6 +55,8 @@
 #include "storage.h"
 #include "version.h"
 #include "timer.h"
+#include "boottrace.h"
+#include "arena.h"
 #ifdef HAL_AUTODETECT
 #include "blobstore.h"
 #endif
@@ -73,6 +75,10 @@
 #include "uefi_utils.h"
 #include "security_interface.h"
 #include "security_efi.h"
+#include "prefetch.h"
+#include "blkcache.h"
+#include "bootprof.h"
+#include "misc.h"
 #ifdef USE_TPM
 #include "tpm2_security.h"
 #endif
@@ -82,14 +88,11 @@ static const CHAR16 __attribute__((used)) magic[] = L"### kernelflinger ###";
 
 /* Default max wait time for console reset in units of milliseconds if no EFI
  * variable is set for this platform.
- * You want this value as small as possible as this is added to
- * the boot time for EVERY boot
+ * The window starts with efi_main(), only what is left of it once
+ * the boot target inputs are gathered is added to the boot time.
  */
 #define EFI_RESET_WAIT_MS           200
 
-/* Interval in ms to check on startup for initial press of magic key */
-#define DETECT_KEY_STALL_TIME_MS    1
-
 /* How long (in milliseconds) magic key should be held to force
  * Fastboot mode
  */
@@ -151,21 +154,53 @@ static VOID print_rsci_values(VOID)
 #endif
 
 
-static enum boot_target check_fastboot_sentinel(VOID)
+/* Inputs of the boot target decision.  They are all gathered once by
+ * gather_boot_inputs() while the magic key detection window is open,
+ * so that the storage, variable and battery accesses overlap the key
+ * wait instead of being serialized after it.
+ */
+struct boot_inputs {
+	/* Decision outputs */
+	CHAR16 *target_path;
+	BOOLEAN oneshot;
+
+	BOOLEAN off_mode_charge;
+	BOOLEAN crash_event_menu;
+	BOOLEAN sentinel;
+	EFI_STATUS bcb_status;
+	struct bootloader_message bcb;
+	CHAR16 *loader_oneshot;
+	enum wake_sources wake_source;
+	enum reset_sources reset_source;
+	BOOLEAN battery_low;
+	BOOLEAN charger_plugged;
+
+	/* Magic key detection */
+	EFI_STATUS key_status;
+	EFI_INPUT_KEY key;
+};
+
+static enum boot_target check_fastboot_sentinel(struct boot_inputs *in)
 {
-	debug(L"checking ESP for %s", FASTBOOT_SENTINEL);
-	if (file_exists(g_disk_device, FASTBOOT_SENTINEL))
-		return FASTBOOT;
-	return NORMAL_BOOT;
+	return in->sentinel ? FASTBOOT : NORMAL_BOOT;
 }
 
 
-static enum boot_target check_magic_key(VOID)
+/* The magic key detection window is opened as soon as efi_main()
+ * starts and expires on a firmware timer, so that the platform
+ * initialization counts toward it.
+ */
+static struct magic_key_window {
+	unsigned long wait_ms;
+	EFI_EVENT deadline;
+} magic_key_window;
+
+static void magic_key_window_open(VOID)
 {
-	unsigned long i;
-	EFI_STATUS ret = EFI_NOT_READY;
-	EFI_INPUT_KEY key;
-	unsigned long wait_ms = EFI_RESET_WAIT_MS;
+	EFI_STATUS ret;
+	struct magic_key_window *w = &magic_key_window;
+
+	w->wait_ms = EFI_RESET_WAIT_MS;
 
 	/* Some systems require a short stall before we can be sure there
 	 * wasn't a keypress at boot. Read the EFI variable which determines
@@ -173,34 +208,73 @@ static enum boot_target check_magic_key(VOID)
 	 */
 	ret = get_efi_variable_long_from_str8(&loader_guid,
 						MAGIC_KEY_TIMEOUT_VAR,
-						&wait_ms);
+						&w->wait_ms);
 	if (EFI_ERROR(ret)) {
 		debug(L"Couldn't read timeout variable; assuming default");
 	} else {
-		if (wait_ms > 1000) {
+		if (w->wait_ms > 1000) {
 			debug(L"pathological magic key timeout, use default");
-			wait_ms = EFI_RESET_WAIT_MS;
+			w->wait_ms = EFI_RESET_WAIT_MS;
 		}
 	}
 
-	debug(L"Reset wait time: %d", wait_ms);
+	debug(L"Reset wait time: %d", w->wait_ms);
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0,
+				NULL, NULL, &w->deadline);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the magic key timer");
+		w->deadline = NULL;
+		return;
+	}
+
+	/* The timer period is in 100ns units */
+	ret = uefi_call_wrapper(BS->SetTimer, 3, w->deadline, TimerRelative,
+				(UINT64)w->wait_ms * 10000);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set the magic key timer");
+		uefi_call_wrapper(BS->CloseEvent, 1, w->deadline);
+		w->deadline = NULL;
+	}
+}
+
+/* Wait for a key stroke until the magic key window expires.  If no key
+ * was pressed and the window already expired, this returns at once.
+ */
+static void magic_key_window_close(struct boot_inputs *in)
+{
+	EFI_STATUS ret;
+	struct magic_key_window *w = &magic_key_window;
+	EFI_EVENT events[2];
+	UINTN index;
+
+	if (w->deadline) {
+		events[0] = ST->ConIn->WaitForKey;
+		events[1] = w->deadline;
+		ret = uefi_call_wrapper(BS->WaitForEvent, 3, 2, events, &index);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to wait for the magic key");
+		uefi_call_wrapper(BS->CloseEvent, 1, w->deadline);
+		w->deadline = NULL;
+	} else
+		wait_for_key((UINT64)w->wait_ms * 1000);
 
 	/* Check for 'magic' key. Some BIOSes are flaky about this
-	 * so wait for the ConIn to be ready after reset
+	 * so it is only read once the ConIn had the whole window to get
+	 * ready after reset
 	 */
-	for (i = 0; i <= wait_ms; i += DETECT_KEY_STALL_TIME_MS) {
-		ret = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2,
-					ST->ConIn, &key);
-		if (ret == EFI_SUCCESS || i == wait_ms)
-			break;
-		uefi_call_wrapper(BS->Stall, 1, DETECT_KEY_STALL_TIME_MS * 1000);
-	}
+	in->key_status = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2,
+					   ST->ConIn, &in->key);
+}
 
-	if (EFI_ERROR(ret))
+
+static enum boot_target check_magic_key(struct boot_inputs *in)
+{
+	if (EFI_ERROR(in->key_status))
 		return NORMAL_BOOT;
 
-	debug(L"ReadKeyStroke: (%d tries) %d %d", i, key.ScanCode, key.UnicodeChar);
-	if (ui_keycode_to_event(key.ScanCode) != MAGIC_KEY)
+	debug(L"ReadKeyStroke: %d %d", in->key.ScanCode, in->key.UnicodeChar);
+	if (ui_keycode_to_event(in->key.ScanCode) != MAGIC_KEY)
 		return NORMAL_BOOT;
 
 	if (ui_enforce_key_held(FASTBOOT_HOLD_DELAY, MAGIC_KEY))
@@ -210,10 +284,10 @@ static enum boot_target check_magic_key(VOID)
 }
 
 
-static enum boot_target check_bcb(CHAR16 **target_path, BOOLEAN *oneshot)
+static enum boot_target check_bcb(CHAR16 **target_path, BOOLEAN *oneshot,
+				  struct bootloader_message *bcb)
 {
 	EFI_STATUS ret;
-	struct bootloader_message bcb;
 	CHAR16 *target = NULL;
 	enum boot_target t;
 	CHAR8 *bcb_cmd;
@@ -222,17 +296,10 @@ static enum boot_target check_bcb(CHAR16 **target_path, BOOLEAN *oneshot)
 	*oneshot = FALSE;
 	*target_path = NULL;
 
-	ret = read_bcb(MISC_LABEL, &bcb);
-	if (EFI_ERROR(ret)) {
-		error(L"Unable to read BCB");
-		t = NORMAL_BOOT;
-		goto out;
-	}
-
-	dirty = bcb.status[0] != '\0';
+	dirty = bcb->status[0] != '\0';
 	/* We own the status field; clear it in case there is any stale data */
-	bcb.status[0] = '\0';
-	bcb_cmd = (CHAR8 *)bcb.command;
+	bcb->status[0] = '\0';
+	bcb_cmd = (CHAR8 *)bcb->command;
 	if (!strncmpa(bcb_cmd, (CHAR8 *)"boot-", 5)) {
 		target = stra_to_str(bcb_cmd + 5);
 		debug(L"BCB boot target: '%s'", target);
@@ -245,7 +312,7 @@ static enum boot_target check_bcb(CHAR16 **target_path, BOOLEAN *oneshot)
 	}
 
 	if (dirty) {
-		ret = write_bcb(MISC_LABEL, &bcb);
+		ret = write_bcb(MISC_LABEL, bcb);
 		if (EFI_ERROR(ret))
 			error(L"Unable to update BCB contents!");
 		}
@@ -294,15 +361,12 @@ out:
 }
 
 
-static enum boot_target check_loader_entry_one_shot(VOID)
+static enum boot_target check_loader_entry_one_shot(CHAR16 *target,
+						    BOOLEAN off_mode_charge)
 {
 	EFI_STATUS ret;
-	CHAR16 *target;
 	enum boot_target bt;
 
-	debug(L"checking %s", LOADER_ENTRY_ONESHOT);
-	target = get_efi_variable_str(&loader_guid, LOADER_ENTRY_ONESHOT);
-
 	del_efi_variable(&loader_guid, LOADER_ENTRY_ONESHOT);
 
 	if (!target)
@@ -319,16 +383,15 @@ static enum boot_target check_loader_entry_one_shot(VOID)
 		} else
 			error(L"Unknown oneshot boot target: '%s'", target);
 		bt = NORMAL_BOOT;
-	} else if (bt == CHARGER && !get_off_mode_charge()) {
+	} else if (bt == CHARGER && !off_mode_charge) {
 		debug(L"Off mode charge is not set, powering off.");
 		bt = POWER_OFF;
 	}
 
-	FreePool(target);
 	return bt;
 }
 
-static BOOLEAN reset_is_due_to_watchdog_or_panic(void)
+static BOOLEAN reset_is_due_to_watchdog_or_panic(enum reset_sources reset_source)
 {
 	static enum reset_sources WATCHDOG_RESET_SOURCES[] = {
 		RESET_KERNEL_WATCHDOG,
@@ -336,10 +399,8 @@ static BOOLEAN reset_is_due_to_watchdog_or_panic(void)
 		RESET_PMIC_WATCHDOG,
 		RESET_EC_WATCHDOG
 	};
-	enum reset_sources reset_source;
 	UINTN i;
 
-	reset_source = rsci_get_reset_source();
 	for (i = 0; i < ARRAY_SIZE(WATCHDOG_RESET_SOURCES); i++)
 		if (reset_source == WATCHDOG_RESET_SOURCES[i]) {
 			debug(L"Watchdog reset source = %d", reset_source);
@@ -355,13 +416,13 @@ static BOOLEAN reset_is_due_to_watchdog_or_panic(void)
  * crash event menu is displayed.  This menu informs the user of the
  * situation and let him choose which boot target he wants.
  */
-static enum boot_target check_watchdog(VOID)
+static enum boot_target check_watchdog(struct boot_inputs *in)
 {
 	EFI_STATUS ret;
 	UINT8 counter;
 	EFI_TIME time_ref, now;
 
-	if (!get_crash_event_menu())
+	if (!in->crash_event_menu)
 		return NORMAL_BOOT;
 
 	ret = get_watchdog_status(&counter, &time_ref);
@@ -370,7 +431,7 @@ static enum boot_target check_watchdog(VOID)
 		return NORMAL_BOOT;
 	}
 
-	if (!reset_is_due_to_watchdog_or_panic()) {
+	if (!reset_is_due_to_watchdog_or_panic(in->reset_source)) {
 		if (counter != 0) {
 			ret = reset_watchdog_status();
 			if (EFI_ERROR(ret)) {
@@ -456,7 +517,11 @@ static enum boot_target check_command_line(VOID)
 #ifndef USER
 		if (!StrCmp(argv[pos], L"-U")) {
 			pos++;
-			unittest_main(pos >= argc ? NULL : argv[pos]);
+			if (pos >= argc)
+				unittest_main(NULL, 0, NULL);
+			else
+				unittest_main(argv[pos], argc - pos - 1,
+					      argv + pos + 1);
 			FreePool(argv);
 			return EXIT_SHELL;
 		}
@@ -493,62 +558,151 @@ out:
 	return bt;
 }
 
-static enum boot_target check_battery_inserted(void)
+static enum boot_target check_battery_inserted(struct boot_inputs *in)
 {
-	enum wake_sources wake_source;
-
-	if (!get_off_mode_charge())
+	if (!in->off_mode_charge)
 		return NORMAL_BOOT;
 
-	wake_source = rsci_get_wake_source();
-	if (wake_source == WAKE_BATTERY_INSERTED)
+	if (in->wake_source == WAKE_BATTERY_INSERTED)
 		return POWER_OFF;
 
 	return NORMAL_BOOT;
 }
 
-static enum boot_target check_charge_mode(void)
+static enum boot_target check_bcb_target(struct boot_inputs *in)
 {
-	enum wake_sources wake_source;
+	enum boot_target ret;
+
+	if (EFI_ERROR(in->bcb_status)) {
+		error(L"Unable to read BCB");
+		in->oneshot = FALSE;
+		return NORMAL_BOOT;
+	}
+
+	ret = check_bcb(&in->target_path, &in->oneshot, &in->bcb);
+	if (ret == NORMAL_BOOT)
+		return ret;
+
+	/* clear LOADER_ENTRY_ONESHOT after detecting oneshot from bcb,
+	* in case of unexpected boot target in next boot. */
+	if (in->oneshot == TRUE)
+		del_efi_variable(&loader_guid, LOADER_ENTRY_ONESHOT);
+	else {
+		/*The bootloader is expected to load and boot into recovery image upon seeting*/
+		/*boot-fastboot in the BCB command. Recovery the parse the BCB message and*/
+		/*switches to fastbootd mode*/
+		if (ret == FASTBOOT)
+			ret = RECOVERY;
+	}
 
-	if (!get_off_mode_charge())
+	return ret;
+}
+
+static enum boot_target check_reboot_target(struct boot_inputs *in)
+{
+	enum boot_target ret;
+
+	ret = check_loader_entry_one_shot(in->loader_oneshot,
+					  in->off_mode_charge);
+	FreePool(in->loader_oneshot);
+	in->loader_oneshot = NULL;
+
+	/* DNX is not a target this loader boots, go on with the
+	 * battery checks */
+	return ret == DNX ? NORMAL_BOOT : ret;
+}
+
+static enum boot_target check_charge_mode(struct boot_inputs *in)
+{
+	if (!in->off_mode_charge)
 		return NORMAL_BOOT;
 
-	wake_source = rsci_get_wake_source();
-	if ((wake_source == WAKE_USB_CHARGER_INSERTED) ||
-		(wake_source == WAKE_ACDC_CHARGER_INSERTED)) {
-		debug(L"Wake source = %d", wake_source);
+	if ((in->wake_source == WAKE_USB_CHARGER_INSERTED) ||
+		(in->wake_source == WAKE_ACDC_CHARGER_INSERTED)) {
+		debug(L"Wake source = %d", in->wake_source);
 		return CHARGER;
 	}
 
 	return NORMAL_BOOT;
 }
 
-enum boot_target check_battery(void)
+static enum boot_target check_battery(struct boot_inputs *in)
 {
-	if (!get_off_mode_charge())
+	if (!in->off_mode_charge || !in->battery_low)
 		return NORMAL_BOOT;
 
-	if (is_battery_below_boot_OS_threshold()) {
-		BOOLEAN charger_plugged = is_charger_plugged_in();
+	debug(L"Battery is below boot OS threshold");
+	debug(L"Charger is%s plugged", in->charger_plugged ? L"" : L" not");
+	if (in->charger_plugged)
+		return CHARGER;
+
+#ifdef USE_UI
+	ux_display_low_battery(3);
+#else
+	debug(L"NO_UI: low battery");
+#endif
+	return POWER_OFF;
+}
+
+/* Read everything the boot target rules depend on.  None of these
+ * probes has a side effect, they are done before waiting for what is
+ * left of the magic key window.
+ */
+static void gather_boot_inputs(struct boot_inputs *in)
+{
+	in->off_mode_charge = get_off_mode_charge();
+	in->crash_event_menu = get_crash_event_menu();
+
+	debug(L"checking ESP for %s", FASTBOOT_SENTINEL);
+	in->sentinel = file_exists(g_disk_device, FASTBOOT_SENTINEL);
+
+	in->bcb_status = read_bcb(MISC_LABEL, &in->bcb);
+
+	debug(L"checking %s", LOADER_ENTRY_ONESHOT);
+	in->loader_oneshot = get_efi_variable_str(&loader_guid,
+						  LOADER_ENTRY_ONESHOT);
+
+	in->wake_source = rsci_get_wake_source();
+	in->reset_source = rsci_get_reset_source();
 
-		debug(L"Battery is below boot OS threshold");
-		debug(L"Charger is%s plugged", charger_plugged ? L"" : L" not");
-		return charger_plugged ? CHARGER : POWER_OFF;
+	if (in->off_mode_charge) {
+		in->battery_low = is_battery_below_boot_OS_threshold();
+		if (in->battery_low)
+			in->charger_plugged = is_charger_plugged_in();
 	}
 
-	return NORMAL_BOOT;
+	magic_key_window_close(in);
 }
 
+/* Boot target rules, in priority order.  The first rule returning
+ * something else than NORMAL_BOOT decides the boot target.  The rules
+ * with side effects (watchdog counter and menu, BCB and oneshot
+ * variable clean-up) are only run when all the rules before them have
+ * passed, as they have always been.
+ */
+static const struct boot_rule {
+	const CHAR16 *name;
+	enum boot_target (*check)(struct boot_inputs *in);
+} BOOT_RULES[] = {
+	{ L"fastboot sentinel", check_fastboot_sentinel },
+	{ L"magic key", check_magic_key },
+	{ L"watchdog", check_watchdog },
+	{ L"battery insertion", check_battery_inserted },
+	{ L"BCB", check_bcb_target },
+	{ L"reboot target", check_reboot_target },
+	{ L"battery level", check_battery },
+	{ L"charger insertion", check_charge_mode }
+};
+
 /* Policy:
- * 1. Check if we had multiple watchdog reported in a short period of
- *    time.  If so, let the user choose the boot target.
- * 2. Check if the "-a xxxxxxxxx" command line was passed in, if so load an
+ * 1. Check if the "-a xxxxxxxxx" command line was passed in, if so load an
  *    android boot image from RAM at that location.
- * 3. Check if the fastboot sentinel file \force_fastboot is present, and if
+ * 2. Check if the fastboot sentinel file \force_fastboot is present, and if
  *    so, force fastboot mode. Use in bootable media.
- * 4. Check for "magic key" being held. Short press loads Recovery. Long press
+ * 3. Check for "magic key" being held. Short press loads Recovery. Long press
  *    loads Fastboot.
+ * 4. Check if we had multiple watchdog reported in a short period of
+ *    time.  If so, let the user choose the boot target.
  * 5. Check if wake source is battery inserted, if so power off
  * 6. Check bootloader control block for a boot target, which could be
  *    the name of a boot image that we know how to read from a partition,
@@ -565,7 +719,9 @@ enum boot_target check_battery(void)
  */
 static enum boot_target choose_boot_target(CHAR16 **target_path, BOOLEAN *oneshot)
 {
+	struct boot_inputs in;
 	enum boot_target ret;
+	UINTN i;
 
 	*target_path = NULL;
 	*oneshot = TRUE;
@@ -580,63 +736,20 @@ static enum boot_target choose_boot_target(CHAR16 **target_path, BOOLEAN *onesho
 	if (ret != NORMAL_BOOT)
 		goto out;
 
-	debug(L"Bootlogic: Check fastboot sentinel...");
-	ret = check_fastboot_sentinel();
-	if (ret != NORMAL_BOOT)
-		goto out;
-
-	debug(L"Bootlogic: Check magic key...");
-	ret = check_magic_key();
-	if (ret != NORMAL_BOOT)
-		goto out;
-
-	debug(L"Bootlogic: Check watchdog...");
-	ret = check_watchdog();
-	if (ret != NORMAL_BOOT)
-		goto out;
+	memset(&in, 0, sizeof(in));
+	in.oneshot = TRUE;
+	gather_boot_inputs(&in);
 
-	debug(L"Bootlogic: Check battery insertion...");
-	ret = check_battery_inserted();
-	if (ret != NORMAL_BOOT)
-		goto out;
-
-	debug(L"Bootlogic: Check BCB...");
-	ret = check_bcb(target_path, oneshot);
-	if (ret != NORMAL_BOOT) {
-		/* clear LOADER_ENTRY_ONESHOT after detecting oneshot from bcb,
-		* in case of unexpected boot target in next boot. */
-		if(*oneshot == TRUE)
-			del_efi_variable(&loader_guid, LOADER_ENTRY_ONESHOT);
-		else {
-			/*The bootloader is expected to load and boot into recovery image upon seeting*/
-			/*boot-fastboot in the BCB command. Recovery the parse the BCB message and*/
-			/*switches to fastbootd mode*/
-			if (ret == FASTBOOT)
-				ret = RECOVERY;
-		}
-		goto out;
+	for (i = 0; i < ARRAY_SIZE(BOOT_RULES); i++) {
+		debug(L"Bootlogic: Check %s...", BOOT_RULES[i].name);
+		ret = BOOT_RULES[i].check(&in);
+		if (ret != NORMAL_BOOT)
+			break;
 	}
 
-	debug(L"Bootlogic: Check reboot target...");
-	ret = check_loader_entry_one_shot();
-	if (ret != DNX && ret != NORMAL_BOOT)
-		goto out;
-
-	debug(L"Bootlogic: Check battery level...");
-	ret = check_battery();
-
-#ifdef USE_UI
-	if (ret == POWER_OFF)
-		ux_display_low_battery(3);
-#else
-	if (ret == POWER_OFF)
-		debug(L"NO_UI: low battery");
-#endif
-	if (ret != NORMAL_BOOT)
-		goto out;
-
-	debug(L"Bootlogic: Check charger insertion...");
-	ret = check_charge_mode();
+	*target_path = in.target_path;
+	*oneshot = in.oneshot;
+	FreePool(in.loader_oneshot);
 
 out:
 	debug(L"Bootlogic: selected '%s'",  boot_target_description(ret));
@@ -989,6 +1102,25 @@ static EFI_STATUS set_image_oemvars(VOID *bootimage)
 	return set_image_oemvars_nocheck(bootimage, NULL);
 }
 
+/* Store the reads of this normal boot for the next one, keyed by the
+ * digest of the verified vbmeta images
+ */
+static void commit_boot_profile(__attribute__((__unused__)) VBDATA *vb_data)
+{
+#ifdef USE_AVB
+	UINT8 digest[AVB_SHA256_DIGEST_SIZE];
+
+	if (vb_data) {
+		avb_slot_verify_data_calculate_vbmeta_digest(vb_data,
+							     AVB_DIGEST_TYPE_SHA256,
+							     digest);
+		bootprof_commit(digest, sizeof(digest));
+		return;
+	}
+#endif
+	bootprof_commit(NULL, 0);
+}
+
 static EFI_STATUS load_image(VOID *bootimage, UINT8 boot_state,
 				enum boot_target boot_target,
 				VBDATA *vb_data
@@ -1019,7 +1151,9 @@ static EFI_STATUS load_image(VOID *bootimage, UINT8 boot_state,
 #endif
 
 	/* install acpi tables before starting trusty */
+	boottrace_begin(BT_ACPI_INSTALL, 0);
 	ret = setup_acpi_table(bootimage, boot_target);
+	boottrace_end(BT_ACPI_INSTALL, 0);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"setup_acpi_table");
 		return ret;
@@ -1037,7 +1171,9 @@ static EFI_STATUS load_image(VOID *bootimage, UINT8 boot_state,
 #endif
 		}
 		debug(L"loading trusty");
+		boottrace_begin(BT_TRUSTY_LOAD, 0);
 		ret = load_tos_image(&tosimage);
+		boottrace_end(BT_TRUSTY_LOAD, 0);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Load tos image failed");
 			die();
@@ -1050,7 +1186,9 @@ static EFI_STATUS load_image(VOID *bootimage, UINT8 boot_state,
 		}
 
 		set_boottime_stamp(TM_LOAD_TOS_DONE);
+		boottrace_begin(BT_TRUSTY_START, 0);
 		ret = start_trusty(tosimage);
+		boottrace_end(BT_TRUSTY_START, 0);
 		if (EFI_ERROR(ret)) {
 #ifndef BUILD_ANDROID_THINGS
 			efi_perror(ret, L"Unable to start trusty; stop.");
@@ -1077,6 +1215,9 @@ static EFI_STATUS load_image(VOID *bootimage, UINT8 boot_state,
 	tpm2_end();
 #endif
 
+	if (boot_target == NORMAL_BOOT)
+		commit_boot_profile(vb_data);
+
 	debug(L"chainloading boot image, boot state is %s",
 			boot_state_to_string(boot_state));
 	ret = android_image_start_buffer(g_parent_image, bootimage,
@@ -1116,6 +1257,11 @@ static VOID enter_fastboot_mode(UINT8 boot_state)
 	VOID *bootimage_p;
 	AvbSlotVerifyData *slot_data;
 
+	/* The boot flow, if any, has been abandoned */
+	prefetch_release();
+	arena_reset();
+	bootprof_stop();
+
 	set_efi_variable(&fastboot_guid, BOOT_STATE_VAR, sizeof(boot_state),
 			&boot_state, FALSE, TRUE);
 	set_oemvars_update(TRUE);
@@ -1147,7 +1293,7 @@ static VOID enter_fastboot_mode(UINT8 boot_state)
 				set_image_oemvars_nocheck(bootimage, NULL);
 				load_image(bootimage, BOOT_STATE_ORANGE, NORMAL_BOOT, slot_data);
 			}
-			FreePool(bootimage);
+			fastboot_free_image(bootimage);
 			bootimage = NULL;
 			continue;
 		}
@@ -1155,12 +1301,17 @@ static VOID enter_fastboot_mode(UINT8 boot_state)
 		if (efiimage) {
 			ret = uefi_call_wrapper(BS->LoadImage, 6, FALSE, g_parent_image,
 						NULL, efiimage, imagesize, &image);
-			FreePool(efiimage);
+			fastboot_free_image(efiimage);
 			efiimage = NULL;
 			if (EFI_ERROR(ret)) {
 				efi_perror(ret, L"Unable to load the received EFI image");
 				continue;
 			}
+			efi_variable_commit();
+			misc_commit();
+#ifdef RPMB_STORAGE
+			rpmb_storage_commit();
+#endif
 			ret = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
 			if (EFI_ERROR(ret))
 				efi_perror(ret, L"Unable to start the received EFI image");
@@ -1291,10 +1442,42 @@ out:
 		avb_slot_verify_data_free(slot_data);
 #else
 	if (bootimage != NULL)
-		FreePool(bootimage);
+		android_free_bootimage(bootimage);
+#endif
+}
+#endif
+
+/* libavb reads up to 64 KiB of the vbmeta partition */
+#define VBMETA_PREFETCH_SIZE	(64 * 1024)
+
+/* Speculatively read the partitions of a normal boot while the boot
+ * target is chosen.  A wrong guess only costs storage bandwidth.
+ */
+static void prefetch_boot_partitions(void)
+{
+	if (use_slot() && !slot_get_active())
+		return;
+
+	android_image_prefetch_partition(slot_label(BOOT_LABEL));
+#ifdef USE_AVB
+	prefetch_partition(slot_label(VBMETA_LABEL), 0, VBMETA_PREFETCH_SIZE);
+#endif
+#ifdef USE_TRUSTY
+	tos_image_prefetch();
 #endif
 }
+
+/* Batch the variable, BCB and RPMB writes of the boot flow, they are
+ * committed before leaving Kernelflinger
+ */
+static void defer_writes(BOOLEAN defer)
+{
+	efi_variable_defer_writes(defer);
+	misc_defer_writes(defer);
+#ifdef RPMB_STORAGE
+	rpmb_storage_defer_writes(defer);
 #endif
+}
 
 EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 {
@@ -1309,10 +1492,13 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	UINT8 *hash = NULL;
 #endif
 	VBDATA *vb_data = NULL;
+	arena_mark_t arena_scope;
 
 	set_boottime_stamp(TM_EFI_MAIN);
 	/* gnu-efi initialization */
 	InitializeLib(image, sys_table);
+	log_load_levels();
+	magic_key_window_open();
 
 #ifdef USE_UI
 	ux_display_vendor_splash();
@@ -1347,6 +1533,17 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		}
 	}
 
+	/* Small random reads are very slow on removable and virtual
+	 * media, cache more and read further ahead there
+	 */
+	blkcache_set_slow_media(is_live_boot() || is_boot_device_virtual());
+
+	/* Read what the previous boot read while the boot target is
+	 * chosen, and record this boot reads for the next one
+	 */
+	bootprof_start();
+	bootprof_replay();
+
 	uefi_bios_update_capsule(g_disk_device, FWUPDATE_FILE);
 
 	uefi_check_upgrade(g_loaded_image, BOOTLOADER_LABEL, KFUPDATE_FILE,
@@ -1383,13 +1580,22 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		return ret;
 	}
 
+	defer_writes(TRUE);
+
+	if (boot_target == NORMAL_BOOT)
+		prefetch_boot_partitions();
+
 	/* No UX prompts before this point, do not want to interfere
 	 * with magic key detection
 	 */
 	if (boot_target == NORMAL_BOOT)
 		boot_target = choose_boot_target(&target_path, &oneshot);
-	if (boot_target == EXIT_SHELL)
+	if (!is_bootimg_target(boot_target))
+		prefetch_release();
+	if (boot_target == EXIT_SHELL) {
+		defer_writes(FALSE);
 		return EFI_SUCCESS;
+	}
 	if (boot_target == CRASHMODE) {
 #ifdef USE_UI
 		boot_target = ux_prompt_user_for_boot_target(NO_ERROR_CODE);
@@ -1463,8 +1669,10 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	/* EFI binaries are validated by the BIOS */
 	if (boot_target == ESP_EFI_BINARY) {
 		debug(L"entering EFI binary");
-		if (!target_path)
+		if (!target_path) {
+			defer_writes(FALSE);
 			return EFI_INVALID_PARAMETER;
+		}
 		ret = uefi_enter_binary(g_disk_device, target_path, oneshot, 0, NULL);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"EFI Application exited abnormally");
@@ -1494,8 +1702,16 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 
 	debug(L"Loading boot image");
 
+	/* The verification and boot image loading short-lived
+	   allocations are dropped at once if the boot fails */
+	arena_scope = arena_mark();
 	set_boottime_stamp(TM_AVB_START);
 	acpi_set_boot_target(boot_target);
+#ifdef USE_TRUSTY
+	/* The TOS image is read while the boot image is verified */
+	if (is_bootimg_target(boot_target))
+		tos_image_prefetch();
+#endif
 #ifdef USE_AVB
 	disable_slot_if_efi_loaded_slot_failed();
 	ret = avb_load_verify_boot_image(boot_target, target_path, &bootimage, oneshot, &boot_state, &vb_data);
@@ -1573,8 +1789,11 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		break;
 	}
 
+	/* vb_data and bootimage are not used past this point */
+	arena_release(arena_scope);
 	bootloader_recover_mode(boot_state);
 
+	defer_writes(FALSE);
 	return EFI_INVALID_PARAMETER;
 }
 
@@ -40,7 +40,7 @@
 #endif
 #include <hecisupport.h>
 
-#include "options.h"
+#include "text_parser.h"
 #if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
 #include "ioc_can.h"
 #endif
@@ -60,6 +60,7 @@
 #include "trusty_common.h"
 #endif
 #include "storage.h"
+#include "prefetch.h"
 #include "acpi.h"
 #include "ux.h"
 
@@ -74,8 +75,58 @@ typedef union {
 	};
 } os_version_t;
 
-#define MAX_CMD_BUF 0x1000
-static CHAR8 cmd_buf[MAX_CMD_BUF];
+/* Keys of the ABL command line */
+enum abl_arg {
+	ABL_RESET,
+	ABL_BOOT_TARGET,
+	ABL_BOOT,
+	ABL_TRUSTY_PARAM,
+	ABL_SECUREBOOT,
+	ABL_BOOTVERSION,
+	ABL_BOOTREASON,
+	ABL_SERIALNO,
+	ABL_DEV_SEC_INFO,
+	ABL_SVNSEED,
+	ABL_IMAGE_BOOT_PARAMS_ADDR,
+	ABL_FIRMWARE_BOOTTIME,
+	ABL_RPMB,
+	ABL_STATUS,
+	ABL_SUFFIX,
+	ABL_ARG_LAST
+};
+
+static const struct abl_key {
+	const char *name;
+	BOOLEAN pass;		/* Also handed over to the kernel */
+} ABL_KEYS[ABL_ARG_LAST] = {
+	[ABL_RESET] = { "ABL.reset=", FALSE },
+	[ABL_BOOT_TARGET] = { "ABL.boot_target=", FALSE },
+	[ABL_BOOT] = { "ABL.boot=", TRUE },
+	[ABL_TRUSTY_PARAM] = { "trusty.param_addr=", FALSE },
+	[ABL_SECUREBOOT] = { "ABL.secureboot=", TRUE },
+	[ABL_BOOTVERSION] = { "androidboot.bootloader=", FALSE },
+	[ABL_BOOTREASON] = { "androidboot.bootreason=", FALSE },
+	[ABL_SERIALNO] = { "androidboot.serialno=", FALSE },
+	[ABL_DEV_SEC_INFO] = { "dev_sec_info.param_addr=", FALSE },
+	[ABL_SVNSEED] = { "ABL.svnseed=", FALSE },
+	[ABL_IMAGE_BOOT_PARAMS_ADDR] = { "ImageBootParamsAddr=", FALSE },
+	[ABL_FIRMWARE_BOOTTIME] = { "fw_boottsc=", FALSE },
+	[ABL_RPMB] = { "ABL.rpmb=", FALSE },
+	[ABL_STATUS] = { "ABL.status=", TRUE },
+	[ABL_SUFFIX] = { "ABL.suffix=", TRUE }
+};
+
+/* ABL command line, converted once by check_command_line().  The
+   tokens handed over to the kernel are packed at the start of the
+   buffer, space separated.  ABL_VALUES holds the value of each key
+   present on the command line and of the handed over keys.  */
+static CHAR8 *abl_cmdline;
+static text_slice_t abl_values[ABL_ARG_LAST];
+
+static const text_slice_t *abl_value(enum abl_arg arg)
+{
+	return abl_values[arg].str ? &abl_values[arg] : NULL;
+}
 
 #ifdef CRASHMODE_USE_ADB
 static EFI_STATUS enter_crashmode(enum boot_target *target)
@@ -172,10 +223,18 @@ static EFI_STATUS process_bootimage(void *bootimage, UINTN imagesize)
 	VBDATA *param = NULL;
 	UINT8 boot_state = BOOT_STATE_GREEN;
 	enum boot_target target = NORMAL_BOOT;
+	struct boot_img_hdr *aosp_header;
 
 	if (!bootimage)
 		return EFI_SUCCESS;
 
+	/* The image is used in place: it must fit in the buffer */
+	aosp_header = get_bootimage_header(bootimage);
+	if (!aosp_header || bootimage_size(aosp_header) > imagesize) {
+		error(L"Invalid boot image");
+		return EFI_INVALID_PARAMETER;
+	}
+
 #ifndef __FORCE_FASTBOOT
 #ifdef USE_AVB
 	AvbOps *ops;
@@ -285,17 +344,10 @@ fail:
 #endif //__FORCE_FASTBOOT
 	/* 'fastboot boot' case, only allowed on unlocked devices.*/
 	if (device_is_unlocked()) {
-		UINT32 crc;
-
-		ret = uefi_call_wrapper(BS->CalculateCrc32, 3, bootimage, imagesize, &crc);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"CalculateCrc32 failed");
-			return ret;
-		}
-
+		heci_end_of_post_wait();
 		ret = android_image_start_buffer(NULL, bootimage,
 							target, boot_state, NULL,
-							param, (const CHAR8 *)cmd_buf);
+							param, (const CHAR8 *)abl_cmdline);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Couldn't load Boot image");
 			return ret;
@@ -318,9 +370,10 @@ static EFI_STATUS enter_fastboot_mode(enum boot_target *target)
 	}
 #endif
 
-	/* Handle corner case that EOP not send before ABL jump to fastboot, will force EOP send.*/
+	/* Handle corner case that EOP not send before ABL jump to fastboot, will force EOP send.
+	 * The acknowledgement is only waited for before booting an image.*/
 	if (!heci_is_eop_received()) {
-		heci_end_of_post();
+		heci_end_of_post_async();
 	}
 
 	for (;;) {
@@ -338,7 +391,7 @@ static EFI_STATUS enter_fastboot_mode(enum boot_target *target)
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Process bootimage failed");
 			if (bootimage) {
-				FreePool(bootimage);
+				fastboot_free_image(bootimage);
 				bootimage = NULL;
 			}
 			break;
@@ -374,119 +427,45 @@ static union bootMode
 	};
 } bootMode;
 
-static enum boot_target check_command_line(EFI_HANDLE image, CHAR8 *cmd_buf, UINTN max_cmd_size)
+static enum abl_arg abl_lookup(const text_slice_t *token, text_slice_t *value)
+{
+	const char *eq;
+	UINTN i, key_len;
+
+	eq = mem_find(token->str, '=', token->len);
+	if (!eq)
+		return ABL_ARG_LAST;
+
+	key_len = eq + 1 - token->str;
+	for (i = 0; i < ABL_ARG_LAST; i++)
+		if (strlen((CHAR8 *)ABL_KEYS[i].name) == key_len &&
+		    !memcmp(token->str, ABL_KEYS[i].name, key_len))
+			break;
+	if (i == ABL_ARG_LAST)
+		return ABL_ARG_LAST;
+
+	value->str = token->str + key_len;
+	value->len = token->len - key_len;
+	return i;
+}
+
+/* Consume the ABL command line.  The pass over the command line is
+   stopped by ABL.boot_target=CRASHMODE.  */
+static enum boot_target check_command_line(EFI_HANDLE image)
 {
 	EFI_STATUS ret;
 	enum boot_target target = FASTBOOT;
 	static EFI_LOADED_IMAGE *limg;
-	UINTN argc, i, j;
-	CHAR16 **argv;
 	CHAR16 *options;
-	UINTN cmd_len = 0;
-	CHAR8 arg8[256] = "";
-	UINTN arglen;
+	CHAR16 *reason;
+	CHAR8 *r, *w;
+	text_slice_t token, value;
+	enum abl_arg arg;
+	UINTN size;
 #if defined(USE_TRUSTY) || defined(RPMB_STORAGE)
 	UINTN num;
 #endif
 
-	enum CmdType
-	{
-		RESET,
-		BOOT_TARGET,
-		BOOT,
-		TRUSTY_PARAM,
-		SECUREBOOT,
-		BOOTVERSION,
-		SERIALNO,
-		DEV_SEC_INFO,
-		IMAGE_BOOT_PARAMS_ADDR,
-		FIRMWARE_BOOTTIME,
-		BOOTREASON,
-		RPMB,
-		STATUS,
-	};
-
-	struct Cmdline
-	{
-		CHAR8 *name;
-		UINTN length;
-		enum CmdType type;
-	};
-
-	struct Cmdline CmdlineArray[] = {
-		{
-			(CHAR8 *)"ABL.reset=",
-			strlen((CHAR8 *)"ABL.reset="),
-			RESET
-		},
-		{
-			(CHAR8 *)"ABL.boot_target=",
-			strlen((CHAR8 *)"ABL.boot_target="),
-			BOOT_TARGET
-		},
-		{
-			(CHAR8 *)"ABL.boot=",
-			strlen((CHAR8 *)"ABL.boot="),
-			BOOT
-		},
-		{
-			(CHAR8 *)"trusty.param_addr=",
-			strlen((CHAR8 *)"trusty.param_addr="),
-			TRUSTY_PARAM
-		},
-		{
-			(CHAR8 *)"ABL.secureboot=",
-			strlen((CHAR8 *)"ABL.secureboot="),
-			SECUREBOOT
-		},
-		{
-			(CHAR8 *)"androidboot.bootloader=",
-			strlen((CHAR8 *)"androidboot.bootloader="),
-			BOOTVERSION
-		},
-		{
-			(CHAR8 *)"androidboot.bootreason=",
-			strlen((CHAR8 *)"androidboot.bootreason="),
-			BOOTREASON
-		},
-		{
-			(CHAR8 *)"androidboot.serialno=",
-			strlen((CHAR8 *)"androidboot.serialno="),
-			SERIALNO
-		},
-		{
-			(CHAR8 *)"dev_sec_info.param_addr=",
-			strlen((CHAR8 *)"dev_sec_info.param_addr="),
-			DEV_SEC_INFO
-		},
-		{
-			(CHAR8 *)"ABL.svnseed=",
-			strlen((CHAR8 *)"ABL.svnseed="),
-			DEV_SEC_INFO
-		},
-		{
-			(CHAR8 *)"ImageBootParamsAddr=",
-			strlen((CHAR8 *)"ImageBootParamsAddr="),
-			IMAGE_BOOT_PARAMS_ADDR
-		},
-		{
-			(CHAR8 *)"fw_boottsc=",
-			strlen("fw_boottsc="),
-			FIRMWARE_BOOTTIME
-		},
-		{
-			(CHAR8 *)"ABL.rpmb=",
-			strlen("ABL.rpmb="),
-			RPMB
-		},
-		{
-			(CHAR8 *)"ABL.status=",
-			strlen((CHAR8 *)"ABL.status="),
-			STATUS
-		},
-	};
-
-	CHAR8 *nptr = NULL;
 	ret = uefi_call_wrapper(BS->OpenProtocol, 6, image,
 				&LoadedImageProtocol, (VOID **)&limg,
 				image, NULL, EFI_OPEN_PROTOCOL_GET_PROTOCOL);
@@ -495,158 +474,149 @@ static enum boot_target check_command_line(EFI_HANDLE image, CHAR8 *cmd_buf, UIN
 		return FASTBOOT;
 	}
 
-	ret = get_argv(limg, &argc, &argv, &options);
-	if (EFI_ERROR(ret))
+	options = limg->LoadOptions ? (CHAR16 *)limg->LoadOptions : L"";
+	size = StrLen(options) + 1;
+	abl_cmdline = AllocatePool(size);
+	if (!abl_cmdline)
 		return FASTBOOT;
 
-	cmd_buf[0] = 0;
-
-	for (i = 0; i < argc; i++) {
-		debug(L" abl cmd %02d: %s", i, argv[i]);
-		arglen = StrLen(argv[i]);
+	ret = str_to_stra(abl_cmdline, options, size);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Non-ascii characters in command line");
+		FreePool(abl_cmdline);
+		abl_cmdline = NULL;
+		return FASTBOOT;
+	}
 
-		if (arglen > (int)sizeof(arg8) - 2)
-			arglen = sizeof(arg8) - 2;
-		debug(L" abl cmd %02d length: %d", i, arglen);
+	/* The values are used where they are, before their token is
+	   moved, while they are still followed by a space or the
+	   terminating NUL.  */
+	for (r = w = abl_cmdline; ; ) {
+		while (*r == ' ')
+			r++;
+		if (*r == '\0')
+			break;
 
-		ret = str_to_stra((CHAR8 *)arg8, argv[i], arglen + 1);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Non-ascii characters in command line");
-			return FASTBOOT;
-		}
+		token.str = (const char *)r;
+		while (*r != ' ' && *r != '\0')
+			r++;
+		token.len = r - (CHAR8 *)token.str;
+
+		arg = abl_lookup(&token, &value);
+		switch (arg) {
+		/* Parse "ABL.reset=xxx" */
+		case ABL_RESET:
+			reason = stran_to_str((const CHAR8 *)value.str, value.len);
+			if (reason) {
+				set_reboot_reason(reason);
+				FreePool(reason);
+			}
+			break;
 
-		if (cmd_len + arglen + 1 < max_cmd_size) {
-			for (j = 0; j < sizeof(CmdlineArray)/sizeof(CmdlineArray[0]); j++) {
-				if((arglen >= CmdlineArray[j].length) && !strncmp(arg8, CmdlineArray[j].name, CmdlineArray[j].length))
-					break;
+		/* Parse "ABL.boot_target=xxxx" */
+		case ABL_BOOT_TARGET:
+			/* Only handle CRASHMODE case, other mode should be decided by "ABL.boot". */
+			if (value.len == strlen((CHAR8 *)"CRASHMODE") &&
+			    !memcmp(value.str, "CRASHMODE", value.len)) {
+				target = CRASHMODE;
+				goto out;
 			}
+			break;
 
-			if (j < sizeof(CmdlineArray)/sizeof(CmdlineArray[0])) {
-				switch(CmdlineArray[j].type) {
-				/* Parse "ABL.reset=xxx" */
-				case RESET:
-					set_reboot_reason(argv[i] + CmdlineArray[j].length);
-					continue;
-
-				/* Parse "ABL.boot_target=xxxx" */
-				case BOOT_TARGET:
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					/* Only handle CRASHMODE case, other mode should be decided by "ABL.boot". */
-					if (!strcmp(nptr, (CHAR8 *)"CRASHMODE")) {
-						target = CRASHMODE;
-						goto out;
-					}
-					continue;
-
-				/* Parse "ABL.boot=xx" */
-				case BOOT:
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					bootMode._bits = (UINT16)strtoul((char *)nptr, 0, 16);
-					target = bootMode.target;
-					break;
+		/* Parse "ABL.boot=xx" */
+		case ABL_BOOT:
+			bootMode._bits = (UINT16)strtoul(value.str, 0, 16);
+			target = bootMode.target;
+			break;
 #ifdef USE_TRUSTY
-				/* Parse "trusty.param_addr=xxxxx" */
-				case TRUSTY_PARAM:
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					num = strtoul((char *)nptr, 0, 16);
-					debug(L"Parsed trusty param addr is 0x%x", num);
-					set_trusty_param((VOID *)num);
-					continue;
+		/* Parse "trusty.param_addr=xxxxx" */
+		case ABL_TRUSTY_PARAM:
+			num = strtoul(value.str, 0, 16);
+			debug(L"Parsed trusty param addr is 0x%x", num);
+			set_trusty_param((VOID *)num);
+			break;
 #endif //USE_TRUSTY
 #ifdef RPMB_STORAGE
-				/* Parse "Add legacy DEV_SEC_INFO parameter for backward compatible to ABL usage" */
-				case DEV_SEC_INFO:
-				case IMAGE_BOOT_PARAMS_ADDR:
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					num = strtoul((char *)nptr, 0, 16);
-					debug(L"Parsed device security information addr is 0x%x", num);
-					set_device_security_info((VOID *)num);
-					continue;
-
-				case RPMB:
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					num = strtoul((char *)nptr, 0, 16);
-					debug(L"abl_rpmb_key addr is 0x%x", num);
-					set_rpmb_derived_key_ex((VOID *)num, RPMB_KEY_SIZE, 1, 1);
-					memset((VOID *)num, 0, RPMB_KEY_SIZE);
-					continue;
+		/* Parse "Add legacy DEV_SEC_INFO parameter for backward compatible to ABL usage" */
+		case ABL_DEV_SEC_INFO:
+		case ABL_SVNSEED:
+		case ABL_IMAGE_BOOT_PARAMS_ADDR:
+			num = strtoul(value.str, 0, 16);
+			debug(L"Parsed device security information addr is 0x%x", num);
+			set_device_security_info((VOID *)num);
+			break;
+
+		case ABL_RPMB:
+			num = strtoul(value.str, 0, 16);
+			debug(L"abl_rpmb_key addr is 0x%x", num);
+			set_rpmb_derived_key_ex((VOID *)num, RPMB_KEY_SIZE, 1, 1);
+			memset((VOID *)num, 0, RPMB_KEY_SIZE);
+			break;
 #endif //RPMB_STORAGE
-				/* Parse "ABL.secureboot=x" */
-				case SECUREBOOT: {
-					UINT8 val;
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					val = (UINT8)strtoul((char *)nptr, 0, 10);
-					ret = set_platform_secure_boot(val);
-					if (EFI_ERROR(ret))
-						efi_perror(ret, L"Failed to set secure boot");
-					break;
-				}
-
-				/* Parse "ABL.status=x" */
-				case STATUS: {
-					union
-					{
-						struct
-						{
-							UINT32 secure_boot:1;
-							UINT32 measured_boot:1;
-							UINT32 dci_debug_npk:1;
-							UINT32 eom:1;
-						}bit;
-						UINT32 val;
-					} abl_status;
-
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					abl_status.val = (UINT32)strtoul((char *)nptr, 0, 16);
-					ret = set_platform_secure_boot(abl_status.bit.secure_boot);
-					if (EFI_ERROR(ret))
-						efi_perror(ret, L"Failed to set secure boot");
-					break;
-				}
-
-				/* Parse "fw_boottsc=xxxxx" */
-				case FIRMWARE_BOOTTIME: {
-					UINT64 VALUE;
-					UINT32 cpu_khz;
-					nptr = (CHAR8 *)(arg8 + CmdlineArray[j].length);
-					VALUE = (UINT64)strtoull((char *)nptr, 0, 10);
-					cpu_khz = get_cpu_freq() * 1000;
-					//EFI_ENTER_POINT boot time is recorded in ms
-					set_efi_enter_point(VALUE /cpu_khz);
-					continue;
-				}
-
-				/* Parse "android.bootloader=xxxxx" */
-				case BOOTVERSION:
-					continue;
-
-				/* Parse "android.serialno=xxxxx " */
-				case SERIALNO:
-					continue;
-
-				/* Parse "androidboot.bootreason=xxxxx " */
-				case BOOTREASON:
-					continue;
-
-				default:
-					continue;
-				}
-			}
+		/* Parse "ABL.secureboot=x" */
+		case ABL_SECUREBOOT:
+			ret = set_platform_secure_boot((UINT8)strtoul(value.str, 0, 10));
+			if (EFI_ERROR(ret))
+				efi_perror(ret, L"Failed to set secure boot");
+			break;
 
-			if (cmd_buf[0] != 0) {
-				strncpy((CHAR8 *)(cmd_buf + cmd_len), (const CHAR8 *)" ", 1);
-				cmd_len++;
-			}
+		/* Parse "ABL.status=x" */
+		case ABL_STATUS: {
+			union
+			{
+				struct
+				{
+					UINT32 secure_boot:1;
+					UINT32 measured_boot:1;
+					UINT32 dci_debug_npk:1;
+					UINT32 eom:1;
+				}bit;
+				UINT32 val;
+			} abl_status;
+
+			abl_status.val = (UINT32)strtoul(value.str, 0, 16);
+			ret = set_platform_secure_boot(abl_status.bit.secure_boot);
+			if (EFI_ERROR(ret))
+				efi_perror(ret, L"Failed to set secure boot");
+			break;
+		}
 
-			strncpy((CHAR8 *)(cmd_buf + cmd_len), (const CHAR8 *)arg8, arglen);
-			cmd_len += arglen;
+		/* Parse "fw_boottsc=xxxxx" */
+		case ABL_FIRMWARE_BOOTTIME: {
+			UINT64 VALUE;
+			UINT32 cpu_khz;
+			VALUE = (UINT64)strtoull(value.str, 0, 10);
+			cpu_khz = get_cpu_freq() * 1000;
+			//EFI_ENTER_POINT boot time is recorded in ms
+			set_efi_enter_point(VALUE /cpu_khz);
+			break;
 		}
+
+		/* "androidboot.bootloader=", "androidboot.serialno=" and
+		   "androidboot.bootreason=" are dropped, the bootloader
+		   provides its own.  */
+		default:
+			break;
+		}
+
+		if (arg != ABL_ARG_LAST)
+			abl_values[arg] = value;
+		if (arg != ABL_ARG_LAST && !ABL_KEYS[arg].pass)
+			continue;
+
+		/* W never passes TOKEN.STR: only tokens are dropped */
+		if (w != abl_cmdline)
+			*w++ = ' ';
+		memmove(w, token.str, token.len);
+		if (arg != ABL_ARG_LAST)
+			abl_values[arg].str = (const char *)w + (value.str - token.str);
+		w += token.len;
 	}
 
 out:
+	*w = '\0';
+	debug(L"ABL command line: %a", abl_cmdline);
 	debug(L"boot target: %d", target);
-	FreePool(argv);
-	FreePool(options);
 	return target;
 }
 
@@ -695,6 +665,7 @@ static EFI_STATUS start_boot_image(VOID *bootimage, UINT8 boot_state,
 
 	debug(L"chainloading boot image, boot state is %s\n",
 	boot_state_to_string(boot_state));
+	heci_end_of_post_wait();
 	ret = android_image_start_buffer(NULL, bootimage,
 					 boot_target, boot_state, NULL,
 					 vb_data, (const CHAR8 *)abl_cmd_line);
@@ -778,25 +749,16 @@ EFI_STATUS avb_boot_android(enum boot_target boot_target, CHAR8 *abl_cmd_line)
 	if (slot_data->ab_suffix) {
 		CHAR8 *capsule_buf;
 		UINTN capsule_buf_len = 0;
-		CHAR16 *AB_SUFFIX = NULL;
-		CHAR16 *ABL_AB_SUFFIX = NULL;
+		const text_slice_t *abl_suffix = abl_value(ABL_SUFFIX);
 
-		AB_SUFFIX = stra_to_str((const CHAR8 *)slot_data->ab_suffix);
-		if (!AB_SUFFIX) {
-			error(L"Cannot get a valid AVB flow suffix: %s", slot_data->ab_suffix);
-			goto fail;
-		}
-		ABL_AB_SUFFIX = stra_to_str((const CHAR8 *)abl_cmd_line);
-		if (!ABL_AB_SUFFIX) {
-			error(L"Cannot get a valid ABL suffix: %s", abl_cmd_line);
-			goto fail;
-		}
-		if (!(StrStr(ABL_AB_SUFFIX, L"ABL.suffix"))) {
+		if (!abl_suffix) {
 			debug(L"ABL.suffix is null");
-		} else if (!(StrCmp(AB_SUFFIX, L"_a")) && (!(StrStr(ABL_AB_SUFFIX, L"ABL.suffix=0")))) {
+		} else if (!strcmp((CHAR8 *)slot_data->ab_suffix, (CHAR8 *)"_a") &&
+			   !slice_starts_with(abl_suffix, "0")) {
 			capsule_buf = (CHAR8 *)"m1:@0";
 			capsule_buf_len = strlen(capsule_buf);
-		} else if (!(StrCmp(AB_SUFFIX, L"_b")) && (!(StrStr(ABL_AB_SUFFIX, L"ABL.suffix=1")))) {
+		} else if (!strcmp((CHAR8 *)slot_data->ab_suffix, (CHAR8 *)"_b") &&
+			   !slice_starts_with(abl_suffix, "1")) {
 			capsule_buf = (CHAR8 *)"m2:@0";
 			capsule_buf_len = strlen(capsule_buf);
 		}
@@ -1122,7 +1084,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 	ux_display_vendor_splash();
 #endif
 
-	target = check_command_line(image, cmd_buf, sizeof(cmd_buf) - 1);
+	target = check_command_line(image);
 	if (!get_boot_device()) {
 		// Get boot device failed
 		error(L"Failed to find boot device");
@@ -1198,13 +1160,20 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *sys_table)
 		case NORMAL_BOOT:
 		case RECOVERY:
 			set_boottime_stamp(TM_AVB_START);
+#ifdef USE_TRUSTY
+			/* The TOS image is read while the boot image is verified */
+			if (target == NORMAL_BOOT)
+				tos_image_prefetch();
+#endif
 #ifdef USE_AVB
-			ret = avb_boot_android(target, cmd_buf);
+			ret = avb_boot_android(target, abl_cmdline);
 #else
-			ret = boot_android(target, cmd_buf);
+			ret = boot_android(target, abl_cmdline);
 #endif
-			if (EFI_ERROR(ret))
+			if (EFI_ERROR(ret)) {
+				prefetch_release();
 				target = FASTBOOT;
+			}
 			break;
 		case UNKNOWN_TARGET:
 #ifndef CRASHMODE_USE_ADB
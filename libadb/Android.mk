@@ -12,7 +12,8 @@ LOCAL_STATIC_LIBRARIES := \
 	libkernelflinger-$(TARGET_BUILD_VARIANT)
 
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/../include/libadb
-LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include/libadb
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include/libadb \
+	$(LOCAL_PATH)/../libsslsupport
 LOCAL_SRC_FILES := \
 	adb.c \
 	adb_socket.c \
@@ -26,6 +27,10 @@ LOCAL_SRC_FILES := \
 	ioport.c \
 	lspartition.c \
 	pci_class.c \
-	lspci.c
+	lspci.c \
+	storagebench.c \
+	crashdump.c \
+	memsum.c \
+	meminfo.c
 
 include $(BUILD_EFI_STATIC_LIBRARY)
@@ -39,6 +39,9 @@
 #include "adb.h"
 #include "adb_socket.h"
 #include "service.h"
+#ifdef CRASHDUMP_PARTITION
+#include "crashdump.h"
+#endif
 
 /* USB configuration */
 #define ADB_IF_SUBCLASS		0x42
@@ -54,6 +57,7 @@
 #define ADB_VERSION_MAX	0x01000001
 #define ADB_VERSION_SKIP_CHECKSUM	0x01000001
 #define SYSTEM_TYPE	"bootloader"
+#define FEATURE_DELAYED_ACK	"delayed_ack"
 
 /* Internal data */
 typedef enum adb_state {
@@ -74,6 +78,7 @@ unsigned char in_buf[ADB_MIN_PAYLOAD];
 
 UINT32 adb_max_payload;
 UINT32 adb_version;
+BOOLEAN adb_delayed_ack;
 
 static UINT32 adb_pkt_sum(adb_pkt_t *pkt)
 {
@@ -86,10 +91,110 @@ static UINT32 adb_pkt_sum(adb_pkt_t *pkt)
 	return sum;
 }
 
-static adb_pkt_t *delayed_pkt_data;
-EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1)
+/* Some transport layer (USB in particular) might not support several
+   writes in raw.  The packets are queued: the header of the first
+   one is written, its payload on the TX event and then the header of
+   the next packet on the following TX event.  The header is copied
+   so that the caller can reuse its packet structure right away, the
+   payload must stay untouched until the packet is sent.
+
+   A stream transport (TCP) writes the header and the payload of a
+   packet as one vectored transfer, the payload is not copied, and up
+   to ADB_TX_IN_FLIGHT packets are written without waiting for their
+   TX event.  */
+#define ADB_TX_QUEUE_SIZE	32
+#define ADB_TX_IN_FLIGHT	8
+
+typedef struct adb_tx {
+	adb_msg_t msg;
+	unsigned char *data;
+	UINT32 *pending;
+} adb_tx_t;
+
+static adb_tx_t tx_queue[ADB_TX_QUEUE_SIZE];
+static UINTN tx_head, tx_count;
+static BOOLEAN tx_payload;
+static BOOLEAN adb_tx_msg;	/* The transport has writev() */
+static UINTN tx_in_flight;	/* Packets written as one transfer */
+
+static void adb_tx_pop(void)
 {
-	EFI_STATUS ret;
+	adb_tx_t *tx = &tx_queue[tx_head];
+
+	if (tx->pending)
+		(*tx->pending)--;
+	tx_head = (tx_head + 1) % ARRAY_SIZE(tx_queue);
+	tx_count--;
+}
+
+static EFI_STATUS adb_tx_msg_start(void)
+{
+	EFI_STATUS ret, first_ret = EFI_SUCCESS;
+	transport_iov_t iov[2];
+	adb_tx_t *tx;
+
+	while (tx_in_flight < min(tx_count, (UINTN)ADB_TX_IN_FLIGHT)) {
+		tx = &tx_queue[(tx_head + tx_in_flight) % ARRAY_SIZE(tx_queue)];
+		iov[0].buf = &tx->msg;
+		iov[0].len = sizeof(tx->msg);
+		iov[1].buf = tx->data;
+		iov[1].len = tx->msg.data_length;
+
+		/* The TX event may be trigged before transport_writev()
+		   returns */
+		tx_in_flight++;
+		ret = transport_writev(iov, iov[1].len ? 2 : 1);
+		if (!EFI_ERROR(ret))
+			continue;
+
+		tx_in_flight--;
+		/* Retried on the TX event of the packets in flight */
+		if (tx_in_flight)
+			break;
+
+		efi_perror(ret, L"Failed to send adb packet");
+		if (!EFI_ERROR(first_ret))
+			first_ret = ret;
+		adb_tx_pop();
+	}
+
+	return first_ret;
+}
+
+static EFI_STATUS adb_tx_start(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS, first_ret = EFI_SUCCESS;
+
+	if (adb_tx_msg)
+		return adb_tx_msg_start();
+
+	while (tx_count) {
+		/* Some transport implementation (TCP in particular)
+		   trig the TX event before transport_write() returns */
+		tx_payload = FALSE;
+		ret = transport_write(&tx_queue[tx_head].msg,
+				      sizeof(tx_queue[tx_head].msg));
+		if (!EFI_ERROR(ret))
+			break;
+
+		efi_perror(ret, L"Failed to send adb msg");
+		if (!EFI_ERROR(first_ret))
+			first_ret = ret;
+		adb_tx_pop();
+	}
+
+	return first_ret;
+}
+
+EFI_STATUS adb_queue_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0,
+			 UINT32 arg1, UINT32 *pending)
+{
+	adb_tx_t *tx;
+
+	if (tx_count == ARRAY_SIZE(tx_queue)) {
+		error(L"adb transmit queue is full");
+		return EFI_OUT_OF_RESOURCES;
+	}
 
 	pkt->msg.command = command;
 	pkt->msg.arg0 = arg0;
@@ -101,20 +206,22 @@ EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1
 	else
 		pkt->msg.data_check = 0;
 
-	/* Some transport layer (USB in particular) might not support
-	   several writes in raw.  Wait for the TX event to send the
-	   payload.  Prepare the delayed packet before we send the
-	   first one because some transport implementation trig the TX
-	   even (TCP in particular) before the first transport_write()
-	   returns.  */
-	if (pkt->msg.data_length)
-		delayed_pkt_data = pkt;
+	tx = &tx_queue[(tx_head + tx_count) % ARRAY_SIZE(tx_queue)];
+	tx->msg = pkt->msg;
+	tx->data = pkt->data;
+	tx->pending = pending;
+	if (pending)
+		(*pending)++;
 
-	ret = transport_write(&pkt->msg, sizeof(pkt->msg));
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"Failed to send adb msg");
+	if (tx_count++ && !adb_tx_msg)
+		return EFI_SUCCESS;
 
-	return ret;
+	return adb_tx_start();
+}
+
+EFI_STATUS adb_send_pkt(adb_pkt_t *pkt, UINT32 command, UINT32 arg0, UINT32 arg1)
+{
+	return adb_queue_pkt(pkt, command, arg0, arg1, NULL);
 }
 
 static void adb_read_msg(void)
@@ -153,6 +260,27 @@ static BOOLEAN is_supported_adb_version(UINT32 ver)
 	return ((ver >= ADB_VERSION_MIN) && (ver <= ADB_VERSION_MAX)) ? TRUE : FALSE;
 }
 
+/* The host banner looks like "host::features=shell_v2,cmd,..." */
+static BOOLEAN has_feature(adb_pkt_t *pkt, const char *feature)
+{
+	char banner[sizeof(in_buf) + 1];
+	char *features, *token, *saveptr;
+
+	memcpy(banner, pkt->data, pkt->msg.data_length);
+	banner[pkt->msg.data_length] = '\0';
+
+	features = strcasestr(banner, "features=");
+	if (!features)
+		return FALSE;
+
+	token = strtok_r(features + strlen((CHAR8 *)"features="), ",;", &saveptr);
+	for (; token; token = strtok_r(NULL, ",;", &saveptr))
+		if (!strcmp((CHAR8 *)token, (CHAR8 *)feature))
+			return TRUE;
+
+	return FALSE;
+}
+
 static void cmd_connect(adb_pkt_t *pkt)
 {
 	EFI_STATUS ret;
@@ -166,8 +294,12 @@ static void cmd_connect(adb_pkt_t *pkt)
 	adb_version = pkt->msg.arg0;
 	adb_max_payload = min((UINT32)ADB_MAX_PAYLOAD, pkt->msg.arg1);
 	debug(L"Negociated payload size is %d bytes", adb_max_payload);
+	adb_delayed_ack = has_feature(pkt, FEATURE_DELAYED_ACK);
+	if (adb_delayed_ack)
+		debug(L"Delayed acknowledgement enabled");
 
-	out_pkt.data = (unsigned char *)SYSTEM_TYPE "::";
+	out_pkt.data = (unsigned char *)SYSTEM_TYPE "::features="
+		FEATURE_DELAYED_ACK;
 	out_pkt.msg.data_length = strlen(out_pkt.data);
 
 	ret = adb_send_pkt(&out_pkt, pkt->msg.command, pkt->msg.arg0,
@@ -199,12 +331,13 @@ static void cmd_open(adb_pkt_t *pkt)
 			break;
 		}
 
-	asock_open(pkt->msg.arg0, srv, arg);
+	asock_open(pkt->msg.arg0, pkt->msg.arg1, srv, arg);
 }
 
 static void cmd_okay(adb_pkt_t *pkt)
 {
-	asock_okay(asock_find(pkt->msg.arg1, pkt->msg.arg0));
+	asock_okay(asock_find(pkt->msg.arg1, pkt->msg.arg0),
+		   pkt->data, pkt->msg.data_length);
 }
 
 static void cmd_close(adb_pkt_t *pkt)
@@ -327,14 +460,32 @@ static void adb_process_tx(__attribute__((__unused__)) void *buf,
 			   __attribute__((__unused__)) unsigned len)
 {
 	EFI_STATUS ret;
+	adb_tx_t *tx;
 
-	if (!delayed_pkt_data)
+	if (!tx_count)
 		return;
 
-	ret = transport_write(delayed_pkt_data->data, delayed_pkt_data->msg.data_length);
-	delayed_pkt_data = NULL;
-	if (EFI_ERROR(ret))
+	if (adb_tx_msg) {
+		if (tx_in_flight)
+			tx_in_flight--;
+		adb_tx_pop();
+		adb_tx_msg_start();
+		asock_tx_done();
+		return;
+	}
+
+	tx = &tx_queue[tx_head];
+	if (!tx_payload && tx->msg.data_length) {
+		tx_payload = TRUE;
+		ret = transport_write(tx->data, tx->msg.data_length);
+		if (!EFI_ERROR(ret))
+			return;
 		efi_perror(ret, L"Failed to send adb payload");
+	}
+
+	adb_tx_pop();
+	adb_tx_start();
+	asock_tx_done();
 }
 
 static enum boot_target exit_bt;
@@ -400,14 +551,46 @@ static transport_t ADB_TRANSPORT[] = {
 		.stop = tcp_stop,
 		.run = tcp_run,
 		.read = tcp_read,
-		.write = tcp_write
+		.write = tcp_write,
+		.writev = tcp_writev
 	}
 };
 
+#ifdef CRASHDUMP_PARTITION
+#ifndef CRASHDUMP_SOURCE
+#define CRASHDUMP_SOURCE CRASHDUMP_DEFAULT_SOURCE
+#endif
+
+/* Save the crash dump once per boot, before any host can connect, so
+   that the units without a host attached keep it.  */
+static void save_crashdump(void)
+{
+	static BOOLEAN saved;
+	struct crashdump_header hdr;
+	EFI_STATUS ret;
+
+	if (saved)
+		return;
+	saved = TRUE;
+
+	debug(L"Saving the '%a' crash dump to '%a'", CRASHDUMP_SOURCE,
+	      CRASHDUMP_PARTITION);
+	ret = crashdump_save(CRASHDUMP_PARTITION, CRASHDUMP_SOURCE, &hdr);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to save the crash dump");
+	else
+		debug(L"%ld KiB crash dump saved", hdr.data_size / 1024);
+}
+#endif
+
 EFI_STATUS adb_init()
 {
 	EFI_STATUS ret;
 
+#ifdef CRASHDUMP_PARTITION
+	save_crashdump();
+#endif
+
 	adb_pkt_in.data = in_buf;
 	exit_bt = UNKNOWN_TARGET;
 
@@ -417,7 +600,12 @@ EFI_STATUS adb_init()
 		return ret;
 	}
 
-	return transport_start(adb_read_msg, adb_process_rx, adb_process_tx);
+	ret = transport_start(adb_read_msg, adb_process_rx, adb_process_tx);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	adb_tx_msg = transport_has_writev();
+	return EFI_SUCCESS;
 }
 
 EFI_STATUS adb_run()
@@ -439,5 +627,7 @@ EFI_STATUS adb_exit()
 {
 	asock_close_all();
 	transport_stop();
+	tx_head = tx_count = 0;
+	asock_free_all();
 	return EFI_SUCCESS;
 }
@@ -36,12 +36,36 @@
 #include "adb_socket.h"
 #include "service.h"
 
+/* Each socket has ASOCK_TX_BUFFERS buffers of ASOCK_TX_BUFFER_SIZE
+   bytes for the small payloads copied by asock_write() so that
+   several WRTE packets can be waiting for the transport.  They are
+   allocated on the first use of the socket slot and kept until adb
+   exits because a closed socket may still have packets in the
+   transmit queue.  The bulk data is sent by asock_write_ref() without
+   any copy.  */
+#define ASOCK_TX_BUFFERS	4
+#define ASOCK_TX_BUFFER_SIZE	ADB_MIN_PAYLOAD
+
+/* Number of bytes the host can send before an acknowledgement when
+   the delayed acknowledgement is enabled: the adb input buffer
+   size.  */
+#define ASOCK_RECV_WINDOW	ADB_MIN_PAYLOAD
+
 struct asock {
 	UINT32 local;
 	UINT32 remote;
 	adb_pkt_t msg;
 	adb_pkt_t wrt;
-	unsigned char data[ADB_MAX_PAYLOAD];
+	unsigned char *data[ASOCK_TX_BUFFERS];
+	UINT32 tx_next;		/* Next payload buffer to use */
+	UINT32 tx_queued;	/* WRTE packets waiting for the transport */
+	BOOLEAN tx_wait;	/* The service waits for tx_queued to drop to 0 */
+	BOOLEAN closing;	/* Closed once tx_queued drops to 0 */
+	BOOLEAN wait_okay;	/* A WRTE packet is not acknowledged yet */
+	INT64 window;		/* Bytes the host still accepts */
+	UINT32 acked;		/* Received bytes to acknowledge */
+	UINT32 acks[ASOCK_TX_BUFFERS];
+	UINT32 ack_next;
 	service_t *service;
 	void *context;
 };
@@ -49,7 +73,23 @@ struct asock {
 static struct asock asocks[MAX_ADB_SOCKET];
 
 /* Host to device */
-EFI_STATUS asock_open(UINT32 remote, service_t *service, char *arg)
+static EFI_STATUS asock_alloc_buffers(asock_t s)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(s->data); i++) {
+		if (s->data[i])
+			continue;
+		s->data[i] = AllocatePool(ASOCK_TX_BUFFER_SIZE);
+		if (!s->data[i])
+			return EFI_OUT_OF_RESOURCES;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS asock_open(UINT32 remote, UINT32 window, service_t *service,
+		      char *arg)
 {
 	static adb_pkt_t fail_msg = { .msg.data_length = 0 };
 	EFI_STATUS ret;
@@ -74,9 +114,17 @@ EFI_STATUS asock_open(UINT32 remote, service_t *service, char *arg)
 		goto err;
 	}
 
+	ret = asock_alloc_buffers(s);
+	if (EFI_ERROR(ret))
+		goto err;
+
 	s->remote = remote;
 	s->service = service;
 	s->context = NULL;
+	s->tx_wait = s->closing = FALSE;
+	s->wait_okay = FALSE;
+	s->window = window;
+	s->acked = ASOCK_RECV_WINDOW;
 
 	ret = service->open(arg, &s->context);
 	if (EFI_ERROR(ret))
@@ -106,13 +154,10 @@ err:
 	return adb_send_pkt(&fail_msg, A_CLSE, 0, remote);
 }
 
-EFI_STATUS asock_close(asock_t s)
+static EFI_STATUS asock_close_service(asock_t s)
 {
 	EFI_STATUS ret;
 
-	if (!s)
-		return EFI_INVALID_PARAMETER;
-
 	ret = s->service->close(s);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to close service on socket %d/%d",
@@ -122,36 +167,124 @@ EFI_STATUS asock_close(asock_t s)
 
 	debug(L"socket %d/%d closed", s->local, s->remote);
 	s->local = 0;
+	s->closing = FALSE;
 
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS asock_okay(asock_t s)
+/* The service buffers referenced by the WRTE packets still in the
+   transmit queue must stay valid: the service is closed once they
+   are all sent.  */
+EFI_STATUS asock_close(asock_t s)
 {
 	if (!s)
 		return EFI_INVALID_PARAMETER;
 
+	if (s->tx_queued) {
+		s->closing = TRUE;
+		return EFI_SUCCESS;
+	}
+
+	return asock_close_service(s);
+}
+
+EFI_STATUS asock_okay(asock_t s, unsigned char *data, UINT32 length)
+{
+	INT32 acked;
+
+	if (!s || s->closing)
+		return EFI_INVALID_PARAMETER;
+
+	if (adb_delayed_ack) {
+		if (length != sizeof(acked)) {
+			error(L"OKAY without acknowledged bytes on socket %d/%d",
+			      s->local, s->remote);
+			return EFI_INVALID_PARAMETER;
+		}
+		memcpy(&acked, data, sizeof(acked));
+		s->window += acked;
+	}
+	s->wait_okay = FALSE;
+
 	return s->service->okay(s);
 }
 
 EFI_STATUS asock_read(asock_t s, unsigned char *data, UINT32 length)
 {
-	if (!s)
+	if (!s || s->closing)
 		return EFI_INVALID_PARAMETER;
 
+	s->acked += length;
 	return s->service->read(s, data, length);
 }
 
 /* Device to host */
+BOOLEAN asock_can_write(asock_t s)
+{
+	if (!s || s->tx_queued == ARRAY_SIZE(s->data))
+		return FALSE;
+
+	return adb_delayed_ack ? s->window > 0 : !s->wait_okay;
+}
+
+static EFI_STATUS asock_queue_write(asock_t s, unsigned char *data,
+				    UINT32 length)
+{
+	EFI_STATUS ret;
+
+	s->wrt.data = data;
+	s->wrt.msg.data_length = length;
+	ret = adb_queue_pkt(&s->wrt, A_WRTE, s->local, s->remote,
+			    &s->tx_queued);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	s->wait_okay = TRUE;
+	s->window -= length;
+
+	return EFI_SUCCESS;
+}
+
 EFI_STATUS asock_write(asock_t s, unsigned char *data, UINT32 length)
+{
+	EFI_STATUS ret;
+	unsigned char *buf;
+
+	if (!s || length > min(adb_max_payload, (UINT32)ASOCK_TX_BUFFER_SIZE))
+		return EFI_INVALID_PARAMETER;
+
+	if (s->tx_queued == ARRAY_SIZE(s->data))
+		return EFI_NOT_READY;
+
+	buf = s->data[s->tx_next];
+	memcpy(buf, data, length);
+	ret = asock_queue_write(s, buf, length);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	s->tx_next = (s->tx_next + 1) % ARRAY_SIZE(s->data);
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS asock_write_ref(asock_t s, unsigned char *data, UINT32 length)
 {
 	if (!s || length > adb_max_payload)
 		return EFI_INVALID_PARAMETER;
 
-	memcpy(s->data, data, length);
-	s->wrt.data = s->data;
-	s->wrt.msg.data_length = length;
-	return adb_send_pkt(&s->wrt, A_WRTE, s->local, s->remote);
+	if (s->tx_queued == ARRAY_SIZE(s->data))
+		return EFI_NOT_READY;
+
+	return asock_queue_write(s, data, length);
+}
+
+BOOLEAN asock_tx_busy(asock_t s)
+{
+	if (!s || !s->tx_queued)
+		return FALSE;
+
+	s->tx_wait = TRUE;
+	return TRUE;
 }
 
 EFI_STATUS asock_send_okay(asock_t s)
@@ -159,6 +292,15 @@ EFI_STATUS asock_send_okay(asock_t s)
 	if (!s)
 		return EFI_INVALID_PARAMETER;
 
+	s->msg.msg.data_length = 0;
+	if (adb_delayed_ack) {
+		s->acks[s->ack_next] = s->acked;
+		s->msg.data = (unsigned char *)&s->acks[s->ack_next];
+		s->msg.msg.data_length = sizeof(s->acks[s->ack_next]);
+		s->ack_next = (s->ack_next + 1) % ARRAY_SIZE(s->acks);
+		s->acked = 0;
+	}
+
 	return adb_send_pkt(&s->msg, A_OKAY, s->local, s->remote);
 }
 
@@ -167,6 +309,7 @@ EFI_STATUS asock_send_close(asock_t s)
 	if (!s)
 		return EFI_INVALID_PARAMETER;
 
+	s->msg.msg.data_length = 0;
 	return adb_send_pkt(&s->msg, A_CLSE, s->local, s->remote);
 }
 
@@ -191,11 +334,57 @@ asock_t asock_find(UINT32 local, UINT32 remote)
 	return NULL;
 }
 
+void asock_tx_done(void)
+{
+	EFI_STATUS ret;
+	asock_t s;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(asocks); i++) {
+		s = &asocks[i];
+		if (!s->local || s->tx_queued)
+			continue;
+
+		if (s->closing) {
+			asock_close_service(s);
+			continue;
+		}
+
+		if (!s->tx_wait)
+			continue;
+
+		s->tx_wait = FALSE;
+		if (!s->service->drained)
+			continue;
+
+		ret = s->service->drained(s);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to resume the transfer on socket %d/%d",
+				   s->local, s->remote);
+	}
+}
+
+/* The transmit queue is flushed: the service buffers do not need to
+   be kept anymore.  */
 void asock_close_all()
 {
 	UINTN i;
 
 	for (i = 0; i < ARRAY_SIZE(asocks); i++)
-		if (asocks[i].local)
-			asock_close(&asocks[i]);
+		if (asocks[i].local) {
+			asocks[i].tx_queued = 0;
+			asock_close_service(&asocks[i]);
+		}
+}
+
+void asock_free_all()
+{
+	UINTN i, j;
+
+	for (i = 0; i < ARRAY_SIZE(asocks); i++)
+		for (j = 0; j < ARRAY_SIZE(asocks[i].data); j++) {
+			if (asocks[i].data[j])
+				FreePool(asocks[i].data[j]);
+			asocks[i].data[j] = NULL;
+		}
 }
@@ -45,19 +45,37 @@ struct service;
 #define MAX_ADB_SOCKET 5
 
 /* Host to device */
-EFI_STATUS asock_open(UINT32 remote, struct service *service, char *arg);
+EFI_STATUS asock_open(UINT32 remote, UINT32 window, struct service *service,
+		      char *arg);
 EFI_STATUS asock_close(asock_t s);
-EFI_STATUS asock_okay(asock_t s);
+EFI_STATUS asock_okay(asock_t s, unsigned char *data, UINT32 length);
 EFI_STATUS asock_read(asock_t s, unsigned char *data, UINT32 length);
 
 /* Device to host */
+/* TRUE if a WRTE packet can be sent right away: a payload buffer is
+   available and the host accepts more data, that is no WRTE packet
+   is waiting for its OKAY or, with the delayed acknowledgement, the
+   host window is not exhausted.  */
+BOOLEAN asock_can_write(asock_t s);
+/* Send a WRTE packet with a copy of the LENGTH bytes of DATA, which
+   must not exceed ADB_MIN_PAYLOAD bytes.  */
 EFI_STATUS asock_write(asock_t s, unsigned char *data, UINT32 length);
+/* Same as asock_write() for up to adb_max_payload bytes but without
+   any copy: DATA must stay untouched until asock_tx_busy() returns
+   FALSE.  */
+EFI_STATUS asock_write_ref(asock_t s, unsigned char *data, UINT32 length);
+/* TRUE if WRTE packets of S are still waiting for the transport.  The
+   service drained() function is called once they are all sent.  */
+BOOLEAN asock_tx_busy(asock_t s);
 EFI_STATUS asock_send_okay(asock_t s);
 EFI_STATUS asock_send_close(asock_t s);
 
 /* Tools */
 void *asock_context(asock_t s);
 asock_t asock_find(UINT32 local, UINT32 remote);
+/* Called by adb on each TX event */
+void asock_tx_done(void);
 void asock_close_all();
+void asock_free_all();
 
 #endif	/* _ADB_SOCKET_H_ */
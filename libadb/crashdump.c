@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include <timer.h>
+#include <async_io.h>
+
+#include "reader.h"
+#include "crashdump.h"
+
+/* The reader output is gathered in ASYNC_IO_MAX_REQUESTS static
+   buffers so that a memory dump does not make any dynamic memory
+   allocation for its data.  One buffer is filled while the others are
+   written.  */
+#define CRASHDUMP_BUF_SIZE	(256 * 1024)
+
+static unsigned char dump_buf[ASYNC_IO_MAX_REQUESTS][CRASHDUMP_BUF_SIZE];
+
+static EFI_STATUS get_partition(const char *label,
+				struct gpt_partition_interface *gparti)
+{
+	EFI_STATUS ret;
+	CHAR16 *label16;
+
+	label16 = stra_to_str((CHAR8 *)label);
+	if (!label16)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = gpt_get_partition_by_label(label16, gparti, LOGICAL_UNIT_USER);
+	FreePool(label16);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Cannot access partition '%a'", label);
+
+	return ret;
+}
+
+static UINT64 partition_offset(struct gpt_partition_interface *gparti)
+{
+	return gparti->part.starting_lba * gparti->bio->Media->BlockSize;
+}
+
+static UINT64 partition_size(struct gpt_partition_interface *gparti)
+{
+	return (gparti->part.ending_lba + 1 - gparti->part.starting_lba) *
+		gparti->bio->Media->BlockSize;
+}
+
+static EFI_STATUS write_header(struct gpt_partition_interface *gparti,
+			       struct crashdump_header *hdr)
+{
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(gparti->dio->WriteDisk, 5, gparti->dio,
+				gparti->bio->Media->MediaId,
+				partition_offset(gparti), sizeof(*hdr), hdr);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to write the crash dump header");
+
+	return ret;
+}
+
+static EFI_STATUS fill_buffer(reader_ctx_t *ctx, unsigned char *buf, UINTN *size)
+{
+	EFI_STATUS ret;
+	unsigned char *data;
+	UINT64 len;
+
+	for (*size = 0; *size < CRASHDUMP_BUF_SIZE; *size += len) {
+		len = CRASHDUMP_BUF_SIZE - *size;
+		ret = reader_read(ctx, &data, &len);
+		if (EFI_ERROR(ret))
+			return ret;
+		if (len == 0)
+			break;
+		memcpy(buf + *size, data, len);
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS write_data(reader_ctx_t *ctx,
+			     struct gpt_partition_interface *gparti,
+			     UINT64 *written)
+{
+	EFI_STATUS ret, wait_ret;
+	struct async_io *aio;
+	UINTN ids[ASYNC_IO_MAX_REQUESTS];
+	BOOLEAN pending[ASYNC_IO_MAX_REQUESTS] = { FALSE };
+	UINT64 offset = CRASHDUMP_DATA_OFFSET;
+	UINTN i, size;
+
+	ret = async_io_open(gparti, &aio);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	for (i = 0; ; i = (i + 1) % ASYNC_IO_MAX_REQUESTS) {
+		if (pending[i]) {
+			ret = async_io_wait(aio, ids[i]);
+			pending[i] = FALSE;
+			if (EFI_ERROR(ret))
+				break;
+		}
+
+		ret = fill_buffer(ctx, dump_buf[i], &size);
+		if (EFI_ERROR(ret) || size == 0)
+			break;
+
+		if (offset + size > partition_size(gparti)) {
+			error(L"The partition is too small for the crash dump");
+			ret = EFI_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		ret = async_io_write(aio, partition_offset(gparti) + offset,
+				     size, dump_buf[i], &ids[i]);
+		if (EFI_ERROR(ret))
+			break;
+
+		pending[i] = TRUE;
+		offset += size;
+	}
+
+	wait_ret = async_io_wait_all(aio);
+	async_io_close(aio);
+	if (EFI_ERROR(wait_ret))
+		efi_perror(wait_ret, L"Failed to write the crash dump");
+
+	*written = offset - CRASHDUMP_DATA_OFFSET;
+	return EFI_ERROR(ret) ? ret : wait_ret;
+}
+
+EFI_STATUS crashdump_save(const char *label, const char *source,
+			  struct crashdump_header *hdr)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	reader_ctx_t ctx;
+	char args[CRASHDUMP_SOURCE_LEN];
+	EFI_TIME now;
+
+	if (!label || !source || !hdr ||
+	    strlen((CHAR8 *)source) >= sizeof(args))
+		return EFI_INVALID_PARAMETER;
+
+	ret = get_partition(label, &gparti);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (partition_size(&gparti) <= CRASHDUMP_DATA_OFFSET) {
+		error(L"Partition '%a' is too small", label);
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	/* Invalidate the previous crash dump */
+	memset(hdr, 0, sizeof(*hdr));
+	ret = write_header(&gparti, hdr);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* The reader splits its arguments in place */
+	strcpy((CHAR8 *)args, (CHAR8 *)source);
+	memset(&ctx, 0, sizeof(ctx));
+	ret = reader_open(&ctx, args);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open the '%a' reader", source);
+		return ret;
+	}
+
+	ret = write_data(&ctx, &gparti, &hdr->data_size);
+	reader_close(&ctx);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(hdr->magic, CRASHDUMP_MAGIC, sizeof(hdr->magic));
+	hdr->version = CRASHDUMP_VERSION;
+	hdr->compression = strncmp((CHAR8 *)source, (CHAR8 *)"lz4:", 4) ?
+		CRASHDUMP_NONE : CRASHDUMP_LZ4;
+	hdr->data_offset = CRASHDUMP_DATA_OFFSET;
+	strcpy((CHAR8 *)hdr->source, (CHAR8 *)source);
+	ret = uefi_call_wrapper(RT->GetTime, 2, &now, NULL);
+	hdr->time = EFI_ERROR(ret) ? 0 : efi_time_to_ctime(&now);
+
+	return write_header(&gparti, hdr);
+}
+
+EFI_STATUS crashdump_read_header(const char *label,
+				 struct gpt_partition_interface *gparti,
+				 struct crashdump_header *hdr)
+{
+	EFI_STATUS ret;
+
+	ret = get_partition(label, gparti);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
+				gparti->bio->Media->MediaId,
+				partition_offset(gparti), sizeof(*hdr), hdr);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read the crash dump header");
+		return ret;
+	}
+
+	if (memcmp(hdr->magic, CRASHDUMP_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != CRASHDUMP_VERSION) {
+		error(L"No crash dump in partition '%a'", label);
+		return EFI_NOT_FOUND;
+	}
+
+	if (hdr->data_offset + hdr->data_size > partition_size(gparti)) {
+		error(L"Invalid crash dump header");
+		return EFI_COMPROMISED_DATA;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS crashdump_main(INTN argc, const char **argv)
+{
+	struct crashdump_header hdr;
+	EFI_STATUS ret;
+	UINT64 start;
+
+	if (argc > 3)
+		return EFI_INVALID_PARAMETER;
+
+	start = timer_ticks();
+	ret = crashdump_save(argc > 1 ? argv[1] : CRASHDUMP_DEFAULT_LABEL,
+			     argc > 2 ? argv[2] : CRASHDUMP_DEFAULT_SOURCE,
+			     &hdr);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ss_printf(L"%ld KiB of %a saved in %ld ms\n", hdr.data_size / 1024,
+		  hdr.source, ticks_to_usec(timer_ticks() - start) / 1000);
+
+	return EFI_SUCCESS;
+}
+
+shcmd_t crashdump_shcmd = {
+	.name = "crashdump",
+	.summary = "Save a crash dump to a partition",
+	.help = "Usage: crashdump [<PART> [<SOURCE>]]\n"
+	"Save the SOURCE reader output, LZ4 compressed RAM by default, to\n"
+	"the PART partition (crashdump by default).  It can be retrieved\n"
+	"later with 'adb pull crashdump[:PART]'.",
+	.main = crashdump_main
+};
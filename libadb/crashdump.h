@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _CRASHDUMP_H_
+#define _CRASHDUMP_H_
+
+#include <efi.h>
+#include <gpt.h>
+
+#include "shell_service.h"
+
+/* A crash dump saved to a partition is the output of a reader,
+   stored at CRASHDUMP_DATA_OFFSET and described by a header at the
+   beginning of the partition.  The header is written once the data
+   is complete so that an interrupted save does not leave a valid
+   looking dump behind.  The memory regions layout is recorded by
+   the reader output itself: the sparse chunks of a ram dump or the
+   program headers of a vmcore.  */
+#define CRASHDUMP_MAGIC		"KFCRASH1"
+#define CRASHDUMP_VERSION	1
+#define CRASHDUMP_DATA_OFFSET	4096
+#define CRASHDUMP_SOURCE_LEN	64
+#define CRASHDUMP_DEFAULT_LABEL	"crashdump"
+#define CRASHDUMP_DEFAULT_SOURCE "lz4:ram"
+
+enum crashdump_compression {
+	CRASHDUMP_NONE,
+	CRASHDUMP_LZ4
+};
+
+struct crashdump_header {
+	char magic[8];
+	UINT32 version;
+	UINT32 compression;
+	UINT64 data_offset;
+	UINT64 data_size;
+	/* Save time, seconds since the Epoch */
+	UINT64 time;
+	/* Reader source and range, for instance "lz4:ram:0:80000000" */
+	char source[CRASHDUMP_SOURCE_LEN];
+} __attribute__((packed));
+
+EFI_STATUS crashdump_save(const char *label, const char *source,
+			  struct crashdump_header *hdr);
+EFI_STATUS crashdump_read_header(const char *label,
+				 struct gpt_partition_interface *gparti,
+				 struct crashdump_header *hdr);
+
+extern shcmd_t crashdump_shcmd;
+
+#endif	/* _CRASHDUMP_H_ */
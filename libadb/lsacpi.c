@@ -48,7 +48,6 @@ static EFI_STATUS lsacpi_main(INTN argc,
 {
 	EFI_STATUS ret;
 	struct ACPI_DESC_HEADER *table;
-	struct XSDT_TABLE *xsdt;
 	UINTN i, count;
 
 	if (argc != 1)
@@ -60,16 +59,18 @@ static EFI_STATUS lsacpi_main(INTN argc,
 	if (!EFI_ERROR(ret))
 		print_table(table);
 
-	ret = get_acpi_table("XSDT", (VOID *)&xsdt);
+	ret = get_acpi_table("XSDT", (VOID *)&table);
 	if (EFI_ERROR(ret))
 		return EFI_SUCCESS;
 
-	print_table((struct ACPI_DESC_HEADER *)xsdt);
+	print_table(table);
 
-	count = (xsdt->header.length - sizeof(xsdt->header)) /
-		sizeof(xsdt->entry[1]);
-	for (i = 0; i < count; i++)
-		print_table((struct ACPI_DESC_HEADER *)(UINTN)xsdt->entry[i]);
+	count = acpi_table_count();
+	for (i = 0; i < count; i++) {
+		ret = acpi_get_table_by_index(i, &table);
+		if (ret == EFI_SUCCESS || ret == EFI_CRC_ERROR)
+			print_table(table);
+	}
 
 	return EFI_SUCCESS;
 }
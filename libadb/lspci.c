@@ -31,47 +31,11 @@
  */
 
 #include <lib.h>
+#include <pci.h>
 
-#include "ioport.h"
 #include "lspci.h"
 #include "pci_class.h"
 
-typedef union {
-	struct {
-		UINT8 function : 3;
-		UINT8 device : 5;
-		UINT8 bus : 8;
-	};
-	UINT16 raw;
-} pci_dev_t;
-
-typedef struct {
-	UINT16 vendor;
-	UINT16 device;
-	UINT16 command;
-	UINT16 status;
-	UINT8 revision;
-	struct {
-		UINT8 interface;
-		UINT8 sub;
-		UINT8 base;
-	} class;
-} __attribute__((packed)) pci_header_t;
-
-static UINT32 pci_read_config32(pci_dev_t dev, UINT16 reg)
-{
-	outl(0x80000000 | dev.raw << 8 | (reg & ~3), 0xcf8);
-	return inl(0xcfc + (reg & 3));
-}
-
-static void pci_read_config(pci_dev_t dev, void *buf, UINT16 count)
-{
-	UINTN i;
-
-	for (i = 0; i < count; i += sizeof(UINT32))
-		*(UINT32 *)&buf[i] = pci_read_config32(dev, i);
-}
-
 enum class_fmt {
 	DEFAULT,
 	NUMERIC,
@@ -87,15 +51,16 @@ static const struct {
 } OPTIONS[] = {
 	{ .option = "-x", .variable = &dump_size, .value = 0x40 },
 	{ .option = "-xxx", .variable = &dump_size, .value = 0x100 },
+	{ .option = "-xxxx", .variable = &dump_size, .value = PCI_CONFIG_SIZE },
 	{ .option = "-n", .variable = &class_fmt, .value = NUMERIC },
 	{ .option = "-nn", .variable = &class_fmt, .value = BOTH }
 };
 
 static EFI_STATUS lspci_main(INTN argc, const char **argv)
 {
-	UINTN i, j;
-	pci_dev_t dev;
-	pci_header_t header;
+	EFI_STATUS ret;
+	UINTN i, j, count;
+	const struct pci_function *functions, *f;
 	unsigned char *buf = NULL;
 	const char *class;
 
@@ -111,6 +76,7 @@ static EFI_STATUS lspci_main(INTN argc, const char **argv)
 			return EFI_INVALID_PARAMETER;
 	}
 
+	dump_size = min(dump_size, pci_config_size());
 	if (dump_size) {
 		buf = AllocatePool(dump_size);
 		if (!buf) {
@@ -119,18 +85,18 @@ static EFI_STATUS lspci_main(INTN argc, const char **argv)
 		}
 	}
 
-	for (i = 0, dev.raw = 0; i <= (UINT16)-1; i++, dev.raw = i) {
-		UINT32 val = pci_read_config32(dev, 0);
-
-		if (val == 0xffffffff || val == 0x00000000 ||
-		    val == 0x0000ffff || val == 0xffff0000)
-			continue;
+	ret = pci_get_functions(&functions, &count);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to enumerate the PCI devices");
+		goto out;
+	}
 
-		pci_read_config(dev, &header, sizeof(header));
+	for (i = 0; i < count; i++) {
+		f = &functions[i];
 
-		ss_printf(L"%02x:%02x.%d ", dev.bus, dev.device, dev.function);
+		ss_printf(L"%02x:%02x.%d ", f->bus, f->device, f->function);
 
-		class = pci_class_string(header.class.base, header.class.sub);
+		class = pci_class_string(f->class_base, f->class_sub);
 		switch (class_fmt) {
 		case DEFAULT:
 			if (class) {
@@ -139,30 +105,31 @@ static EFI_STATUS lspci_main(INTN argc, const char **argv)
 			}
 
 		case NUMERIC:
-			ss_printf(L"%02x%02x", header.class.base,
-				  header.class.sub);
+			ss_printf(L"%02x%02x", f->class_base, f->class_sub);
 			break;
 
 		case BOTH:
 			ss_printf(L"%a [%02x%02x]", class,
-				  header.class.base, header.class.sub);
+				  f->class_base, f->class_sub);
 			break;
 		}
 
 		ss_printf(L": %04x:%04x (rev %02x)\n",
-			  header.vendor, header.device, header.revision);
+			  f->vendor_id, f->device_id, f->revision);
 
-		if (buf) {
-			pci_read_config(dev, buf, dump_size);
+		if (buf && !EFI_ERROR(pci_config_read(f->bus, f->device,
+						       f->function, 0, buf,
+						       dump_size))) {
 			ss_hexdump(buf, dump_size, 0, FALSE);
 			ss_printf(L"\n");
 		}
 	}
 
+out:
 	if (buf)
 		FreePool(buf);
 
-	return EFI_SUCCESS;
+	return ret;
 }
 
 shcmd_t lspci_shcmd = {
@@ -171,7 +138,8 @@ shcmd_t lspci_shcmd = {
 	.help = "Usage: lspci [OPTIONS]\n"
 	"OPTIONS:\n"
 	"-x      Hexdump of the standard part of the config space\n"
-	"-xxx    Hexdump of the whole config space\n"
+	"-xxx    Hexdump of the PCI config space\n"
+	"-xxxx   Hexdump of the extended config space (MMCONFIG only)\n"
 	"-n	Use numeric ID's\n"
 	"-nn	Use both textual and numeric ID's",
 	.main = lspci_main
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#ifdef MEMTRACK
+
+#include <lib.h>
+#include <memtrack.h>
+
+#include "meminfo.h"
+
+#define MEMINFO_MAX_SITES	32
+
+static EFI_STATUS meminfo_main(INTN argc, const char **argv)
+{
+	struct memtrack_site sites[MEMINFO_MAX_SITES];
+	const struct memtrack_stats *stats;
+	UINTN i, nb;
+
+	if (argc == 2 && !strcmp((CHAR8 *)argv[1], (CHAR8 *)"reset")) {
+		memtrack_reset_peaks();
+		return EFI_SUCCESS;
+	}
+
+	if (argc != 1)
+		return EFI_INVALID_PARAMETER;
+
+	ss_printf(L"%-8a  %12a  %12a  %8a  %8a  %8a\n-\n",
+		  "Tag", "Live", "Peak", "Allocs", "Frees", "Failures");
+	for (i = 0; i <= MT_TAG_LAST; i++) {
+		stats = memtrack_get_stats(i);
+		ss_printf(L"%-8a  %12ld  %12ld  %8ld  %8ld  %8ld\n",
+			  memtrack_tag_name(i), stats->live, stats->peak,
+			  stats->allocs, stats->frees, stats->failures);
+	}
+
+	ss_printf(L"\n%-24a  %-8a  %12a  %6a\n-\n",
+		  "Call site", "Tag", "Live", "Count");
+	nb = memtrack_get_sites(sites, ARRAY_SIZE(sites));
+	for (i = 0; i < nb; i++)
+		ss_printf(L"%-20a:%-3d  %-8a  %12ld  %6d\n",
+			  sites[i].file, sites[i].line,
+			  memtrack_tag_name(sites[i].tag),
+			  sites[i].live, (UINT32)sites[i].count);
+
+	if (memtrack_dropped())
+		ss_printf(L"%ld allocations not tracked\n", memtrack_dropped());
+
+	return EFI_SUCCESS;
+}
+
+shcmd_t meminfo_shcmd = {
+	.name = "meminfo",
+	.summary = "Show the tracked memory allocations",
+	.help = "Usage: meminfo [reset]\n"
+	"Print the live and peak bytes, the allocation, free and failure\n"
+	"counts of each subsystem and the call sites holding the most\n"
+	"live memory.  With reset, the peaks restart from the live bytes.",
+	.main = meminfo_main
+};
+
+#endif	/* MEMTRACK */
@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include <pae.h>
+#include <crc32.h>
+#include <mp_pool.h>
+#include <openssl/sha.h>
+
+#include "reader.h"
+#include "memsum.h"
+
+/* The conventional memory regions are split into ranges of at most
+   MEMSUM_RANGE_SIZE bytes which are checksummed concurrently by the
+   worker pool.  On 32-bit builds, the Application Processors cannot
+   use the PAE mapping: the ranges above 4 GB are checksummed by the
+   BSP afterwards.  The tables are static so that the checksums of a
+   memory dump are not altered by memory allocations.  */
+#define MEMSUM_RANGE_SIZE	(32 * 1024 * 1024)
+#define MEMSUM_BLOCK_SIZE	(64 * 1024)
+#define MAX_MEMSUM_RANGES	2048
+
+struct memsum_range {
+	EFI_PHYSICAL_ADDRESS start;
+	UINT64 length;
+	UINT32 crc;
+	UINT8 sha[SHA256_DIGEST_LENGTH];
+};
+
+static UINT8 memmap[MAX_MEMORY_REGION_NB * sizeof(EFI_MEMORY_DESCRIPTOR)];
+static struct memsum_range ranges[MAX_MEMSUM_RANGES];
+
+static BOOLEAN is_high(struct memsum_range *range)
+{
+#ifdef __LP64__
+	(void)range;
+	return FALSE;
+#else
+	return range->start + range->length > UINT32_MAX;
+#endif
+}
+
+static void checksum(struct memsum_range *range, const UINT8 *data)
+{
+	SHA256_CTX sha;
+	UINT64 off;
+	UINTN len;
+
+	range->crc = 0;
+	SHA256_Init(&sha);
+	for (off = 0; off < range->length; off += len) {
+		len = min((UINT64)MEMSUM_BLOCK_SIZE, range->length - off);
+		range->crc = crc32_update(range->crc, data + off, len);
+		SHA256_Update(&sha, data + off, len);
+	}
+	SHA256_Final(range->sha, &sha);
+}
+
+static void checksum_ranges(UINTN start, UINTN end,
+			    __attribute__((__unused__)) VOID *ctx)
+{
+	UINTN i;
+
+	for (i = start; i < end; i++)
+		if (!is_high(&ranges[i]))
+			checksum(&ranges[i], (const UINT8 *)(UINTN)ranges[i].start);
+}
+
+#ifndef __LP64__
+static EFI_STATUS checksum_high_ranges(UINTN nb)
+{
+	EFI_STATUS ret;
+	EFI_PHYSICAL_ADDRESS address;
+	UINTN i;
+
+	for (i = 0; i < nb; i++) {
+		if (!is_high(&ranges[i]))
+			continue;
+
+		address = ranges[i].start;
+		ret = ss_pae_map(&address, ranges[i].length);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to map 0x%lx", ranges[i].start);
+			return ret;
+		}
+		checksum(&ranges[i], (const UINT8 *)(UINTN)address);
+		pae_exit();
+	}
+
+	return EFI_SUCCESS;
+}
+#endif
+
+static EFI_STATUS build_ranges(EFI_PHYSICAL_ADDRESS start,
+			       EFI_PHYSICAL_ADDRESS end, UINTN *nb)
+{
+	EFI_STATUS ret;
+	EFI_MEMORY_DESCRIPTOR *entry;
+	EFI_PHYSICAL_ADDRESS cur, entry_end;
+	UINTN i, nr_descr, descr_sz;
+
+	ret = get_sorted_memory_map(memmap, sizeof(memmap), &nr_descr, &descr_sz);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	*nb = 0;
+	for (i = 0; i < nr_descr; i++) {
+		entry = (EFI_MEMORY_DESCRIPTOR *)(memmap + i * descr_sz);
+		if (entry->Type != EfiConventionalMemory)
+			continue;
+
+		cur = max(entry->PhysicalStart, start);
+		entry_end = min(entry->PhysicalStart +
+				entry->NumberOfPages * EFI_PAGE_SIZE, end);
+
+		for (; cur < entry_end; cur += ranges[*nb - 1].length) {
+			if (*nb == ARRAY_SIZE(ranges)) {
+				error(L"Too many ranges, restrict the memory range");
+				return EFI_BUFFER_TOO_SMALL;
+			}
+
+			ranges[*nb].start = cur;
+			ranges[*nb].length = min((UINT64)MEMSUM_RANGE_SIZE,
+						 entry_end - cur);
+			(*nb)++;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void print_sha(UINT8 *sha)
+{
+	CHAR8 hex[SHA256_DIGEST_LENGTH * 2 + 1];
+
+	if (EFI_ERROR(bytes_to_hex_stra(sha, SHA256_DIGEST_LENGTH,
+					hex, sizeof(hex))))
+		hex[0] = '\0';
+	ss_printf(L"%a\n", hex);
+}
+
+static EFI_STATUS memsum_main(INTN argc, const char **argv)
+{
+	EFI_STATUS ret;
+	EFI_PHYSICAL_ADDRESS start = 0, end = (EFI_PHYSICAL_ADDRESS)-1;
+	UINT64 length;
+	UINTN i, nb;
+
+	if (argc > 3)
+		return EFI_INVALID_PARAMETER;
+
+	if (argc > 1) {
+		ret = ss_read_number(argv[1], "START", &start);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	if (argc > 2) {
+		ret = ss_read_number(argv[2], "LENGTH", &length);
+		if (EFI_ERROR(ret))
+			return ret;
+		end = start + length;
+	}
+
+	ret = build_ranges(start, end, &nb);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Build the CRC32 tables before the APs use them */
+	crc32_update(0, NULL, 0);
+	ret = parallel_for(nb, 1, checksum_ranges, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+#ifndef __LP64__
+	ret = checksum_high_ranges(nb);
+	if (EFI_ERROR(ret))
+		return ret;
+#endif
+
+	ss_printf(L"%-16a %-16a %-8a %a\n", "Start", "Length", "CRC32", "SHA-256");
+	for (i = 0; i < nb; i++) {
+		ss_printf(L"%016lx %016lx %08x ", ranges[i].start,
+			  ranges[i].length, ranges[i].crc);
+		print_sha(ranges[i].sha);
+	}
+
+	return EFI_SUCCESS;
+}
+
+shcmd_t memsum_shcmd = {
+	.name = "memsum",
+	.summary = "Checksum the conventional memory",
+	.help = "Usage: memsum [START [LENGTH]]\n"
+	"Compute the CRC32 and SHA-256 of the conventional memory regions,\n"
+	"split in ranges of up to 32 MB, on all the processors.  START and\n"
+	"LENGTH restrict the checksummed physical memory range.",
+	.main = memsum_main
+};
@@ -32,6 +32,14 @@
 
 #include <lib.h>
 #include <slot.h>
+#include <lz4.h>
+#include <mp_pool.h>
+#include <crc32.h>
+#include <memmap.h>
+#include <async_io.h>
+#ifdef DYNAMIC_PARTITIONS
+#include <lp_metadata.h>
+#endif
 
 #include "acpi.h"
 #ifndef __LP64__
@@ -39,12 +47,11 @@
 #endif
 #include "reader.h"
 #include "sparse_format.h"
+#include "crashdump.h"
 
 /* Memory dump shared functions.  These functions do not make any
    dynamic memory allocation to avoid RAM corruption during the
    dump.  */
-#define MAX_MEMORY_REGION_NB 256
-
 typedef struct memory_priv {
 	BOOLEAN is_in_used;
 
@@ -62,23 +69,24 @@ typedef struct memory_priv {
 	EFI_PHYSICAL_ADDRESS cur_end;
 } memory_t;
 
-static EFI_STATUS get_sorted_memory_map(memory_t *mem)
+EFI_STATUS get_sorted_memory_map(UINT8 *memmap, UINTN memmap_sz,
+				 UINTN *nr_descr, UINTN *descr_sz)
 {
 	EFI_STATUS ret;
 	UINT32 descr_ver;
-	UINTN key, memmap_sz;
+	UINTN key;
 
-	memmap_sz = sizeof(mem->memmap);
 	ret = uefi_call_wrapper(BS->GetMemoryMap, 5, &memmap_sz,
-				(EFI_MEMORY_DESCRIPTOR *)mem->memmap,
-				&key, &mem->descr_sz, &descr_ver);
+				(EFI_MEMORY_DESCRIPTOR *)memmap,
+				&key, descr_sz, &descr_ver);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get the current memory map");
 		return ret;
 	}
 
-	mem->nr_descr = memmap_sz / mem->descr_sz;
-	sort_memory_map(mem->memmap, mem->nr_descr, mem->descr_sz);
+	*nr_descr = memmap_sz / *descr_sz;
+	sort_memory_map(memmap, *nr_descr, *descr_sz);
+	*nr_descr = memmap_coalesce(memmap, *nr_descr, *descr_sz);
 
 	return EFI_SUCCESS;
 }
@@ -121,20 +129,26 @@ static EFI_STATUS memory_open(reader_ctx_t *ctx, memory_t *mem,
 		goto err;
 	}
 
-	ret = get_sorted_memory_map(mem);
+	ret = get_sorted_memory_map(mem->memmap, sizeof(mem->memmap),
+				    &mem->nr_descr, &mem->descr_sz);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = init(ctx, mem);
-	if (EFI_ERROR(ret))
-		goto err;
-
+	/* The init function scans the memory content */
 #ifndef __LP64__
 	ret = pae_init(mem->memmap, mem->nr_descr, mem->descr_sz);
 	if (EFI_ERROR(ret))
 		goto err;
 #endif
 
+	ret = init(ctx, mem);
+	if (EFI_ERROR(ret)) {
+#ifndef __LP64__
+		pae_exit();
+#endif
+		goto err;
+	}
+
 	return EFI_SUCCESS;
 
 err:
@@ -161,6 +175,76 @@ static EFI_STATUS memory_read_current(memory_t *mem, unsigned char **buf, UINT64
 	return EFI_SUCCESS;
 }
 
+/* Return TRUE if the page at ADDR is filled up with a single 32 bits
+   PATTERN.  The differences are accumulated by blocks so that the
+   compiler can vectorize the comparison.  */
+#define PATTERN_BLOCK_WORDS	16
+
+static BOOLEAN page_pattern(EFI_PHYSICAL_ADDRESS addr, UINT32 *pattern)
+{
+	UINT64 *words, value, diff;
+	UINTN i, j;
+#ifndef __LP64__
+	unsigned char *buf;
+	UINT64 len = EFI_PAGE_SIZE;
+
+	if (EFI_ERROR(pae_map(addr, &buf, &len)) || len != EFI_PAGE_SIZE)
+		return FALSE;
+	words = (UINT64 *)buf;
+#else
+	words = (UINT64 *)addr;
+#endif
+
+	value = words[0];
+	if ((UINT32)value != (UINT32)(value >> 32))
+		return FALSE;
+
+	for (i = 0; i < EFI_PAGE_SIZE / sizeof(*words); i += PATTERN_BLOCK_WORDS) {
+		for (diff = 0, j = 0; j < PATTERN_BLOCK_WORDS; j++)
+			diff |= words[i + j] ^ value;
+		if (diff)
+			return FALSE;
+	}
+
+	*pattern = (UINT32)value;
+	return TRUE;
+}
+
+/* Look for the first run of at least PATTERN_MIN_PAGES pages filled
+   up with a single 32 bits pattern, or with zeroes only if ZERO_ONLY
+   is set, in the [START, END[ memory range.  Shorter runs are not
+   worth a sparse chunk or an ELF program header.  */
+#define PATTERN_MIN_PAGES	8
+
+static BOOLEAN memory_find_pattern_run(EFI_PHYSICAL_ADDRESS start,
+				       EFI_PHYSICAL_ADDRESS end,
+				       BOOLEAN zero_only,
+				       EFI_PHYSICAL_ADDRESS *run_start,
+				       EFI_PHYSICAL_ADDRESS *run_end,
+				       UINT32 *pattern)
+{
+	EFI_PHYSICAL_ADDRESS addr, cur;
+	UINT32 value, next;
+
+	for (addr = start; addr < end; addr = cur) {
+		cur = addr + EFI_PAGE_SIZE;
+		if (!page_pattern(addr, &value) || (zero_only && value))
+			continue;
+
+		while (cur < end && page_pattern(cur, &next) && next == value)
+			cur += EFI_PAGE_SIZE;
+
+		if (cur - addr >= PATTERN_MIN_PAGES * EFI_PAGE_SIZE) {
+			*run_start = addr;
+			*run_end = cur;
+			*pattern = value;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
 static void memory_close(reader_ctx_t *ctx)
 {
 	((memory_t *)ctx->private)->is_in_used = FALSE;
@@ -169,9 +253,23 @@ static void memory_close(reader_ctx_t *ctx)
 #endif
 }
 
-/* RAM reader */
+/* RAM reader.  The conventional memory runs of pages filled up with a
+   single pattern, zero most of the time, are exported as FILL chunks.
+   Once the chunk table is almost full, the remaining conventional
+   memory is exported as RAW chunks only: RAM_CHUNK_RESERVE entries
+   are kept for the memory map regions.  With the "crc" option, each
+   RAW chunk is followed by a CRC32 chunk holding the CRC32 of the
+   image up to there, as the Android sparse format defines it.  */
 #define SIZEOF_TOTALSZ		sizeof(((chunk_header_t *)0)->total_sz)
 #define MAX_CHUNK_SIZE		(((UINT64)1 << (SIZEOF_TOTALSZ * 8)) - EFI_PAGE_SIZE)
+#define MAX_RAM_CHUNK_NB	16384
+#define RAM_CHUNK_RESERVE	(4 * MAX_MEMORY_REGION_NB)
+
+/* A chunk header followed by the FILL or CRC32 chunk data */
+struct ram_chunk {
+	struct chunk_header hdr;
+	UINT32 fill;
+};
 
 static struct ram_priv {
 	memory_t m;
@@ -180,7 +278,11 @@ static struct ram_priv {
 	UINTN chunk_nb;
 	UINTN cur_chunk;
 	struct sparse_header sheader;
-	struct chunk_header chunks[MAX_MEMORY_REGION_NB];
+	struct ram_chunk chunks[MAX_RAM_CHUNK_NB];
+
+	/* CRC32 of the image sent so far */
+	BOOLEAN crc;
+	UINT32 crc32;
 } ram_priv = {
 	.sheader = {
 		.magic = SPARSE_HEADER_MAGIC,
@@ -196,6 +298,7 @@ static EFI_STATUS ram_add_chunk(reader_ctx_t *ctx, struct ram_priv *priv, UINT16
 {
 	EFI_STATUS ret = EFI_SUCCESS;
 	struct chunk_header *cur = NULL;
+	struct ram_chunk *chunk;
 
 	if (size % EFI_PAGE_SIZE) {
 		error(L"chunk size must be multiple of %d bytes", EFI_PAGE_SIZE);
@@ -212,12 +315,13 @@ static EFI_STATUS ram_add_chunk(reader_ctx_t *ctx, struct ram_priv *priv, UINT16
 		}
 	}
 
-	if (priv->chunk_nb == MAX_MEMORY_REGION_NB) {
+	if (priv->chunk_nb == ARRAY_SIZE(priv->chunks)) {
 		error(L"Failed to allocate a new chunk");
 		return EFI_OUT_OF_RESOURCES;
 	}
 
-	cur = &priv->chunks[priv->chunk_nb++];
+	chunk = &priv->chunks[priv->chunk_nb++];
+	cur = &chunk->hdr;
 
 	cur->chunk_type = type;
 	cur->chunk_sz = size / EFI_PAGE_SIZE;
@@ -226,23 +330,59 @@ static EFI_STATUS ram_add_chunk(reader_ctx_t *ctx, struct ram_priv *priv, UINT16
 	if (type == CHUNK_TYPE_RAW) {
 		cur->total_sz += size;
 		ctx->len += size;
+	} else if (type == CHUNK_TYPE_FILL || type == CHUNK_TYPE_CRC32) {
+		cur->total_sz += sizeof(chunk->fill);
+		ctx->len += sizeof(chunk->fill);
 	}
 
 	priv->sheader.total_chunks++;
 	priv->sheader.total_blks += cur->chunk_sz;
 
+	if (type == CHUNK_TYPE_RAW && priv->crc)
+		return ram_add_chunk(ctx, priv, CHUNK_TYPE_CRC32, 0);
+
 	return EFI_SUCCESS;
 }
 
+static EFI_STATUS ram_add_memory(reader_ctx_t *ctx, struct ram_priv *priv,
+				 EFI_PHYSICAL_ADDRESS start, UINT64 length)
+{
+	EFI_STATUS ret;
+	EFI_PHYSICAL_ADDRESS end = start + length, run_start, run_end;
+	UINT32 pattern;
+
+	while (priv->chunk_nb + 4 + RAM_CHUNK_RESERVE <= ARRAY_SIZE(priv->chunks) &&
+	       memory_find_pattern_run(start, end, FALSE, &run_start,
+				       &run_end, &pattern)) {
+		if (run_start > start) {
+			ret = ram_add_chunk(ctx, priv, CHUNK_TYPE_RAW,
+					    run_start - start);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+
+		ret = ram_add_chunk(ctx, priv, CHUNK_TYPE_FILL,
+				    run_end - run_start);
+		if (EFI_ERROR(ret))
+			return ret;
+		priv->chunks[priv->chunk_nb - 1].fill = pattern;
+		start = run_end;
+	}
+
+	if (start == end)
+		return EFI_SUCCESS;
+
+	return ram_add_chunk(ctx, priv, CHUNK_TYPE_RAW, end - start);
+}
+
 static EFI_STATUS ram_build_chunks(reader_ctx_t *ctx, void *priv_p)
 {
 	struct ram_priv *priv = priv_p;
 	EFI_STATUS ret = EFI_SUCCESS;
-	UINT16 type;
 	UINTN i;
 	EFI_MEMORY_DESCRIPTOR *entry;
 	UINT64 entry_len, length;
-	EFI_PHYSICAL_ADDRESS entry_end, prev_end;
+	EFI_PHYSICAL_ADDRESS entry_start, entry_end, prev_end;
 	UINT8 *entries = priv->m.memmap;
 
 	priv->sheader.total_chunks = priv->sheader.total_blks = 0;
@@ -281,14 +421,19 @@ static EFI_STATUS ram_build_chunks(reader_ctx_t *ctx, void *priv_p)
 		}
 
 		length = entry_len;
-		if (priv->m.start > entry->PhysicalStart && priv->m.start < entry_end)
+		entry_start = entry->PhysicalStart;
+		if (priv->m.start > entry->PhysicalStart && priv->m.start < entry_end) {
 			length -= priv->m.start - entry->PhysicalStart;
+			entry_start = priv->m.start;
+		}
 
 		if (priv->m.end && priv->m.end < entry_end)
 			length -= entry_end - priv->m.end;
 
-		type = entry->Type == EfiConventionalMemory ? CHUNK_TYPE_RAW : CHUNK_TYPE_DONT_CARE;
-		ret = ram_add_chunk(ctx, priv, type, length);
+		if (entry->Type == EfiConventionalMemory)
+			ret = ram_add_memory(ctx, priv, entry_start, length);
+		else
+			ret = ram_add_chunk(ctx, priv, CHUNK_TYPE_DONT_CARE, length);
 		if (EFI_ERROR(ret))
 			goto err;
 
@@ -322,13 +467,40 @@ err:
 
 static EFI_STATUS ram_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 {
+	if (ram_priv.m.is_in_used)
+		return EFI_ALREADY_STARTED;
+
+	ram_priv.crc = argc > 0 && !strcmp((CHAR8 *)argv[argc - 1], (CHAR8 *)"crc");
+	if (ram_priv.crc)
+		argc--;
+
 	return memory_open(ctx, &ram_priv.m, ram_build_chunks, argc, argv);
 }
 
+static void ram_update_crc(struct ram_priv *priv, struct ram_chunk *chunk)
+{
+	static const UINT32 zero;
+	UINT64 count = chunk->hdr.chunk_sz * (EFI_PAGE_SIZE / sizeof(UINT32));
+
+	switch (chunk->hdr.chunk_type) {
+	case CHUNK_TYPE_FILL:
+		priv->crc32 = crc32_repeat(priv->crc32, &chunk->fill,
+					   sizeof(chunk->fill), count);
+		break;
+	case CHUNK_TYPE_DONT_CARE:
+		priv->crc32 = crc32_repeat(priv->crc32, &zero, sizeof(zero), count);
+		break;
+	case CHUNK_TYPE_CRC32:
+		chunk->fill = priv->crc32;
+		break;
+	}
+}
+
 static EFI_STATUS ram_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
 {
+	EFI_STATUS ret;
 	struct ram_priv *priv = ctx->private;
-	struct chunk_header *chunk;
+	struct ram_chunk *chunk;
 
 	/* First byte, send the sparse header */
 	if (ctx->cur == 0) {
@@ -338,6 +510,7 @@ static EFI_STATUS ram_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
 		*buf = (unsigned char *)&priv->sheader;
 		*len = sizeof(priv->sheader);
 		priv->m.cur = priv->m.cur_end = priv->m.start;
+		priv->crc32 = 0;
 		return EFI_SUCCESS;
 	}
 
@@ -349,16 +522,25 @@ static EFI_STATUS ram_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
 		}
 
 		chunk = &priv->chunks[priv->cur_chunk++];
+		if (priv->crc)
+			ram_update_crc(priv, chunk);
 		*buf = (unsigned char *)chunk;
-		*len = sizeof(*chunk);
-		priv->m.cur_end = priv->m.cur + chunk->chunk_sz * EFI_PAGE_SIZE;
-		if (chunk->chunk_type != CHUNK_TYPE_RAW)
+		*len = sizeof(chunk->hdr);
+		if (chunk->hdr.chunk_type == CHUNK_TYPE_FILL ||
+		    chunk->hdr.chunk_type == CHUNK_TYPE_CRC32)
+			*len += sizeof(chunk->fill);
+		priv->m.cur_end = priv->m.cur + chunk->hdr.chunk_sz * EFI_PAGE_SIZE;
+		if (chunk->hdr.chunk_type != CHUNK_TYPE_RAW)
 			priv->m.cur = priv->m.cur_end;
 		return EFI_SUCCESS;
 	}
 
 	/* Continue to send the current memory region */
-	return memory_read_current(&priv->m, buf, len);
+	ret = memory_read_current(&priv->m, buf, len);
+	if (!EFI_ERROR(ret) && priv->crc)
+		priv->crc32 = crc32_update(priv->crc32, *buf, *len);
+
+	return ret;
 }
 
 /* VMCore reader */
@@ -449,6 +631,13 @@ enum elfp_type {
    (cf. https://www.kernel.org/doc/Documentation/x86/x86_64/mm.txt) */
 #define KERNEL_PAGE_OFFSET	0xffff880000000000
 
+/* The conventional memory regions are split at the zero page runs:
+   each PT_LOAD segment only has its leading non-zero pages in the file
+   and the following zero pages are covered by its memory size.  Once
+   the program header table is almost full, the remaining memory
+   regions are not split anymore.  */
+#define MAX_VMCORE_PHDR_NB	4096
+
 static struct vmcore_priv {
 	memory_t m;
 
@@ -458,7 +647,7 @@ static struct vmcore_priv {
 	/* ELF header and ELF program headers */
 	UINTN hdr_sz;
 	elf64_hdr_t hdr;
-	elf64_phdr_t phdr[MAX_MEMORY_REGION_NB];
+	elf64_phdr_t phdr[MAX_VMCORE_PHDR_NB];
 } vmcore_priv = {
 	.hdr = {
 		.ident = {
@@ -484,10 +673,60 @@ static struct vmcore_priv {
 };
 #pragma pack()
 
+static EFI_STATUS vmcore_add_phdr(struct vmcore_priv *priv,
+				  EFI_PHYSICAL_ADDRESS start, UINT64 filesz,
+				  UINT64 memsz)
+{
+	elf64_phdr_t *phdr;
+
+	priv->hdr.phnum++;
+	if (priv->hdr.phnum == ARRAY_SIZE(priv->phdr)) {
+		error(L"Not enough program headers");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	phdr = &priv->phdr[priv->hdr.phnum - 1];
+	phdr->type = PT_LOAD;
+	phdr->paddr = start;
+	phdr->vaddr = KERNEL_PAGE_OFFSET + start;
+	phdr->filesz = filesz;
+	phdr->memsz = memsz;
+	phdr->flags = KERNEL_PAGE_FLAGS;
+
+	priv->hdr_sz += sizeof(*phdr);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS vmcore_add_memory(struct vmcore_priv *priv,
+				    EFI_PHYSICAL_ADDRESS start,
+				    EFI_PHYSICAL_ADDRESS end)
+{
+	EFI_STATUS ret;
+	EFI_PHYSICAL_ADDRESS run_start, run_end;
+	UINT32 pattern;
+
+	while (priv->hdr.phnum + 1 + MAX_MEMORY_REGION_NB < ARRAY_SIZE(priv->phdr) &&
+	       memory_find_pattern_run(start, end, TRUE, &run_start,
+				       &run_end, &pattern)) {
+		ret = vmcore_add_phdr(priv, start, run_start - start,
+				      run_end - start);
+		if (EFI_ERROR(ret))
+			return ret;
+		start = run_end;
+	}
+
+	if (start == end)
+		return EFI_SUCCESS;
+
+	return vmcore_add_phdr(priv, start, end - start, end - start);
+}
+
 static EFI_STATUS vmcore_build_header(reader_ctx_t *ctx, void *priv_p)
 
 {
 	struct vmcore_priv *priv = priv_p;
+	EFI_STATUS ret;
 	UINTN i;
 	EFI_MEMORY_DESCRIPTOR *entry;
 	elf64_phdr_t *phdr;
@@ -521,20 +760,12 @@ static EFI_STATUS vmcore_build_header(reader_ctx_t *ctx, void *priv_p)
 			end = priv->m.end;
 		}
 
-		priv->hdr.phnum++;
-		if (priv->hdr.phnum == ARRAY_SIZE(priv->phdr)) {
-			error(L"Not enough program headers");
-			return EFI_OUT_OF_RESOURCES;
-		}
-
-		phdr = &priv->phdr[priv->hdr.phnum - 1];
-		phdr->type = PT_LOAD;
-		phdr->paddr = start;
-		phdr->vaddr = KERNEL_PAGE_OFFSET + start;
-		phdr->filesz = phdr->memsz = length;
-		phdr->flags = KERNEL_PAGE_FLAGS;
+		if (start >= end)
+			continue;
 
-		priv->hdr_sz += sizeof(*phdr);
+		ret = vmcore_add_memory(priv, start, end);
+		if (EFI_ERROR(ret))
+			return ret;
 	}
 
 	if (priv->hdr.phnum == 1) {
@@ -546,7 +777,7 @@ static EFI_STATUS vmcore_build_header(reader_ctx_t *ctx, void *priv_p)
 	for (i = 1; i < priv->hdr.phnum; i++) {
 		phdr = &priv->phdr[i];
 		phdr->offset = ctx->len;
-		ctx->len += phdr->memsz;
+		ctx->len += phdr->filesz;
 	}
 
 	return EFI_SUCCESS;
@@ -574,8 +805,9 @@ static EFI_STATUS vmcore_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *le
 		return EFI_SUCCESS;
 	}
 
-	/* Start new memory region */
-	if (priv->m.cur == priv->m.cur_end) {
+	/* Start new memory region, the segments made of zero pages
+	   only have no data in the file */
+	while (priv->m.cur == priv->m.cur_end) {
 		if (priv->cur_phdr == priv->hdr.phnum - 1) {
 			error(L"Invalid parameter in %a", __func__);
 			return EFI_INVALID_PARAMETER;
@@ -583,25 +815,96 @@ static EFI_STATUS vmcore_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *le
 
 		priv->cur_phdr++;
 		priv->m.cur = priv->phdr[priv->cur_phdr].paddr;
-		priv->m.cur_end = priv->m.cur + priv->phdr[priv->cur_phdr].memsz;
+		priv->m.cur_end = priv->m.cur + priv->phdr[priv->cur_phdr].filesz;
 	}
 
 	/* Continue to send the current memory region */
 	return memory_read_current(&priv->m, buf, len);
 }
 
-/* Partition reader */
-#define PART_READER_BUF_SIZE (10 * 1024 * 1024)
+/* Pool of the partition reader buffers.  They are kept allocated
+   from one reader session to the next and are page aligned to meet
+   the block I/O alignment constraints.  */
+#define READ_BUF_POOL_SIZE 4
+
+static struct read_buf {
+	VOID *free_addr;
+	unsigned char *buf;
+	BOOLEAN in_use;
+} read_buf_pool[READ_BUF_POOL_SIZE];
+
+static unsigned char *read_buf_get(void)
+{
+	struct read_buf *rb;
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(read_buf_pool); i++) {
+		rb = &read_buf_pool[i];
+		if (rb->in_use)
+			continue;
+
+		if (!rb->buf) {
+			ret = alloc_aligned(&rb->free_addr, (VOID **)&rb->buf,
+					    PART_READER_BUF_SIZE, EFI_PAGE_SIZE);
+			if (EFI_ERROR(ret))
+				return NULL;
+		}
+
+		rb->in_use = TRUE;
+		return rb->buf;
+	}
+
+	return NULL;
+}
+
+static void read_buf_put(unsigned char *buf)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(read_buf_pool); i++)
+		if (read_buf_pool[i].buf == buf)
+			read_buf_pool[i].in_use = FALSE;
+}
+
+/* Partition reader.  The data is double buffered: the next chunk is
+   read from the storage while the current one is sent.  */
+
+#define PART_READER_BUFS 2
 
 struct part_priv {
 	struct gpt_partition_interface gparti;
+#ifdef DYNAMIC_PARTITIONS
+	/* Logical partition of super, GPARTI is the super partition.
+	   It remains valid as long as super is not written.  */
+	const struct lp_partition *lp;
+#endif
+	struct async_io *aio;
+	struct {
+		unsigned char *data;
+		UINT64 pos;		/* Reader offset of DATA */
+		UINTN len;
+		UINTN id;
+		BOOLEAN pending;
+	} bufs[PART_READER_BUFS];
+	UINTN cur;			/* Buffer being sent */
 	BOOLEAN need_more_data;
-	unsigned char buf[PART_READER_BUF_SIZE];
 	UINTN buf_cur;
-	UINTN buf_len;
 	UINT64 offset;
 };
 
+static void part_free(struct part_priv *priv)
+{
+	UINTN i;
+
+	if (priv->aio)
+		async_io_close(priv->aio);
+	for (i = 0; i < PART_READER_BUFS; i++)
+		if (priv->bufs[i].data)
+			read_buf_put(priv->bufs[i].data);
+	FreePool(priv);
+}
+
 static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical_unit_t log_unit)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
@@ -609,14 +912,23 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 	struct part_priv *priv;
 	CHAR16 *partname;
 	UINT64 length;
+	UINTN i;
 
 	if (argc < 1 || argc > 3)
 		return EFI_INVALID_PARAMETER;
 
-	priv = ctx->private = AllocatePool(sizeof(*priv));
+	priv = ctx->private = AllocateZeroPool(sizeof(*priv));
 	if (!priv)
 		return EFI_OUT_OF_RESOURCES;
 
+	for (i = 0; i < PART_READER_BUFS; i++) {
+		priv->bufs[i].data = read_buf_get();
+		if (!priv->bufs[i].data) {
+			error(L"Failed to get a partition reader buffer");
+			ret = EFI_OUT_OF_RESOURCES;
+			goto err;
+		}
+	}
 
 	partname = stra_to_str((CHAR8 *)argv[0]);
 	if (!partname) {
@@ -626,15 +938,32 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 
 	gparti = &priv->gparti;
 	ret = gpt_get_partition_by_label(slot_label(partname), gparti, log_unit);
+#ifdef DYNAMIC_PARTITIONS
+	priv->lp = NULL;
+	if (ret == EFI_NOT_FOUND && log_unit == LOGICAL_UNIT_USER)
+		ret = lp_get_partition(partname, &priv->lp, gparti);
+#endif
 	FreePool(partname);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Cannot access partition '%a'", argv[0]);
 		goto err;
 	}
 
+	ret = async_io_open(gparti, &priv->aio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set up the partition reads");
+		goto err;
+	}
+
 	priv->offset = gparti->part.starting_lba * gparti->bio->Media->BlockSize;
 	length = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) *
 		gparti->bio->Media->BlockSize;
+#ifdef DYNAMIC_PARTITIONS
+	if (priv->lp)
+		length = priv->lp->size;
+	if (!length)
+		goto err;
+#endif
 
 	ctx->cur = 0;
 	ctx->len = length;
@@ -652,13 +981,12 @@ static EFI_STATUS _part_open(reader_ctx_t *ctx, UINTN argc, char **argv, logical
 	}
 
 	priv->buf_cur = 0;
-	priv->buf_len = 0;
 	priv->need_more_data = TRUE;
 
 	return EFI_SUCCESS;
 
 err:
-	FreePool(priv);
+	part_free(priv);
 	return EFI_ERROR(ret) ? ret : EFI_INVALID_PARAMETER;
 }
 
@@ -672,16 +1000,106 @@ static EFI_STATUS factory_part_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 	return _part_open(ctx, argc, argv, LOGICAL_UNIT_FACTORY);
 }
 
+/* Crash dump saved to a partition, cf. crashdump_save() */
+static EFI_STATUS crashdump_open(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	struct crashdump_header hdr;
+	char *label;
+
+	if (argc > 1)
+		return EFI_INVALID_PARAMETER;
+
+	label = argc ? argv[0] : CRASHDUMP_DEFAULT_LABEL;
+	ret = crashdump_read_header(label, &gparti, &hdr);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = _part_open(ctx, 1, &label, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* The partition reader reads from CTX->CUR up to CTX->LEN */
+	ctx->cur = hdr.data_offset;
+	ctx->len = hdr.data_offset + hdr.data_size;
+
+	return EFI_SUCCESS;
+}
+
+/* Start reading the data at reader offset POS into the buffer B,
+   up to the end of the buffer, of the data or of the logical
+   partition extent.  */
+static EFI_STATUS part_fill(reader_ctx_t *ctx, struct part_priv *priv,
+			    UINTN b, UINT64 pos)
+{
+	UINT64 disk_offset = priv->offset + pos;
+	EFI_STATUS ret;
+
+	priv->bufs[b].pos = pos;
+	priv->bufs[b].len = min((UINT64)PART_READER_BUF_SIZE, ctx->len - pos);
+
+#ifdef DYNAMIC_PARTITIONS
+	if (priv->lp) {
+		const struct lp_extent *ext = priv->lp->extents;
+		UINT64 start = 0;
+		UINT32 i;
+
+		for (i = 0; i < priv->lp->nb_extents; i++) {
+			if (pos < start + ext[i].size)
+				break;
+			start += ext[i].size;
+		}
+		if (i == priv->lp->nb_extents)
+			return EFI_END_OF_MEDIA;
+
+		priv->bufs[b].len = min((UINT64)priv->bufs[b].len,
+					start + ext[i].size - pos);
+		if (ext[i].zero) {
+			memset(priv->bufs[b].data, 0, priv->bufs[b].len);
+			return EFI_SUCCESS;
+		}
+		disk_offset = priv->offset + ext[i].offset + pos - start;
+	}
+#endif
+
+	ret = async_io_read(priv->aio, disk_offset, priv->bufs[b].len,
+			    priv->bufs[b].data, &priv->bufs[b].id);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	priv->bufs[b].pending = TRUE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS part_wait(struct part_priv *priv, UINTN b)
+{
+	if (!priv->bufs[b].pending)
+		return EFI_SUCCESS;
+
+	priv->bufs[b].pending = FALSE;
+	return async_io_wait(priv->aio, priv->bufs[b].id);
+}
+
 static EFI_STATUS part_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
 {
 	EFI_STATUS ret;
 	struct part_priv *priv = ctx->private;
+	UINTN next = (priv->cur + 1) % PART_READER_BUFS;
+	UINT64 pos;
 
 	if (priv->need_more_data) {
-		priv->buf_len = min(sizeof(priv->buf), ctx->len - ctx->cur);
-		ret = uefi_call_wrapper(priv->gparti.dio->ReadDisk, 5, priv->gparti.dio,
-					priv->gparti.bio->Media->MediaId,
-					priv->offset + ctx->cur, priv->buf_len, priv->buf);
+		/* Use the read-ahead buffer unless the reader moved */
+		if (priv->bufs[next].pending && priv->bufs[next].pos == ctx->cur) {
+			priv->cur = next;
+			ret = part_wait(priv, priv->cur);
+		} else {
+			ret = part_wait(priv, next);
+			if (!EFI_ERROR(ret))
+				ret = part_fill(ctx, priv, priv->cur, ctx->cur);
+			if (!EFI_ERROR(ret))
+				ret = part_wait(priv, priv->cur);
+		}
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Failed to read partition");
 			return ret;
@@ -689,27 +1107,48 @@ static EFI_STATUS part_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
 
 		priv->need_more_data = FALSE;
 		priv->buf_cur = 0;
+
+		/* The other buffer is no longer referenced: the caller
+		   only asks for more data once it is all sent.  */
+		next = (priv->cur + 1) % PART_READER_BUFS;
+		pos = priv->bufs[priv->cur].pos + priv->bufs[priv->cur].len;
+		if (pos < ctx->len) {
+			ret = part_fill(ctx, priv, next, pos);
+			if (EFI_ERROR(ret))
+				debug(L"Partition read-ahead failed: %r", ret);
+		}
 	}
 
-	*len = min(*len, priv->buf_len - priv->buf_cur);
-	*buf = priv->buf + priv->buf_cur;
+	*len = min(*len, priv->bufs[priv->cur].len - priv->buf_cur);
+	*buf = priv->bufs[priv->cur].data + priv->buf_cur;
 	priv->buf_cur += *len;
-	if (priv->buf_cur == priv->buf_len)
+	if (priv->buf_cur == priv->bufs[priv->cur].len)
 		priv->need_more_data = TRUE;
 
 	return EFI_SUCCESS;
 }
 
+static void part_close(reader_ctx_t *ctx)
+{
+	part_free(ctx->private);
+}
+
 /* ACPI table reader */
 static EFI_STATUS acpi_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 {
 	EFI_STATUS ret;
 	struct ACPI_DESC_HEADER *table;
+	UINTN index;
+	char *end;
 
 	if (argc != 1)
 		return EFI_INVALID_PARAMETER;
 
-	ret = get_acpi_table((CHAR8 *)argv[0], (VOID **)&table);
+	index = strtoul(argv[0], &end, 10);
+	if (*argv[0] && *end == '\0')
+		ret = acpi_get_table_by_index(index, &table);
+	else
+		ret = get_acpi_table((CHAR8 *)argv[0], (VOID **)&table);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Cannot access ACPI table %a", argv[0]);
 		return ret;
@@ -723,70 +1162,6 @@ static EFI_STATUS acpi_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 }
 
 /* EFI variable reader */
-static EFI_STATUS efivar_find(CHAR16 *varname, EFI_GUID *guid_p)
-{
-	EFI_STATUS ret;
-	UINTN bufsize, namesize;
-	CHAR16 *name;
-	EFI_GUID guid;
-	BOOLEAN found = FALSE;
-	EFI_GUID found_guid;
-
-	bufsize = 64;		/* Initial size large enough to handle
-				   usual variable names length and
-				   avoid the ReallocatePool as much as
-				   possible.  */
-	name = AllocateZeroPool(bufsize);
-	if (!name) {
-		error(L"Failed to re-allocate variable name buffer");
-		return EFI_OUT_OF_RESOURCES;
-	}
-
-	for (;;) {
-		namesize = bufsize;
-		ret = uefi_call_wrapper(RT->GetNextVariableName, 3, &namesize,
-					name, &guid);
-		if (ret == EFI_NOT_FOUND) {
-			ret = EFI_SUCCESS;
-			break;
-		}
-		if (ret == EFI_BUFFER_TOO_SMALL) {
-			name = ReallocatePool(name, bufsize, namesize);
-			if (!name) {
-				error(L"Failed to re-allocate variable name buffer");
-				return EFI_OUT_OF_RESOURCES;
-			}
-			bufsize = namesize;
-			continue;
-		}
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"GetNextVariableName failed");
-			break;
-		}
-
-		if (!StrCmp(name, varname)) {
-			if (found) {
-				error(L"Found 2 variables named %s", varname);
-				ret = EFI_UNSUPPORTED;
-				break;
-			}
-			found = TRUE;
-			found_guid = guid;
-		}
-	}
-
-	FreePool(name);
-
-	if (EFI_ERROR(ret))
-		return ret;
-
-	if (!found)
-		return EFI_NOT_FOUND;
-
-	*guid_p = found_guid;
-	return EFI_SUCCESS;
-}
-
 static EFI_STATUS efivar_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 {
 	EFI_STATUS ret;
@@ -809,7 +1184,7 @@ static EFI_STATUS efivar_open(reader_ctx_t *ctx, UINTN argc, char **argv)
 		return EFI_OUT_OF_RESOURCES;
 
 	if (argc == 1) {
-		ret = efivar_find(varname, &guid);
+		ret = efi_variable_find(varname, &guid);
 		if (EFI_ERROR(ret))
 			goto exit;
 	}
@@ -828,6 +1203,111 @@ exit:
 	return ret;
 }
 
+/* All the EFI variables in a single stream: an efivars_header
+   followed by an efivars_record per variable, itself followed by the
+   variable name, NUL-terminated UTF-16, and data.  The variables
+   which cannot be read are skipped.  */
+#define EFIVARS_MAGIC "EFIVARS1"
+
+struct efivars_header {
+	char magic[8];
+	UINT32 nb;
+} __attribute__((packed));
+
+struct efivars_record {
+	EFI_GUID guid;
+	UINT32 attributes;
+	UINT32 name_size;
+	UINT32 data_size;
+} __attribute__((packed));
+
+struct efivars_buffer {
+	unsigned char *data;
+	UINTN size;
+	UINTN max;
+};
+
+static EFI_STATUS efivars_append(struct efivars_buffer *buf, const void *data,
+				 UINTN size)
+{
+	unsigned char *bigger;
+	UINTN new_max;
+
+	if (buf->size + size > buf->max) {
+		new_max = max(buf->max * 2, buf->size + size);
+		bigger = ReallocatePool(buf->data, buf->max, new_max);
+		if (!bigger)
+			return EFI_OUT_OF_RESOURCES;
+		buf->data = bigger;
+		buf->max = new_max;
+	}
+
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS efivars_open(reader_ctx_t *ctx, UINTN argc,
+			       __attribute__((__unused__)) char **argv)
+{
+	const struct efi_var_name *names;
+	struct efivars_buffer buf = { NULL, 0, 0 };
+	struct efivars_header header;
+	struct efivars_record record;
+	EFI_STATUS ret;
+	UINTN i, nb, size;
+	UINT32 flags;
+	VOID *data;
+
+	if (argc != 0)
+		return EFI_INVALID_PARAMETER;
+
+	ret = efi_variable_list(&names, &nb);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to list the EFI variables");
+		return ret;
+	}
+
+	memcpy(header.magic, EFIVARS_MAGIC, sizeof(header.magic));
+	header.nb = 0;
+	ret = efivars_append(&buf, &header, sizeof(header));
+
+	for (i = 0; !EFI_ERROR(ret) && i < nb; i++) {
+		if (EFI_ERROR(get_efi_variable(&names[i].guid, names[i].name,
+					       &size, &data, &flags))) {
+			debug(L"Skipping EFI variable %s %g", names[i].name,
+			      &names[i].guid);
+			continue;
+		}
+
+		record.guid = names[i].guid;
+		record.attributes = flags;
+		record.name_size = StrSize(names[i].name);
+		record.data_size = size;
+		ret = efivars_append(&buf, &record, sizeof(record));
+		if (!EFI_ERROR(ret))
+			ret = efivars_append(&buf, names[i].name, record.name_size);
+		if (!EFI_ERROR(ret))
+			ret = efivars_append(&buf, data, size);
+		FreePool(data);
+		header.nb++;
+	}
+
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to build the EFI variables stream");
+		if (buf.data)
+			FreePool(buf.data);
+		return ret;
+	}
+
+	memcpy(buf.data, &header, sizeof(header));
+	ctx->private = buf.data;
+	ctx->cur = 0;
+	ctx->len = buf.size;
+
+	return EFI_SUCCESS;
+}
+
 /* MBR */
 static EFI_STATUS mbr_open(reader_ctx_t *ctx, UINTN argc,
 			   __attribute__((__unused__)) char **argv)
@@ -987,6 +1467,355 @@ static EFI_STATUS bert_region_read(reader_ctx_t *ctx, unsigned char **buf, UINT6
 	return EFI_SUCCESS;
 }
 
+/* Bulk physical memory reader.  Without access width, the data is
+   streamed directly from memory and the copy to the transport
+   buffer uses the wide memcpy() implementation.  With an access
+   width, for devices registers, the memory is copied in a bounce
+   buffer using accesses of exactly that width.  */
+#define MEM_BOUNCE_SIZE		(64 * 1024)
+
+static struct mem_priv {
+	BOOLEAN is_in_used;
+	EFI_PHYSICAL_ADDRESS start;
+	UINTN width;
+#ifndef __LP64__
+	UINT8 memmap[MAX_MEMORY_REGION_NB * sizeof(EFI_MEMORY_DESCRIPTOR)];
+#endif
+	unsigned char bounce[MEM_BOUNCE_SIZE] __attribute__((aligned(64)));
+} mem_priv;
+
+static EFI_STATUS mem_open(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	struct mem_priv *priv = &mem_priv;
+	char *endptr;
+	UINT64 length;
+#ifndef __LP64__
+	EFI_STATUS ret;
+	UINTN nr_descr, descr_sz;
+#endif
+
+	if (argc < 2 || argc > 3)
+		return EFI_INVALID_PARAMETER;
+
+	if (priv->is_in_used)
+		return EFI_ALREADY_STARTED;
+
+	priv->start = strtoull(argv[0], &endptr, 16);
+	if (*endptr != '\0')
+		return EFI_INVALID_PARAMETER;
+
+	length = strtoull(argv[1], &endptr, 16);
+	if (*endptr != '\0' || length == 0 || priv->start + length < priv->start)
+		return EFI_INVALID_PARAMETER;
+
+	priv->width = 0;
+	if (argc == 3) {
+		priv->width = strtoul(argv[2], &endptr, 10);
+		if (*endptr != '\0' ||
+		    (priv->width != 1 && priv->width != 2 &&
+		     priv->width != 4 && priv->width != 8))
+			return EFI_INVALID_PARAMETER;
+
+		if (priv->start % priv->width || length % priv->width) {
+			error(L"Address and length must be multiple of %d bytes",
+			      priv->width);
+			return EFI_INVALID_PARAMETER;
+		}
+	}
+
+#ifndef __LP64__
+	ret = get_sorted_memory_map(priv->memmap, sizeof(priv->memmap),
+				    &nr_descr, &descr_sz);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = pae_init(priv->memmap, nr_descr, descr_sz);
+	if (EFI_ERROR(ret))
+		return ret;
+#endif
+
+	priv->is_in_used = TRUE;
+	ctx->private = priv;
+	ctx->cur = 0;
+	ctx->len = length;
+
+	return EFI_SUCCESS;
+}
+
+static void mem_copy(void *dst, unsigned char *src, UINT64 len, UINTN width)
+{
+	UINT64 i;
+
+	switch (width) {
+	case 1:
+		for (i = 0; i < len; i++)
+			((UINT8 *)dst)[i] = ((volatile UINT8 *)src)[i];
+		break;
+	case 2:
+		for (i = 0; i < len / 2; i++)
+			((UINT16 *)dst)[i] = ((volatile UINT16 *)src)[i];
+		break;
+	case 4:
+		for (i = 0; i < len / 4; i++)
+			((UINT32 *)dst)[i] = ((volatile UINT32 *)src)[i];
+		break;
+	case 8:
+		for (i = 0; i < len / 8; i++)
+			((UINT64 *)dst)[i] = ((volatile UINT64 *)src)[i];
+		break;
+	}
+}
+
+static EFI_STATUS mem_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
+{
+	struct mem_priv *priv = ctx->private;
+	EFI_PHYSICAL_ADDRESS addr = priv->start + ctx->cur;
+	unsigned char *src;
+#ifndef __LP64__
+	EFI_STATUS ret;
+#endif
+
+	if (priv->width) {
+		*len = min(*len, (UINT64)sizeof(priv->bounce));
+		*len -= *len % priv->width;
+		if (*len == 0)
+			return EFI_INVALID_PARAMETER;
+	}
+
+#ifdef __LP64__
+	src = (unsigned char *)addr;
+#else
+	ret = pae_map(addr, &src, len);
+	if (EFI_ERROR(ret))
+		return ret;
+	if (priv->width)
+		*len -= *len % priv->width;
+#endif
+
+	if (!priv->width) {
+		*buf = src;
+		return EFI_SUCCESS;
+	}
+
+	mem_copy(priv->bounce, src, *len, priv->width);
+	*buf = priv->bounce;
+
+	return EFI_SUCCESS;
+}
+
+static void mem_close(reader_ctx_t *ctx)
+{
+	struct mem_priv *priv = ctx->private;
+
+#ifndef __LP64__
+	pae_exit();
+#endif
+	priv->is_in_used = FALSE;
+}
+
+struct reader {
+	const char *name;
+	EFI_STATUS (*open)(reader_ctx_t *ctx, UINTN argc, char **argv);
+	EFI_STATUS (*read)(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len);
+	void (*close)(reader_ctx_t *ctx);
+};
+
+static struct reader *find_reader(const char *name);
+
+/* LZ4 compressed stream of another reader.  The data is gathered by
+   LZ4_FRAME_BLOCK_SIZE bytes blocks and the next block is compressed
+   on an Application Processor while the previous one is transmitted.
+   The buffers are static so that the memory dumps do not make any
+   dynamic memory allocation.  */
+
+struct lz4_block {
+	unsigned char in[LZ4_FRAME_BLOCK_SIZE];
+	UINTN in_len;
+	unsigned char out[LZ4_FRAME_BLOCK_BOUND(LZ4_FRAME_BLOCK_SIZE)];
+	UINTN out_len;
+	UINT32 *table;
+};
+
+static struct lz4_priv {
+	BOOLEAN is_in_used;
+	reader_ctx_t src;
+
+	unsigned char frame[LZ4_FRAME_HEADER_SIZE];
+	UINT32 table[LZ4_HASH_SIZE];
+	struct lz4_block blocks[2];
+
+	/* Block being sent */
+	struct lz4_block *cur;
+	UINTN cur_sent;
+
+	/* Block being compressed */
+	struct lz4_block *next;
+	BOOLEAN on_pool;
+} lz4_priv;
+
+static void lz4_compress_work(__attribute__((__unused__)) UINTN start,
+			      __attribute__((__unused__)) UINTN end,
+			      VOID *ctx)
+{
+	struct lz4_block *block = ctx;
+
+	block->out_len = lz4_frame_block(block->in, block->in_len,
+					 block->out, block->table);
+}
+
+static EFI_STATUS lz4_fill(struct lz4_priv *priv, struct lz4_block *block)
+{
+	EFI_STATUS ret;
+	unsigned char *data;
+	UINT64 len;
+
+	for (block->in_len = 0; block->in_len < sizeof(block->in); ) {
+		len = sizeof(block->in) - block->in_len;
+		ret = reader_read(&priv->src, &data, &len);
+		if (EFI_ERROR(ret))
+			return ret;
+		if (len == 0)
+			break;
+
+		memcpy(block->in + block->in_len, data, len);
+		block->in_len += len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Start the compression of BLOCK on the worker pool, or compress it
+   right away if the pool is busy.  */
+static void lz4_compress(struct lz4_priv *priv, struct lz4_block *block)
+{
+	priv->next = block;
+	priv->on_pool = !EFI_ERROR(mp_pool_start(1, 1, lz4_compress_work, block));
+	if (!priv->on_pool)
+		lz4_compress_work(0, 1, block);
+}
+
+static EFI_STATUS lz4_wait(struct lz4_priv *priv)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	if (priv->on_pool)
+		ret = mp_pool_wait();
+	priv->on_pool = FALSE;
+
+	priv->cur = priv->next;
+	priv->cur_sent = 0;
+	priv->next = NULL;
+
+	return ret;
+}
+
+static EFI_STATUS lz4_open(reader_ctx_t *ctx, UINTN argc, char **argv)
+{
+	EFI_STATUS ret;
+	struct lz4_priv *priv = &lz4_priv;
+	struct reader *reader;
+	UINTN i;
+
+	if (argc < 1)
+		return EFI_INVALID_PARAMETER;
+
+	if (priv->is_in_used)
+		return EFI_ALREADY_STARTED;
+
+	reader = find_reader(argv[0]);
+	if (!reader)
+		return EFI_UNSUPPORTED;
+
+	memset(&priv->src, 0, sizeof(priv->src));
+	priv->src.reader = reader;
+	ret = reader->open(&priv->src, argc - 1, argv + 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	for (i = 0; i < ARRAY_SIZE(priv->blocks); i++)
+		priv->blocks[i].table = priv->table;
+	priv->cur = priv->next = NULL;
+	priv->on_pool = FALSE;
+	priv->is_in_used = TRUE;
+
+	/* The compressed size is only known at the end of the stream */
+	ctx->private = priv;
+	ctx->cur = 0;
+	ctx->len = ULLONG_MAX;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS lz4_read(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len)
+{
+	EFI_STATUS ret;
+	struct lz4_priv *priv = ctx->private;
+	struct lz4_block *block;
+
+	/* First byte, send the frame header and start the compression
+	   of the first block */
+	if (ctx->cur == 0) {
+		if (*len < LZ4_FRAME_HEADER_SIZE)
+			return EFI_INVALID_PARAMETER;
+
+		ret = lz4_fill(priv, &priv->blocks[0]);
+		if (EFI_ERROR(ret))
+			return ret;
+		if (priv->blocks[0].in_len)
+			lz4_compress(priv, &priv->blocks[0]);
+
+		*buf = priv->frame;
+		*len = lz4_frame_header(priv->frame);
+		return EFI_SUCCESS;
+	}
+
+	if (!priv->cur || priv->cur_sent == priv->cur->out_len) {
+		/* End of the stream */
+		if (!priv->next) {
+			if (*len < LZ4_FRAME_END_SIZE)
+				return EFI_INVALID_PARAMETER;
+
+			*buf = priv->frame;
+			*len = lz4_frame_end(priv->frame);
+			ctx->len = ctx->cur + *len;
+			return EFI_SUCCESS;
+		}
+
+		/* Gather the block after next while the next block is
+		   compressed */
+		block = priv->next == &priv->blocks[0] ?
+			&priv->blocks[1] : &priv->blocks[0];
+		ret = lz4_fill(priv, block);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		ret = lz4_wait(priv);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		if (block->in_len)
+			lz4_compress(priv, block);
+	}
+
+	*len = min(*len, (UINT64)(priv->cur->out_len - priv->cur_sent));
+	*buf = priv->cur->out + priv->cur_sent;
+	priv->cur_sent += *len;
+
+	return EFI_SUCCESS;
+}
+
+static void lz4_close(reader_ctx_t *ctx)
+{
+	struct lz4_priv *priv = ctx->private;
+
+	if (priv->on_pool)
+		mp_pool_wait();
+	priv->on_pool = FALSE;
+
+	reader_close(&priv->src);
+	priv->is_in_used = FALSE;
+}
+
 /* Interface */
 static EFI_STATUS read_from_private(reader_ctx_t *ctx, unsigned char **buf,
 				    __attribute__((__unused__)) UINT64 *len)
@@ -1000,35 +1829,44 @@ static void free_private(reader_ctx_t *ctx)
 	FreePool(ctx->private);
 }
 
-struct reader {
-	const char *name;
-	EFI_STATUS (*open)(reader_ctx_t *ctx, UINTN argc, char **argv);
-	EFI_STATUS (*read)(reader_ctx_t *ctx, unsigned char **buf, UINT64 *len);
-	void (*close)(reader_ctx_t *ctx);
-} READERS[] = {
+struct reader READERS[] = {
 	{ "ram",		ram_open,			ram_read,		memory_close },
 	{ "vmcore",		vmcore_open,			vmcore_read,		memory_close },
 	{ "acpi",		acpi_open,			read_from_private,	NULL },
-	{ "part",		part_open,			part_read,		free_private },
-	{ "factory-part",	factory_part_open,		part_read,		free_private },
+	{ "part",		part_open,			part_read,		part_close },
+	{ "factory-part",	factory_part_open,		part_read,		part_close },
 	{ "efivar",		efivar_open,			read_from_private,	free_private },
+	{ "efivars",		efivars_open,			read_from_private,	free_private },
 	{ "mbr",		mbr_open,			read_from_private,	free_private },
 	{ "gpt-header",		gpt_header_open,		read_from_private,	free_private },
 	{ "gpt-parts",		gpt_parts_open,			read_from_private,	free_private },
 	{ "gpt-factory-header",	gpt_factory_header_open,	read_from_private,	free_private },
 	{ "gpt-factory-parts",	gpt_factory_parts_open,		read_from_private,	free_private },
-	{ "bert-region",	bert_region_open,		bert_region_read,	NULL }
+	{ "bert-region",	bert_region_open,		bert_region_read,	NULL },
+	{ "crashdump",		crashdump_open,			part_read,		part_close },
+	{ "lz4",		lz4_open,			lz4_read,		lz4_close },
+	{ "mem",		mem_open,			mem_read,		mem_close }
 };
 
 #define MAX_ARGS		8
 
+static struct reader *find_reader(const char *name)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(READERS); i++)
+		if (!strcmp((CHAR8 *)name, (CHAR8 *)READERS[i].name))
+			return &READERS[i];
+
+	return NULL;
+}
+
 EFI_STATUS reader_open(reader_ctx_t *ctx, char *args)
 {
 	EFI_STATUS ret;
 	INTN argc;
-	UINTN i;
 	char *argv[MAX_ARGS];
-	struct reader *reader = NULL;
+	struct reader *reader;
 
 	if (!args || !ctx)
 		return EFI_INVALID_PARAMETER;
@@ -1040,12 +1878,7 @@ EFI_STATUS reader_open(reader_ctx_t *ctx, char *args)
 		return ret;
 	}
 
-	for (i = 0; i < ARRAY_SIZE(READERS); i++)
-		if (!strcmp((CHAR8 *)argv[0], (CHAR8 *)READERS[i].name)) {
-			reader = &READERS[i];
-			break;
-		}
-
+	reader = find_reader(argv[0]);
 	if (!reader)
 		return EFI_UNSUPPORTED;
 
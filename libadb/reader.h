@@ -35,6 +35,13 @@
 
 #include <gpt.h>
 
+/* Size of the partition reader buffer, the largest chunk a reader
+   returns */
+#define PART_READER_BUF_SIZE (4 * 1024 * 1024)
+
+/* Maximum number of memory map entries of the memory readers */
+#define MAX_MEMORY_REGION_NB 256
+
 typedef struct reader_context {
 	struct reader *reader;
 	UINT64 cur;
@@ -46,4 +53,9 @@ EFI_STATUS reader_open(reader_ctx_t *reader, char *args);
 EFI_STATUS reader_read(reader_ctx_t *reader, unsigned char **buf, UINT64 *len);
 void reader_close(reader_ctx_t *reader);
 
+/* Fill up the MEMMAP_SZ bytes of MEMMAP with the current memory map
+   sorted by physical address.  It does not allocate any memory.  */
+EFI_STATUS get_sorted_memory_map(UINT8 *memmap, UINTN memmap_sz,
+				 UINTN *nr_descr, UINTN *descr_sz);
+
 #endif	/* _READER_H_ */
@@ -46,6 +46,8 @@ typedef struct service {
 	EFI_STATUS (*close)(asock_t s);
 	EFI_STATUS (*okay)(asock_t s);
 	EFI_STATUS (*read)(asock_t s, unsigned char *data, UINT32 length);
+	/* Optional, see asock_tx_busy() */
+	EFI_STATUS (*drained)(asock_t s);
 } service_t;
 
 extern service_t sync_service;
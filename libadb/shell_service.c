@@ -32,6 +32,7 @@
 
 #include <lib.h>
 #include <pae.h>
+#include <memmap.h>
 
 #include "adb_socket.h"
 #include "service.h"
@@ -43,6 +44,10 @@
 #include "lsacpi.h"
 #include "lspartition.h"
 #include "lspci.h"
+#include "storagebench.h"
+#include "crashdump.h"
+#include "memsum.h"
+#include "meminfo.h"
 
 #define MAX_ARGS	8
 
@@ -51,12 +56,18 @@ typedef struct {
 	char *arg;
 	INTN argc;
 	const char *argv[MAX_ARGS];
+	/* Command output, sent by packets of up to adb_max_payload
+	   bytes once the command has exited */
 	char *buf;
-	UINTN buf_size;
+	UINTN buf_len;
+	UINTN buf_cap;
+	UINTN buf_sent;
+	BOOLEAN closed;
 } shell_ctx_t;
 
 static shcmd_t help_shcmd, list_shcmd;
 static shcmd_t *SHCMD[] = {
+	&crashdump_shcmd,
 	&devmem_shcmd,
 	&help_shcmd,
 	&hexdump_shcmd,
@@ -67,9 +78,14 @@ static shcmd_t *SHCMD[] = {
 	&lsacpi_shcmd,
 	&lspartition_shcmd,
 	&lspci_shcmd,
+#ifdef MEMTRACK
+	&meminfo_shcmd,
+#endif
+	&memsum_shcmd,
 	&outb_shcmd,
 	&outl_shcmd,
-	&outw_shcmd
+	&outw_shcmd,
+	&storagebench_shcmd
 };
 
 static void free_shell_ctx(shell_ctx_t *ctx)
@@ -142,6 +158,31 @@ err:
 	return ret;
 }
 
+static EFI_STATUS send_output(asock_t s, shell_ctx_t *ctx)
+{
+	EFI_STATUS ret;
+	UINT32 len;
+
+	if (ctx->closed)
+		return EFI_SUCCESS;
+
+	if (ctx->buf_sent == ctx->buf_len) {
+		ctx->closed = TRUE;
+		return asock_send_close(s);
+	}
+
+	while (ctx->buf_sent < ctx->buf_len && asock_can_write(s)) {
+		len = min((UINTN)adb_max_payload, ctx->buf_len - ctx->buf_sent);
+		ret = asock_write_ref(s, (unsigned char *)ctx->buf + ctx->buf_sent,
+				      len);
+		if (EFI_ERROR(ret))
+			return ret;
+		ctx->buf_sent += len;
+	}
+
+	return EFI_SUCCESS;
+}
+
 static asock_t current_socket;
 static EFI_STATUS shell_service_ready(asock_t s)
 {
@@ -156,12 +197,7 @@ static EFI_STATUS shell_service_ready(asock_t s)
 		ss_printf(L"'%a' failed with error %r", ctx->cmd->name, ret);
 	current_socket = NULL;
 
-	if (ctx->buf)
-		ret = asock_write(s, ctx->buf, ctx->buf_size - 1);
-	else
-		ret = asock_send_close(s);
-
-	return ret;
+	return send_output(s, ctx);
 }
 
 static EFI_STATUS shell_service_close(asock_t s)
@@ -172,7 +208,7 @@ static EFI_STATUS shell_service_close(asock_t s)
 
 static EFI_STATUS shell_service_okay(asock_t s)
 {
-	return asock_send_close(s);
+	return send_output(s, asock_context(s));
 }
 
 static EFI_STATUS shell_service_read(__attribute__((__unused__)) asock_t s,
@@ -245,10 +281,58 @@ static shcmd_t list_shcmd = {
 };
 
 #define BUFFER_SIZE 512
+#define MIN_OUTPUT_SIZE (16 * 1024)
+
+/* Make room for LENGTH more bytes, plus the terminating NUL
+   character, in the command output buffer.  The buffer capacity is
+   doubled so that the output is not copied over and over.  */
+static EFI_STATUS reserve_output(shell_ctx_t *ctx, UINTN length)
+{
+	UINTN cap;
+	char *buf;
+
+	if (ctx->buf_len + length < ctx->buf_cap)
+		return EFI_SUCCESS;
+
+	for (cap = max(ctx->buf_cap, (UINTN)MIN_OUTPUT_SIZE);
+	     cap <= ctx->buf_len + length; cap *= 2)
+		;
+
+	buf = AllocatePool(cap);
+	if (!buf) {
+		efi_perror(EFI_OUT_OF_RESOURCES, L"Failed to grow the shell output buffer");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	if (ctx->buf) {
+		memcpy(buf, ctx->buf, ctx->buf_len);
+		FreePool(ctx->buf);
+	}
+	ctx->buf = buf;
+	ctx->buf_cap = cap;
+
+	return EFI_SUCCESS;
+}
+
+/* These functions are to be called by the shell command
+   implementation.  They add text to a buffer which is sent through
+   the adb socket once the command has exited (end of its main
+   function). */
+EFI_STATUS ss_write(const char *data, UINTN length)
+{
+	shell_ctx_t *ctx = asock_context(current_socket);
+	EFI_STATUS ret;
+
+	ret = reserve_output(ctx, length);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(ctx->buf + ctx->buf_len, data, length);
+	ctx->buf_len += length;
+
+	return EFI_SUCCESS;
+}
 
-/* This function is to be called by the shell command implementation.
-   It adds formatted text to a buffer which is sent through the adb
-   socket once the command has exited (end of its main function). */
 EFI_STATUS ss_printf(const CHAR16 *fmt, ...)
 {
 	va_list args;
@@ -258,31 +342,19 @@ EFI_STATUS ss_printf(const CHAR16 *fmt, ...)
 	EFI_STATUS ret;
 
 	va_start(args, fmt);
-	length = VSPrint(buf16, sizeof(buf16), (CHAR16 *)fmt, args) + 1;
+	length = VSPrint(buf16, sizeof(buf16), (CHAR16 *)fmt, args);
 	va_end(args);
 
-	if (!ctx->buf) {
-		ctx->buf = AllocatePool(length);
-		if (!ctx->buf)
-			goto err;
-
-		ret = str_to_stra(ctx->buf, buf16, length);
-		ctx->buf_size += length;
-	} else {
-		ctx->buf = ReallocatePool(ctx->buf, ctx->buf_size,
-					  ctx->buf_size + length - 1);
-		if (!ctx->buf)
-			goto err;
-
-		ret = str_to_stra(ctx->buf + ctx->buf_size - 1, buf16, length);
-		ctx->buf_size += length - 1;
-	}
+	ret = reserve_output(ctx, length);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	return ret;
+	ret = str_to_stra((CHAR8 *)ctx->buf + ctx->buf_len, buf16, length + 1);
+	if (EFI_ERROR(ret))
+		return ret;
 
-err:
-	efi_perror(EFI_OUT_OF_RESOURCES, L"ss_printf() failed, %r");
-	return EFI_OUT_OF_RESOURCES;
+	ctx->buf_len += length;
+	return EFI_SUCCESS;
 }
 
 EFI_STATUS ss_read_number(const char *arg, const char *name, UINT64 *value)
@@ -303,58 +375,69 @@ EFI_STATUS ss_read_number(const char *arg, const char *name, UINT64 *value)
 
 #define PRINT_SIZE (sizeof(UINT64) * 2)
 
-static CHAR16 *get_address_format(EFI_PHYSICAL_ADDRESS address)
+static char *format_hex(char *p, UINT64 value, UINTN digits)
 {
-	static CHAR16 fmt[8];
+	static const char HEX[] = "0123456789abcdef";
 	UINTN i;
 
-	for (i = 0; address != 0; i++)
-		address /= 16;
+	for (i = digits; i--; value >>= 4)
+		p[i] = HEX[value & 0xf];
 
-	SPrint(fmt, sizeof(fmt), L"%%0%dllx", i);
-	return fmt;
+	return p + digits;
 }
 
+/* The lines are formatted by hand, without going through the
+   CHAR16 formatting of ss_printf(), in a buffer holding many
+   lines.  */
+#define HEXDUMP_BUF_SIZE 4096
+
 void ss_hexdump(unsigned char *buf, UINTN length,
 		EFI_PHYSICAL_ADDRESS address, BOOLEAN canonical)
 {
-	CHAR16 *addr_fmt;
-	char ascii[PRINT_SIZE + 1] = { '\0' };
-	unsigned char *cur, *end;
-	UINTN col;
-
-	addr_fmt = get_address_format(address + length);
-	memset(ascii, '.', sizeof(ascii) - 1);
-	end = (char *)(UINTN)(buf + length);
-	for (col = 0, cur = (char *)(UINTN)buf;
-	     cur != end;
-	     address++, cur++, col = (col + 1) % PRINT_SIZE) {
-		if (col == 0)
-			ss_printf(addr_fmt, address);
-
-		ss_printf(L" %a%02x", col % sizeof(UINT64) ? "" : " ", *cur);
-
-		if (*cur >= ' ' && *cur <= '~')
-			ascii[col] = *cur;
-		else
-			ascii[col] = '.';
-
-		if (col == PRINT_SIZE - 1) {
-			if (canonical) {
-				ss_printf(L"  |%a|", ascii);
-				memset(ascii, '.', sizeof(ascii) - 1);
+	/* Address, two columns of 8 bytes, ASCII column and newline */
+	char out[HEXDUMP_BUF_SIZE], *p = out;
+	const UINTN line_max = 16 + PRINT_SIZE * 3 + 2 + 4 + PRINT_SIZE + 1;
+	EFI_PHYSICAL_ADDRESS end;
+	UINTN col, n, digits;
+
+	for (digits = 1, end = (address + length) >> 4; end; end >>= 4)
+		digits++;
+
+	for (; length; buf += n, address += n, length -= n) {
+		n = min(length, (UINTN)PRINT_SIZE);
+
+		p = format_hex(p, address, digits);
+		for (col = 0; col < PRINT_SIZE; col++) {
+			*p++ = ' ';
+			if (col % sizeof(UINT64) == 0)
+				*p++ = ' ';
+			if (col < n)
+				p = format_hex(p, buf[col], 2);
+			else {
+				*p++ = ' ';
+				*p++ = ' ';
 			}
-			ss_printf(L"\n");
 		}
-	}
 
-	if (col != 0) {
-		for (; col < PRINT_SIZE; col++)
-			ss_printf(L" %a  ", col % sizeof(UINT64) ? "" : " ");
-		if (canonical)
-			ss_printf(L"  |%a|", ascii);
-		ss_printf(L"\n");
+		if (canonical) {
+			*p++ = ' ';
+			*p++ = ' ';
+			*p++ = '|';
+			for (col = 0; col < PRINT_SIZE; col++)
+				*p++ = col < n && buf[col] >= ' ' && buf[col] <= '~' ?
+					buf[col] : '.';
+			*p++ = '|';
+		}
+		*p++ = '\n';
+
+		if ((UINTN)(p - out) > sizeof(out) - line_max) {
+			ss_write(out, p - out);
+			p = out;
+		}
 	}
+
+	if (p != out)
+		ss_write(out, p - out);
 }
 
 #ifndef __LP64__
@@ -362,19 +445,23 @@ EFI_STATUS ss_pae_map(EFI_PHYSICAL_ADDRESS *address, UINT64 length)
 {
 	EFI_STATUS ret;
 	unsigned char *to;
-	EFI_MEMORY_DESCRIPTOR *map;
-        UINTN nr_entries, key, entry_sz;
-        UINT32 entry_ver;
+	CHAR8 *map;
+	UINTN nr_entries, entry_sz;
 	UINT64 len = length;
 
-	map = LibMemoryMap(&nr_entries, &key, &entry_sz, &entry_ver);
-	if (!map)
-		return EFI_OUT_OF_RESOURCES;
+	ret = memmap_get(&map, &nr_entries, &entry_sz, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	ret = pae_init((CHAR8 *)map, nr_entries, entry_sz);
+	ret = pae_init(map, nr_entries, entry_sz);
 	if (EFI_ERROR(ret))
 		return ret;
 
+	if (length > pae_max_map_size()) {
+		ret = EFI_BUFFER_TOO_SMALL;
+		goto err;
+	}
+
 	ret = pae_map(*address, &to, &len);
 	if (EFI_ERROR(ret))
 		goto err;
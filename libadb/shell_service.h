@@ -36,6 +36,7 @@
 #include <efi.h>
 
 EFI_STATUS ss_printf(const CHAR16 *fmt, ...);
+EFI_STATUS ss_write(const char *data, UINTN length);
 EFI_STATUS ss_read_number(const char *arg, const char *name, UINT64 *value);
 void ss_hexdump(unsigned char *buf, UINTN length,
 		EFI_PHYSICAL_ADDRESS address, BOOLEAN canonical);
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include <vars.h>
+#include <storage_bench.h>
+
+#include "storagebench.h"
+
+static EFI_STATUS storagebench_main(INTN argc, const char **argv)
+{
+	struct storage_bench_result results[STORAGE_BENCH_MAX_RESULTS];
+	static const char *NAMES[] = { "SIZE", "BS", "QD" };
+	UINT64 params[ARRAY_SIZE(NAMES)] = { 0 };
+	CHAR16 *label;
+	EFI_STATUS ret;
+	UINTN i, nb;
+
+	if (argc > 5)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 2; i < (UINTN)argc; i++) {
+		ret = ss_read_number(argv[i], NAMES[i - 2], &params[i - 2]);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	label = stra_to_str((CHAR8 *)(argc > 1 ? argv[1] : "userdata"));
+	if (!label)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = storage_bench(label, params[0], params[1], params[2],
+			    device_is_unlocked(), results, &nb);
+	FreePool(label);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ss_printf(L"%-.10a  %8a  %2a  %10a  %8a\n-\n",
+		  "Test", "BS", "QD", "KiB/s", "IOPS");
+	for (i = 0; i < nb; i++)
+		ss_printf(L"%-.10a  %8d  %2d  %10ld  %8ld\n",
+			  storage_bench_test_name(results[i].test),
+			  (UINT32)results[i].block_size,
+			  (UINT32)results[i].queue_depth,
+			  storage_bench_kib_per_sec(&results[i]),
+			  storage_bench_iops(&results[i]));
+
+	return EFI_SUCCESS;
+}
+
+shcmd_t storagebench_shcmd = {
+	.name = "storagebench",
+	.summary = "Measure the storage performance",
+	.help = "Usage: storagebench [<PART> [<SIZE> [<BS> [<QD>]]]]\n"
+	"Run sequential and random read tests, and write tests on the\n"
+	"userdata or cache partitions of an unlocked device, on the first\n"
+	"SIZE bytes of PART (userdata by default).  The block sizes and\n"
+	"queue depths default to 4K, 128K, 1M and 1, 4.",
+	.main = storagebench_main
+};
@@ -69,15 +69,16 @@ typedef union {
 	} data;
 } sync_msg_t;
 
+/* Maximum size of a DATA message accepted by the host */
 #define SYNC_DATA_MAX (64 * 1024)
 
 typedef struct {
 	state_t state;
 	reader_ctx_t reader_ctx;
-	BOOLEAN need_more_data;
 	unsigned char *buf;
 	UINT64 buf_cur;
 	UINT64 buf_len;
+	UINT64 data_left;	/* Bytes left in the current DATA message */
 	UINT64 sent;
 } sync_ctx_t;
 static sync_ctx_t CONTEXTS[MAX_ADB_SOCKET];
@@ -141,15 +142,21 @@ static EFI_STATUS send_done(asock_t s, sync_ctx_t *ctx)
 
 #define DATA_PROGRESS_THRESHOLD (5 * 1024 * 1024)
 
-static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
+/* The data is loaded from the reader by chunks of up to
+   PART_READER_BUF_SIZE bytes and sent in DATA messages of up to
+   SYNC_DATA_MAX bytes.  Each call sends one WRTE packet.  The packets
+   reference the reader buffer, which is reused by the next
+   reader_read() call: the next chunk is only loaded once they are all
+   sent.  */
+static EFI_STATUS send_data_packet(asock_t s, sync_ctx_t *ctx)
 {
 	EFI_STATUS ret;
 	UINT32 sent;
 	sync_msg_t msg;
 
 	/* Need to load more data. */
-	if (ctx->need_more_data) {
-		ctx->buf_len = SYNC_DATA_MAX;
+	if (ctx->buf_cur == ctx->buf_len) {
+		ctx->buf_len = PART_READER_BUF_SIZE;
 
 		ret = reader_read(&ctx->reader_ctx, &ctx->buf, &ctx->buf_len);
 		if (EFI_ERROR(ret))
@@ -157,22 +164,25 @@ static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
 		if (ctx->buf_len == 0) /* No more data to send. */
 			return send_done(s, ctx);
 
-		msg.data.id = ID_DATA;
-		msg.data.size = ctx->buf_len;
 		ctx->buf_cur = 0;
-		ctx->need_more_data = FALSE;
+	}
+
+	if (ctx->data_left == 0) {
+		ctx->data_left = min((UINT64)SYNC_DATA_MAX,
+				     ctx->buf_len - ctx->buf_cur);
+		msg.data.id = ID_DATA;
+		msg.data.size = ctx->data_left;
 
 		return asock_write(s, (unsigned char *)&msg, sizeof(msg.data));
 	}
 
-	sent = min((UINTN)adb_max_payload, ctx->buf_len - ctx->buf_cur);
-	ret = asock_write(s, ctx->buf + ctx->buf_cur, sent);
+	sent = min((UINT64)adb_max_payload, ctx->data_left);
+	ret = asock_write_ref(s, ctx->buf + ctx->buf_cur, sent);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ctx->buf_cur = ctx->buf_cur + sent;
-	if (ctx->buf_cur == ctx->buf_len)
-		ctx->need_more_data = TRUE;
+	ctx->buf_cur += sent;
+	ctx->data_left -= sent;
 
 	ctx->sent += sent;
 	if (ctx->sent >= DATA_PROGRESS_THRESHOLD &&
@@ -182,6 +192,24 @@ static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
 	return ret;
 }
 
+/* Send as many packets as the socket accepts: one per OKAY without
+   the delayed acknowledgement, up to the host window otherwise.  The
+   next OKAY resumes the transfer, or the drained() call if it is
+   waiting for the reader buffer.  */
+static EFI_STATUS send_more_data(asock_t s, sync_ctx_t *ctx)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	while (!EFI_ERROR(ret) && ctx->state == SENDING_DATA &&
+	       asock_can_write(s)) {
+		if (ctx->buf_cur == ctx->buf_len && asock_tx_busy(s))
+			break;
+		ret = send_data_packet(s, ctx);
+	}
+
+	return ret;
+}
+
 static EFI_STATUS sync_service_okay(asock_t s)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
@@ -196,6 +224,19 @@ static EFI_STATUS sync_service_okay(asock_t s)
 	return ret;
 }
 
+static EFI_STATUS sync_service_drained(asock_t s)
+{
+	sync_ctx_t *ctx = asock_context(s);
+
+	if (!ctx)
+		return EFI_INVALID_PARAMETER;
+
+	if (ctx->state == SENDING_DATA)
+		return send_more_data(s, ctx);
+
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS sync_service_reader_open(sync_ctx_t *ctx, unsigned char *data, UINT32 length)
 {
 	char path[length + 1];
@@ -255,7 +296,8 @@ static EFI_STATUS sync_service_recv(asock_t s, sync_ctx_t *ctx, unsigned char *d
 
 	ctx->sent = 0;
 	ctx->state = SENDING_DATA;
-	ctx->need_more_data = TRUE;
+	ctx->buf_cur = ctx->buf_len = 0;
+	ctx->data_left = 0;
 
 	return send_more_data(s, ctx);
 }
@@ -318,5 +360,6 @@ service_t sync_service = {
 	.ready	= sync_service_ready,
 	.close	= sync_service_close,
 	.okay	= sync_service_okay,
-	.read	= sync_service_read
+	.read	= sync_service_read,
+	.drained = sync_service_drained
 };
@@ -17,6 +17,7 @@ WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
 #include "Tpm2Help.h"
 #include "Tcg2Protocol.h"
 #include "Tpm2DeviceLib.h"
+#include "boottrace.h"
 
 EFI_STATUS
 EFIAPI
@@ -31,15 +32,24 @@ Tpm2SubmitCommand (
   TPM2_RESPONSE_HEADER      *Header;
 
   EFI_GUID gEfiTcg2ProtocolGuid = EFI_TCG2_PROTOCOL_GUID;
-  EFI_TCG2_PROTOCOL *mTcg2Protocol;
+  //
+  // The protocol is looked up once, not for every command.
+  //
+  static EFI_TCG2_PROTOCOL *mTcg2Protocol;
 
- Status = LibLocateProtocol (&gEfiTcg2ProtocolGuid, (void **) &mTcg2Protocol);
+  if (mTcg2Protocol == NULL) {
+    Status = LibLocateProtocol (&gEfiTcg2ProtocolGuid, (void **) &mTcg2Protocol);
     if (EFI_ERROR (Status)) {
       //
       // Tcg2 protocol is not installed. So, TPM2 is not present.
       //
+      mTcg2Protocol = NULL;
       return EFI_NOT_FOUND;
     }
+  }
+
+  boottrace_begin (BT_TPM_CMD,
+                   SwapBytes32 (((TPM2_COMMAND_HEADER *)InputParameterBlock)->commandCode));
   //
   // Assume when Tcg2 Protocol is ready, RequestUseTpm already done.
   //
@@ -51,11 +61,14 @@ Tpm2SubmitCommand (
                             OutputParameterBlock
                             );
   if (EFI_ERROR (Status)) {
+    boottrace_end (BT_TPM_CMD, (InputParameterBlockSize & 0xFFFF) << 16);
     return Status;
   }
 
   Header = (TPM2_RESPONSE_HEADER *)OutputParameterBlock;
   *OutputParameterBlockSize = SwapBytes32 (Header->paramSize);
+  boottrace_end (BT_TPM_CMD, (InputParameterBlockSize & 0xFFFF) << 16 |
+                             (*OutputParameterBlockSize & 0xFFFF));
 
   return EFI_SUCCESS;
 }
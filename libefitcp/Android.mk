@@ -4,6 +4,23 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := libefitcp-$(TARGET_BUILD_VARIANT)
 LOCAL_CFLAGS := $(KERNELFLINGER_CFLAGS)
+
+ifneq ($(KERNELFLINGER_TCP_MAX_TOKEN),)
+    LOCAL_CFLAGS += -DTCP_MAX_TOKEN=$(KERNELFLINGER_TCP_MAX_TOKEN)
+endif
+
+ifneq ($(KERNELFLINGER_TCP_RX_FRAG_SIZE),)
+    LOCAL_CFLAGS += -DTCP_RX_FRAG_SIZE=$(KERNELFLINGER_TCP_RX_FRAG_SIZE)
+endif
+
+ifneq ($(KERNELFLINGER_TCP_WINDOW_SIZE),)
+    LOCAL_CFLAGS += -DTCP_WINDOW_SIZE=$(KERNELFLINGER_TCP_WINDOW_SIZE)
+endif
+
+ifneq ($(KERNELFLINGER_NET_LEASE_CACHE_SEC),)
+    LOCAL_CFLAGS += -DNET_LEASE_CACHE_SEC=$(KERNELFLINGER_NET_LEASE_CACHE_SEC)
+endif
+
 LOCAL_STATIC_LIBRARIES := \
 	$(KERNELFLINGER_STATIC_LIBRARIES) \
 	libkernelflinger-$(TARGET_BUILD_VARIANT) \
@@ -12,6 +29,8 @@ LOCAL_STATIC_LIBRARIES := \
 LOCAL_EXPORT_C_INCLUDE_DIRS := $(LOCAL_PATH)/../include/libefitcp
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include/libefitcp
 LOCAL_SRC_FILES := \
-	tcp.c
+	tcp.c \
+	udp.c \
+	ipcfg.c
 
 include $(BUILD_EFI_STATIC_LIBRARY)
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include <vars.h>
+
+#include "ipcfg.h"
+
+#define NETWORK_CONFIG_VAR	L"NetworkConfig"
+#define NETWORK_LEASE_VAR	L"NetworkLease"
+
+#ifndef NET_LEASE_CACHE_SEC
+#define NET_LEASE_CACHE_SEC	3600
+#endif
+
+#define LEASE_VERSION		1
+
+struct lease {
+	UINT32 version;
+	EFI_IPv4_ADDRESS address;
+	EFI_IPv4_ADDRESS mask;
+	EFI_IPv4_ADDRESS gateway;
+	UINT64 saved;		/* Seconds since the Epoch */
+} __attribute__((packed));
+
+static struct lease cached;
+static BOOLEAN using_cache;
+
+static UINT64 now_sec(void)
+{
+	EFI_TIME now;
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(RT->GetTime, 2, &now, NULL);
+	if (EFI_ERROR(ret))
+		return 0;
+
+	return efi_time_to_ctime(&now);
+}
+
+static BOOLEAN is_any(EFI_IPv4_ADDRESS *addr)
+{
+	UINTN i;
+
+	for (i = 0; i < sizeof(addr->Addr); i++)
+		if (addr->Addr[i])
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Parse a dotted decimal address, return the character which ends it */
+static const CHAR16 *parse_address(const CHAR16 *str, EFI_IPv4_ADDRESS *addr)
+{
+	UINTN i, value, digits;
+
+	for (i = 0; i < sizeof(addr->Addr); i++) {
+		if (i && *str++ != '.')
+			return NULL;
+		for (value = 0, digits = 0; *str >= '0' && *str <= '9';
+		     str++, digits++)
+			value = value * 10 + (*str - '0');
+		if (!digits || digits > 3 || value > 255)
+			return NULL;
+		addr->Addr[i] = value;
+	}
+
+	return str;
+}
+
+static EFI_STATUS get_static(struct ipcfg *cfg)
+{
+	CHAR16 *str;
+	const CHAR16 *p;
+	UINTN prefix = 0, i;
+	EFI_STATUS ret = EFI_INVALID_PARAMETER;
+
+	str = get_efi_variable_str8(&loader_guid, NETWORK_CONFIG_VAR);
+	if (!str)
+		return EFI_NOT_FOUND;
+
+	memset(cfg, 0, sizeof(*cfg));
+	p = parse_address(str, &cfg->address);
+	if (!p || *p++ != '/')
+		goto out;
+
+	for (; *p >= '0' && *p <= '9' && prefix <= 32; p++)
+		prefix = prefix * 10 + (*p - '0');
+	if (!prefix || prefix > 32)
+		goto out;
+	for (i = 0; i < prefix; i++)
+		cfg->mask.Addr[i / 8] |= 0x80 >> (i % 8);
+
+	if (*p == ',')
+		p = parse_address(p + 1, &cfg->gateway);
+	if (!p || *p)
+		goto out;
+
+	cfg->is_static = TRUE;
+	ret = EFI_SUCCESS;
+
+out:
+	if (EFI_ERROR(ret))
+		error(L"Invalid %s variable '%s'", NETWORK_CONFIG_VAR, str);
+	FreePool(str);
+	return ret;
+}
+
+EFI_STATUS ipcfg_get(struct ipcfg *cfg)
+{
+	struct lease *lease;
+	UINTN size;
+	UINT32 flags;
+	UINT64 now;
+	EFI_STATUS ret;
+
+	if (!cfg)
+		return EFI_INVALID_PARAMETER;
+
+	ret = get_static(cfg);
+	if (!EFI_ERROR(ret))
+		cfg->has_gateway = !is_any(&cfg->gateway);
+	if (ret != EFI_NOT_FOUND)
+		return ret;
+
+	if (!NET_LEASE_CACHE_SEC)
+		return EFI_NOT_FOUND;
+
+	ret = get_efi_variable(&loader_guid, NETWORK_LEASE_VAR, &size,
+			       (VOID **)&lease, &flags);
+	if (EFI_ERROR(ret))
+		return EFI_NOT_FOUND;
+
+	if (size != sizeof(*lease) || lease->version != LEASE_VERSION) {
+		FreePool(lease);
+		ipcfg_discard();
+		return EFI_NOT_FOUND;
+	}
+
+	cached = *lease;
+	FreePool(lease);
+
+	/* A clock moved backward invalidates the lease as well */
+	now = now_sec();
+	if (!now || now < cached.saved ||
+	    now - cached.saved >= NET_LEASE_CACHE_SEC) {
+		debug(L"Cached network configuration expired");
+		return EFI_NOT_FOUND;
+	}
+
+	memset(cfg, 0, sizeof(*cfg));
+	memcpy(&cfg->address, &cached.address, sizeof(cfg->address));
+	memcpy(&cfg->mask, &cached.mask, sizeof(cfg->mask));
+	memcpy(&cfg->gateway, &cached.gateway, sizeof(cfg->gateway));
+	cfg->has_gateway = !is_any(&cfg->gateway);
+	using_cache = TRUE;
+
+	return EFI_SUCCESS;
+}
+
+static void save(void)
+{
+	EFI_STATUS ret;
+
+	cached.version = LEASE_VERSION;
+	cached.saved = now_sec();
+	if (!cached.saved)
+		return;
+
+	ret = set_efi_variable(&loader_guid, NETWORK_LEASE_VAR,
+			       sizeof(cached), &cached, TRUE, FALSE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to cache the network configuration");
+}
+
+void ipcfg_save(EFI_IP4_MODE_DATA *mode)
+{
+	EFI_IP4_ROUTE_TABLE *route;
+	UINT32 i;
+
+	if (!NET_LEASE_CACHE_SEC || !mode)
+		return;
+
+	memset(&cached, 0, sizeof(cached));
+	memcpy(&cached.address, &mode->ConfigData.StationAddress,
+	       sizeof(cached.address));
+	memcpy(&cached.mask, &mode->ConfigData.SubnetMask,
+	       sizeof(cached.mask));
+
+	/* The default route holds the gateway */
+	for (i = 0; i < mode->RouteCount; i++) {
+		route = &mode->RouteTable[i];
+		if (is_any(&route->SubnetAddress) &&
+		    is_any(&route->SubnetMask)) {
+			memcpy(&cached.gateway, &route->GatewayAddress,
+			       sizeof(cached.gateway));
+			break;
+		}
+	}
+
+	save();
+}
+
+void ipcfg_validated(void)
+{
+	if (!using_cache)
+		return;
+
+	using_cache = FALSE;
+	save();
+}
+
+void ipcfg_discard(void)
+{
+	using_cache = FALSE;
+	del_efi_variable(&loader_guid, NETWORK_LEASE_VAR);
+}
@@ -37,6 +37,7 @@
 #include <smbios.h>
 
 #include "tcp.h"
+#include "ipcfg.h"
 
 /* TCP/IP structures  */
 static EFI_HANDLE tcp_handle;
@@ -50,21 +51,42 @@ static EFI_TCP4_LISTEN_TOKEN accept_token;
 static EFI_TCP4_CLOSE_TOKEN close_token;
 
 /* RX data structures  */
-#define MAX_TOKEN 16
-#define RX_FRAG_SIZE 2048  /* Fragment size greater or equal to TCP
-			      MSS  */
+#ifdef TCP_MAX_TOKEN
+#define MAX_TOKEN TCP_MAX_TOKEN
+#else
+#define MAX_TOKEN 64
+#endif
+
+/* The receive tokens point directly into the caller buffer.  The
+   TCP stack completes a receive token as soon as some data is
+   available so the fragment size should match the size of the TCP
+   segments the host sends to avoid partially filled tokens.  */
+#ifdef TCP_RX_FRAG_SIZE
+#define RX_FRAG_SIZE TCP_RX_FRAG_SIZE
+#else
+#define RX_FRAG_SIZE 1460
+#endif
+
 typedef struct token {
 	EFI_TCP4_IO_TOKEN token;
 	UINT32 requested;
+	UINT32 offset;
 } token_t;
 static token_t rx_token[MAX_TOKEN];
 static EFI_TCP4_RECEIVE_DATA rx_data[MAX_TOKEN];
-static CHAR8 rx_frag_buf[MAX_TOKEN][RX_FRAG_SIZE];
 
-/* TX data structures  */
+/* TX data structures.  A transmit token has up to TRANSPORT_MAX_IOV
+   fragments: a message header and its payload are sent as one
+   transmit, in the same TCP segments, without being copied.  */
+typedef struct tx_data {
+	EFI_TCP4_TRANSMIT_DATA data;
+	/* FragmentTable[1] to FragmentTable[TRANSPORT_MAX_IOV - 1] */
+	EFI_TCP4_FRAGMENT_DATA more[TRANSPORT_MAX_IOV - 1];
+} tx_data_t;
+
 static UINTN next_tx_token;
 static token_t tx_token[MAX_TOKEN];
-static EFI_TCP4_TRANSMIT_DATA tx_data[MAX_TOKEN];
+static tx_data_t tx_data[MAX_TOKEN];
 
 /* Events  */
 static BOOLEAN events_created;
@@ -79,29 +101,66 @@ static struct rx {
 	UINT32 size;
 	UINT32 requested;
 	UINT32 received;
+	UINT32 posted;		/* Offset of the next token buffer */
 	BOOLEAN receiving;
 } rx;
 
-static EFI_STATUS request_data(token_t *token, UINT32 max_size)
+static EFI_STATUS request_data(token_t *token)
 {
 	EFI_STATUS ret;
-	UINTN size = min(max_size, (UINT32)RX_FRAG_SIZE);
 	EFI_TCP4_RECEIVE_DATA *data = token->token.Packet.RxData;
+	UINT32 size;
+
+	size = min(rx.size - rx.received - rx.requested, rx.size - rx.posted);
+	size = min(size, (UINT32)RX_FRAG_SIZE);
 
 	data->DataLength = size;
 	data->FragmentTable[0].FragmentLength = size;
+	data->FragmentTable[0].FragmentBuffer = rx.buf + rx.posted;
 
+	token->offset = rx.posted;
 	token->requested = size;
 	rx.requested += size;
+	rx.posted += size;
 
 	ret = uefi_call_wrapper(tcp_connection->Receive, 2,
 				tcp_connection, &token->token);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"TCP Receive failed");
+		rx.requested -= size;
+		rx.posted -= size;
+		token->requested = 0;
+	}
 
 	return ret;
 }
 
+/* Post all the idle receive tokens, as long as there is room left in
+   the caller buffer.  Tokens are posted at the next unused offset,
+   even past the holes left by partially filled tokens: the space of
+   the holes is only reused once no token is in flight anymore, see
+   data_received().  */
+static EFI_STATUS request_all_data(void)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < MAX_TOKEN; i++) {
+		if (rx.received + rx.requested == rx.size ||
+		    rx.posted == rx.size)
+			break;
+
+		if (rx_token[i].requested)
+			continue;
+
+		ret = request_data(&rx_token[i]);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
 /* Event handlers */
 static void EFIAPI data_sent(__attribute__((__unused__)) EFI_EVENT evt,
 			     void *ctx)
@@ -116,8 +175,7 @@ static void EFIAPI data_sent(__attribute__((__unused__)) EFI_EVENT evt,
 	}
 
 	token->requested = 0;
-	tx_callback(data->FragmentTable[0].FragmentBuffer,
-		    data->FragmentTable[0].FragmentLength);
+	tx_callback(data->FragmentTable[0].FragmentBuffer, data->DataLength);
 }
 
 static void EFIAPI data_received(__attribute__((__unused__)) EFI_EVENT evt, void *ctx)
@@ -128,6 +186,7 @@ static void EFIAPI data_received(__attribute__((__unused__)) EFI_EVENT evt, void
 
 	if (token->token.CompletionToken.Status == EFI_CONNECTION_FIN) {
 		rx.receiving = FALSE;
+		token->requested = 0;
 
 		if (!events_created)
 			return;
@@ -142,20 +201,29 @@ static void EFIAPI data_received(__attribute__((__unused__)) EFI_EVENT evt, void
 
 	if (EFI_ERROR(token->token.CompletionToken.Status)) {
 		rx.receiving = FALSE;
+		token->requested = 0;
 		efi_perror(token->token.CompletionToken.Status,
 			   L"TCP data received failed");
 		return;
 	}
 
-	memcpy(rx.buf + rx.received,
-	       data->FragmentTable[0].FragmentBuffer,
-	       data->FragmentTable[0].FragmentLength);
+	/* Tokens complete in order.  A partially filled token leaves a
+	   hole before the data of the next ones: move their data back
+	   to keep the caller buffer contiguous.  */
+	if (token->offset != rx.received)
+		memmove(rx.buf + rx.received, rx.buf + token->offset,
+			data->DataLength);
 
-	rx.received += data->FragmentTable[0].FragmentLength;
+	rx.received += data->DataLength;
 	rx.requested -= token->requested;
+	token->requested = 0;
 
-	if (rx.requested < rx.size - rx.received)
-		request_data(token, rx.size - rx.received - rx.requested);
+	/* No more token in flight, the next ones can be put right after
+	   the received data again.  */
+	if (rx.requested == 0)
+		rx.posted = rx.received;
+
+	request_all_data();
 
 	if (rx.received == rx.size) {
 		rx.receiving = FALSE;
@@ -219,13 +287,13 @@ static void init_rx_tx_structures()
 	for (i = 0; i < MAX_TOKEN; i++) {
 		rx_data[i].UrgentFlag = FALSE;
 		rx_data[i].FragmentCount = 1;
-		rx_data[i].FragmentTable[0].FragmentBuffer = rx_frag_buf[i];
 		rx_token[i].token.Packet.RxData = &rx_data[i];
+		rx_token[i].requested = 0;
 
-		tx_data[i].Push = TRUE;
-		tx_data[i].Urgent = FALSE;
-		tx_data[i].FragmentCount = 1;
-		tx_token[i].token.Packet.TxData = &tx_data[i];
+		tx_data[i].data.Push = TRUE;
+		tx_data[i].data.Urgent = FALSE;
+		tx_data[i].data.FragmentCount = 1;
+		tx_token[i].token.Packet.TxData = &tx_data[i].data;
 	}
 }
 
@@ -333,6 +401,87 @@ void close_events()
 	events_created = FALSE;
 }
 
+/* The receive buffer size bounds the window advertised to the host.
+   Window scaling is required for windows larger than 64 KB.  Nagle's
+   algorithm would hold the small writes, fastboot responses and adb
+   packets, until the previous data is acknowledged.  Zero values
+   select the TCP stack defaults, but for the retransmissions count
+   which is set to the usual stack default.  */
+#define TCP_DATA_RETRIES	12
+
+static EFI_TCP4_OPTION tcp_option = {
+#ifdef TCP_WINDOW_SIZE
+	.ReceiveBufferSize = TCP_WINDOW_SIZE,
+	.SendBufferSize = TCP_WINDOW_SIZE,
+#endif
+	.DataRetries = TCP_DATA_RETRIES,
+	.EnableNagle = FALSE,
+	.EnableTimeStamp = TRUE,
+	.EnableWindowScaling = TRUE,
+	.EnableSelectiveAck = FALSE,
+	.EnablePathMtuDiscovery = FALSE
+};
+
+static EFI_STATUS configure(EFI_TCP4_CONFIG_DATA *tcp_config)
+{
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(tcp_listener->Configure, 2,
+				tcp_listener, tcp_config);
+	if (ret != EFI_UNSUPPORTED && ret != EFI_INVALID_PARAMETER)
+		return ret;
+	if (!tcp_config->ControlOption)
+		return ret;
+
+	debug(L"TCP options rejected, using the default ones");
+	tcp_config->ControlOption = NULL;
+	return uefi_call_wrapper(tcp_listener->Configure, 2,
+				 tcp_listener, tcp_config);
+}
+
+/* Use the static or cached configuration, see ipcfg.h, rather than
+   waiting for DHCP */
+static EFI_STATUS ip_configuration_cached(EFI_TCP4_CONFIG_DATA *tcp_config,
+					  EFI_IPv4_ADDRESS *address)
+{
+	EFI_IPv4_ADDRESS any = { {0, 0, 0, 0} };
+	struct ipcfg cfg;
+	EFI_STATUS ret;
+
+	ret = ipcfg_get(&cfg);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	tcp_config->AccessPoint.UseDefaultAddress = FALSE;
+	memcpy(&tcp_config->AccessPoint.StationAddress, &cfg.address,
+	       sizeof(cfg.address));
+	memcpy(&tcp_config->AccessPoint.SubnetMask, &cfg.mask,
+	       sizeof(cfg.mask));
+
+	ret = configure(tcp_config);
+	if (!EFI_ERROR(ret) && cfg.has_gateway)
+		ret = uefi_call_wrapper(tcp_listener->Routes, 5, tcp_listener,
+					FALSE, &any, &any, &cfg.gateway);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"%a IP configuration rejected",
+			   cfg.is_static ? "Static" : "Cached");
+		uefi_call_wrapper(tcp_listener->Configure, 2, tcp_listener,
+				  NULL);
+		if (!cfg.is_static)
+			ipcfg_discard();
+
+		tcp_config->AccessPoint.UseDefaultAddress = TRUE;
+		memset(&tcp_config->AccessPoint.StationAddress, 0,
+		       sizeof(cfg.address));
+		memset(&tcp_config->AccessPoint.SubnetMask, 0,
+		       sizeof(cfg.mask));
+		return ret;
+	}
+
+	memcpy(address, &cfg.address, sizeof(*address));
+	return EFI_SUCCESS;
+}
+
 static EFI_STATUS ip_configuration(UINT32 port, EFI_IPv4_ADDRESS *address)
 {
 	EFI_STATUS ret;
@@ -349,12 +498,15 @@ static EFI_STATUS ip_configuration(UINT32 port, EFI_IPv4_ADDRESS *address)
 			.RemotePort = 0, /* accept any */
 			.ActiveFlag = FALSE
 		},
-		.ControlOption = NULL
+		.ControlOption = &tcp_option
 	};
 	memset((UINT8 *)&ip_data, 0, sizeof(ip_data));
 
-	ret = uefi_call_wrapper(tcp_listener->Configure, 2,
-				tcp_listener, &tcp_config);
+	ret = ip_configuration_cached(&tcp_config, address);
+	if (!EFI_ERROR(ret))
+		return EFI_SUCCESS;
+
+	ret = configure(&tcp_config);
 	if (EFI_ERROR(ret) && ret != EFI_NO_MAPPING) {
 		efi_perror(ret, L"Failed to configure IP stack");
 		return ret;
@@ -370,8 +522,7 @@ static EFI_STATUS ip_configuration(UINT32 port, EFI_IPv4_ADDRESS *address)
 				return ret;
 			}
 		} while (!ip_data.IsConfigured);
-		ret = uefi_call_wrapper(tcp_listener->Configure, 2,
-					tcp_listener, &tcp_config);
+		ret = configure(&tcp_config);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Failed to configure IP stack");
 			return ret;
@@ -388,6 +539,7 @@ static EFI_STATUS ip_configuration(UINT32 port, EFI_IPv4_ADDRESS *address)
 	}
 
 	memcpy(address, &ip_data.ConfigData.StationAddress, sizeof(*address));
+	ipcfg_save(&ip_data);
 
 	return EFI_SUCCESS;
 }
@@ -474,11 +626,19 @@ err:
 	return ret;
 }
 
-EFI_STATUS tcp_write(void *buf, UINT32 size)
+EFI_STATUS tcp_writev(const transport_iov_t *iov, UINTN iovcnt)
 {
 	EFI_STATUS ret;
 	token_t *token;
 	EFI_TCP4_TRANSMIT_DATA *data;
+	EFI_TCP4_FRAGMENT_DATA *frag;
+	UINTN i;
+
+	if (!iovcnt || iovcnt > TRANSPORT_MAX_IOV)
+		return EFI_INVALID_PARAMETER;
+
+	if (!tcp_connection)
+		return EFI_NOT_STARTED;
 
 	if (tx_token[next_tx_token].requested != 0)
 		return EFI_NOT_READY;
@@ -486,40 +646,50 @@ EFI_STATUS tcp_write(void *buf, UINT32 size)
 	token = &tx_token[next_tx_token];
 	next_tx_token = (next_tx_token + 1) % MAX_TOKEN;
 	data = token->token.Packet.TxData;
+	frag = data->FragmentTable;
 
-	token->requested = size;
-	data->DataLength = size;
-	data->FragmentTable[0].FragmentLength = size;
-	data->FragmentTable[0].FragmentBuffer = buf;
+	token->requested = 0;
+	for (i = 0; i < iovcnt; i++) {
+		frag[i].FragmentLength = iov[i].len;
+		frag[i].FragmentBuffer = iov[i].buf;
+		token->requested += iov[i].len;
+	}
+	data->FragmentCount = iovcnt;
+	data->DataLength = token->requested;
 
 	ret = uefi_call_wrapper(tcp_connection->Transmit, 2,
 				tcp_connection, &token->token);
-	if (EFI_ERROR(ret))
+	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"TCP Transmit failed");
+		token->requested = 0;
+	}
 
 	return ret;
 }
 
+EFI_STATUS tcp_write(void *buf, UINT32 size)
+{
+	transport_iov_t iov = { .buf = buf, .len = size };
+
+	return tcp_writev(&iov, 1);
+}
+
 EFI_STATUS tcp_read(void *buf, UINT32 size)
 {
 	EFI_STATUS ret;
-	UINTN i;
 
 	if (rx.receiving)
 		return EFI_NOT_READY;
 
 	rx.buf = buf;
 	rx.size = size;
-	rx.received = rx.requested = 0;
+	rx.received = rx.requested = rx.posted = 0;
 	rx.receiving = TRUE;
 
-	for (i = 0; i < MAX_TOKEN && size; i++) {
-		ret = request_data(&rx_token[i], size);
-		if (EFI_ERROR(ret)) {
-			rx.receiving = FALSE;
-			return ret;
-		}
-		size -= rx_token[i].requested;
+	ret = request_all_data();
+	if (EFI_ERROR(ret) && rx.requested == 0) {
+		rx.receiving = FALSE;
+		return ret;
 	}
 
 	return EFI_SUCCESS;
@@ -607,6 +777,9 @@ EFI_STATUS tcp_run(void)
 	if (!tcp_connection)
 		return EFI_SUCCESS;
 
+	/* A host has connected, the cached configuration works */
+	ipcfg_validated();
+
 	return uefi_call_wrapper(tcp_connection->Poll, 1,
 				 tcp_connection);
 }
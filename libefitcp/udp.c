@@ -0,0 +1,460 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include <uefi_utils.h>
+#include <efiudp.h>
+
+#include "udp.h"
+#include "ipcfg.h"
+
+/* UDP/IP structures  */
+static EFI_HANDLE udp_handle;
+static EFI_GUID UDP_GUID = EFI_UDP4_PROTOCOL;
+static EFI_SERVICE_BINDING *udp_srv_binding;
+static EFI_UDP4 *udp;
+
+/* Several receive tokens are kept posted so that datagrams arriving
+   in a burst are not dropped while the previous ones are
+   processed.  */
+#define RX_TOKEN 16
+#define TX_TOKEN 16
+
+typedef struct tx_token {
+	EFI_UDP4_COMPLETION_TOKEN token;
+	EFI_UDP4_TRANSMIT_DATA data;
+	EFI_UDP4_SESSION_DATA session;
+	BOOLEAN busy;
+	CHAR8 buf[UDP_MAX_DATAGRAM_SIZE];
+} tx_token_t;
+
+static EFI_UDP4_COMPLETION_TOKEN rx_token[RX_TOKEN];
+static tx_token_t tx_token[TX_TOKEN];
+static UINTN next_tx_token;
+static BOOLEAN events_created;
+static BOOLEAN running;
+
+/* Re-assembled datagrams are made contiguous in this buffer.  */
+static CHAR8 rx_buf[UDP_MAX_DATAGRAM_SIZE];
+
+static udp_rx_callback_t rx_callback;
+
+static EFI_STATUS request_data(EFI_UDP4_COMPLETION_TOKEN *token)
+{
+	EFI_STATUS ret;
+
+	token->Packet.RxData = NULL;
+	ret = uefi_call_wrapper(udp->Receive, 2, udp, token);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"UDP Receive failed");
+
+	return ret;
+}
+
+/* Event handlers  */
+static void EFIAPI data_received(__attribute__((__unused__)) EFI_EVENT evt,
+				 void *ctx)
+{
+	EFI_UDP4_COMPLETION_TOKEN *token = (EFI_UDP4_COMPLETION_TOKEN *)ctx;
+	EFI_UDP4_RECEIVE_DATA *data = token->Packet.RxData;
+	CHAR8 *buf;
+	UINT32 i, len;
+
+	if (EFI_ERROR(token->Status)) {
+		if (token->Status != EFI_ABORTED)
+			efi_perror(token->Status, L"UDP data received failed");
+		goto out;
+	}
+
+	if (data->DataLength > sizeof(rx_buf)) {
+		error(L"Dropping a %d bytes UDP datagram", data->DataLength);
+		buf = NULL;
+	} else if (data->FragmentCount == 1) {
+		buf = data->FragmentTable[0].FragmentBuffer;
+	} else {
+		buf = rx_buf;
+		for (i = 0, len = 0; i < data->FragmentCount; i++) {
+			memcpy(rx_buf + len, data->FragmentTable[i].FragmentBuffer,
+			       data->FragmentTable[i].FragmentLength);
+			len += data->FragmentTable[i].FragmentLength;
+		}
+	}
+
+	if (buf)
+		rx_callback(&data->UdpSession, buf, data->DataLength);
+
+out:
+	if (data)
+		uefi_call_wrapper(BS->SignalEvent, 1, data->RecycleSignal);
+
+	if (running)
+		request_data(token);
+}
+
+static void EFIAPI data_sent(__attribute__((__unused__)) EFI_EVENT evt,
+			     void *ctx)
+{
+	tx_token_t *token = (tx_token_t *)ctx;
+
+	if (EFI_ERROR(token->token.Status))
+		efi_perror(token->token.Status, L"UDP send failed");
+
+	token->busy = FALSE;
+}
+
+static EFI_STATUS create_events(void)
+{
+	EFI_STATUS ret;
+	UINTN i = 0, j = 0, k;
+
+	for (i = 0; i < TX_TOKEN; i++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5,
+					EVT_NOTIFY_SIGNAL,
+					TPL_CALLBACK,
+					data_sent,
+					&tx_token[i],
+					&tx_token[i].token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create UDP Transmit event");
+			goto err;
+		}
+	}
+
+	for (j = 0; j < RX_TOKEN; j++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5,
+					EVT_NOTIFY_SIGNAL,
+					TPL_CALLBACK,
+					data_received,
+					&rx_token[j],
+					&rx_token[j].Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create UDP Receive event");
+			goto err;
+		}
+	}
+
+	events_created = TRUE;
+	return EFI_SUCCESS;
+
+err:
+	for (k = 0; k < i; k++)
+		uefi_call_wrapper(BS->CloseEvent, 1, tx_token[k].token.Event);
+	for (k = 0; k < j; k++)
+		uefi_call_wrapper(BS->CloseEvent, 1, rx_token[k].Event);
+	return ret;
+}
+
+static void close_events(void)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	events_created = FALSE;
+
+	for (i = 0; i < TX_TOKEN; i++) {
+		ret = uefi_call_wrapper(BS->CloseEvent, 1,
+					tx_token[i].token.Event);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to close UDP Transmit %d event", i);
+	}
+
+	for (i = 0; i < RX_TOKEN; i++) {
+		ret = uefi_call_wrapper(BS->CloseEvent, 1, rx_token[i].Event);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to close UDP Receive %d event", i);
+	}
+}
+
+/* Use the static or cached configuration, see ipcfg.h, rather than
+   waiting for DHCP */
+static EFI_STATUS ip_configuration_cached(EFI_UDP4_CONFIG_DATA *udp_config,
+					  EFI_IPv4_ADDRESS *address)
+{
+	EFI_IPv4_ADDRESS any = { {0, 0, 0, 0} };
+	struct ipcfg cfg;
+	EFI_STATUS ret;
+
+	ret = ipcfg_get(&cfg);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	udp_config->UseDefaultAddress = FALSE;
+	memcpy(&udp_config->StationAddress, &cfg.address, sizeof(cfg.address));
+	memcpy(&udp_config->SubnetMask, &cfg.mask, sizeof(cfg.mask));
+
+	ret = uefi_call_wrapper(udp->Configure, 2, udp, udp_config);
+	if (!EFI_ERROR(ret) && cfg.has_gateway)
+		ret = uefi_call_wrapper(udp->Routes, 5, udp, FALSE, &any, &any,
+					&cfg.gateway);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"%a IP configuration rejected",
+			   cfg.is_static ? "Static" : "Cached");
+		uefi_call_wrapper(udp->Configure, 2, udp, NULL);
+		if (!cfg.is_static)
+			ipcfg_discard();
+
+		udp_config->UseDefaultAddress = TRUE;
+		memset(&udp_config->StationAddress, 0, sizeof(cfg.address));
+		memset(&udp_config->SubnetMask, 0, sizeof(cfg.mask));
+		return ret;
+	}
+
+	memcpy(address, &cfg.address, sizeof(*address));
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ip_configuration(UINT32 port, EFI_IPv4_ADDRESS *address)
+{
+	EFI_STATUS ret;
+	EFI_IP4_MODE_DATA ip_data;
+	EFI_UDP4_CONFIG_DATA udp_config = {
+		.AcceptBroadcast = FALSE,
+		.AcceptPromiscuous = FALSE,
+		.AcceptAnyPort = FALSE,
+		.AllowDuplicatePort = FALSE,
+		.TypeOfService = 0x00,
+		.TimeToLive = 255,
+		.DoNotFragment = FALSE,
+		.ReceiveTimeout = 0,
+		.TransmitTimeout = 0,
+		.UseDefaultAddress = TRUE,
+		.StationAddress = { {0, 0, 0, 0} }, /* ignored - use default */
+		.SubnetMask = { {0, 0, 0, 0} },	    /* ignored - use default */
+		.StationPort = port,
+		.RemoteAddress = { {0, 0, 0, 0} }, /* accept any */
+		.RemotePort = 0 /* accept any */
+	};
+	memset((UINT8 *)&ip_data, 0, sizeof(ip_data));
+
+	ret = ip_configuration_cached(&udp_config, address);
+	if (!EFI_ERROR(ret))
+		return EFI_SUCCESS;
+
+	ret = uefi_call_wrapper(udp->Configure, 2, udp, &udp_config);
+	if (EFI_ERROR(ret) && ret != EFI_NO_MAPPING) {
+		efi_perror(ret, L"Failed to configure IP stack");
+		return ret;
+	}
+
+	/* DHCP still ongoing. */
+	if (ret == EFI_NO_MAPPING) {
+		do {
+			ret = uefi_call_wrapper(udp->GetModeData, 5,
+						udp, NULL, &ip_data, NULL, NULL);
+			if (EFI_ERROR(ret)) {
+				efi_perror(ret, L"Failed to get IP mode data");
+				return ret;
+			}
+		} while (!ip_data.IsConfigured);
+		ret = uefi_call_wrapper(udp->Configure, 2, udp, &udp_config);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to configure IP stack");
+			return ret;
+		}
+	}
+
+	if (!ip_data.IsConfigured) {
+		ret = uefi_call_wrapper(udp->GetModeData, 5,
+					udp, NULL, &ip_data, NULL, NULL);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to get IP mode data");
+			return ret;
+		}
+	}
+
+	memcpy(address, &ip_data.ConfigData.StationAddress, sizeof(*address));
+	ipcfg_save(&ip_data);
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS udp_start(UINT32 port, udp_rx_callback_t rx_cb,
+		     EFI_IPv4_ADDRESS *station_address)
+{
+	EFI_GUID udp_srv_binding_guid = EFI_UDP4_SERVICE_BINDING_PROTOCOL;
+	EFI_HANDLE *handles;
+	UINTN nb_handle = 0;
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (!rx_cb || !station_address)
+		return EFI_INVALID_PARAMETER;
+
+	rx_callback = rx_cb;
+
+	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol,
+				&udp_srv_binding_guid, NULL, &nb_handle, &handles);
+	if (EFI_ERROR(ret)) {
+		debug(L"Failed to locate UDP service binding protocol");
+		return EFI_UNSUPPORTED;
+	}
+
+	/* Use the first network device. */
+	ret = uefi_call_wrapper(BS->OpenProtocol, 6,
+				handles[0],
+				&udp_srv_binding_guid,
+				(VOID **)&udp_srv_binding,
+				g_parent_image,
+				NULL,
+				EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	FreePool(handles);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open UDP service binding protocol");
+		return ret;
+	}
+
+	ret = uefi_call_wrapper(udp_srv_binding->CreateChild, 2,
+				udp_srv_binding, &udp_handle);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create UDP child");
+		udp_srv_binding = NULL;
+		return ret;
+	}
+
+	ret = uefi_call_wrapper(BS->OpenProtocol, 6,
+				udp_handle,
+				&UDP_GUID,
+				(VOID **)&udp,
+				g_parent_image,
+				NULL,
+				EFI_OPEN_PROTOCOL_GET_PROTOCOL);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open UDP protocol");
+		goto err;
+	}
+
+	for (i = 0; i < TX_TOKEN; i++) {
+		tx_token[i].busy = FALSE;
+		tx_token[i].data.UdpSessionData = &tx_token[i].session;
+		tx_token[i].data.GatewayAddress = NULL;
+		tx_token[i].data.FragmentCount = 1;
+		tx_token[i].data.FragmentTable[0].FragmentBuffer = tx_token[i].buf;
+		tx_token[i].token.Packet.TxData = &tx_token[i].data;
+	}
+	next_tx_token = 0;
+
+	ret = create_events();
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = ip_configuration(port, station_address);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"IP configuration failed");
+		goto err;
+	}
+
+	running = TRUE;
+	for (i = 0; i < RX_TOKEN; i++) {
+		ret = request_data(&rx_token[i]);
+		if (EFI_ERROR(ret))
+			goto err;
+	}
+
+	return EFI_SUCCESS;
+
+err:
+	udp_stop();
+	return ret;
+}
+
+EFI_STATUS udp_send(EFI_UDP4_SESSION_DATA *session, void *buf, UINT32 size)
+{
+	EFI_STATUS ret;
+	tx_token_t *token;
+
+	if (!udp)
+		return EFI_NOT_STARTED;
+
+	if (size > sizeof(token->buf))
+		return EFI_BAD_BUFFER_SIZE;
+
+	token = &tx_token[next_tx_token];
+	if (token->busy)
+		return EFI_NOT_READY;
+	next_tx_token = (next_tx_token + 1) % TX_TOKEN;
+
+	memset(&token->session, 0, sizeof(token->session));
+	memcpy(&token->session.DestinationAddress, &session->SourceAddress,
+	       sizeof(token->session.DestinationAddress));
+	token->session.DestinationPort = session->SourcePort;
+
+	memcpy(token->buf, buf, size);
+	token->data.DataLength = size;
+	token->data.FragmentTable[0].FragmentLength = size;
+
+	token->busy = TRUE;
+	ret = uefi_call_wrapper(udp->Transmit, 2, udp, &token->token);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"UDP Transmit failed");
+		token->busy = FALSE;
+	}
+
+	return ret;
+}
+
+EFI_STATUS udp_stop(void)
+{
+	EFI_STATUS ret;
+
+	running = FALSE;
+
+	if (udp) {
+		/* Abort the pending tokens while their events still
+		   exist.  */
+		ret = uefi_call_wrapper(udp->Configure, 2, udp, NULL);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"UDP Configure failed");
+	}
+
+	if (events_created)
+		close_events();
+
+	udp = NULL;
+
+	if (udp_srv_binding) {
+		ret = uefi_call_wrapper(udp_srv_binding->DestroyChild, 2,
+					udp_srv_binding, udp_handle);
+		if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED) {
+			efi_perror(ret, L"UDP service DestroyChild failed");
+			return ret;
+		}
+		udp_srv_binding = NULL;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS udp_run(void)
+{
+	if (!udp)
+		return EFI_SUCCESS;
+
+	return uefi_call_wrapper(udp->Poll, 1, udp);
+}
@@ -14,6 +14,10 @@ LOCAL_C_INCLUDES := $(LOCAL_PATH)/../include/libefiusb
 LOCAL_SRC_FILES := \
 	usb.c
 
+ifeq ($(KERNELFLINGER_USB_SUPER_SPEED),true)
+LOCAL_CFLAGS += -DSUPPORT_SUPER_SPEED
+endif
+
 ifeq ($(KERNELFLINGER_SUPPORT_SELF_USB_DEVICE_MODE_PROTOCOL),true)
 LOCAL_CFLAGS += -DUSE_SELF_USB_DEVICE_MODE_PROTOCOL
 LOCAL_SRC_FILES += \
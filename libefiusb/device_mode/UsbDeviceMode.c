@@ -78,43 +78,39 @@ XhciSwitchSwid(BOOLEAN enable)
   DEBUG ((DEBUG_INFO, "DualRoleCfg1 : 0x%x \n", DualRoleCfg1));
 }
 
+//
+// Maximum number of event batches processed by one poll
+//
+#define XDCI_MAX_EVENT_BATCHES  5
+
 VOID
 EFIAPI
 UsbdMonitorEvents (
   IN EFI_EVENT __attribute__((unused))Event,
-  IN VOID                 *Context
+  IN VOID                 __attribute__((unused))*Context
   )
 {
-  USB_XDCI_DEV_CONTEXT    *XdciDevContext;
-  UINT32                  EventCount;
-  UINT32                  PreEventCount;
-  UINT32                  LoopCount;
-
-  XdciDevContext = (USB_XDCI_DEV_CONTEXT *) Context;
-  EventCount = UsbRegRead ((UINT32)XdciDevContext->XdciMmioBarAddr, DWC_XDCI_EVNTCOUNT_REG (0));
-  if (EventCount == 0) {
-    return;
-  }
+  EFI_STATUS              Status;
+  UINT32                  Batch;
 
-  LoopCount = 0;
-  PreEventCount = EventCount;
-  while (EventCount != 0) {
-    if (UsbDeviceIsrRoutineTimerBased (mDrvObj.XdciDrvObj) != EFI_SUCCESS) {
-      DEBUG ((DEBUG_INFO, "UsbDeviceRun() - Failed to execute event ISR\n"));
+  //
+  // Each ISR call reads the event count once, processes all the pending
+  // events and acknowledges them with one write.  The events posted while
+  // a batch is processed are handled by the next batch, up to a bound so
+  // that a continuous event stream does not hold the timer notification.
+  //
+  for (Batch = 0; Batch < XDCI_MAX_EVENT_BATCHES; Batch++) {
+    Status = UsbDeviceIsrRoutineTimerBased (mDrvObj.XdciDrvObj);
+    if (Status == EFI_NOT_READY) {
+      return;
     }
-    EventCount = UsbRegRead ((UINT32)XdciDevContext->XdciMmioBarAddr, DWC_XDCI_EVNTCOUNT_REG (0));
-    if (PreEventCount == EventCount) {
-      LoopCount++;
-      if (LoopCount >= 5) {
-        DEBUG ((DEBUG_INFO, "USB is working on a long event...\n"));
-        break;
-      }
-    } else {
-      LoopCount = 0;
+    if (EFI_ERROR (Status)) {
+      DEBUG ((DEBUG_INFO, "UsbDeviceRun() - Failed to execute event ISR\n"));
+      return;
     }
   }
 
-  return;
+  DEBUG ((DEBUG_INFO, "USB is working on a long event...\n"));
 }
 
 /**
@@ -154,6 +150,77 @@ UsbdInit (
 }
 
 
+#ifdef SUPPORT_SUPER_SPEED
+/**
+  Tells whether the link was established in SuperSpeed. The class
+  driver describes its SuperSpeed configuration: on a slower link,
+  the endpoint companion descriptors are dropped and the bulk packets
+  are limited to the High Speed size.
+
+  @return TRUE on a SuperSpeed link, FALSE otherwise
+
+**/
+BOOLEAN
+UsbdIsSuperSpeed (
+  VOID
+  )
+{
+  USB_SPEED    Speed;
+
+  if (EFI_ERROR (UsbDeviceGetSpeed (mDrvObj.XdciDrvObj, &Speed))) {
+    return FALSE;
+  }
+
+  return Speed == USB_SPEED_SUPER;
+}
+
+
+/**
+  Copies the configuration descriptors of a SuperSpeed configuration
+  for a High Speed link: the endpoint companion descriptors are
+  skipped and the bulk endpoints max packet size is limited to 512
+  bytes.
+
+  @param Buffer    Pointer to destination Buffer
+  @param Config    The SuperSpeed configuration descriptors
+  @param Length    The byte count of the configuration descriptors
+
+  @return the byte count of data copied to the output Buffer
+
+**/
+UINT32
+UsbdCopyHsConfigDesc (
+  OUT UINT8    *Buffer,
+  IN  UINT8    *Config,
+  IN  UINT32   Length
+  )
+{
+  EFI_USB_ENDPOINT_DESCRIPTOR    *EpDesc;
+  UINT32                         Offset;
+  UINT32                         Copied = 0;
+
+  for (Offset = 0; Offset + 2 <= Length && Config[Offset] != 0; Offset += Config[Offset]) {
+    if (Config[Offset + 1] == USB_DESC_TYPE_SS_ENDPOINT_COMPANION) {
+      continue;
+    }
+
+    CopyMem (Buffer + Copied, Config + Offset, Config[Offset]);
+    if (Config[Offset + 1] == USB_DESC_TYPE_ENDPOINT) {
+      EpDesc = (EFI_USB_ENDPOINT_DESCRIPTOR *)(Buffer + Copied);
+      if ((EpDesc->Attributes & USB_ENDPOINT_TYPE_MASK) == USB_ENDPOINT_BULK) {
+        EpDesc->MaxPacketSize = MIN (EpDesc->MaxPacketSize, USB_BULK_EP_PKT_SIZE_HS);
+      }
+    }
+    Copied += Config[Offset];
+  }
+
+  ((EFI_USB_CONFIG_DESCRIPTOR *)Buffer)->TotalLength = (UINT16)Copied;
+
+  return Copied;
+}
+#endif
+
+
 /**
   Copies relevant endpoint data from standard USB endpoint descriptors
   to the usbEpInfo structure used by the XDCI
@@ -193,6 +260,15 @@ UsbdSetEpInfo (
     EpDest->Mult = EpCompDesc->BytesPerInterval;
   }
 
+#ifdef SUPPORT_SUPER_SPEED
+  if (EpDesc != NULL && EpDest->EpType == USB_ENDPOINT_BULK && !UsbdIsSuperSpeed ()) {
+    EpDest->MaxPktSize = MIN (EpDest->MaxPktSize, USB_BULK_EP_PKT_SIZE_HS);
+    EpDest->MaxStreams = 0;
+    EpDest->BurstSize = 0;
+    EpDest->Mult = 0;
+  }
+#endif
+
   return;
 }
 
@@ -575,8 +651,20 @@ UsbdGetConfigDesc (
     //
     // copy the data to the output Buffer
     //
-    Length = MIN (ReqLen, ConfigLen);
-    CopyMem (Buffer, Descriptor, Length);
+#ifdef SUPPORT_SUPER_SPEED
+    if (!UsbdIsSuperSpeed () && ConfigLen <= USB_EPO_MAX_PKT_SIZE_ALL) {
+      UINT8    HsConfig[USB_EPO_MAX_PKT_SIZE_ALL];
+
+      ConfigLen = UsbdCopyHsConfigDesc (HsConfig, Descriptor, ConfigLen);
+      Descriptor = HsConfig;
+      Length = MIN (ReqLen, ConfigLen);
+      CopyMem (Buffer, Descriptor, Length);
+    } else
+#endif
+    {
+      Length = MIN (ReqLen, ConfigLen);
+      CopyMem (Buffer, Descriptor, Length);
+    }
     *DataLen = Length;
     Status = EFI_SUCCESS;
   } else {
@@ -1001,6 +1089,20 @@ UsbdSetupHdlr (
               //
               mCtrlIoReq.IoInfo.Length = MIN (CtrlRequest->Length, DevDesc->Length);
               CopyMem (mCtrlIoReq.IoInfo.Buffer, DevDesc, mCtrlIoReq.IoInfo.Length);
+#ifdef SUPPORT_SUPER_SPEED
+              //
+              // A USB 2.1 device on a High Speed link, with 64 bytes
+              // control packets, still offers its BOS descriptor
+              //
+              if (DevDesc->BcdUSB >= USB_BCD_VERSION_SS && !UsbdIsSuperSpeed ()) {
+                USB_DEVICE_DESCRIPTOR    HsDevDesc;
+
+                CopyMem (&HsDevDesc, DevDesc, sizeof (HsDevDesc));
+                HsDevDesc.BcdUSB = USB_BCD_VERSION_HS_BOS;
+                HsDevDesc.MaxPacketSize0 = USB_EP0_MAX_PKT_SIZE_HS;
+                CopyMem (mCtrlIoReq.IoInfo.Buffer, &HsDevDesc, mCtrlIoReq.IoInfo.Length);
+              }
+#endif
               PrintDeviceDescriptor (DevDesc);
               break;
 
@@ -457,7 +457,7 @@ DwcXdciCorePrepareOneTrb (
   DEBUG ((DEBUG_INFO, "Trb is 0x%x, BufferPtr is 0x%x, size is 0x%x\n", Trb, BufferPtr, size));
 
   Trb->BuffPtrLow = (UINT32)(UINTN)BufferPtr;
-  Trb->BuffPtrHigh = 0;
+  Trb->BuffPtrHigh = (UINT32)((UINT64)(UINTN)BufferPtr >> 32);
   Trb->LenXferParams = size;
   Trb->TrbCtrl = TrbCtrl << DWC_XDCI_TRB_CTRL_TYPE_BIT_POS;
 
@@ -686,6 +686,7 @@ DwcXdciEndXfer (
   }
 
   CoreHandle->EpHandles[EpNum].CheckFlag = FALSE;
+  CoreHandle->EpHandles[EpNum].Segmented = FALSE;
 
   //
   // Issue a DEPENDXFER for EP
@@ -1188,6 +1189,210 @@ DwcXdciProcessEp0XferPhaseDone (
 }
 
 
+/**
+  Internal utility function:
+  This function is used to queue the next segments of a segmented
+  transfer on the free TRBs of the endpoint ring
+  @EpHandle: Endpoint handle address
+
+  Returns the number of TRBs queued.
+
+**/
+STATIC
+UINT32
+DwcXdciSegQueue (
+  IN DWC_XDCI_ENDPOINT    *EpHandle
+  )
+{
+  DWC_XDCI_TRB    *Trb;
+  UINT32          Len;
+  UINT32          Queued = 0;
+
+  while (EpHandle->SegLeft && EpHandle->SegInFlight < DWC_XDCI_SEG_TRB_NUM) {
+    Len = EpHandle->SegLeft < DWC_XDCI_SEG_SIZE ? EpHandle->SegLeft : DWC_XDCI_SEG_SIZE;
+    EpHandle->SegLeft -= Len;
+
+    //
+    // The controller may be walking the ring: hand the TRB over, with
+    // the HWO bit, only once it is completely set up.
+    //
+    Trb = EpHandle->Trb + EpHandle->SegEnqueue;
+    Trb->BuffPtrLow = (UINT32)(UINTN)EpHandle->SegBuffer;
+    Trb->BuffPtrHigh = (UINT32)((UINT64)(UINTN)EpHandle->SegBuffer >> 32);
+    Trb->LenXferParams = Len;
+    __asm__ __volatile__ ("" ::: "memory");
+    *(volatile UINT32 *)&Trb->TrbCtrl = (TRBCTL_NORMAL << DWC_XDCI_TRB_CTRL_TYPE_BIT_POS) |
+                                        (EpHandle->SegLeft ? 0 : DWC_XDCI_TRB_CTRL_LST_TRB_MASK) |
+                                        DWC_XDCI_TRB_CTRL_IOSP_MISOCH_MASK |
+                                        DWC_XDCI_TRB_CTRL_IOC_MASK |
+                                        DWC_XDCI_TRB_CTRL_HWO_MASK;
+
+    EpHandle->SegBuffer += Len;
+    EpHandle->SegEnqueue = (EpHandle->SegEnqueue + 1) % DWC_XDCI_SEG_TRB_NUM;
+    EpHandle->SegInFlight++;
+    Queued++;
+  }
+
+  return Queued;
+}
+
+
+/**
+  Internal function:
+  This function is used to start a segmented transfer. The transfer
+  is split in DWC_XDCI_SEG_SIZE segments, each one described by its
+  own TRB, and up to DWC_XDCI_SEG_TRB_NUM segments are owned by the
+  controller at any time so that it keeps receiving while completed
+  segments are reported and their TRB re-used for the next ones.
+  @CoreHandle: xDCI controller handle address
+  @EpNum: Physical endpoint number
+
+**/
+STATIC
+EFI_STATUS
+DwcXdciStartSegXfer (
+  IN XDCI_CORE_HANDLE    *CoreHandle,
+  IN UINT32              EpNum
+  )
+{
+  DWC_XDCI_ENDPOINT             *epHandle;
+  DWC_XDCI_ENDPOINT_CMD_PARAMS  EpCmdParams;
+  DWC_XDCI_TRB                  *Link;
+  EFI_STATUS                    Status;
+
+  epHandle = &CoreHandle->EpHandles[EpNum];
+
+  epHandle->Segmented = TRUE;
+  epHandle->SegBuffer = epHandle->XferHandle.XferBuffer;
+  epHandle->SegLeft = epHandle->XferHandle.XferLen;
+  epHandle->SegNext = epHandle->XferHandle.XferBuffer;
+  epHandle->SegPending = epHandle->XferHandle.XferLen;
+  epHandle->SegEnqueue = epHandle->SegDequeue = epHandle->SegInFlight = 0;
+
+  //
+  // Close the ring with a link TRB pointing back to the first one
+  //
+  Link = epHandle->Trb + DWC_XDCI_SEG_TRB_NUM;
+  Link->BuffPtrLow = (UINT32)(UINTN)epHandle->Trb;
+  Link->BuffPtrHigh = (UINT32)((UINT64)(UINTN)epHandle->Trb >> 32);
+  Link->LenXferParams = 0;
+  Link->TrbCtrl = (TRBCTL_LINK << DWC_XDCI_TRB_CTRL_TYPE_BIT_POS) | DWC_XDCI_TRB_CTRL_HWO_MASK;
+
+  DwcXdciSegQueue (epHandle);
+
+  EpCmdParams.Param2 = 0;
+  EpCmdParams.Param0 = (UINT32)((UINT64)(UINTN)epHandle->Trb >> 32);
+  EpCmdParams.Param1 = (UINT32)(UINTN)epHandle->Trb;
+
+  Status = DwcXdciCoreIssueEpCmd (
+             CoreHandle,
+             EpNum,
+             EPCMD_START_XFER,
+             &EpCmdParams
+             );
+  if (Status) {
+    DEBUG ((DEBUG_INFO, "DwcXdciStartSegXfer: Failed to start transfer\n"));
+    epHandle->Segmented = FALSE;
+    return Status;
+  }
+
+  epHandle->CurrentXferRscIdx = ((UsbRegRead(CoreHandle->BaseAddress, DWC_XDCI_EPCMD_REG(EpNum)) & DWC_XDCI_EPCMD_RES_IDX_MASK) >> DWC_XDCI_EPCMD_RES_IDX_BIT_POS);
+
+  return EFI_SUCCESS;
+}
+
+
+/**
+  Internal function:
+  This function is used to process the completed segments of a
+  segmented transfer. It is called on both transfer in progress and
+  transfer complete events: the request completion callback is
+  invoked once per segment with the segment buffer and length. The
+  transfer is over once all the segments have completed or on a
+  short packet.
+  @CoreHandle: xDCI controller handle address
+  @EpNum: Physical endpoint number
+  @XferCmplt: TRUE on transfer complete event. The last segment is
+  only reported on that event so that it is not processed twice.
+
+**/
+STATIC
+EFI_STATUS
+DwcXdciProcessEpSegments (
+  IN XDCI_CORE_HANDLE    *CoreHandle,
+  IN UINT32              EpNum,
+  IN BOOLEAN             XferCmplt
+  )
+{
+  DWC_XDCI_ENDPOINT             *epHandle;
+  DWC_XDCI_ENDPOINT_CMD_PARAMS  EpCmdParams;
+  DWC_XDCI_TRB                  *Trb;
+  USB_XFER_REQUEST              XferReq;
+  UINT32                        SegLen;
+  UINT32                        remainingLen;
+
+  epHandle = &CoreHandle->EpHandles[EpNum];
+
+  while (epHandle->Segmented && epHandle->SegInFlight) {
+    Trb = epHandle->Trb + epHandle->SegDequeue;
+    if (Trb->TrbCtrl & DWC_XDCI_TRB_CTRL_HWO_MASK) {
+      break;
+    }
+
+    SegLen = epHandle->SegPending < DWC_XDCI_SEG_SIZE ? epHandle->SegPending : DWC_XDCI_SEG_SIZE;
+    if (SegLen == epHandle->SegPending && !XferCmplt) {
+      break;
+    }
+
+    remainingLen = (Trb->LenXferParams & DWC_XDCI_TRB_BUFF_SIZE_MASK);
+    if (remainingLen > SegLen) {
+      DEBUG ((DEBUG_INFO, "ERROR: DwcXdciProcessEpSegments: Possible Buffer overrun\n"));
+      remainingLen = 0;
+    }
+
+    CopyMem (&XferReq, &epHandle->XferHandle, sizeof (USB_XFER_REQUEST));
+    XferReq.XferBuffer = epHandle->SegNext;
+    XferReq.XferLen = SegLen;
+    XferReq.ActualXferLen = SegLen - remainingLen;
+
+    epHandle->SegNext += SegLen;
+    epHandle->SegPending -= SegLen;
+    epHandle->SegDequeue = (epHandle->SegDequeue + 1) % DWC_XDCI_SEG_TRB_NUM;
+    epHandle->SegInFlight--;
+
+    if (epHandle->SegPending == 0 || remainingLen) {
+      //
+      // Last segment or short packet: the transfer is done. On a
+      // short packet, the controller still owns the next TRBs.
+      //
+      if (epHandle->SegLeft || epHandle->SegInFlight) {
+        DwcXdciEndXfer (CoreHandle, EpNum);
+      }
+      epHandle->Segmented = FALSE;
+      epHandle->CurrentXferRscIdx = 0;
+      epHandle->CheckFlag = FALSE;
+    } else if (DwcXdciSegQueue (epHandle)) {
+      //
+      // Hand the re-filled TRBs to the controller
+      //
+      EpCmdParams.Param0 = EpCmdParams.Param1 = EpCmdParams.Param2 = 0;
+      DwcXdciCoreIssueEpCmd (
+        CoreHandle,
+        EpNum,
+        DWC_XDCI_EPCMD_UPDATE_XFER | (epHandle->CurrentXferRscIdx << DWC_XDCI_EPCMD_RES_IDX_BIT_POS),
+        &EpCmdParams
+        );
+    }
+
+    if (XferReq.XferDone) {
+      XferReq.XferDone (CoreHandle->ParentHandle, &XferReq);
+    }
+  }
+
+  return EFI_SUCCESS;
+}
+
+
 /**
   Internal function:
   This function is used to process transfer done for
@@ -1218,6 +1423,10 @@ DwcXdciProcessEpXferDone (
   }
 
   epHandle = &CoreHandle->EpHandles[EpNum];
+  if (epHandle->Segmented) {
+    return DwcXdciProcessEpSegments (CoreHandle, EpNum, TRUE);
+  }
+
   epHandle->CurrentXferRscIdx = 0;
   Trb = epHandle->Trb;
   XferReq = &epHandle->XferHandle;
@@ -1325,6 +1534,9 @@ DwcXdciProcessEpEvent (
 
     case DWC_XDCI_EVENT_BUFF_EP_XFER_IN_PROGRESS:
       DEBUG ((DEBUG_INFO, "IN_PROGRESS\n"));
+      if (EpNum > 1 && CoreHandle->EpHandles[EpNum].Segmented) {
+        DwcXdciProcessEpSegments (CoreHandle, EpNum, FALSE);
+      }
       break;
 
     case DWC_XDCI_EVENT_BUFF_EP_XFER_NOT_READY:
@@ -2153,7 +2365,10 @@ DwcXdciCoreIsrRoutine (
 
 /**
   Interface:
-  This function is used as an interrupt service routine and it processes only one event at a time.
+  This function is used as an interrupt service routine from the poll timer.
+  It processes all the events pending in the first event buffer as one
+  batch: the event count is read once and the processed events are
+  acknowledged with a single write.
   @CoreHandle: xDCI controller handle
 
 **/
@@ -2167,8 +2382,6 @@ DwcXdciCoreIsrRoutineTimerBased (
   UINT32              BaseAddr;
   UINT32              eventCount;
   UINT32              ProcessedEventCount;
-  UINT32              currentEventAddr;
-  UINT32              ProcessedEventSize = 0;
 
   if (CoreHandle == NULL) {
     DEBUG ((DEBUG_INFO, "DwcXdciCoreIsrRoutineTimerBased: INVALID handle\n"));
@@ -2182,44 +2395,22 @@ DwcXdciCoreIsrRoutineTimerBased (
 
   BaseAddr = LocalCoreHandle->BaseAddress;
 
-  eventCount = UsbRegRead (BaseAddr, DWC_XDCI_EVNTCOUNT_REG (0)) & DWC_XDCI_EVNTCOUNT_MASK;
-
   if (LocalCoreHandle->InterrupProcessing == TRUE) {
     DEBUG ((DEBUG_INFO, "interrupProcessing.........\n"));
     return EFI_SUCCESS;
   }
 
+  eventCount = UsbRegRead (BaseAddr, DWC_XDCI_EVNTCOUNT_REG (0)) & DWC_XDCI_EVNTCOUNT_MASK;
+  if (eventCount == 0) {
+    return EFI_NOT_READY;
+  }
+
   LocalCoreHandle->InterrupProcessing = TRUE;
 
   ProcessedEventCount = 0;
-  currentEventAddr = (UINT32)(UINTN)(LocalCoreHandle->CurrentEventBuffer);
-
-  if (LocalCoreHandle->CurrentEventBuffer->Event & DWC_XDCI_EVENT_DEV_MASK) {
-    DwcXdciProcessDeviceEvent (
-      LocalCoreHandle,
-      LocalCoreHandle->CurrentEventBuffer,
-      &ProcessedEventSize
-      );
-  } else {
-    DwcXdciProcessEpEvent (
-      LocalCoreHandle,
-      LocalCoreHandle->CurrentEventBuffer,
-      &ProcessedEventSize);
-  }
-
-  eventCount -= ProcessedEventSize;
-  ProcessedEventCount += ProcessedEventSize;
-  if ((currentEventAddr + ProcessedEventSize) >=
-      ((UINT32)(UINTN)(LocalCoreHandle->AlignedEventBuffers) + (sizeof(DWC_XDCI_EVENT_BUFFER) * DWC_XDCI_MAX_EVENTS_PER_BUFFER))
-     ) {
-    currentEventAddr = (UINT32)(UINTN)(LocalCoreHandle->AlignedEventBuffers);
-    DEBUG ((DEBUG_INFO, "DwcXdciProcessInterruptLineEvents: Event Buffer bound reached\n"));
-  } else {
-    currentEventAddr += ProcessedEventSize;
-  }
-
-  LocalCoreHandle->CurrentEventBuffer = (DWC_XDCI_EVENT_BUFFER *)(UINTN)currentEventAddr;
+  DwcXdciProcessInterruptLineEvents (LocalCoreHandle, eventCount, &ProcessedEventCount);
   UsbRegWrite (BaseAddr, DWC_XDCI_EVNTCOUNT_REG (0), ProcessedEventCount);
+
   LocalCoreHandle->InterrupProcessing = FALSE;
 
   return EFI_SUCCESS;
@@ -2540,6 +2731,71 @@ DwcXdciSetLinkState (
 }
 
 
+/**
+  Internal function:
+  This function is used to size the TxFIFO of a bursting IN endpoint
+  so that it holds a full burst of packets. The hardware default
+  FIFOs only hold a couple of packets which stalls the SuperSpeed
+  bursts. The FIFO is placed right after the previous one, in the
+  RAM left by the lower FIFOs: the higher FIFOs, unused by the
+  class driver, may overlap it.
+  @CoreHandle: xDCI controller handle address
+  @EpInfo: Address of structure describing properties of EP
+
+**/
+STATIC
+VOID
+DwcXdciCoreResizeTxFifo (
+  IN XDCI_CORE_HANDLE    *CoreHandle,
+  IN USB_EP_INFO         *EpInfo
+  )
+{
+  UINT32    BaseAddr = CoreHandle->BaseAddress;
+  UINT32    MdWidth;
+  UINT32    RamDepth;
+  UINT32    Prev;
+  UINT32    Start;
+  UINT32    Depth;
+
+  if (EpInfo->EpNum == 0 || EpInfo->EpDir != UsbEpDirIn || EpInfo->BurstSize == 0) {
+    return;
+  }
+
+  //
+  // FIFO sizes and addresses are in MDWIDTH words
+  //
+  MdWidth = ((UsbRegRead (BaseAddr, DWC_XDCI_GHWPARAMS0_REG) & DWC_XDCI_GHWPARAMS0_MDWIDTH_MASK) >>
+             DWC_XDCI_GHWPARAMS0_MDWIDTH_BIT_POS) / 8;
+  RamDepth = UsbRegRead (BaseAddr, DWC_XDCI_GHWPARAMS7_REG) & DWC_XDCI_GHWPARAMS7_RAM1_DEPTH_MASK;
+  if (MdWidth == 0) {
+    return;
+  }
+
+  Prev = UsbRegRead (BaseAddr, DWC_XDCI_GTXFIFOSIZ_REG (EpInfo->EpNum - 1));
+  Start = ((Prev & DWC_XDCI_GTXFIFOSIZ_START_ADDRESS_MASK) >> DWC_XDCI_GTXFIFOSIZ_START_ADDRESS_BIT_POS) +
+          (Prev & DWC_XDCI_GTXFIFOSIZ_DEPTH_MASK);
+  Depth = (EpInfo->BurstSize + 1) * ((EpInfo->MaxPktSize + MdWidth) / MdWidth) + 1;
+
+  if (Start >= RamDepth) {
+    return;
+  }
+  if (Start + Depth > RamDepth) {
+    Depth = RamDepth - Start;
+  }
+  if (Depth <= (UsbRegRead (BaseAddr, DWC_XDCI_GTXFIFOSIZ_REG (EpInfo->EpNum)) & DWC_XDCI_GTXFIFOSIZ_DEPTH_MASK)) {
+    return;
+  }
+
+  UsbRegWrite (
+    BaseAddr,
+    DWC_XDCI_GTXFIFOSIZ_REG (EpInfo->EpNum),
+    (Start << DWC_XDCI_GTXFIFOSIZ_START_ADDRESS_BIT_POS) | Depth
+    );
+
+  DEBUG ((DEBUG_INFO, "DwcXdciCoreResizeTxFifo: TxFIFO %d at 0x%x, %d words\n", EpInfo->EpNum, Start, Depth));
+}
+
+
 /**
   Interface:
   This function is used to initialize endpoint
@@ -2579,6 +2835,9 @@ DwcXdciInitEp (
   // Init CheckFlag
   //
   LocalCoreHandle->EpHandles[EpNum].CheckFlag = FALSE;
+  LocalCoreHandle->EpHandles[EpNum].Segmented = FALSE;
+
+  DwcXdciCoreResizeTxFifo (LocalCoreHandle, EpInfo);
 
   //
   // Init DEPCFG cmd params for EP
@@ -3355,6 +3614,15 @@ DwcXdciEpRxData (
   // need to wait the previous request done.
   //
   if (LocalCoreHandle->EpHandles[EpNum].CheckFlag == TRUE) {
+    //
+    // Re-arming the remaining part of a segmented transfer from a
+    // segment completion callback: these segments are already queued.
+    //
+    if (LocalCoreHandle->EpHandles[EpNum].Segmented &&
+        XferReq->XferBuffer == LocalCoreHandle->EpHandles[EpNum].SegNext &&
+        XferReq->XferLen == LocalCoreHandle->EpHandles[EpNum].SegPending) {
+      return EFI_SUCCESS;
+    }
     return EFI_NOT_READY;
   }
 
@@ -3371,6 +3639,14 @@ DwcXdciEpRxData (
 
   DEBUG ((DEBUG_INFO, "(DwcXdciEpRxData)XferReq->XferLen is 0x%x\n", XferReq->XferLen));
 
+  if (EpNum > 1 && XferReq->XferLen > DWC_XDCI_SEG_SIZE) {
+    Status = DwcXdciStartSegXfer (LocalCoreHandle, EpNum);
+    if (Status) {
+      LocalCoreHandle->EpHandles[EpNum].CheckFlag = FALSE;
+    }
+    return Status;
+  }
+
   Status = DwcXdciCoreInitTrb (
              LocalCoreHandle,
              Trb,
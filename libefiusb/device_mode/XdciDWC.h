@@ -31,6 +31,13 @@
 #define DWC_XDCI_TRB_NUM                                   (32)
 #define DWC_XDCI_MASK                                      (DWC_XDCI_TRB_NUM - 1)
 
+//
+// Large bulk OUT transfers are split in segments queued on a ring of
+// TRBs closed by a link TRB.  Each segment raises its own completion.
+//
+#define DWC_XDCI_SEG_SIZE                                  (0x00400000)
+#define DWC_XDCI_SEG_TRB_NUM                               (DWC_XDCI_TRB_NUM - 1)
+
 #define DWC_XDCI_MAX_DELAY_ITERATIONS                      (1000)
 
 #define DWC_XDCI_GSBUSCFG0_REG                             (0xC100)
@@ -66,6 +73,8 @@
 // Global Hardware Parameters Registers
 //
 #define DWC_XDCI_GHWPARAMS0_REG                            (0xC140)
+#define DWC_XDCI_GHWPARAMS0_MDWIDTH_MASK                   (0x0000FF00)
+#define DWC_XDCI_GHWPARAMS0_MDWIDTH_BIT_POS                (8)
 #define DWC_XDCI_GHWPARAMS1_REG                            (0xC144)
 #define DWC_XDCI_GHWPARAMS1_NUM_INT_MASK                   (0x1F8000)
 #define DWC_XDCI_GHWPARAMS1_NUM_INT_BIT_POS                (15)
@@ -77,6 +86,7 @@
 #define DWC_XDCI_GHWPARAMS5_REG                            (0xC154)
 #define DWC_XDCI_GHWPARAMS6_REG                            (0xC158)
 #define DWC_XDCI_GHWPARAMS7_REG                            (0xC15C)
+#define DWC_XDCI_GHWPARAMS7_RAM1_DEPTH_MASK                (0x0000FFFF)
 #define DWC_XDCI_GHWPARAMS8_REG                            (0xC600)
 
 #define DWC_XDCI_GDBGFIFOSPACE_REG                         (0xC160)
@@ -91,6 +101,7 @@
 #define DWC_XDCI_GTXFIFOSIZ_REG(n)                         (0xC300 + (n << 2))
 #define DWC_XDCI_GTXFIFOSIZ_START_ADDRESS_MASK             (0xFFFF0000)
 #define DWC_XDCI_GTXFIFOSIZ_START_ADDRESS_BIT_POS          (16)
+#define DWC_XDCI_GTXFIFOSIZ_DEPTH_MASK                     (0x0000FFFF)
 #define DWC_XDCI_GRXFIFOSIZ_REG(n)                         (0xC380 + (n << 2))
 
 //
@@ -483,6 +494,14 @@ typedef struct  {
   USB_EP_STATE      State;
   USB_EP_STATE      OrgState;
   BOOLEAN           CheckFlag;
+  BOOLEAN           Segmented;      // Segmented transfer in progress
+  UINT8             *SegBuffer;     // Next segment to queue
+  UINT32            SegLeft;        // Bytes left to queue
+  UINT8             *SegNext;       // Next segment to complete
+  UINT32            SegPending;     // Bytes left to complete
+  UINT32            SegEnqueue;     // Ring index of the next TRB to queue
+  UINT32            SegDequeue;     // Ring index of the next TRB to complete
+  UINT32            SegInFlight;    // Number of TRBs owned by the hardware
 } DWC_XDCI_ENDPOINT;
 
 typedef struct {
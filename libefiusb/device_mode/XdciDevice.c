@@ -206,7 +206,8 @@ UsbDeviceIsrRoutine (
   This function is used to service interrupt events on device
   controller. Use this API in your OS/stack-specific ISR framework
   In polled mode scenario, invoke this API in a loop to service the
-  events
+  events.  All the pending events are processed as one batch,
+  EFI_NOT_READY is returned if there is none
   @DevCoreHandle: Handle to HW-independent APIs for device
   controller
 
@@ -647,6 +648,10 @@ UsbXdciDeviceEpTxData (
   completes.
   Callback for transfer completion is invoked when requested transfer length
   is reached or if a short packet is received
+  Large bulk requests are split in segments queued together on the
+  controller: the callback is then invoked for each completed segment
+  with the segment buffer and length. Requesting the remaining part of the
+  transfer from that callback is allowed, it is already queued.
   @DevCoreHandle: Handle to HW-independent APIs for device
   controller
   @XferReq: Address to transfer request describing this transfer
@@ -55,6 +55,7 @@
 //
 #define USB_BCD_VERSION_LS          0x0110
 #define USB_BCD_VERSION_HS          0x0200
+#define USB_BCD_VERSION_HS_BOS      0x0210 // High Speed with a BOS descriptor
 #define USB_BCD_VERSION_SS          0x0300
 
 //
@@ -51,7 +51,16 @@
 #define IF_PROTOCOL          	0x00	/* Default protocol */
 #define IN_ENDPOINT_NUM         1
 #define OUT_ENDPOINT_NUM        2
+#ifdef SUPPORT_SUPER_SPEED
+#define BULK_EP_PKT_SIZE	USB_BULK_EP_PKT_SIZE_SS
+#define BULK_EP_MAX_BURST	15	/* 16 packets per burst */
+#define BCD_USB			USB_BCD_VERSION_SS
+#define EP0_MAX_PKT_SIZE	USB_EP0_MAX_PKT_SIZE_SS
+#else
 #define BULK_EP_PKT_SIZE     	USB_BULK_EP_PKT_SIZE_HS	/* default to using high speed */
+#define BCD_USB			USB_BCD_VERSION_HS
+#define EP0_MAX_PKT_SIZE	USB_EP0_MAX_PKT_SIZE_HS
+#endif
 #define VENDOR_ID               0x8087	/* Intel Inc. */
 #define PRODUCT_ID		0x09EF
 #define BCD_DEVICE		0x0100
@@ -67,6 +76,17 @@ static USB_DEVICE_ENDPOINT_OBJ	gEndpointObjs[ENDPOINT_COUNT];
 EFI_GUID gEfiUsbDeviceModeProtocolGuid = EFI_USB_DEVICE_MODE_PROTOCOL_GUID;
 static EFI_USB_DEVICE_MODE_PROTOCOL *usb_device = NULL;
 
+/* Soft pause: between two sessions of the same interface, the device
+   stays connected and configured.  The host does not enumerate it
+   again, see usb_pause().  */
+static BOOLEAN configured;
+static BOOLEAN rx_pending, tx_pending;
+static struct {
+	BOOLEAN active;
+	UINT8 subclass;
+	UINT8 protocol;
+} paused;
+
 /* String descriptor table indexes */
 typedef enum {
 	STR_TBL_LANG,
@@ -95,14 +115,84 @@ static USB_STRING_DESCRIPTOR string_table[] = {
 	{ 2 + sizeof(STR_INTERFACE)	, USB_DESC_TYPE_STRING, STR_INTERFACE },
 };
 
-/* Complete Configuration structure */
+/* Complete Configuration structure.  In SuperSpeed, each endpoint
+   descriptor is followed by its companion descriptor.  The
+   self-implemented device mode protocol drops the companions and
+   reverts to 512 bytes packets on a High Speed link.  */
 struct config_descriptor {
 	EFI_USB_CONFIG_DESCRIPTOR    config;
 	EFI_USB_INTERFACE_DESCRIPTOR interface;
 	EFI_USB_ENDPOINT_DESCRIPTOR  ep_in;
+#ifdef SUPPORT_SUPER_SPEED
+	EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR ep_in_comp;
+#endif
 	EFI_USB_ENDPOINT_DESCRIPTOR  ep_out;
+#ifdef SUPPORT_SUPER_SPEED
+	EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR ep_out_comp;
+#endif
+} __attribute__((packed));
+
+#ifdef SUPPORT_SUPER_SPEED
+#define EP_IN_COMP_DESC		(&config_descriptor.ep_in_comp)
+#define EP_OUT_COMP_DESC	(&config_descriptor.ep_out_comp)
+
+#define USB_DESC_TYPE_DEVICE_CAPABILITY	0x10
+#define USB_CAP_TYPE_USB20_EXT		0x02
+#define USB_CAP_TYPE_SUPER_SPEED	0x03
+#define USB_SPEEDS_FS_HS_SS		0x000E
+#define USB_FUNCTIONALITY_FS		0x01
+
+/* Binary device Object Store: USB 2.0 extension and SuperSpeed
+   device capabilities */
+struct bos_descriptor {
+	EFI_USB_BOS_DESCRIPTOR bos;
+	struct {
+		UINT8  Length;
+		UINT8  DescriptorType;
+		UINT8  DevCapabilityType;
+		UINT32 Attributes;
+	} __attribute__((packed)) usb20_ext;
+	struct {
+		UINT8  Length;
+		UINT8  DescriptorType;
+		UINT8  DevCapabilityType;
+		UINT8  Attributes;
+		UINT16 SpeedsSupported;
+		UINT8  FunctionalitySupport;
+		UINT8  U1DevExitLat;
+		UINT16 U2DevExitLat;
+	} __attribute__((packed)) ss_cap;
 } __attribute__((packed));
 
+static struct bos_descriptor bos_descriptor = {
+	.bos = {
+		sizeof(EFI_USB_BOS_DESCRIPTOR),
+		USB_DESC_TYPE_BOS,
+		sizeof(struct bos_descriptor),
+		2
+	},
+	.usb20_ext = {
+		sizeof(bos_descriptor.usb20_ext),
+		USB_DESC_TYPE_DEVICE_CAPABILITY,
+		USB_CAP_TYPE_USB20_EXT,
+		0x0 /* No Link Power Management */
+	},
+	.ss_cap = {
+		sizeof(bos_descriptor.ss_cap),
+		USB_DESC_TYPE_DEVICE_CAPABILITY,
+		USB_CAP_TYPE_SUPER_SPEED,
+		0x0, /* No Latency Tolerance Messages */
+		USB_SPEEDS_FS_HS_SS,
+		USB_FUNCTIONALITY_FS,
+		0x0, /* U1 and U2 link states are not supported */
+		0x0
+	}
+};
+#else
+#define EP_IN_COMP_DESC		NULL
+#define EP_OUT_COMP_DESC	NULL
+#endif
+
 static struct config_descriptor config_descriptor = {
 	.config = {
 		sizeof(EFI_USB_CONFIG_DESCRIPTOR),
@@ -133,6 +223,15 @@ static struct config_descriptor config_descriptor = {
 		BULK_EP_PKT_SIZE,
 		0x00 /* Not specified for bulk endpoint */
 	},
+#ifdef SUPPORT_SUPER_SPEED
+	.ep_in_comp = {
+		sizeof(EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR),
+		USB_DESC_TYPE_SS_ENDPOINT_COMPANION,
+		BULK_EP_MAX_BURST,
+		0x00, /* No streams */
+		0x00  /* Not specified for bulk endpoint */
+	},
+#endif
 	.ep_out = {
 		sizeof(EFI_USB_ENDPOINT_DESCRIPTOR),
 		USB_DESC_TYPE_ENDPOINT,
@@ -140,17 +239,26 @@ static struct config_descriptor config_descriptor = {
 		USB_ENDPOINT_BULK,
 		BULK_EP_PKT_SIZE,
 		0x00 /* Not specified for bulk endpoint */
+	},
+#ifdef SUPPORT_SUPER_SPEED
+	.ep_out_comp = {
+		sizeof(EFI_USB_ENDPOINT_COMPANION_DESCRIPTOR),
+		USB_DESC_TYPE_SS_ENDPOINT_COMPANION,
+		BULK_EP_MAX_BURST,
+		0x00, /* No streams */
+		0x00  /* Not specified for bulk endpoint */
 	}
+#endif
 };
 
 static USB_DEVICE_DESCRIPTOR device_descriptor = {
 	sizeof(USB_DEVICE_DESCRIPTOR),
 	USB_DESC_TYPE_DEVICE,
-	USB_BCD_VERSION_HS, /* Default to High Speed */
+	BCD_USB,
 	0x00, /* specified in interface descriptor */
 	0x00, /* specified in interface descriptor */
 	0x00, /* specified in interface descriptor */
-	USB_EP0_MAX_PKT_SIZE_HS, /* Default to high speed */
+	EP0_MAX_PKT_SIZE,
 	VENDOR_ID,
 	PRODUCT_ID,
 	BCD_DEVICE,
@@ -166,7 +274,7 @@ EFI_STATUS usb_write(void *buf, UINT32 size)
 	USB_DEVICE_IO_REQ ioReq;
 
 	ioReq.EndpointInfo.EndpointDesc = &config_descriptor.ep_in;
-	ioReq.EndpointInfo.EndpointCompDesc = NULL;
+	ioReq.EndpointInfo.EndpointCompDesc = EP_IN_COMP_DESC;
 	ioReq.IoInfo.Buffer = buf;
 	ioReq.IoInfo.Length = size;
 
@@ -174,6 +282,8 @@ EFI_STATUS usb_write(void *buf, UINT32 size)
 	ret = uefi_call_wrapper(usb_device->EpTxData, 2, usb_device, &ioReq);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"failed to queue Tx request");
+	else
+		tx_pending = TRUE;
 
 	return ret;
 }
@@ -189,7 +299,7 @@ EFI_STATUS usb_read(void *buf, UINT32 size)
 	size = ALIGN(size, max_pkt_size);
 
 	ioReq.EndpointInfo.EndpointDesc = &config_descriptor.ep_out;
-	ioReq.EndpointInfo.EndpointCompDesc = NULL;
+	ioReq.EndpointInfo.EndpointCompDesc = EP_OUT_COMP_DESC;
 	ioReq.IoInfo.Buffer = buf;
 	ioReq.IoInfo.Length = size;
 
@@ -197,6 +307,8 @@ EFI_STATUS usb_read(void *buf, UINT32 size)
 	ret = uefi_call_wrapper(usb_device->EpRxData, 2, usb_device, &ioReq);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"failed to queue Rx request");
+	else
+		rx_pending = TRUE;
 
 	return ret;
 }
@@ -216,6 +328,7 @@ static EFIAPI EFI_STATUS config_handler(UINT8 cfgVal)
 
 	if (cfgVal == config_descriptor.config.ConfigurationValue) {
 		/* we've been configured, get ready to receive Commands */
+		configured = TRUE;
 		if (start_callback)
 			start_callback();
 	} else {
@@ -235,11 +348,14 @@ EFIAPI EFI_STATUS data_handler(EFI_USB_DEVICE_XFER_INFO *XferInfo)
 
 	/* if we are receiving a command or data, call the processing routine */
 	if (XferInfo->EndpointDir == USB_ENDPOINT_DIR_OUT) {
+		rx_pending = FALSE;
 		if (rx_callback)
 			rx_callback(XferInfo->Buffer, XferInfo->Length);
-	} else
+	} else {
+		tx_pending = FALSE;
 		if (tx_callback)
 			tx_callback(XferInfo->Buffer, XferInfo->Length);
+	}
 	return EFI_SUCCESS;
 }
 
@@ -330,6 +446,9 @@ static void init_driver_objs(UINT8 subclass,
 	gDevObj.DeviceDesc                 = &device_descriptor;
 	gDevObj.ConfigObjs                 = device_configs;
 	gDevObj.StringTable                = string_table;
+#ifdef SUPPORT_SUPER_SPEED
+	gDevObj.BosDesc                    = &bos_descriptor.bos;
+#endif
 	gDevObj.StrTblEntries              = STR_TBL_COUNT;
 	gDevObj.ConfigCallback             = config_handler;
 	gDevObj.SetupCallback              = setup_handler;
@@ -346,10 +465,10 @@ static void init_driver_objs(UINT8 subclass,
 
 	/* Endpoint Data In/Out objects */
 	gEndpointObjs[0].EndpointDesc      = &config_descriptor.ep_in;
-	gEndpointObjs[0].EndpointCompDesc  = NULL;
+	gEndpointObjs[0].EndpointCompDesc  = EP_IN_COMP_DESC;
 
 	gEndpointObjs[1].EndpointDesc      = &config_descriptor.ep_out;
-	gEndpointObjs[1].EndpointCompDesc  = NULL;
+	gEndpointObjs[1].EndpointCompDesc  = EP_OUT_COMP_DESC;
 }
 
 EFI_STATUS usb_start(UINT8 subclass, UINT8 protocol,
@@ -362,6 +481,21 @@ EFI_STATUS usb_start(UINT8 subclass, UINT8 protocol,
 	if (!str_configuration || !str_interface || !start_cb || !rx_cb || !tx_cb)
 		return EFI_INVALID_PARAMETER;
 
+	if (paused.active) {
+		if (configured && paused.subclass == subclass &&
+		    paused.protocol == protocol) {
+			paused.active = FALSE;
+			start_callback = start_cb;
+			rx_callback = rx_cb;
+			tx_callback = tx_cb;
+			debug(L"Resuming the paused USB device");
+			/* The host configured the device already */
+			start_cb();
+			return EFI_SUCCESS;
+		}
+		usb_stop();
+	}
+
 	start_callback = start_cb;
 	rx_callback = rx_cb;
 	tx_callback = tx_cb;
@@ -423,6 +557,10 @@ EFI_STATUS usb_stop(void)
 {
 	EFI_STATUS ret;
 
+	paused.active = FALSE;
+	configured = FALSE;
+	rx_pending = tx_pending = FALSE;
+
 	ret = uefi_call_wrapper(usb_device->Stop, 1, usb_device);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to Stop USB", ret);
@@ -446,6 +584,27 @@ EFI_STATUS usb_stop(void)
 	return ret;
 }
 
+/* The session ends but the device stays connected and configured.
+   The next usb_start() of the same interface resumes it without a
+   disconnection, any other usb_start() stops it first.  A device which
+   is not configured yet or has a transfer in flight is stopped.  */
+EFI_STATUS usb_pause(void)
+{
+	if (!configured || rx_pending || tx_pending)
+		return usb_stop();
+
+	start_callback = NULL;
+	rx_callback = NULL;
+	tx_callback = NULL;
+
+	paused.subclass = config_descriptor.interface.InterfaceSubClass;
+	paused.protocol = config_descriptor.interface.InterfaceProtocol;
+	paused.active = TRUE;
+	debug(L"USB device paused");
+
+	return EFI_SUCCESS;
+}
+
 EFI_STATUS usb_run(void)
 {
 	return uefi_call_wrapper(usb_device->Run, 2, usb_device, 1);
@@ -55,12 +55,14 @@ elf32_update_rela_section(uint32_t relocation_offset, elf32_dyn_t *dyn_section,
 	elf32_rela_t *rela = NULL;
 	uint32_t rela_sz = 0;
 	uint32_t rela_entsz = 0;
+	uint32_t rela_count = 0;
 	elf32_sym_t *symtab = NULL;
 	uint32_t symtab_entsz = 0;
 	uint32_t i;
 	elf32_rel_t *rel = NULL;
 	uint32_t rel_sz = 0;
 	uint32_t rel_entsz = 0;
+	uint32_t rel_count = 0;
 
 	if (!dyn_section) {
 		local_print(L"failed to read dynamic section from file.\n");
@@ -106,6 +108,14 @@ elf32_update_rela_section(uint32_t relocation_offset, elf32_dyn_t *dyn_section,
 		if (DT_RELENT == dyn_section[i].d_tag) {
 			rel_entsz = dyn_section[i].d_un.d_val;
 		}
+
+		if (DT_RELACOUNT == dyn_section[i].d_tag) {
+			rela_count = dyn_section[i].d_un.d_val;
+		}
+
+		if (DT_RELCOUNT == dyn_section[i].d_tag) {
+			rel_count = dyn_section[i].d_un.d_val;
+		}
 	}
 
 	/* handle DT_RELA tag: */
@@ -113,7 +123,15 @@ elf32_update_rela_section(uint32_t relocation_offset, elf32_dyn_t *dyn_section,
 		&& rela_sz && (NULL != symtab)
 		&& (sizeof(elf32_rela_t) == rela_entsz)
 		&& (sizeof(elf32_sym_t) == symtab_entsz)) {
-		for (i = 0; i < rela_sz / rela_entsz; ++i) {
+		/* leading R_386_RELATIVE entries counted by DT_RELACOUNT */
+		rela_count = min(rela_count, rela_sz / rela_entsz);
+		for (i = 0; i < rela_count; ++i) {
+			*(uint32_t *)(UINTN)((uint64_t)rela[i].r_offset +
+					     (uint64_t)relocation_offset) =
+				rela[i].r_addend + relocation_offset;
+		}
+
+		for (; i < rela_sz / rela_entsz; ++i) {
 			uint32_t *target_addr =
 				(uint32_t *)(UINTN)((uint64_t)rela[i].r_offset +
 						 (uint64_t)relocation_offset);
@@ -149,7 +167,14 @@ elf32_update_rela_section(uint32_t relocation_offset, elf32_dyn_t *dyn_section,
 		 * architecture, one form or the other might be necessary or more
 		 * convenient. Consequently, an implementation for a particular machine
 		 * may use one form exclusively or either form depending on context. */
-		for (i = 0; i < rel_sz / rel_entsz; ++i) {
+		/* leading R_386_RELATIVE entries counted by DT_RELCOUNT */
+		rel_count = min(rel_count, rel_sz / rel_entsz);
+		for (i = 0; i < rel_count; ++i) {
+			*(uint32_t *)(UINTN)((uint64_t)rel[i].r_offset +
+					     (uint64_t)relocation_offset) += relocation_offset;
+		}
+
+		for (; i < rel_sz / rel_entsz; ++i) {
 			uint32_t *target_addr =
 				(uint32_t *)(UINTN)((uint64_t)rel[i].r_offset +
 						 (uint64_t)relocation_offset);
@@ -280,6 +305,23 @@ elf32_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 
 	relocation_offset = (uint32_t)file_info->runtime_addr - low_addr;
 
+	/* plan the placement of all the segments before writing to the
+	 * runtime region */
+	for (i = 0; i < (uint16_t)ehdr->e_phnum; ++i) {
+		elf32_phdr_t *phdr = (elf32_phdr_t *)GET_PHDR(ehdr, phdrtab, i);
+
+		if (PT_LOAD != phdr->p_type || 0 == phdr->p_memsz) {
+			continue;
+		}
+
+		if (!image_check(file_info, (uint64_t)phdr->p_paddr + (uint64_t)relocation_offset,
+				 phdr->p_offset, min(phdr->p_filesz, phdr->p_memsz),
+				 phdr->p_memsz)) {
+			local_print(L"segment %d does not fit\n", i);
+			return FALSE;
+		}
+	}
+
 	/* now actually copy image to its target destination */
 	for (i = 0; i < (uint16_t)ehdr->e_phnum; ++i) {
 		elf32_phdr_t *phdr = (elf32_phdr_t *)GET_PHDR(ehdr, phdrtab, i);
@@ -312,8 +354,8 @@ elf32_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 		}
 
 		if (filesz < memsz) { /* zero BSS if exists */
-			memset((void *)(UINTN)((uint64_t)addr + (uint64_t)filesz +
-						    (uint64_t)relocation_offset), 0,
+			image_zero((void *)(UINTN)((uint64_t)addr + (uint64_t)filesz +
+						    (uint64_t)relocation_offset),
 				memsz - filesz);
 		}
 	}
@@ -53,6 +53,7 @@ elf64_update_rela_section(uint16_t e_type, uint64_t relocation_offset, elf64_dyn
 	elf64_rela_t *rela = NULL;
 	uint64_t rela_sz = 0;
 	uint64_t rela_entsz = 0;
+	uint64_t rela_count = 0;
 	elf64_sym_t *symtab = NULL;
 	uint64_t symtab_entsz = 0;
 	uint64_t i;
@@ -77,6 +78,9 @@ elf64_update_rela_section(uint16_t e_type, uint64_t relocation_offset, elf64_dyn
 		else if(DT_RELAENT == d_tag) {
 			rela_entsz = dyn_section[i].d_un.d_val;
 		}
+		else if(DT_RELACOUNT == d_tag) {
+			rela_count = dyn_section[i].d_un.d_val;
+		}
 		else if(DT_SYMTAB == d_tag) {
 			symtab = (elf64_sym_t *)(UINTN)(uint64_t)(dyn_section[i].d_un.d_ptr +
 					relocation_offset);
@@ -102,7 +106,15 @@ elf64_update_rela_section(uint16_t e_type, uint64_t relocation_offset, elf64_dyn
 		}
 	}
 
-	for (i = 0; i < rela_sz / rela_entsz; ++i) {
+	/* the linker puts the R_X86_64_RELATIVE entries first and
+	 * DT_RELACOUNT counts them: they only need the addend */
+	rela_count = min(rela_count, rela_sz / rela_entsz);
+	for (i = 0; i < rela_count; ++i) {
+		*(uint64_t *)(UINTN)(uint64_t)(rela[i].r_offset + relocation_offset) =
+			rela[i].r_addend + relocation_offset;
+	}
+
+	for (; i < rela_sz / rela_entsz; ++i) {
 		uint64_t *target_addr =
 			(uint64_t *)(UINTN)(uint64_t)(rela[i].r_offset +
 						 relocation_offset);
@@ -227,6 +239,23 @@ elf64_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 
 	relocation_offset = (uint64_t)file_info->runtime_addr - low_addr;
 
+	/* plan the placement of all the segments before writing to the
+	 * runtime region */
+	for (i = 0; i < (uint16_t)ehdr->e_phnum; ++i) {
+		phdr = (elf64_phdr_t *)GET_PHDR(ehdr, phdrtab, i);
+
+		if (PT_LOAD != phdr->p_type || 0 == phdr->p_memsz) {
+			continue;
+		}
+
+		if (!image_check(file_info, phdr->p_paddr + relocation_offset,
+				 phdr->p_offset, min(phdr->p_filesz, phdr->p_memsz),
+				 phdr->p_memsz)) {
+			local_print(L"segment %d does not fit\n", i);
+			return FALSE;
+		}
+	}
+
 	/* now actually copy image to its target destination */
 	for (i = 0; i < (uint16_t)ehdr->e_phnum; ++i) {
 		phdr = (elf64_phdr_t *)GET_PHDR(ehdr, phdrtab, i);
@@ -261,8 +290,8 @@ elf64_load_executable(module_file_info_t *file_info, uint64_t *p_entry)
 
 		if (filesz < memsz) {
 			/* zero BSS if exists */
-			memset((void *)(UINTN)(uint64_t)(addr + filesz +
-						    relocation_offset), 0,
+			image_zero((void *)(UINTN)(uint64_t)(addr + filesz +
+						    relocation_offset),
 				(uint64_t)(memsz - filesz));
 		}
 	}
@@ -38,6 +38,9 @@ BOOLEAN image_copy(void *dest, module_file_info_t *file_info,
 				uint64_t src_offset, uint64_t bytes_to_copy)
 {
 	void *src;
+	if (bytes_to_copy == 0) {
+		return TRUE; /* BSS only segment */
+	}
 	src = image_offset(file_info, src_offset, bytes_to_copy);
 	if (!src) {
 		return FALSE;
@@ -47,10 +50,38 @@ BOOLEAN image_copy(void *dest, module_file_info_t *file_info,
 		 (file_info->runtime_addr + file_info->runtime_image_size))) {
 		return FALSE;
 	}
-	memcpy(dest, src, bytes_to_copy);
+	if (dest != src) {
+		/* the segment is not already at its runtime address */
+		memcpy(dest, src, bytes_to_copy);
+	}
+	return TRUE;
+}
+
+/* check a whole segment placement before anything is written to the
+ * runtime region */
+BOOLEAN image_check(module_file_info_t *file_info, uint64_t dest,
+				uint64_t src_offset, uint64_t filesz, uint64_t memsz)
+{
+	if (filesz && !image_offset(file_info, src_offset, filesz)) {
+		return FALSE;
+	}
+	if ((dest < file_info->runtime_addr) || (dest + memsz < dest) ||
+		((dest + memsz) >
+		 (file_info->runtime_addr + file_info->runtime_image_size))) {
+		return FALSE;
+	}
 	return TRUE;
 }
 
+void image_zero(void *dest, uint64_t size)
+{
+	if (size >= ELF_BSS_NT_SIZE) {
+		zero_memory_nt(dest, size);
+	} else {
+		memset(dest, 0, size);
+	}
+}
+
 /*------------------------- Exported Interface --------------------------*/
 
 /*----------------------------------------------------------------------
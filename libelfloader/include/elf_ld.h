@@ -114,6 +114,8 @@
 #define DT_RUNPATH      29                      /* String table offset of a null-terminated library search path string. */
 #define DT_FLAGS        30                      /* Object specific flag values. */
 #define DT_ENCODING     32                      /* Values greater than or equal to DT_ENCODING */
+#define DT_RELACOUNT    0x6ffffff9              /* Number of leading RELATIVE entries of the DT_RELA table. */
+#define DT_RELCOUNT     0x6ffffffa              /* Number of leading RELATIVE entries of the DT_REL table. */
 
 /*
  * Relocation types.
@@ -229,7 +231,14 @@ typedef struct {
 	uint64_t runtime_total_size;
 } module_file_info_t;
 
+/* BSS areas of at least ELF_BSS_NT_SIZE bytes are zeroed with
+ * non-temporal stores: the loader does not read them back. */
+#define ELF_BSS_NT_SIZE (64 * 1024)
+
 BOOLEAN image_copy(void * dest, module_file_info_t *file_info, uint64_t src_offset, uint64_t byte_to_read);
 void *image_offset(module_file_info_t *file_info, uint64_t src_offset, uint64_t byte_to_read);
+BOOLEAN image_check(module_file_info_t *file_info, uint64_t dest, uint64_t src_offset,
+		    uint64_t filesz, uint64_t memsz);
+void image_zero(void *dest, uint64_t size);
 
 #endif    /* _ELF_LD_H_ */
@@ -5,6 +5,26 @@ SHARED_CFLAGS := \
 	$(KERNELFLINGER_CFLAGS) \
 	-DTARGET_BOOTLOADER_BOARD_NAME=\"$(TARGET_BOOTLOADER_BOARD_NAME)\"
 
+ifneq ($(KERNELFLINGER_FASTBOOT_MAX_DOWNLOAD_SIZE),)
+    SHARED_CFLAGS += -DFASTBOOT_MAX_DOWNLOAD_SIZE_MB=$(KERNELFLINGER_FASTBOOT_MAX_DOWNLOAD_SIZE)
+endif
+
+ifeq ($(KERNELFLINGER_USE_IPP_SHA256),true)
+    SHARED_CFLAGS += -DUSE_IPP_SHA256
+endif
+
+ifneq ($(KERNELFLINGER_HASH_SEGMENT_SIZE),)
+    SHARED_CFLAGS += -DHASH_SEGMENT_SIZE_KB=$(KERNELFLINGER_HASH_SEGMENT_SIZE)
+endif
+
+ifneq ($(KERNELFLINGER_FASTBOOT_UDP_MAX_PACKET_SIZE),)
+    SHARED_CFLAGS += -DFASTBOOT_UDP_MAX_PACKET_SIZE=$(KERNELFLINGER_FASTBOOT_UDP_MAX_PACKET_SIZE)
+endif
+
+ifeq ($(KERNELFLINGER_USB_SOFT_PAUSE),true)
+    SHARED_CFLAGS += -DUSB_SOFT_PAUSE
+endif
+
 SHARED_C_INCLUDES := $(LOCAL_PATH)/../include/libfastboot
 SHARED_STATIC_LIBRARIES := \
 	$(KERNELFLINGER_STATIC_LIBRARIES) \
@@ -28,6 +48,7 @@ SHARED_SRC_FILES := \
 	fastboot_flashing.c \
 	flash.c \
 	sparse.c \
+	fetch.c \
 	info.c \
 	intel_variables.c \
 	bootmgr.c \
@@ -31,6 +31,7 @@
  */
 
 #include <lib.h>
+#include <fastboot.h>
 
 #include "flash.h"
 #include "gpt.h"
@@ -183,6 +184,41 @@ static EFI_STATUS read_load_options(EFI_HANDLE handle)
 	return EFI_SUCCESS;
 }
 
+/* The LABEL partition already holds the image: the safe flash
+ * procedure would only rewrite the same content, the load options are
+ * refreshed from the current partition instead.
+ */
+static EFI_STATUS refresh_efi_partition(CHAR16 *label, BOOLEAN is_load_options)
+{
+	EFI_STATUS ret;
+	EFI_HANDLE handle;
+
+	fastboot_info("%s is up to date, skipping the flash", label);
+	if (!is_load_options)
+		return EFI_SUCCESS;
+
+	ret = gpt_get_partition_handle(label, LOGICAL_UNIT_USER, &handle);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get handle for '%s' partition",
+			   label);
+		return EFI_NOT_FOUND;
+	}
+
+	ret = read_load_options(handle);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get load options");
+		return ret;
+	}
+
+	ret = bootmgr_register_entries(label, load_options, load_option_nb);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to install the load options");
+
+	free_load_options();
+
+	return ret;
+}
+
 /* we perform a "safe flash procedure" for EFI System partition:
  * 1. write data to the BOOTLOADER_TMP_PART partition
  * 2. perform sanity check on BOOTLOADER_TMP_PART partition files
@@ -195,12 +231,24 @@ static EFI_STATUS flash_efi_partition(CHAR16 *label, CHAR16 *tmp_part,
 {
 	EFI_STATUS ret, erase_ret;
 	EFI_HANDLE handle;
+	BOOLEAN same;
 	UINTN i;
 
+	ret = flash_compare(data, size, label, &same);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to compare the '%s' partition", label);
+	else if (same)
+		return refresh_efi_partition(label, is_load_options);
+
 	ret = flash_partition(data, size, tmp_part);
 	if (EFI_ERROR(ret))
 		return ret;
 
+	/* The new bootloader must be durable before it is swapped in */
+	ret = gpt_sync();
+	if (EFI_ERROR(ret))
+		return ret;
+
 	ret = gpt_refresh();
 	if (EFI_ERROR(ret))
 		return ret;
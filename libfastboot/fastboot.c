@@ -32,6 +32,8 @@
  *
  */
 
+#define LOG_MODULE LOG_MODULE_FASTBOOT
+
 #include <efi.h>
 #include <efilib.h>
 #include <lib.h>
@@ -46,6 +48,7 @@
 #include "gpt.h"
 #include "fastboot.h"
 #include "flash.h"
+#include "fetch.h"
 #include "fastboot_oem.h"
 #include "fastboot_flashing.h"
 #include "fastboot_ui.h"
@@ -58,20 +61,32 @@
 #endif
 #include "timer.h"
 #include "android.h"
+#include "misc.h"
+#ifdef RPMB_STORAGE
+#include "rpmb_storage.h"
+#endif
+#include "memtrack.h"
+#include "memmap.h"
+#include "crc32.h"
 
 /* size of "INFO" "OKAY" or "FAIL" */
 #define CODE_LENGTH 4
 #define INFO_PAYLOAD (MAGIC_LENGTH - CODE_LENGTH)
 #define MAX_VARIABLE_LENGTH 64
+/* Number of buckets of the variable hash tables, a power of two */
+#define VAR_HASH_SIZE 256
 #if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
 #define TIMEOUT 5
 #endif
 
 struct fastboot_var {
-	struct fastboot_var *next;
+	struct fastboot_var *next;	/* Publication order */
+	struct fastboot_var *hnext;	/* Hash bucket chain */
 	char name[MAX_VARIABLE_LENGTH];
 	char value[MAX_VARIABLE_LENGTH];
 	const char *(*get_value)(void);
+	BOOLEAN memoize;		/* Keep the first get_value() result */
+	BOOLEAN cached;			/* value holds get_value() result */
 };
 
 struct fastboot_tx_buffer {
@@ -90,6 +105,8 @@ enum fastboot_states {
 	STATE_COMPLETE,
 	STATE_START_DOWNLOAD,
 	STATE_DOWNLOAD,
+	STATE_START_UPLOAD,
+	STATE_UPLOAD,
 	STATE_TX,
 	STATE_STOPPING,
 	STATE_STOPPED,
@@ -99,15 +116,125 @@ enum fastboot_states {
 static cmdlist_t cmdlist;
 static char *command_buffer;
 static UINTN command_buffer_size;
-static struct fastboot_var *varlist;
-static struct fastboot_tx_buffer *txbuf_head;
+static struct fastboot_var *varlist, *varlist_tail;
+static struct fastboot_var *var_buckets[VAR_HASH_SIZE];
+/* The partition variables are not published but computed from the
+   GPT cache on lookup.  They are built in a single table, kept until
+   the GPT cache generation changes.  */
+static struct fastboot_var *partvars;
+static struct fastboot_var *partvar_buckets[VAR_HASH_SIZE];
+static UINTN partvars_nb, partvars_max;
+static UINT32 partvars_generation;
+/* The buffered messages are queued in a fixed ring.  A command
+   handler cannot wait for the transport to drain it: the transports
+   only progress from the main loop, and the installer one even runs
+   the next command from there.  Once the ring is full, the messages
+   are queued in allocated buffers until the ring has been flushed.  */
+#define TX_RING_SIZE 512
+static char tx_ring[TX_RING_SIZE][MAGIC_LENGTH];
+static UINTN tx_ring_head, tx_ring_count;
+static struct fastboot_tx_buffer *txbuf_head, *txbuf_tail;
 static enum fastboot_states fastboot_state;
 static enum fastboot_states next_state;
 
-/* Download buffer structure and size limits */
+/* Download buffer structure and size limits.  The download buffer
+   is allocated by pages in the largest free memory region, leaving
+   DLSIZE_RESERVE bytes of that region to the rest of the boot loader,
+   up to MAX_DLSIZE bytes.  */
 static struct download_buffer dl;
-static const UINTN MIN_DLSIZE = 8 * 1024 * 1024;
-static const UINTN MAX_DLSIZE = 256 * 1024 * 1024;
+static EFI_PHYSICAL_ADDRESS dl_base;
+static UINTN dl_pages;
+static const UINT64 MIN_DLSIZE = 8 * 1024 * 1024;
+static const UINT64 DLSIZE_RESERVE = 128 * 1024 * 1024;
+#if defined(FASTBOOT_MAX_DOWNLOAD_SIZE_MB)
+static const UINT64 MAX_DLSIZE = (UINT64)FASTBOOT_MAX_DOWNLOAD_SIZE_MB * 1024 * 1024;
+#elif defined(__LP64__)
+static const UINT64 MAX_DLSIZE = 1024 * 1024 * 1024;
+#else
+static const UINT64 MAX_DLSIZE = 256 * 1024 * 1024;
+#endif
+
+/* Streaming flash: when a partition has been selected with
+   fastboot_set_flash_stream(), the next download is not buffered
+   entirely.  The download buffer is split into a ring of segments
+   and each segment is written to the partition as soon as it is
+   full, while the transport is already receiving the next one.  */
+static const UINTN STREAM_SEGMENT_SIZE = 8 * 1024 * 1024;
+static const UINTN STREAM_MIN_SEGMENTS = 2;
+
+static struct flash_stream {
+	CHAR16 *label;
+	BOOLEAN resume;		/* Rest of an interrupted stream */
+	BOOLEAN active;
+	UINTN seg_size;
+	UINTN nb_seg;
+	UINTN cur_seg;
+	UINTN seg_used;
+	EFI_STATUS status;
+} stream;
+
+/* Pipelined flash: when enabled with fastboot_set_flash_pipeline(),
+   the download buffer is split in two halves.  A flash command of a
+   regular partition only queues the downloaded image, answers OKAY
+   right away and the next download is received in the other half
+   while the queued image is written by the main loop.  The queue
+   depth is one: the next flash command waits for the previous one.
+   The first failure is reported by the flash-status variable and by
+   the next command which is neither getvar nor download.  */
+static struct flash_pipeline {
+	BOOLEAN enabled;
+	VOID *base;
+	UINTN full_size;
+	UINTN cur;
+	CHAR16 *label;
+	CHAR8 *data;
+	UINTN size;
+	UINTN done;
+	CHAR16 *failed;
+	EFI_STATUS status;
+} pipe;
+
+/* Download benchmark: when armed with fastboot_set_bench_download(),
+   the next download is received by transfers of the selected size at
+   the beginning of the download buffer and discarded.  It is not
+   limited by the download buffer size.  */
+static struct download_bench {
+	UINTN transfer_size;
+	BOOLEAN active;
+	UINT64 start;
+	struct fastboot_bench_result result;
+} bench;
+
+/* Upload: the data announced by the DATA response is sent by the
+   chunks NEXT() returns, each one once the previous one has been
+   transmitted.  A NEXT() error does not stop the transfer, the host
+   would lose sync, it is reported by the final FAIL response.  The
+   staged data, see fastboot_stage(), is uploaded the same way by the
+   upload command.  */
+static struct upload {
+	EFI_STATUS (*next)(void **data, UINTN *len);
+	void (*end)(void);
+	UINT64 size;
+	UINT64 sent;
+	EFI_STATUS status;
+} up;
+
+static UINTN staged_size;
+
+/* CRC32 of the download, updated as each transfer completes while
+   the transport is already receiving the next one.  It can be checked
+   against the value given with download:<size>:<crc> before the data
+   is used.  */
+static struct download_crc {
+	UINT32 crc;
+	UINT32 expected;
+	BOOLEAN check;
+	BOOLEAN valid;		/* CRC of a complete download */
+} dlcrc;
+
+static unsigned received_len;
+static unsigned last_received_len;
+#define DATA_PROGRESS_THRESHOLD (5 * 1024 * 1024)
 
 #ifndef FASTBOOT_FOR_NON_ANDROID
 static const char *flash_locked_whitelist[] = {
@@ -170,6 +297,33 @@ void printProgress(int done, int total) {
 	sec = boottime_in_msec() / 1000;
 }
 
+/* Completions can be a few KiB each, network fragments for instance:
+   printProgress() is only called every PROGRESS_INTERVAL_USEC.  */
+#define PROGRESS_INTERVAL_USEC	(250 * 1000)
+
+static void download_progress(void)
+{
+	static uint64_t last;
+	uint64_t now = timer_ticks();
+
+	if (received_len < dl.size &&
+	    ticks_to_usec(now - last) < PROGRESS_INTERVAL_USEC)
+		return;
+
+	last = now;
+	printProgress((received_len / MiB), (dl.size / MiB));
+}
+
+/* Size of the next download read: one transfer unit of the transport,
+   if it has a preferred one, so that it is not split.  */
+static UINT32 download_read_size(void)
+{
+	UINT32 left = dl.size - received_len;
+	UINT32 unit = transport_transfer_unit();
+
+	return unit ? min(left, unit) : left;
+}
+
 struct download_buffer *fastboot_download_buffer(void)
 {
 	return &dl;
@@ -224,17 +378,52 @@ void fastboot_cmdlist_unregister(cmdlist_t *list)
 	*list = NULL;
 }
 
-struct fastboot_var *fastboot_getvar(const char *name)
+static struct fastboot_var *get_partition_vars(UINTN *nb);
+
+/* FNV-1a hash */
+static UINTN var_hash(const char *name)
+{
+	UINT32 hash = 2166136261U;
+
+	for (; *name; name++)
+		hash = (hash ^ (UINT8)*name) * 16777619U;
+
+	return hash & (VAR_HASH_SIZE - 1);
+}
+
+static struct fastboot_var *var_lookup(struct fastboot_var **buckets,
+				       const char *name)
 {
 	struct fastboot_var *var;
 
-	for (var = varlist; var; var = var->next)
+	for (var = buckets[var_hash(name)]; var; var = var->hnext)
 		if (!strcmp((CHAR8 *)name, (const CHAR8 *)var->name))
 			return var;
 
 	return NULL;
 }
 
+static void var_insert(struct fastboot_var **buckets, struct fastboot_var *var)
+{
+	UINTN hash = var_hash(var->name);
+
+	var->hnext = buckets[hash];
+	buckets[hash] = var;
+}
+
+struct fastboot_var *fastboot_getvar(const char *name)
+{
+	struct fastboot_var *var;
+	UINTN nb;
+
+	var = var_lookup(var_buckets, name);
+	if (var)
+		return var;
+
+	get_partition_vars(&nb);
+	return var_lookup(partvar_buckets, name);
+}
+
 static struct fastboot_var *fastboot_getvar_or_create(const char *name)
 {
 	struct fastboot_var *var;
@@ -246,16 +435,20 @@ static struct fastboot_var *fastboot_getvar_or_create(const char *name)
 		return NULL;
 	}
 
-	var = fastboot_getvar(name);
+	var = var_lookup(var_buckets, name);
 	if (!var) {
 		var = AllocateZeroPool(sizeof(*var));
 		if (!var) {
 			error(L"Failed to allocate variable '%a'", name);
 			return NULL;
 		}
-		var->next = varlist;
-		varlist = var;
 		CopyMem(var->name, name, size);
+		if (varlist_tail)
+			varlist_tail->next = var;
+		else
+			varlist = var;
+		varlist_tail = var;
+		var_insert(var_buckets, var);
 	}
 
 	return var;
@@ -268,16 +461,22 @@ static void delete_var_starting_with(const char *prefix)
 	struct fastboot_var *next;
 
 	old_varlist = varlist;
-	varlist = NULL;
+	varlist = varlist_tail = NULL;
+	ZeroMem(var_buckets, sizeof(var_buckets));
 
 	for (var = old_varlist; var; var = next) {
 		next = var->next;
 		if (!memcmp(prefix, var->name, strlena((CHAR8 *)prefix))) {
 			FreePool(var);
-		} else {
-			var->next = varlist;
-			varlist = var;
+			continue;
 		}
+		var->next = NULL;
+		if (varlist_tail)
+			varlist_tail->next = var;
+		else
+			varlist = var;
+		varlist_tail = var;
+		var_insert(var_buckets, var);
 	}
 }
 
@@ -290,10 +489,12 @@ static void fastboot_unpublish_all()
 		FreePool(var);
 	}
 
-	varlist = NULL;
+	varlist = varlist_tail = NULL;
+	ZeroMem(var_buckets, sizeof(var_buckets));
 }
 
-EFI_STATUS fastboot_publish_dynamic(const char *name, const char *(get_value)(void))
+static EFI_STATUS publish_dynamic(const char *name, const char *(get_value)(void),
+				  BOOLEAN memoize)
 {
 	struct fastboot_var *var;
 
@@ -305,10 +506,22 @@ EFI_STATUS fastboot_publish_dynamic(const char *name, const char *(get_value)(vo
 		return EFI_INVALID_PARAMETER;
 
 	var->get_value = get_value;
+	var->memoize = memoize;
+	var->cached = FALSE;
 
 	return EFI_SUCCESS;
 }
 
+EFI_STATUS fastboot_publish_dynamic(const char *name, const char *(get_value)(void))
+{
+	return publish_dynamic(name, get_value, FALSE);
+}
+
+EFI_STATUS fastboot_publish_lazy(const char *name, const char *(get_value)(void))
+{
+	return publish_dynamic(name, get_value, TRUE);
+}
+
 EFI_STATUS fastboot_publish(const char *name, const char *value)
 {
 	struct fastboot_var *var;
@@ -372,7 +585,28 @@ static const char *get_psize_str(UINT64 size)
 	return part_size;
 }
 
-static EFI_STATUS publish_part(CHAR16 *part_name, UINT64 size, EFI_GUID *guid)
+static EFI_STATUS add_partition_var(const char *name, const char *value,
+				    BOOLEAN unique)
+{
+	struct fastboot_var *var;
+	UINTN len;
+
+	if (unique && var_lookup(partvar_buckets, name))
+		return EFI_SUCCESS;
+
+	len = strlena((CHAR8 *)value) + 1;
+	if (partvars_nb == partvars_max || len > sizeof(var->value))
+		return EFI_BUFFER_TOO_SMALL;
+
+	var = &partvars[partvars_nb++];
+	CopyMem(var->name, name, strlena((CHAR8 *)name) + 1);
+	CopyMem(var->value, value, len);
+	var_insert(partvar_buckets, var);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS add_partition(CHAR16 *part_name, UINT64 size, EFI_GUID *guid)
 {
 	struct descriptor {
 		const char *name;
@@ -397,7 +631,7 @@ static EFI_STATUS publish_part(CHAR16 *part_name, UINT64 size, EFI_GUID *guid)
 		if (len < 0 || len >= (int)sizeof(var))
 			return EFI_INVALID_PARAMETER;
 
-		ret = fastboot_publish(var, "yes");
+		ret = add_partition_var(var, "yes", TRUE);
 		if (EFI_ERROR(ret))
 			return ret;
 	}
@@ -412,7 +646,7 @@ static EFI_STATUS publish_part(CHAR16 *part_name, UINT64 size, EFI_GUID *guid)
 		if (len < 0 || len >= (int)sizeof(var))
 			return EFI_INVALID_PARAMETER;
 
-		ret = fastboot_publish(var, desc->value);
+		ret = add_partition_var(var, desc->value, FALSE);
 		if (EFI_ERROR(ret))
 			return ret;
 	}
@@ -495,42 +729,108 @@ static EFI_STATUS publish_slots(void)
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS publish_partsize(void)
+static void free_partition_vars(void)
+{
+	if (partvars)
+		FreePool(partvars);
+	partvars = NULL;
+	partvars_nb = partvars_max = 0;
+	ZeroMem(partvar_buckets, sizeof(partvar_buckets));
+}
+
+static EFI_STATUS build_partition_vars(void)
 {
 	EFI_STATUS ret;
 	struct gpt_partition_interface *gparti;
 	UINTN part_count;
 	UINTN i;
 
+	free_partition_vars();
+
 	ret = gpt_list_partition(&gparti, &part_count, LOGICAL_UNIT_USER);
 	if (EFI_ERROR(ret) || part_count == 0)
 		return EFI_SUCCESS;
 
+	/* Up to four variables per partition, plus the data/userdata
+	   aliases */
+	partvars_max = (part_count + 2) * 4;
+	partvars = AllocateZeroPool(partvars_max * sizeof(*partvars));
+	if (!partvars) {
+		partvars_max = 0;
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
 	for (i = 0; i < part_count; i++) {
 		UINT64 size;
 
 		size = gparti[i].bio->Media->BlockSize
 			* (gparti[i].part.ending_lba + 1 - gparti[i].part.starting_lba);
 
-		ret = publish_part(gparti[i].part.name, size, &gparti[i].part.type);
+		ret = add_partition(gparti[i].part.name, size, &gparti[i].part.type);
 		if (EFI_ERROR(ret))
-			return ret;
+			goto out;
 
 		/* stay compatible with userdata/data naming */
 		if (!StrCmp(gparti[i].part.name, L"data")) {
-			ret = publish_part(L"userdata", size, &gparti[i].part.type);
+			ret = add_partition(L"userdata", size, &gparti[i].part.type);
 			if (EFI_ERROR(ret))
-				return ret;
+				goto out;
 		} else if (!StrCmp(gparti[i].part.name, L"userdata")) {
-			ret = publish_part(L"data", size, &gparti[i].part.type);
+			ret = add_partition(L"data", size, &gparti[i].part.type);
 			if (EFI_ERROR(ret))
-				return ret;
+				goto out;
 		}
 	}
 
+out:
 	FreePool(gparti);
+	if (EFI_ERROR(ret))
+		free_partition_vars();
 
-	return EFI_SUCCESS;
+	return ret;
+}
+
+static struct fastboot_var *get_partition_vars(UINTN *nb)
+{
+	EFI_STATUS ret;
+
+	if (!partvars || partvars_generation != gpt_cache_generation()) {
+		ret = build_partition_vars();
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to build partition variables");
+		/* Listing the partitions may have loaded the GPT cache */
+		partvars_generation = gpt_cache_generation();
+	}
+
+	*nb = partvars_nb;
+	return partvars;
+}
+
+/* getvar partition-table sends one INFO line per partition,
+   "<label>,<type>,<size in hex>,<y if it has a slot>,<u|f>", the last
+   field telling whether the partition is on the user or the factory
+   logical unit.  The number of partitions is returned in the OKAY
+   response.  */
+static UINTN send_partition_table(logical_unit_t log_unit, char unit)
+{
+	struct gpt_partition_interface *gparti;
+	UINTN i, part_count;
+	UINT64 size;
+
+	if (EFI_ERROR(gpt_list_partition(&gparti, &part_count, log_unit)))
+		return 0;
+
+	for (i = 0; i < part_count; i++) {
+		size = gparti[i].bio->Media->BlockSize
+			* (gparti[i].part.ending_lba + 1 - gparti[i].part.starting_lba);
+		fastboot_info("%s,%a,%llx,%c,%c", gparti[i].part.name,
+			      get_ptype_str(&gparti[i].part.type), size,
+			      slot_base(gparti[i].part.name) ? 'y' : 'n', unit);
+	}
+
+	FreePool(gparti);
+	return part_count;
 }
 
 static const char *get_battery_voltage_var()
@@ -573,6 +873,55 @@ static const char *get_battery_soc_ok_var()
 	return battery_soc_ok;
 }
 
+static const char *get_download_crc_var()
+{
+	static char crc_str[11];
+
+	if (!dlcrc.valid)
+		return "";
+
+	if (efi_snprintf((CHAR8 *)crc_str, sizeof(crc_str), (CHAR8 *)"0x%08x",
+			 dlcrc.crc) < 0)
+		return "";
+
+	return crc_str;
+}
+
+static const char *get_flash_checkpoint_var()
+{
+	static char checkpoint_str[MAX_VARIABLE_LENGTH];
+	struct flash_checkpoint cp;
+
+	if (EFI_ERROR(flash_checkpoint_get(&cp)))
+		return "";
+
+	if (efi_snprintf((CHAR8 *)checkpoint_str, sizeof(checkpoint_str),
+			 (CHAR8 *)"%s:0x%lx:0x%lx:0x%08x", cp.label,
+			 cp.offset, cp.size, cp.crc) < 0)
+		return "";
+
+	return checkpoint_str;
+}
+
+static const char *get_flash_status_var()
+{
+	static char status_str[MAX_VARIABLE_LENGTH];
+
+	if (pipe.label) {
+		if (efi_snprintf((CHAR8 *)status_str, sizeof(status_str),
+				 (CHAR8 *)"pending:%s", pipe.label) < 0)
+			return "";
+	} else if (pipe.failed) {
+		if (efi_snprintf((CHAR8 *)status_str, sizeof(status_str),
+				 (CHAR8 *)"failed:%s:%r", pipe.failed,
+				 pipe.status) < 0)
+			return "";
+	} else
+		return "okay";
+
+	return status_str;
+}
+
 static const char *get_erase_block_size_var()
 {
 	static char erase_block_size[MAX_VARIABLE_LENGTH];
@@ -652,28 +1001,36 @@ void fastboot_ack(const char *code, const char *fmt, va_list ap)
 
 void fastboot_ack_buffered(const char *code, const char *fmt, va_list ap)
 {
-	struct fastboot_tx_buffer *new_txbuf;
-	struct fastboot_tx_buffer *txbuf;
+	struct fastboot_tx_buffer *new_txbuf = NULL;
 	EFI_STATUS ret;
-
-	new_txbuf = AllocateZeroPool(sizeof(*new_txbuf));
-	if (!new_txbuf) {
-		error(L"Failed to allocate memory");
-		return;
+	char *msg;
+
+	if (!txbuf_head && tx_ring_count < TX_RING_SIZE) {
+		msg = tx_ring[(tx_ring_head + tx_ring_count) % TX_RING_SIZE];
+		ZeroMem(msg, MAGIC_LENGTH);
+	} else {
+		new_txbuf = AllocateZeroPool(sizeof(*new_txbuf));
+		if (!new_txbuf) {
+			error(L"Failed to allocate memory");
+			return;
+		}
+		msg = new_txbuf->msg;
 	}
 
-	ret = fastboot_build_ack_msg(new_txbuf->msg, code, fmt, ap);
+	ret = fastboot_build_ack_msg(msg, code, fmt, ap);
 	if (EFI_ERROR(ret)) {
-		FreePool(new_txbuf);
+		if (new_txbuf)
+			FreePool(new_txbuf);
 		return;
 	}
-	if (!txbuf_head)
-		txbuf_head = new_txbuf;
+
+	if (!new_txbuf)
+		tx_ring_count++;
+	else if (!txbuf_head)
+		txbuf_head = txbuf_tail = new_txbuf;
 	else {
-		txbuf = txbuf_head;
-		while (txbuf->next)
-			txbuf = txbuf->next;
-		txbuf->next = new_txbuf;
+		txbuf_tail->next = new_txbuf;
+		txbuf_tail = new_txbuf;
 	}
 	fastboot_state = STATE_TX;
 }
@@ -734,13 +1091,22 @@ static void flush_tx_buffer(void)
 	struct fastboot_tx_buffer *msg;
 	static CHAR8 buf[sizeof(msg->msg)];
 
-	msg = txbuf_head;
-	txbuf_head = txbuf_head->next;
-	if (!txbuf_head)
+	if (tx_ring_count) {
+		memcpy(buf, tx_ring[tx_ring_head], sizeof(buf));
+		tx_ring_head = (tx_ring_head + 1) % TX_RING_SIZE;
+		tx_ring_count--;
+	} else {
+		msg = txbuf_head;
+		txbuf_head = txbuf_head->next;
+		if (!txbuf_head)
+			txbuf_tail = NULL;
+		memcpy(buf, msg->msg, sizeof(buf));
+		FreePool(msg);
+	}
+
+	if (!tx_ring_count && !txbuf_head)
 		fastboot_state = next_state;
 
-	memcpy(buf, msg->msg, sizeof(buf));
-	FreePool(msg);
 	ret = transport_write(buf, sizeof(buf));
 	if (EFI_ERROR(ret))
 		fastboot_state = STATE_ERROR;
@@ -755,12 +1121,21 @@ static BOOLEAN is_in_white_list(const CHAR8 *key, const char **white_list)
 	return FALSE;
 }
 
+/* The lazy variables values may depend on the storage device */
+static void forget_lazy_values(void)
+{
+	struct fastboot_var *var;
+
+	for (var = varlist; var; var = var->next)
+		var->cached = FALSE;
+}
+
 EFI_STATUS refresh_partition_var(void)
 {
 	EFI_STATUS ret;
 
-	delete_var_starting_with("partition-");
-	delete_var_starting_with("has-slot");
+	forget_lazy_values();
+	free_partition_vars();
 	delete_var_starting_with("slot-");
 	delete_var_starting_with("current-slot");
 
@@ -770,11 +1145,130 @@ EFI_STATUS refresh_partition_var(void)
 		return ret;
 	}
 
-	ret = publish_slots();
+	return publish_slots();
+}
+
+static void flash_pipeline_complete(EFI_STATUS ret)
+{
+	if (!EFI_ERROR(ret))
+		info(L"Pipelined flash of %s done.", pipe.label);
+	else {
+		efi_perror(ret, L"Pipelined flash of %s failed", pipe.label);
+		/* Only the first failure is reported */
+		if (!pipe.failed) {
+			pipe.failed = pipe.label;
+			pipe.status = ret;
+			pipe.label = NULL;
+		}
+	}
+
+	if (pipe.label) {
+		FreePool(pipe.label);
+		pipe.label = NULL;
+	}
+	pipe.data = NULL;
+	pipe.size = pipe.done = 0;
+}
+
+/* Write the next segment of the queued image */
+static void flash_pipeline_step(void)
+{
+	EFI_STATUS ret;
+	UINTN len;
+
+	if (!pipe.label)
+		return;
+
+	len = min(STREAM_SEGMENT_SIZE, pipe.size - pipe.done);
+	ret = flash_stream_write(pipe.data + pipe.done, len);
+	if (EFI_ERROR(ret)) {
+		flash_stream_abort();
+		flash_pipeline_complete(ret);
+		return;
+	}
+
+	pipe.done += len;
+	if (pipe.done < pipe.size)
+		return;
+
+	ret = flash_stream_end(pipe.label);
+	if (!EFI_ERROR(ret))
+		gpt_sync_data();
+	flash_pipeline_complete(ret);
+}
+
+static BOOLEAN flash_pipeline_barrier_needed(const char *cmd)
+{
+	if (!pipe.label && !pipe.failed)
+		return FALSE;
+
+	if (!strcmp((CHAR8 *)cmd, (CHAR8 *)"getvar"))
+		return FALSE;
+
+	return strcmp((CHAR8 *)cmd, (CHAR8 *)"download") || stream.label;
+}
+
+static void flash_pipeline_clear_status(void)
+{
+	if (pipe.failed) {
+		FreePool(pipe.failed);
+		pipe.failed = NULL;
+	}
+	pipe.status = EFI_SUCCESS;
+}
+
+/* Complete the queued image and report a pending failure to the
+   host.  Return FALSE if a pipelined flash has failed.  */
+static BOOLEAN flash_pipeline_barrier(void)
+{
+	while (pipe.label)
+		flash_pipeline_step();
+
+	if (!pipe.failed)
+		return TRUE;
+
+	fastboot_fail("Pipelined flash of %s failed, %r", pipe.failed,
+		      pipe.status);
+	flash_pipeline_clear_status();
+	return FALSE;
+}
+
+/* Wait for the background erase of oem erase-quick.  Its failure is
+   reported on the command which follows, the host got OKAY already.  */
+static BOOLEAN background_erase_barrier(void)
+{
+	EFI_STATUS ret;
+
+	ret = storage_erase_wait();
+	if (!EFI_ERROR(ret))
+		return TRUE;
+
+	fastboot_fail("Background erase failed, %r", ret);
+	return FALSE;
+}
+
+/* Queue the downloaded image and receive the next download in the
+   other half of the buffer */
+static EFI_STATUS flash_pipeline_queue(CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	ret = flash_stream_start(label, dl.size);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	return publish_partsize();
+	pipe.label = label;
+	pipe.data = dl.data;
+	pipe.size = dl.size;
+	pipe.done = 0;
+
+	pipe.cur = !pipe.cur;
+	dl.data = (CHAR8 *)pipe.base + pipe.cur * dl.max_size;
+	dl.size = 0;
+	staged_size = 0;
+
+	info(L"Flashing %s in the background ...", label);
+	return EFI_SUCCESS;
 }
 
 static void cmd_flash(INTN argc, CHAR8 **argv)
@@ -801,16 +1295,35 @@ static void cmd_flash(INTN argc, CHAR8 **argv)
 		fastboot_fail("Allocation error");
 		return;
 	}
+
+	if (pipe.enabled && dl.size && flash_is_partition(label)) {
+		ret = flash_pipeline_queue(label);
+		if (EFI_ERROR(ret)) {
+			FreePool(label);
+			fastboot_fail("Flash failure: %r", ret);
+			return;
+		}
+
+		fastboot_okay("");
+		return;
+	}
+
 	info(L"Flashing %s ...", label);
 
 	ret = flash(dl.data, dl.size, label);
-	FreePool(label);
 	if (EFI_ERROR(ret)) {
+		FreePool(label);
 		fastboot_fail("Flash failure: %r", ret);
 		return;
 	}
 
-	gpt_sync();
+	/* Special targets, bootloader or partition table, must be
+	   durable right away */
+	if (flash_is_partition(label))
+		gpt_sync_data();
+	else
+		gpt_sync();
+	FreePool(label);
 
 	/* update partition variable in case it has changed */
 	if (ret & REFRESH_PARTITION_VAR) {
@@ -880,25 +1393,34 @@ static void cmd_boot(__attribute__((__unused__)) INTN argc,
 static const char *fastboot_var_value(struct fastboot_var *var)
 {
 	const char *value;
+	UINTN valuelen;
 
-	if (!var->get_value)
+	if (!var->get_value || var->cached)
 		return var->value;
 
 	value = var->get_value();
 	if (!value)
 		return "";
 
-	if (strlena((CHAR8 *)value) + 1 > sizeof(var->value)) {
+	valuelen = strlena((CHAR8 *)value) + 1;
+	if (valuelen > sizeof(var->value)) {
 		error(L"value too long for '%a' variable");
 		return "";
 	}
 
+	if (var->memoize) {
+		CopyMem(var->value, value, valuelen);
+		var->cached = TRUE;
+	}
+
 	return value;
 }
 
 static void cmd_getvar(INTN argc, CHAR8 **argv)
 {
 	struct fastboot_var *var;
+	UINTN i, nb;
+
 	if (argc != 2) {
 		fastboot_fail("Invalid parameter");
 		return;
@@ -907,10 +1429,21 @@ static void cmd_getvar(INTN argc, CHAR8 **argv)
 	if (!strcmp(argv[1], (CHAR8 *)"all")) {
 		for (var = varlist; var; var = var->next)
 			fastboot_info("%a: %a", var->name, fastboot_var_value(var));
+		var = get_partition_vars(&nb);
+		for (i = 0; i < nb; i++)
+			fastboot_info("%a: %a", var[i].name, var[i].value);
 		fastboot_okay("");
 		return;
 	}
 
+	if (!strcmp(argv[1], (CHAR8 *)"partition-table")) {
+		nb = send_partition_table(LOGICAL_UNIT_USER, 'u');
+		if (is_cur_storage_ufs())
+			nb += send_partition_table(LOGICAL_UNIT_FACTORY, 'f');
+		fastboot_okay("%d", nb);
+		return;
+	}
+
 	var = fastboot_getvar((char *)argv[1]);
 	if (NULL == var)
 		fastboot_fail("Unknown variable");
@@ -1051,6 +1584,14 @@ void fastboot_run_cmd(cmdlist_t list, const char *name, INTN argc, CHAR8 **argv)
 void fastboot_run_root_cmd(const char *name, INTN argc, CHAR8 **argv)
 {
 	fastboot_run_cmd(cmdlist, name, argc, argv);
+	/* Variables, misc and RPMB data written by a command must
+	 * survive a power loss
+	 */
+	efi_variable_commit();
+	misc_commit();
+#ifdef RPMB_STORAGE
+	rpmb_storage_commit();
+#endif
 }
 
 static void fastboot_read_command(void)
@@ -1058,6 +1599,392 @@ static void fastboot_read_command(void)
 	transport_read(command_buffer, command_buffer_size);
 }
 
+EFI_STATUS fastboot_set_flash_stream(const CHAR8 *label)
+{
+	if (stream.label) {
+		FreePool(stream.label);
+		stream.label = NULL;
+	}
+	stream.resume = FALSE;
+
+	if (!label)
+		return EFI_SUCCESS;
+
+	stream.label = stra_to_str(label);
+	if (!stream.label) {
+		error(L"Failed to get label %a", label);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS fastboot_set_flash_resume(const CHAR8 *label)
+{
+	EFI_STATUS ret;
+
+	ret = fastboot_set_flash_stream(label);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	stream.resume = TRUE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS publish_max_download_size(void)
+{
+	char download_max_str[30];
+
+	if (efi_snprintf((CHAR8 *)download_max_str, sizeof(download_max_str),
+			 (CHAR8 *)"0x%lX", dl.max_size) < 0) {
+		error(L"Failed to set download_max_str string");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	return fastboot_publish("max-download-size", download_max_str);
+}
+
+EFI_STATUS fastboot_set_flash_pipeline(BOOLEAN enable)
+{
+	UINTN half;
+
+	if (enable == pipe.enabled)
+		return EFI_SUCCESS;
+
+	/* Nothing may be in flight when the buffer is resized */
+	if (pipe.label || stream.active)
+		return EFI_ACCESS_DENIED;
+
+	if (enable) {
+		half = ALIGN_DOWN(dl.max_size / 2, EFI_PAGE_SIZE);
+		if (half < MIN_DLSIZE) {
+			error(L"Download buffer too small to be split");
+			return EFI_BUFFER_TOO_SMALL;
+		}
+
+		pipe.base = dl.data;
+		pipe.full_size = dl.max_size;
+		pipe.cur = 0;
+		dl.max_size = half;
+	} else {
+		dl.data = pipe.base;
+		dl.max_size = pipe.full_size;
+	}
+
+	pipe.enabled = enable;
+	dl.size = 0;
+	staged_size = 0;
+
+	return publish_max_download_size();
+}
+
+static EFI_STATUS stream_start(void)
+{
+	EFI_STATUS ret;
+
+	/* The CRC32 of the download carries on from the checkpoint so
+	   that it is the one of the whole image */
+	if (stream.resume)
+		ret = flash_stream_resume(stream.label, dl.size, &dlcrc.crc);
+	else
+		ret = flash_stream_start(stream.label, dl.size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	stream.seg_size = min(STREAM_SEGMENT_SIZE,
+			      dl.max_size / STREAM_MIN_SEGMENTS);
+	stream.nb_seg = dl.max_size / stream.seg_size;
+	stream.cur_seg = 0;
+	stream.seg_used = 0;
+	stream.status = EFI_SUCCESS;
+	stream.active = TRUE;
+
+	info(L"Streaming %ld bytes to %s ...", dl.size, stream.label);
+	return EFI_SUCCESS;
+}
+
+static CHAR8 *stream_segment(UINTN index)
+{
+	return (CHAR8 *)dl.data + index * stream.seg_size;
+}
+
+/* Complete the download CRC, return FALSE on mismatch */
+static BOOLEAN download_crc_check(void)
+{
+	dlcrc.valid = TRUE;
+	if (!dlcrc.check || dlcrc.crc == dlcrc.expected)
+		return TRUE;
+
+	error(L"Download CRC32 0x%08x, expected 0x%08x", dlcrc.crc,
+	      dlcrc.expected);
+	return FALSE;
+}
+
+static void stream_done(void)
+{
+	EFI_STATUS ret;
+
+	ret = stream.status;
+	if (!EFI_ERROR(ret) && !download_crc_check())
+		ret = EFI_CRC_ERROR;
+	if (EFI_ERROR(ret))
+		flash_stream_abort();
+	else
+		ret = flash_stream_end(stream.label);
+
+	if (!EFI_ERROR(ret)) {
+		if (flash_is_partition(stream.label))
+			gpt_sync_data();
+		else
+			gpt_sync();
+	}
+
+	stream.active = FALSE;
+	fastboot_set_flash_stream(NULL);
+	/* The download buffer content is meaningless now */
+	dl.size = 0;
+
+	fastboot_state = STATE_COMPLETE;
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Flash failure: %r", ret);
+		return;
+	}
+
+	info(L"Flash done.");
+	fastboot_okay("");
+}
+
+static void stream_process_rx(unsigned len)
+{
+	CHAR8 *seg, *data;
+	UINTN seg_len;
+
+	received_len += len;
+	stream.seg_used += len;
+	download_progress();
+
+	seg = stream_segment(stream.cur_seg);
+	data = seg + stream.seg_used - len;
+	seg_len = stream.seg_used + min(stream.seg_size - stream.seg_used,
+					dl.size - received_len);
+	if (stream.seg_used < seg_len) {
+		transport_read(seg + stream.seg_used, seg_len - stream.seg_used);
+		dlcrc.crc = crc32_update(dlcrc.crc, data, len);
+		return;
+	}
+
+	/* Queue the reception of the next segment before writing the
+	   current one so that the transport keeps receiving while the
+	   storage device is busy.  */
+	if (received_len < dl.size) {
+		stream.cur_seg = (stream.cur_seg + 1) % stream.nb_seg;
+		stream.seg_used = 0;
+		transport_read(stream_segment(stream.cur_seg),
+			       min(stream.seg_size, dl.size - received_len));
+	}
+	dlcrc.crc = crc32_update(dlcrc.crc, data, len);
+
+	/* On failure, keep receiving the data the host is sending to
+	   stay in sync with it and report the error at the end.  */
+	if (!EFI_ERROR(stream.status))
+		stream.status = flash_stream_write(seg, seg_len);
+	if (!EFI_ERROR(stream.status) && received_len < dl.size)
+		stream.status = flash_stream_checkpoint(dlcrc.crc);
+
+	if (received_len == dl.size)
+		stream_done();
+}
+
+EFI_STATUS fastboot_set_bench_download(UINTN transfer_size)
+{
+	if (transfer_size > dl.max_size)
+		return EFI_INVALID_PARAMETER;
+
+	bench.transfer_size = transfer_size;
+	return EFI_SUCCESS;
+}
+
+const struct fastboot_bench_result *fastboot_get_bench_download(void)
+{
+	return &bench.result;
+}
+
+static void bench_start(void)
+{
+	memset(&bench.result, 0, sizeof(bench.result));
+	transport_reset_stats();
+	bench.active = TRUE;
+	bench.start = timer_ticks();
+	info(L"Benchmarking the download of %ld bytes ...", dl.size);
+}
+
+static void bench_process_rx(unsigned len)
+{
+	received_len += len;
+	if (received_len < dl.size) {
+		transport_read(dl.data, min(bench.transfer_size,
+					    (UINTN)(dl.size - received_len)));
+		return;
+	}
+
+	bench.result.bytes = received_len;
+	bench.result.usec = ticks_to_usec(timer_ticks() - bench.start);
+	bench.result.rx = transport_get_stats()->rx;
+	bench.active = FALSE;
+	bench.transfer_size = 0;
+	/* The download buffer content is meaningless now */
+	dl.size = 0;
+
+	fastboot_state = STATE_COMPLETE;
+	fastboot_okay("");
+}
+
+EFI_STATUS fastboot_stage(UINTN size)
+{
+	if (size > dl.max_size)
+		return EFI_BUFFER_TOO_SMALL;
+
+	/* The staged data replaces the download */
+	dl.size = 0;
+	staged_size = size;
+	return EFI_SUCCESS;
+}
+
+static void upload_start(UINT64 size, EFI_STATUS (*next)(void **data, UINTN *len),
+			 void (*end)(void))
+{
+	static CHAR8 response[MAGIC_LENGTH];
+	EFI_STATUS ret;
+
+	up.next = next;
+	up.end = end;
+	up.size = size;
+	up.sent = 0;
+	up.status = EFI_SUCCESS;
+
+	if (efi_snprintf(response, sizeof(response), (CHAR8 *)"DATA%08x",
+			 (UINT32)size) < 0) {
+		if (end)
+			end();
+		fastboot_fail("Failed to format DATA response");
+		return;
+	}
+
+	fastboot_state = STATE_START_UPLOAD;
+	ret = transport_write(response, strlen((CHAR8 *)response));
+	if (EFI_ERROR(ret)) {
+		if (end)
+			end();
+		fastboot_state = STATE_ERROR;
+	}
+}
+
+static void upload_send(void)
+{
+	EFI_STATUS ret;
+	void *data;
+	UINTN len;
+
+	if (up.sent == up.size) {
+		if (up.end)
+			up.end();
+		fastboot_state = STATE_COMPLETE;
+		if (EFI_ERROR(up.status)) {
+			fastboot_fail("Upload failure: %r", up.status);
+			return;
+		}
+		info(L"Upload done.");
+		fastboot_okay("");
+		return;
+	}
+
+	ret = up.next(&data, &len);
+	if (EFI_ERROR(ret) && !EFI_ERROR(up.status))
+		up.status = ret;
+
+	len = min((UINT64)len, up.size - up.sent);
+	up.sent += len;
+	fastboot_state = STATE_UPLOAD;
+	ret = transport_write(data, len);
+	if (EFI_ERROR(ret)) {
+		if (up.end)
+			up.end();
+		fastboot_state = STATE_ERROR;
+	}
+}
+
+static EFI_STATUS staged_next(void **data, UINTN *len)
+{
+	*data = (CHAR8 *)dl.data + up.sent;
+	*len = min(up.size - up.sent, (UINT64)FETCH_MAX_SIZE);
+	return EFI_SUCCESS;
+}
+
+static void cmd_upload(INTN argc, __attribute__((__unused__)) CHAR8 **argv)
+{
+	if (argc != 1) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (!staged_size) {
+		fastboot_fail("No staged data");
+		return;
+	}
+
+	info(L"Uploading %ld bytes ...", staged_size);
+	upload_start(staged_size, staged_next, NULL);
+}
+
+/* fetch:<partition>[:<offset>:<size>], offset and size in hexadecimal.
+   The read-ahead buffers are taken from the download buffer.  */
+static void cmd_fetch(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	CHAR16 *label;
+	UINT64 offset = 0, size = 0;
+	char *endptr;
+
+	if (argc != 2 && argc != 4) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (argc == 4) {
+		offset = strtoull((const char *)argv[2], &endptr, 16);
+		if (*endptr == '\0')
+			size = strtoull((const char *)argv[3], &endptr, 16);
+		if (*endptr != '\0' || !size) {
+			fastboot_fail("Failed to parse the offset and size");
+			return;
+		}
+	}
+
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	staged_size = 0;
+	dl.size = 0;
+	ret = fetch_start(label, offset, &size, dl.data, dl.max_size);
+	FreePool(label);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Cannot read partition: %r", ret);
+		return;
+	}
+
+	if (size > FETCH_MAX_SIZE) {
+		fetch_end();
+		fastboot_fail("Fetch size too large, 0x%x max", FETCH_MAX_SIZE);
+		return;
+	}
+
+	info(L"Fetching %ld bytes of %a ...", size, argv[1]);
+	upload_start(size, fetch_next, fetch_end);
+}
+
 static void cmd_download(INTN argc, CHAR8 **argv)
 {
 	static CHAR8 response[MAGIC_LENGTH];
@@ -1065,7 +1992,7 @@ static void cmd_download(INTN argc, CHAR8 **argv)
 	int len;
 	char *endptr;
 
-	if (argc != 2) {
+	if (argc != 2 && argc != 3) {
 		fastboot_fail("Invalid parameter");
 		return;
 	}
@@ -1076,7 +2003,28 @@ static void cmd_download(INTN argc, CHAR8 **argv)
 		return;
 	}
 
-	if (dl.size > dl.max_size) {
+	memset(&dlcrc, 0, sizeof(dlcrc));
+	if (argc == 3) {
+		dlcrc.expected = strtoul((const char *)argv[2], &endptr, 16);
+		if (*endptr != '\0') {
+			dl.size = 0;
+			fastboot_fail("Failed to parse the download CRC32");
+			return;
+		}
+		dlcrc.check = TRUE;
+	}
+
+	staged_size = 0;
+	if (bench.transfer_size) {
+		bench_start();
+	} else if (stream.label) {
+		ret = stream_start();
+		if (EFI_ERROR(ret)) {
+			fastboot_set_flash_stream(NULL);
+			fastboot_fail("Cannot stream to partition: %r", ret);
+			return;
+		}
+	} else if (dl.size > dl.max_size) {
 		fastboot_fail("data too large");
 		return;
 	}
@@ -1102,7 +2050,13 @@ static void worker_download(void)
 {
 	EFI_STATUS ret;
 
-	ret = transport_read(dl.data, dl.size);
+	if (bench.active)
+		ret = transport_read(dl.data, min(bench.transfer_size, dl.size));
+	else if (stream.active)
+		ret = transport_read(stream_segment(0),
+				     min(stream.seg_size, dl.size));
+	else
+		ret = transport_read(dl.data, download_read_size());
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to receive %d bytes", dl.size);
 		fastboot_fail("Transport receive failed");
@@ -1127,15 +2081,39 @@ static void fastboot_process_tx(__attribute__((__unused__)) void *buf,
 	case STATE_START_DOWNLOAD:
 		worker_download();
 		break;
+	case STATE_START_UPLOAD:
+	case STATE_UPLOAD:
+		upload_send();
+		break;
 	default:
 		error(L"Unexpected tx event while in state %d", fastboot_state);
 		break;
 	}
 }
 
-static unsigned received_len;
-static unsigned last_received_len;
-#define DATA_PROGRESS_THRESHOLD (5 * 1024 * 1024)
+/* Time from fastboot_start() to the first command received */
+static uint64_t startup_ticks;
+static UINT64 startup_usec;
+
+UINT64 fastboot_get_startup_usec(void)
+{
+	return startup_usec;
+}
+
+/* The host is considered done with a batch of commands once it has
+   been idle for FLUSH_IDLE_MS: the deferred flushes are issued.  */
+#define FLUSH_IDLE_MS	1000
+static uint64_t last_command_ticks;
+
+static void flush_idle(void)
+{
+	if (fastboot_state != STATE_COMPLETE ||
+	    ticks_to_usec(timer_ticks() - last_command_ticks) < FLUSH_IDLE_MS * 1000)
+		return;
+
+	gpt_flush_pending();
+}
+
 static void fastboot_run_command()
 {
 #define MAX_ARGS 16
@@ -1146,13 +2124,26 @@ static void fastboot_run_command()
 	if (fastboot_state != STATE_COMMAND)
 		return;
 
+	if (startup_ticks) {
+		startup_usec = ticks_to_usec(timer_ticks() - startup_ticks);
+		startup_ticks = 0;
+	}
+	last_command_ticks = timer_ticks();
+
 	ret = string_to_argv(command_buffer, &argc, argv, MAX_ARGS, ":= ", " ");
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to split fastboot command line");
 		return;
 	}
 
-	fastboot_run_root_cmd((char *)argv[0], argc, argv);
+	/* Only getvar may run while an oem erase-quick completes.  A
+	   download may run while a pipelined flash completes, unless it
+	   is streamed to a partition itself */
+	if ((!strcmp(argv[0], (CHAR8 *)"getvar") ||
+	     background_erase_barrier()) &&
+	    (!flash_pipeline_barrier_needed((char *)argv[0]) ||
+	     flash_pipeline_barrier()))
+		fastboot_run_root_cmd((char *)argv[0], argc, argv);
 	received_len = 0;
 	last_received_len = 0;
 
@@ -1166,15 +2157,32 @@ static void fastboot_process_rx(void *buf, unsigned len)
 
 	switch (fastboot_state) {
 	case STATE_DOWNLOAD:
+		if (bench.active) {
+			bench_process_rx(len);
+			break;
+		}
+		if (stream.active) {
+			stream_process_rx(len);
+			break;
+		}
 		received_len += len;
-		printProgress((received_len / MiB), (dl.size / MiB));
+		download_progress();
 		if (received_len < dl.size) {
 			s = buf;
-			transport_read(&s[len], dl.size - received_len);
-		} else {
-			fastboot_state = STATE_COMPLETE;
-			fastboot_okay("");
+			transport_read(&s[len], download_read_size());
+			dlcrc.crc = crc32_update(dlcrc.crc, buf, len);
+			break;
+		}
+		dlcrc.crc = crc32_update(dlcrc.crc, buf, len);
+		fastboot_state = STATE_COMPLETE;
+		if (!download_crc_check()) {
+			/* Do not let a corrupted image be flashed */
+			dl.size = 0;
+			fastboot_fail("Download CRC32 mismatch, 0x%08x != 0x%08x",
+				      dlcrc.crc, dlcrc.expected);
+			break;
 		}
+		fastboot_okay("");
 		break;
 	case STATE_COMPLETE:
 		if (buf != command_buffer || len >= command_buffer_size) {
@@ -1194,20 +2202,139 @@ static void fastboot_process_rx(void *buf, unsigned len)
 
 static void fastboot_start_callback(void)
 {
+	/* The host left in the middle of a streamed download: abort it,
+	   its checkpoint lets the new session resume it.  */
+	if (stream.active) {
+		error(L"Stream to %s interrupted", stream.label);
+		flash_stream_abort();
+		stream.active = FALSE;
+		fastboot_set_flash_stream(NULL);
+		dl.size = 0;
+	}
+
 	fastboot_state = next_state;
 	fastboot_read_command();
 }
 
-static EFI_STATUS init_download_buffer(void)
+#ifndef __LP64__
+#define MAX_ADDRESS_4G 0x100000000ULL
+#endif
+
+/* Size of the largest free memory region the download buffer can be
+   allocated in.  */
+static UINT64 largest_free_region(void)
 {
-	UINTN size;
+	EFI_MEMORY_DESCRIPTOR *entry;
+	UINTN nr_entries, entry_sz, i;
+	CHAR8 *entries;
+	UINT64 start, end, largest = 0;
+
+	/* Adjacent free descriptors are merged */
+	if (EFI_ERROR(memmap_get(&entries, &nr_entries, &entry_sz, NULL)))
+		return 0;
+
+	for (i = 0; i < nr_entries; i++) {
+		entry = (EFI_MEMORY_DESCRIPTOR *)(entries + i * entry_sz);
+		if (entry->Type != EfiConventionalMemory)
+			continue;
 
-	for (size = MAX_DLSIZE; size >= MIN_DLSIZE; size /= 2) {
-		dl.data = AllocatePool(size);
-		if (!dl.data)
+		start = entry->PhysicalStart;
+		end = start + entry->NumberOfPages * EFI_PAGE_SIZE;
+#ifndef __LP64__
+		if (start >= MAX_ADDRESS_4G)
 			continue;
+		end = min(end, MAX_ADDRESS_4G);
+#endif
+		largest = max(largest, end - start);
+	}
+
+	return largest;
+}
+
+/* Pages are suitable for DMA unless the boot device requires a larger
+   alignment.  */
+static UINTN download_buffer_alignment(void)
+{
+	EFI_HANDLE handle;
+	EFI_BLOCK_IO *bio;
+	EFI_STATUS ret;
+
+	handle = get_boot_device_handle();
+	if (!handle)
+		return EFI_PAGE_SIZE;
+
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, handle,
+				&BlockIoProtocol, (VOID **)&bio);
+	if (EFI_ERROR(ret) || bio->Media->IoAlign <= EFI_PAGE_SIZE)
+		return EFI_PAGE_SIZE;
 
-		dl.max_size = size;
+	return bio->Media->IoAlign;
+}
+
+static EFI_STATUS allocate_download_buffer(UINT64 size, UINTN align)
+{
+	EFI_STATUS ret;
+	EFI_ALLOCATE_TYPE type;
+	EFI_PHYSICAL_ADDRESS addr;
+	UINTN pages;
+
+	pages = EFI_SIZE_TO_PAGES(size + align - EFI_PAGE_SIZE);
+#ifdef __LP64__
+	type = AllocateAnyPages;
+	addr = 0;
+#else
+	type = AllocateMaxAddress;
+	addr = MAX_ADDRESS_4G - 1;
+#endif
+	ret = uefi_call_wrapper(BS->AllocatePages, 4, type, EfiLoaderData,
+				pages, &addr);
+	if (EFI_ERROR(ret)) {
+		mt_failure(MT_DOWNLOAD, EFI_PAGES_TO_SIZE(pages));
+		return ret;
+	}
+
+	mt_track(MT_DOWNLOAD, (VOID *)(UINTN)addr, EFI_PAGES_TO_SIZE(pages));
+	dl_base = addr;
+	dl_pages = pages;
+	dl.data = (VOID *)(UINTN)((addr + align - 1) & ~((UINT64)align - 1));
+	dl.max_size = size;
+	return EFI_SUCCESS;
+}
+
+static void free_download_buffer(void)
+{
+	if (!dl.data)
+		return;
+
+	mt_untrack((VOID *)(UINTN)dl_base);
+	uefi_call_wrapper(BS->FreePages, 2, dl_base, dl_pages);
+	dl.data = NULL;
+	dl.max_size = dl.size = 0;
+	dl_base = 0;
+	dl_pages = 0;
+}
+
+static EFI_STATUS init_download_buffer(void)
+{
+	EFI_STATUS ret;
+	UINT64 size, largest;
+	UINTN align;
+
+	largest = largest_free_region();
+	size = largest > DLSIZE_RESERVE + MIN_DLSIZE ?
+		largest - DLSIZE_RESERVE : MIN_DLSIZE;
+	size = min(size, MAX_DLSIZE) & ~((UINT64)MIN_DLSIZE - 1);
+	align = download_buffer_alignment();
+
+	/* The memory map may have changed since it was read */
+	for (; size >= MIN_DLSIZE; size /= 2) {
+		ret = allocate_download_buffer(size, align);
+		if (EFI_ERROR(ret))
+			continue;
+
+		debug(L"%ld MB download buffer at 0x%lx, largest free region %ld MB",
+		      size / 1024 / 1024, (UINT64)(UINTN)dl.data,
+		      largest / 1024 / 1024);
 		return EFI_SUCCESS;
 	}
 
@@ -1227,7 +2354,9 @@ static struct fastboot_cmd COMMANDS[] = {
 	{ "reboot-bootloader",	LOCKED,		cmd_reboot_bootloader },
 	{ "reboot-recovery",	LOCKED,		cmd_reboot_recovery },
 	{ "reboot-fastboot",	LOCKED,		cmd_reboot_fastbootd },
-	{ "set_active",		UNLOCKED,	cmd_set_active }
+	{ "set_active",		UNLOCKED,	cmd_set_active },
+	{ "fetch",		UNLOCKED,	cmd_fetch },
+	{ "upload",		LOCKED,		cmd_upload }
 };
 #else
 static struct fastboot_cmd COMMANDS[] = {
@@ -1294,11 +2423,11 @@ static EFI_STATUS fastboot_init()
 	data = NULL;
 #endif
 
-	ret = fastboot_publish("variant", info_variant());
+	ret = fastboot_publish_lazy("variant", info_variant);
 	if (EFI_ERROR(ret))
 		goto error;
 
-	ret = fastboot_publish("hw-revision", info_hw_revision());
+	ret = fastboot_publish_lazy("hw-revision", info_hw_revision);
 	if (EFI_ERROR(ret))
 		goto error;
 
@@ -1310,6 +2439,11 @@ static EFI_STATUS fastboot_init()
 	if (EFI_ERROR(ret))
 		goto error;
 
+	/* Images can be downloaded as LZ4 frames, see flash.c */
+	ret = fastboot_publish("compression", "lz4");
+	if (EFI_ERROR(ret))
+		goto error;
+
 	ret = fastboot_publish_dynamic("battery-voltage", get_battery_voltage_var);
 	if (EFI_ERROR(ret))
 		goto error;
@@ -1322,30 +2456,41 @@ static EFI_STATUS fastboot_init()
 	if (EFI_ERROR(ret))
 		goto error;
 
+	ret = publish_max_download_size();
+	if (EFI_ERROR(ret))
+		goto error;
+
 	if (efi_snprintf((CHAR8 *)download_max_str, sizeof(download_max_str),
-			 (CHAR8 *)"0x%lX", dl.max_size) < 0) {
-		error(L"Failed to set download_max_str string");
+			 (CHAR8 *)"0x%X", FETCH_MAX_SIZE) < 0) {
 		ret = EFI_INVALID_PARAMETER;
 		goto error;
 	}
 
-	ret = fastboot_publish("max-download-size", download_max_str);
+	ret = fastboot_publish("max-fetch-size", download_max_str);
 	if (EFI_ERROR(ret))
 		goto error;
 
-	ret = fastboot_publish_dynamic("erase-block-size", get_erase_block_size_var);
+	ret = fastboot_publish_dynamic("download-crc", get_download_crc_var);
 	if (EFI_ERROR(ret))
 		goto error;
 
-	ret = fastboot_publish_dynamic("logical-block-size", get_logical_block_size_var);
+	ret = fastboot_publish_dynamic("flash-status", get_flash_status_var);
 	if (EFI_ERROR(ret))
 		goto error;
 
-	ret = fastboot_publish_dynamic("boot-device", get_boot_device_var);
+	ret = fastboot_publish_dynamic("flash-checkpoint", get_flash_checkpoint_var);
 	if (EFI_ERROR(ret))
 		goto error;
 
-	ret = publish_partsize();
+	ret = fastboot_publish_lazy("erase-block-size", get_erase_block_size_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
+	ret = fastboot_publish_lazy("logical-block-size", get_logical_block_size_var);
+	if (EFI_ERROR(ret))
+		goto error;
+
+	ret = fastboot_publish_lazy("boot-device", get_boot_device_var);
 	if (EFI_ERROR(ret))
 		goto error;
 
@@ -1394,6 +2539,54 @@ static void *fastboot_efiimage;
 static UINTN fastboot_imagesize;
 static enum boot_target fastboot_target;
 
+/* Download buffer handover: the image of a boot or an efirun flash is
+   used where it has been received.  The download buffer pages are
+   given to the caller of fastboot_start() which releases them with
+   fastboot_free_image().  The next fastboot_start() allocates a new
+   download buffer.  */
+static BOOLEAN handover_pending;
+static struct {
+	EFI_PHYSICAL_ADDRESS base;
+	UINTN pages;
+} handover;
+
+static BOOLEAN in_download_buffer(EFI_PHYSICAL_ADDRESS base, UINTN pages,
+				  void *image)
+{
+	EFI_PHYSICAL_ADDRESS addr = (EFI_PHYSICAL_ADDRESS)(UINTN)image;
+
+	return pages && addr >= base && addr < base + EFI_PAGES_TO_SIZE(pages);
+}
+
+static void download_buffer_handover(void)
+{
+	handover.base = dl_base;
+	handover.pages = dl_pages;
+	dl.data = NULL;
+	dl.max_size = dl.size = 0;
+	dl_base = 0;
+	dl_pages = 0;
+}
+
+void fastboot_free_image(void *image)
+{
+	if (!image)
+		return;
+
+	if (!in_download_buffer(handover.base, handover.pages, image)) {
+		FreePool(image);
+		return;
+	}
+
+	mt_untrack((VOID *)(UINTN)handover.base);
+	uefi_call_wrapper(BS->FreePages, 2, handover.base, handover.pages);
+	handover.base = 0;
+	handover.pages = 0;
+}
+
+/* Battery status refresh period, getvar battery-* reads the last one */
+#define BATTERY_POLL_PERIOD_MS	2000
+
 EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 			  enum boot_target *target)
 {
@@ -1407,12 +2600,23 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 	if (!bootimage || !efiimage || !imagesize || !target)
 		return EFI_INVALID_PARAMETER;
 
+	startup_ticks = timer_ticks();
+	startup_usec = 0;
 	fastboot_bootimage = NULL;
 	fastboot_efiimage = NULL;
+	handover_pending = FALSE;
 	fastboot_target = UNKNOWN_TARGET;
 	*target = UNKNOWN_TARGET;
 
 	fastboot_init();
+	/* The partition handles are rebuilt once at the end of a batch
+	 * of flash and erase commands, or when they are needed */
+	gpt_defer_refresh(TRUE);
+	/* Likewise, the partition data is flushed from the storage
+	   device write cache at the end of a batch, see
+	   flush_idle() */
+	gpt_defer_flush(TRUE);
+	em_start_polling(BATTERY_POLL_PERIOD_MS);
 
 	/* In case user still holding it from answering a UX prompt
 	 * or magic key */
@@ -1463,12 +2667,17 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 		}
 
 		fastboot_run_command();
+		flash_pipeline_step();
+		flush_idle();
 
 		if (fastboot_state == STATE_STOPPED)
 			break;
 	}
 
-	ret = transport_stop();
+	/* The transport is paused if it can: the next fastboot_start()
+	   resumes the session, for instance after a failed boot.  A
+	   received EFI application may drive the transport itself.  */
+	ret = fastboot_efiimage ? transport_stop() : transport_pause();
 	if (EFI_ERROR(ret))
 		goto exit;
 
@@ -1480,6 +2689,8 @@ EFI_STATUS fastboot_start(void **bootimage, void **efiimage, UINTN *imagesize,
 	*imagesize = fastboot_imagesize;
 
 exit:
+	if (EFI_ERROR(ret))
+		handover_pending = FALSE;
 	fastboot_free();
 	return ret;
 }
@@ -1489,16 +2700,30 @@ EFI_STATUS fastboot_stop(void *bootimage, void *efiimage, UINTN imagesize,
 {
 	VOID *imgbuffer = NULL;
 
+	/* Make the queued and deferred writes durable before reboot,
+	   continue or boot */
+	while (pipe.label)
+		flash_pipeline_step();
+	gpt_flush_pending();
+
 	fastboot_imagesize = imagesize;
 	fastboot_target = target;
 
+	handover_pending = FALSE;
 	if (imagesize && (bootimage || efiimage)) {
-		imgbuffer = AllocatePool(imagesize);
-		if (!imgbuffer) {
-			error(L"Failed to allocate image buffer");
-			return EFI_OUT_OF_RESOURCES;
+		imgbuffer = bootimage ? bootimage : efiimage;
+		/* A received image is not copied, see handover */
+		handover_pending = in_download_buffer(dl_base, dl_pages,
+						      imgbuffer);
+		if (!handover_pending) {
+			imgbuffer = AllocatePool(imagesize);
+			if (!imgbuffer) {
+				error(L"Failed to allocate image buffer");
+				return EFI_OUT_OF_RESOURCES;
+			}
+			memcpy(imgbuffer, bootimage ? bootimage : efiimage,
+			       imagesize);
 		}
-		memcpy(imgbuffer, bootimage ? bootimage : efiimage, imagesize);
 	}
 
 	fastboot_bootimage = bootimage ? imgbuffer : NULL;
@@ -1514,13 +2739,33 @@ EFI_STATUS fastboot_stop(void *bootimage, void *efiimage, UINTN imagesize,
 
 void fastboot_free()
 {
-	if (dl.data) {
-		FreePool(dl.data);
-		dl.data = NULL;
-		dl.max_size = dl.size = 0;
+	if (stream.active) {
+		flash_stream_abort();
+		stream.active = FALSE;
+	}
+	fastboot_set_flash_stream(NULL);
+	fetch_end();
+
+	if (pipe.label) {
+		flash_stream_abort();
+		FreePool(pipe.label);
+	}
+	flash_pipeline_clear_status();
+	if (pipe.enabled) {
+		dl.data = pipe.base;
+		dl.max_size = pipe.full_size;
 	}
+	memset(&pipe, 0, sizeof(pipe));
+
+	if (handover_pending) {
+		download_buffer_handover();
+		handover_pending = FALSE;
+	}
+
+	free_download_buffer();
 
 	fastboot_unpublish_all();
+	free_partition_vars();
 	fastboot_cmdlist_unregister(&cmdlist);
 #ifndef FASTBOOT_FOR_NON_ANDROID
 	fastboot_oem_free();
@@ -1529,5 +2774,9 @@ void fastboot_free()
 #ifdef USE_UI
 	fastboot_ui_destroy();
 #endif
+	em_stop_polling();
+	storage_erase_wait();
+	gpt_defer_refresh(FALSE);
+	gpt_defer_flush(FALSE);
 	gpt_free_cache();
 }
@@ -123,6 +123,7 @@ EFI_STATUS change_device_state(enum device_state new_state, BOOLEAN interactive)
 	/* Ensure logs variable is deleted on a successful
 	   state transition.  */
 	del_efi_variable(&loader_guid, LOG_VAR);
+	log_reset_partition();
 
 	return EFI_SUCCESS;
 }
@@ -195,11 +196,39 @@ static enum unlock_ability get_unlock_ability(void)
 	return frp_allows_unlock() ? UNLOCK_ALLOWED : NO_UNLOCK_FRP;
 }
 
+#ifdef USER
+/* Minimum interval between two RAM wipe progress reports */
+#define CLEAR_PROGRESS_PERIOD_MS 1000
+
+/* The INFO messages go to the transmit ring, they are sent once the
+   TPL is restored.  */
+static void clear_memory_progress(UINT64 done, UINT64 total, UINT32 elapsed,
+				  VOID *ctx)
+{
+	UINT32 *last = ctx;
+	UINT64 rate;
+
+	if (done != total && elapsed - *last < CLEAR_PROGRESS_PERIOD_MS)
+		return;
+	*last = elapsed;
+
+	rate = elapsed ? (done / 1024 / 1024) * 1000 / elapsed : 0;
+	fastboot_info("Clearing memory: %lld%%, %lld MB/s",
+		      done * 100 / total, rate);
+#ifdef USE_UI
+	fastboot_ui_progress(done, total);
+#endif
+}
+#endif
+
+/* 'flashing unlock verify' reads back a sample of the cleared memory */
 static void cmd_unlock(__attribute__((__unused__)) INTN argc,
 		       __attribute__((__unused__)) CHAR8 **argv)
 {
 #ifdef USER
 	EFI_STATUS ret;
+	UINT32 last = 0;
+	BOOLEAN verify = argc > 1 && !strcmp(argv[1], (CHAR8 *)"verify");
 #endif
 #ifdef FASTBOOT_FOR_NON_ANDROID
 	fastboot_info("lock/Unlock is not supported");
@@ -212,7 +241,8 @@ static void cmd_unlock(__attribute__((__unused__)) INTN argc,
 
 	if (get_unlock_ability() == UNLOCK_ALLOWED) {
 #ifdef USER
-		ret = android_clear_memory();
+		ret = android_clear_memory_progress(clear_memory_progress,
+						    &last, verify);
 		if (EFI_ERROR(ret)) {
 			fastboot_fail("Failed to clear memory.  Unlock aborted.");
 			return;
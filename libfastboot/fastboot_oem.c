@@ -40,6 +40,7 @@
 
 #include "uefi_utils.h"
 #include "flash.h"
+#include "fetch.h"
 #include "hashes.h"
 #include "fastboot.h"
 #include "fastboot_ui.h"
@@ -50,6 +51,10 @@
 #include "fastboot_flashing.h"
 #include "intel_variables.h"
 #include "text_parser.h"
+#include "timer.h"
+#include "boottrace.h"
+#include "boot_harness.h"
+#include "memtrack.h"
 #ifdef USE_AVB
 #include "libavb/libavb.h"
 #include "libavb/uefi_avb_ops.h"
@@ -63,6 +68,9 @@
 #include "security.h"
 #include "vars.h"
 #include "security_interface.h"
+#include "transport.h"
+#include "fastboot_transport.h"
+#include "storage_bench.h"
 
 #define OFF_MODE_CHARGE		"off-mode-charge"
 #define CRASH_EVENT_MENU	"crash-event-menu"
@@ -73,14 +81,115 @@ static cmdlist_t cmdlist;
 static cmdlist_t cmdlist_fuse;
 #endif
 
+static UINT64 kib_per_sec(UINT64 bytes, UINT64 usec)
+{
+	return usec ? bytes * 1000000 / 1024 / usec : 0;
+}
+
+static const char *format_perf_dir(const transport_dir_stats_t *dir)
+{
+	static char value[64];
+
+	if (efi_snprintf((CHAR8 *)value, sizeof(value),
+			 (CHAR8 *)"%ld bytes %ld xfers %ld KiB/s %ld stalls",
+			 dir->bytes, dir->transfers,
+			 kib_per_sec(dir->bytes, dir->usec), dir->stalls) < 0)
+		return NULL;
+
+	return value;
+}
+
+static const char *get_perf_rx_var(void)
+{
+	return format_perf_dir(&transport_get_stats()->rx);
+}
+
+static const char *get_perf_tx_var(void)
+{
+	return format_perf_dir(&transport_get_stats()->tx);
+}
+
+static const char *get_perf_rearm_var(void)
+{
+	static char value[64];
+	const transport_stats_t *stats = transport_get_stats();
+
+	if (efi_snprintf((CHAR8 *)value, sizeof(value),
+			 (CHAR8 *)"%ld us avg %ld us max",
+			 stats->rearms ? stats->rearm_usec / stats->rearms : 0,
+			 stats->rearm_max_usec) < 0)
+		return NULL;
+
+	return value;
+}
+
+static const char *get_perf_flash_var(void)
+{
+	static char value[64];
+	const struct flash_perf *perf = flash_get_perf();
+
+	if (efi_snprintf((CHAR8 *)value, sizeof(value),
+			 (CHAR8 *)"%ld bytes %ld writes %ld KiB/s",
+			 perf->bytes, perf->writes,
+			 kib_per_sec(perf->bytes, perf->write_usec)) < 0)
+		return NULL;
+
+	return value;
+}
+
+static const char *get_perf_flush_var(void)
+{
+	static char value[64];
+	const struct gpt_flush_stats *flush = gpt_get_flush_stats();
+
+	if (efi_snprintf((CHAR8 *)value, sizeof(value),
+			 (CHAR8 *)"%ld flushes %ld ms %ld deferred",
+			 flush->flushes, flush->usec / 1000,
+			 flush->deferred) < 0)
+		return NULL;
+
+	return value;
+}
+
+static const char *get_perf_startup_var(void)
+{
+	static char value[32];
+
+	if (efi_snprintf((CHAR8 *)value, sizeof(value), (CHAR8 *)"%ld us",
+			 fastboot_get_startup_usec()) < 0)
+		return NULL;
+
+	return value;
+}
+
+static struct perf_var {
+	const char *name;
+	const char *(*get_value)(void);
+} PERF_VARS[] = {
+	{ "perf-rx", get_perf_rx_var },
+	{ "perf-tx", get_perf_tx_var },
+	{ "perf-rearm", get_perf_rearm_var },
+	{ "perf-flash", get_perf_flash_var },
+	{ "perf-flush", get_perf_flush_var },
+	{ "perf-startup", get_perf_startup_var }
+};
+
 static EFI_STATUS fastboot_oem_publish(void)
 {
 	EFI_STATUS ret;
+	UINTN i;
 
 	ret = fastboot_publish(OFF_MODE_CHARGE, get_off_mode_charge() ? "1" : "0");
 	if (EFI_ERROR(ret))
 		return ret;
 
+	for (i = 0; i < ARRAY_SIZE(PERF_VARS); i++) {
+		ret = fastboot_publish_dynamic(PERF_VARS[i].name,
+					       PERF_VARS[i].get_value);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
 	return publish_intel_variables();
 }
 
@@ -102,7 +211,7 @@ static EFI_STATUS cmd_oem_set_boolean(INTN argc, CHAR8 **argv,
 
 	ret = set_fun(!strcmp(argv[1], (CHAR8 *)"1"));
 	if (EFI_ERROR(ret))
-		fastboot_fail("Failed to set %a", OFF_MODE_CHARGE);
+		fastboot_fail("Failed to set %a", name);
 
 	return ret;
 }
@@ -234,6 +343,782 @@ static void cmd_oem_garbage_disk(__attribute__((__unused__)) INTN argc,
 		fastboot_fail("Garbage disk failed, %r", ret);
 }
 
+static void cmd_oem_flash_stream(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	ret = fastboot_set_flash_stream(argv[1]);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set streaming partition, %r", ret);
+		return;
+	}
+
+	fastboot_info("Next download is written to %a while received", argv[1]);
+	fastboot_okay("");
+}
+
+/* oem flash-resume <partition>: the next download is the rest of the
+   image whose stream to PARTITION was interrupted, from the offset of
+   the flash-checkpoint variable.  */
+static void cmd_oem_flash_resume(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	ret = fastboot_set_flash_resume(argv[1]);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to set resumed partition, %r", ret);
+		return;
+	}
+
+	fastboot_info("Next download resumes the stream to %a", argv[1]);
+	fastboot_okay("");
+}
+
+static void cmd_oem_flash_pipeline(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	ret = cmd_oem_set_boolean(argc, argv, "flash-pipeline",
+				  fastboot_set_flash_pipeline);
+	if (EFI_ERROR(ret))
+		return;
+
+	fastboot_info("max-download-size is now 0x%lX",
+		      fastboot_download_buffer()->max_size);
+	fastboot_okay("");
+}
+
+/* oem fetch-sparse <partition> [<offset> <size>]: encode the partition
+   as a sparse image in the download buffer, retrieved with "fastboot
+   get_staged".  Offset and size are in hexadecimal.  */
+static void cmd_oem_fetch_sparse(INTN argc, CHAR8 **argv)
+{
+	struct download_buffer *dl = fastboot_download_buffer();
+	EFI_STATUS ret;
+	CHAR16 *label;
+	UINT64 offset = 0, size = 0;
+	UINTN len;
+
+	if (argc != 2 && argc != 4) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (argc == 4) {
+		offset = strtoull((const char *)argv[2], NULL, 16);
+		size = strtoull((const char *)argv[3], NULL, 16);
+		if (!size) {
+			fastboot_fail("Invalid size");
+			return;
+		}
+	}
+
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	ret = fetch_sparse(label, offset, size, dl->data, dl->max_size, &len);
+	FreePool(label);
+	if (ret == EFI_BUFFER_TOO_SMALL) {
+		fastboot_fail("Sparse image larger than the download buffer");
+		return;
+	}
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to read %a: %r", argv[1], ret);
+		return;
+	}
+
+	ret = fastboot_stage(len);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to stage the image: %r", ret);
+		return;
+	}
+
+	fastboot_info("%ld bytes sparse image staged", len);
+	fastboot_okay("");
+}
+
+static void flash_batch_manifest(struct download_buffer *dl)
+{
+	struct flash_manifest_entry entries[FLASH_MANIFEST_MAX_ENTRIES];
+	EFI_STATUS ret;
+	UINTN i, nb = ARRAY_SIZE(entries);
+
+	ret = flash_manifest_parse(dl->data, dl->size, entries, &nb);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Invalid manifest: %r", ret);
+		return;
+	}
+
+	info(L"Flashing %d images ...", nb);
+	ret = flash_manifest(dl->data, entries, nb);
+
+	for (i = 0; i < nb; i++) {
+		if (entries[i].status == EFI_NOT_STARTED) {
+			fastboot_info("%s: %a, skipped", entries[i].label,
+				      flash_format_name(entries[i].format));
+			continue;
+		}
+		fastboot_info("%s: %a, %ld KiB in %ld ms, %r", entries[i].label,
+			      flash_format_name(entries[i].format),
+			      entries[i].size / 1024, entries[i].usec / 1000,
+			      entries[i].status);
+	}
+
+	gpt_sync_data();
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Flash failure: %r", ret);
+		return;
+	}
+
+	info(L"Flash done.");
+	fastboot_okay("");
+}
+
+static void cmd_oem_flash_batch(INTN argc, CHAR8 **argv)
+{
+	struct download_buffer *dl = fastboot_download_buffer();
+	CHAR16 *labels[FLASH_BATCH_MAX_PARTITIONS];
+	EFI_STATUS ret;
+	INTN i, nb;
+
+	if (argc - 1 > (INTN)ARRAY_SIZE(labels)) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (!dl->size) {
+		fastboot_fail("No image downloaded");
+		return;
+	}
+
+	if (argc == 1) {
+		flash_batch_manifest(dl);
+		return;
+	}
+
+	for (nb = 0; nb < argc - 1; nb++) {
+		labels[nb] = stra_to_str(argv[nb + 1]);
+		if (!labels[nb]) {
+			fastboot_fail("Allocation error");
+			goto out;
+		}
+	}
+
+	info(L"Flashing %d partitions ...", nb);
+	ret = flash_batch(dl->data, dl->size, labels, nb);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Flash failure: %r", ret);
+		goto out;
+	}
+
+	gpt_sync_data();
+	info(L"Flash done.");
+	fastboot_okay("");
+
+out:
+	for (i = 0; i < nb; i++)
+		FreePool(labels[i]);
+}
+
+static void cmd_oem_erase_batch(INTN argc, CHAR8 **argv)
+{
+	CHAR16 *labels[ERASE_MAX_PARTITIONS];
+	EFI_STATUS ret;
+	INTN i, nb;
+
+	if (argc < 2 || argc - 1 > (INTN)ARRAY_SIZE(labels)) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	for (nb = 0; nb < argc - 1; nb++) {
+		labels[nb] = stra_to_str(argv[nb + 1]);
+		if (!labels[nb]) {
+			fastboot_fail("Allocation error");
+			goto out;
+		}
+		/* The slot variables are refreshed by the erase command */
+		if (!StrCmp(labels[nb], SLOT_STORAGE_PART)) {
+			fastboot_fail("Use erase for %a", argv[nb + 1]);
+			nb++;
+			goto out;
+		}
+	}
+
+	info(L"Erasing %d partitions ...", nb);
+	ret = erase_by_labels(labels, nb);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Erase failure: %r", ret);
+		goto out;
+	}
+
+	info(L"Erase done.");
+	fastboot_okay("");
+
+out:
+	for (i = 0; i < nb; i++)
+		FreePool(labels[i]);
+}
+
+static void cmd_oem_erase_quick(INTN argc, CHAR8 **argv)
+{
+	CHAR16 *label;
+	EFI_STATUS ret;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	if (!StrCmp(label, SLOT_STORAGE_PART)) {
+		fastboot_fail("Use erase for %a", argv[1]);
+		goto out;
+	}
+
+	info(L"Quick erasing %s ...", label);
+	ret = quick_erase_by_label(label);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Erase failure: %r", ret);
+		goto out;
+	}
+
+	fastboot_okay("");
+
+out:
+	FreePool(label);
+}
+
+static void cmd_oem_flash_delta(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	ret = cmd_oem_set_boolean(argc, argv, "flash-delta", flash_set_delta);
+	if (EFI_ERROR(ret))
+		return;
+
+	fastboot_info("Delta flash %a", flash_get_delta() ? "enabled" : "disabled");
+	fastboot_okay("");
+}
+
+static void cmd_oem_flash_zero_detect(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	ret = cmd_oem_set_boolean(argc, argv, "flash-zero-detect",
+				  flash_set_zero_detect);
+	if (EFI_ERROR(ret))
+		return;
+
+	fastboot_info("Zero detection %a",
+		      flash_get_zero_detect() ? "enabled" : "disabled");
+	fastboot_okay("");
+}
+
+static void cmd_oem_flush_deferred(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+
+	ret = cmd_oem_set_boolean(argc, argv, "flush-deferred", gpt_defer_flush);
+	if (EFI_ERROR(ret))
+		return;
+
+	fastboot_info("Data flushes %a", gpt_flush_deferred() ?
+		      "deferred to the end of the batch" : "immediate");
+	fastboot_okay("");
+}
+
+static void print_perf_dir(const char *name, const transport_dir_stats_t *dir)
+{
+	fastboot_info("%a: %ld bytes in %ld transfers, %ld KiB/s", name,
+		      dir->bytes, dir->transfers,
+		      kib_per_sec(dir->bytes, dir->usec));
+	fastboot_info("%a: %ld us avg, %ld us max, %ld stalls", name,
+		      dir->transfers ? dir->usec / dir->transfers : 0,
+		      dir->max_usec, dir->stalls);
+	fastboot_info("%a: %ld bytes min, %ld bytes max, %ld partial", name,
+		      dir->min_len, dir->max_len, dir->partial);
+}
+
+static void cmd_oem_perf(INTN argc, CHAR8 **argv)
+{
+	const transport_stats_t *stats;
+	const struct flash_perf *perf;
+	const struct gpt_flush_stats *flush;
+	UINTN i, nb;
+
+	if (argc == 2 && !strcmp(argv[1], (CHAR8 *)"reset")) {
+		transport_reset_stats();
+		flash_reset_perf();
+		gpt_reset_flush_stats();
+		fastboot_okay("");
+		return;
+	}
+
+	if (argc != 1) {
+		fastboot_fail("Usage: perf [reset]");
+		return;
+	}
+
+	stats = transport_get_stats();
+	print_perf_dir("rx", &stats->rx);
+	print_perf_dir("tx", &stats->tx);
+	fastboot_info("rx re-arm: %ld us avg, %ld us max",
+		      stats->rearms ? stats->rearm_usec / stats->rearms : 0,
+		      stats->rearm_max_usec);
+	fastboot_info("idle: %ld ms sleeping, %ld tasks run",
+		      stats->sleep_usec / 1000, stats->idle_tasks);
+
+	perf = flash_get_perf();
+	fastboot_info("flash: %ld bytes in %ld writes, %ld KiB/s",
+		      perf->bytes, perf->writes,
+		      kib_per_sec(perf->bytes, perf->write_usec));
+	flush = gpt_get_flush_stats();
+	fastboot_info("flush: %ld in %ld ms, %ld deferred", flush->flushes,
+		      flush->usec / 1000, flush->deferred);
+
+	perf = flash_get_partition_perf(&nb);
+	for (i = 0; i < nb; i++)
+		fastboot_info("%s: %ld KiB in %ld ms, %ld ms writing",
+			      perf[i].label, perf[i].bytes / 1024,
+			      perf[i].usec / 1000, perf[i].write_usec / 1000);
+
+	fastboot_okay("");
+}
+
+static EFI_STATUS parse_bench_arg(CHAR8 *arg, UINT64 *value)
+{
+	char *endptr;
+
+	*value = strtoull((char *)arg, &endptr, 0);
+	return *endptr == '\0' ? EFI_SUCCESS : EFI_INVALID_PARAMETER;
+}
+
+static void print_histogram(const UINT64 histogram[TRANSPORT_HISTOGRAM_SIZE])
+{
+	UINTN i;
+
+	for (i = 0; i < TRANSPORT_HISTOGRAM_SIZE - 1; i++)
+		if (histogram[i])
+			fastboot_info("< %ld us: %ld", (UINT64)1 << i, histogram[i]);
+
+	if (histogram[i])
+		fastboot_info(">= %ld us: %ld", (UINT64)1 << (i - 1), histogram[i]);
+}
+
+static void cmd_oem_bench_download(INTN argc, CHAR8 **argv)
+{
+	const struct fastboot_bench_result *result;
+	UINT64 transfer_size;
+	EFI_STATUS ret;
+
+	if (argc == 2) {
+		ret = parse_bench_arg(argv[1], &transfer_size);
+		if (!EFI_ERROR(ret))
+			ret = fastboot_set_bench_download(transfer_size);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Invalid transfer size %a", argv[1]);
+			return;
+		}
+
+		if (transfer_size)
+			fastboot_info("Next download is received by %ld bytes transfers and discarded",
+				      transfer_size);
+		fastboot_okay("");
+		return;
+	}
+
+	if (argc != 1) {
+		fastboot_fail("Usage: bench-download [<transfer-size>]");
+		return;
+	}
+
+	result = fastboot_get_bench_download();
+	if (!result->bytes) {
+		fastboot_fail("No download benchmark result");
+		return;
+	}
+
+	fastboot_info("%ld bytes in %ld us, %ld KiB/s", result->bytes,
+		      result->usec, kib_per_sec(result->bytes, result->usec));
+	print_perf_dir("rx", &result->rx);
+	print_histogram(result->rx.histogram);
+	fastboot_okay("");
+}
+
+#define BENCH_FLASH_CHUNK_SIZE		(1024 * 1024)
+#define BENCH_FLASH_QUEUE_DEPTH		3
+
+static void cmd_oem_bench_flash(INTN argc, CHAR8 **argv)
+{
+	struct download_buffer *dl = fastboot_download_buffer();
+	UINT64 histogram[TRANSPORT_HISTOGRAM_SIZE] = { 0 };
+	UINT64 size, chunk_size = BENCH_FLASH_CHUNK_SIZE;
+	UINT64 queue_depth = BENCH_FLASH_QUEUE_DEPTH;
+	UINT64 done, writes = 0, usec, max_usec = 0, write_usec = 0;
+	uint64_t start, write_start;
+	UINT32 *pattern;
+	CHAR16 *label;
+	EFI_STATUS ret, ret2;
+	UINTN i, len;
+
+	if (argc < 3 || argc > 5) {
+		fastboot_fail("Usage: bench-flash <part> <size> [<chunk-size> [<qd>]]");
+		return;
+	}
+
+	if (EFI_ERROR(parse_bench_arg(argv[2], &size)) || !size ||
+	    (argc > 3 && EFI_ERROR(parse_bench_arg(argv[3], &chunk_size))) ||
+	    (argc > 4 && EFI_ERROR(parse_bench_arg(argv[4], &queue_depth)))) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	if (!chunk_size || chunk_size > dl->max_size ||
+	    queue_depth > FLASH_BENCH_MAX_QUEUE_DEPTH) {
+		fastboot_fail("Chunk size or queue depth out of range");
+		return;
+	}
+
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	/* A non-uniform pattern so that the storage device cannot
+	   shortcut the writes.  The downloaded image is lost.  */
+	pattern = dl->data;
+	for (i = 0; i < chunk_size / sizeof(*pattern); i++)
+		pattern[i] = 0x5a5a5a5a ^ (UINT32)i;
+	dl->size = 0;
+
+	ret = flash_bench_start(label, size, queue_depth);
+	if (EFI_ERROR(ret)) {
+		FreePool(label);
+		fastboot_fail("Failed to start the benchmark, %r", ret);
+		return;
+	}
+
+	info(L"Benchmarking the flash of %ld bytes to %s ...", size, label);
+	FreePool(label);
+
+	start = timer_ticks();
+	for (done = 0; done < size; done += len) {
+		len = min(chunk_size, size - done);
+		write_start = timer_ticks();
+		ret = flash_write(dl->data, len);
+		usec = ticks_to_usec(timer_ticks() - write_start);
+		if (EFI_ERROR(ret))
+			break;
+
+		writes++;
+		write_usec += usec;
+		max_usec = max(max_usec, usec);
+		histogram[transport_histogram_bucket(usec)]++;
+	}
+	ret2 = flash_bench_end();
+	usec = ticks_to_usec(timer_ticks() - start);
+	if (!EFI_ERROR(ret))
+		ret = ret2;
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Flash benchmark failure: %r", ret);
+		return;
+	}
+
+	fastboot_info("%ld bytes in %ld us, %ld KiB/s", size, usec,
+		      kib_per_sec(size, usec));
+	fastboot_info("%ld writes of %ld bytes, queue depth %ld", writes,
+		      chunk_size, queue_depth);
+	fastboot_info("write: %ld us avg, %ld us max", write_usec / writes,
+		      max_usec);
+	print_histogram(histogram);
+	fastboot_okay("");
+}
+
+static void cmd_oem_storage_bench(INTN argc, CHAR8 **argv)
+{
+	struct storage_bench_result results[STORAGE_BENCH_MAX_RESULTS];
+	UINT64 params[3] = { 0 };
+	char name[64], value[64];
+	CHAR16 *label;
+	EFI_STATUS ret;
+	INTN i;
+	UINTN j, nb;
+
+	if (argc > 5) {
+		fastboot_fail("Usage: storage-bench [<part> [<size> [<bs> [<qd>]]]]");
+		return;
+	}
+
+	for (i = 2; i < argc; i++) {
+		ret = parse_bench_arg(argv[i], &params[i - 2]);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Invalid value %a", argv[i]);
+			return;
+		}
+	}
+
+	label = stra_to_str(argc > 1 ? argv[1] : (CHAR8 *)"userdata");
+	if (!label) {
+		fastboot_fail("Allocation error");
+		return;
+	}
+
+	info(L"Benchmarking %s ...", label);
+	ret = storage_bench(label, params[0], params[1], params[2],
+			    device_is_unlocked(), results, &nb);
+	FreePool(label);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Storage benchmark failure: %r", ret);
+		return;
+	}
+
+	for (j = 0; j < nb; j++) {
+		if (efi_snprintf((CHAR8 *)name, sizeof(name),
+				 (CHAR8 *)"storage-bench:%a:%d:%d",
+				 storage_bench_test_name(results[j].test),
+				 (int)results[j].block_size,
+				 (int)results[j].queue_depth) < 0 ||
+		    efi_snprintf((CHAR8 *)value, sizeof(value),
+				 (CHAR8 *)"%ld KiB/s %ld IOPS",
+				 storage_bench_kib_per_sec(&results[j]),
+				 storage_bench_iops(&results[j])) < 0) {
+			fastboot_fail("Failed to format the results");
+			return;
+		}
+
+		fastboot_info("%a %a", name + sizeof("storage-bench"), value);
+		ret = fastboot_publish(name, value);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Failed to publish %a, %r", name, ret);
+			return;
+		}
+	}
+
+	fastboot_okay("");
+}
+
+static void cmd_oem_boottrace(INTN argc, __attribute__((__unused__)) CHAR8 **argv)
+{
+	static const char TYPES[] = { 'P', 'B', 'E' };
+	const struct boottrace_record *first, *rec;
+	UINTN i;
+
+	if (argc != 1) {
+		fastboot_fail("Usage: boottrace");
+		return;
+	}
+
+	first = boottrace_get(0);
+	for (i = 0; i < boottrace_count(); i++) {
+		rec = boottrace_get(i);
+		fastboot_info("%ld %c %a %d",
+			      ticks_to_usec(rec->tsc - first->tsc),
+			      rec->type < ARRAY_SIZE(TYPES) ? TYPES[rec->type] : '?',
+			      boottrace_event_name(rec->event), rec->arg);
+	}
+
+	for (i = BT_STAGE + 1; i < BT_EVENT_LAST; i++)
+		fastboot_info("total %a %ld", boottrace_event_name(i),
+			      boottrace_total_usec(i));
+
+	fastboot_okay("");
+}
+
+#ifdef BOOT_HARNESS
+static void report_regression(const CHAR8 *name, UINT64 usec, UINT64 budget)
+{
+	fastboot_info("regression %a %ld > %ld", name, usec, budget);
+}
+
+static void cmd_oem_boot_harness(INTN argc, CHAR8 **argv)
+{
+	CHAR8 *results, *budget, *line, *next, *entry, *saveptr;
+	UINTN run, total = 0;
+	unsigned long runs;
+	EFI_STATUS ret;
+	char *end;
+
+	if (argc == 3 && !strcmp(argv[1], (CHAR8 *)"budget")) {
+		if (!strcmp(argv[2], (CHAR8 *)"none"))
+			ret = boot_harness_set_budget(NULL);
+		else
+			ret = boot_harness_set_budget(argv[2]);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Failed to set the budget, %r", ret);
+			return;
+		}
+		fastboot_okay("");
+		return;
+	}
+
+	if (argc == 2) {
+		runs = strtoul((char *)argv[1], &end, 10);
+		if (end == (char *)argv[1] || *end != '\0') {
+			fastboot_fail("Invalid number of runs");
+			return;
+		}
+		ret = boot_harness_arm(runs);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Failed to arm the harness, %r", ret);
+			return;
+		}
+		fastboot_okay("");
+		return;
+	}
+
+	if (argc != 1) {
+		fastboot_fail("Usage: boot-harness [<runs>|budget <budget>|budget none]");
+		return;
+	}
+
+	budget = boot_harness_get_budget();
+	results = boot_harness_get_results();
+
+	fastboot_info("runs left %d", boot_harness_runs());
+	fastboot_info("budget%a", budget ? "" : " none");
+	if (budget)
+		fastboot_info_long_string((char *)budget, NULL);
+
+	for (run = 0, line = results; line && *line; line = next, run++) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		fastboot_info("run %d", run);
+		total += boot_harness_check(line, strlen(line), budget,
+					    report_regression);
+		for (entry = (CHAR8 *)strtok_r((char *)line, ",", (char **)&saveptr);
+		     entry;
+		     entry = (CHAR8 *)strtok_r(NULL, ",", (char **)&saveptr))
+			fastboot_info("%a", entry);
+	}
+
+	if (budget)
+		FreePool(budget);
+	if (results)
+		FreePool(results);
+
+	if (total)
+		fastboot_fail("%d regression(s)", total);
+	else
+		fastboot_okay("");
+}
+#endif
+
+#ifdef MEMTRACK
+#define MEMINFO_MAX_SITES	16
+
+static void cmd_oem_meminfo(INTN argc, CHAR8 **argv)
+{
+	struct memtrack_site sites[MEMINFO_MAX_SITES];
+	const struct memtrack_stats *stats;
+	UINTN i, nb;
+
+	if (argc == 2 && !strcmp(argv[1], (CHAR8 *)"reset")) {
+		memtrack_reset_peaks();
+		fastboot_okay("");
+		return;
+	}
+
+	if (argc != 1) {
+		fastboot_fail("Usage: meminfo [reset]");
+		return;
+	}
+
+	for (i = 0; i <= MT_TAG_LAST; i++) {
+		stats = memtrack_get_stats(i);
+		if (!stats->allocs && i != MT_TAG_LAST)
+			continue;
+
+		fastboot_info("%a: %ld live, %ld peak, %ld/%ld allocs/frees",
+			      memtrack_tag_name(i), stats->live, stats->peak,
+			      stats->allocs, stats->frees);
+		if (stats->failures)
+			fastboot_info("%a: %ld failures, last of %ld bytes",
+				      memtrack_tag_name(i), stats->failures,
+				      stats->last_failure);
+	}
+
+	nb = memtrack_get_sites(sites, ARRAY_SIZE(sites));
+	for (i = 0; i < nb; i++)
+		fastboot_info("%a:%d %a: %ld live in %ld",
+			      sites[i].file, sites[i].line,
+			      memtrack_tag_name(sites[i].tag),
+			      sites[i].live, (UINT64)sites[i].count);
+
+	if (memtrack_dropped())
+		fastboot_info("%ld allocations not tracked", memtrack_dropped());
+
+	fastboot_okay("");
+}
+#endif
+
+static void cmd_oem_loglevel(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	INTN module = -1, level;
+	UINTN i;
+
+	if (argc == 1) {
+		for (i = 0; i < LOG_MODULE_COUNT; i++)
+			fastboot_info("%a: %a", log_module_name(i),
+				      log_level_name(log_levels[i]));
+		fastboot_okay("");
+		return;
+	}
+
+	if (argc > 3)
+		goto usage;
+
+	if (argc == 3) {
+		module = log_module_from_name((char *)argv[1]);
+		if (module == -1) {
+			fastboot_fail("Unknown module '%a'", argv[1]);
+			return;
+		}
+	}
+
+	level = log_level_from_name((char *)argv[argc - 1]);
+	if (level == -1)
+		goto usage;
+
+	for (i = 0; i < LOG_MODULE_COUNT; i++)
+		if (module == -1 || (UINTN)module == i)
+			log_levels[i] = level;
+
+	ret = log_save_levels();
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to save the log levels, %r", ret);
+		return;
+	}
+
+	fastboot_okay("");
+	return;
+
+usage:
+	fastboot_fail("Usage: loglevel [[<module>] debug|info|warning|error]");
+}
+
 static struct oem_hash {
 	const CHAR16 *name;
 	EFI_STATUS (*hash)(const CHAR16 *name);
@@ -294,6 +1179,72 @@ static void cmd_oem_gethashes(INTN argc, CHAR8 **argv)
 	fastboot_okay("");
 }
 
+#ifdef DYNAMIC_PARTITIONS
+/* Hash one logical partition of super instead of the whole super
+   partition */
+static void cmd_oem_get_lp_hash(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	CHAR16 *name;
+
+	if (argc != 2 && argc != 3) {
+		fastboot_fail("Usage: get-lp-hash <logical partition> [<algorithm>]");
+		return;
+	}
+
+	if (argc == 3) {
+		ret = set_hash_algorithm(argv[2]);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Fail to set the algorithm, %r", ret);
+			return;
+		}
+	}
+
+	name = stra_to_str(argv[1]);
+	if (!name) {
+		fastboot_fail("Unable to convert string");
+		return;
+	}
+
+	ret = get_logical_partition_hash(name);
+	FreePool(name);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Failed to get hash for %a, %r", argv[1], ret);
+		return;
+	}
+
+	fastboot_okay("");
+}
+#endif
+
+#ifdef USE_AVB
+static void cmd_oem_verify_hashtree(INTN argc, CHAR8 **argv)
+{
+	EFI_STATUS ret;
+	CHAR16 *label;
+
+	if (argc != 2) {
+		fastboot_fail("Invalid parameter");
+		return;
+	}
+
+	label = stra_to_str(argv[1]);
+	if (!label) {
+		fastboot_fail("Unable to convert string");
+		return;
+	}
+
+	ret = verify_hashtree(slot_label(label));
+	FreePool(label);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("Hash tree verification failed, %r", ret);
+		return;
+	}
+
+	fastboot_okay("");
+}
+#endif
+
 static void cmd_oem_set_storage(INTN argc, CHAR8 **argv)
 {
 	EFI_STATUS ret;
@@ -424,6 +1375,8 @@ static void cmd_oem_set_storage(INTN argc, CHAR8 **argv)
 		fastboot_fail("Failed to refresh partition table: %r", ret);
 		return;
 	}
+	/* The partition table is now read from the new storage */
+	gpt_free_cache();
 
 	refresh_current_state();
 	fastboot_flashing_publish();
@@ -586,9 +1539,12 @@ static void cmd_oem_get_logs(INTN argc, __attribute__((__unused__)) CHAR8 **argv
 		return;
 	}
 
-	ret = get_efi_variable(&loader_guid, LOG_VAR, &size, (VOID **)&buf, &flags);
+	ret = log_read_partition((CHAR8 **)&buf, &size);
+	if (ret == EFI_UNSUPPORTED)
+		ret = get_efi_variable(&loader_guid, LOG_VAR, &size,
+				       (VOID **)&buf, &flags);
 	if (EFI_ERROR(ret)) {
-		fastboot_fail("failed to get log buffer from variable, %r", ret);
+		fastboot_fail("failed to get log buffer, %r", ret);
 		return;
 	}
 
@@ -637,6 +1593,61 @@ static void cmd_oem_get_action_nonce(INTN argc, __attribute__((__unused__)) CHAR
 #endif
 
 #ifdef USE_TPM
+#define TPM_BENCH_DEFAULT_ITERATIONS	100
+
+static void cmd_oem_tpm_bench(INTN argc, CHAR8 **argv)
+{
+	struct tpm2_bench_result results[TPM2_BENCH_LAST];
+	UINT64 iterations = TPM_BENCH_DEFAULT_ITERATIONS;
+	char name[64], value[64];
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (argc > 2) {
+		fastboot_fail("Usage: tpm-bench [<iterations>]");
+		return;
+	}
+
+	if (argc == 2) {
+		ret = parse_bench_arg(argv[1], &iterations);
+		if (EFI_ERROR(ret) || !iterations) {
+			fastboot_fail("Invalid value %a", argv[1]);
+			return;
+		}
+	}
+
+	ret = tpm2_bench(iterations, results);
+	if (EFI_ERROR(ret)) {
+		fastboot_fail("TPM benchmark failure: %r", ret);
+		return;
+	}
+
+	for (i = 0; i < TPM2_BENCH_LAST; i++) {
+		if (!results[i].count)
+			continue;
+
+		if (efi_snprintf((CHAR8 *)name, sizeof(name),
+				 (CHAR8 *)"tpm-bench:%a",
+				 tpm2_bench_test_name(i)) < 0 ||
+		    efi_snprintf((CHAR8 *)value, sizeof(value),
+				 (CHAR8 *)"%ld us avg %ld us max",
+				 results[i].total_usec / results[i].count,
+				 results[i].max_usec) < 0) {
+			fastboot_fail("Failed to format the results");
+			return;
+		}
+
+		fastboot_info("%a %a", name + sizeof("tpm-bench"), value);
+		ret = fastboot_publish(name, value);
+		if (EFI_ERROR(ret)) {
+			fastboot_fail("Failed to publish %a, %r", name, ret);
+			return;
+		}
+	}
+
+	fastboot_okay("");
+}
+
 #ifndef USER
 static void cmd_oem_tpm_show_index(INTN argc, __attribute__((__unused__)) CHAR8 **argv)
 {
@@ -801,6 +1812,28 @@ static struct fastboot_cmd COMMANDS[] = {
 	{ CRASH_EVENT_MENU,		LOCKED,		cmd_oem_crash_event_menu  },
 	{ "setvar",			UNLOCKED,	cmd_oem_setvar  },
 	{ "garbage-disk",		UNLOCKED,	cmd_oem_garbage_disk  },
+	{ "flash-stream",		UNLOCKED,	cmd_oem_flash_stream  },
+	{ "flash-resume",		UNLOCKED,	cmd_oem_flash_resume  },
+	{ "flash-pipeline",		UNLOCKED,	cmd_oem_flash_pipeline  },
+	{ "fetch-sparse",		UNLOCKED,	cmd_oem_fetch_sparse  },
+	{ "flash-batch",		UNLOCKED,	cmd_oem_flash_batch  },
+	{ "erase-batch",		UNLOCKED,	cmd_oem_erase_batch  },
+	{ "erase-quick",		UNLOCKED,	cmd_oem_erase_quick  },
+	{ "flash-delta",		UNLOCKED,	cmd_oem_flash_delta  },
+	{ "flash-zero-detect",		UNLOCKED,	cmd_oem_flash_zero_detect  },
+	{ "flush-deferred",		LOCKED,		cmd_oem_flush_deferred  },
+	{ "perf",			LOCKED,		cmd_oem_perf  },
+	{ "boottrace",			LOCKED,		cmd_oem_boottrace  },
+#ifdef BOOT_HARNESS
+	{ "boot-harness",		LOCKED,		cmd_oem_boot_harness  },
+#endif
+#ifdef MEMTRACK
+	{ "meminfo",			LOCKED,		cmd_oem_meminfo  },
+#endif
+	{ "loglevel",			LOCKED,		cmd_oem_loglevel  },
+	{ "storage-bench",		LOCKED,		cmd_oem_storage_bench  },
+	{ "bench-download",		LOCKED,		cmd_oem_bench_download  },
+	{ "bench-flash",		UNLOCKED,	cmd_oem_bench_flash  },
 	{ "reboot",			LOCKED,		cmd_oem_reboot  },
 	{ "fw-update",			UNLOCKED,	cmd_oem_fw_update  },
 	{ "set-storage",		LOCKED,		cmd_oem_set_storage  },
@@ -815,11 +1848,18 @@ static struct fastboot_cmd COMMANDS[] = {
 #endif
 #endif
 	{ "get-hashes",			LOCKED,		cmd_oem_gethashes  },
+#ifdef DYNAMIC_PARTITIONS
+	{ "get-lp-hash",		LOCKED,		cmd_oem_get_lp_hash  },
+#endif
+#ifdef USE_AVB
+	{ "verify-hashtree",		LOCKED,		cmd_oem_verify_hashtree  },
+#endif
 	{ "get-provisioning-logs",	LOCKED,		cmd_oem_get_logs },
 #ifdef BOOTLOADER_POLICY
 	{ "get-action-nonce",		LOCKED,		cmd_oem_get_action_nonce },
 #endif
 #ifdef USE_TPM
+	{ "tpm-bench",			LOCKED,		cmd_oem_tpm_bench },
 #ifndef USER
 	{ "tpm-show-index",		LOCKED,		cmd_oem_tpm_show_index },
 	{ "tpm-delete-index",		LOCKED,		cmd_oem_tpm_delete_index },
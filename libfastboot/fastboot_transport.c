@@ -35,6 +35,7 @@
 #include <fastboot.h>
 #include <usb.h>
 #include <tcp.h>
+#include <udp.h>
 #include <transport.h>
 
 /* USB */
@@ -244,23 +245,505 @@ EFI_STATUS fastboot_tcp_read(void *buf, UINT32 size)
 	return ret;
 }
 
+/* UDP */
+static const UINT32 UDP_PORT = 5554;
+
+/* Android fastboot UDP protocol.  The host initiates all the
+   exchanges: each host packet is answered by exactly one device
+   packet with the same sequence number.  The host sends fastboot data
+   in FASTBOOT packets, acknowledged by empty ones, and polls for the
+   device data with empty FASTBOOT packets.  A poll is only answered
+   once fastboot has something to send.  A retransmitted packet is
+   answered with the previous response.  */
+#define UDP_ID_ERROR			0x00
+#define UDP_ID_QUERY			0x01
+#define UDP_ID_INIT			0x02
+#define UDP_ID_FASTBOOT			0x03
+#define UDP_FLAG_CONTINUATION		0x01
+#define UDP_PROTOCOL_VERSION		1
+#define UDP_MIN_PACKET_SIZE		512
+
+#if defined(FASTBOOT_UDP_MAX_PACKET_SIZE) && \
+	FASTBOOT_UDP_MAX_PACKET_SIZE <= UDP_MAX_DATAGRAM_SIZE
+#define UDP_MAX_PACKET_SIZE FASTBOOT_UDP_MAX_PACKET_SIZE
+#else
+#define UDP_MAX_PACKET_SIZE UDP_MAX_DATAGRAM_SIZE
+#endif
+
+typedef struct udp_header {
+	UINT8 id;
+	UINT8 flags;
+	UINT16 seq;			/* Big endian */
+} __attribute__((packed)) udp_header_t;
+
+static struct udp_session {
+	BOOLEAN active;
+	EFI_UDP4_SESSION_DATA peer;
+	UINT16 seq;			/* Next expected sequence number */
+	UINT16 packet_size;		/* Negotiated maximum packet size */
+	BOOLEAN poll_pending;		/* Poll not answered yet */
+	CHAR8 last[UDP_MAX_PACKET_SIZE]; /* Last response */
+	UINT32 last_len;
+} udp;
+
+/* A data packet larger than the room left in the read buffer is
+   kept in PENDING: its data is handed out by the following reads and
+   the packet is acknowledged once entirely consumed.  */
+static struct udp_rx {
+	char *buf;
+	UINT32 size;
+	UINT32 used;
+	BOOLEAN reading;
+	struct {
+		UINT8 data[UDP_MAX_PACKET_SIZE];
+		UINT32 len;
+		UINT32 offset;
+		UINT8 flags;
+		UINT16 seq;
+	} pending;
+} udp_rx;
+
+static struct udp_tx {
+	char *buf;
+	UINT32 size;
+	UINT32 sent;
+	BOOLEAN writing;
+	BOOLEAN done;
+} udp_tx;
+
+static start_callback_t udp_start_callback;
+static data_callback_t udp_rx_callback;
+static data_callback_t udp_tx_callback;
+
+static EFI_STATUS udp_reply(EFI_UDP4_SESSION_DATA *peer, UINT8 id,
+			    UINT8 flags, UINT16 seq,
+			    const void *data, UINT32 len)
+{
+	CHAR8 pkt[UDP_MAX_PACKET_SIZE];
+	udp_header_t *hdr = (udp_header_t *)pkt;
+
+	if (len > sizeof(pkt) - sizeof(*hdr))
+		return EFI_BAD_BUFFER_SIZE;
+
+	hdr->id = id;
+	hdr->flags = flags;
+	hdr->seq = htobe16(seq);
+	if (len)
+		memcpy(pkt + sizeof(*hdr), data, len);
+
+	/* Responses to the session packets are kept for
+	   retransmission.  */
+	if (id == UDP_ID_INIT || id == UDP_ID_FASTBOOT) {
+		memcpy(udp.last, pkt, sizeof(*hdr) + len);
+		udp.last_len = sizeof(*hdr) + len;
+		udp.seq = seq + 1;
+	}
+
+	return udp_send(peer, pkt, sizeof(*hdr) + len);
+}
+
+static void udp_error(EFI_UDP4_SESSION_DATA *peer, UINT16 seq,
+		      const char *msg)
+{
+	udp_reply(peer, UDP_ID_ERROR, 0, seq, msg, strlen((CHAR8 *)msg));
+}
+
+/* Answer the pending poll with the next chunk of fastboot data.  */
+static void udp_send_data(void)
+{
+	UINT32 len;
+	UINT8 flags = 0;
+
+	len = min(udp_tx.size - udp_tx.sent,
+		  (UINT32)(udp.packet_size - sizeof(udp_header_t)));
+	if (udp_tx.sent + len < udp_tx.size)
+		flags = UDP_FLAG_CONTINUATION;
+
+	udp.poll_pending = FALSE;
+	if (EFI_ERROR(udp_reply(&udp.peer, UDP_ID_FASTBOOT, flags, udp.seq,
+				udp_tx.buf + udp_tx.sent, len)))
+		return;
+
+	udp_tx.sent += len;
+	if (udp_tx.sent == udp_tx.size) {
+		udp_tx.writing = FALSE;
+		udp_tx.done = TRUE;
+	}
+}
+
+static void udp_process_init(EFI_UDP4_SESSION_DATA *peer, UINT16 seq,
+			     UINT8 *data, UINT32 len)
+{
+	UINT16 version, host_packet_size, resp[2];
+
+	if (len < sizeof(resp)) {
+		udp_error(peer, seq, "Invalid init packet");
+		return;
+	}
+
+	version = be16toh(*(UINT16 *)data);
+	host_packet_size = be16toh(*(UINT16 *)(data + sizeof(UINT16)));
+	if (version < UDP_PROTOCOL_VERSION ||
+	    host_packet_size < UDP_MIN_PACKET_SIZE) {
+		udp_error(peer, seq, "Unsupported protocol version or packet size");
+		return;
+	}
+
+	/* A new session replaces the current one.  */
+	memcpy(&udp.peer, peer, sizeof(udp.peer));
+	udp.packet_size = min(host_packet_size, (UINT16)UDP_MAX_PACKET_SIZE);
+	udp.poll_pending = FALSE;
+	udp_rx.reading = FALSE;
+	udp_rx.pending.len = 0;
+	udp_tx.writing = udp_tx.done = FALSE;
+
+	resp[0] = htobe16(UDP_PROTOCOL_VERSION);
+	resp[1] = htobe16(udp.packet_size);
+	if (EFI_ERROR(udp_reply(peer, UDP_ID_INIT, 0, seq, resp, sizeof(resp))))
+		return;
+
+	debug(L"Fastboot UDP session started, %d bytes packets",
+	      udp.packet_size);
+	udp.active = TRUE;
+	udp_start_callback();
+}
+
+/* The read completes with the last packet of a transfer or once its
+   buffer is full */
+static void udp_rx_complete(UINT8 flags)
+{
+	if (!(flags & UDP_FLAG_CONTINUATION) || udp_rx.used == udp_rx.size) {
+		udp_rx.reading = FALSE;
+		udp_rx_callback(udp_rx.buf, udp_rx.used);
+	}
+}
+
+static void udp_rx_consume_pending(void)
+{
+	UINT32 len;
+
+	len = min(udp_rx.pending.len - udp_rx.pending.offset,
+		  udp_rx.size - udp_rx.used);
+	memcpy(udp_rx.buf + udp_rx.used,
+	       udp_rx.pending.data + udp_rx.pending.offset, len);
+	udp_rx.used += len;
+	udp_rx.pending.offset += len;
+
+	if (udp_rx.pending.offset < udp_rx.pending.len) {
+		udp_rx.reading = FALSE;
+		udp_rx_callback(udp_rx.buf, udp_rx.used);
+		return;
+	}
+
+	udp_rx.pending.len = 0;
+	if (EFI_ERROR(udp_reply(&udp.peer, UDP_ID_FASTBOOT, 0,
+				udp_rx.pending.seq, NULL, 0)))
+		return;
+
+	udp_rx_complete(udp_rx.pending.flags);
+}
+
+static void udp_process_fastboot(UINT8 flags, UINT16 seq,
+				 UINT8 *data, UINT32 len)
+{
+	if (seq != udp.seq)
+		return;
+
+	if (len == 0) {
+		if (udp_tx.writing)
+			udp_send_data();
+		else
+			udp.poll_pending = TRUE;
+		return;
+	}
+
+	/* Not ready to receive this data, or still handing out the
+	   previous packet: do not acknowledge it, the host retransmits
+	   it.  */
+	if (!udp_rx.reading || udp_rx.pending.len)
+		return;
+
+	if (len > udp_rx.size - udp_rx.used) {
+		memcpy(udp_rx.pending.data, data, len);
+		udp_rx.pending.len = len;
+		udp_rx.pending.offset = 0;
+		udp_rx.pending.flags = flags;
+		udp_rx.pending.seq = seq;
+		udp_rx_consume_pending();
+		return;
+	}
+
+	memcpy(udp_rx.buf + udp_rx.used, data, len);
+	udp_rx.used += len;
+
+	if (EFI_ERROR(udp_reply(&udp.peer, UDP_ID_FASTBOOT, 0, seq, NULL, 0)))
+		return;
+
+	udp_rx_complete(flags);
+}
+
+static BOOLEAN udp_is_peer(EFI_UDP4_SESSION_DATA *session)
+{
+	return udp.active &&
+		!memcmp(&session->SourceAddress, &udp.peer.SourceAddress,
+			sizeof(session->SourceAddress)) &&
+		session->SourcePort == udp.peer.SourcePort;
+}
+
+static void transport_udp_rx_cb(EFI_UDP4_SESSION_DATA *session,
+				void *buf, UINT32 size)
+{
+	udp_header_t *hdr = buf;
+	UINT8 *data = (UINT8 *)buf + sizeof(*hdr);
+	UINT32 len = size - sizeof(*hdr);
+	UINT16 seq, cur_seq;
+
+	/* Packets larger than the negotiated size would overflow the
+	   pending and response buffers */
+	if (size < sizeof(*hdr) ||
+	    size > (udp.active ? udp.packet_size : UDP_MAX_PACKET_SIZE))
+		return;
+
+	seq = be16toh(hdr->seq);
+
+	if (hdr->id == UDP_ID_QUERY) {
+		cur_seq = htobe16(udp.seq);
+		udp_reply(session, UDP_ID_QUERY, 0, seq, &cur_seq, sizeof(cur_seq));
+		return;
+	}
+
+	if (udp_is_peer(session) && udp.last_len &&
+	    seq == (UINT16)(udp.seq - 1)) {
+		udp_send(session, udp.last, udp.last_len);
+		return;
+	}
+
+	switch (hdr->id) {
+	case UDP_ID_INIT:
+		udp_process_init(session, seq, data, len);
+		break;
+
+	case UDP_ID_FASTBOOT:
+		if (!udp_is_peer(session)) {
+			udp_error(session, seq, "No session");
+			break;
+		}
+		udp_process_fastboot(hdr->flags, seq, data, len);
+		break;
+
+	default:
+		udp_error(session, seq, "Unknown packet type");
+	}
+}
+
+static EFI_STATUS fastboot_udp_start(start_callback_t start_cb,
+				     data_callback_t rx_cb,
+				     data_callback_t tx_cb)
+{
+#define UDPIP_INFO_FMT L"Fastboot is listening on UDP %d.%d.%d.%d:%d"
+	EFI_STATUS ret;
+	EFI_IPv4_ADDRESS address;
+
+	udp_start_callback = start_cb;
+	udp_rx_callback = rx_cb;
+	udp_tx_callback = tx_cb;
+
+	memset(&udp, 0, sizeof(udp));
+	memset(&udp_rx, 0, sizeof(udp_rx));
+	memset(&udp_tx, 0, sizeof(udp_tx));
+
+	ret = udp_start(UDP_PORT, transport_udp_rx_cb, &address);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ui_print(UDPIP_INFO_FMT, address.Addr[0], address.Addr[1],
+		 address.Addr[2], address.Addr[3], UDP_PORT);
+	debug(UDPIP_INFO_FMT, address.Addr[0], address.Addr[1],
+	      address.Addr[2], address.Addr[3], UDP_PORT);
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS fastboot_udp_stop(void)
+{
+	udp.active = FALSE;
+	return udp_stop();
+}
+
+static EFI_STATUS fastboot_udp_run(void)
+{
+	EFI_STATUS ret;
+
+	/* The rest of a packet is handed out here rather than by
+	   fastboot_udp_read() so that fastboot is not re-entered from
+	   its own transport_read() call.  */
+	if (udp_rx.reading && udp_rx.pending.len)
+		udp_rx_consume_pending();
+
+	ret = udp_run();
+
+	/* The transmit callback is deferred so that fastboot never
+	   re-enters its own transport_write() call.  */
+	if (udp_tx.done) {
+		udp_tx.done = FALSE;
+		udp_tx_callback(udp_tx.buf, udp_tx.size);
+	}
+
+	return ret;
+}
+
+static EFI_STATUS fastboot_udp_write(void *buf, UINT32 size)
+{
+	if (!udp.active)
+		return EFI_NOT_STARTED;
+
+	if (udp_tx.writing || udp_tx.done)
+		return EFI_NOT_READY;
+
+	udp_tx.buf = buf;
+	udp_tx.size = size;
+	udp_tx.sent = 0;
+	udp_tx.writing = TRUE;
+
+	if (udp.poll_pending)
+		udp_send_data();
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS fastboot_udp_read(void *buf, UINT32 size)
+{
+	if (!udp.active)
+		return EFI_NOT_STARTED;
+
+	if (udp_rx.reading)
+		return EFI_NOT_READY;
+
+	udp_rx.buf = buf;
+	udp_rx.size = size;
+	udp_rx.used = 0;
+	udp_rx.reading = TRUE;
+
+	return EFI_SUCCESS;
+}
+
+/* Network: fastboot listens on both TCP and UDP.  The protocol of the
+   last host which started a session is used.  */
+typedef enum net_protocol {
+	NET_NONE,
+	NET_TCP,
+	NET_UDP
+} net_protocol_t;
+static net_protocol_t net_active;
+static BOOLEAN tcp_started, udp_started;
+static start_callback_t net_start_callback;
+
+static void fastboot_net_tcp_start_cb(void)
+{
+	net_active = NET_TCP;
+	net_start_callback();
+}
+
+static void fastboot_net_udp_start_cb(void)
+{
+	net_active = NET_UDP;
+	net_start_callback();
+}
+
+static EFI_STATUS fastboot_net_start(start_callback_t start_cb,
+				     data_callback_t rx_cb,
+				     data_callback_t tx_cb)
+{
+	EFI_STATUS ret;
+
+	net_start_callback = start_cb;
+	net_active = NET_NONE;
+
+	ret = fastboot_tcp_start(fastboot_net_tcp_start_cb, rx_cb, tx_cb);
+	tcp_started = !EFI_ERROR(ret);
+	if (!tcp_started && ret != EFI_UNSUPPORTED)
+		efi_perror(ret, L"Fastboot over TCP is not available");
+
+	ret = fastboot_udp_start(fastboot_net_udp_start_cb, rx_cb, tx_cb);
+	udp_started = !EFI_ERROR(ret);
+	if (!udp_started && ret != EFI_UNSUPPORTED)
+		efi_perror(ret, L"Fastboot over UDP is not available");
+
+	return tcp_started || udp_started ? EFI_SUCCESS : ret;
+}
+
+static EFI_STATUS fastboot_net_stop(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS, udp_ret = EFI_SUCCESS;
+
+	if (tcp_started)
+		ret = tcp_stop();
+	if (udp_started)
+		udp_ret = fastboot_udp_stop();
+
+	tcp_started = udp_started = FALSE;
+	net_active = NET_NONE;
+
+	return EFI_ERROR(ret) ? ret : udp_ret;
+}
+
+static EFI_STATUS fastboot_net_run(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS, udp_ret = EFI_SUCCESS;
+
+	if (tcp_started)
+		ret = tcp_run();
+	if (udp_started)
+		udp_ret = fastboot_udp_run();
+
+	return EFI_ERROR(ret) ? ret : udp_ret;
+}
+
+static EFI_STATUS fastboot_net_read(void *buf, UINT32 size)
+{
+	switch (net_active) {
+	case NET_TCP:
+		return fastboot_tcp_read(buf, size);
+	case NET_UDP:
+		return fastboot_udp_read(buf, size);
+	default:
+		return EFI_NOT_STARTED;
+	}
+}
+
+static EFI_STATUS fastboot_net_write(void *buf, UINT32 size)
+{
+	switch (net_active) {
+	case NET_TCP:
+		return fastboot_tcp_write(buf, size);
+	case NET_UDP:
+		return fastboot_udp_write(buf, size);
+	default:
+		return EFI_NOT_STARTED;
+	}
+}
+
 /* Transport */
 static transport_t FASTBOOT_TRANSPORT[] = {
 	{
 		.name = "USB for fastboot",
 		.start = fastboot_usb_start,
 		.stop = usb_stop,
+#ifdef USB_SOFT_PAUSE
+		.pause = usb_pause,
+#endif
 		.run = usb_run,
 		.read = fastboot_usb_read,
-		.write = usb_write
+		.write = usb_write,
+		.transfer_unit = BLK_DOWNLOAD
 	},
 	{
-		.name = "TCP for fastboot",
-		.start = fastboot_tcp_start,
-		.stop = tcp_stop,
-		.run = tcp_run,
-		.read = fastboot_tcp_read,
-		.write = fastboot_tcp_write
+		.name = "TCP and UDP for fastboot",
+		.start = fastboot_net_start,
+		.stop = fastboot_net_stop,
+		.run = fastboot_net_run,
+		.read = fastboot_net_read,
+		.write = fastboot_net_write
 	}
 };
 
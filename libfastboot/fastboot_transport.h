@@ -33,7 +33,22 @@
 #ifndef _FASTBOOT_TRANSPORT_H_
 #define _FASTBOOT_TRANSPORT_H_
 
+#include <transport.h>
+
 EFI_STATUS fastboot_transport_register(void);
 void fastboot_transport_unregister(void);
 
+/* Receive the next download by TRANSFER_SIZE bytes transfers and
+   discard it to measure the transport throughput.  Zero disarms the
+   benchmark.  The transport statistics are reset at the beginning of
+   the download, RX holds the receive ones at its end.  */
+struct fastboot_bench_result {
+	UINT64 bytes;
+	UINT64 usec;
+	transport_dir_stats_t rx;
+};
+
+EFI_STATUS fastboot_set_bench_download(UINTN transfer_size);
+const struct fastboot_bench_result *fastboot_get_bench_download(void);
+
 #endif	/* _FASTBOOT_TRANSPORT_H_ */
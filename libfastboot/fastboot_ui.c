@@ -93,6 +93,8 @@ static struct msg_for_state {
 
 static const char *DROID_IMG_NAME = "droid_operation";
 
+#define PROGRESS_BAR_HEIGHT 12
+
 /* Boot menu. */
 static ui_boot_action_t BOOT_ACTIONS[] = {
 	{ "start",		NULL,	NORMAL_BOOT },
@@ -259,6 +261,26 @@ void fastboot_ui_refresh(void)
 			      sheight - y - margin);
 }
 
+/* Only fills rectangles: no memory allocation */
+void fastboot_ui_progress(UINT64 done, UINT64 total)
+{
+	UINTN width, filled, y;
+
+	if (!fastboot_ui_initialized || !total)
+		return;
+
+	width = swidth - area_x - margin;
+	filled = min(done, total) * width / total;
+	y = sheight - margin - PROGRESS_BAR_HEIGHT;
+
+	if (filled)
+		ui_fill_area(area_x, y, filled, PROGRESS_BAR_HEIGHT,
+			     &COLOR_WHITE);
+	if (filled < width)
+		ui_fill_area(area_x + filled, y, width - filled,
+			     PROGRESS_BAR_HEIGHT, &COLOR_LIGHTGRAY);
+}
+
 EFI_STATUS fastboot_ui_init(void)
 {
 	ui_image_t *droid;
@@ -42,5 +42,8 @@ void fastboot_ui_destroy(void);
 enum boot_target fastboot_ui_event_handler(void);
 BOOLEAN fastboot_ui_confirm_for_state(enum device_state target);
 void fastboot_ui_refresh(void);
+/* Draw a progress bar at the bottom of the dynamic area, it is
+   erased by the next fastboot_ui_refresh() */
+void fastboot_ui_progress(UINT64 done, UINT64 total);
 
 #endif  /* _FASTBOOT_UI_H_ */
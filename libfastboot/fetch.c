@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "gpt.h"
+#include "slot.h"
+#include "async_io.h"
+#include "sparse.h"
+#include "fetch.h"
+
+/* Partition reads for the fetch command.  The working buffer is split
+   in FETCH_NB_BUFS chunks buffers: while a chunk is sent to the host,
+   the following ones are being read from the storage.  */
+#define FETCH_CHUNK_SIZE	(1024 * 1024)
+#define FETCH_NB_BUFS		ASYNC_IO_MAX_REQUESTS
+
+static struct fetch {
+	struct async_io *aio;
+	CHAR8 *bufs[FETCH_NB_BUFS];
+	UINTN ids[FETCH_NB_BUFS];
+	EFI_STATUS status[FETCH_NB_BUFS];
+	UINTN chunk_size;
+	UINT64 start;		/* Disk offset of the data */
+	UINT64 size;
+	UINT64 issued;		/* Bytes whose read has been submitted */
+	UINT64 returned;	/* Bytes returned by fetch_next() */
+	UINTN next;		/* Buffer of the next chunk to return */
+} f;
+
+EFI_STATUS fetch_start(const CHAR16 *label, UINT64 offset, UINT64 *size,
+		       void *buf, UINTN buf_size)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	UINT64 part_size;
+	UINTN i;
+
+	fetch_end();
+
+	ret = gpt_get_partition_by_label(slot_label(label), &gparti,
+					 LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Cannot access partition '%s'", label);
+		return ret;
+	}
+
+	part_size = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) *
+		gparti.bio->Media->BlockSize;
+	if (!*size && offset < part_size)
+		*size = part_size - offset;
+	if (!*size || offset >= part_size || *size > part_size - offset) {
+		error(L"Range is outside of partition '%s'", label);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	/* Chunks are a multiple of the sparse block size, see
+	   fetch_sparse() */
+	f.chunk_size = min((UINTN)FETCH_CHUNK_SIZE, buf_size / FETCH_NB_BUFS);
+	f.chunk_size &= ~((UINTN)SPARSE_BLOCK_SIZE - 1);
+	if (!f.chunk_size)
+		return EFI_BUFFER_TOO_SMALL;
+
+	ret = async_io_open(&gparti, &f.aio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set up the partition reads");
+		return ret;
+	}
+
+	for (i = 0; i < FETCH_NB_BUFS; i++)
+		f.bufs[i] = (CHAR8 *)buf + i * f.chunk_size;
+	f.start = gparti.part.starting_lba * gparti.bio->Media->BlockSize +
+		offset;
+	f.size = *size;
+	f.issued = f.returned = 0;
+	f.next = 0;
+
+	return EFI_SUCCESS;
+}
+
+/* Submit the reads of the chunks following the one to be returned
+   next, as long as their buffer has been released.  */
+static void fetch_issue(void)
+{
+	UINTN b, len;
+
+	while (f.issued < f.size &&
+	       f.issued / f.chunk_size < f.returned / f.chunk_size + FETCH_NB_BUFS) {
+		b = (f.issued / f.chunk_size) % FETCH_NB_BUFS;
+		len = min((UINT64)f.chunk_size, f.size - f.issued);
+		f.status[b] = async_io_read(f.aio, f.start + f.issued, len,
+					    f.bufs[b], &f.ids[b]);
+		f.issued += len;
+	}
+}
+
+EFI_STATUS fetch_next(void **data, UINTN *len)
+{
+	EFI_STATUS ret;
+	UINTN b = f.next;
+
+	if (!f.aio || f.returned == f.size)
+		return EFI_END_OF_MEDIA;
+
+	fetch_issue();
+
+	ret = f.status[b];
+	if (!EFI_ERROR(ret))
+		ret = async_io_wait(f.aio, f.ids[b]);
+
+	*data = f.bufs[b];
+	*len = min((UINT64)f.chunk_size, f.size - f.returned);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read %d bytes at offset 0x%lx",
+			   *len, f.start + f.returned);
+		memset(*data, 0, *len);
+	}
+
+	f.returned += *len;
+	f.next = (b + 1) % FETCH_NB_BUFS;
+	return ret;
+}
+
+void fetch_end(void)
+{
+	if (f.aio)
+		async_io_close(f.aio);
+	memset(&f, 0, sizeof(f));
+}
+
+EFI_STATUS fetch_sparse(const CHAR16 *label, UINT64 offset, UINT64 size,
+			void *out, UINTN max_size, UINTN *out_size)
+{
+	EFI_STATUS ret;
+	void *buf, *data;
+	UINTN len;
+
+	buf = AllocatePool(FETCH_NB_BUFS * FETCH_CHUNK_SIZE);
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = fetch_start(label, offset, &size, buf,
+			  FETCH_NB_BUFS * FETCH_CHUNK_SIZE);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	if (size % SPARSE_BLOCK_SIZE) {
+		error(L"Size is not a multiple of %d bytes", SPARSE_BLOCK_SIZE);
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	ret = sparse_encode_start(out, max_size);
+	while (!EFI_ERROR(ret)) {
+		ret = fetch_next(&data, &len);
+		if (ret == EFI_END_OF_MEDIA) {
+			ret = sparse_encode_end(out_size);
+			break;
+		}
+		if (!EFI_ERROR(ret))
+			ret = sparse_encode_write(data, len);
+	}
+
+out:
+	fetch_end();
+	FreePool(buf);
+	return ret;
+}
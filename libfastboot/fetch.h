@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _FETCH_H_
+#define _FETCH_H_
+
+#include <efi.h>
+
+/* Largest amount of data a fetch command can return: the DATA
+   response size is 32 bits.  */
+#define FETCH_MAX_SIZE	0xFFFFF000
+
+/* Read SIZE bytes of the partition LABEL from OFFSET.  A SIZE of zero
+   reads up to the end of the partition and is updated accordingly.
+   BUF, of BUF_SIZE bytes, is used for the read-ahead buffers: the next
+   chunks are read from the storage while the previous ones are being
+   sent.  */
+EFI_STATUS fetch_start(const CHAR16 *label, UINT64 offset, UINT64 *size,
+		       void *buf, UINTN buf_size);
+/* Return the next chunk.  On read error, DATA is zeroed so that the
+   host still receives the announced size and the error is returned.  */
+EFI_STATUS fetch_next(void **data, UINTN *len);
+void fetch_end(void);
+
+/* Encode the partition range as an Android sparse image into OUT */
+EFI_STATUS fetch_sparse(const CHAR16 *label, UINT64 offset, UINT64 size,
+			void *out, UINTN max_size, UINTN *out_size);
+
+#endif	/* _FETCH_H_ */
@@ -32,23 +32,35 @@
  *
  */
 
+#define LOG_MODULE LOG_MODULE_FLASH
+
 #include <efi.h>
 #include <efilib.h>
+#include <openssl/sha.h>
 #include <lib.h>
 #include <fastboot.h>
 #include <android.h>
 #include <slot.h>
+#include <timer.h>
 
 #include "uefi_utils.h"
 #include "gpt.h"
 #include "gpt_bin.h"
+#include "blkcache.h"
+#include "async_io.h"
+#include "io_buffer.h"
+#include "random.h"
 #include "flash.h"
 #include "storage.h"
 #include "sparse.h"
+#include "lz4.h"
 #include "oemvars.h"
 #include "vars.h"
 #include "bootloader.h"
 #include "authenticated_action.h"
+#include "hashes.h"
+#include "text_parser.h"
+#include "memtrack.h"
 #if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
 #include "ioc_uart_protocol.h"
 #endif
@@ -59,12 +71,76 @@
 static struct gpt_partition_interface gparti;
 static UINT64 cur_offset;
 
+#ifdef USE_HASH_MANIFEST
+/* The partition write generation is bumped on the first write after
+   the partition selection.  */
+static BOOLEAN part_touched;
+
+static void touch_partition(void)
+{
+	if (part_touched)
+		return;
+
+	hash_manifest_touch(&gparti.part.unique);
+	part_touched = TRUE;
+}
+#else
+#define touch_partition()
+#endif
+
 #define part_start (gparti.part.starting_lba * gparti.bio->Media->BlockSize)
 #define part_end ((gparti.part.ending_lba + 1) * gparti.bio->Media->BlockSize)
 
 #define is_inside_partition(off, sz) \
 		(off >= part_start && off + sz <= part_end)
 
+/* Performance counters, see flash.h */
+static struct flash_perf perf_total;
+static struct flash_perf perf_parts[FLASH_PERF_MAX_PARTITIONS];
+static UINTN perf_nb_parts;
+static struct flash_perf perf_cur;
+static uint64_t perf_start;
+
+static void perf_partition_start(CHAR16 *label)
+{
+	memset(&perf_cur, 0, sizeof(perf_cur));
+	StrNCpy(perf_cur.label, label, ARRAY_SIZE(perf_cur.label) - 1);
+	perf_start = timer_ticks();
+}
+
+static void perf_partition_end(void)
+{
+	if (!perf_start)
+		return;
+
+	perf_cur.usec = ticks_to_usec(timer_ticks() - perf_start);
+	perf_start = 0;
+
+	if (perf_nb_parts == ARRAY_SIZE(perf_parts)) {
+		memmove(perf_parts, perf_parts + 1,
+			sizeof(perf_parts) - sizeof(*perf_parts));
+		perf_nb_parts--;
+	}
+	perf_parts[perf_nb_parts++] = perf_cur;
+}
+
+const struct flash_perf *flash_get_perf(void)
+{
+	return &perf_total;
+}
+
+const struct flash_perf *flash_get_partition_perf(UINTN *nb)
+{
+	*nb = perf_nb_parts;
+	return perf_parts;
+}
+
+void flash_reset_perf(void)
+{
+	memset(&perf_total, 0, sizeof(perf_total));
+	perf_nb_parts = 0;
+}
+
 EFI_STATUS flash_skip(UINT64 size)
 {
 	if (!is_inside_partition(cur_offset, size)) {
@@ -76,221 +152,810 @@ EFI_STATUS flash_skip(UINT64 size)
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_write(VOID *data, UINTN size)
+/* Delta flash: the storage content is read back and compared chunk by
+   chunk, only the chunks which differ are written.  It saves write
+   time and storage endurance when the device already holds a close
+   build.  */
+#define DELTA_CHUNK_SIZE	(1024 * 1024)
+
+static VOID *delta_buf;
+static UINT64 delta_written;
+static UINT64 delta_skipped;
+
+EFI_STATUS flash_set_delta(BOOLEAN enable)
+{
+	if (!enable) {
+		if (delta_buf) {
+			mt_pool_free(delta_buf);
+			delta_buf = NULL;
+		}
+		return EFI_SUCCESS;
+	}
+
+	if (delta_buf)
+		return EFI_SUCCESS;
+
+	delta_buf = mt_pool_alloc(MT_FLASH, DELTA_CHUNK_SIZE);
+	if (!delta_buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	return EFI_SUCCESS;
+}
+
+BOOLEAN flash_get_delta(void)
+{
+	return delta_buf != NULL;
+}
+
+static EFI_STATUS delta_write(VOID *data, UINTN size)
 {
 	EFI_STATUS ret;
+	UINT8 *p = data;
+	UINTN len;
 
-	if (!gparti.bio)
-		return EFI_INVALID_PARAMETER;
+	for (; size; size -= len, p += len) {
+		len = min(size, (UINTN)DELTA_CHUNK_SIZE);
 
-	if (!is_inside_partition(cur_offset, size)) {
-		error(L"Attempt to write outside of partition [%ld %ld] [%ld %ld]",
-				part_start, part_end, cur_offset, cur_offset + size);
-		return EFI_INVALID_PARAMETER;
-	}
-	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio, gparti.bio->Media->MediaId, cur_offset, size, data);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to write bytes");
-		return ret;
+		ret = gpt_disk_read(&gparti, cur_offset, len, delta_buf);
+		if (!EFI_ERROR(ret) && !memcmp(delta_buf, p, len)) {
+			delta_skipped += len;
+			cur_offset += len;
+			continue;
+		}
+
+		ret = gpt_disk_write(&gparti, cur_offset, len, p);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to write bytes");
+			return ret;
+		}
+		delta_written += len;
+		cur_offset += len;
 	}
 
-	cur_offset += size;
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
+static void delta_reset(void)
+{
+	delta_written = 0;
+	delta_skipped = 0;
+}
+
+static void delta_report(void)
+{
+	if (!delta_buf)
+		return;
+
+	fastboot_info("Delta flash: %ld KiB written, %ld KiB unchanged",
+		      delta_written / 1024, delta_skipped / 1024);
+}
+
+/* Set SAME to TRUE if the LABEL partition already starts with the
+   raw image DATA.  Sparse and LZ4 images are never reported as
+   identical.  */
+EFI_STATUS flash_compare(VOID *data, UINTN size, CHAR16 *label, BOOLEAN *same)
 {
 	EFI_STATUS ret;
-	UINT32 *aligned_buf;
+	struct gpt_partition_interface gpart;
+	UINT64 offset, part_size;
+	UINT8 *p = data;
 	VOID *buf;
-	UINTN i, buf_size, write_size;
+	UINTN len;
 
-	if (!gparti.bio || !size || size % gparti.bio->Media->BlockSize)
-		return EFI_INVALID_PARAMETER;
+	*same = FALSE;
+	if (is_sparse_image(data, size) || is_lz4_frame(data, size))
+		return EFI_SUCCESS;
 
-	buf_size = min(gparti.bio->Media->BlockSize * N_BLOCK, size);
-	ret = alloc_aligned(&buf, (VOID **)&aligned_buf, buf_size, gparti.bio->Media->IoAlign);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Unable to allocate the pattern buf");
+	ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
-	for (i = 0; i < buf_size / sizeof(*aligned_buf); i++)
-		aligned_buf[i] = pattern;
+	part_size = (gpart.part.ending_lba + 1 - gpart.part.starting_lba) *
+		gpart.bio->Media->BlockSize;
+	if (size > part_size)
+		return EFI_SUCCESS;
 
-	for (; size; size -= write_size) {
-		write_size = min(size, buf_size);
-		ret = flash_write(aligned_buf, write_size);
-		if (EFI_ERROR(ret))
-			goto out;
+	buf = delta_buf ? delta_buf : mt_pool_alloc(MT_FLASH, DELTA_CHUNK_SIZE);
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	offset = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
+	for (; size; size -= len, p += len, offset += len) {
+		len = min(size, (UINTN)DELTA_CHUNK_SIZE);
+
+		ret = gpt_disk_read(&gpart, offset, len, buf);
+		if (EFI_ERROR(ret) || memcmp(buf, p, len))
+			break;
 	}
+	*same = !EFI_ERROR(ret) && !size;
+
+	if (buf != delta_buf)
+		mt_pool_free(buf);
 
-out:
-	FreePool(buf);
 	return ret;
 }
 
-static EFI_STATUS flash_into_esp(VOID *data, UINTN size, CHAR16 *label)
+/* Write behind: the streaming path copies the data into one of
+   WRITE_BEHIND_COUNT staging buffers.  A buffer is written
+   asynchronously once full or when the next write is not contiguous,
+   so that the producer, a file read for instance, runs while the
+   previous buffers are being written.  */
+#define WRITE_BEHIND_COUNT	3
+#define WRITE_BEHIND_SIZE	(4 * 1024 * 1024)
+
+static struct write_behind {
+	struct async_io *aio;
+	VOID *buf[FLASH_BENCH_MAX_QUEUE_DEPTH];
+	UINTN ids[FLASH_BENCH_MAX_QUEUE_DEPTH];
+	BOOLEAN pending[FLASH_BENCH_MAX_QUEUE_DEPTH];
+	UINTN depth;		/* Number of staging buffers */
+	UINTN cur;
+	UINTN used;
+	UINT64 offset;		/* Disk offset of the current buffer */
+} wb;
+
+static EFI_STATUS write_behind_stop(void);
+
+static EFI_STATUS write_behind_start(UINTN depth)
 {
 	EFI_STATUS ret;
-	EFI_FILE_IO_INTERFACE *io;
+	UINTN i;
 
-	ret = get_esp_fs(&io);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get partition ESP");
-		return ret;
+	write_behind_stop();
+	wb.depth = depth;
+	for (i = 0; i < depth; i++) {
+		wb.buf[i] = mt_pool_alloc(MT_FLASH, WRITE_BEHIND_SIZE);
+		if (!wb.buf[i]) {
+			write_behind_stop();
+			return EFI_OUT_OF_RESOURCES;
+		}
 	}
-	return uefi_write_file_with_dir(io, label, data, size);
-}
-
-#define MBR_LB_SIZE (is_cur_storage_ufs()? 4096:512)
 
-static EFI_STATUS get_full_gpt_header(VOID **data_p, UINTN *size_p)
-{
-	VOID *data = *data_p;
-	UINTN size = *size_p;
-	struct gpt_header *gh;
+	ret = async_io_open(&gparti, &wb.aio);
+	if (EFI_ERROR(ret))
+		write_behind_stop();
 
-	if (size < MBR_LB_SIZE)
-		return EFI_NOT_FOUND;
+	return ret;
+}
 
-	gh = data + MBR_LB_SIZE;
-	size -= MBR_SIZE;
+static EFI_STATUS write_behind_submit(void)
+{
+	EFI_STATUS ret;
 
-	if (size < (GPT_HEADER_SIZE + (GPT_ENTRIES * GPT_ENTRY_SIZE)) ||
-	    CompareMem(gh->signature, EFI_PTAB_HEADER_ID, sizeof(gh->signature)))
-		return EFI_NOT_FOUND;
+	ret = async_io_write(wb.aio, wb.offset, wb.used, wb.buf[wb.cur],
+			     &wb.ids[wb.cur]);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	*data_p = gh;
-	*size_p = (GPT_HEADER_SIZE + (GPT_ENTRIES * GPT_ENTRY_SIZE));
+	wb.pending[wb.cur] = TRUE;
+	wb.cur = (wb.cur + 1) % wb.depth;
+	wb.used = 0;
 	return EFI_SUCCESS;
 }
 
-/* _flash_gpt supports two gpt binary format:
- * - The bpttool gpt binary : MBR + GPT Header + GPT entries
- * - The GPT binary format generated by the gpt_ini2bin.py script.
- */
-static EFI_STATUS _flash_gpt(VOID *data, UINTN size, logical_unit_t log_unit)
+static EFI_STATUS write_behind(VOID *data, UINTN size)
 {
 	EFI_STATUS ret;
-	struct gpt_bin_header *gb_hdr;
-	struct gpt_bin_part *gb_part;
+	UINT8 *p = data;
+	UINTN len;
 
-	ret = get_full_gpt_header(&data, &size);
-	if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND)
-		return ret;
-	if (!EFI_ERROR(ret))
-		return gpt_create((struct gpt_header *)data, size, 0, 0, NULL, log_unit);
+	if (!is_inside_partition(cur_offset, size)) {
+		error(L"Attempt to write outside of partition [%ld %ld] [%ld %ld]",
+				part_start, part_end, cur_offset, cur_offset + size);
+		return EFI_INVALID_PARAMETER;
+	}
 
- 	gb_hdr = data;
- 	gb_part = (struct gpt_bin_part *)&gb_hdr[1];
-	if (size >= sizeof(*gb_hdr) &&
-	    gb_hdr->magic == GPT_BIN_MAGIC &&
-	    size == sizeof(*gb_hdr) + (gb_hdr->npart * sizeof(*gb_part)))
-		return gpt_create(NULL, 0, gb_hdr->start_lba, gb_hdr->npart,
-				  gb_part, log_unit);
+	blkcache_invalidate(gparti.bio, cur_offset, size);
+	if (wb.used && wb.offset + wb.used != cur_offset) {
+		ret = write_behind_submit();
+		if (EFI_ERROR(ret))
+			goto err;
+	}
 
-	error(L"Unsupport gpt binary format");
-	return EFI_INVALID_PARAMETER;
+	for (; size; size -= len, p += len) {
+		if (!wb.used) {
+			if (wb.pending[wb.cur]) {
+				wb.pending[wb.cur] = FALSE;
+				ret = async_io_wait(wb.aio, wb.ids[wb.cur]);
+				if (EFI_ERROR(ret))
+					goto err;
+			}
+			wb.offset = cur_offset;
+		}
+
+		len = min(size, WRITE_BEHIND_SIZE - wb.used);
+		memcpy((UINT8 *)wb.buf[wb.cur] + wb.used, p, len);
+		wb.used += len;
+		cur_offset += len;
+
+		if (wb.used == WRITE_BEHIND_SIZE) {
+			ret = write_behind_submit();
+			if (EFI_ERROR(ret))
+				goto err;
+		}
+	}
+
+	return EFI_SUCCESS;
+
+err:
+	efi_perror(ret, L"Failed to write bytes");
+	return ret;
 }
 
-static EFI_STATUS flash_gpt(VOID *data, UINTN size)
+/* Write the partially filled buffer and wait for all the writes */
+static EFI_STATUS write_behind_flush(void)
 {
 	EFI_STATUS ret;
 
-	ret = _flash_gpt(data, size, LOGICAL_UNIT_USER);
-	return EFI_ERROR(ret) ? ret : EFI_SUCCESS | REFRESH_PARTITION_VAR;
-}
+	if (!wb.aio)
+		return EFI_SUCCESS;
 
-static EFI_STATUS flash_gpt_gpp1(VOID *data, UINTN size)
-{
-	return _flash_gpt(data, size, LOGICAL_UNIT_FACTORY);
+	if (wb.used) {
+		ret = write_behind_submit();
+		if (EFI_ERROR(ret))
+			goto err;
+	}
+
+	memset(wb.pending, 0, sizeof(wb.pending));
+	ret = async_io_wait_all(wb.aio);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	return EFI_SUCCESS;
+
+err:
+	efi_perror(ret, L"Failed to write bytes");
+	return ret;
 }
 
-#ifndef USER
-static EFI_STATUS flash_efirun(VOID *data, UINTN size)
+/* Write the partially filled buffer, wait for all the writes and
+   release the buffers */
+static EFI_STATUS write_behind_stop(void)
 {
-	return fastboot_stop(NULL, data, size, UNKNOWN_TARGET);
+	EFI_STATUS ret = EFI_SUCCESS, ret2;
+	UINTN i;
+
+	if (wb.aio) {
+		if (wb.used)
+			ret = write_behind_submit();
+		ret2 = async_io_wait_all(wb.aio);
+		if (!EFI_ERROR(ret))
+			ret = ret2;
+		async_io_close(wb.aio);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to write bytes");
+	}
+
+	for (i = 0; i < ARRAY_SIZE(wb.buf); i++)
+		if (wb.buf[i])
+			mt_pool_free(wb.buf[i]);
+
+	memset(&wb, 0, sizeof(wb));
+	return ret;
 }
 
-static EFI_STATUS flash_mbr(VOID *data, UINTN size)
+static EFI_STATUS do_flash_write(VOID *data, UINTN size)
 {
-	struct gpt_partition_interface gparti;
 	EFI_STATUS ret;
 
-	if (size > MBR_CODE_SIZE)
+	if (!gparti.bio)
 		return EFI_INVALID_PARAMETER;
 
-	ret = gpt_get_root_disk(&gparti, LOGICAL_UNIT_USER);
+	if (!is_inside_partition(cur_offset, size)) {
+		error(L"Attempt to write outside of partition [%ld %ld] [%ld %ld]",
+				part_start, part_end, cur_offset, cur_offset + size);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	blkcache_invalidate(gparti.bio, cur_offset, size);
+	if (delta_buf)
+		return delta_write(data, size);
+
+	ret = gpt_disk_write(&gparti, cur_offset, size, data);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get disk information");
+		efi_perror(ret, L"Failed to write bytes");
 		return ret;
 	}
 
-	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio,
-				gparti.bio->Media->MediaId, 0, size, data);
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"Failed to flash MBR");
+	cur_offset += size;
+	return EFI_SUCCESS;
+}
 
-	return ret;
+static void perf_account(UINT64 bytes, UINT64 writes, uint64_t start)
+{
+	UINT64 usec = ticks_to_usec(timer_ticks() - start);
+
+	perf_total.bytes += bytes;
+	perf_cur.bytes += bytes;
+	perf_total.writes += writes;
+	perf_cur.writes += writes;
+	perf_total.write_usec += usec;
+	perf_cur.write_usec += usec;
 }
-#endif
 
-static EFI_STATUS flash_sfu(VOID *data, UINTN size)
+static EFI_STATUS raw_write(VOID *data, UINTN size)
 {
-	return flash_into_esp(data, size, L"BIOSUPDATE.fv");
+	if (wb.aio && !delta_buf)
+		return write_behind(data, size);
+
+	return do_flash_write(data, size);
 }
 
-static EFI_STATUS flash_ifwi(VOID *data, UINTN size)
+/* Zero detection: the block aligned runs of zeroes of at least
+   ZERO_RUN_MIN_SIZE bytes are not written but zeroed by the storage
+   device, when it guarantees that the blocks then read as zeroes.
+   Padded raw images, vbmeta or dtbo for instance, are flashed about
+   as fast as their sparse version.  */
+#define ZERO_RUN_MIN_SIZE	(256 * 1024)
+
+static BOOLEAN zero_detect;
+/* The storage device cannot zero blocks, see storage_write_zeroes() */
+static BOOLEAN zero_unsupported;
+static UINT64 zero_skipped;
+
+EFI_STATUS flash_set_zero_detect(BOOLEAN enable)
 {
-	return flash_into_esp(data, size, L"ifwi.bin");
+	zero_detect = enable;
+	return EFI_SUCCESS;
 }
 
-#if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
-static EFI_STATUS flash_ioc(VOID *data, UINTN size)
+BOOLEAN flash_get_zero_detect(void)
 {
-	EFI_STATUS ret;
-	EFI_GUID guid = EFI_IOC_UART_PROTOCOL_GUID;
-	IOC_UART_PROTOCOL *iocprotocal;
+	return zero_detect;
+}
 
-	ret = LibLocateProtocol(&guid, (void **)&iocprotocal);
-	if (EFI_ERROR(ret)) {
-		debug(L"IOC UART Protocol is not supported");
-		return EFI_UNSUPPORTED;
-	}
+static void zero_reset(void)
+{
+	zero_unsupported = FALSE;
+	zero_skipped = 0;
+}
 
-	if (!EFI_ERROR(ret)) {
-		ret = uefi_call_wrapper(iocprotocal->flash_ioc_firmware, 3, iocprotocal, data, size);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to flash ioc firmware");
-			return ret;
+static void zero_report(void)
+{
+	if (zero_detect && zero_skipped)
+		fastboot_info("Zero detection: %ld KiB zeroed by the device",
+			      zero_skipped / 1024);
+}
+
+static BOOLEAN is_zero(const UINT8 *p, UINTN size)
+{
+	const UINT64 *w = (const UINT64 *)p;
+	UINTN i;
+
+	for (i = 0; i < size / sizeof(*w); i++)
+		if (w[i])
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Zero the SIZE bytes of zeroes DATA at the current offset, or write
+   them if the device cannot.  */
+static EFI_STATUS zero_write(VOID *data, UINTN size)
+{
+	UINTN bs = gparti.bio->Media->BlockSize;
+	EFI_LBA lba = cur_offset / bs;
+	EFI_STATUS ret;
+
+	if (!zero_unsupported) {
+		ret = storage_write_zeroes(gparti.handle, gparti.bio, lba,
+					   lba + size / bs - 1);
+		if (!EFI_ERROR(ret)) {
+			zero_skipped += size;
+			cur_offset += size;
+			return EFI_SUCCESS;
 		}
+		if (ret != EFI_UNSUPPORTED)
+			efi_perror(ret, L"Failed to write zeroes, falling back to writing them");
+		zero_unsupported = TRUE;
 	}
 
-	return EFI_SUCCESS;
+	return raw_write(data, size);
 }
-#endif
 
-static EFI_STATUS flash_new_bootimage(VOID *kernel, UINTN kernel_size,
-				      VOID *ramdisk, UINTN ramdisk_size)
+/* The zero run [RUN, END) ends: if it is long enough, the data extent
+   [*EXTENT, RUN) is written and the run zeroed.  */
+static EFI_STATUS zero_run_end(UINT8 **extent, UINT8 *run, UINT8 *end)
 {
-	struct boot_img_hdr *bootimage, *new_bootimage;
-	VOID *new_cur, *cur;
-	UINTN new_size, partlen, page_size;
 	EFI_STATUS ret;
 
-	ret = gpt_get_partition_by_label(slot_label(BOOT_LABEL), &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		error(L"Unable to get information on the boot partition");
-		return ret;
-	}
-	partlen = (gparti.part.ending_lba + 1 - gparti.part.starting_lba)
-		* gparti.bio->Media->BlockSize;
+	if (!run || (UINTN)(end - run) < ZERO_RUN_MIN_SIZE)
+		return EFI_SUCCESS;
 
-	bootimage = AllocatePool(sizeof(*bootimage));
-	if (!bootimage) {
-		error(L"Unable to allocate bootimage buffer");
-		return EFI_OUT_OF_RESOURCES;
+	if (run != *extent) {
+		ret = raw_write(*extent, run - *extent);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	ret = zero_write(run, end - run);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	*extent = end;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS zero_detect_write(VOID *data, UINTN size)
+{
+	UINTN bs = gparti.bio->Media->BlockSize;
+	UINT8 *p = data, *end = p + size, *extent = p, *run = NULL;
+	EFI_STATUS ret;
+
+	if (cur_offset % bs || !is_inside_partition(cur_offset, size))
+		return raw_write(data, size);
+
+	for (; (UINTN)(end - p) >= bs; p += bs) {
+		if (is_zero(p, bs)) {
+			if (!run)
+				run = p;
+			continue;
+		}
+
+		ret = zero_run_end(&extent, run, p);
+		if (EFI_ERROR(ret))
+			return ret;
+		run = NULL;
+	}
+
+	ret = zero_run_end(&extent, run, p);
+	if (EFI_ERROR(ret) || extent == end)
+		return ret;
+
+	return raw_write(extent, end - extent);
+}
+
+EFI_STATUS flash_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	uint64_t start;
+
+	touch_partition();
+	start = timer_ticks();
+	if (zero_detect && !zero_unsupported && !delta_buf)
+		ret = zero_detect_write(data, size);
+	else
+		ret = raw_write(data, size);
+	perf_account(EFI_ERROR(ret) ? 0 : size, 1, start);
+
+	return ret;
+}
+
+/* Write the BUF_SIZE bytes BUF pattern buffer over and over, up to
+   FILL_QUEUE_DEPTH writes being in flight.  */
+static EFI_STATUS fill_async(VOID *buf, UINTN buf_size, UINTN size)
+{
+	struct async_io *aio;
+	UINTN ids[FILL_QUEUE_DEPTH], n, write_size;
+	UINT64 written = 0;
+	uint64_t start;
+	EFI_STATUS ret, ret2;
+
+	if (!is_inside_partition(cur_offset, size)) {
+		error(L"Attempt to write outside of partition [%ld %ld] [%ld %ld]",
+				part_start, part_end, cur_offset, cur_offset + size);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ret = async_io_open(&gparti, &aio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open the I/O context");
+		return ret;
+	}
+
+	start = timer_ticks();
+	for (n = 0; size; size -= write_size, n++) {
+		write_size = min(size, buf_size);
+		if (n >= FILL_QUEUE_DEPTH) {
+			ret = async_io_wait(aio, ids[n % FILL_QUEUE_DEPTH]);
+			if (EFI_ERROR(ret))
+				break;
+		}
+		ret = async_io_write(aio, cur_offset, write_size, buf,
+				     &ids[n % FILL_QUEUE_DEPTH]);
+		if (EFI_ERROR(ret))
+			break;
+		cur_offset += write_size;
+		written += write_size;
+	}
+
+	ret2 = async_io_wait_all(aio);
+	if (!EFI_ERROR(ret))
+		ret = ret2;
+	async_io_close(aio);
+	perf_account(EFI_ERROR(ret) ? 0 : written, n, start);
+
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to write bytes");
+	return ret;
+}
+
+EFI_STATUS flash_fill(UINT32 pattern, UINTN size)
+{
+	EFI_STATUS ret;
+	VOID *buf;
+	UINTN buf_size, write_size;
+	EFI_LBA lba;
+
+	if (!gparti.bio || !size || size % gparti.bio->Media->BlockSize)
+		return EFI_INVALID_PARAMETER;
+
+	touch_partition();
+
+	/* Let the device zero the blocks when it can guarantee it */
+	if (!pattern && !(cur_offset % gparti.bio->Media->BlockSize) &&
+	    is_inside_partition(cur_offset, size)) {
+		lba = cur_offset / gparti.bio->Media->BlockSize;
+		ret = storage_write_zeroes(gparti.handle, gparti.bio, lba,
+					   lba + size / gparti.bio->Media->BlockSize - 1);
+		if (!EFI_ERROR(ret)) {
+			cur_offset += size;
+			return EFI_SUCCESS;
+		}
+		if (ret != EFI_UNSUPPORTED)
+			efi_perror(ret, L"Failed to write zeroes, falling back to writing them");
+	}
+
+	ret = io_buffer_get_pattern(gparti.bio, 0, pattern, &buf, &buf_size);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Unable to get the pattern buf");
+		return ret;
+	}
+
+	/* The delta flash reads each chunk back before writing it */
+	if (size > buf_size && !delta_buf)
+		return fill_async(buf, buf_size, size);
+
+	for (; size; size -= write_size) {
+		write_size = min(size, buf_size);
+		ret = flash_write(buf, write_size);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS flash_into_esp(VOID *data, UINTN size, CHAR16 *label)
+{
+	EFI_STATUS ret;
+	EFI_FILE_IO_INTERFACE *io;
+
+	ret = get_esp_fs(&io);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition ESP");
+		return ret;
+	}
+	return uefi_write_file_with_dir(io, label, data, size);
+}
+
+#define MBR_LB_SIZE (is_cur_storage_ufs()? 4096:512)
+
+static EFI_STATUS get_full_gpt_header(VOID **data_p, UINTN *size_p)
+{
+	VOID *data = *data_p;
+	UINTN size = *size_p;
+	struct gpt_header *gh;
+
+	if (size < MBR_LB_SIZE)
+		return EFI_NOT_FOUND;
+
+	gh = data + MBR_LB_SIZE;
+	size -= MBR_SIZE;
+
+	if (size < (GPT_HEADER_SIZE + (GPT_ENTRIES * GPT_ENTRY_SIZE)) ||
+	    CompareMem(gh->signature, EFI_PTAB_HEADER_ID, sizeof(gh->signature)))
+		return EFI_NOT_FOUND;
+
+	*data_p = gh;
+	*size_p = (GPT_HEADER_SIZE + (GPT_ENTRIES * GPT_ENTRY_SIZE));
+	return EFI_SUCCESS;
+}
+
+/* _flash_gpt supports two gpt binary format:
+ * - The bpttool gpt binary : MBR + GPT Header + GPT entries
+ * - The GPT binary format generated by the gpt_ini2bin.py script.
+ */
+static EFI_STATUS _flash_gpt(VOID *data, UINTN size, logical_unit_t log_unit)
+{
+	EFI_STATUS ret;
+	struct gpt_bin_header *gb_hdr;
+	struct gpt_bin_part *gb_part;
+
+	ret = get_full_gpt_header(&data, &size);
+	if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND)
+		return ret;
+	if (!EFI_ERROR(ret))
+		return gpt_create((struct gpt_header *)data, size, 0, 0, NULL, log_unit);
+
+ 	gb_hdr = data;
+ 	gb_part = (struct gpt_bin_part *)&gb_hdr[1];
+	if (size >= sizeof(*gb_hdr) &&
+	    gb_hdr->magic == GPT_BIN_MAGIC &&
+	    size == sizeof(*gb_hdr) + (gb_hdr->npart * sizeof(*gb_part)))
+		return gpt_create(NULL, 0, gb_hdr->start_lba, gb_hdr->npart,
+				  gb_part, log_unit);
+
+	error(L"Unsupport gpt binary format");
+	return EFI_INVALID_PARAMETER;
+}
+
+static EFI_STATUS flash_gpt(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	ret = _flash_gpt(data, size, LOGICAL_UNIT_USER);
+#ifdef USE_HASH_MANIFEST
+	hash_manifest_clear();
+#endif
+	return EFI_ERROR(ret) ? ret : EFI_SUCCESS | REFRESH_PARTITION_VAR;
+}
+
+static EFI_STATUS flash_gpt_gpp1(VOID *data, UINTN size)
+{
+	return _flash_gpt(data, size, LOGICAL_UNIT_FACTORY);
+}
+
+#ifndef USER
+static EFI_STATUS flash_efirun(VOID *data, UINTN size)
+{
+	return fastboot_stop(NULL, data, size, UNKNOWN_TARGET);
+}
+
+static EFI_STATUS flash_mbr(VOID *data, UINTN size)
+{
+	struct gpt_partition_interface gparti;
+	EFI_STATUS ret;
+
+	if (size > MBR_CODE_SIZE)
+		return EFI_INVALID_PARAMETER;
+
+	ret = gpt_get_root_disk(&gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get disk information");
+		return ret;
+	}
+
+	blkcache_invalidate(gparti.bio, 0, size);
+	ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId, 0, size, data);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to flash MBR");
+
+	return ret;
+}
+#endif
+
+/* Firmware update capsules are ESP files picked up by the BIOS */
+static const struct capsule_file {
+	CHAR16 *label;
+	CHAR16 *path;
+} CAPSULE_FILES[] = {
+	{ L"sfu", L"BIOSUPDATE.fv" },
+	{ L"ifwi", L"ifwi.bin" }
+};
+
+static const struct capsule_file *get_capsule_file(CHAR16 *label)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(CAPSULE_FILES); i++)
+		if (!StrCmp(CAPSULE_FILES[i].label, label))
+			return &CAPSULE_FILES[i];
+
+	return NULL;
+}
+
+static EFI_STATUS flash_sfu(VOID *data, UINTN size)
+{
+	return flash_into_esp(data, size, get_capsule_file(L"sfu")->path);
+}
+
+static EFI_STATUS flash_ifwi(VOID *data, UINTN size)
+{
+	return flash_into_esp(data, size, get_capsule_file(L"ifwi")->path);
+}
+
+#if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
+static EFI_STATUS flash_ioc(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	EFI_GUID guid = EFI_IOC_UART_PROTOCOL_GUID;
+	IOC_UART_PROTOCOL *iocprotocal;
+
+	ret = LibLocateProtocol(&guid, (void **)&iocprotocal);
+	if (EFI_ERROR(ret)) {
+		debug(L"IOC UART Protocol is not supported");
+		return EFI_UNSUPPORTED;
+	}
+
+	if (!EFI_ERROR(ret)) {
+		ret = uefi_call_wrapper(iocprotocal->flash_ioc_firmware, 3, iocprotocal, data, size);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to flash ioc firmware");
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+#endif
+
+/* When the new kernel or ramdisk takes the same number of pages as
+   the current one, the boot image layout does not change: only the
+   component, its padding and the header are written.  BOOTIMAGE is
+   the current header, it is updated.  */
+static EFI_STATUS flash_bootimage_in_place(struct boot_img_hdr *bootimage,
+					   VOID *kernel, UINTN kernel_size,
+					   VOID *ramdisk, UINTN ramdisk_size)
+{
+	UINT64 offset = bootimage->page_size;
+	VOID *data;
+	UINTN size;
+	EFI_STATUS ret;
+
+	if (kernel) {
+		if (pagealign(bootimage, kernel_size) !=
+		    pagealign(bootimage, bootimage->kernel_size))
+			return EFI_UNSUPPORTED;
+		data = kernel;
+		size = kernel_size;
+		bootimage->kernel_size = kernel_size;
+	} else {
+		if (pagealign(bootimage, ramdisk_size) !=
+		    pagealign(bootimage, bootimage->ramdisk_size))
+			return EFI_UNSUPPORTED;
+		offset += pagealign(bootimage, bootimage->kernel_size);
+		data = ramdisk;
+		size = ramdisk_size;
+		bootimage->ramdisk_size = ramdisk_size;
+	}
+
+	debug(L"Updating %ld bytes of the boot image in place", size);
+	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize +
+		offset;
+	ret = flash_write(data, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Same padding as a rebuilt image */
+	if (pagealign(bootimage, size) != size) {
+		size = pagealign(bootimage, size) - size;
+		data = AllocateZeroPool(size);
+		if (!data)
+			return EFI_OUT_OF_RESOURCES;
+		ret = flash_write(data, size);
+		FreePool(data);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	/* The header is written last: an interrupted update leaves the
+	   previous sizes, which still describe the same layout.  */
+	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	return flash_write(bootimage, sizeof(*bootimage));
+}
+
+static EFI_STATUS flash_new_bootimage(VOID *kernel, UINTN kernel_size,
+				      VOID *ramdisk, UINTN ramdisk_size)
+{
+	struct boot_img_hdr *bootimage, *new_bootimage;
+	VOID *new_cur, *cur;
+	UINTN new_size, partlen, page_size;
+	EFI_STATUS ret;
+
+	ret = gpt_get_partition_by_label(slot_label(BOOT_LABEL), &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		error(L"Unable to get information on the boot partition");
+		return ret;
+	}
+	partlen = (gparti.part.ending_lba + 1 - gparti.part.starting_lba)
+		* gparti.bio->Media->BlockSize;
+
+	bootimage = AllocatePool(sizeof(*bootimage));
+	if (!bootimage) {
+		error(L"Unable to allocate bootimage buffer");
+		return EFI_OUT_OF_RESOURCES;
 	}
 
 	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
@@ -298,288 +963,1438 @@ static EFI_STATUS flash_new_bootimage(VOID *kernel, UINTN kernel_size,
 				gparti.part.starting_lba * gparti.bio->Media->BlockSize,
 				sizeof(*bootimage), bootimage);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to load the current bootimage");
-		goto out;
+		efi_perror(ret, L"Failed to load the current bootimage");
+		goto out;
+	}
+
+	if (memcmp(bootimage->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+		error(L"boot partition does not contain a valid bootimage");
+		ret = EFI_UNSUPPORTED;
+		goto out;
+	}
+
+	if (bootimage_size(bootimage) > partlen) {
+		error(L"Invalid boot image size");
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	ret = flash_bootimage_in_place(bootimage, kernel, kernel_size,
+				       ramdisk, ramdisk_size);
+	if (ret != EFI_UNSUPPORTED)
+		goto out;
+
+	bootimage = ReallocatePool(bootimage, sizeof(*bootimage),
+				   bootimage_size(bootimage));
+	if (!bootimage) {
+		error(L"Unable to increase the bootimage buffer size");
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId,
+				gparti.part.starting_lba * gparti.bio->Media->BlockSize,
+				bootimage_size(bootimage), bootimage);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to load the current bootimage");
+		goto out;
+	}
+
+	page_size = bootimage->page_size;
+	if (!kernel) {
+		kernel = (VOID *)bootimage + page_size;
+		kernel_size = bootimage->kernel_size;
+	}
+	if (!ramdisk) {
+		ramdisk = (VOID *)bootimage + page_size +
+			pagealign(bootimage, bootimage->kernel_size);
+		ramdisk_size = bootimage->ramdisk_size;
+	}
+
+	new_size = bootimage_size(bootimage)
+		- pagealign(bootimage, bootimage->kernel_size)
+		+ pagealign(bootimage, kernel_size)
+		- pagealign(bootimage, bootimage->ramdisk_size)
+		+ pagealign(bootimage, ramdisk_size);
+	if (new_size > partlen) {
+		error(L"Kernel image is too large to fit in the boot partition");
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	new_bootimage = AllocateZeroPool(new_size);
+	if (!new_bootimage) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	/* Create the new bootimage. */
+	memcpy((VOID *)new_bootimage, bootimage, sizeof(*bootimage));
+
+	cur = (VOID *)bootimage + page_size;
+	new_cur = (VOID *)new_bootimage + page_size;
+
+	new_bootimage->kernel_size = kernel_size;
+	memcpy(new_cur, kernel, kernel_size);
+
+	cur += pagealign(bootimage, bootimage->kernel_size);
+	new_cur += pagealign(new_bootimage, kernel_size);
+
+	new_bootimage->ramdisk_size = ramdisk_size;
+	memcpy(new_cur, ramdisk, ramdisk_size);
+
+	cur += pagealign(bootimage, bootimage->ramdisk_size);
+	new_cur += pagealign(new_bootimage, ramdisk_size);
+
+	memcpy(new_cur, cur, bootimage->second_size);
+
+	if (bootimage->header_version >= 1) {
+		memcpy(new_bootimage + new_bootimage->recovery_acpio_offset,
+			   bootimage + bootimage->recovery_acpio_offset,
+			   bootimage->recovery_acpio_size);
+	}
+
+	if (bootimage->header_version == 2) {
+		memcpy(new_bootimage + new_bootimage->acpi_addr,
+			   bootimage + bootimage->acpi_addr,
+			   bootimage->acpi_size);
+	}
+
+	/* Flash new the bootimage. */
+	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	ret = flash_write(new_bootimage, new_size);
+
+	FreePool(new_bootimage);
+
+out:
+	FreePool(bootimage);
+	return ret;
+}
+
+static EFI_STATUS flash_kernel(VOID *data, UINTN size)
+{
+	return flash_new_bootimage(data, size, NULL, 0);
+}
+
+static EFI_STATUS flash_ramdisk(VOID *data, UINTN size)
+{
+	return flash_new_bootimage(NULL, 0, data, size);
+}
+
+static CHAR16 *DM_VERITY_PARTITIONS[] =
+	{ SYSTEM_LABEL, VENDOR_LABEL, OEM_LABEL };
+
+static EFI_STATUS flash_partition_done(CHAR16 *label);
+static void checkpoint_clear(void);
+
+/* A LZ4 compressed image fully downloaded is decompressed block by
+   block through the streaming path.  */
+static EFI_STATUS flash_lz4(VOID *data, UINTN size, CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	ret = flash_stream_start(label, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = flash_stream_write(data, size);
+	if (EFI_ERROR(ret)) {
+		flash_stream_abort();
+		return ret;
+	}
+
+	return flash_stream_end(label);
+}
+
+EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	if (is_lz4_frame(data, size))
+		return flash_lz4(data, size, label);
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	delta_reset();
+	zero_reset();
+	checkpoint_clear();
+	perf_partition_start(label);
+#ifdef USE_HASH_MANIFEST
+	part_touched = FALSE;
+#endif
+
+	if (is_sparse_image(data, size))
+		ret = flash_sparse(data, size);
+	else
+		ret = flash_write(data, size);
+
+	if (EFI_ERROR(ret)) {
+		perf_start = 0;
+		return ret;
+	}
+
+	return flash_partition_done(label);
+}
+
+static EFI_STATUS flash_partition_done(CHAR16 *label)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	delta_report();
+	zero_report();
+	perf_partition_end();
+
+	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid)) {
+		ret = gpt_refresh();
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(DM_VERITY_PARTITIONS); i++)
+		if (!StrCmp(DM_VERITY_PARTITIONS[i], label))
+			return slot_set_verity_corrupted(FALSE);
+
+	return EFI_SUCCESS;
+}
+
+static struct label_exception {
+	CHAR16 *name;
+	EFI_STATUS (*flash_func)(VOID *data, UINTN size);
+} LABEL_EXCEPTIONS[] = {
+	{ L"gpt", flash_gpt },
+	{ L"gpt-gpp1", flash_gpt_gpp1 },
+#ifndef USER
+	{ L"efirun", flash_efirun },
+	{ L"mbr", flash_mbr },
+#endif
+	{ L"sfu", flash_sfu },
+	{ L"ifwi", flash_ifwi },
+	{ L"oemvars", flash_oemvars },
+	{ L"kernel", flash_kernel },
+	{ L"ramdisk", flash_ramdisk },
+	{ ESP_LABEL, flash_esp },
+	{ BOOTLOADER_LABEL, flash_bootloader },
+	{ BOOTLOADER_A_LABEL, flash_bootloader_a },
+	{ BOOTLOADER_B_LABEL, flash_bootloader_b },
+#if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
+	{ L"ioc", flash_ioc },
+#endif
+#ifdef BOOTLOADER_POLICY
+	{ CONVERT_TO_WIDE(ACTION_AUTHORIZATION), authenticated_action },
+#endif
+#ifdef FASTBOOT_KEYBOX_PROVISION
+	{ L"keybox", flash_keybox }
+#endif
+};
+
+EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
+{
+	UINTN i;
+
+#ifndef USER
+	/* special case for writing inside esp partition */
+	CHAR16 esp[] = L"/ESP/";
+	if (!StrnCmp(esp, label, StrLen(esp)))
+		return flash_into_esp(data, size, &label[ARRAY_SIZE(esp) - 1]);
+#endif
+	/* special cases */
+	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
+		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
+			return LABEL_EXCEPTIONS[i].flash_func(data, size);
+
+	return flash_partition(data, size, label);
+}
+
+/* Streaming flash: the data is written to the partition segment by
+   segment while it is still being received.  Only regular partitions
+   are supported, special labels need the whole image at once.  The
+   stream can be a LZ4 frame wrapping a raw or sparse image.  The
+   firmware update capsules are the exception, see below.  */
+static BOOLEAN stream_started;
+static BOOLEAN stream_lz4;
+static BOOLEAN stream_image_started;
+static BOOLEAN stream_sparse;
+static UINT64 stream_size;
+
+/* Capsule staging: a firmware update capsule is streamed into a
+   temporary ESP file while its SHA-256 is computed.  At the end of
+   the stream, the file is read back and its digest compared to the
+   streamed one.  Only a verified file replaces the capsule the BIOS
+   looks for, so an interrupted or corrupted download never leaves a
+   truncated capsule behind.  */
+#define CAPSULE_TMP_SUFFIX	L".new"
+#define CAPSULE_VERIFY_CHUNK	(1024 * 1024)
+
+static struct capsule_stream {
+	const struct capsule_file *capsule;
+	EFI_FILE_IO_INTERFACE *io;
+	EFI_FILE *file;
+	CHAR16 tmp_path[32];
+	SHA256_CTX sha;
+	UINT64 written;
+} cstream;
+
+static void capsule_stream_close(BOOLEAN delete)
+{
+	if (!cstream.file)
+		return;
+
+	if (delete)
+		uefi_call_wrapper(cstream.file->Delete, 1, cstream.file);
+	else
+		uefi_call_wrapper(cstream.file->Close, 1, cstream.file);
+	cstream.file = NULL;
+}
+
+static EFI_STATUS capsule_stream_start(const struct capsule_file *capsule)
+{
+	EFI_STATUS ret;
+	EFI_FILE *root;
+
+	if (StrLen(capsule->path) + StrLen(CAPSULE_TMP_SUFFIX) >=
+	    ARRAY_SIZE(cstream.tmp_path))
+		return EFI_BUFFER_TOO_SMALL;
+
+	ret = get_esp_fs(&cstream.io);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition ESP");
+		return ret;
+	}
+
+	StrCpy(cstream.tmp_path, capsule->path);
+	StrCat(cstream.tmp_path, CAPSULE_TMP_SUFFIX);
+
+	/* A left over from a previous staging attempt must not be
+	   extended */
+	if (uefi_exist_file_root(cstream.io, cstream.tmp_path))
+		uefi_delete_file(cstream.io, cstream.tmp_path);
+
+	ret = uefi_call_wrapper(cstream.io->OpenVolume, 2, cstream.io, &root);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open ESP root directory");
+		return ret;
+	}
+
+	ret = uefi_call_wrapper(root->Open, 5, root, &cstream.file,
+				cstream.tmp_path, EFI_FILE_MODE_READ |
+				EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+	uefi_call_wrapper(root->Close, 1, root);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create %s", cstream.tmp_path);
+		cstream.file = NULL;
+		return ret;
+	}
+
+	SHA256_Init(&cstream.sha);
+	cstream.written = 0;
+	cstream.capsule = capsule;
+	perf_partition_start(capsule->label);
+	info(L"Staging capsule into %s", cstream.tmp_path);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS capsule_stream_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINTN len = size;
+	uint64_t start;
+
+	if (cstream.written + size > stream_size) {
+		error(L"Capsule data exceeds the announced size");
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	start = timer_ticks();
+	ret = uefi_call_wrapper(cstream.file->Write, 3, cstream.file, &len, data);
+	perf_account(len, 1, start);
+	if (EFI_ERROR(ret) || len != size) {
+		ret = EFI_ERROR(ret) ? ret : EFI_VOLUME_FULL;
+		efi_perror(ret, L"Failed to write %s", cstream.tmp_path);
+		return ret;
+	}
+
+	SHA256_Update(&cstream.sha, data, size);
+	cstream.written += size;
+	return EFI_SUCCESS;
+}
+
+/* Read the staged file back and check it against the streamed
+   digest */
+static EFI_STATUS capsule_stream_verify(void)
+{
+	EFI_STATUS ret;
+	unsigned char expected[SHA256_DIGEST_LENGTH];
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256_CTX sha;
+	VOID *buf;
+	UINT64 remaining;
+	UINTN len;
+
+	SHA256_Final(expected, &cstream.sha);
+
+	buf = AllocatePool(CAPSULE_VERIFY_CHUNK);
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = uefi_call_wrapper(cstream.file->SetPosition, 2, cstream.file, 0);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to rewind %s", cstream.tmp_path);
+		goto out;
+	}
+
+	SHA256_Init(&sha);
+	for (remaining = cstream.written; remaining; remaining -= len) {
+		len = min(remaining, (UINT64)CAPSULE_VERIFY_CHUNK);
+		ret = uefi_call_wrapper(cstream.file->Read, 3, cstream.file,
+					&len, buf);
+		if (EFI_ERROR(ret) || !len) {
+			ret = EFI_ERROR(ret) ? ret : EFI_END_OF_FILE;
+			efi_perror(ret, L"Failed to read back %s", cstream.tmp_path);
+			goto out;
+		}
+		SHA256_Update(&sha, buf, len);
+	}
+	SHA256_Final(digest, &sha);
+
+	if (memcmp(digest, expected, sizeof(digest))) {
+		error(L"Staged capsule %s is corrupted", cstream.tmp_path);
+		ret = EFI_CRC_ERROR;
+	}
+
+out:
+	FreePool(buf);
+	return ret;
+}
+
+static EFI_STATUS capsule_stream_end(void)
+{
+	EFI_STATUS ret;
+	CHAR16 *path = cstream.capsule->path;
+
+	if (cstream.written != stream_size) {
+		error(L"Capsule is truncated, %ld/%ld bytes",
+		      cstream.written, stream_size);
+		ret = EFI_END_OF_FILE;
+		goto err;
+	}
+
+	ret = uefi_call_wrapper(cstream.file->Flush, 1, cstream.file);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to flush %s", cstream.tmp_path);
+		goto err;
+	}
+
+	ret = capsule_stream_verify();
+	if (EFI_ERROR(ret))
+		goto err;
+
+	capsule_stream_close(FALSE);
+
+	/* The FAT driver does not rename over an existing file */
+	if (uefi_exist_file_root(cstream.io, path)) {
+		ret = uefi_delete_file(cstream.io, path);
+		if (ret == EFI_WARN_DELETE_FAILURE)
+			ret = EFI_ACCESS_DENIED;
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	ret = uefi_rename_file(cstream.io, cstream.tmp_path, path);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to rename %s to %s",
+			   cstream.tmp_path, path);
+		return ret;
+	}
+
+	perf_partition_end();
+	return EFI_SUCCESS;
+
+err:
+	capsule_stream_close(TRUE);
+	return ret;
+}
+
+BOOLEAN flash_is_partition(CHAR16 *label)
+{
+	UINTN i;
+
+#ifndef USER
+	if (!StrnCmp(L"/ESP/", label, 5))
+		return FALSE;
+#endif
+	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
+		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Stream checkpoints: every CHECKPOINT_INTERVAL bytes of a raw
+   image stream, the data written so far is flushed to the storage
+   device and the progress recorded in a volatile variable.  If the
+   transfer is interrupted, the host reads the checkpoint back and
+   only sends the rest of the image.  The CRC32 of the flushed data
+   lets it check that the checkpoint belongs to the same image.  The
+   sparse and LZ4 parsers keep a state between two writes, these
+   streams are not checkpointed.  */
+#define CHECKPOINT_INTERVAL	(64 * 1024 * 1024)
+#define FLASH_CHECKPOINT_VAR	L"FlashCheckpoint"
+
+static struct flash_checkpoint checkpoint;
+
+static void checkpoint_init(CHAR16 *label, UINT64 size, UINT64 offset)
+{
+	memset(&checkpoint, 0, sizeof(checkpoint));
+	StrNCpy(checkpoint.label, label, ARRAY_SIZE(checkpoint.label) - 1);
+	checkpoint.size = size;
+	checkpoint.offset = offset;
+}
+
+static void checkpoint_clear(void)
+{
+	EFI_STATUS ret;
+
+	ret = del_efi_variable(&fastboot_guid, FLASH_CHECKPOINT_VAR);
+	if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND)
+		efi_perror(ret, L"Failed to delete the flash checkpoint");
+}
+
+EFI_STATUS flash_checkpoint_get(struct flash_checkpoint *cp)
+{
+	EFI_STATUS ret;
+	UINTN size;
+	VOID *data;
+
+	if (!cp)
+		return EFI_INVALID_PARAMETER;
+
+	ret = get_efi_variable(&fastboot_guid, FLASH_CHECKPOINT_VAR,
+			       &size, &data, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (size != sizeof(*cp)) {
+		FreePool(data);
+		return EFI_COMPROMISED_DATA;
+	}
+
+	memcpy(cp, data, sizeof(*cp));
+	cp->label[ARRAY_SIZE(cp->label) - 1] = 0;
+	FreePool(data);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_stream_checkpoint(UINT32 crc)
+{
+	EFI_STATUS ret;
+	UINT64 offset;
+
+	if (cstream.file || !stream_image_started || stream_lz4 || stream_sparse)
+		return EFI_SUCCESS;
+
+	offset = cur_offset - part_start;
+	if (offset < checkpoint.offset + CHECKPOINT_INTERVAL)
+		return EFI_SUCCESS;
+
+	ret = write_behind_flush();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = uefi_call_wrapper(gparti.bio->FlushBlocks, 1, gparti.bio);
+	if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED) {
+		efi_perror(ret, L"Failed to flush %s", checkpoint.label);
+		return ret;
+	}
+
+	checkpoint.offset = offset;
+	checkpoint.crc = crc;
+	/* The stream goes on without checkpoint rather than failing */
+	ret = set_efi_variable(&fastboot_guid, FLASH_CHECKPOINT_VAR,
+			       sizeof(checkpoint), &checkpoint, FALSE, FALSE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to record the flash checkpoint");
+
+	return EFI_SUCCESS;
+}
+
+/* Select the LABEL partition for a stream of SIZE bytes starting
+   OFFSET bytes in, SIZE being 0 if the image size is not known yet.
+   The write offset is only set once the stream fits.  */
+static EFI_STATUS stream_partition_open(CHAR16 *label, UINT64 offset,
+					UINT64 size)
+{
+	EFI_STATUS ret;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
 	}
 
-	if (memcmp(bootimage->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
-		error(L"boot partition does not contain a valid bootimage");
-		ret = EFI_UNSUPPORTED;
+	if (offset > part_end - part_start ||
+	    size > part_end - part_start - offset) {
+		error(L"%ld bytes do not fit in partition %s", offset + size,
+		      label);
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	cur_offset = part_start + offset;
+	delta_reset();
+	zero_reset();
+	perf_partition_start(label);
+#ifdef USE_HASH_MANIFEST
+	part_touched = FALSE;
+#endif
+
+	ret = write_behind_start(WRITE_BEHIND_COUNT);
+	if (EFI_ERROR(ret))
+		debug(L"Write behind disabled, %r", ret);
+
+	return EFI_SUCCESS;
+}
+
+BOOLEAN flash_stream_supported(CHAR16 *label)
+{
+	if (get_capsule_file(label))
+		return TRUE;
+
+	return flash_is_partition(label);
+}
+
+EFI_STATUS flash_stream_start(CHAR16 *label, UINT64 size)
+{
+	EFI_STATUS ret;
+	const struct capsule_file *capsule;
+
+	if (!label || !size)
+		return EFI_INVALID_PARAMETER;
+
+	if (!flash_stream_supported(label)) {
+		error(L"Streaming is not supported for %s", label);
+		return EFI_UNSUPPORTED;
+	}
+
+	stream_size = size;
+	stream_started = FALSE;
+	stream_image_started = FALSE;
+	checkpoint_clear();
+	capsule = get_capsule_file(label);
+	if (capsule)
+		return capsule_stream_start(capsule);
+
+	ret = stream_partition_open(label, 0, 0);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	checkpoint_init(label, size, 0);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS flash_stream_resume(CHAR16 *label, UINT64 size, UINT32 *crc)
+{
+	struct flash_checkpoint cp;
+	EFI_STATUS ret;
+
+	if (!label || !size || !crc)
+		return EFI_INVALID_PARAMETER;
+
+	ret = flash_checkpoint_get(&cp);
+	if (EFI_ERROR(ret)) {
+		error(L"No interrupted stream to resume");
+		return ret;
+	}
+
+	if (StrCmp(cp.label, label) || cp.offset + size != cp.size) {
+		error(L"%ld bytes for %s do not complete the %ld/%ld bytes stream to %s",
+		      size, label, cp.offset, cp.size, cp.label);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ret = stream_partition_open(label, cp.offset, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Only raw images are checkpointed, see flash_stream_checkpoint() */
+	stream_size = cp.size;
+	stream_started = TRUE;
+	stream_lz4 = FALSE;
+	stream_image_started = TRUE;
+	stream_sparse = FALSE;
+
+	checkpoint_init(label, cp.size, cp.offset);
+	*crc = cp.crc;
+	info(L"Resuming the stream to %s at %ld bytes", label, cp.offset);
+	return EFI_SUCCESS;
+}
+
+/* Write the uncompressed image data */
+static EFI_STATUS stream_image_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (!stream_image_started) {
+		stream_image_started = TRUE;
+		stream_sparse = is_sparse_image(data, size);
+		if (stream_sparse) {
+			ret = sparse_stream_start();
+			if (EFI_ERROR(ret))
+				return ret;
+		} else if (!stream_lz4 && stream_size > part_end - part_start) {
+			error(L"%ld bytes do not fit in the partition", stream_size);
+			return EFI_BAD_BUFFER_SIZE;
+		}
+	}
+
+	if (stream_sparse)
+		return sparse_stream_write(data, size);
+
+	return flash_write(data, size);
+}
+
+static void stream_image_abort(void)
+{
+	if (stream_image_started && stream_sparse)
+		sparse_stream_end();
+	stream_image_started = FALSE;
+}
+
+EFI_STATUS flash_stream_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+
+	if (cstream.file)
+		return capsule_stream_write(data, size);
+
+	if (!stream_started) {
+		stream_started = TRUE;
+		stream_lz4 = is_lz4_frame(data, size);
+		if (stream_lz4) {
+			ret = lz4_stream_start(stream_image_write);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+	}
+
+	if (stream_lz4)
+		return lz4_stream_write(data, size);
+
+	return stream_image_write(data, size);
+}
+
+EFI_STATUS flash_stream_end(CHAR16 *label)
+{
+	EFI_STATUS ret;
+
+	if (cstream.file)
+		return capsule_stream_end();
+
+	if (!stream_started)
+		return EFI_NOT_STARTED;
+
+	stream_started = FALSE;
+	if (stream_lz4) {
+		ret = lz4_stream_end();
+		if (EFI_ERROR(ret)) {
+			stream_image_abort();
+			write_behind_stop();
+			return ret;
+		}
+	}
+
+	if (!stream_image_started) {
+		write_behind_stop();
+		return EFI_END_OF_FILE;
+	}
+
+	stream_image_started = FALSE;
+	if (stream_sparse) {
+		ret = sparse_stream_end();
+		if (EFI_ERROR(ret)) {
+			write_behind_stop();
+			return ret;
+		}
+	}
+
+	ret = write_behind_stop();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	checkpoint_clear();
+	return flash_partition_done(label);
+}
+
+void flash_stream_abort(void)
+{
+	perf_start = 0;
+	capsule_stream_close(TRUE);
+	if (stream_started && stream_lz4)
+		lz4_stream_end();
+	stream_image_abort();
+	write_behind_stop();
+	stream_started = FALSE;
+}
+
+EFI_STATUS flash_bench_start(CHAR16 *label, UINT64 size, UINTN queue_depth)
+{
+	EFI_STATUS ret;
+
+	if (!label || !size || queue_depth > FLASH_BENCH_MAX_QUEUE_DEPTH)
+		return EFI_INVALID_PARAMETER;
+
+	if (!flash_stream_supported(label)) {
+		error(L"Cannot benchmark the %s special partition", label);
+		return EFI_UNSUPPORTED;
+	}
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	if (size > part_end - part_start) {
+		error(L"%ld bytes do not fit in the partition", size);
+		return EFI_BAD_BUFFER_SIZE;
+	}
+
+	cur_offset = part_start;
+	delta_reset();
+#ifdef USE_HASH_MANIFEST
+	part_touched = FALSE;
+#endif
+
+	if (!queue_depth)
+		return EFI_SUCCESS;
+
+	ret = write_behind_start(queue_depth);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to start the write behind");
+
+	return ret;
+}
+
+EFI_STATUS flash_bench_end(void)
+{
+	EFI_STATUS ret;
+
+	ret = write_behind_stop();
+	delta_report();
+
+	return ret;
+}
+
+EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label)
+{
+	EFI_STATUS ret;
+	EFI_FILE_IO_INTERFACE *io = NULL;
+	VOID *buffer = NULL;
+	UINTN size = 0;
+
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, image, &FileSystemProtocol, (void *)&io);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get FileSystemProtocol");
 		goto out;
 	}
 
-	if (bootimage_size(bootimage) > partlen) {
-		error(L"Invalid boot image size");
-		ret = EFI_INVALID_PARAMETER;
+	ret = uefi_read_file(io, filename, &buffer, &size);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read file %s", filename);
 		goto out;
 	}
 
-	bootimage = ReallocatePool(bootimage, sizeof(*bootimage),
-				   bootimage_size(bootimage));
-	if (!bootimage) {
-		error(L"Unable to increase the bootimage buffer size");
-		return EFI_OUT_OF_RESOURCES;
+	ret = flash(buffer, size, label);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to flash file %s on partition %s", filename, label);
+		goto free_buffer;
 	}
 
-	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
-				gparti.bio->Media->MediaId,
-				gparti.part.starting_lba * gparti.bio->Media->BlockSize,
-				bootimage_size(bootimage), bootimage);
+free_buffer:
+	FreePool(buffer);
+out:
+	return ret;
+
+}
+
+#define FS_MGR_SIZE 4096
+
+/* Erase the PARTS ranges of a disk.  The overlapping and adjacent
+   ranges are merged so that the storage device gets as few erase
+   commands as possible.  */
+static EFI_STATUS erase_ranges(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+			       struct lba_range *parts, UINTN nb)
+{
+	struct lba_range ranges[ERASE_MAX_PARTITIONS];
+	BOOLEAN zeroed[ERASE_MAX_PARTITIONS];
+	EFI_STATUS ret;
+	EFI_LBA min_end;
+	UINTN i, j, n;
+
+	if (!nb || nb > ARRAY_SIZE(ranges))
+		return EFI_INVALID_PARAMETER;
+
+	memcpy(ranges, parts, nb * sizeof(*parts));
+	n = merge_lba_ranges(ranges, nb);
+
+	for (i = 0; i < n; i++) {
+		/* No need to take care of fs_mgr below, the blocks are zeroes */
+		ret = storage_write_zeroes(handle, bio, ranges[i].start, ranges[i].end);
+		zeroed[i] = ret == EFI_SUCCESS;
+		if (zeroed[i])
+			continue;
+
+		ret = storage_erase_blocks(handle, bio, ranges[i].start, ranges[i].end);
+		if (ret == EFI_SUCCESS)
+			continue;
+
+		debug(L"Fallbacking to filling with zeros");
+		ret = fill_zero(bio, ranges[i].start, ranges[i].end);
+		if (EFI_ERROR(ret))
+			return ret;
+		zeroed[i] = TRUE;
+	}
+
+	/* If the Android fs_mgr fails mounting a partition, it tries
+	   to detect if the partition has been wiped out to determine
+	   if it has to format it.  fs_mgr considers that the partition
+	   has been wiped out if the first 4096 bytes are filled up
+	   with all 0 or all 1.  storage_erase_blocks() uses hardware
+	   support to erase the blocks which does not guarantee that
+	   content will be all 0 or all 1.  It also can be
+	   indeterminate data. */
+	for (j = 0; j < nb; j++) {
+		for (i = 0; i < n; i++)
+			if (parts[j].start >= ranges[i].start &&
+			    parts[j].start <= ranges[i].end)
+				break;
+		if (i == n || zeroed[i])
+			continue;
+
+		min_end = parts[j].start + (FS_MGR_SIZE / bio->Media->BlockSize) + 1;
+		ret = fill_zero(bio, parts[j].start, min(min_end, parts[j].end));
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+{
+	struct lba_range range = { start, end };
+
+	return erase_ranges(handle, bio, &range, 1);
+}
+
+EFI_STATUS erase_by_labels(CHAR16 **labels, UINTN nb)
+{
+	struct gpt_partition_interface parts[ERASE_MAX_PARTITIONS];
+	struct lba_range ranges[ERASE_MAX_PARTITIONS];
+	BOOLEAN refresh = FALSE;
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (!labels || !nb || nb > ARRAY_SIZE(parts))
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < nb; i++) {
+		ret = gpt_get_partition_by_label(labels[i], &parts[i], LOGICAL_UNIT_USER);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to get partition %s", labels[i]);
+			return ret;
+		}
+		/* All the partitions of the user logical unit are on
+		   the same disk */
+		if (parts[i].bio != parts[0].bio)
+			return EFI_UNSUPPORTED;
+		ranges[i].start = parts[i].part.starting_lba;
+		ranges[i].end = parts[i].part.ending_lba;
+	}
+
+#ifdef USE_HASH_MANIFEST
+	for (i = 0; i < nb; i++)
+		hash_manifest_touch(&parts[i].part.unique);
+#endif
+	ret = erase_ranges(parts[0].handle, parts[0].bio, ranges, nb);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to load the current bootimage");
-		goto out;
+		efi_perror(ret, L"Failed to erase %s", nb == 1 ? labels[0] : L"partitions");
+		return ret;
 	}
 
-	page_size = bootimage->page_size;
-	if (!kernel) {
-		kernel = (VOID *)bootimage + page_size;
-		kernel_size = bootimage->kernel_size;
+	for (i = 0; i < nb; i++)
+		if (!CompareGuid(&parts[i].part.type, &EfiPartTypeSystemPartitionGuid))
+			refresh = TRUE;
+
+	return refresh ? gpt_refresh() : EFI_SUCCESS;
+}
+
+EFI_STATUS erase_by_label(CHAR16 *label)
+{
+	return erase_by_labels(&label, 1);
+}
+
+/* The ext4 primary superblock and group descriptors, both f2fs
+   superblocks and the FS_MGR_SIZE bytes fs_mgr checks all lie in the
+   first megabyte of the partition.  */
+#define QUICK_ERASE_HEAD_SIZE	(1024 * 1024)
+
+EFI_STATUS quick_erase_by_label(CHAR16 *label)
+{
+	struct gpt_partition_interface gparti;
+	EFI_LBA start, end, head;
+	EFI_STATUS ret;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
 	}
-	if (!ramdisk) {
-		ramdisk = (VOID *)bootimage + page_size +
-			pagealign(bootimage, bootimage->kernel_size);
-		ramdisk_size = bootimage->ramdisk_size;
+
+	start = gparti.part.starting_lba;
+	end = gparti.part.ending_lba;
+	head = QUICK_ERASE_HEAD_SIZE / gparti.bio->Media->BlockSize;
+	if (end - start + 1 <= 2 * head)
+		return erase_by_label(label);
+
+#ifdef USE_HASH_MANIFEST
+	hash_manifest_touch(&gparti.part.unique);
+#endif
+	ret = storage_erase_blocks_async(gparti.handle, gparti.bio,
+					 start + head, end);
+	if (ret == EFI_UNSUPPORTED) {
+		debug(L"No background erase, erasing the whole partition");
+		return erase_by_label(label);
+	}
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to start erasing %s", label);
+		return ret;
 	}
 
-	new_size = bootimage_size(bootimage)
-		- pagealign(bootimage, bootimage->kernel_size)
-		+ pagealign(bootimage, kernel_size)
-		- pagealign(bootimage, bootimage->ramdisk_size)
-		+ pagealign(bootimage, ramdisk_size);
-	if (new_size > partlen) {
-		error(L"Kernel image is too large to fit in the boot partition");
-		ret = EFI_INVALID_PARAMETER;
-		goto out;
+	ret = fill_zero(gparti.bio, start, start + head - 1);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to wipe the %s metadata", label);
+		storage_erase_wait();
+		return ret;
 	}
 
-	new_bootimage = AllocateZeroPool(new_size);
-	if (!new_bootimage) {
-		ret = EFI_OUT_OF_RESOURCES;
-		goto out;
+	ret = uefi_call_wrapper(gparti.bio->FlushBlocks, 1, gparti.bio);
+	if (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED) {
+		efi_perror(ret, L"Failed to flush the %s metadata", label);
+		return ret;
 	}
 
-	/* Create the new bootimage. */
-	memcpy((VOID *)new_bootimage, bootimage, sizeof(*bootimage));
+	if (CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid))
+		return EFI_SUCCESS;
 
-	cur = (VOID *)bootimage + page_size;
-	new_cur = (VOID *)new_bootimage + page_size;
+	return gpt_refresh();
+}
 
-	new_bootimage->kernel_size = kernel_size;
-	memcpy(new_cur, kernel, kernel_size);
+/* Batch flash: the same raw image is written to several partitions
+   chunk by chunk in a round robin.  Each partition has its own async
+   I/O context so the writes to partitions of different logical units
+   are in flight at the same time and the storage device processes
+   them in parallel.  */
+#define FLASH_BATCH_CHUNK_SIZE	(4 * 1024 * 1024)
 
-	cur += pagealign(bootimage, bootimage->kernel_size);
-	new_cur += pagealign(new_bootimage, kernel_size);
+struct batch_job {
+	CHAR16 *label;
+	struct gpt_partition_interface gparti;
+	struct async_io *aio;
+	UINT64 offset;
+	VOID *data;
+	UINTN size;
+};
 
-	new_bootimage->ramdisk_size = ramdisk_size;
-	memcpy(new_cur, ramdisk, ramdisk_size);
+static EFI_STATUS batch_job_open(struct batch_job *job, CHAR16 *label,
+				 VOID *data, UINTN size)
+{
+	EFI_STATUS ret;
+	UINT64 start, end;
 
-	cur += pagealign(bootimage, bootimage->ramdisk_size);
-	new_cur += pagealign(new_bootimage, ramdisk_size);
+	ret = gpt_get_partition_by_label(label, &job->gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
 
-	memcpy(new_cur, cur, bootimage->second_size);
+	start = job->gparti.part.starting_lba * job->gparti.bio->Media->BlockSize;
+	end = (job->gparti.part.ending_lba + 1) * job->gparti.bio->Media->BlockSize;
+	if (size > end - start) {
+		error(L"Image is too large for partition %s", label);
+		return EFI_INVALID_PARAMETER;
+	}
 
-	if (bootimage->header_version >= 1) {
-		memcpy(new_bootimage + new_bootimage->recovery_acpio_offset,
-			   bootimage + bootimage->recovery_acpio_offset,
-			   bootimage->recovery_acpio_size);
+	ret = async_io_open(&job->gparti, &job->aio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open partition %s", label);
+		return ret;
 	}
 
-	if (bootimage->header_version == 2) {
-		memcpy(new_bootimage + new_bootimage->acpi_addr,
-			   bootimage + bootimage->acpi_addr,
-			   bootimage->acpi_size);
+	job->label = label;
+	job->offset = start;
+	job->data = data;
+	job->size = size;
+#ifdef USE_HASH_MANIFEST
+	hash_manifest_touch(&job->gparti.part.unique);
+#endif
+	blkcache_invalidate(job->gparti.bio, start, size);
+
+	return EFI_SUCCESS;
+}
+
+/* Submit the jobs writes chunk by chunk in a round robin until all
+   the images are queued.  */
+static EFI_STATUS batch_write(struct batch_job *jobs, UINTN nb)
+{
+	EFI_STATUS ret;
+	BOOLEAN pending;
+	UINTN i, len, id, off;
+
+	for (off = 0, pending = TRUE; pending; off += FLASH_BATCH_CHUNK_SIZE) {
+		pending = FALSE;
+		for (i = 0; i < nb; i++) {
+			if (off >= jobs[i].size)
+				continue;
+			len = min(jobs[i].size - off, (UINTN)FLASH_BATCH_CHUNK_SIZE);
+			ret = async_io_write(jobs[i].aio, jobs[i].offset + off,
+					     len, (UINT8 *)jobs[i].data + off, &id);
+			if (EFI_ERROR(ret)) {
+				efi_perror(ret, L"Failed to write partition %s",
+					   jobs[i].label);
+				return ret;
+			}
+			pending = TRUE;
+		}
 	}
 
-	/* Flash new the bootimage. */
-	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
-	ret = flash_write(new_bootimage, new_size);
+	return EFI_SUCCESS;
+}
 
-	FreePool(new_bootimage);
+/* Wait for the NB opened jobs and close them.  The first error is
+   returned, RET if it is already an error.  */
+static EFI_STATUS batch_close(struct batch_job *jobs, UINTN nb,
+			      EFI_STATUS ret)
+{
+	EFI_STATUS ret2;
+	UINTN i;
+
+	for (i = 0; i < nb; i++) {
+		ret2 = async_io_wait_all(jobs[i].aio);
+		if (EFI_ERROR(ret2) && !EFI_ERROR(ret)) {
+			efi_perror(ret2, L"Failed to write partition %s",
+				   jobs[i].label);
+			ret = ret2;
+		}
+		async_io_close(jobs[i].aio);
+	}
 
-out:
-	FreePool(bootimage);
 	return ret;
 }
 
-static EFI_STATUS flash_kernel(VOID *data, UINTN size)
+static EFI_STATUS batch_done(struct batch_job *jobs, UINTN nb)
 {
-	return flash_new_bootimage(data, size, NULL, 0);
+	EFI_STATUS ret;
+	BOOLEAN refresh = FALSE;
+	UINTN i, j;
+
+	for (i = 0; i < nb; i++) {
+		if (!CompareGuid(&jobs[i].gparti.part.type,
+				 &EfiPartTypeSystemPartitionGuid))
+			refresh = TRUE;
+		for (j = 0; j < ARRAY_SIZE(DM_VERITY_PARTITIONS); j++)
+			if (!StrCmp(DM_VERITY_PARTITIONS[j], jobs[i].label)) {
+				ret = slot_set_verity_corrupted(FALSE);
+				if (EFI_ERROR(ret))
+					return ret;
+			}
+	}
+
+	return refresh ? gpt_refresh() : EFI_SUCCESS;
 }
 
-static EFI_STATUS flash_ramdisk(VOID *data, UINTN size)
+static BOOLEAN is_label_exception(CHAR16 *label)
 {
-	return flash_new_bootimage(NULL, 0, data, size);
-}
+	UINTN i;
 
-static CHAR16 *DM_VERITY_PARTITIONS[] =
-	{ SYSTEM_LABEL, VENDOR_LABEL, OEM_LABEL };
+	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
+		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
+			return TRUE;
 
-EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label)
+	return FALSE;
+}
+
+EFI_STATUS flash_batch(VOID *data, UINTN size, CHAR16 **labels, UINTN nb)
 {
-	EFI_STATUS ret;
-	UINTN i;
+	struct batch_job jobs[FLASH_BATCH_MAX_PARTITIONS];
+	EFI_STATUS ret = EFI_SUCCESS;
+	uint64_t start;
+	UINTN i, j, opened;
 
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get partition %s", label);
-		return ret;
+	if (!data || !size || !labels || !nb || nb > ARRAY_SIZE(jobs))
+		return EFI_INVALID_PARAMETER;
+
+	if (is_sparse_image(data, size) || is_lz4_frame(data, size)) {
+		error(L"Only raw images can be batch flashed");
+		return EFI_UNSUPPORTED;
 	}
 
-	cur_offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	for (i = 0; i < nb; i++) {
+		if (is_label_exception(labels[i]))
+			return EFI_UNSUPPORTED;
+		for (j = 0; j < i; j++)
+			if (!StrCmp(labels[j], labels[i]))
+				return EFI_INVALID_PARAMETER;
+	}
 
-	if (is_sparse_image(data, size))
-		ret = flash_sparse(data, size);
-	else
-		ret = flash_write(data, size);
+	for (opened = 0; opened < nb; opened++) {
+		ret = batch_job_open(&jobs[opened], labels[opened], data, size);
+		if (EFI_ERROR(ret))
+			break;
+	}
 
+	start = timer_ticks();
+	if (!EFI_ERROR(ret))
+		ret = batch_write(jobs, nb);
+	ret = batch_close(jobs, opened, ret);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid)) {
-		ret = gpt_refresh();
-		if (EFI_ERROR(ret))
-			return ret;
-	}
-
-	for (i = 0; i < ARRAY_SIZE(DM_VERITY_PARTITIONS); i++)
-		if (!StrCmp(DM_VERITY_PARTITIONS[i], label))
-			return slot_set_verity_corrupted(FALSE);
+	perf_total.bytes += (UINT64)size * nb;
+	perf_total.writes += nb;
+	perf_total.write_usec += ticks_to_usec(timer_ticks() - start);
 
-	return EFI_SUCCESS;
+	return batch_done(jobs, nb);
 }
 
-static struct label_exception {
-	CHAR16 *name;
-	EFI_STATUS (*flash_func)(VOID *data, UINTN size);
-} LABEL_EXCEPTIONS[] = {
-	{ L"gpt", flash_gpt },
-	{ L"gpt-gpp1", flash_gpt_gpp1 },
-#ifndef USER
-	{ L"efirun", flash_efirun },
-	{ L"mbr", flash_mbr },
-#endif
-	{ L"sfu", flash_sfu },
-	{ L"ifwi", flash_ifwi },
-	{ L"oemvars", flash_oemvars },
-	{ L"kernel", flash_kernel },
-	{ L"ramdisk", flash_ramdisk },
-	{ ESP_LABEL, flash_esp },
-	{ BOOTLOADER_LABEL, flash_bootloader },
-	{ BOOTLOADER_A_LABEL, flash_bootloader_a },
-	{ BOOTLOADER_B_LABEL, flash_bootloader_b },
-#if defined(IOC_USE_SLCAN) || defined(IOC_USE_CBC)
-	{ L"ioc", flash_ioc },
-#endif
-#ifdef BOOTLOADER_POLICY
-	{ CONVERT_TO_WIDE(ACTION_AUTHORIZATION), authenticated_action },
-#endif
-#ifdef FASTBOOT_KEYBOX_PROVISION
-	{ L"keybox", flash_keybox }
-#endif
+/* Flash manifest: the blob starts with a NUL terminated text
+   manifest describing the images it carries, one
+   "<partition> <offset> <size> [raw|sparse|lz4]" line per image, the
+   offsets being relative to the start of the blob.  The raw images
+   are written concurrently like a batch flash, the sparse and LZ4
+   ones are then flashed one after the other.  */
+static const char *FLASH_FORMAT_NAMES[] = {
+	[FLASH_FORMAT_RAW] = "raw",
+	[FLASH_FORMAT_SPARSE] = "sparse",
+	[FLASH_FORMAT_LZ4] = "lz4"
 };
 
-EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label)
+const char *flash_format_name(enum flash_format format)
 {
-	UINTN i;
-
-#ifndef USER
-	/* special case for writing inside esp partition */
-	CHAR16 esp[] = L"/ESP/";
-	if (!StrnCmp(esp, label, StrLen(esp)))
-		return flash_into_esp(data, size, &label[ARRAY_SIZE(esp) - 1]);
-#endif
-	/* special cases */
-	for (i = 0; i < ARRAY_SIZE(LABEL_EXCEPTIONS); i++)
-		if (!StrCmp(LABEL_EXCEPTIONS[i].name, label))
-			return LABEL_EXCEPTIONS[i].flash_func(data, size);
+	return format < ARRAY_SIZE(FLASH_FORMAT_NAMES) ?
+		FLASH_FORMAT_NAMES[format] : "unknown";
+}
 
-	return flash_partition(data, size, label);
+static enum flash_format image_format(VOID *data, UINTN size)
+{
+	if (is_sparse_image(data, size))
+		return FLASH_FORMAT_SPARSE;
+	if (is_lz4_frame(data, size))
+		return FLASH_FORMAT_LZ4;
+	return FLASH_FORMAT_RAW;
 }
 
-EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label)
+struct manifest_ctx {
+	VOID *data;
+	UINTN size;
+	UINTN header_size;
+	struct flash_manifest_entry *entries;
+	UINTN nb;
+	UINTN max;
+};
+
+static EFI_STATUS parse_manifest_line(char *line, VOID *context)
 {
+	struct manifest_ctx *ctx = context;
+	struct flash_manifest_entry *entry;
+	CHAR8 *argv[4];
+	CHAR16 *label;
+	char *end;
+	UINT64 offset, size;
+	INTN argc, i;
 	EFI_STATUS ret;
-	EFI_FILE_IO_INTERFACE *io = NULL;
-	VOID *buffer = NULL;
-	UINTN size = 0;
 
-	ret = uefi_call_wrapper(BS->HandleProtocol, 3, image, &FileSystemProtocol, (void *)&io);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get FileSystemProtocol");
-		goto out;
-	}
+	if (*line == '#')
+		return EFI_SUCCESS;
 
-	ret = uefi_read_file(io, filename, &buffer, &size);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to read file %s", filename);
-		goto out;
+	if (ctx->nb == ctx->max) {
+		error(L"Too many images in the manifest");
+		return EFI_BUFFER_TOO_SMALL;
 	}
+	entry = &ctx->entries[ctx->nb];
+	memset(entry, 0, sizeof(*entry));
 
-	ret = flash(buffer, size, label);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to flash file %s on partition %s", filename, label);
-		goto free_buffer;
+	ret = string_to_argv(line, &argc, argv, ARRAY_SIZE(argv), " \t", " \t");
+	if (EFI_ERROR(ret) || argc < 3)
+		return EFI_INVALID_PARAMETER;
+
+	if (strlen(argv[0]) >= ARRAY_SIZE(entry->label))
+		return EFI_INVALID_PARAMETER;
+	label = stra_to_str(argv[0]);
+	if (!label)
+		return EFI_OUT_OF_RESOURCES;
+	StrNCpy(entry->label, label, ARRAY_SIZE(entry->label));
+	FreePool(label);
+
+	offset = strtoull((char *)argv[1], &end, 0);
+	if (*end)
+		return EFI_INVALID_PARAMETER;
+	size = strtoull((char *)argv[2], &end, 0);
+	if (*end || !size)
+		return EFI_INVALID_PARAMETER;
+
+	if (offset < ctx->header_size || offset > ctx->size ||
+	    size > ctx->size - offset) {
+		error(L"Image %s is not inside the blob", entry->label);
+		return EFI_INVALID_PARAMETER;
+	}
+	entry->offset = offset;
+	entry->size = size;
+
+	entry->format = image_format((UINT8 *)ctx->data + entry->offset,
+				     entry->size);
+	if (argc == 4 && strcmp(argv[3],
+				(CHAR8 *)flash_format_name(entry->format))) {
+		error(L"Image %s is not a %a image", entry->label, argv[3]);
+		return EFI_INVALID_PARAMETER;
 	}
 
-free_buffer:
-	FreePool(buffer);
-out:
-	return ret;
+	if (is_label_exception(entry->label)) {
+		error(L"%s cannot be flashed from a manifest", entry->label);
+		return EFI_UNSUPPORTED;
+	}
+	for (i = 0; i < (INTN)ctx->nb; i++)
+		if (!StrCmp(ctx->entries[i].label, entry->label))
+			return EFI_INVALID_PARAMETER;
 
+	entry->status = EFI_NOT_STARTED;
+	ctx->nb++;
+	return EFI_SUCCESS;
 }
 
-#define FS_MGR_SIZE 4096
-static EFI_STATUS erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+EFI_STATUS flash_manifest_parse(VOID *data, UINTN size,
+				struct flash_manifest_entry *entries,
+				UINTN *nb)
 {
+	struct manifest_ctx ctx = {
+		.data = data,
+		.size = size,
+		.entries = entries,
+		.max = *nb
+	};
 	EFI_STATUS ret;
-	EFI_LBA min_end;
 
-	ret = storage_erase_blocks(handle, bio, start, end);
-	if (ret == EFI_SUCCESS) {
-		/* If the Android fs_mgr fails mounting a partition,
-		   it tries to detect if the partition has been wiped
-		   out to determine if it has to format it.  fs_mgr
-		   considers that the partition has been wiped out if
-		   the first 4096 bytes are filled up with all 0 or
-		   all 1.  storage_erase_blocks() uses hardware
-		   support to erase the blocks which does not guarantee
-		   that content will be all 0 or all 1.  It also can
-		   be indeterminate data. */
-		min_end = start + (FS_MGR_SIZE / bio->Media->BlockSize) + 1;
-		return fill_zero(bio, start, min(min_end, end));
+	if (!data || !size || !entries || !nb)
+		return EFI_INVALID_PARAMETER;
+
+	ctx.header_size = strnlen(data, min(size,
+					    (UINTN)FLASH_MANIFEST_MAX_SIZE));
+	if (ctx.header_size == size || ctx.header_size == FLASH_MANIFEST_MAX_SIZE) {
+		error(L"The manifest is not NUL terminated");
+		return EFI_INVALID_PARAMETER;
+	}
+	ctx.header_size++;
+
+	ret = parse_text_buffer(data, ctx.header_size - 1,
+				parse_manifest_line, &ctx);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!ctx.nb) {
+		error(L"The manifest is empty");
+		return EFI_INVALID_PARAMETER;
 	}
 
-	debug(L"Fallbacking to filling with zeros");
-	return fill_zero(bio, start, end);
+	*nb = ctx.nb;
+	return EFI_SUCCESS;
 }
 
-EFI_STATUS erase_by_label(CHAR16 *label)
+EFI_STATUS flash_manifest(VOID *data, struct flash_manifest_entry *entries,
+			  UINTN nb)
 {
-	EFI_STATUS ret;
+	struct batch_job jobs[FLASH_MANIFEST_MAX_ENTRIES];
+	struct flash_manifest_entry *raw[FLASH_MANIFEST_MAX_ENTRIES];
+	EFI_STATUS ret = EFI_SUCCESS;
+	uint64_t start;
+	UINT64 bytes = 0;
+	UINTN i, nb_raw = 0, opened;
+
+	if (!data || !entries || !nb || nb > ARRAY_SIZE(jobs))
+		return EFI_INVALID_PARAMETER;
 
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get partition %s", label);
-		return ret;
+	for (i = 0; i < nb; i++)
+		if (entries[i].format == FLASH_FORMAT_RAW)
+			raw[nb_raw++] = &entries[i];
+
+	for (opened = 0; opened < nb_raw; opened++) {
+		ret = batch_job_open(&jobs[opened], raw[opened]->label,
+				     (UINT8 *)data + raw[opened]->offset,
+				     raw[opened]->size);
+		if (EFI_ERROR(ret)) {
+			raw[opened]->status = ret;
+			break;
+		}
+		bytes += raw[opened]->size;
 	}
-	ret = erase_blocks(gparti.handle, gparti.bio, gparti.part.starting_lba, gparti.part.ending_lba);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to erase partition %s", label);
+
+	start = timer_ticks();
+	if (!EFI_ERROR(ret))
+		ret = batch_write(jobs, nb_raw);
+	ret = batch_close(jobs, opened, ret);
+	if (!EFI_ERROR(ret)) {
+		perf_total.bytes += bytes;
+		perf_total.writes += nb_raw;
+		perf_total.write_usec += ticks_to_usec(timer_ticks() - start);
+		ret = batch_done(jobs, nb_raw);
+	}
+	for (i = 0; i < opened; i++) {
+		raw[i]->status = ret;
+		raw[i]->usec = ticks_to_usec(timer_ticks() - start);
+	}
+	if (EFI_ERROR(ret))
 		return ret;
+
+	for (i = 0; i < nb; i++) {
+		if (entries[i].format == FLASH_FORMAT_RAW)
+			continue;
+		start = timer_ticks();
+		ret = flash_partition((UINT8 *)data + entries[i].offset,
+				      entries[i].size, entries[i].label);
+		entries[i].status = ret;
+		entries[i].usec = ticks_to_usec(timer_ticks() - start);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to flash %s", entries[i].label);
+			return ret;
+		}
 	}
-	if (!CompareGuid(&gparti.part.type, &EfiPartTypeSystemPartitionGuid))
-		return gpt_refresh();
 
 	return EFI_SUCCESS;
 }
 
+/* Garbage disk: the disk is first erased with the native storage
+   primitive, then overwritten with random data.  The random data of
+   the next chunk is generated while the current chunk is written
+   asynchronously.  The two chunks are the shared I/O buffers.  */
+static EFI_STATUS garbage_generate(VOID *buf, UINTN size)
+{
+	return random_bulk(buf, size);
+}
+
 EFI_STATUS garbage_disk(void)
 {
 	struct gpt_partition_interface gparti;
-	EFI_STATUS ret;
-	VOID *chunk;
-	VOID *aligned_chunk;
-	UINTN size;
+	struct async_io *aio;
+	EFI_STATUS ret, ret2;
+	VOID *chunk[2];
+	UINTN ids[2], chunk_size, len, cur;
+	UINT64 offset, end;
+	BOOLEAN pending = FALSE;
+	uint32_t print_sec, print_prev;
+	CHAR8 probe;
 
 	ret = gpt_get_root_disk(&gparti, LOGICAL_UNIT_USER);
 	if (EFI_ERROR(ret)) {
@@ -587,23 +2402,81 @@ EFI_STATUS garbage_disk(void)
 		return ret;
 	}
 
-	size = gparti.bio->Media->BlockSize * N_BLOCK;
-	ret = alloc_aligned(&chunk, &aligned_chunk, size, gparti.bio->Media->IoAlign);
+	/* RDRAND support check */
+	ret = generate_random_numbers(&probe, sizeof(probe));
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Unable to allocate the garbage chunk");
+		efi_perror(ret, L"Failed to generate random numbers");
 		return ret;
 	}
 
-	ret = generate_random_numbers(aligned_chunk, size);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to generate random numbers");
-		FreePool(chunk);
-		return ret;
+#ifdef USE_HASH_MANIFEST
+	hash_manifest_clear();
+#endif
+
+	ret = storage_erase_blocks(gparti.handle, gparti.bio, gparti.part.starting_lba,
+				   gparti.part.ending_lba);
+	if (EFI_ERROR(ret))
+		debug(L"Native disk erase failed, %r", ret);
+
+	for (cur = 0; cur < ARRAY_SIZE(chunk); cur++) {
+		ret = io_buffer_get(gparti.bio, cur, &chunk[cur], &chunk_size);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Unable to get the garbage chunks");
+			return ret;
+		}
 	}
 
-	ret = fill_with(gparti.bio, gparti.part.starting_lba,
-			gparti.part.ending_lba, aligned_chunk, N_BLOCK);
+	ret = async_io_open(&gparti, &aio);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	end = (gparti.part.ending_lba + 1) * gparti.bio->Media->BlockSize;
+	blkcache_invalidate(NULL, 0, 0);
 
-	FreePool(chunk);
-	return gpt_refresh();
+	ret = garbage_generate(chunk[0], chunk_size);
+	if (EFI_ERROR(ret))
+		goto close;
+
+	info_n(L"Erasing ");
+	print_sec = boottime_in_msec() / 1000;
+	print_prev = 0;
+	for (cur = 0; offset < end; offset += len, cur ^= 1) {
+		len = min(end - offset, (UINT64)chunk_size);
+		ret = async_io_write(aio, offset, len, chunk[cur], &ids[cur]);
+		if (EFI_ERROR(ret))
+			break;
+		if (offset + len == end)
+			break;
+
+		/* The other chunk is free once its write is done */
+		if (pending) {
+			ret = async_io_wait(aio, ids[cur ^ 1]);
+			if (EFI_ERROR(ret))
+				break;
+		}
+		pending = TRUE;
+		ret = garbage_generate(chunk[cur ^ 1], chunk_size);
+		if (EFI_ERROR(ret))
+			break;
+
+		print_progress(offset / gparti.bio->Media->BlockSize, end / gparti.bio->Media->BlockSize,
+			       boottime_in_msec() / 1000, &print_sec, &print_prev);
+	}
+	info_n(L"\n");
+
+close:
+	ret2 = async_io_wait_all(aio);
+	if (!EFI_ERROR(ret))
+		ret = ret2;
+	async_io_close(aio);
+out:
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to write the garbage data");
+		return ret;
+	}
+	ret = gpt_refresh();
+	/* The partition table has been overwritten */
+	gpt_free_cache();
+	return ret;
 }
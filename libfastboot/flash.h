@@ -36,10 +36,18 @@
 #define _FLASH_H_
 
 #include <efi.h>
+#include <gpt.h>
 
 EFI_STATUS flash_skip(UINT64 size);
 EFI_STATUS flash_write(VOID *data, UINTN size);
 EFI_STATUS flash_fill(UINT32 pattern, UINTN size);
+EFI_STATUS flash_set_delta(BOOLEAN enable);
+BOOLEAN flash_get_delta(void);
+EFI_STATUS flash_set_zero_detect(BOOLEAN enable);
+BOOLEAN flash_get_zero_detect(void);
+/* SAME is set to TRUE if the LABEL partition already holds the raw
+   image DATA.  */
+EFI_STATUS flash_compare(VOID *data, UINTN size, CHAR16 *label, BOOLEAN *same);
 
 /* return value for flash() function */
 
@@ -48,8 +56,103 @@ EFI_STATUS flash_fill(UINT32 pattern, UINTN size);
 EFI_STATUS flash(VOID *data, UINTN size, CHAR16 *label);
 EFI_STATUS flash_file(EFI_HANDLE image, CHAR16 *filename, CHAR16 *label);
 EFI_STATUS erase_by_label(CHAR16 *label);
+/* Erase up to ERASE_MAX_PARTITIONS partitions, the adjacent ones
+   are erased as a single range.  */
+#define ERASE_MAX_PARTITIONS 16
+EFI_STATUS erase_by_labels(CHAR16 **labels, UINTN nb);
+/* Wipe the file-system metadata at the start of the LABEL partition
+   and return, the rest of the partition is erased in the background
+   until storage_erase_wait().  Fall back to erase_by_label() if the
+   device cannot erase in the background.  */
+EFI_STATUS quick_erase_by_label(CHAR16 *label);
 EFI_STATUS garbage_disk(void);
+/* Write the same raw image to up to FLASH_BATCH_MAX_PARTITIONS
+   partitions at once.  */
+#define FLASH_BATCH_MAX_PARTITIONS 8
+EFI_STATUS flash_batch(VOID *data, UINTN size, CHAR16 **labels, UINTN nb);
+/* Flash the images of a blob described by the text manifest at its
+   beginning.  FLASH_MANIFEST_MAX_SIZE bounds the manifest size.  */
+#define FLASH_MANIFEST_MAX_ENTRIES 16
+#define FLASH_MANIFEST_MAX_SIZE 4096
+
+enum flash_format {
+	FLASH_FORMAT_RAW,
+	FLASH_FORMAT_SPARSE,
+	FLASH_FORMAT_LZ4
+};
+
+struct flash_manifest_entry {
+	CHAR16 label[GPT_NAME_LEN];
+	UINTN offset;
+	UINTN size;
+	enum flash_format format;
+	EFI_STATUS status;	/* EFI_NOT_STARTED if not flashed */
+	UINT64 usec;
+};
+
+const char *flash_format_name(enum flash_format format);
+EFI_STATUS flash_manifest_parse(VOID *data, UINTN size,
+				struct flash_manifest_entry *entries,
+				UINTN *nb);
+EFI_STATUS flash_manifest(VOID *data, struct flash_manifest_entry *entries,
+			  UINTN nb);
 EFI_STATUS flash_partition(VOID *data, UINTN size, CHAR16 *label);
+/* The special labels, such as gpt or the ESP files, need the whole
+   image at once and cannot be streamed */
+/* TRUE if LABEL is flashed as a regular partition, not handled by a
+   special function like gpt or bootloader */
+BOOLEAN flash_is_partition(CHAR16 *label);
+BOOLEAN flash_stream_supported(CHAR16 *label);
+EFI_STATUS flash_stream_start(CHAR16 *label, UINT64 size);
+EFI_STATUS flash_stream_write(VOID *data, UINTN size);
+EFI_STATUS flash_stream_end(CHAR16 *label);
+void flash_stream_abort(void);
+
+/* Progress of an interrupted raw image stream: the first OFFSET bytes
+   of the SIZE bytes image, whose CRC32 is CRC, are durably written to
+   the LABEL partition.  flash_stream_checkpoint() records it
+   periodically, CRC being the CRC32 of the data streamed so far.
+   flash_stream_resume() starts a stream of the SIZE - OFFSET
+   remaining bytes and returns CRC to carry on the image CRC32.  */
+struct flash_checkpoint {
+	CHAR16 label[GPT_NAME_LEN];
+	UINT64 size;
+	UINT64 offset;
+	UINT32 crc;
+};
+
+EFI_STATUS flash_checkpoint_get(struct flash_checkpoint *cp);
+EFI_STATUS flash_stream_checkpoint(UINT32 crc);
+EFI_STATUS flash_stream_resume(CHAR16 *label, UINT64 size, UINT32 *crc);
+
+/* Flash benchmark: select the LABEL partition for SIZE bytes of
+   flash_write() calls, QUEUE_DEPTH of them being written
+   asynchronously through the write behind staging buffers, zero for
+   synchronous writes.  flash_bench_end() waits for the pending writes.
+   The partition is not refreshed, its content is meaningless
+   afterward.  */
+#define FLASH_BENCH_MAX_QUEUE_DEPTH	8
+
+EFI_STATUS flash_bench_start(CHAR16 *label, UINT64 size, UINTN queue_depth);
+EFI_STATUS flash_bench_end(void);
+/* Flash performance counters.  Only the partitions flashed through
+   flash_partition() or the streaming path are accounted per
+   partition, the FLASH_PERF_MAX_PARTITIONS most recent ones are
+   kept.  */
+#define FLASH_PERF_MAX_PARTITIONS 16
+
+struct flash_perf {
+	CHAR16 label[GPT_NAME_LEN];
+	UINT64 bytes;		/* Bytes written by flash_write() */
+	UINT64 writes;		/* flash_write() calls */
+	UINT64 write_usec;	/* Time spent in flash_write() */
+	UINT64 usec;		/* Whole partition flash time */
+};
+
+const struct flash_perf *flash_get_perf(void);
+const struct flash_perf *flash_get_partition_perf(UINTN *nb);
+void flash_reset_perf(void);
+
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, UINT64 start, UINT64 end);
 
 #endif	/* _FLASH_H_ */
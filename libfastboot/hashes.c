@@ -36,24 +36,42 @@
 #include <efilib.h>
 #include <lib.h>
 #include <openssl/evp.h>
+#include <openssl/sha.h>
 
 #include "hashes.h"
 #include "fastboot.h"
 #include "uefi_utils.h"
 #include "gpt.h"
+#include "async_io.h"
+#include "blkcache.h"
 #include "android.h"
 #include "signature.h"
 #include "security.h"
+#include "mp_pool.h"
+#include "vars.h"
+#include "memtrack.h"
+#include "sha256_mb.h"
+#ifdef USE_AVB
+#include "libavb/libavb.h"
+#endif
+#ifdef USE_IPP_SHA256
+#include "sha256_ipps.h"
+#endif
 #if defined(USE_ACPIO) || defined(USE_ACPI)
 #include "acpi.h"
 #endif
+#ifdef DYNAMIC_PARTITIONS
+#include "lp_metadata.h"
+#endif
 
 static struct algorithm {
 	const CHAR8 *name;
 	const EVP_MD *(*get_md)(void);
 } const ALGORITHMS[] = {
 	{ (CHAR8*)"sha1", EVP_sha1 }, /* default algorithm */
-	{ (CHAR8*)"md5", EVP_md5 }
+	{ (CHAR8*)"md5", EVP_md5 },
+	{ (CHAR8*)"sha256", EVP_sha256 },
+	{ (CHAR8*)"sha512", EVP_sha512 }
 };
 
 static const EVP_MD *selected_md;
@@ -90,18 +108,82 @@ out:
 	return ret;
 }
 
-static void hash_buffer(CHAR8 *buffer, UINT64 len, CHAR8 *hash)
-{
+/* Digest context.  SHA-256 is computed with the SHA extensions when the
+   CPU provides them, the SSL library implementation is used
+   otherwise.  */
+struct hash_ctx {
 	EVP_MD_CTX mdctx;
+#ifdef USE_IPP_SHA256
+	BOOLEAN ipps;
+	SHA256_IPPS_CTX sha256;
+#endif
+};
 
+static void hash_init(struct hash_ctx *ctx)
+{
 	if (!selected_md)
 		set_hash_algorithm(NULL);
 
-	EVP_MD_CTX_init(&mdctx);
-	EVP_DigestInit_ex(&mdctx, selected_md, NULL);
-	EVP_DigestUpdate(&mdctx, buffer, len);
-	EVP_DigestFinal_ex(&mdctx, hash, NULL);
-	EVP_MD_CTX_cleanup(&mdctx);
+#ifdef USE_IPP_SHA256
+	ctx->ipps = EVP_MD_type(selected_md) == NID_sha256 &&
+		sha256_ipps_is_supported();
+	if (ctx->ipps) {
+		ippsSHA256_Init(&ctx->sha256);
+		return;
+	}
+#endif
+
+	EVP_MD_CTX_init(&ctx->mdctx);
+	EVP_DigestInit_ex(&ctx->mdctx, selected_md, NULL);
+}
+
+static void hash_update(struct hash_ctx *ctx, CHAR8 *buffer, UINT64 len)
+{
+#ifdef USE_IPP_SHA256
+	UINT64 chunk;
+
+	if (ctx->ipps) {
+		for (; len; len -= chunk, buffer += chunk) {
+			chunk = min(len, (UINT64)1024 * 1024 * 1024);
+			ippsSHA256_Update(&ctx->sha256, buffer, chunk);
+		}
+		return;
+	}
+#endif
+
+	EVP_DigestUpdate(&ctx->mdctx, buffer, len);
+}
+
+static void hash_final(struct hash_ctx *ctx, CHAR8 *hash)
+{
+#ifdef USE_IPP_SHA256
+	if (ctx->ipps) {
+		ippsSHA256_Final(&ctx->sha256, (uint32_t *)hash);
+		return;
+	}
+#endif
+
+	EVP_DigestFinal_ex(&ctx->mdctx, hash, NULL);
+}
+
+static void hash_cleanup(struct hash_ctx *ctx)
+{
+#ifdef USE_IPP_SHA256
+	if (ctx->ipps)
+		return;
+#endif
+
+	EVP_MD_CTX_cleanup(&ctx->mdctx);
+}
+
+static void hash_buffer(CHAR8 *buffer, UINT64 len, CHAR8 *hash)
+{
+	struct hash_ctx ctx;
+
+	hash_init(&ctx);
+	hash_update(&ctx, buffer, len);
+	hash_final(&ctx, hash);
+	hash_cleanup(&ctx);
 }
 
 static EFI_STATUS report_hash(const CHAR16 *base, const CHAR16 *name, CHAR8 *hash)
@@ -124,19 +206,40 @@ static EFI_STATUS report_hash(const CHAR16 *base, const CHAR16 *name, CHAR8 *has
 #define MAX_DIR 10
 #define MAX_FILENAME_LEN (256 * sizeof(CHAR16))
 #define DIR_BUFFER_SIZE (MAX_DIR * MAX_FILENAME_LEN)
-static CHAR16 *path;
-static CHAR16 *subname[MAX_DIR];
+static CHAR16 path[DIR_BUFFER_SIZE / sizeof(CHAR16)];
+static UINTN path_len[MAX_DIR];
 static INTN subdir;
 
+/* The ESP files are read by ESP_CHUNK_SIZE chunks into two buffers
+   reused for the whole walk: a chunk is hashed on an Application
+   Processor while the next one is being read.  */
+#define ESP_CHUNK_SIZE (1024 * 1024)
+static CHAR8 *esp_chunk[2];
+
+struct chunk_job {
+	struct hash_ctx ctx;
+	CHAR8 *data;
+	UINTN len;
+};
+
+static void hash_chunk(UINTN start _unused, UINTN end _unused, VOID *ctx)
+{
+	struct chunk_job *job = ctx;
+
+	hash_update(&job->ctx, job->data, job->len);
+}
+
 static EFI_STATUS hash_file(EFI_FILE *dir, EFI_FILE_INFO *fi)
 {
 	EFI_FILE *file;
-	void *data;
+	struct chunk_job job;
 	CHAR8 hash[EVP_MAX_MD_SIZE];
-	EFI_STATUS ret;
-	UINTN size;
+	EFI_STATUS ret, hash_ret = EFI_SUCCESS;
+	BOOLEAN pending = FALSE;
+	UINT64 remaining;
+	UINTN size, cur;
 
-	if (!fi->Size) {
+	if (!fi->FileSize) {
 		hash_buffer(NULL, 0, hash);
 		return report_hash(path, fi->FileName, hash);
 	}
@@ -145,22 +248,38 @@ static EFI_STATUS hash_file(EFI_FILE *dir, EFI_FILE_INFO *fi)
 	if (EFI_ERROR(ret))
 		return ret;
 
-	size = fi->FileSize;
-
-	data = AllocatePool(size);
-	if (!data)
-		goto close;
+	hash_init(&job.ctx);
+	for (remaining = fi->FileSize, cur = 0; remaining; remaining -= size, cur ^= 1) {
+		size = min(remaining, (UINT64)ESP_CHUNK_SIZE);
+		ret = uefi_call_wrapper(file->Read, 3, file, &size, esp_chunk[cur]);
+		if (EFI_ERROR(ret) || !size)
+			break;
+
+		if (pending) {
+			hash_ret = mp_pool_join(&hash_ret);
+			pending = FALSE;
+			if (EFI_ERROR(hash_ret))
+				break;
+		}
 
-	ret = uefi_call_wrapper(file->Read, 3, file, &size, data);
-	if (EFI_ERROR(ret))
-		goto free;
+		job.data = esp_chunk[cur];
+		job.len = size;
+		if (EFI_ERROR(mp_pool_start_detached(1, 1, hash_chunk, &job, &hash_ret)))
+			hash_update(&job.ctx, job.data, job.len);
+		else
+			pending = TRUE;
+	}
 
-	hash_buffer(data, size, hash);
-	ret = report_hash(path, fi->FileName, hash);
+	if (pending)
+		hash_ret = mp_pool_join(&hash_ret);
+	if (!EFI_ERROR(ret))
+		ret = hash_ret;
+	if (!EFI_ERROR(ret)) {
+		hash_final(&job.ctx, hash);
+		ret = report_hash(path, fi->FileName, hash);
+	}
+	hash_cleanup(&job.ctx);
 
-free:
-	FreePool(data);
-close:
 	uefi_call_wrapper(file->Close, 1, file);
 	return ret;
 }
@@ -169,48 +288,34 @@ close:
  * generate a string with the current directory
  * updated each time we open/close a directory
  */
- static void initpath(void)
- {
-	path = AllocateZeroPool(DIR_BUFFER_SIZE);
-	if (!path)
-		return;
-	StrCat(path, L"/bootloader/");
- }
-
-static void freepath(void)
+static void initpath(void)
 {
-	if (!path)
-		return;
-
-	FreePool(path);
-	path = NULL;
-	debug(L"Free path");
+	StrCpy(path, L"/bootloader/");
+	path_len[0] = StrLen(path);
 }
 
 static void pushdir(CHAR16 *dir)
 {
-	if (!path)
-		return;
+	UINTN len = StrLen(dir), cur = path_len[subdir];
 
-	if (StrSize(path) + StrSize(dir) > DIR_BUFFER_SIZE)
+	path_len[subdir + 1] = cur;
+	if ((cur + len + 2) * sizeof(CHAR16) > sizeof(path))
 		return;
 
-	subname[subdir] = path + StrLen(path);
-	StrCat(path, dir);
-	StrCat(path, L"/");
+	memcpy(path + cur, dir, len * sizeof(CHAR16));
+	cur += len;
+	path[cur++] = L'/';
+	path[cur] = L'\0';
+	path_len[subdir + 1] = cur;
 	debug(L"Opening %s", path);
 }
 
 static void popdir(void)
 {
-	if (!path)
-		return;
 	if (subdir > 0) {
-		*subname[subdir - 1] = L'\0';
+		path[path_len[subdir - 1]] = L'\0';
 		debug(L"Return to %s", path);
-		return;
 	}
-	freepath();
 }
 
 static EFI_STATUS get_esp_hash(void)
@@ -220,7 +325,7 @@ static EFI_STATUS get_esp_hash(void)
 	EFI_FILE *dirs[MAX_DIR];
 	CHAR8 buf[sizeof(EFI_FILE_INFO) + MAX_FILENAME_LEN];
 	EFI_FILE_INFO *fi = (EFI_FILE_INFO *) buf;
-	UINTN size = sizeof(buf);
+	UINTN i, size = sizeof(buf);
 
 	ret = get_esp_fs(&io);
 	if (EFI_ERROR(ret)) {
@@ -228,11 +333,19 @@ static EFI_STATUS get_esp_hash(void)
 		return ret;
 	}
 
+	for (i = 0; i < ARRAY_SIZE(esp_chunk); i++) {
+		esp_chunk[i] = mt_pool_alloc(MT_HASH, ESP_CHUNK_SIZE);
+		if (!esp_chunk[i]) {
+			ret = EFI_OUT_OF_RESOURCES;
+			goto free;
+		}
+	}
+
 	subdir = 0;
 	ret = uefi_call_wrapper(io->OpenVolume, 2, io, &dirs[subdir]);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to open root directory");
-		return ret;
+		goto free;
 	}
 	initpath();
 	do {
@@ -275,12 +388,21 @@ static EFI_STATUS get_esp_hash(void)
 		} else {
 			ret = hash_file(dirs[subdir], fi);
 			if (EFI_ERROR(ret)) {
-				freepath();
-				return ret;
+				for (; subdir >= 0; subdir--)
+					uefi_call_wrapper(dirs[subdir]->Close, 1, dirs[subdir]);
+				goto free;
 			}
 		}
 	} while (size || subdir >= 0);
-	return EFI_SUCCESS;
+	ret = EFI_SUCCESS;
+
+free:
+	for (i = 0; i < ARRAY_SIZE(esp_chunk); i++) {
+		if (esp_chunk[i])
+			mt_pool_free(esp_chunk[i]);
+		esp_chunk[i] = NULL;
+	}
+	return ret;
 }
 
 EFI_STATUS get_bootloader_hash(const CHAR16 *label)
@@ -428,46 +550,584 @@ static EFI_STATUS read_partition(struct gpt_partition_interface *gparti, UINT64
 		debug(L"attempt to read outside of partition %s, (len %lld offset %lld partition len %lld)", gparti->part.name, len, offset, partlen);
 		return EFI_END_OF_MEDIA;
 	}
-	ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio, gparti->bio->Media->MediaId, partoffset + offset, len, data);
+	ret = gpt_disk_read(gparti, partoffset + offset, len, data);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"read partition %s failed", gparti->part.name);
 	return ret;
 }
 
-#define CHUNK 1024 * 1024
+#ifdef USE_HASH_MANIFEST
+/* Hash manifest: the digest of each hashed partition is saved in the
+   HASH_MANIFEST_VAR EFI variable along with the write generation it
+   was computed at.  The generation counter is bumped and saved in the
+   partition record each time the partition is written, a digest is
+   re-used only if the partition has not been written since it was
+   computed.  */
+#define HASH_MANIFEST_MAGIC	0x4d534148	/* "HASM" */
+#define HASH_MANIFEST_ENTRIES	32
+
+struct hash_manifest_entry {
+	EFI_GUID part_guid;
+	UINT64 write_gen;	/* Generation of the last write */
+	UINT64 hash_gen;	/* Generation the digest was computed at */
+	UINT64 len;
+	UINT32 md_type;
+	UINT8 hash[EVP_MAX_MD_SIZE];
+} __attribute__((packed));
+
+static struct hash_manifest {
+	UINT32 magic;
+	UINT32 nb_entries;
+	UINT64 generation;
+	struct hash_manifest_entry entries[HASH_MANIFEST_ENTRIES];
+} __attribute__((packed)) manifest;
+static BOOLEAN manifest_loaded;
+
+static void hash_manifest_load(void)
+{
+	EFI_STATUS ret;
+	struct hash_manifest *var;
+	UINTN size;
+	UINT32 flags;
+
+	if (manifest_loaded)
+		return;
+
+	manifest_loaded = TRUE;
+	manifest.magic = HASH_MANIFEST_MAGIC;
+	manifest.nb_entries = 0;
+	manifest.generation = 0;
+
+	ret = get_efi_variable(&fastboot_guid, HASH_MANIFEST_VAR, &size,
+			       (VOID **)&var, &flags);
+	if (EFI_ERROR(ret))
+		return;
+
+	if (size >= offsetof(struct hash_manifest, entries) &&
+	    var->magic == HASH_MANIFEST_MAGIC &&
+	    var->nb_entries <= HASH_MANIFEST_ENTRIES &&
+	    size == offsetof(struct hash_manifest, entries) +
+	    var->nb_entries * sizeof(struct hash_manifest_entry))
+		memcpy(&manifest, var, size);
+
+	FreePool(var);
+}
+
+static void hash_manifest_save(void)
+{
+	EFI_STATUS ret;
+
+	ret = set_efi_variable(&fastboot_guid, HASH_MANIFEST_VAR,
+			       offsetof(struct hash_manifest, entries) +
+			       manifest.nb_entries * sizeof(struct hash_manifest_entry),
+			       &manifest, TRUE, FALSE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to save the hash manifest");
+}
+
+static struct hash_manifest_entry *hash_manifest_get(const EFI_GUID *part_guid,
+						     BOOLEAN create)
+{
+	struct hash_manifest_entry *entry;
+	UINTN i;
+
+	hash_manifest_load();
+
+	for (i = 0; i < manifest.nb_entries; i++)
+		if (!CompareGuid((EFI_GUID *)part_guid,
+				 &manifest.entries[i].part_guid))
+			return &manifest.entries[i];
+
+	if (!create)
+		return NULL;
+
+	/* Drop the oldest entry if the manifest is full */
+	if (manifest.nb_entries == HASH_MANIFEST_ENTRIES) {
+		memmove(manifest.entries, manifest.entries + 1,
+			sizeof(manifest.entries) - sizeof(*manifest.entries));
+		manifest.nb_entries--;
+	}
+
+	entry = &manifest.entries[manifest.nb_entries++];
+	memset(entry, 0, sizeof(*entry));
+	memcpy(&entry->part_guid, part_guid, sizeof(entry->part_guid));
+	return entry;
+}
+
+void hash_manifest_touch(const EFI_GUID *part_guid)
+{
+	struct hash_manifest_entry *entry;
+
+	entry = hash_manifest_get(part_guid, TRUE);
+	entry->write_gen = ++manifest.generation;
+	hash_manifest_save();
+}
+
+void hash_manifest_clear(void)
+{
+	manifest_loaded = TRUE;
+	manifest.magic = HASH_MANIFEST_MAGIC;
+	manifest.nb_entries = 0;
+	manifest.generation = 0;
+	del_efi_variable(&fastboot_guid, HASH_MANIFEST_VAR);
+}
+
+static BOOLEAN hash_manifest_lookup(struct gpt_partition_interface *gparti,
+				    UINT64 len, CHAR8 *hash)
+{
+	struct hash_manifest_entry *entry;
+
+	entry = hash_manifest_get(&gparti->part.unique, FALSE);
+	if (!entry || !entry->hash_gen || entry->hash_gen < entry->write_gen ||
+	    entry->len != len || entry->md_type != (UINT32)EVP_MD_type(selected_md))
+		return FALSE;
+
+	memcpy(hash, entry->hash, hash_len);
+	debug(L"Using the cached digest of %s", gparti->part.name);
+	return TRUE;
+}
+
+static void hash_manifest_update(struct gpt_partition_interface *gparti,
+				 UINT64 len, CHAR8 *hash)
+{
+	struct hash_manifest_entry *entry;
+
+	entry = hash_manifest_get(&gparti->part.unique, TRUE);
+	/* Generation 0 means no digest */
+	if (!manifest.generation)
+		manifest.generation = 1;
+	entry->hash_gen = manifest.generation;
+	entry->len = len;
+	entry->md_type = EVP_MD_type(selected_md);
+	memcpy(entry->hash, hash, hash_len);
+	hash_manifest_save();
+}
+#endif
+
+#ifdef HASH_SEGMENT_SIZE_KB
+#define SEGMENT_SIZE ((UINT64)HASH_SEGMENT_SIZE_KB * 1024)
+#else
+#define SEGMENT_SIZE (4 * 1024 * 1024)
+#endif
 #define MIN(a, b) ((a < b) ? (a) : (b))
-static EFI_STATUS hash_partition(struct gpt_partition_interface *gparti, UINT64 len, CHAR8 *hash)
+/* Update CTX with LEN bytes at OFFSET of the partition.  Up to
+   ASYNC_IO_MAX_REQUESTS segments are in flight: the digest is updated
+   with the oldest one while the others are being read.  */
+static EFI_STATUS hash_partition_range(struct gpt_partition_interface *gparti,
+				       UINT64 start, UINT64 len,
+				       struct hash_ctx *ctx)
 {
-	EVP_MD_CTX mdctx;
-	CHAR8 *buffer;
+	CHAR8 *buffer[ASYNC_IO_MAX_REQUESTS] = { NULL };
+	struct async_io *aio;
+	UINTN id[ASYNC_IO_MAX_REQUESTS];
+	UINT64 partoffset;
+	UINT64 nb_seg, submitted, done;
 	UINT64 offset;
-	UINT64 chunklen;
-	EFI_STATUS ret = EFI_INVALID_PARAMETER;
+	UINTN i, nb_buf, cur;
+	EFI_STATUS ret;
 
-	buffer = AllocatePool(CHUNK);
-	if (!buffer)
-		return EFI_OUT_OF_RESOURCES;
+	ret = async_io_open(gparti, &aio);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	nb_seg = (len + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+	nb_buf = MIN(nb_seg, (UINT64)ASYNC_IO_MAX_REQUESTS);
+	for (i = 0; i < nb_buf; i++) {
+		buffer[i] = mt_pool_alloc(MT_HASH, SEGMENT_SIZE);
+		if (!buffer[i]) {
+			ret = EFI_OUT_OF_RESOURCES;
+			goto free;
+		}
+	}
+
+	partoffset = gparti->part.starting_lba * gparti->bio->Media->BlockSize + start;
+	for (submitted = 0, done = 0; done < nb_seg; done++) {
+		for (; submitted < nb_seg && submitted - done < nb_buf; submitted++) {
+			offset = submitted * SEGMENT_SIZE;
+			cur = submitted % nb_buf;
+			ret = async_io_read(aio, partoffset + offset,
+					    MIN(len - offset, SEGMENT_SIZE),
+					    buffer[cur], &id[cur]);
+			if (EFI_ERROR(ret))
+				goto free;
+		}
+
+		cur = done % nb_buf;
+		ret = async_io_wait(aio, id[cur]);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"read partition %s failed", gparti->part.name);
+			goto free;
+		}
+
+		offset = done * SEGMENT_SIZE;
+		hash_update(ctx, buffer[cur], MIN(len - offset, SEGMENT_SIZE));
+	}
+
+free:
+	async_io_close(aio);
+	for (i = 0; i < nb_buf; i++)
+		if (buffer[i])
+			mt_pool_free(buffer[i]);
+	return ret;
+}
+
+static EFI_STATUS hash_partition(struct gpt_partition_interface *gparti, UINT64 len, CHAR8 *hash)
+{
+	struct hash_ctx ctx;
+	EFI_STATUS ret;
+
+	if (!len)
+		return EFI_INVALID_PARAMETER;
+
+	if (len > part_size(gparti)) {
+		debug(L"attempt to hash outside of partition %s", gparti->part.name);
+		return EFI_END_OF_MEDIA;
+	}
 
 	if (!selected_md)
 		set_hash_algorithm(NULL);
 
-	EVP_MD_CTX_init(&mdctx);
-	EVP_DigestInit_ex(&mdctx, selected_md, NULL);
+#ifdef USE_HASH_MANIFEST
+	if (hash_manifest_lookup(gparti, len, hash))
+		return EFI_SUCCESS;
+#endif
+
+	hash_init(&ctx);
+	ret = hash_partition_range(gparti, 0, len, &ctx);
+	if (!EFI_ERROR(ret)) {
+		hash_final(&ctx, hash);
+#ifdef USE_HASH_MANIFEST
+		hash_manifest_update(gparti, len, hash);
+#endif
+	}
+	hash_cleanup(&ctx);
+
+	return ret;
+}
+
+#ifdef USE_AVB
+/* dm-verity hash tree check: the hash tree described by the AVB
+   hashtree descriptor of the partition footer is recomputed from the
+   partition data and compared with the on-disk tree and with the root
+   digest.  The block hashes of each level are computed by the MP
+   worker pool.  It checks the integrity of the partition content, the
+   authenticity of the descriptor being the matter of the boot time
+   verification.  */
+#define HASHTREE_MAX_LEVELS	16
+
+struct hashtree_job {
+	const UINT8 *data;
+	UINT32 block_size;
+	const UINT8 *salt;
+	UINT32 salt_len;
+	UINT8 *digests;
+};
+
+/* Run on the APs.  The blocks are independent messages submitted to
+   the multi-buffer SHA-256 engine, which does not allocate any
+   memory and falls back to the one stream implementations when the
+   processor has no wide SIMD unit.  At most one job per lane is held
+   by the manager, the returned ones are reused.  */
+static void hashtree_hash_blocks(UINTN start, UINTN end, VOID *ctx)
+{
+	struct hashtree_job *job = ctx;
+	struct sha256_mb_mgr mgr;
+	struct sha256_mb_job jobs[SHA256_MB_MAX_LANES], *mb = NULL;
+	UINTN i, used = 0;
+
+	sha256_mb_init(&mgr);
+	for (i = start; i < end; i++) {
+		if (!mb)
+			mb = &jobs[used++];
+		mb->prefix = job->salt;
+		mb->prefix_len = job->salt_len;
+		mb->data = job->data + i * job->block_size;
+		mb->len = job->block_size;
+		mb->digest = job->digests + i * SHA256_DIGEST_LENGTH;
+		mb = sha256_mb_submit(&mgr, mb);
+	}
+	while (sha256_mb_flush(&mgr))
+		;
+}
+
+static EFI_STATUS hashtree_hash_level(struct hashtree_job *job, const UINT8 *data,
+				      UINTN nb_blocks, UINT8 *digests)
+{
+	job->data = data;
+	job->digests = digests;
+	return parallel_for(nb_blocks, 64, hashtree_hash_blocks, job);
+}
+
+struct hashtree_info {
+	AvbHashtreeDescriptor desc;
+	const UINT8 *salt;
+	const UINT8 *root_digest;
+	BOOLEAN found;
+};
+
+static bool find_hashtree_descriptor(const AvbDescriptor *descriptor, void *user_data)
+{
+	struct hashtree_info *info = user_data;
+	const UINT8 *p;
+
+	if (avb_be64toh(descriptor->tag) != AVB_DESCRIPTOR_TAG_HASHTREE)
+		return true;
+
+	if (!avb_hashtree_descriptor_validate_and_byteswap(
+		    (const AvbHashtreeDescriptor *)descriptor, &info->desc))
+		return true;
+
+	p = (const UINT8 *)descriptor + sizeof(AvbHashtreeDescriptor);
+	info->salt = p + info->desc.partition_name_len;
+	info->root_digest = info->salt + info->desc.salt_len;
+	info->found = TRUE;
+	return false;
+}
+
+static EFI_STATUS read_footer_vbmeta(struct gpt_partition_interface *gparti,
+				     UINT8 **vbmeta, UINT64 *vbmeta_size)
+{
+	AvbFooter footer;
+	EFI_STATUS ret;
+	AvbVBMetaVerifyResult res;
+
+	ret = read_partition(gparti, part_size(gparti) - AVB_FOOTER_SIZE,
+			     sizeof(footer), &footer);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!avb_footer_validate_and_byteswap(&footer, &footer)) {
+		error(L"No valid AVB footer on %s", gparti->part.name);
+		return EFI_NOT_FOUND;
+	}
+
+	if (footer.vbmeta_size > part_size(gparti) ||
+	    footer.vbmeta_offset > part_size(gparti) - footer.vbmeta_size)
+		return EFI_COMPROMISED_DATA;
+
+	*vbmeta = AllocatePool(footer.vbmeta_size);
+	if (!*vbmeta)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = read_partition(gparti, footer.vbmeta_offset, footer.vbmeta_size, *vbmeta);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	res = avb_vbmeta_image_verify(*vbmeta, footer.vbmeta_size, NULL, NULL);
+	if (res != AVB_VBMETA_VERIFY_RESULT_OK &&
+	    res != AVB_VBMETA_VERIFY_RESULT_OK_NOT_SIGNED) {
+		error(L"Invalid vbmeta image in %s footer", gparti->part.name);
+		ret = EFI_COMPROMISED_DATA;
+		goto err;
+	}
+
+	*vbmeta_size = footer.vbmeta_size;
+	return EFI_SUCCESS;
+
+err:
+	FreePool(*vbmeta);
+	return ret;
+}
+
+/* Read the partition data and compute the first level of the tree.
+   The next segment is read while the current one is hashed.  */
+static EFI_STATUS hashtree_hash_data(struct gpt_partition_interface *gparti,
+				     struct hashtree_job *job, UINT64 image_size,
+				     UINT8 *digests)
+{
+	UINT64 seg_size = ALIGN_DOWN(SEGMENT_SIZE, job->block_size);
+	CHAR8 *buffer[2] = { NULL, NULL };
+	struct async_io *aio;
+	UINTN id[2];
+	UINT64 partoffset, offset, len;
+	UINTN cur;
+	EFI_STATUS ret;
+
+	if (!seg_size)
+		seg_size = job->block_size;
+
+	ret = async_io_open(gparti, &aio);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	buffer[0] = mt_pool_alloc(MT_HASH, seg_size);
+	buffer[1] = mt_pool_alloc(MT_HASH, seg_size);
+	if (!buffer[0] || !buffer[1]) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	partoffset = gparti->part.starting_lba * gparti->bio->Media->BlockSize;
+	cur = 0;
+	ret = async_io_read(aio, partoffset, MIN(image_size, seg_size),
+			    buffer[0], &id[0]);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	for (offset = 0; offset < image_size; offset += seg_size, cur = !cur) {
+		len = MIN(image_size - offset, seg_size);
+		if (offset + seg_size < image_size) {
+			ret = async_io_read(aio, partoffset + offset + seg_size,
+					    MIN(image_size - offset - seg_size, seg_size),
+					    buffer[!cur], &id[!cur]);
+			if (EFI_ERROR(ret))
+				goto out;
+		}
+
+		ret = async_io_wait(aio, id[cur]);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"read partition %s failed", gparti->part.name);
+			goto out;
+		}
 
-	for (offset = 0; offset < len; offset += CHUNK) {
-		chunklen = MIN(len - offset, CHUNK);
-		ret = read_partition(gparti, offset, chunklen, buffer);
+		/* The last block is zero padded */
+		if (len % job->block_size)
+			memset(buffer[cur] + len, 0,
+			       job->block_size - len % job->block_size);
+
+		ret = hashtree_hash_level(job, (UINT8 *)buffer[cur],
+					  DIV_ROUND_UP(len, job->block_size),
+					  digests + offset / job->block_size *
+					  SHA256_DIGEST_LENGTH);
 		if (EFI_ERROR(ret))
-			goto free;
-		EVP_DigestUpdate(&mdctx, buffer, chunklen);
+			goto out;
 	}
-	EVP_DigestFinal_ex(&mdctx, hash, NULL);
 
-free:
-	EVP_MD_CTX_cleanup(&mdctx);
-	FreePool(buffer);
+out:
+	async_io_close(aio);
+	if (buffer[0])
+		mt_pool_free(buffer[0]);
+	if (buffer[1])
+		mt_pool_free(buffer[1]);
+	return ret;
+}
+
+EFI_STATUS verify_hashtree(const CHAR16 *label)
+{
+	struct gpt_partition_interface gparti;
+	struct hashtree_info info = { .found = FALSE };
+	struct hashtree_job job;
+	UINT64 level_size[HASHTREE_MAX_LEVELS];
+	UINT64 level_off[HASHTREE_MAX_LEVELS];
+	UINT8 *vbmeta = NULL, *tree = NULL, *disk_tree = NULL;
+	UINT8 root[SHA256_DIGEST_LENGTH];
+	UINT64 vbmeta_size, size, tree_size;
+	UINTN levels, i;
+	SHA256_CTX sha;
+	EFI_STATUS ret;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	ret = read_footer_vbmeta(&gparti, &vbmeta, &vbmeta_size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	avb_descriptor_foreach(vbmeta, vbmeta_size, find_hashtree_descriptor, &info);
+	if (!info.found) {
+		error(L"No hashtree descriptor for %s", label);
+		ret = EFI_NOT_FOUND;
+		goto out;
+	}
+
+	if (strcmp((CHAR8 *)info.desc.hash_algorithm, (CHAR8 *)"sha256") ||
+	    info.desc.data_block_size != info.desc.hash_block_size ||
+	    info.desc.data_block_size % SHA256_DIGEST_LENGTH ||
+	    info.desc.root_digest_len != SHA256_DIGEST_LENGTH ||
+	    info.desc.image_size <= info.desc.data_block_size) {
+		error(L"Unsupported hash tree geometry or algorithm");
+		ret = EFI_UNSUPPORTED;
+		goto out;
+	}
+
+	/* Levels geometry, the top level comes first on the disk */
+	levels = 0;
+	for (size = info.desc.image_size; size > info.desc.data_block_size;
+	     size = level_size[levels++]) {
+		if (levels == HASHTREE_MAX_LEVELS) {
+			ret = EFI_UNSUPPORTED;
+			goto out;
+		}
+		level_size[levels] = ALIGN(DIV_ROUND_UP(size, info.desc.data_block_size) *
+					   SHA256_DIGEST_LENGTH,
+					   (UINT64)info.desc.data_block_size);
+	}
+	for (tree_size = 0, i = levels; i > 0; i--) {
+		level_off[i - 1] = tree_size;
+		tree_size += level_size[i - 1];
+	}
+
+	if (tree_size != info.desc.tree_size ||
+	    tree_size > part_size(&gparti) ||
+	    info.desc.tree_offset > part_size(&gparti) - tree_size) {
+		error(L"Inconsistent hash tree size");
+		ret = EFI_COMPROMISED_DATA;
+		goto out;
+	}
+
+	tree = AllocateZeroPool(tree_size);
+	disk_tree = AllocatePool(tree_size);
+	if (!tree || !disk_tree) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	job.block_size = info.desc.data_block_size;
+	job.salt = info.salt;
+	job.salt_len = info.desc.salt_len;
+
+	ret = hashtree_hash_data(&gparti, &job, info.desc.image_size,
+				 tree + level_off[0]);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	for (i = 1; i < levels; i++) {
+		ret = hashtree_hash_level(&job, tree + level_off[i - 1],
+					  level_size[i - 1] / job.block_size,
+					  tree + level_off[i]);
+		if (EFI_ERROR(ret))
+			goto out;
+	}
+
+	SHA256_Init(&sha);
+	SHA256_Update(&sha, info.salt, info.desc.salt_len);
+	SHA256_Update(&sha, tree + level_off[levels - 1], level_size[levels - 1]);
+	SHA256_Final(root, &sha);
+
+	ret = read_partition(&gparti, info.desc.tree_offset, tree_size, disk_tree);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	for (i = 0; i < levels; i++)
+		if (memcmp(tree + level_off[i], disk_tree + level_off[i],
+			   level_size[i])) {
+			fastboot_info("%s: hash tree level %d mismatch", label, i);
+			ret = EFI_COMPROMISED_DATA;
+		}
+
+	if (memcmp(root, info.root_digest, sizeof(root))) {
+		fastboot_info("%s: root digest mismatch", label);
+		ret = EFI_COMPROMISED_DATA;
+	}
+
+	if (!EFI_ERROR(ret))
+		fastboot_info("%s: %ld blocks, %d levels, hash tree verified",
+			      label, DIV_ROUND_UP(info.desc.image_size,
+						  info.desc.data_block_size),
+			      levels);
+
+out:
+	if (disk_tree)
+		FreePool(disk_tree);
+	if (tree)
+		FreePool(tree);
+	FreePool(vbmeta);
 	return ret;
 }
+#endif
 
 #ifndef USE_AVB
 static EFI_STATUS get_bootimage_len(struct gpt_partition_interface *gparti,
@@ -483,9 +1143,7 @@ static EFI_STATUS get_bootimage_len(struct gpt_partition_interface *gparti,
 	part_len = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) *
 		gparti->bio->Media->BlockSize;
 
-	ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
-				gparti->bio->Media->MediaId, part_off,
-				sizeof(hdr), &hdr);
+	ret = blkcache_read(gparti, part_off, sizeof(hdr), &hdr);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read the boot image header");
 		return ret;
@@ -508,9 +1166,8 @@ static EFI_STATUS get_bootimage_len(struct gpt_partition_interface *gparti,
 	if (!footer)
 		return EFI_OUT_OF_RESOURCES;
 
-	ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
-				gparti->bio->Media->MediaId, part_off + *len,
-				BOOT_SIGNATURE_MAX_SIZE, footer);
+	ret = blkcache_read(gparti, part_off + *len,
+			    BOOT_SIGNATURE_MAX_SIZE, footer);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read the boot image footer");
 		goto out;
@@ -565,9 +1222,8 @@ static EFI_STATUS get_iasimage_len(struct gpt_partition_interface *gparti,
 	part_len = (gparti->part.ending_lba + 1 - gparti->part.starting_lba) *
 		gparti->bio->Media->BlockSize;
 
-	ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
-				gparti->bio->Media->MediaId, part_off + iasoffset,
-				sizeof(hdr), &hdr);
+	ret = blkcache_read(gparti, part_off + iasoffset,
+			    sizeof(hdr), &hdr);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read the ias image header");
 		return ret;
@@ -591,9 +1247,8 @@ static EFI_STATUS get_iasimage_len(struct gpt_partition_interface *gparti,
 			if (!files_num_data)
 				return EFI_OUT_OF_RESOURCES;
 
-			ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
-				gparti->bio->Media->MediaId, part_off + iasoffset + sizeof(hdr),
-				files_num, files_num_data);
+			ret = blkcache_read(gparti, part_off + iasoffset + sizeof(hdr),
+					    files_num, files_num_data);
 			if (EFI_ERROR(ret)) {
 				efi_perror(ret, L"Failed to multi files");
 				FreePool(files_num_data);
@@ -619,9 +1274,8 @@ static EFI_STATUS get_iasimage_len(struct gpt_partition_interface *gparti,
 					FreePool(files_num_data);
 					return EFI_COMPROMISED_DATA;
 				}
-				ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
-					gparti->bio->Media->MediaId, part_off + data_off,
-					sizeof(tos_magic), &tos_magic);
+				ret = blkcache_read(gparti, part_off + data_off,
+						    sizeof(tos_magic), &tos_magic);
 				if (EFI_ERROR(ret)) {
 					efi_perror(ret, L"Failed to read the multiboot magic");
 					FreePool(files_num_data);
@@ -641,9 +1295,8 @@ static EFI_STATUS get_iasimage_len(struct gpt_partition_interface *gparti,
 				return EFI_COMPROMISED_DATA;
 			}
 		} else {
-			ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
-					gparti->bio->Media->MediaId, part_off + data_off,
-					sizeof(tos_magic), &tos_magic);
+			ret = blkcache_read(gparti, part_off + data_off,
+					    sizeof(tos_magic), &tos_magic);
 			if (EFI_ERROR(ret)) {
 				efi_perror(ret, L"Failed to read the multiboot magic");
 				return ret;
@@ -884,6 +1537,57 @@ EFI_STATUS get_super_image_hash(const CHAR16 *label)
 
 	return report_hash(L"/", gpart.part.name, hash);
 }
+
+/* The logical partition is hashed extent by extent, the ZERO extents
+   as zeroes.  The hash manifest is not used: a logical partition has
+   no GUID of its own.  */
+EFI_STATUS get_logical_partition_hash(const CHAR16 *name)
+{
+	const struct lp_partition *part;
+	struct gpt_partition_interface super;
+	struct hash_ctx ctx;
+	CHAR8 hash[EVP_MAX_MD_SIZE];
+	CHAR8 *zero = NULL;
+	UINT64 len;
+	UINT32 i;
+	EFI_STATUS ret;
+
+	ret = lp_get_partition(name, &part, &super);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Logical partition %s not found", name);
+		return ret;
+	}
+
+	hash_init(&ctx);
+	for (i = 0; i < part->nb_extents; i++) {
+		if (!part->extents[i].zero) {
+			ret = hash_partition_range(&super, part->extents[i].offset,
+						   part->extents[i].size, &ctx);
+			if (EFI_ERROR(ret))
+				goto out;
+			continue;
+		}
+
+		if (!zero) {
+			zero = mt_pool_alloc(MT_HASH, SEGMENT_SIZE);
+			if (!zero) {
+				ret = EFI_OUT_OF_RESOURCES;
+				goto out;
+			}
+			memset(zero, 0, SEGMENT_SIZE);
+		}
+		for (len = part->extents[i].size; len; len -= MIN(len, SEGMENT_SIZE))
+			hash_update(&ctx, zero, MIN(len, SEGMENT_SIZE));
+	}
+	hash_final(&ctx, hash);
+	ret = report_hash(L"/", part->name, hash);
+
+out:
+	hash_cleanup(&ctx);
+	if (zero)
+		mt_pool_free(zero);
+	return ret;
+}
 #endif
 
 EFI_STATUS get_fs_hash(const CHAR16 *label)
@@ -40,15 +40,24 @@ EFI_STATUS get_ias_image_hash(const CHAR16 *label);
 #endif
 #ifdef USE_AVB
 EFI_STATUS get_vbmeta_image_hash(const CHAR16 *label);
+EFI_STATUS verify_hashtree(const CHAR16 *label);
 #endif
 EFI_STATUS get_boot_image_hash(const CHAR16 *label);
 EFI_STATUS get_bootloader_hash(const CHAR16 *label);
 EFI_STATUS get_fs_hash(const CHAR16 *label);
 EFI_STATUS set_hash_algorithm(const CHAR8 *algo);
+#ifdef USE_HASH_MANIFEST
+/* Bump the write generation of a partition, invalidating its cached
+   digest */
+void hash_manifest_touch(const EFI_GUID *part_guid);
+void hash_manifest_clear(void);
+#endif
 #if defined(USE_ACPIO) || defined(USE_ACPI)
 EFI_STATUS get_acpi_hash(const CHAR16 *label);
 #endif
 #ifdef DYNAMIC_PARTITIONS
 EFI_STATUS get_super_image_hash(const CHAR16 *label);
+/* Hash the logical partition NAME of the super partition */
+EFI_STATUS get_logical_partition_hash(const CHAR16 *name);
 #endif
 #endif	/* _HASHES_H_ */
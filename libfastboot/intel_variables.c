@@ -40,26 +40,38 @@
 #include "smbios.h"
 #include "intel_variables.h"
 
+/* The firmware, DMI and serial number variables cannot change while
+ * fastboot runs: they are only computed on the first getvar, see
+ * fastboot_publish_lazy().  */
+
 /* "secureboot": Indicates whether UEFI Secure Boot is enabled. This
    is a pre-requisite for Verified Boot.  */
+static const char *get_secureboot(void)
+{
+	return is_platform_secure_boot_enabled() ? "yes" : "no";
+}
+
 static EFI_STATUS publish_secureboot(void)
 {
-	return fastboot_publish("secureboot",
-				is_platform_secure_boot_enabled() ? "yes" : "no" );
+	return fastboot_publish_lazy("secureboot", get_secureboot);
 }
 
 /* "product-name": Reports "product_name" field in DMI.  */
+static const char *get_product_name(void)
+{
+	return SMBIOS_GET_STRING(1, ProductName);
+}
+
 static EFI_STATUS publish_product_name(void)
 {
-	return fastboot_publish("product-name",
-				SMBIOS_GET_STRING(1, ProductName));
+	return fastboot_publish_lazy("product-name", get_product_name);
 }
 
 /* "firmware": Reports the current device firmware version from
  * DMI. Combines the values of DMI "bios_vendor" and "bios_version"
  * fields.  */
 static char firmware_str[128];
-static EFI_STATUS publish_firmware(void)
+static const char *get_firmware(void)
 {
 	int len;
 
@@ -68,9 +80,14 @@ static EFI_STATUS publish_firmware(void)
 			   SMBIOS_GET_STRING(0, Vendor),
 			   SMBIOS_GET_STRING(0, BiosVersion));
 	if (len == -1)
-		return EFI_INVALID_PARAMETER;
+		return NULL;
 
-	return fastboot_publish("firmware", firmware_str);
+	return firmware_str;
+}
+
+static EFI_STATUS publish_firmware(void)
+{
+	return fastboot_publish_lazy("firmware", get_firmware);
 }
 
 /* "boot-state": Indicates the device's color-coded boot state as per
@@ -103,7 +120,7 @@ static EFI_STATUS publish_device_state(void)
 /* "board": Indicates the board information, combining the values of
  * DMI "board_vendor", "board_name", and "board_version" fields.  */
 static char board_str[128];
-static EFI_STATUS publish_board(void)
+static const char *get_board(void)
 {
 	int len;
 
@@ -113,16 +130,26 @@ static EFI_STATUS publish_board(void)
 			   SMBIOS_GET_STRING(2, ProductName),
 			   SMBIOS_GET_STRING(2, Version));
 	if (len < 0)
-		return EFI_INVALID_PARAMETER;
+		return NULL;
+
+	return board_str;
+}
 
-	return fastboot_publish("board", board_str);
+static EFI_STATUS publish_board(void)
+{
+	return fastboot_publish_lazy("board", get_board);
 }
 
 /* "serialno": The device serial number. */
-static EFI_STATUS publish_serialno(void)
+static const char *get_serialno(void)
 {
 	char *serial = get_serial_number();
-	return fastboot_publish("serialno", serial ? serial : "N/A");
+	return serial ? serial : "N/A";
+}
+
+static EFI_STATUS publish_serialno(void)
+{
+	return fastboot_publish_lazy("serialno", get_serialno);
 }
 
 static EFI_STATUS (*PUBLISH_FUNCTION[])(void) = {
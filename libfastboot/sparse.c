@@ -32,6 +32,8 @@
  *
  */
 
+#define LOG_MODULE LOG_MODULE_SPARSE
+
 #include <efi.h>
 #include <efilib.h>
 #include <lib.h>
@@ -39,6 +41,11 @@
 
 #include "flash.h"
 #include "sparse_format.h"
+#include "crc32.h"
+#include "memtrack.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Hunks buffer size.  */
 static const unsigned int BUFFER_SIZE = 10 * 1024 * 1024;
@@ -77,7 +84,7 @@ BOOLEAN is_sparse_image(void *data, UINT64 size)
 
 static EFI_STATUS init_buffer()
 {
-	buffer = AllocatePool(BUFFER_SIZE);
+	buffer = mt_pool_alloc(MT_SPARSE, BUFFER_SIZE);
 	if (!buffer) {
 		debug(L"Allocation failed, sparse file buffer is disabled");
 		return EFI_OUT_OF_RESOURCES;
@@ -92,7 +99,7 @@ static void free_buffer()
 	if (!buffer)
 		return;
 
-	FreePool(buffer);
+	mt_pool_free(buffer);
 	buffer = NULL;
 }
 
@@ -133,30 +140,66 @@ static EFI_STATUS flash_raw_data(void *data, unsigned size)
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ckh, CHAR8 *data, unsigned int size)
+/* Resumable sparse image parser.  The image can be provided in
+   fragments of arbitrary size: partial file and chunk headers are
+   accumulated across calls and each chunk is flashed as soon as it is
+   complete.  Raw chunk data is flashed as it arrives.  */
+enum sparse_state {
+	SPARSE_FILE_HEADER,
+	SPARSE_CHUNK_HEADER,
+	SPARSE_CHUNK_DATA,
+	SPARSE_DONE,
+	SPARSE_ERROR
+};
+
+static struct sparse_stream {
+	enum sparse_state state;
+	struct sparse_header sph;
+	struct chunk_header ckh;
+	/* Bytes of the current header or chunk data consumed so far */
+	UINT32 consumed;
+	/* Bytes remaining in the current chunk data */
+	UINT32 remaining;
+	UINT32 chunk;
+	/* FILL and CRC32 chunk payload */
+	UINT32 value;
+	/* CRC32 of the data flashed so far */
+	UINT32 crc;
+} ss;
+
+static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ckh,
+			      CHAR8 *data, UINT32 size)
 {
+	static const UINT32 zero;
 	EFI_STATUS ret;
 	UINT64 chunk_szb = (UINT64)ckh->chunk_sz * (UINT64)sph->blk_sz;
 
 	switch (ckh->chunk_type) {
 	case CHUNK_TYPE_RAW:
-		if (size % sph->blk_sz || size != chunk_szb) {
-			error(L"inconsistent raw chunk");
-			return EFI_INVALID_PARAMETER;
-		}
+		ss.crc = crc32_update(ss.crc, data, size);
 		return flash_raw_data(data, size);
 	case CHUNK_TYPE_DONT_CARE:
+		/* Don't care blocks count as 0 in the checksum */
+		ss.crc = crc32_repeat(ss.crc, &zero, sizeof(zero),
+				      chunk_szb / sizeof(zero));
 		ret = flush_buffer();
 		if (EFI_ERROR(ret))
 			return ret;
 		return flash_skip(chunk_szb);
 	case CHUNK_TYPE_FILL:
+		ss.crc = crc32_repeat(ss.crc, data, sizeof(UINT32),
+				      chunk_szb / sizeof(UINT32));
 		ret = flush_buffer();
 		if (EFI_ERROR(ret))
 			return ret;
 		return flash_fill(*((UINT32 *) data), chunk_szb);
 	case CHUNK_TYPE_CRC32:
-		debug(L"crc chunk not implemented yet %d", size);
+		if (*((UINT32 *)data) != ss.crc) {
+			error(L"sparse image CRC32 mismatch at chunk %d, 0x%08x != 0x%08x",
+			      ss.chunk, *((UINT32 *)data), ss.crc);
+			return EFI_CRC_ERROR;
+		}
+		debug(L"sparse image CRC32 0x%08x verified", ss.crc);
 		break;
 	default:
 		error(L"Unknow chunk type %04x", ckh->chunk_type);
@@ -165,44 +208,363 @@ static EFI_STATUS flash_chunk(struct sparse_header *sph, struct chunk_header *ck
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS flash_sparse(void *data, UINT64 size)
+static EFI_STATUS check_chunk_header(struct sparse_header *sph, struct chunk_header *ckh)
 {
-	struct sparse_header *sph;
-	CHAR8 *s;
-	UINT64 rlen;
-	unsigned int i;
-	EFI_STATUS ret_flush_buffer, ret = EFI_SUCCESS;
+	UINT64 chunk_szb = (UINT64)ckh->chunk_sz * (UINT64)sph->blk_sz;
+	UINT32 data_sz;
 
-	rlen = size;
-	s = data;
-	sph = data;
-	s += sph->file_hdr_sz;
+	if (ckh->total_sz < sph->chunk_hdr_sz) {
+		error(L"sparse chunk malformated, %d, %d", ckh->total_sz, sph->chunk_hdr_sz);
+		return EFI_INVALID_PARAMETER;
+	}
+	data_sz = ckh->total_sz - sph->chunk_hdr_sz;
+
+	switch (ckh->chunk_type) {
+	case CHUNK_TYPE_RAW:
+		if (data_sz != chunk_szb) {
+			error(L"inconsistent raw chunk");
+			return EFI_INVALID_PARAMETER;
+		}
+		break;
+	case CHUNK_TYPE_DONT_CARE:
+		break;
+	case CHUNK_TYPE_FILL:
+	case CHUNK_TYPE_CRC32:
+		if (data_sz != sizeof(UINT32)) {
+			error(L"inconsistent chunk %04x size %d", ckh->chunk_type, data_sz);
+			return EFI_INVALID_PARAMETER;
+		}
+		break;
+	default:
+		error(L"Unknow chunk type %04x", ckh->chunk_type);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Copy up to WANTED - SS.CONSUMED bytes from DATA into DST and
+   return the number of bytes of DATA consumed.  Bytes beyond
+   DST_SIZE are dropped.  */
+static UINTN accumulate(void *dst, UINTN dst_size, UINTN wanted,
+			CHAR8 *data, UINTN size)
+{
+	UINTN len = min(wanted - ss.consumed, size);
+
+	if (ss.consumed < dst_size)
+		memcpy((CHAR8 *)dst + ss.consumed, data,
+		       min(len, dst_size - ss.consumed));
+	ss.consumed += len;
+
+	return len;
+}
 
+static EFI_STATUS next_chunk(void)
+{
+	ss.consumed = 0;
+	if (++ss.chunk == ss.sph.total_chunks)
+		ss.state = SPARSE_DONE;
+	else
+		ss.state = SPARSE_CHUNK_HEADER;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS parse_file_header(CHAR8 *data, UINTN size, UINTN *used)
+{
+	*used = 0;
+	if (ss.consumed < sizeof(ss.sph)) {
+		*used = accumulate(&ss.sph, sizeof(ss.sph), sizeof(ss.sph),
+				   data, size);
+		if (ss.consumed < sizeof(ss.sph))
+			return EFI_SUCCESS;
+	}
+
+	/* The file header might be larger than the structure we know */
+	if (ss.consumed == sizeof(ss.sph) &&
+	    !is_sparse_image(&ss.sph, sizeof(ss.sph))) {
+		error(L"Invalid sparse header");
+		return EFI_INVALID_PARAMETER;
+	}
+	*used += accumulate(NULL, 0, ss.sph.file_hdr_sz, data + *used, size - *used);
+	if (ss.consumed < ss.sph.file_hdr_sz)
+		return EFI_SUCCESS;
+
+	ss.consumed = 0;
+	ss.chunk = 0;
+	ss.state = ss.sph.total_chunks ? SPARSE_CHUNK_HEADER : SPARSE_DONE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS parse_chunk_header(CHAR8 *data, UINTN size, UINTN *used)
+{
+	EFI_STATUS ret;
+
+	*used = accumulate(&ss.ckh, sizeof(ss.ckh), ss.sph.chunk_hdr_sz, data, size);
+	if (ss.consumed < ss.sph.chunk_hdr_sz)
+		return EFI_SUCCESS;
+
+	ret = check_chunk_header(&ss.sph, &ss.ckh);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ss.consumed = 0;
+	ss.remaining = ss.ckh.total_sz - ss.sph.chunk_hdr_sz;
+	if (ss.remaining) {
+		ss.state = SPARSE_CHUNK_DATA;
+		return EFI_SUCCESS;
+	}
+
+	ret = flash_chunk(&ss.sph, &ss.ckh, NULL, 0);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return next_chunk();
+}
+
+static EFI_STATUS parse_chunk_data(CHAR8 *data, UINTN size, UINTN *used)
+{
+	EFI_STATUS ret;
+	UINTN len;
+
+	if (ss.ckh.chunk_type == CHUNK_TYPE_RAW) {
+		len = min(size, (UINTN)ss.remaining);
+		ret = flash_chunk(&ss.sph, &ss.ckh, data, len);
+		if (EFI_ERROR(ret))
+			return ret;
+		*used = len;
+		ss.remaining -= len;
+		return ss.remaining ? EFI_SUCCESS : next_chunk();
+	}
+
+	*used = accumulate(&ss.value, sizeof(ss.value), ss.remaining, data, size);
+	if (ss.consumed < ss.remaining)
+		return EFI_SUCCESS;
+
+	ret = flash_chunk(&ss.sph, &ss.ckh, (CHAR8 *)&ss.value, sizeof(ss.value));
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return next_chunk();
+}
+
+EFI_STATUS sparse_stream_start(void)
+{
+	memset(&ss, 0, sizeof(ss));
+	ss.state = SPARSE_FILE_HEADER;
 	init_buffer();
 
-	for (i = 0; i < sph->total_chunks; i++) {
-		struct chunk_header *ckh;
-		ckh = (struct chunk_header *) s;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS sparse_stream_write(void *data, UINTN size)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	CHAR8 *s = data;
+	UINTN used;
 
-		if (rlen < sph->chunk_hdr_sz || rlen < ckh->total_sz) {
-			error(L"sparse chunk truncated, %ld, %ld", rlen, size);
-			ret = EFI_INVALID_PARAMETER;
+	while (size && !EFI_ERROR(ret)) {
+		used = 0;
+		switch (ss.state) {
+		case SPARSE_FILE_HEADER:
+			ret = parse_file_header(s, size, &used);
 			break;
-		}
-		if (ckh->total_sz < sph->chunk_hdr_sz) {
-			error(L"sparse chunk malformated, %d, %d", ckh->total_sz, sph->chunk_hdr_sz);
-			ret = EFI_INVALID_PARAMETER;
+		case SPARSE_CHUNK_HEADER:
+			ret = parse_chunk_header(s, size, &used);
 			break;
-		}
-		ret = flash_chunk(sph, ckh, s + sph->chunk_hdr_sz, ckh->total_sz - sph->chunk_hdr_sz);
-		if (EFI_ERROR(ret))
+		case SPARSE_CHUNK_DATA:
+			ret = parse_chunk_data(s, size, &used);
 			break;
-
-		s += ckh->total_sz;
-		rlen -= ckh->total_sz;
+		case SPARSE_DONE:
+			/* Ignore trailing data */
+			return EFI_SUCCESS;
+		default:
+			return EFI_INVALID_PARAMETER;
+		}
+		s += used;
+		size -= used;
 	}
 
-	ret_flush_buffer = flush_buffer();
+	if (EFI_ERROR(ret))
+		ss.state = SPARSE_ERROR;
+
+	return ret;
+}
+
+EFI_STATUS sparse_stream_end(void)
+{
+	EFI_STATUS ret;
+
+	ret = flush_buffer();
 	free_buffer();
-	return EFI_ERROR(ret) ? ret : ret_flush_buffer;
+
+	if (ss.state == SPARSE_ERROR)
+		return EFI_INVALID_PARAMETER;
+
+	if (ss.state != SPARSE_DONE) {
+		error(L"sparse image truncated at chunk %d/%d",
+		      ss.chunk, ss.sph.total_chunks);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	return ret;
+}
+
+EFI_STATUS flash_sparse(void *data, UINT64 size)
+{
+	EFI_STATUS ret, ret_end;
+
+	sparse_stream_start();
+	ret = sparse_stream_write(data, size);
+	ret_end = sparse_stream_end();
+
+	return EFI_ERROR(ret) ? ret : ret_end;
+}
+
+static struct sparse_encoder {
+	CHAR8 *out;
+	UINTN max_size;
+	UINTN size;
+	struct sparse_header *sph;
+	/* Chunk being extended, NULL if none */
+	struct chunk_header *ckh;
+	UINT32 fill;
+	EFI_STATUS status;
+} se;
+
+/* Return TRUE if the block BLK is a repetition of its first 32 bits
+   word.  */
+static BOOLEAN block_is_fill(const UINT32 *blk)
+{
+	UINTN i;
+#ifdef __SSE2__
+	const __m128i *v = (const __m128i *)blk;
+	__m128i pattern = _mm_set1_epi32(blk[0]);
+	__m128i diff;
+
+	/* Check by 64 bytes so that random data is rejected early */
+	for (i = 0; i < SPARSE_BLOCK_SIZE / sizeof(*v); i += 4) {
+		diff = _mm_or_si128(
+			_mm_or_si128(_mm_xor_si128(_mm_loadu_si128(&v[i]), pattern),
+				     _mm_xor_si128(_mm_loadu_si128(&v[i + 1]), pattern)),
+			_mm_or_si128(_mm_xor_si128(_mm_loadu_si128(&v[i + 2]), pattern),
+				     _mm_xor_si128(_mm_loadu_si128(&v[i + 3]), pattern)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff)
+			return FALSE;
+	}
+#else
+	for (i = 1; i < SPARSE_BLOCK_SIZE / sizeof(*blk); i++)
+		if (blk[i] != blk[0])
+			return FALSE;
+#endif
+	return TRUE;
+}
+
+static void *encode_reserve(UINTN size)
+{
+	void *p;
+
+	if (size > se.max_size - se.size) {
+		se.status = EFI_BUFFER_TOO_SMALL;
+		return NULL;
+	}
+
+	p = se.out + se.size;
+	se.size += size;
+	return p;
+}
+
+static EFI_STATUS encode_chunk(UINT16 type, UINT32 data_size)
+{
+	se.ckh = encode_reserve(sizeof(*se.ckh));
+	if (!se.ckh)
+		return se.status;
+
+	se.ckh->chunk_type = type;
+	se.ckh->reserved1 = 0;
+	se.ckh->chunk_sz = 0;
+	se.ckh->total_sz = sizeof(*se.ckh) + data_size;
+	se.sph->total_chunks++;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS encode_block(const UINT32 *blk)
+{
+	EFI_STATUS ret;
+	UINT32 *value;
+	void *data;
+
+	if (block_is_fill(blk)) {
+		if (!se.ckh || se.ckh->chunk_type != CHUNK_TYPE_FILL ||
+		    se.fill != blk[0]) {
+			ret = encode_chunk(CHUNK_TYPE_FILL, sizeof(*value));
+			if (EFI_ERROR(ret))
+				return ret;
+			value = encode_reserve(sizeof(*value));
+			if (!value)
+				return se.status;
+			*value = se.fill = blk[0];
+		}
+	} else {
+		if (!se.ckh || se.ckh->chunk_type != CHUNK_TYPE_RAW) {
+			ret = encode_chunk(CHUNK_TYPE_RAW, 0);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+		data = encode_reserve(SPARSE_BLOCK_SIZE);
+		if (!data)
+			return se.status;
+		memcpy(data, blk, SPARSE_BLOCK_SIZE);
+		se.ckh->total_sz += SPARSE_BLOCK_SIZE;
+	}
+
+	se.ckh->chunk_sz++;
+	se.sph->total_blks++;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS sparse_encode_start(void *out, UINTN max_size)
+{
+	memset(&se, 0, sizeof(se));
+	se.out = out;
+	se.max_size = max_size;
+
+	se.sph = encode_reserve(sizeof(*se.sph));
+	if (!se.sph)
+		return se.status;
+
+	memset(se.sph, 0, sizeof(*se.sph));
+	se.sph->magic = SPARSE_HEADER_MAGIC;
+	se.sph->major_version = 1;
+	se.sph->file_hdr_sz = sizeof(*se.sph);
+	se.sph->chunk_hdr_sz = sizeof(struct chunk_header);
+	se.sph->blk_sz = SPARSE_BLOCK_SIZE;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS sparse_encode_write(const void *data, UINTN size)
+{
+	const CHAR8 *blk = data;
+
+	if (EFI_ERROR(se.status))
+		return se.status;
+
+	if (size % SPARSE_BLOCK_SIZE)
+		return EFI_INVALID_PARAMETER;
+
+	for (; size; size -= SPARSE_BLOCK_SIZE, blk += SPARSE_BLOCK_SIZE)
+		if (EFI_ERROR(encode_block((const UINT32 *)blk)))
+			return se.status;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS sparse_encode_end(UINTN *size)
+{
+	if (EFI_ERROR(se.status))
+		return se.status;
+
+	*size = se.size;
+	return EFI_SUCCESS;
 }
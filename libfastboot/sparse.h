@@ -40,4 +40,19 @@
 int is_sparse_image(void *data, UINT64 size);
 EFI_STATUS flash_sparse(void *data, UINT64 size);
 
+/* Resumable parser, the sparse image is provided in fragments */
+EFI_STATUS sparse_stream_start(void);
+EFI_STATUS sparse_stream_write(void *data, UINTN size);
+EFI_STATUS sparse_stream_end(void);
+
+/* Sparse image encoder writing into OUT, at most MAX_SIZE bytes.
+   The data must be provided by multiples of SPARSE_BLOCK_SIZE.
+   Blocks repeating a 32 bits pattern, zero blocks in particular,
+   are encoded as FILL chunks.  */
+#define SPARSE_BLOCK_SIZE	4096
+
+EFI_STATUS sparse_encode_start(void *out, UINTN max_size);
+EFI_STATUS sparse_encode_write(const void *data, UINTN size);
+EFI_STATUS sparse_encode_end(UINTN *size);
+
 #endif	/* _SPARSE_H_ */
@@ -29,6 +29,11 @@
 
 #include <lib.h>
 #include <hecisupport.h>
+#include <boottrace.h>
+
+/* An End Of Post message has been sent by heci_end_of_post_async()
+   and its acknowledgement is still to be read.  */
+static BOOLEAN eop_pending;
 
 /*
  * Send message with ack
@@ -36,17 +41,28 @@
 static EFI_STATUS heci_send_w_ack(uint8_t *Message, uint32_t Length, uint32_t *RecLength, uint8_t HostAddress, uint8_t DevAddr)
 {
 	EFI_STATUS ret = EFI_NOT_READY;
+	UINT32 header = 0;
 
 	EFI_GUID guid = HECI_PROTOCOL_GUID;
 	EFI_HECI_PROTOCOL *protocol = NULL;
 
+	/* Do not take the pending EOP acknowledgement for the
+	   response to this message */
+	if (eop_pending)
+		heci_end_of_post_wait();
+
 	ret = LibLocateProtocol(&guid, (void **)&protocol);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get heciprotocol");
 		return ret;
 	}
 
+	if (Length >= sizeof(header))
+		memcpy(&header, Message, sizeof(header));
+	boottrace_begin(BT_HECI_CMD, header);
 	ret = uefi_call_wrapper(protocol->SendwACK, 5, (UINT32 *)Message, Length, RecLength, HostAddress, DevAddr);
+	boottrace_end(BT_HECI_CMD, (Length & 0xFFFF) << 16 |
+		      (EFI_ERROR(ret) ? 0 : *RecLength & 0xFFFF));
 	debug(L"uefi_call_wrapper(SendwACK) =  %d", ret);
 
 	return ret;
@@ -165,3 +181,90 @@ EFI_STATUS heci_end_of_post(void)
 	return ret;
 }
 
+/*
+ * Send End of Post without waiting for the acknowledgement
+ */
+EFI_STATUS heci_end_of_post_async(void)
+{
+	EFI_STATUS ret;
+	EFI_GUID guid = HECI_PROTOCOL_GUID;
+	EFI_HECI_PROTOCOL *protocol = NULL;
+	GEN_END_OF_POST SendEOP;
+	uint32_t SeCMode;
+
+	if (eop_pending)
+		return EFI_SUCCESS;
+
+	debug(L"Start Send HECI Message: EndOfPost (async)");
+	ret = heci_get_sec_mode(&SeCMode);
+	if (EFI_ERROR(ret) || (SeCMode != SEC_MODE_NORMAL)) {
+		return ret;
+	}
+
+	ret = LibLocateProtocol(&guid, (void **)&protocol);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get heciprotocol");
+		return ret;
+	}
+
+	memset(&SendEOP, 0, sizeof(SendEOP));
+	SendEOP.MKHIHeader.Fields.GroupId = EOP_GROUP_ID;
+	SendEOP.MKHIHeader.Fields.Command = EOP_CMD_ID;
+
+	ret = uefi_call_wrapper(protocol->SendMsg, 4, (UINT32 *)&SendEOP,
+				sizeof(SendEOP), BIOS_FIXED_HOST_ADDR,
+				PREBOOT_FIXED_SEC_ADDR);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to send the EOP message");
+		return ret;
+	}
+
+	eop_pending = TRUE;
+	return EFI_SUCCESS;
+}
+
+/*
+ * Collect the acknowledgement of an End of Post sent by
+ * heci_end_of_post_async().  If it cannot be read, the EOP status is
+ * queried and the End of Post is sent again if the CSE did not get it.
+ */
+EFI_STATUS heci_end_of_post_wait(void)
+{
+	EFI_STATUS ret;
+	EFI_GUID guid = HECI_PROTOCOL_GUID;
+	EFI_HECI_PROTOCOL *protocol = NULL;
+	GEN_END_OF_POST_ACK EOPResp;
+	uint32_t HeciRecvLength;
+
+	if (!eop_pending)
+		return EFI_SUCCESS;
+	eop_pending = FALSE;
+
+	ret = LibLocateProtocol(&guid, (void **)&protocol);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get heciprotocol");
+		return ret;
+	}
+
+	memset(&EOPResp, 0, sizeof(EOPResp));
+	HeciRecvLength = sizeof(EOPResp);
+
+	boottrace_begin(BT_HECI_CMD, 0);
+	ret = uefi_call_wrapper(protocol->ReadMsg, 3, BLOCKING,
+				(UINT32 *)&EOPResp, &HeciRecvLength);
+	boottrace_end(BT_HECI_CMD, EFI_ERROR(ret) ? 0 : HeciRecvLength & 0xFFFF);
+	if (EFI_ERROR(ret) || !EOPResp.Header.Fields.IsResponse ||
+	    EOPResp.Header.Fields.GroupId != EOP_GROUP_ID ||
+	    EOPResp.Header.Fields.Command != EOP_CMD_ID) {
+		debug(L"EOP acknowledgement not read, %r", ret);
+		if (heci_is_eop_received())
+			return EFI_SUCCESS;
+		return heci_end_of_post();
+	}
+
+	debug(L"Result   =%08x", EOPResp.Header.Fields.Result);
+	debug(L"RequestedActions   =%08x", EOPResp.Data.RequestedActions);
+
+	return EFI_SUCCESS;
+}
+
@@ -99,6 +99,31 @@ ifeq ($(KERNELFLINGER_USE_IPP_SHA256),true)
     LOCAL_CFLAGS += -msse4 -msha
 endif
 
+ifeq ($(KERNELFLINGER_USE_PCLMUL_CRC32),true)
+    LOCAL_CFLAGS += -DUSE_PCLMUL_CRC32
+    LOCAL_CFLAGS += -msse4 -mpclmul
+endif
+
+ifeq ($(KERNELFLINGER_USE_GPT_CACHE),true)
+    LOCAL_CFLAGS += -DUSE_GPT_CACHE
+endif
+
+ifeq ($(KERNELFLINGER_USE_SPLASH_CACHE),true)
+    LOCAL_CFLAGS += -DUSE_SPLASH_CACHE
+endif
+
+ifeq ($(KERNELFLINGER_RAMDISK_PREDECOMPRESS),true)
+    LOCAL_CFLAGS += -DRAMDISK_PREDECOMPRESS
+endif
+
+ifneq ($(KERNELFLINGER_LOG_RING_SIZE),)
+    LOCAL_CFLAGS += -DLOG_RING_SIZE_KB=$(KERNELFLINGER_LOG_RING_SIZE)
+endif
+
+ifneq ($(KERNELFLINGER_LOG_LEVEL),)
+    LOCAL_CFLAGS += -DLOG_DEFAULT_LEVEL=LOG_LEVEL_$(KERNELFLINGER_LOG_LEVEL)
+endif
+
 ifneq ($(KERNELFLINGER_FIXED_RPMB_KEY),)
     LOCAL_CFLAGS += -DFIXED_RPMB_KEY=$(KERNELFLINGER_FIXED_RPMB_KEY)
 endif
@@ -117,11 +142,7 @@ LOCAL_SRC_FILES := \
 	gpt.c \
 	storage.c \
 	pci.c \
-	mmc.c \
-	ufs.c \
-	sdcard.c \
 	sdio.c \
-	sata.c \
 	uefi_utils.c \
 	targets.c \
 	smbios.c \
@@ -131,17 +152,41 @@ LOCAL_SRC_FILES := \
 	life_cycle.c \
 	qsort.c \
 	rpmb/rpmb.c \
-	rpmb/rpmb_emmc.c \
-	rpmb/rpmb_ufs.c \
-	rpmb/rpmb_virtual.c \
-	rpmb/rpmb_nvme.c \
+	rpmb/rpmb_memory.c \
 	rpmb/rpmb_storage_common.c \
 	timer.c \
-	nvme.c \
-	virtual_media.c \
-	general_block.c \
 	aes_gcm.c \
-	vbmeta_ias.c
+	vbmeta_ias.c \
+	crc32.c \
+	lz4.c \
+	async_io.c \
+	mp_pool.c \
+	random.c \
+	aesni.c \
+	sha256_mb.c \
+	cmdline.c \
+	boottrace.c \
+	boot_harness.c \
+	arena.c \
+	memtrack.c \
+	memmap.c \
+	prefetch.c \
+	bootprof.c \
+	blkcache.c \
+	misc.c \
+	storage_bench.c \
+	io_buffer.c \
+	protocol.c \
+	slot_parts.c
+
+storage_backend_emmc_src := mmc.c rpmb/rpmb_emmc.c
+storage_backend_ufs_src := ufs.c rpmb/rpmb_ufs.c
+storage_backend_sdcard_src := sdcard.c
+storage_backend_sata_src := sata.c
+storage_backend_nvme_src := nvme.c rpmb/rpmb_nvme.c
+storage_backend_virtual_src := virtual_media.c rpmb/rpmb_virtual.c
+storage_backend_general_block_src := general_block.c
+LOCAL_SRC_FILES += $(foreach b,$(KERNELFLINGER_STORAGE_BACKENDS_BUILT),$(storage_backend_$(b)_src))
 
 ifeq ($(KERNELFLINGER_SUPPORT_USB_STORAGE),true)
 	LOCAL_SRC_FILES += usb_storage.c \
@@ -188,6 +233,10 @@ ifeq ($(KERNELFLINGER_USE_IPP_SHA256),true)
     LOCAL_SRC_FILES += sha256_ipps.c
 endif
 
+ifeq ($(PRODUCT_USE_DYNAMIC_PARTITIONS),true)
+    LOCAL_SRC_FILES += lp_metadata.c
+endif
+
 ifeq ($(TARGET_USE_TPM),true)
     LOCAL_SRC_FILES += tpm2_security.c
 endif
@@ -183,31 +183,127 @@ out:
 	return ret;
 }
 
-EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table)
+/* Index of the tables referenced by the XSDT, built on the first
+ * lookup.  Each table checksum is verified once when it is indexed.
+ */
+struct acpi_index_entry {
+	struct ACPI_DESC_HEADER *table;
+	EFI_STATUS status;		/* Checksum verification result */
+};
+
+static struct acpi_index {
+	BOOLEAN ready;
+	struct XSDT_TABLE *xsdt;
+	struct acpi_index_entry dsdt;
+	struct acpi_index_entry *entries;
+	UINTN count;
+} acpi_index;
+
+static struct acpi_index_entry *acpi_index_add(struct acpi_index_entry *entry,
+					       struct ACPI_DESC_HEADER *table)
+{
+	entry->table = table;
+	entry->status = acpi_verify_checksum(table);
+	if (EFI_ERROR(entry->status))
+		error(L"Invalid checksum for %c%c%c%c table",
+		      table->signature[0], table->signature[1],
+		      table->signature[2], table->signature[3]);
+	return entry;
+}
+
+static EFI_STATUS acpi_build_index(void)
 {
 	struct XSDT_TABLE *xsdt;
 	EFI_STATUS ret;
-	UINTN i, nb_acpi_tables, sign_count = 1;
-	char *end;
+	UINTN i, count;
 
-	if (!signature || !table || strlen(signature) != SIG_SIZE)
-		return EFI_INVALID_PARAMETER;
+	if (acpi_index.ready)
+		return EFI_SUCCESS;
 
-	if (!memcmp("DSDT", signature, SIG_SIZE)) {
-		UINT32 dsdt = get_acpi_field(FACP, DSDT);
-		if (dsdt == (UINT32)-1)
-			return EFI_NOT_FOUND;
-		*table = (VOID *)(UINTN)dsdt;
-		goto out;
+	ret = get_xsdt_table(&xsdt);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	count = (xsdt->header.length - sizeof(xsdt->header)) / sizeof(xsdt->entry[1]);
+	if (count) {
+		acpi_index.entries = AllocatePool(count * sizeof(*acpi_index.entries));
+		if (!acpi_index.entries)
+			return EFI_OUT_OF_RESOURCES;
 	}
 
-	ret = get_xsdt_table(&xsdt);
+	for (i = 0; i < count; i++)
+		acpi_index_add(&acpi_index.entries[i],
+			       (VOID *)(UINTN)xsdt->entry[i]);
+
+	acpi_index.xsdt = xsdt;
+	acpi_index.count = count;
+	acpi_index.ready = TRUE;
+	debug(L"%d ACPI tables indexed", count);
+
+	return EFI_SUCCESS;
+}
+
+void acpi_invalidate_index(void)
+{
+	if (acpi_index.entries)
+		FreePool(acpi_index.entries);
+	memset(&acpi_index, 0, sizeof(acpi_index));
+}
+
+UINTN acpi_table_count(void)
+{
+	if (EFI_ERROR(acpi_build_index()))
+		return 0;
+
+	return acpi_index.count;
+}
+
+EFI_STATUS acpi_get_table_by_index(UINTN index, struct ACPI_DESC_HEADER **table)
+{
+	EFI_STATUS ret;
+
+	if (!table)
+		return EFI_INVALID_PARAMETER;
+
+	ret = acpi_build_index();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (index >= acpi_index.count)
+		return EFI_NOT_FOUND;
+
+	*table = acpi_index.entries[index].table;
+	return acpi_index.entries[index].status;
+}
+
+EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table)
+{
+	struct acpi_index_entry *entry = NULL;
+	EFI_STATUS ret;
+	UINTN i, sign_count = 1;
+	char *end;
+
+	if (!signature || !table || strlen(signature) < SIG_SIZE)
+		return EFI_INVALID_PARAMETER;
+
+	ret = acpi_build_index();
 	if (EFI_ERROR(ret))
 		return ret;
 
+	if (!memcmp("DSDT", signature, SIG_SIZE)) {
+		if (!acpi_index.dsdt.table) {
+			UINT32 dsdt = get_acpi_field(FACP, DSDT);
+			if (dsdt == (UINT32)-1)
+				return EFI_NOT_FOUND;
+			acpi_index_add(&acpi_index.dsdt, (VOID *)(UINTN)dsdt);
+		}
+		*table = acpi_index.dsdt.table;
+		return acpi_index.dsdt.status;
+	}
+
 	if (!memcmp(XSDT_SIG, signature, SIG_SIZE)) {
-		*table = xsdt;
-		goto out;
+		*table = acpi_index.xsdt;
+		return EFI_SUCCESS;
 	}
 
 	if (strlen(signature) > SIG_SIZE) {
@@ -216,31 +312,20 @@ EFI_STATUS get_acpi_table(const CHAR8 *signature, VOID **table)
 			return EFI_INVALID_PARAMETER;
 	}
 
-	nb_acpi_tables = (xsdt->header.length - sizeof(xsdt->header)) / sizeof(xsdt->entry[1]);
-	ret = EFI_NOT_FOUND;
-	for (i = 0; i < nb_acpi_tables; i++) {
-		struct ACPI_DESC_HEADER *header = (VOID *)(UINTN)xsdt->entry[i];
-		if (!memcmp(header->signature, signature, SIG_SIZE)) {
-			if (sign_count > 1) {
-				sign_count--;
-				continue;
-			}
-			*table = header;
-			goto out;
+	for (i = 0; i < acpi_index.count; i++) {
+		if (memcmp(acpi_index.entries[i].table->signature, signature, SIG_SIZE))
+			continue;
+		if (--sign_count == 0) {
+			entry = &acpi_index.entries[i];
+			break;
 		}
 	}
 
-	return EFI_NOT_FOUND;
+	if (!entry)
+		return EFI_NOT_FOUND;
 
-out:
-	debug(L"Found %c%c%c%c table", signature[0], signature[1],
-	      signature[2], signature[3]);
-	ret = acpi_verify_checksum(*table);
-	if (EFI_ERROR(ret))
-		error(L"Invalid checksum for %c%c%c%c table", signature[0],
-		      signature[1], signature[2], signature[3]);
-
-	return ret;
+	*table = entry->table;
+	return entry->status;
 }
 
 #ifdef USE_RSCI
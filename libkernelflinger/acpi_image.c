@@ -43,6 +43,8 @@
 #include "slot.h"
 #include "gpt.h"
 #include "dt_table.h"
+#include "async_io.h"
+#include "blkcache.h"
 #ifdef USE_FIRSTSTAGE_MOUNT
 #include "firststage_mount.h"
 #endif
@@ -106,8 +108,8 @@ EFI_STATUS acpi_image_get_length(const CHAR16 *label, struct ACPI_INFO **acpi_in
 	partition_size = (gpart.part.ending_lba + 1 - gpart.part.starting_lba) *
 		gpart.bio->Media->BlockSize;
 	debug(L"Reading %s image header", label);
-	ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
-				partition_start, sizeof(aosp_header), &aosp_header);
+	ret = blkcache_read(&gpart, partition_start, sizeof(aosp_header),
+			    &aosp_header);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"ReadDisk (%s_header)", label);
 		return ret;
@@ -166,46 +168,7 @@ EFI_STATUS acpi_image_get_length(const CHAR16 *label, struct ACPI_INFO **acpi_in
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS acpi_image_load_partition(const CHAR16 *label, VOID **image)
-{
-	EFI_STATUS ret;
-	struct gpt_partition_interface gpart;
-	VOID *acpiimage;
-	struct ACPI_INFO *acpi_info;
-
-	ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Partition %s not found", label);
-		return ret;
-	}
-	ret = acpi_image_get_length(label, &acpi_info);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Partition %s can't get size", label);
-		return ret;
-	}
-
-	acpiimage = AllocatePool((*acpi_info).img_size);
-	if (!acpiimage) {
-		error(L"Alloc memory for %s image failed", label);
-		FreePool(acpi_info);
-		return EFI_OUT_OF_RESOURCES;
-	}
-	debug(L"Reading %s image: %d bytes", label, (*acpi_info).img_size);
-	ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, (*acpi_info).MediaId,
-				(*acpi_info).partition_start, (*acpi_info).img_size, acpiimage);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"ReadDisk Error for %s image read", label);
-		FreePool(acpi_info);
-		FreePool(acpiimage);
-		return ret;
-	}
-	*image = acpiimage;
-	FreePool(acpi_info);
-	return EFI_SUCCESS;
-}
-
-EFI_STATUS install_acpi_table(VOID *acpi_table, UINTN acpi_table_size,
-			      UINTN *tablekey)
+static struct _EFI_ACPI_TABLE_PROTOCOL *locate_acpi_table_protocol(void)
 {
 	EFI_STATUS ret;
 	struct _EFI_ACPI_TABLE_PROTOCOL *acpiprotocol = NULL;
@@ -214,17 +177,10 @@ EFI_STATUS install_acpi_table(VOID *acpi_table, UINTN acpi_table_size,
 	ret = LibLocateProtocol(&guid, (VOID **)&acpiprotocol);
 	if (EFI_ERROR(ret) || !acpiprotocol) {
 		efi_perror(ret, L"LibLocateProtocol: Failed by guid of acpi");
-		return ret;
-	}
-
-	ret = uefi_call_wrapper(acpiprotocol->InstallAcpiTable, 4, acpiprotocol,
-				acpi_table, acpi_table_size, tablekey);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to install acpi table");
-		return ret;
+		return NULL;
 	}
 
-	return ret;
+	return acpiprotocol;
 }
 
 static VOID acpi_add_table_index(UINTN index, enum acpi_src_type type)
@@ -236,6 +192,129 @@ static VOID acpi_add_table_index(UINTN index, enum acpi_src_type type)
 	}
 }
 
+/* Installation batch: between acpi_install_begin() and
+   acpi_install_commit() the tables, already checked, are queued
+   instead of being installed one by one.  The commit locates the ACPI
+   table protocol once, installs the queued tables back to back and
+   lets the XSDT index be rebuilt once.  A table is referenced, not
+   copied: it must stay valid until the commit unless the batch owns
+   it.  */
+struct acpi_queued_table {
+	VOID *data;
+	UINTN size;
+	BOOLEAN owned;
+	UINTN index;
+	enum acpi_src_type type;	/* ACPI_SRC_TYPE_MAX: not recorded */
+};
+
+static struct {
+	BOOLEAN active;
+	UINTN count;
+	struct acpi_queued_table tables[ACPI_TABLE_MAX_LOAD_NUM];
+} batch;
+
+static EFI_STATUS acpi_install_queued(struct _EFI_ACPI_TABLE_PROTOCOL *acpiprotocol,
+				      struct acpi_queued_table *table,
+				      UINTN *tablekey)
+{
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(acpiprotocol->InstallAcpiTable, 4, acpiprotocol,
+				table->data, table->size, tablekey);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to install acpi table");
+	else if (table->type != ACPI_SRC_TYPE_MAX)
+		acpi_add_table_index(table->index, table->type);
+
+	if (table->owned)
+		FreePool(table->data);
+	return ret;
+}
+
+void acpi_install_begin(void)
+{
+	batch.active = TRUE;
+}
+
+EFI_STATUS acpi_install_commit(void)
+{
+	EFI_STATUS ret, status = EFI_SUCCESS;
+	struct _EFI_ACPI_TABLE_PROTOCOL *acpiprotocol;
+	UINTN i, tablekey;
+
+	batch.active = FALSE;
+	if (!batch.count)
+		return EFI_SUCCESS;
+
+	acpiprotocol = locate_acpi_table_protocol();
+	debug(L"Installing %d acpi tables", batch.count);
+	for (i = 0; i < batch.count; i++) {
+		if (!acpiprotocol) {
+			if (batch.tables[i].owned)
+				FreePool(batch.tables[i].data);
+			continue;
+		}
+
+		ret = acpi_install_queued(acpiprotocol, &batch.tables[i],
+					  &tablekey);
+		if (EFI_ERROR(ret) && !EFI_ERROR(status))
+			status = ret;
+	}
+	batch.count = 0;
+
+	/* The firmware has updated the XSDT */
+	acpi_invalidate_index();
+
+	return acpiprotocol ? status : EFI_NOT_FOUND;
+}
+
+/* Install the table right away, or queue it while a batch is open,
+   TABLEKEY is then zero.  Return TRUE if the batch took the ownership
+   of an OWNED table.  */
+static BOOLEAN acpi_install_or_queue(VOID *acpi_table, UINTN size,
+				     BOOLEAN owned, UINTN index,
+				     enum acpi_src_type type,
+				     UINTN *tablekey, EFI_STATUS *ret)
+{
+	struct acpi_queued_table table = {
+		.data = acpi_table,
+		.size = size,
+		.index = index,
+		.type = type
+	};
+	struct _EFI_ACPI_TABLE_PROTOCOL *acpiprotocol;
+
+	*tablekey = 0;
+	if (batch.active && batch.count < ARRAY_SIZE(batch.tables)) {
+		table.owned = owned;
+		batch.tables[batch.count++] = table;
+		*ret = EFI_SUCCESS;
+		return owned;
+	}
+
+	acpiprotocol = locate_acpi_table_protocol();
+	if (!acpiprotocol) {
+		*ret = EFI_NOT_FOUND;
+		return FALSE;
+	}
+
+	*ret = acpi_install_queued(acpiprotocol, &table, tablekey);
+	if (!EFI_ERROR(*ret))
+		/* The firmware has updated the XSDT */
+		acpi_invalidate_index();
+	return FALSE;
+}
+
+EFI_STATUS install_acpi_table(VOID *acpi_table, UINTN acpi_table_size,
+			      UINTN *tablekey)
+{
+	EFI_STATUS ret;
+
+	acpi_install_or_queue(acpi_table, acpi_table_size, FALSE, 0,
+			      ACPI_SRC_TYPE_MAX, tablekey, &ret);
+	return ret;
+}
+
 CHAR8 *acpi_loaded_table_idx_to_string(enum acpi_src_type type)
 {
 	struct ACPI_TABLE_LOADED *tables = &loaded_table[type];
@@ -304,30 +383,58 @@ EFI_STATUS install_acpi_table_from_boot_acpi(VOID *acpiimage, UINTN total_size)
 		if (acpi_csum(acpi_table, acpi_header->length))
 			continue;
 
-		ret = install_acpi_table(acpi_table, acpi_header->length,
-					 &tablekey);
+		acpi_install_or_queue(acpi_table, acpi_header->length, FALSE,
+				      i, BOOT_ACPI, &tablekey, &ret);
 		if (EFI_ERROR(ret))
 			continue;
 
-		acpi_add_table_index(i, BOOT_ACPI);
 		break; // only allow one DSDT in ACPI
 	}
 
 	return EFI_SUCCESS;
 }
 
+/* Return TRUE if the installation batch took the ownership of the
+   OWNED table */
+static BOOLEAN acpi_image_install_table(VOID *acpi_table, UINTN dt_size,
+					UINT32 index, int is_acpio,
+					BOOLEAN owned)
+{
+	struct ACPI_DESC_HEADER *acpi_header = acpi_table;
+	UINTN tablekey;
+	BOOLEAN taken;
+	EFI_STATUS ret;
+
+	debug(L"acpi table info: magic=0x%08x, size=%d",
+	      *(UINT32 *)(acpi_header), acpi_header->length);
+	if (acpi_csum(acpi_table, dt_size))
+		return FALSE;
+
+#if defined(USE_FIRSTSTAGE_MOUNT) && defined(AUTO_DISKBUS)
+	ret = check_revise_acpi_table(acpi_table, dt_size);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Warning: fail to revise acpi_table");
+		return FALSE;
+	}
+#endif
+	taken = acpi_install_or_queue(acpi_table, dt_size, owned, index,
+				      is_acpio ? ACPIO : ACPI_SRC_TYPE_MAX,
+				      &tablekey, &ret);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Warning: acpi_table %d install failed.", index);
+
+	return taken;
+}
+
 static EFI_STATUS acpi_image_parse_table(VOID *acpiimage, int is_acpio)
 {
 	struct dt_table_header *header = (struct dt_table_header *)(acpiimage);
 	struct dt_table_entry *entry;
-	struct ACPI_DESC_HEADER *acpi_header;
-	VOID *acpi_table;
-	UINTN dt_size, dt_offset, tablekey;
+	UINTN dt_size, dt_offset;
 
 	UINT32 entry_size = bswap_32(header->dt_entry_size);
 	UINT32 entry_offset = bswap_32(header->dt_entries_offset);
 	UINT32 entry_count = bswap_32(header->dt_entry_count);
-	EFI_STATUS ret;
 
 	for (UINT32 i = 0; i < entry_count; i++, entry_offset += entry_size) {
 		entry = (struct dt_table_entry *)(acpiimage + entry_offset);
@@ -337,36 +444,191 @@ static EFI_STATUS acpi_image_parse_table(VOID *acpiimage, int is_acpio)
 		if (dt_size == 0 || dt_offset == 0)
 			continue;
 
-		acpi_table = acpiimage + dt_offset;
-		acpi_header = (struct ACPI_DESC_HEADER *)(acpi_table);
-		debug(L"acpi table info: magic=0x%08x, size=%d",
-		      *(UINT32 *)(acpi_header), acpi_header->length);
-		if (acpi_csum(acpi_table, dt_size))
-			continue;
+		acpi_image_install_table(acpiimage + dt_offset, dt_size, i,
+					 is_acpio, FALSE);
+	}
 
-#if defined(USE_FIRSTSTAGE_MOUNT) && defined(AUTO_DISKBUS)
-		ret = check_revise_acpi_table(acpi_table, dt_size);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Warning: fail to revise acpi_table");
-			continue;
-		}
-#endif
-		ret = install_acpi_table(acpi_table, dt_size, &tablekey);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Warning: acpi_table %d install failed.", i);
-			continue;
-		}
+	return EFI_SUCCESS;
+}
+
+/* Table of an ACPI image partition being read */
+struct acpi_image_table {
+	VOID *data;
+	UINTN size;
+	UINTN id;
+};
+
+static EFI_STATUS acpi_image_read_entries(struct gpt_partition_interface *gpart,
+					  struct ACPI_INFO *acpi_info,
+					  struct dt_table_entry **entries_p,
+					  UINT32 *count_p)
+{
+	EFI_STATUS ret;
+	struct dt_table_header header;
+	struct dt_table_entry *entries;
+	UINT32 entry_size, entry_offset, entry_count, i;
+	UINT8 *raw;
 
-		if (is_acpio)
-			acpi_add_table_index(i, ACPIO);
+	ret = blkcache_read(gpart, acpi_info->partition_start, sizeof(header),
+			    &header);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read the ACPI image header");
+		return ret;
 	}
 
+	entry_size = bswap_32(header.dt_entry_size);
+	entry_offset = bswap_32(header.dt_entries_offset);
+	entry_count = bswap_32(header.dt_entry_count);
+	if (entry_size < sizeof(*entries) || !entry_count ||
+	    entry_count > acpi_info->img_size / entry_size ||
+	    entry_offset > acpi_info->img_size - entry_count * entry_size) {
+		error(L"Invalid ACPI image table of entries");
+		return EFI_COMPROMISED_DATA;
+	}
+
+	raw = AllocatePool(entry_count * entry_size);
+	if (!raw)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = blkcache_read(gpart, acpi_info->partition_start + entry_offset,
+			    entry_count * entry_size, raw);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read the ACPI image entries");
+		FreePool(raw);
+		return ret;
+	}
+
+	/* Pack the entries in case DT_ENTRY_SIZE has grown */
+	entries = (struct dt_table_entry *)raw;
+	for (i = 1; i < entry_count && entry_size != sizeof(*entries); i++)
+		memmove(&entries[i], raw + i * entry_size, sizeof(*entries));
+
+	*entries_p = entries;
+	*count_p = entry_count;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS acpi_image_read_table(struct async_io *aio,
+					struct ACPI_INFO *acpi_info,
+					struct dt_table_entry *entry,
+					struct acpi_image_table *table)
+{
+	EFI_STATUS ret;
+	UINT32 dt_size, dt_offset;
+
+	dt_size = bswap_32(entry->dt_size);
+	dt_offset = bswap_32(entry->dt_offset);
+	if (dt_size == 0 || dt_offset == 0)
+		return EFI_SUCCESS;
+
+	if (dt_size < sizeof(struct ACPI_DESC_HEADER) ||
+	    dt_offset > acpi_info->img_size ||
+	    dt_size > acpi_info->img_size - dt_offset)
+		return EFI_COMPROMISED_DATA;
+
+	table->data = AllocatePool(dt_size);
+	if (!table->data)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = async_io_read(aio, acpi_info->partition_start + dt_offset,
+			    dt_size, table->data, &table->id);
+	if (EFI_ERROR(ret)) {
+		FreePool(table->data);
+		table->data = NULL;
+		return ret;
+	}
+
+	table->size = dt_size;
 	return EFI_SUCCESS;
 }
 
+/* Only read the image header, the table of entries and then the
+ * tables themselves.  The tables reads are kept in flight while the
+ * previous tables are checked and installed.
+ */
+static EFI_STATUS acpi_image_install_from_partition(const CHAR16 *label,
+						    int is_acpio)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gpart;
+	struct ACPI_INFO *acpi_info;
+	struct dt_table_entry *entries = NULL;
+	struct acpi_image_table *tables = NULL;
+	struct async_io *aio = NULL;
+	UINT32 count = 0, i, next;
+
+	ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Partition %s not found", label);
+		return ret;
+	}
+
+	ret = acpi_image_get_length(label, &acpi_info);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Partition %s can't get size", label);
+		return ret;
+	}
+
+	ret = acpi_image_read_entries(&gpart, acpi_info, &entries, &count);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	tables = AllocateZeroPool(count * sizeof(*tables));
+	if (!tables) {
+		ret = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	ret = async_io_open(&gpart, &aio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open %s for reading", label);
+		goto out;
+	}
+
+	debug(L"Reading %d tables from %s image", count, label);
+	for (i = 0, next = 0; i < count; i++) {
+		for (; next < count && next < i + ASYNC_IO_MAX_REQUESTS; next++) {
+			ret = acpi_image_read_table(aio, acpi_info, &entries[next],
+						    &tables[next]);
+			if (EFI_ERROR(ret))
+				efi_perror(ret, L"Warning: acpi_table %d read failed",
+					   next);
+		}
+
+		if (!tables[i].data)
+			continue;
+
+		ret = async_io_wait(aio, tables[i].id);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Warning: acpi_table %d read failed", i);
+		else if (acpi_image_install_table(tables[i].data,
+						  tables[i].size, i, is_acpio,
+						  TRUE))
+			tables[i].data = NULL;
+		if (tables[i].data)
+			FreePool(tables[i].data);
+		tables[i].data = NULL;
+	}
+	ret = EFI_SUCCESS;
+
+out:
+	if (aio)
+		async_io_close(aio);
+	if (tables) {
+		for (i = 0; i < count; i++)
+			if (tables[i].data)
+				FreePool(tables[i].data);
+		FreePool(tables);
+	}
+	if (entries)
+		FreePool(entries);
+	FreePool(acpi_info);
+	return ret;
+}
+
 static EFI_STATUS install_acpi_image_from_partition(int is_acpio)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
+	EFI_STATUS ret;
 	const CHAR16 *acpi_label;
 
 	if (is_acpio)
@@ -374,21 +636,10 @@ static EFI_STATUS install_acpi_image_from_partition(int is_acpio)
 	else
 		acpi_label = slot_label(ACPI_LABEL);
 
-	VOID *acpiimage = NULL;
-
-	ret = acpi_image_load_partition(acpi_label, &acpiimage);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to load image from %s partition",
-			   acpi_label);
-		return ret;
-	}
-	ret = acpi_image_parse_table(acpiimage, is_acpio);
-	if (EFI_ERROR(ret)) {
+	ret = acpi_image_install_from_partition(acpi_label, is_acpio);
+	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to install acpi table from %s image",
 			   acpi_label);
-		return ret;
-	}
-	FreePool(acpiimage);
 
 	return ret;
 }
@@ -14,17 +14,248 @@
  * limitations under the License.
  */
 #include <aes_gcm.h>
+#include <immintrin.h>
 #include "log.h"
+#include "endian.h"
+#include "aesni.h"
 
-static void dump(UINT8 *p, int size)
+/* Every processor implementing AES-NI and PCLMULQDQ also implements
+   SSSE3, used to byte-reflect the GHASH operands.  */
+#define TARGET_GCM	__attribute__((target("aes,pclmul,sse2,ssse3")))
+
+/* Counter blocks encrypted per pass, and number of powers of H used
+   to aggregate the GHASH multiplications.  */
+#define GCM_BATCH_BLOCKS	64
+#define GHASH_POWERS		4
+
+struct ghash {
+	__m128i h[GHASH_POWERS];	/* H^1 to H^4, byte-reflected */
+	__m128i x;
+};
+
+static BOOLEAN force_software;
+
+void aes_gcm_force_software(BOOLEAN force)
+{
+	force_software = force;
+}
+
+static BOOLEAN use_aesni(void)
+{
+	return !force_software && aesni_is_supported() &&
+		aesni_pclmul_is_supported();
+}
+
+static inline TARGET_GCM __m128i bswap128(__m128i x)
+{
+	return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8,
+						9, 10, 11, 12, 13, 14, 15));
+}
+
+/* Carry-less multiplication of two byte-reflected elements of
+   GF(2^128), accumulated into the 256-bit LO:HI product.  The
+   reduction is deferred so that several products can share it, see
+   the Intel "Carry-Less Multiplication and Its Usage for Computing the
+   GCM Mode" white paper.  */
+static inline TARGET_GCM void gf_mul_acc(__m128i a, __m128i b,
+					 __m128i *lo, __m128i *hi)
+{
+	__m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10),
+				    _mm_clmulepi64_si128(a, b, 0x01));
+
+	*lo = _mm_xor_si128(*lo, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00),
+					       _mm_slli_si128(mid, 8)));
+	*hi = _mm_xor_si128(*hi, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11),
+					       _mm_srli_si128(mid, 8)));
+}
+
+/* Reduce LO:HI modulo x^128 + x^7 + x^2 + x + 1 */
+static inline TARGET_GCM __m128i gf_reduce(__m128i lo, __m128i hi)
 {
-	int i;
+	__m128i t1, t2, t3;
 
-	(VOID)p;
+	/* Shift the 256-bit product left by one bit */
+	t1 = _mm_srli_epi32(lo, 31);
+	t2 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t3 = _mm_srli_si128(t1, 12);
+	t2 = _mm_slli_si128(t2, 4);
+	t1 = _mm_slli_si128(t1, 4);
+	lo = _mm_or_si128(lo, t1);
+	hi = _mm_or_si128(hi, t2);
+	hi = _mm_or_si128(hi, t3);
 
-	for(i=0; i<size; i++)
-		debug(L"%02x ", p[i]);
+	t1 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31),
+					 _mm_slli_epi32(lo, 30)),
+			   _mm_slli_epi32(lo, 25));
+	t2 = _mm_srli_si128(t1, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(t1, 12));
+	t1 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1),
+					 _mm_srli_epi32(lo, 2)),
+			   _mm_srli_epi32(lo, 7));
+	t1 = _mm_xor_si128(t1, t2);
+	lo = _mm_xor_si128(lo, t1);
+
+	return _mm_xor_si128(hi, lo);
+}
+
+static TARGET_GCM __m128i gf_mul(__m128i a, __m128i b)
+{
+	__m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+	gf_mul_acc(a, b, &lo, &hi);
+	return gf_reduce(lo, hi);
+}
+
+static TARGET_GCM void ghash_init(struct ghash *g, const UINT8 h[AESNI_BLOCK_SIZE])
+{
+	UINTN i;
+
+	g->h[0] = bswap128(_mm_loadu_si128((const __m128i *)h));
+	for (i = 1; i < GHASH_POWERS; i++)
+		g->h[i] = gf_mul(g->h[i - 1], g->h[0]);
+	g->x = _mm_setzero_si128();
 }
+
+/* Hash SIZE bytes of DATA, the last partial block being zero-padded.
+   All the calls but the last one of a sequence must therefore be
+   given a multiple of the block size.  */
+static TARGET_GCM void ghash_update(struct ghash *g, const UINT8 *data, size_t size)
+{
+	UINT8 last[AESNI_BLOCK_SIZE];
+	__m128i x = g->x, b[GHASH_POWERS], lo, hi;
+	UINTN i;
+
+	/* X = (X + B0).H^4 + B1.H^3 + B2.H^2 + B3.H with one reduction */
+	for (; size >= sizeof(b); data += sizeof(b), size -= sizeof(b)) {
+		for (i = 0; i < GHASH_POWERS; i++)
+			b[i] = bswap128(_mm_loadu_si128((const __m128i *)data + i));
+		b[0] = _mm_xor_si128(b[0], x);
+		lo = hi = _mm_setzero_si128();
+		for (i = 0; i < GHASH_POWERS; i++)
+			gf_mul_acc(b[i], g->h[GHASH_POWERS - 1 - i], &lo, &hi);
+		x = gf_reduce(lo, hi);
+	}
+
+	for (; size >= sizeof(last); data += sizeof(last), size -= sizeof(last))
+		x = gf_mul(_mm_xor_si128(x, bswap128(_mm_loadu_si128((const __m128i *)data))),
+			   g->h[0]);
+
+	if (size) {
+		memset(last, 0, sizeof(last));
+		memcpy(last, data, size);
+		x = gf_mul(_mm_xor_si128(x, bswap128(_mm_loadu_si128((const __m128i *)last))),
+			   g->h[0]);
+	}
+
+	g->x = x;
+}
+
+/* Hash the lengths block and store the GHASH value in OUT */
+static TARGET_GCM void ghash_final(struct ghash *g, UINT64 aad_size,
+				   UINT64 data_size, UINT8 out[AESNI_BLOCK_SIZE])
+{
+	__m128i len = _mm_set_epi64x(aad_size * 8, data_size * 8);
+
+	g->x = gf_mul(_mm_xor_si128(g->x, len), g->h[0]);
+	_mm_storeu_si128((__m128i *)out, bswap128(g->x));
+}
+
+/* Encrypt or decrypt SIZE bytes of IN into OUT with the inc32 counter
+   blocks following J0, and hash the ciphertext.  */
+static TARGET_GCM void gcm_crypt(const struct aesni_256_key *k, struct ghash *g,
+				 const UINT8 j0[AESNI_BLOCK_SIZE],
+				 const UINT8 *in, UINT8 *out, size_t size,
+				 BOOLEAN encrypt)
+{
+	UINT8 ks[GCM_BATCH_BLOCKS * AESNI_BLOCK_SIZE];
+	UINT32 ctr = be32toh(*(UINT32 *)(j0 + 12));
+	size_t len, i;
+	UINTN nb, b;
+
+	for (; size; in += len, out += len, size -= len) {
+		len = min(size, sizeof(ks));
+		nb = (len + AESNI_BLOCK_SIZE - 1) / AESNI_BLOCK_SIZE;
+		for (b = 0; b < nb; b++) {
+			memcpy(ks + b * AESNI_BLOCK_SIZE, j0, 12);
+			*(UINT32 *)(ks + b * AESNI_BLOCK_SIZE + 12) = htobe32(++ctr);
+		}
+		aesni_256_encrypt(k, ks, ks, nb);
+
+		if (!encrypt)
+			ghash_update(g, in, len);
+		for (i = 0; i + AESNI_BLOCK_SIZE <= len; i += AESNI_BLOCK_SIZE)
+			_mm_storeu_si128((__m128i *)(out + i),
+					 _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)),
+						       _mm_loadu_si128((const __m128i *)(ks + i))));
+		for (; i < len; i++)
+			out[i] = in[i] ^ ks[i];
+		if (encrypt)
+			ghash_update(g, out, len);
+	}
+
+	memset(ks, 0, sizeof(ks));
+}
+
+/* AES-NI and PCLMULQDQ implementation of AES-256-GCM, producing the
+   same output as the OpenSSL one.  TAG is written on encryption and
+   checked on decryption.  */
+static int aes_256_gcm_aesni(const struct gcm_key *key,
+			     const void *iv, size_t iv_size,
+			     const void *aad, size_t aad_size,
+			     const void *in, size_t size, void *out,
+			     UINT8 tag[GCM_TAG_SIZE], BOOLEAN encrypt)
+{
+	struct aesni_256_key k;
+	struct ghash g;
+	UINT8 h[AESNI_BLOCK_SIZE], j0[AESNI_BLOCK_SIZE], s[AESNI_BLOCK_SIZE];
+	UINT8 diff = 0;
+	UINTN i;
+
+	if (!aad)
+		aad_size = 0;
+
+	aesni_256_set_key(key->byte, &k);
+	memset(h, 0, sizeof(h));
+	aesni_256_encrypt(&k, h, h, 1);
+
+	if (iv_size == GCM_IV_SIZE) {
+		memcpy(j0, iv, GCM_IV_SIZE);
+		*(UINT32 *)(j0 + 12) = htobe32(1);
+	} else {
+		ghash_init(&g, h);
+		ghash_update(&g, iv, iv_size);
+		ghash_final(&g, 0, iv_size, j0);
+	}
+
+	ghash_init(&g, h);
+	ghash_update(&g, aad, aad_size);
+	gcm_crypt(&k, &g, j0, in, out, size, encrypt);
+	ghash_final(&g, aad_size, size, s);
+
+	aesni_256_encrypt(&k, j0, j0, 1);
+	for (i = 0; i < GCM_TAG_SIZE; i++)
+		s[i] ^= j0[i];
+
+	if (encrypt)
+		memcpy(tag, s, GCM_TAG_SIZE);
+	else
+		for (i = 0; i < GCM_TAG_SIZE; i++)
+			diff |= s[i] ^ tag[i];
+
+	memset(&k, 0, sizeof(k));
+	memset(&g, 0, sizeof(g));
+
+	if (diff) {
+		memset(out, 0, size);
+		error(L"fail to check TAG.\n");
+		return AES_GCM_ERR_AUTH_FAILED;
+	}
+
+	return AES_GCM_NO_ERROR;
+}
+
 /**
  * aes_256_gcm_encrypt - Helper function for encrypt.
  * @key:          Key object.
@@ -56,6 +287,15 @@ int aes_256_gcm_encrypt(const struct gcm_key *key,
 		return AES_GCM_ERR_GENERIC;
 	}
 
+	if (use_aesni()) {
+		rc = aes_256_gcm_aesni(key, iv, iv_size, aad, aad_size,
+				       plain, plain_size, out,
+				       (UINT8 *)out + plain_size, TRUE);
+		if (rc == AES_GCM_NO_ERROR)
+			*out_size = plain_size + sizeof(struct gcm_tag);
+		return rc;
+	}
+
 	/*creat cipher ctx*/
 	ctx = EVP_CIPHER_CTX_new();
 	if (ctx == NULL) {
@@ -98,8 +338,6 @@ int aes_256_gcm_encrypt(const struct gcm_key *key,
 	}
         out_len += fin_len;
         debug(L"cipher_len final is %08x\n", out_len);
-	debug(L"cipher text is as follows:\n");
-	dump(out, out_len);
 	tag = out + out_len;
 	/*get TAG*/
 	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, sizeof(struct gcm_tag), tag)) {
@@ -111,8 +349,6 @@ int aes_256_gcm_encrypt(const struct gcm_key *key,
 	out_len += sizeof(struct gcm_tag);
 	*out_size = out_len;
 
-	debug(L"tag text is as follows:\n");
-        dump(tag, sizeof(struct gcm_tag));
 	rc = AES_GCM_NO_ERROR;
 
 exit:
@@ -148,11 +384,22 @@ int aes_256_gcm_decrypt(const struct gcm_key *key,
 	UINT8 *tag;
 
 	if ((key == NULL) || (iv == NULL) || (iv_size == 0) ||
-		(cipher == NULL) || (out == NULL) || (out_size == NULL)) {
+		(cipher == NULL) || (out == NULL) || (out_size == NULL) ||
+		(cipher_size < sizeof(struct gcm_tag))) {
 		error(L"invalid args!\n");
 		return AES_GCM_ERR_GENERIC;
 	}
 
+	if (use_aesni()) {
+		rc = aes_256_gcm_aesni(key, iv, iv_size, aad, aad_size, cipher,
+				       cipher_size - sizeof(struct gcm_tag), out,
+				       (UINT8 *)cipher + cipher_size -
+				       sizeof(struct gcm_tag), FALSE);
+		if (rc == AES_GCM_NO_ERROR)
+			*out_size = cipher_size - sizeof(struct gcm_tag);
+		return rc;
+	}
+
 	/*creat cipher ctx*/
 	ctx = EVP_CIPHER_CTX_new();
 	if (ctx == NULL) {
@@ -188,8 +435,6 @@ int aes_256_gcm_decrypt(const struct gcm_key *key,
 		goto exit;
 	}
 
-	debug(L"decrypt partial output:\n");
-	dump((UINT8 *)out, out_len);
 	tag = (UINT8 *)cipher + data_len;
 	/*set TAG*/
 	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, sizeof(struct gcm_tag), tag)) {
@@ -205,8 +450,6 @@ int aes_256_gcm_decrypt(const struct gcm_key *key,
 	}
 
 	out_len += data_len;
-	debug(L"decrypt final output:\n");
-	dump((UINT8 *)out, out_len);
 
 	*out_size = out_len;
 
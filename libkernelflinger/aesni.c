@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <immintrin.h>
+
+#include "lib.h"
+#include "aesni.h"
+
+#define TARGET_AES	__attribute__((target("aes,sse2")))
+
+/* Blocks encrypted per pass to keep the AES units busy */
+#define AESNI_LANES	4
+
+static struct {
+	BOOLEAN probed;
+	BOOLEAN aes;
+	BOOLEAN pclmul;
+} cpu;
+
+static void cpu_probe(void)
+{
+	UINT32 reg[4];
+
+	if (cpu.probed)
+		return;
+	cpu.probed = TRUE;
+
+	cpuid(1, reg);
+	cpu.pclmul = !!(reg[2] & (1 << 1));
+	cpu.aes = !!(reg[2] & (1 << 25));
+}
+
+BOOLEAN aesni_is_supported(void)
+{
+	cpu_probe();
+	return cpu.aes;
+}
+
+BOOLEAN aesni_pclmul_is_supported(void)
+{
+	cpu_probe();
+	return cpu.pclmul;
+}
+
+/* AES-256 key expansion, see the Intel AES-NI white paper */
+static TARGET_AES __m128i expand_even(__m128i key, __m128i assist)
+{
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+static TARGET_AES __m128i expand_odd(__m128i key, __m128i prev)
+{
+	__m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0),
+					   0xaa);
+
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+#define EXPAND_PAIR(rk, i, rcon)					\
+	do {								\
+		rk[i] = expand_even(rk[i - 2],				\
+				    _mm_aeskeygenassist_si128(rk[i - 1], rcon)); \
+		rk[i + 1] = expand_odd(rk[i - 1], rk[i]);		\
+	} while (0)
+
+TARGET_AES void aesni_256_set_key(const UINT8 key[AESNI_256_KEY_SIZE],
+				  struct aesni_256_key *k)
+{
+	__m128i *rk = (__m128i *)k->rk;
+
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	rk[1] = _mm_loadu_si128((const __m128i *)(key + AESNI_BLOCK_SIZE));
+	EXPAND_PAIR(rk, 2, 0x01);
+	EXPAND_PAIR(rk, 4, 0x02);
+	EXPAND_PAIR(rk, 6, 0x04);
+	EXPAND_PAIR(rk, 8, 0x08);
+	EXPAND_PAIR(rk, 10, 0x10);
+	EXPAND_PAIR(rk, 12, 0x20);
+	rk[14] = expand_even(rk[12], _mm_aeskeygenassist_si128(rk[13], 0x40));
+}
+
+TARGET_AES void aesni_256_encrypt(const struct aesni_256_key *k,
+				  const UINT8 *in, UINT8 *out, UINTN nb)
+{
+	const __m128i *rk = (const __m128i *)k->rk;
+	__m128i b[AESNI_LANES];
+	UINTN i, j, r, lanes;
+
+	for (i = 0; i < nb; i += lanes) {
+		lanes = min(nb - i, (UINTN)AESNI_LANES);
+		for (j = 0; j < lanes; j++)
+			b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)
+							     (in + (i + j) * AESNI_BLOCK_SIZE)),
+					     rk[0]);
+		for (r = 1; r < AESNI_256_ROUNDS; r++)
+			for (j = 0; j < lanes; j++)
+				b[j] = _mm_aesenc_si128(b[j], rk[r]);
+		for (j = 0; j < lanes; j++)
+			_mm_storeu_si128((__m128i *)(out + (i + j) * AESNI_BLOCK_SIZE),
+					 _mm_aesenclast_si128(b[j], rk[AESNI_256_ROUNDS]));
+	}
+}
@@ -52,11 +52,24 @@
 #include "slot.h"
 #include "pae.h"
 #include "timer.h"
+#include "mp_pool.h"
+#include "boottrace.h"
+#include "boot_harness.h"
+#include "prefetch.h"
+#include "async_io.h"
+#include "blkcache.h"
+#include "misc.h"
+#include "memtrack.h"
+#include "memmap.h"
+#include "random.h"
 #include "android_vb.h"
 #ifdef RPMB_STORAGE
 #include "rpmb_storage.h"
 #endif
 #include "acpi.h"
+#ifdef RAMDISK_PREDECOMPRESS
+#include "lz4.h"
+#endif
 #ifdef USE_FIRSTSTAGE_MOUNT
 #include "firststage_mount.h"
 #endif
@@ -308,6 +321,25 @@ static EFI_STATUS setup_gdt(void)
         return EFI_SUCCESS;
 }
 
+/* E820 type of each UEFI memory type, E820_UNDEFINED entries are
+ * skipped.  */
+static const UINT8 e820_types[] = {
+        [EfiReservedMemoryType] = E820_RESERVED,
+        [EfiLoaderCode] = E820_RAM,
+        [EfiLoaderData] = E820_RAM,
+        [EfiBootServicesCode] = E820_RAM,
+        [EfiBootServicesData] = E820_RAM,
+        [EfiRuntimeServicesCode] = E820_RESERVED,
+        [EfiRuntimeServicesData] = E820_RESERVED,
+        [EfiConventionalMemory] = E820_RAM,
+        [EfiUnusableMemory] = E820_UNUSABLE,
+        [EfiACPIReclaimMemory] = E820_ACPI,
+        [EfiACPIMemoryNVS] = E820_NVS,
+        [EfiMemoryMappedIO] = E820_RESERVED,
+        [EfiMemoryMappedIOPortSpace] = E820_RESERVED,
+        [EfiPalCode] = E820_RESERVED
+};
+
 /* WARNING: Do not make any call that might change the memory mapping
  * (allocation, print, ...) in this function.  */
 static void setup_e820_map(struct boot_params *boot_params,
@@ -316,93 +348,92 @@ static void setup_e820_map(struct boot_params *boot_params,
                            UINTN entry_sz)
 {
         struct e820_entry *e820_map = boot_params->e820_map;
+        struct e820_entry *last = NULL;
+        UINT8 *d = (UINT8 *)mem_entries;
         UINTN i, n_page = 0;
 
-        for (i = 0; i < nr_entries; i++) {
-                EFI_MEMORY_DESCRIPTOR *d;
-                unsigned int cur_type = 0;
-
-                d = (EFI_MEMORY_DESCRIPTOR *)((unsigned long)mem_entries + (i * entry_sz));
-                switch (d->Type) {
-                case EfiReservedMemoryType:
-                case EfiRuntimeServicesCode:
-                case EfiRuntimeServicesData:
-                case EfiMemoryMappedIO:
-                case EfiMemoryMappedIOPortSpace:
-                case EfiPalCode:
-                        cur_type = E820_RESERVED;
-                        break;
-
-                case EfiUnusableMemory:
-                        cur_type = E820_UNUSABLE;
-                        break;
-
-                case EfiACPIReclaimMemory:
-                        cur_type = E820_ACPI;
-                        break;
-
-                case EfiLoaderCode:
-                case EfiLoaderData:
-                case EfiBootServicesCode:
-                case EfiBootServicesData:
-                case EfiConventionalMemory:
-                        cur_type = E820_RAM;
-                        break;
+        for (i = 0; i < nr_entries; i++, d += entry_sz) {
+                EFI_MEMORY_DESCRIPTOR *entry = (EFI_MEMORY_DESCRIPTOR *)d;
+                UINT64 size = entry->NumberOfPages << EFI_PAGE_SHIFT;
+                UINT32 cur_type;
 
-                case EfiACPIMemoryNVS:
-                        cur_type = E820_NVS;
-                        break;
-
-                default:
+                if (entry->Type >= ARRAY_SIZE(e820_types))
+                        continue;
+                cur_type = e820_types[entry->Type];
+                if (cur_type == E820_UNDEFINED)
                         continue;
-                }
 
-                if (n_page &&
-                    e820_map[n_page - 1].type == cur_type &&
-                    (e820_map[n_page - 1].addr + e820_map[n_page - 1].size) == d->PhysicalStart) {
-                        e820_map[n_page - 1].size += d->NumberOfPages << EFI_PAGE_SHIFT;
+                if (last && last->type == cur_type &&
+                    last->addr + last->size == entry->PhysicalStart) {
+                        last->size += size;
                         continue;
                 }
 
-                e820_map[n_page].addr = d->PhysicalStart;
-                e820_map[n_page].size = d->NumberOfPages << EFI_PAGE_SHIFT;
-                e820_map[n_page].type = cur_type;
-                n_page++;
+                if (n_page == ARRAY_SIZE(boot_params->e820_map))
+                        break;
+
+                last = &e820_map[n_page++];
+                last->addr = entry->PhysicalStart;
+                last->size = size;
+                last->type = cur_type;
         }
 
         boot_params->e820_entries = n_page;
 }
 
+/* Room for the descriptors the firmware adds to the memory map
+ * between the handover memory map buffer allocation and
+ * ExitBootServices().  */
+#define HANDOVER_MEMMAP_SLACK   16
+#define EXIT_BS_MAX_ATTEMPTS    4
+
+/* The memory map handed over to the kernel.  It is allocated once,
+ * before the first GetMemoryMap() call: after a failed
+ * ExitBootServices() call, the boot services other than
+ * GetMemoryMap() must not be used.  */
+static EFI_STATUS alloc_handover_memmap(EFI_MEMORY_DESCRIPTOR **mem_entries,
+                                        UINTN *size)
+{
+        EFI_STATUS ret;
+        UINTN key, entry_sz = sizeof(EFI_MEMORY_DESCRIPTOR);
+        UINT32 entry_ver;
+
+        *size = 0;
+        ret = uefi_call_wrapper(BS->GetMemoryMap, 5, size, NULL,
+                                &key, &entry_sz, &entry_ver);
+        if (ret != EFI_BUFFER_TOO_SMALL)
+                return EFI_ERROR(ret) ? ret : EFI_LOAD_ERROR;
+
+        *size += HANDOVER_MEMMAP_SLACK * entry_sz;
+        *mem_entries = AllocatePool(*size);
+        if (!*mem_entries)
+                return EFI_OUT_OF_RESOURCES;
+
+        return EFI_SUCCESS;
+}
+
 /* WARNING: Do not make any call that might change the memory mapping
  * (allocation, print, ...) in this function.  */
-static EFI_STATUS setup_memory_map(struct boot_params *boot_params, UINTN *key)
+static EFI_STATUS setup_memory_map(struct boot_params *boot_params,
+                                   EFI_MEMORY_DESCRIPTOR *mem_entries,
+                                   UINTN size, UINTN *key)
 {
-        UINTN nr_entries, entry_sz;
-        EFI_MEMORY_DESCRIPTOR *mem_entries;
+        EFI_STATUS ret;
+        UINTN entry_sz;
         UINT32 entry_ver;
         struct efi_info *efi = &boot_params->efi_info;
 
-        /* This function can be called several times. The previous
-         * memory map buffer must be freed. */
-        if (efi->efi_memmap) {
-                UINTN prev_memmap = efi->efi_memmap;
-#ifdef  __LP64__
-                prev_memmap = prev_memmap |
-                        (EFI_PHYSICAL_ADDRESS)efi->efi_memmap_hi << 32;
-#endif
-                FreePool((VOID *)prev_memmap);
-        }
-
-        mem_entries = LibMemoryMap(&nr_entries, key, &entry_sz, &entry_ver);
-        if (!mem_entries)
-                return EFI_OUT_OF_RESOURCES;
+        ret = uefi_call_wrapper(BS->GetMemoryMap, 5, &size, mem_entries,
+                                key, &entry_sz, &entry_ver);
+        if (EFI_ERROR(ret))
+                return ret;
 
         if (is_UEFI()) {
                 efi->efi_systab = (UINT32)(UINTN)ST;
                 efi->efi_memdesc_size = entry_sz;
                 efi->efi_memdesc_version = entry_ver;
                 efi->efi_memmap = (UINT32)(UINTN)mem_entries;
-                efi->efi_memmap_size = entry_sz * nr_entries;
+                efi->efi_memmap_size = size;
 #ifdef  __LP64__
                 efi->efi_systab_hi = (EFI_PHYSICAL_ADDRESS)ST >> 32;
                 efi->efi_memmap_hi = (EFI_PHYSICAL_ADDRESS)mem_entries >> 32;
@@ -412,9 +443,7 @@ static EFI_STATUS setup_memory_map(struct boot_params *boot_params, UINTN *key)
                        EFI_LOADER_SIGNATURE, sizeof(efi->efi_loader_signature));
         }
 
-        setup_e820_map(boot_params, mem_entries, nr_entries, entry_sz);
-        if (!is_UEFI())
-                FreePool(mem_entries);
+        setup_e820_map(boot_params, mem_entries, size / entry_sz, entry_sz);
 
         return EFI_SUCCESS;
 }
@@ -424,12 +453,14 @@ static inline EFI_STATUS handover_jump(EFI_HANDLE image,
                                        EFI_PHYSICAL_ADDRESS kernel_start)
 {
         EFI_STATUS ret = EFI_LOAD_ERROR;
-        UINTN map_key, i;
+        EFI_MEMORY_DESCRIPTOR *mem_entries;
+        UINTN map_key, memmap_sz, i;
 
 #ifdef RPMB_STORAGE
         clear_rpmb_key();
 #endif
         log(L"handover jump ...\n");
+        log_flush();
 
         ret = setup_gdt();
         if (EFI_ERROR(ret)) {
@@ -437,19 +468,27 @@ static inline EFI_STATUS handover_jump(EFI_HANDLE image,
                 return ret;
         }
 
+        ret = alloc_handover_memmap(&mem_entries, &memmap_sz);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to allocate the memory map");
+                return ret;
+        }
+
         /* According to UEFI specification 2.4 Chapter 6.4
          * EFI_BOOT_SERVICES.ExitBootServices(), Firmware
          * implementation may choose to do a partial shutdown of the
-         * boot services during the first call to ExitBootServices().
-         * Hence, we give two chances to ExitBootServices() to
-         * succeed.
+         * boot services during the first call to ExitBootServices()
+         * and the memory map can change in between.  Hence, we give
+         * several chances to ExitBootServices() to succeed.  Nothing
+         * in this loop allocates memory, a retry only pays for a
+         * GetMemoryMap() call and the e820 table.
          */
-        for (i = 0; i < 2; i++) {
-                ret = setup_memory_map(boot_params, &map_key);
-                if (EFI_ERROR(ret)) {
-                        efi_perror(ret, L"Failed to setup memory map");
-                        return ret;
-                }
+        boottrace_begin(BT_EXIT_BS, 0);
+        for (i = 0; i < EXIT_BS_MAX_ATTEMPTS; i++) {
+                ret = setup_memory_map(boot_params, mem_entries,
+                                       memmap_sz, &map_key);
+                if (EFI_ERROR(ret))
+                        break;
 
                 /* Do not add extra code between setup_memory_map() call and
                  * ExitBootServices() call or memory_map key might mismatch
@@ -461,9 +500,17 @@ static inline EFI_STATUS handover_jump(EFI_HANDLE image,
                         goto boot;
         }
 
+        boottrace_end(BT_EXIT_BS, i);
+        /* After a failed ExitBootServices() call, the other boot
+         * services must not be used.  */
+        if (i == 0) {
+                efi_perror(ret, L"Failed to setup memory map");
+                FreePool(mem_entries);
+        }
         return ret;
 
 boot:
+        boottrace_end(BT_EXIT_BS, i + 1);
 
 #if __LP64__
         /* The 64-bit kernel entry is 512 bytes after the start. */
@@ -525,7 +572,53 @@ struct boot_img_hdr *get_bootimage_header(VOID *bootimage_blob)
 }
 
 
-static EFI_STATUS setup_ramdisk(UINT8 *bootimage)
+#ifdef RAMDISK_PREDECOMPRESS
+/* The kernel decompresses a LZ4 legacy ramdisk on a single CPU.  Its
+   independent blocks are rather decompressed here in parallel on the
+   Application Processors, in place of the ramdisk copy, and the
+   kernel gets the uncompressed cpio archive.  */
+static EFI_STATUS predecompress_ramdisk(struct boot_params *bp,
+                                        UINT8 *ramdisk, UINT32 rsize)
+{
+        EFI_PHYSICAL_ADDRESS addr;
+        UINTN count, pages, used, len;
+        EFI_STATUS ret;
+
+        ret = lz4_legacy_block_count(ramdisk, rsize, &count);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        if (count * LZ4_LEGACY_BLOCK_SIZE > bp->hdr.ramdisk_max)
+                return EFI_BUFFER_TOO_SMALL;
+
+        pages = EFI_SIZE_TO_PAGES(count * LZ4_LEGACY_BLOCK_SIZE);
+        addr = bp->hdr.ramdisk_max;
+        ret = allocate_pages(AllocateMaxAddress, EfiLoaderData, pages, &addr);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        ret = lz4_legacy_decompress(ramdisk, rsize, (VOID *)(UINTN)addr,
+                                    EFI_PAGES_TO_SIZE(pages), &len);
+        if (EFI_ERROR(ret)) {
+                free_pages(addr, pages);
+                return ret;
+        }
+
+        /* The ramdisk is released with its final length */
+        used = EFI_SIZE_TO_PAGES(len);
+        if (used < pages)
+                free_pages(addr + EFI_PAGES_TO_SIZE(used), pages - used);
+
+        debug(L"ramdisk decompressed from %d to %d bytes", rsize, len);
+        bp->hdr.ramdisk_start = (UINT32)(UINTN)addr;
+        bp->hdr.ramdisk_len = len;
+        return EFI_SUCCESS;
+}
+#endif
+
+/* *IN_PLACE is set to TRUE if the ramdisk is handed over to the
+   kernel where it is in BOOTIMAGE rather than copied.  */
+static EFI_STATUS setup_ramdisk(UINT8 *bootimage, BOOLEAN *in_place)
 {
         struct boot_img_hdr *aosp_header;
         struct boot_params *bp;
@@ -533,6 +626,8 @@ static EFI_STATUS setup_ramdisk(UINT8 *bootimage)
         EFI_PHYSICAL_ADDRESS ramdisk_addr;
         EFI_STATUS ret;
 
+        *in_place = FALSE;
+
         aosp_header = (struct boot_img_hdr *)bootimage;
         bp = (struct boot_params *)(bootimage + aosp_header->page_size);
 
@@ -546,14 +641,36 @@ static EFI_STATUS setup_ramdisk(UINT8 *bootimage)
 
         bp->hdr.ramdisk_len = rsize;
         debug(L"ramdisk size %d", rsize);
-        ret = emalloc(rsize, 0x1000, &ramdisk_addr, FALSE);
-        if (EFI_ERROR(ret))
-                return ret;
 
-        if ((UINTN)ramdisk_addr > bp->hdr.ramdisk_max) {
-                error(L"Ramdisk address is too high!");
-                efree(ramdisk_addr, rsize);
-                return EFI_OUT_OF_RESOURCES;
+#ifdef RAMDISK_PREDECOMPRESS
+        if (is_lz4_legacy(bootimage + roffset, rsize)) {
+                ret = predecompress_ramdisk(bp, bootimage + roffset, rsize);
+                if (!EFI_ERROR(ret))
+                        return EFI_SUCCESS;
+                efi_perror(ret, L"Failed to decompress the ramdisk, handing the compressed ramdisk to the kernel");
+        }
+#endif
+
+        /* See place_bootimage() */
+        ramdisk_addr = (UINTN)(bootimage + roffset);
+        if (ramdisk_addr % EFI_PAGE_SIZE == 0 &&
+            ramdisk_addr + rsize - 1 <= bp->hdr.ramdisk_max) {
+                debug(L"ramdisk used in place");
+                bp->hdr.ramdisk_start = (UINT32)ramdisk_addr;
+                *in_place = TRUE;
+                return EFI_SUCCESS;
+        }
+
+        /* Let the firmware pick any free range below initrd_addr_max
+           rather than taking the lowest one and failing later if it
+           is too high.  */
+        ramdisk_addr = bp->hdr.ramdisk_max;
+        ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
+                             EFI_SIZE_TO_PAGES(rsize), &ramdisk_addr);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to allocate the ramdisk below 0x%x",
+                           bp->hdr.ramdisk_max);
+                return ret;
         }
         memcpy((VOID *)(UINTN)ramdisk_addr, bootimage + roffset, rsize);
         bp->hdr.ramdisk_start = (UINT32)(UINTN)ramdisk_addr;
@@ -570,6 +687,7 @@ EFI_STATUS setup_acpi_table(VOID *bootimage,
         debug(L"Setup acpi table");
         aosp_header = (struct boot_img_hdr *)bootimage;
 
+        acpi_install_begin();
 #ifdef USE_ACPIO
         if (aosp_header->header_version >= 1) {
                 VOID *acpio;
@@ -577,6 +695,7 @@ EFI_STATUS setup_acpi_table(VOID *bootimage,
                 ret = install_acpi_table_from_recovery_acpio(acpio);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"Install from recovery_acpio failed");
+                        acpi_install_commit();
                         return ret;
                 }
         }
@@ -587,6 +706,7 @@ EFI_STATUS setup_acpi_table(VOID *bootimage,
                 efi_perror(ret, L"Install builtin early mount table failed");
         }
 #endif
+        acpi_install_commit();
         return ret;
 }
 
@@ -752,43 +872,22 @@ done:
         return bootreason;
 }
 
-EFI_STATUS prepend_command_line(CHAR16 **cmdline, CHAR16 *fmt, ...)
+/* Add the boot image command line, or its override, to CMDLINE.  It
+   is referenced in place: the boot image must not be released before
+   the command line has been built.  */
+static EFI_STATUS add_base_command_line(IN struct boot_img_hdr *aosp_header,
+                                        IN enum boot_target boot_target,
+                                        IN OUT cmdline_t *cmdline)
 {
-        CHAR16 *old;
-        va_list args;
-        CHAR16 *string;
-        CHAR16 *new;
-
-        old = *cmdline;
-        va_start(args, fmt);
-        string = VPoolPrint(fmt, args);
-        va_end(args);
-
-        if (!string)
-                return EFI_OUT_OF_RESOURCES;
-
-        new = PoolPrint(L"%s %s", string, old);
-        FreePool(string);
-        if (!new)
-                return EFI_OUT_OF_RESOURCES;
-
-        FreePool(old);
-        *cmdline = new;
-        return EFI_SUCCESS;
-}
-
-
-static CHAR16 *get_command_line(IN struct boot_img_hdr *aosp_header,
-                                IN enum boot_target boot_target)
-{
-        CHAR16 *cmdline16 = NULL;
+        CHAR16 *cmdline_replace = NULL;
+        EFI_STATUS ret;
 #ifndef USER
         CHAR16 *cmdline_append = NULL;
         CHAR16 *cmdline_prepend = NULL;
         BOOLEAN needs_pause = FALSE;
 
         if (boot_target == NORMAL_BOOT || boot_target == MEMORY) {
-                cmdline16 = get_efi_variable_str8(&loader_guid, CMDLINE_REPLACE_VAR);
+                cmdline_replace = get_efi_variable_str8(&loader_guid, CMDLINE_REPLACE_VAR);
                 cmdline_append = get_efi_variable_str8(&loader_guid, CMDLINE_APPEND_VAR);
                 cmdline_prepend = get_efi_variable_str8(&loader_guid, CMDLINE_PREPEND_VAR);
         }
@@ -796,67 +895,66 @@ static CHAR16 *get_command_line(IN struct boot_img_hdr *aosp_header,
         (void)boot_target; /* Get rid of a unused parameter warning */
 #endif
 
-        if (!cmdline16) {
-                CHAR8 full_cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE];
-                int offset = BOOT_ARGS_SIZE;
-
-                /* include the potential NUL terminal char */
-                memcpy(full_cmdline, aosp_header->cmdline, BOOT_ARGS_SIZE);
-                /* if there is extra cmdline arguments */
-                if (aosp_header->extra_cmdline[0]) {
-                        /* legacy boot.img format cmdline is NUL terminated */
-                        if (!aosp_header->cmdline[BOOT_ARGS_SIZE - 1])
-                                offset--;
-                        memcpy(full_cmdline + offset,
-                               aosp_header->extra_cmdline,
-                               BOOT_EXTRA_ARGS_SIZE);
-                }
+        if (!cmdline_replace) {
+                UINTN len;
 
-                cmdline16 = stra_to_str(full_cmdline);
+                len = strnlen((CHAR8 *)aosp_header->cmdline, BOOT_ARGS_SIZE);
+                /* The extra cmdline arguments only continue a
+                   command line filling the whole cmdline field */
+                if (aosp_header->extra_cmdline[0] && len >= BOOT_ARGS_SIZE - 1) {
+                        CHAR8 full_cmdline[BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE + 1];
 
-                if (!cmdline16)
-                        return NULL;
+                        memcpy(full_cmdline, aosp_header->cmdline, len);
+                        memcpy(full_cmdline + len, aosp_header->extra_cmdline,
+                               BOOT_EXTRA_ARGS_SIZE);
+                        full_cmdline[len + BOOT_EXTRA_ARGS_SIZE] = '\0';
+                        ret = cmdline_append(cmdline, L"%a", full_cmdline);
+                } else
+                        ret = cmdline_append_ref(cmdline, aosp_header->cmdline, len);
+                if (EFI_ERROR(ret))
+                        return ret;
 #ifndef USER
         } else {
-                error(L"Boot image command line overridden with '%s'", cmdline16);
+                error(L"Boot image command line overridden with '%s'", cmdline_replace);
                 needs_pause = TRUE;
+                ret = cmdline_append(cmdline, L"%s", cmdline_replace);
+                FreePool(cmdline_replace);
+                if (EFI_ERROR(ret)) {
+                        if (cmdline_append)
+                                FreePool(cmdline_append);
+                        if (cmdline_prepend)
+                                FreePool(cmdline_prepend);
+                        return ret;
+                }
 #endif
         }
 
 #ifndef USER
         if (cmdline_prepend) {
-                EFI_STATUS ret;
-
                 error(L"Prepending '%s' to command line", cmdline_prepend);
                 needs_pause = TRUE;
 
-                ret = prepend_command_line(&cmdline16, L"%s", cmdline_prepend);
+                ret = cmdline_prepend(cmdline, L"%s", cmdline_prepend);
                 FreePool(cmdline_prepend);
                 if (EFI_ERROR(ret))
                         error(L"couldn't prepend to command line");
         }
 
         if (cmdline_append) {
-                EFI_STATUS ret;
-
                 error(L"Appending '%s' to command line", cmdline_append);
                 needs_pause = TRUE;
 
-                ret = prepend_command_line(&cmdline_append, L"%s", cmdline16);
-                if (EFI_ERROR(ret)) {
-                        error(L"couldn't prepend to command line");
-                        FreePool(cmdline_append);
-                } else {
-                        FreePool(cmdline16);
-                        cmdline16 = cmdline_append;
-                }
+                ret = cmdline_append(cmdline, L"%s", cmdline_append);
+                FreePool(cmdline_append);
+                if (EFI_ERROR(ret))
+                        error(L"couldn't append to command line");
         }
 
         if (needs_pause)
                 pause(1);
 #endif
 
-        return cmdline16;
+        return EFI_SUCCESS;
 }
 
 EFI_STATUS get_bootimage_2nd(VOID *bootimage, VOID **second, UINT32 *size)
@@ -883,6 +981,10 @@ EFI_STATUS get_bootimage_2nd(VOID *bootimage, VOID **second, UINT32 *size)
 EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
                               UINT32 *blobsize)
 {
+        /* The device ID does not change once computed, its hash is
+           kept for the lookups of the other blob types */
+        static char *hashed_id;
+        static unsigned int id_hash;
         VOID *second;
         UINT32 second_size;
         struct blobstore *bs;
@@ -891,6 +993,10 @@ EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
 
         device_id = get_device_id();
         debug(L"Lookup blobstore data %a-%d", device_id, btype);
+        if (device_id != hashed_id) {
+                id_hash = blobstore_key_hash(device_id);
+                hashed_id = device_id;
+        }
 
         ret = get_bootimage_2nd(bootimage, &second, &second_size);
         if (EFI_ERROR(ret))
@@ -900,7 +1006,8 @@ EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
         if (!bs)
                 return EFI_UNSUPPORTED;
 
-        if (blobstore_get_item(bs, device_id, btype, blob, blobsize))
+        if (blobstore_get_item_hashed(bs, device_id, id_hash, btype, blob,
+                                      blobsize))
                 return EFI_NOT_FOUND;
 
         return EFI_SUCCESS;
@@ -910,17 +1017,19 @@ EFI_STATUS get_bootimage_blob(VOID *bootimage, enum blobtype btype, VOID **blob,
  * #<comment> or <key>=<value>. We don't do sanity checking as the
  * blobstore is covered by the verified boot signature and is hence
  * trusted */
-static EFI_STATUS parse_bootvars_line(char *line, VOID *ctx)
+static EFI_STATUS parse_bootvars_line(text_slice_t *line, VOID *ctx)
 {
-        CHAR16 **cmdline16 = (CHAR16 **)ctx;
+        cmdline_t *cmdline = (cmdline_t *)ctx;
 
-        if (strlen((CHAR8 *)line) == 0 || line[0] == '#')
+        if (line->str[0] == '#')
                 return EFI_SUCCESS;
 
-        return prepend_command_line(cmdline16, L"%a", line);
+        /* The boot image outlives the command line */
+        return cmdline_prepend_ref(cmdline, (const CHAR8 *)line->str,
+                                   line->len);
 }
 
-static EFI_STATUS add_bootvars(VOID *bootimage, CHAR16 **cmdline16)
+static EFI_STATUS add_bootvars(VOID *bootimage, cmdline_t *cmdline)
 {
         VOID *bootvars;
         UINT32 bvsize;
@@ -937,8 +1046,8 @@ static EFI_STATUS add_bootvars(VOID *bootimage, CHAR16 **cmdline16)
                 return ret;
         }
 
-        return parse_text_buffer(bootvars, bvsize, parse_bootvars_line,
-                                 cmdline16);
+        return parse_text_slices(bootvars, bvsize, parse_bootvars_line,
+                                 cmdline);
 }
 #endif
 
@@ -954,7 +1063,7 @@ static EFI_STATUS setup_command_line(
                 IN VBDATA *vb_data
                 )
 {
-        CHAR16 *cmdline16 = NULL;
+        cmdline_t args;
         char   *serialno = NULL;
         CHAR16 *serialport = NULL;
         CHAR16 *bootreason = NULL;
@@ -963,12 +1072,13 @@ static EFI_STATUS setup_command_line(
         CHAR8 *cmdline;
         UINTN cmdlen;
         UINTN cmdsize;
-        UINTN vb_cmdlen = 0;
         EFI_STATUS ret;
         struct boot_params *buf;
         struct boot_img_hdr *aosp_header;
         CHAR8 time_str8[128] = {0};
-        CHAR16 *time_str16 = NULL;
+#ifdef BOOTTRACE_CMDLINE
+        CHAR8 trace_str8[256];
+#endif
         EFI_GUID *swap_guid = NULL;
         CHAR8 *abl_cmd_line = NULL;
         BOOLEAN is_uefi = TRUE;
@@ -987,16 +1097,15 @@ static EFI_STATUS setup_command_line(
         aosp_header = (struct boot_img_hdr *)bootimage;
         buf = (struct boot_params *)(bootimage + aosp_header->page_size);
 
-        cmdline16 = get_command_line(aosp_header, boot_target);
-        if (!cmdline16) {
-                ret = EFI_OUT_OF_RESOURCES;
+        cmdline_init(&args);
+        ret = add_base_command_line(aosp_header, boot_target, &args);
+        if (EFI_ERROR(ret))
                 goto out;
-        }
 
         /* Append serial number from DMI */
         serialno = get_serial_number();
         if (serialno) {
-                ret = prepend_command_line(&cmdline16,
+                ret = cmdline_prepend(&args,
                                 L"androidboot.serialno=%a g_ffs.iSerialNumber=%a",
                                 serialno, serialno);
                 if (EFI_ERROR(ret))
@@ -1004,7 +1113,7 @@ static EFI_STATUS setup_command_line(
         }
 
         if (boot_target == CHARGER) {
-                ret = prepend_command_line(&cmdline16,
+                ret = cmdline_prepend(&args,
                                 L"androidboot.mode=charger");
                 if (EFI_ERROR(ret))
                         goto out;
@@ -1020,17 +1129,17 @@ static EFI_STATUS setup_command_line(
                 goto out;
         }
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.bootreason=%s", bootreason);
+        ret = cmdline_prepend(&args, L"androidboot.bootreason=%s", bootreason);
         if (EFI_ERROR(ret))
                 goto out;
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.verifiedbootstate=%s",
-                                   boot_state_to_string(boot_state));
+        ret = cmdline_prepend(&args, L"androidboot.verifiedbootstate=%s",
+                              boot_state_to_string(boot_state));
         if (EFI_ERROR(ret))
                 goto out;
 
         if (swap_guid) {
-                ret = prepend_command_line(&cmdline16, L"resume=PARTUUID=%g",
+                ret = cmdline_prepend(&args, L"resume=PARTUUID=%g",
                         swap_guid);
                 if (EFI_ERROR(ret))
                         goto out;
@@ -1038,14 +1147,14 @@ static EFI_STATUS setup_command_line(
 
         serialport = get_serial_port();
         if (serialport) {
-                ret = prepend_command_line(&cmdline16, L"console=%s", serialport);
+                ret = cmdline_prepend(&args, L"console=%s", serialport);
                 if (EFI_ERROR(ret))
                         goto out;
         }
 
 #ifndef USER
         if (get_disable_watchdog()) {
-                ret = prepend_command_line(&cmdline16, CONVERT_TO_WIDE(TCO_OPT_DISABLED));
+                ret = cmdline_prepend(&args, CONVERT_TO_WIDE(TCO_OPT_DISABLED));
                 if (EFI_ERROR(ret))
                         goto out;
         }
@@ -1060,19 +1169,19 @@ static EFI_STATUS setup_command_line(
                 diskbus = PoolPrint(L"%a", (CHAR8 *)PREDEF_DISK_BUS);
 #endif
                 StrToLower(diskbus);
-                ret = prepend_command_line(&cmdline16,
-                                           (aosp_header->header_version < 2)
-                                           ? L"androidboot.diskbus=%s"
-                                           : L"androidboot.boot_devices=pci0000:00/0000:00:%s",
-                                           diskbus);
+                ret = cmdline_prepend(&args,
+                                      (aosp_header->header_version < 2)
+                                      ? L"androidboot.diskbus=%s"
+                                      : L"androidboot.boot_devices=pci0000:00/0000:00:%s",
+                                      diskbus);
                 FreePool(diskbus);
                 if (EFI_ERROR(ret))
                         goto out;
         } else
                 error(L"Boot device not found, diskbus parameter not set in the commandline!");
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.bootloader=%a",
-                                   get_property_bootloader());
+        ret = cmdline_prepend(&args, L"androidboot.bootloader=%a",
+                              get_property_bootloader());
         if (EFI_ERROR(ret))
                 goto out;
 #if defined(DYNAMIC_PARTITIONS) && defined(USE_SLOT)
@@ -1080,58 +1189,78 @@ static EFI_STATUS setup_command_line(
         //containing the recovery’s ramdisk. command line "androidboot.force_normal_boot=1" is
         //mandatory for normal boot.
         if(boot_target == NORMAL_BOOT) {
-                ret = prepend_command_line(&cmdline16, L"androidboot.force_normal_boot=1");
+                ret = cmdline_prepend(&args, L"androidboot.force_normal_boot=1");
                 if (EFI_ERROR(ret))
                         goto out;
         }
 #endif
-        ret = prepend_command_line(&cmdline16, L"androidboot.acpi_idx=%a ",
-                                   acpi_loaded_table_idx_to_string(BOOT_ACPI));
+        ret = cmdline_prepend(&args, L"androidboot.acpi_idx=%a ",
+                              acpi_loaded_table_idx_to_string(BOOT_ACPI));
         if (EFI_ERROR(ret))
                 goto out;
 
-        ret = prepend_command_line(&cmdline16, L"androidboot.acpio_idx=%a ",
-                                   acpi_loaded_table_idx_to_string(ACPIO));
+        ret = cmdline_prepend(&args, L"androidboot.acpio_idx=%a ",
+                              acpi_loaded_table_idx_to_string(ACPIO));
         if (EFI_ERROR(ret))
                 goto out;
 
 #ifdef HAL_AUTODETECT
-        ret = prepend_command_line(&cmdline16, L"androidboot.brand=%a "
-                                   "androidboot.name=%a androidboot.device=%a "
+        ret = cmdline_prepend(&args, L"androidboot.brand=%a "
+                              "androidboot.name=%a androidboot.device=%a "
                                    "androidboot.model=%a", get_property_brand(),
-                                   get_property_name(), get_property_device(),
+                              get_property_name(), get_property_device(),
                                    get_property_model());
         if (EFI_ERROR(ret))
                 goto out;
 
-        ret = add_bootvars(bootimage, &cmdline16);
+        ret = add_bootvars(bootimage, &args);
         if (EFI_ERROR(ret))
                 goto out;
 #endif
 
-        ret = prepend_slot_command_line(&cmdline16, boot_target, vb_data);
+        ret = prepend_slot_command_line(&args, boot_target, vb_data);
         if (EFI_ERROR(ret))
                 goto out;
         /* append stages boottime */
         set_boottime_stamp(TM_JMP_KERNEL);
         construct_stages_boottime(time_str8, sizeof(time_str8));
-        time_str16 = stra_to_str(time_str8);
-        if (time_str16) {
-                ret = prepend_command_line(&cmdline16, L"androidboot.boottime=%s", time_str16);
+        ret = cmdline_prepend(&args, L"androidboot.boottime=%a", time_str8);
+        if (EFI_ERROR(ret))
+                goto out;
+
+#ifdef BOOTTRACE_CMDLINE
+        boottrace_summary(trace_str8, sizeof(trace_str8));
+        if (trace_str8[0]) {
+                ret = cmdline_prepend(&args, L"androidboot.boottrace=%a",
+                                      trace_str8);
+                if (EFI_ERROR(ret))
+                        goto out;
+        }
+#endif
+
+        if (boot_target != MEMORY && get_vb_cmdlen(vb_data) > 0) {
+                ret = cmdline_append_ref(&args,
+                                         (CHAR8 *)get_vb_cmdline(vb_data),
+                                         get_vb_cmdlen(vb_data));
                 if (EFI_ERROR(ret))
                         goto out;
         }
 
-        if(boot_target != MEMORY)
-                vb_cmdlen = get_vb_cmdlen(vb_data);
+        /* append command line from ABL */
+        if (abl_cmd_len > 0) {
+                ret = cmdline_append_ref(&args, (CHAR8 *)abl_cmd_line,
+                                         abl_cmd_len);
+                if (EFI_ERROR(ret))
+                        goto out;
+        }
 
         if (is_uefi) {
             /* Documentation/x86/boot.txt: "The kernel command line can be located
              * anywhere between the end of the setup heap and 0xA0000" */
             cmdline_addr = 0xA0000;
 
-            cmdlen = StrLen(cmdline16);
-            cmdsize = cmdlen + 1 + vb_cmdlen + 1;
+            cmdlen = cmdline_len(&args);
+            cmdsize = cmdlen + 1;
             ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
                                  EFI_SIZE_TO_PAGES(cmdsize),
                                  &cmdline_addr);
@@ -1139,9 +1268,9 @@ static EFI_STATUS setup_command_line(
                     goto out;
         } else {
         /*TBD- unify cmdline buffer allocation in ABL with UEFI */
-            cmdlen = StrLen(cmdline16);
+            cmdlen = cmdline_len(&args);
             /* +256: for extra cmd line*/
-            cmdsize = cmdlen + vb_cmdlen + abl_cmd_len + 256;
+            cmdsize = cmdlen + 256;
             cmdline_addr = (EFI_PHYSICAL_ADDRESS)((UINTN)AllocatePool(cmdsize));
             if (cmdline_addr == 0) {
                     ret = EFI_OUT_OF_RESOURCES;
@@ -1150,39 +1279,21 @@ static EFI_STATUS setup_command_line(
         }
 
         cmdline = (CHAR8 *)(UINTN)cmdline_addr;
-        ret = str_to_stra(cmdline, cmdline16, cmdlen + 1);
+        ret = cmdline_build(&args, cmdline, cmdsize);
         if (EFI_ERROR(ret)) {
-                error(L"Non-ascii characters in command line");
-                free_pages(cmdline_addr, EFI_SIZE_TO_PAGES(cmdsize));
+                if (is_uefi)
+                        free_pages(cmdline_addr, EFI_SIZE_TO_PAGES(cmdsize));
+                else
+                        FreePool(cmdline);
                 goto out;
         }
 
-        if (vb_cmdlen > 0) {
-                char *vb_cmdline;
-                vb_cmdline = get_vb_cmdline(vb_data);
-                cmdline[cmdlen] = ' ';
-                memcpy(cmdline + cmdlen + 1, vb_cmdline, vb_cmdlen);
-                cmdlen += vb_cmdlen + 1;
-                cmdline[cmdlen] = 0;
-        }
-
-        /* append command line from ABL */
-        if (abl_cmd_len > 0)
-        {
-                cmdline[cmdlen] = ' ';
-                memcpy(cmdline + cmdlen + 1, abl_cmd_line, abl_cmd_len + 1);
-                cmdlen += abl_cmd_len + 1;
-                cmdline[cmdlen] = 0;
-        }
-
         buf->hdr.cmd_line_ptr = (UINT32)(UINTN)cmdline;
         ret = EFI_SUCCESS;
 out:
-        FreePool(cmdline16);
+        cmdline_free(&args);
         if (serialport)
                 FreePool(serialport);
-        if (time_str16)
-                FreePool(time_str16);
 
         return ret;
 }
@@ -1209,6 +1320,41 @@ static void setup_screen_info_from_gop(struct screen_info *pinfo)
         pinfo->lfb_linelength = gop->Mode->Info->PixelsPerScanLine * 4;
 }
 
+/* The kernel can run from where it is in BOOTIMAGE if it is aligned
+   as the boot protocol requires and if its whole init_size footprint
+   lies within the boot image without covering the ramdisk.  */
+static BOOLEAN kernel_in_place(CHAR8 *bootimage, EFI_PHYSICAL_ADDRESS start,
+                               UINT64 init_size)
+{
+        struct boot_img_hdr *aosp_header = (struct boot_img_hdr *)bootimage;
+        struct boot_params *buf;
+        EFI_PHYSICAL_ADDRESS end, ramdisk_start, ramdisk_end;
+        UINT32 align;
+
+        buf = (struct boot_params *)(bootimage + aosp_header->page_size);
+        end = (EFI_PHYSICAL_ADDRESS)(UINTN)bootimage + bootimage_size(aosp_header);
+
+        /* A relocatable kernel accepts 1 << min_alignment, see
+           Linux Documentation/x86/boot.txt */
+        align = start == buf->hdr.pref_address ? buf->hdr.kernel_alignment :
+                (UINT32)1 << buf->hdr.min_alignment;
+        if (!align || start % align)
+                return FALSE;
+
+        if (start + init_size > end)
+                return FALSE;
+
+        ramdisk_start = buf->hdr.ramdisk_start;
+        ramdisk_end = ramdisk_start + buf->hdr.ramdisk_len;
+        if (buf->hdr.ramdisk_len &&
+            ramdisk_start < start + init_size && ramdisk_end > start)
+                return FALSE;
+
+        if (start != buf->hdr.pref_address)
+                buf->hdr.kernel_alignment = align;
+        return TRUE;
+}
+
 static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 {
         EFI_PHYSICAL_ADDRESS kernel_start;
@@ -1222,6 +1368,7 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
         UINT32 setup_size;
         UINT32 ksize;
         UINT32 koffset;
+        BOOLEAN in_place;
 
         aosp_header = (struct boot_img_hdr *)bootimage;
         buf = (struct boot_params *)(bootimage + aosp_header->page_size);
@@ -1238,6 +1385,14 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 
         setup_screen_info_from_gop(&buf->screen_info);
 
+        boot_addr = (EFI_PHYSICAL_ADDRESS)(UINTN)(bootimage + koffset + setup_size);
+        in_place = kernel_in_place(bootimage, boot_addr, init_size);
+        if (in_place) {
+                debug(L"kernel used in place at 0x%lx", boot_addr);
+                kernel_start = boot_addr;
+                goto setup;
+        }
+
         ret = allocate_pages(AllocateAddress, EfiLoaderData,
                              EFI_SIZE_TO_PAGES(init_size), &kernel_start);
         if (EFI_ERROR(ret)) {
@@ -1253,6 +1408,8 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 
         memcpy((CHAR8 *)(UINTN)kernel_start, bootimage + koffset + setup_size, ksize);
 
+setup:
+
         boot_addr = 0x3fffffff;
         ret = allocate_pages(AllocateMaxAddress, EfiLoaderData,
                              EFI_SIZE_TO_PAGES(16384), &boot_addr);
@@ -1274,6 +1431,7 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
         ui_free();
 
         log_flush_to_var(FALSE);
+        log_flush_to_partition();
 
         boot_params = (struct boot_params *)(UINTN)boot_addr;
         memset(boot_params, 0x0, 16384);
@@ -1292,7 +1450,8 @@ static EFI_STATUS handover_kernel(CHAR8 *bootimage, EFI_HANDLE parent_image)
 
         free_pages(boot_addr, EFI_SIZE_TO_PAGES(16384));
 out:
-        efree(kernel_start, ksize);
+        if (!in_place)
+                efree(kernel_start, ksize);
         return ret;
 }
 
@@ -1308,28 +1467,169 @@ static EFI_STATUS android_install_acpi_table(VOID)
                 NULL};
         EFI_STATUS ret = EFI_SUCCESS;
 
+        acpi_install_begin();
         for (int i = 0; acpi_part_names[i] != NULL; i++) {
                 ret = install_acpi_table_from_partitions(NULL, acpi_part_names[i]);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"Failed to install acpi table from %a image",
                                    acpi_part_names[i]);
-                        return ret;
+                        break;
+                }
+        }
+
+        /* The tables of the images are queued, install them at once */
+        acpi_install_commit();
+        return ret;
+}
+
+/* Size of the first read of a boot partition.  It holds the whole
+   boot image header, and the kernel setup header for page sizes up to
+   4 KiB, and is a multiple of the usual block sizes so that the
+   remainder read stays block aligned.  */
+#define BOOT_IMAGE_FIRST_READ_SIZE 8192
+
+/* Boot image allocated by place_bootimage(), released by
+   android_free_bootimage().  */
+static struct {
+        VOID *bootimage;
+        EFI_PHYSICAL_ADDRESS base;
+        UINTN pages;
+} placed;
+
+/* Allocate IMG_SIZE bytes for the boot image of header HDR so that
+   setup_ramdisk() can hand its ramdisk over to the kernel in place:
+   the image pages are below the kernel initrd_addr_max and the image
+   starts at the offset within its first page which makes the ramdisk
+   page aligned.  BP is the kernel boot parameters, or NULL if they
+   are not known yet.  Falls back to a pool allocation, the ramdisk is
+   then copied.  */
+static VOID *place_bootimage(struct boot_img_hdr *hdr, struct boot_params *bp,
+                             UINTN img_size)
+{
+        EFI_PHYSICAL_ADDRESS base;
+        UINTN roffset, shift, pages;
+        EFI_STATUS ret;
+
+        if (!bp || !hdr->ramdisk_size || placed.bootimage)
+                return mt_pool_alloc(MT_BOOTIMG, img_size);
+
+        if (bp->hdr.signature != 0xAA55 || bp->hdr.header != SETUP_HDR ||
+            !bp->hdr.ramdisk_max)
+                return mt_pool_alloc(MT_BOOTIMG, img_size);
+
+        roffset = hdr->page_size + pagealign(hdr, hdr->kernel_size);
+        shift = (EFI_PAGE_SIZE - roffset % EFI_PAGE_SIZE) % EFI_PAGE_SIZE;
+        pages = EFI_SIZE_TO_PAGES(shift + img_size);
+
+        base = bp->hdr.ramdisk_max;
+        ret = allocate_pages(AllocateMaxAddress, EfiLoaderData, pages, &base);
+        if (EFI_ERROR(ret)) {
+                debug(L"Cannot place the boot image below 0x%x, %r",
+                      bp->hdr.ramdisk_max, ret);
+                return mt_pool_alloc(MT_BOOTIMG, img_size);
+        }
+
+        placed.bootimage = (VOID *)(UINTN)(base + shift);
+        placed.base = base;
+        placed.pages = pages;
+        mt_track(MT_BOOTIMG, placed.bootimage, EFI_PAGES_TO_SIZE(pages));
+        return placed.bootimage;
+}
+
+VOID android_free_bootimage(VOID *bootimage)
+{
+        if (!bootimage)
+                return;
+
+#ifndef USE_AVB
+        bootimage_hash_discard(bootimage);
+#endif
+
+        if (bootimage == placed.bootimage) {
+                mt_untrack(bootimage);
+                free_pages(placed.base, placed.pages);
+                placed.bootimage = NULL;
+                return;
+        }
+
+        mt_pool_free(bootimage);
+}
+
+#ifndef USE_AVB
+/* Segment size of the boot image reads.  The VB1 verification hash
+   is computed as the image is loaded: a segment is hashed while the
+   next ones are being read.  */
+#define BOOT_IMAGE_SEGMENT_SIZE (2 * 1024 * 1024)
+
+/* Read the LEN bytes at OFFSET of the partition into BOOTIMAGE + START
+   and hash the first IMG_SIZE bytes of BOOTIMAGE on the way, the START
+   bytes already loaded included.  */
+static EFI_STATUS read_bootimage_hashed(struct gpt_partition_interface *gpart,
+                                        UINT64 offset, UINTN len,
+                                        UINT8 *bootimage, UINTN start,
+                                        UINTN img_size)
+{
+        struct async_io *aio;
+        UINTN ids[ASYNC_IO_MAX_REQUESTS];
+        UINTN nb_seg, submitted, done, seg_off, seg_len, img_off;
+        EFI_STATUS ret;
+
+        /* Let the caller fall back to a plain read */
+        ret = async_io_open(gpart, &aio);
+        if (EFI_ERROR(ret))
+                return EFI_NOT_FOUND;
+
+        bootimage_hash_update(bootimage, 0, min(start, img_size));
+
+        nb_seg = (len + BOOT_IMAGE_SEGMENT_SIZE - 1) / BOOT_IMAGE_SEGMENT_SIZE;
+        for (submitted = 0, done = 0; done < nb_seg; done++) {
+                for (; submitted < nb_seg &&
+                             submitted - done < ASYNC_IO_MAX_REQUESTS;
+                     submitted++) {
+                        seg_off = submitted * BOOT_IMAGE_SEGMENT_SIZE;
+                        ret = async_io_read(aio, offset + seg_off,
+                                            min(len - seg_off,
+                                                (UINTN)BOOT_IMAGE_SEGMENT_SIZE),
+                                            bootimage + start + seg_off,
+                                            &ids[submitted % ASYNC_IO_MAX_REQUESTS]);
+                        if (EFI_ERROR(ret))
+                                goto out;
                 }
+
+                ret = async_io_wait(aio, ids[done % ASYNC_IO_MAX_REQUESTS]);
+                if (EFI_ERROR(ret))
+                        goto out;
+
+                seg_off = done * BOOT_IMAGE_SEGMENT_SIZE;
+                seg_len = min(len - seg_off, (UINTN)BOOT_IMAGE_SEGMENT_SIZE);
+                img_off = start + seg_off;
+                if (img_off < img_size)
+                        bootimage_hash_update(bootimage, img_off,
+                                              min(seg_len, img_size - img_off));
         }
+
+out:
+        if (EFI_ERROR(ret))
+                bootimage_hash_discard(bootimage);
+        async_io_close(aio);
         return ret;
 }
+#endif
 
 EFI_STATUS android_image_load_partition(
                 IN const CHAR16 *label,
                 OUT VOID **bootimage_p)
 {
         UINT32 MediaId;
-        UINT32 img_size;
+        UINTN img_size, read_size;
         VOID *bootimage;
         EFI_STATUS ret;
-        struct boot_img_hdr aosp_header;
+        UINT8 first[BOOT_IMAGE_FIRST_READ_SIZE];
+        struct boot_img_hdr *aosp_header;
+        struct boot_params *bp = NULL;
         struct gpt_partition_interface gpart;
         UINT64 partition_start;
+        UINT64 partition_size;
 
         *bootimage_p = NULL;
         ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
@@ -1339,41 +1639,107 @@ EFI_STATUS android_image_load_partition(
         }
         MediaId = gpart.bio->Media->MediaId;
         partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
+        partition_size = (gpart.part.ending_lba + 1 - gpart.part.starting_lba) *
+                gpart.bio->Media->BlockSize;
 
         debug(L"Reading boot image header");
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
-                                partition_start,
-                                sizeof(aosp_header), &aosp_header);
+        ret = prefetch_read(&gpart, partition_start, sizeof(first), first);
+        if (ret == EFI_NOT_FOUND)
+                ret = blkcache_read(&gpart, partition_start, sizeof(first), first);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk (header)");
                 return ret;
         }
-        if (memcmp(aosp_header.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+        aosp_header = get_bootimage_header(first);
+        if (!aosp_header) {
                 error(L"This partition does not appear to contain an Android boot image");
                 return EFI_INVALID_PARAMETER;
         }
 
-        img_size = bootimage_size(&aosp_header) + BOOT_SIGNATURE_MAX_SIZE;
-        bootimage = AllocatePool(img_size);
+        if (bootimage_size(aosp_header) > partition_size) {
+                error(L"Boot image is larger than the partition");
+                return EFI_INVALID_PARAMETER;
+        }
+
+        /* bootimage_size() is at least one page, the image is always
+           larger than the first read.  The signature room may go past
+           the end of the partition though.  */
+        img_size = bootimage_size(aosp_header) + BOOT_SIGNATURE_MAX_SIZE;
+        read_size = min(img_size, (UINTN)partition_size);
+        if (read_size < sizeof(first)) {
+                error(L"Boot image is too small");
+                return EFI_INVALID_PARAMETER;
+        }
+
+        if (aosp_header->page_size + sizeof(*bp) <= sizeof(first))
+                bp = (struct boot_params *)(first + aosp_header->page_size);
+
+        bootimage = place_bootimage(aosp_header, bp, img_size);
         if (!bootimage)
                 return EFI_OUT_OF_RESOURCES;
-
-        debug(L"Reading full boot image (%d bytes)", img_size);
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId, partition_start,
-                                img_size, bootimage);
+        memset((UINT8 *)bootimage + read_size, 0, img_size - read_size);
+
+        /* Only read what follows the header block. */
+        memcpy(bootimage, first, sizeof(first));
+        debug(L"Reading full boot image (%d bytes)", read_size);
+        boottrace_begin(BT_BOOTIMG_LOAD, read_size);
+        ret = prefetch_read(&gpart, partition_start + sizeof(first),
+                            read_size - sizeof(first),
+                            (UINT8 *)bootimage + sizeof(first));
+#ifndef USE_AVB
+        if (ret == EFI_NOT_FOUND)
+                ret = read_bootimage_hashed(&gpart, partition_start + sizeof(first),
+                                            read_size - sizeof(first), bootimage,
+                                            sizeof(first),
+                                            bootimage_size(aosp_header));
+#endif
+        if (ret == EFI_NOT_FOUND)
+                ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
+                                        partition_start + sizeof(first),
+                                        read_size - sizeof(first),
+                                        (UINT8 *)bootimage + sizeof(first));
+        boottrace_end(BT_BOOTIMG_LOAD, read_size);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk");
-                FreePool(bootimage);
+                android_free_bootimage(bootimage);
                 return ret;
         }
 
         *bootimage_p = bootimage;
 
+        boottrace_begin(BT_ACPI_INSTALL, 0);
         ret = android_install_acpi_table();
+        boottrace_end(BT_ACPI_INSTALL, 0);
 
         return ret;
 }
 
+EFI_STATUS android_image_prefetch_partition(IN const CHAR16 *label)
+{
+        struct gpt_partition_interface gpart;
+        struct boot_img_hdr hdr;
+        EFI_STATUS ret;
+
+        if (!label)
+                return EFI_INVALID_PARAMETER;
+
+        ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        ret = blkcache_read(&gpart,
+                            gpart.part.starting_lba * gpart.bio->Media->BlockSize,
+                            sizeof(hdr), &hdr);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        if (!get_bootimage_header(&hdr))
+                return EFI_NOT_FOUND;
+
+        return prefetch_partition(label, 0, bootimage_size(&hdr) +
+                                  BOOT_SIGNATURE_MAX_SIZE);
+}
+
 
 EFI_STATUS android_image_load_file(
                 IN EFI_HANDLE device,
@@ -1504,6 +1870,10 @@ out:
 out_free:
         FreePool(fileinfo);
         if (ret == EFI_SUCCESS) {
+#ifndef USE_AVB
+                /* Not hashed on the way */
+                bootimage_hash_discard(bootimage);
+#endif
                 *bootimage_p = bootimage;
         } else {
                 FreePool(bootimage);
@@ -1526,6 +1896,7 @@ EFI_STATUS android_image_start_buffer(
         void *parameter = NULL;
         EFI_STATUS ret;
         BOOLEAN use_ramdisk = TRUE;
+        BOOLEAN ramdisk_in_place = FALSE;
         if (!bootimage)
                 return EFI_INVALID_PARAMETER;
 
@@ -1580,18 +1951,39 @@ EFI_STATUS android_image_start_buffer(
         use_ramdisk = !recovery_in_boot_partition() || boot_target == RECOVERY || boot_target == MEMORY;
 #endif
         if (use_ramdisk) {
-                ret = setup_ramdisk(bootimage);
+                ret = setup_ramdisk(bootimage, &ramdisk_in_place);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"setup_ramdisk");
                         goto out_cmdline;
                 }
         }
 
+#ifdef USE_HASH_MANIFEST
+        /* The OS can write the partitions behind Fastboot's back */
+        del_efi_variable(&fastboot_guid, HASH_MANIFEST_VAR);
+#endif
+
+        ui_vendor_splash_join();
+        log_flush();
+        log_flush_to_partition();
+        efi_variable_commit();
+        misc_commit();
+#ifdef RPMB_STORAGE
+        rpmb_storage_commit();
+#endif
+        prefetch_release();
+
+#ifdef BOOT_HARNESS
+        if (boot_target != MEMORY && boot_harness_runs())
+                boot_harness_run_done();
+#endif
+
         debug(L"Loading the kernel");
         ret = handover_kernel(bootimage, parent_image);
         efi_perror(ret, L"handover_kernel");
 
-        efree(buf->hdr.ramdisk_start, buf->hdr.ramdisk_len);
+        if (!ramdisk_in_place)
+                efree(buf->hdr.ramdisk_start, buf->hdr.ramdisk_len);
         buf->hdr.ramdisk_start = 0;
         buf->hdr.ramdisk_len = 0;
 out_cmdline:
@@ -1620,16 +2012,21 @@ EFI_STATUS read_bcb(
         struct gpt_partition_interface gpart;
         UINT64 partition_start;
 
-        debug(L"Locating BCB");
-        ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
-        if (EFI_ERROR(ret))
-                return EFI_INVALID_PARAMETER;
-        partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
+        /* The misc partition is read once for the BCB and the
+           slot metadata */
+        if (!StrCmp(label, MISC_LABEL)) {
+                debug(L"Reading BCB");
+                ret = misc_read(0, sizeof(*bcb), bcb);
+        } else {
+                debug(L"Locating BCB");
+                ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
+                if (EFI_ERROR(ret))
+                        return EFI_INVALID_PARAMETER;
+                partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
 
-        debug(L"Reading BCB");
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio,
-                                gpart.bio->Media->MediaId,
-                                partition_start, sizeof(*bcb), bcb);
+                debug(L"Reading BCB");
+                ret = blkcache_read(&gpart, partition_start, sizeof(*bcb), bcb);
+        }
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk (bcb)");
                 return ret;
@@ -1651,16 +2048,24 @@ EFI_STATUS write_bcb(
         struct gpt_partition_interface gpart;
         UINT64 partition_start;
 
-        debug(L"Locating BCB");
-        ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
-        if (EFI_ERROR(ret))
-                return EFI_INVALID_PARAMETER;
-        partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
+        /* The write is coalesced with the slot metadata ones when
+           the misc writes are deferred, see misc_defer_writes() */
+        if (!StrCmp(label, MISC_LABEL)) {
+                debug(L"Writing BCB");
+                ret = misc_write(0, sizeof(*bcb), bcb);
+        } else {
+                debug(L"Locating BCB");
+                ret = gpt_get_partition_by_label(label, &gpart, LOGICAL_UNIT_USER);
+                if (EFI_ERROR(ret))
+                        return EFI_INVALID_PARAMETER;
+                partition_start = gpart.part.starting_lba * gpart.bio->Media->BlockSize;
 
-        debug(L"Writing BCB");
-        ret = uefi_call_wrapper(gpart.dio->WriteDisk, 5, gpart.dio,
-                                gpart.bio->Media->MediaId,
-                                partition_start, sizeof(*bcb), bcb);
+                debug(L"Writing BCB");
+                blkcache_invalidate(gpart.bio, partition_start, sizeof(*bcb));
+                ret = uefi_call_wrapper(gpart.dio->WriteDisk, 5, gpart.dio,
+                                        gpart.bio->Media->MediaId,
+                                        partition_start, sizeof(*bcb), bcb);
+        }
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"WriteDisk (bcb)");
                 return ret;
@@ -1671,34 +2076,201 @@ EFI_STATUS write_bcb(
 }
 
 
+/* The verification reads back one page out of CLEAR_VERIFY_STRIDE,
+   about 0.1% of the cleared memory.  */
+#define CLEAR_VERIFY_STRIDE 1024
+
+#ifdef __LP64__
+/* Conventional memory is cleared by units of CLEAR_UNIT_SIZE bytes
+   which are spread over the processors.  The progress is reported
+   after each slice of CLEAR_SLICE_UNITS units per processor.  */
+#define CLEAR_UNIT_SIZE (64 * 1024 * 1024)
+#define CLEAR_SLICE_UNITS 2
+
+struct clear_ctx {
+        CHAR8 *entries;
+        UINTN nr_entries;
+        UINTN entry_sz;
+        UINTN base;             /* First unit of the current slice */
+};
+
+static UINT64 clear_units(EFI_MEMORY_DESCRIPTOR *entry)
+{
+        UINT64 size = entry->NumberOfPages * EFI_PAGE_SIZE;
+
+        return (size + CLEAR_UNIT_SIZE - 1) / CLEAR_UNIT_SIZE;
+}
+
+/* Run on the APs: no UEFI service and no log allowed.  */
+static void clear_units_range(UINTN start, UINTN end, VOID *arg)
+{
+        struct clear_ctx *ctx = arg;
+        EFI_MEMORY_DESCRIPTOR *entry;
+        UINT64 first, units, offset, size, len;
+        UINTN i, unit;
+
+        for (unit = ctx->base + start; unit < ctx->base + end; unit++) {
+                for (i = 0, first = 0; i < ctx->nr_entries; i++, first += units) {
+                        entry = (EFI_MEMORY_DESCRIPTOR *)
+                                (ctx->entries + i * ctx->entry_sz);
+                        units = entry->Type == EfiConventionalMemory ?
+                                clear_units(entry) : 0;
+                        if (unit < first + units)
+                                break;
+                }
+                if (i == ctx->nr_entries)
+                        return;
+
+                offset = (unit - first) * CLEAR_UNIT_SIZE;
+                size = entry->NumberOfPages * EFI_PAGE_SIZE;
+                len = min(size - offset, (UINT64)CLEAR_UNIT_SIZE);
+                zero_memory_nt((VOID *)(entry->PhysicalStart + offset), len);
+        }
+}
+#endif
+
+static BOOLEAN page_is_cleared(EFI_PHYSICAL_ADDRESS addr)
+{
+        UINT64 *words, diff = 0;
+        UINTN i;
+#ifndef __LP64__
+        unsigned char *buf;
+        UINT64 len = EFI_PAGE_SIZE;
+
+        if (EFI_ERROR(pae_map(addr, &buf, &len)) || len != EFI_PAGE_SIZE)
+                return FALSE;
+        words = (UINT64 *)buf;
+#else
+        words = (UINT64 *)addr;
+#endif
+
+        for (i = 0; i < EFI_PAGE_SIZE / sizeof(*words); i++)
+                diff |= words[i];
+
+        return diff == 0;
+}
+
+/* Read back one page out of CLEAR_VERIFY_STRIDE of each conventional
+   memory region, at a random offset so that the sampled pages cannot
+   be predicted.  */
+static EFI_STATUS verify_cleared(CHAR8 *entries, UINTN nr_entries,
+                                 UINTN entry_sz)
+{
+        EFI_MEMORY_DESCRIPTOR *entry;
+        EFI_PHYSICAL_ADDRESS addr;
+        UINT32 seed;
+        UINT64 page;
+        UINTN i, nb = 0;
+
+        for (i = 0; i < nr_entries; i++) {
+                entry = (EFI_MEMORY_DESCRIPTOR *)(entries + i * entry_sz);
+                if (entry->Type != EfiConventionalMemory ||
+                    !entry->NumberOfPages)
+                        continue;
+
+                if (EFI_ERROR(random_get(&seed, sizeof(seed))))
+                        seed = i;
+                page = seed % min(entry->NumberOfPages,
+                                  (UINT64)CLEAR_VERIFY_STRIDE);
+                for (; page < entry->NumberOfPages;
+                     page += CLEAR_VERIFY_STRIDE, nb++) {
+                        addr = entry->PhysicalStart + page * EFI_PAGE_SIZE;
+                        if (!page_is_cleared(addr)) {
+                                error(L"Memory page 0x%lx is not cleared", addr);
+                                return EFI_DEVICE_ERROR;
+                        }
+                }
+        }
+
+        debug(L"Verified %d sampled pages", nb);
+        return EFI_SUCCESS;
+}
+
 EFI_STATUS android_clear_memory()
+{
+        return android_clear_memory_progress(NULL, NULL, FALSE);
+}
+
+EFI_STATUS android_clear_memory_progress(clear_progress_t progress,
+                                         VOID *progress_ctx, BOOLEAN verify)
 {
         EFI_STATUS ret = EFI_SUCCESS;
-        UINTN nr_entries, key, entry_sz;
-        CHAR8 *mem_entries;
-        UINT32 entry_ver;
+        UINTN nr_entries, entry_sz;
+        CHAR8 *mem_entries, *entries;
         UINTN i;
-        CHAR8 *mem_map;
         EFI_TPL OldTpl;
+        UINT64 total = 0;
+        UINT32 begin, elapsed;
 
         UINTN stack_canary = *(UINTN *)STACK_CANARY_LOCATION;
 
+        /* A detached MP pool job cannot be completed at TPL_NOTIFY */
+        ui_vendor_splash_join();
+
         OldTpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_NOTIFY);
-        mem_entries = (CHAR8 *)LibMemoryMap(&nr_entries, &key, &entry_sz, &entry_ver);
-        if (!mem_entries) {
+        ret = memmap_get(&mem_entries, &nr_entries, &entry_sz, NULL);
+        if (EFI_ERROR(ret)) {
                 uefi_call_wrapper(BS->RestoreTPL, 1, OldTpl);
-                return EFI_OUT_OF_RESOURCES;
+                return ret;
         }
+        entries = mem_entries;
 
-        sort_memory_map(mem_entries, nr_entries, entry_sz);
-        mem_map = mem_entries;
+        begin = boottime_in_msec();
+
+#ifdef __LP64__
+        struct clear_ctx ctx = {
+                .entries = mem_entries,
+                .nr_entries = nr_entries,
+                .entry_sz = entry_sz
+        };
+        UINTN nr_units = 0, slice, count;
+
+        for (i = 0; i < nr_entries; mem_entries += entry_sz, i++) {
+                EFI_MEMORY_DESCRIPTOR *entry;
+
+                entry = (EFI_MEMORY_DESCRIPTOR *)mem_entries;
+                if (entry->Type != EfiConventionalMemory)
+                        continue;
+
+                nr_units += clear_units(entry);
+                total += entry->NumberOfPages * EFI_PAGE_SIZE;
+        }
+
+        /* The Application Processors only run clear_units_range():
+           they do not touch the stack canary of the BSP.  */
+        slice = mp_pool_cpu_count() * CLEAR_SLICE_UNITS;
+        for (ctx.base = 0; ctx.base < nr_units; ctx.base += count) {
+                count = min(nr_units - ctx.base, slice);
+                ret = parallel_for(count, 1, clear_units_range, &ctx);
+                if (EFI_ERROR(ret))
+                        goto err;
+                if (progress)
+                        progress(ctx.base + count == nr_units ? total :
+                                 min((UINT64)(ctx.base + count) * CLEAR_UNIT_SIZE,
+                                     total),
+                                 total, boottime_in_msec() - begin,
+                                 progress_ctx);
+        }
+
+        if (verify)
+                ret = verify_cleared(entries, nr_entries, entry_sz);
+#else
+        UINT64 done = 0;
 
-#ifndef __LP64__
         ret = pae_init(mem_entries, nr_entries, entry_sz);
         if (EFI_ERROR(ret))
                 goto err;
-#endif
 
+        for (i = 0; i < nr_entries; i++) {
+                EFI_MEMORY_DESCRIPTOR *entry;
+
+                entry = (EFI_MEMORY_DESCRIPTOR *)(mem_entries + i * entry_sz);
+                if (entry->Type == EfiConventionalMemory)
+                        total += entry->NumberOfPages * EFI_PAGE_SIZE;
+        }
+
+        /* The PAE window is only mapped on the BSP, the clearing
+           cannot be spread over the other processors.  */
         for (i = 0; i < nr_entries; mem_entries += entry_sz, i++) {
                 EFI_MEMORY_DESCRIPTOR *entry;
                 EFI_PHYSICAL_ADDRESS start;
@@ -1714,26 +2286,41 @@ EFI_STATUS android_clear_memory()
 
                 for (; map_sz > 0; map_sz -= len, start += len) {
                         len = map_sz;
-#ifdef __LP64__
-                        buf = (void *)start;
-#else
                         ret = pae_map(start, (unsigned char **)&buf, &len);
                         if (EFI_ERROR(ret))
                                 goto pae_err;
-#endif
-                        uefi_call_wrapper(BS->SetMem, 3, buf, len, 0);
+                        zero_memory_nt(buf, len);
+                        done += len;
+                        if (progress)
+                                progress(done, total,
+                                         boottime_in_msec() - begin,
+                                         progress_ctx);
                 }
         }
 
-#ifndef __LP64__
+        if (verify)
+                ret = verify_cleared(entries, nr_entries, entry_sz);
+
 pae_err:
         pae_exit();
-err:
 #endif
+
+err:
+        elapsed = boottime_in_msec() - begin;
         uefi_call_wrapper(BS->RestoreTPL, 1, OldTpl);
-        FreePool((void *)mem_map);
         *(UINTN *)STACK_CANARY_LOCATION = stack_canary;
 
+        if (!EFI_ERROR(ret) && elapsed) {
+                UINT64 rate = (total / 1024 / 1024) * 1000 / elapsed;
+#ifdef __LP64__
+                UINTN cpus = mp_pool_cpu_count();
+#else
+                UINTN cpus = 1;
+#endif
+                debug(L"Cleared %ld MB in %d ms: %ld MB/s, %ld MB/s per core",
+                      total / 1024 / 1024, elapsed, rate, rate / cpus);
+        }
+
         return ret;
 }
 
@@ -41,7 +41,7 @@
 
 #define ROOTFS_PREFIX L"skip_initramfs rootwait ro init=/init root="
 
-static EFI_STATUS prepend_command_line_rootfs(CHAR16 **cmdline16, X509 *verity_cert)
+static EFI_STATUS prepend_command_line_rootfs(cmdline_t *cmdline, X509 *verity_cert)
 {
         EFI_GUID system_uuid;
         EFI_STATUS ret;
@@ -59,8 +59,8 @@ static EFI_STATUS prepend_command_line_rootfs(CHAR16 **cmdline16, X509 *verity_c
                 error(L"Cannot boot without a verity certificate");
                 return EFI_INVALID_PARAMETER;
 #else
-                ret = prepend_command_line(cmdline16, ROOTFS_PREFIX "PARTUUID=%g",
-                                           &system_uuid);
+                ret = cmdline_prepend(cmdline, ROOTFS_PREFIX "PARTUUID=%g",
+                                      &system_uuid);
                 return ret;
 #endif
         }
@@ -69,15 +69,15 @@ static EFI_STATUS prepend_command_line_rootfs(CHAR16 **cmdline16, X509 *verity_c
         if (EFI_ERROR(ret))
                 return ret;
 
-        ret = prepend_command_line(cmdline16, ROOTFS_PREFIX "/dev/dm-0 dm=\"system "
-                                   "none ro,0 1 android-verity %a PARTUUID=%g\"",
-                                   key_id, &system_uuid);
+        ret = cmdline_prepend(cmdline, ROOTFS_PREFIX "/dev/dm-0 dm=\"system "
+                              "none ro,0 1 android-verity %a PARTUUID=%g\"",
+                              key_id, &system_uuid);
         FreePool(key_id);
 
         return ret;
 }
 
-EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
+EFI_STATUS prepend_slot_command_line(cmdline_t *cmdline,
         enum boot_target boot_target,
         VBDATA *vb_data)
 {
@@ -86,7 +86,7 @@ EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
         if ((boot_target == NORMAL_BOOT || boot_target == CHARGER) &&
                 recovery_in_boot_partition() && vb_data) {
 
-                ret = prepend_command_line_rootfs(cmdline16, vb_data);
+                ret = prepend_command_line_rootfs(cmdline, vb_data);
                 if (vb_data)
                         X509_free(vb_data);
 
@@ -94,7 +94,7 @@ EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
                         return ret;
 
                 if (slot_get_verity_corrupted()) {
-                        ret = prepend_command_line(cmdline16,
+                        ret = cmdline_prepend(cmdline,
                                 L"androidboot.veritymode=eio");
                         if (EFI_ERROR(ret))
                                 return ret;
@@ -34,6 +34,7 @@
 #include "slot.h"
 #include "pae.h"
 #include "timer.h"
+#include "boottrace.h"
 #ifdef RPMB_STORAGE
 #include "rpmb_storage.h"
 #endif
@@ -90,7 +91,7 @@ bool avb_update_stored_rollback_indexes_for_slot(AvbOps* ops, AvbSlotVerifyData*
 #define DISABLE_AVB_ROOTFS_PREFIX L" root="
 
 static EFI_STATUS avb_prepend_command_line_rootfs(
-                __attribute__((__unused__)) OUT CHAR16 **cmdline16,
+                __attribute__((__unused__)) OUT cmdline_t *cmdline,
                 IN enum boot_target boot_target)
 {
         EFI_STATUS ret = EFI_SUCCESS;
@@ -99,7 +100,7 @@ static EFI_STATUS avb_prepend_command_line_rootfs(
                 return ret;
 
         if (use_slot()) {
-                ret = prepend_command_line(cmdline16, AVB_ROOTFS_PREFIX);
+                ret = cmdline_prepend(cmdline, AVB_ROOTFS_PREFIX);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"Failed to add AVB rootfs prefix");
                         return ret;
@@ -108,7 +109,7 @@ static EFI_STATUS avb_prepend_command_line_rootfs(
         return ret;
 }
 
-EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
+EFI_STATUS prepend_slot_command_line(cmdline_t *cmdline,
         enum boot_target boot_target,
         VBDATA *vb_data)
 {
@@ -117,11 +118,11 @@ EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
         EFI_GUID system_uuid;
 #endif
 
-        avb_prepend_command_line_rootfs(cmdline16, boot_target);
+        avb_prepend_command_line_rootfs(cmdline, boot_target);
 
         if (use_slot()) {
                 if (slot_get_active()) {
-                        ret = prepend_command_line(cmdline16,
+                        ret = cmdline_prepend(cmdline,
                                 L"androidboot.slot_suffix=%a",
                                 slot_get_active());
                         if (EFI_ERROR(ret))
@@ -141,7 +142,7 @@ EFI_STATUS prepend_slot_command_line(CHAR16 **cmdline16,
                                 return ret;
                         }
 
-                        ret = prepend_command_line(cmdline16,
+                        ret = cmdline_prepend(cmdline,
                                 DISABLE_AVB_ROOTFS_PREFIX "PARTUUID=%g",
                                 &system_uuid);
                         if (EFI_ERROR(ret))
@@ -295,6 +296,7 @@ EFI_STATUS android_install_acpi_table_avb(AvbSlotVerifyData *slot_data)
         EFI_STATUS ret = EFI_SUCCESS;
         struct boot_img_hdr *hdr;
 
+        acpi_install_begin();
         android_query_image_from_avb_result(slot_data, "boot", &image);
         if (image != NULL) {
                 hdr = (struct boot_img_hdr *)image;
@@ -314,16 +316,19 @@ EFI_STATUS android_install_acpi_table_avb(AvbSlotVerifyData *slot_data)
                                                     acpi_part_names[i], &image);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"'%a' image not found!", acpi_part_names[i]);
-                        return ret;
+                        break;
                 }
                 ret = install_acpi_table_from_partitions(image,
                                                          acpi_part_names[i]);
                 if (EFI_ERROR(ret)) {
                         efi_perror(ret, L"Failed to install acpi table from %a image",
                                    acpi_part_names[i]);
-                        return ret;
+                        break;
                 }
         }
+
+        /* The tables of the images are queued, install them at once */
+        acpi_install_commit();
         return ret;
 }
 
@@ -365,13 +370,18 @@ EFI_STATUS android_image_load_partition_avb(
         flags = AVB_SLOT_VERIFY_FLAGS_NONE;
         if (allow_verification_error)
                 flags |= AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR;
+#ifdef AVB_PARALLEL_CHAINS
+        flags |= AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS;
+#endif
 
+        boottrace_begin(BT_AVB_VERIFY, 0);
         verify_result = avb_slot_verify(ops,
                         requested_partitions,
                         slot_suffix,
                         flags,
                         AVB_HASHTREE_ERROR_MODE_RESTART,
                         slot_data);
+        boottrace_end(BT_AVB_VERIFY, verify_result);
 
         debug(L"avb_slot_verify ret %d\n", verify_result);
 
@@ -426,6 +436,9 @@ EFI_STATUS android_image_load_partition_avb_ab(
         flags = AVB_SLOT_VERIFY_FLAGS_NONE;
         if (allow_verification_error)
                 flags |= AVB_SLOT_VERIFY_FLAGS_ALLOW_VERIFICATION_ERROR;
+#ifdef AVB_PARALLEL_CHAINS
+        flags |= AVB_SLOT_VERIFY_FLAGS_PARALLEL_CHAINS;
+#endif
 
         flow_result = avb_ab_flow(&ab_ops, requested_partitions, flags, AVB_HASHTREE_ERROR_MODE_RESTART, slot_data);
         ret = get_avb_flow_result(*slot_data,
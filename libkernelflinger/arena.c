@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "arena.h"
+#include "memtrack.h"
+
+#define ARENA_CHUNK_SIZE	EFI_PAGES_TO_SIZE(ARENA_CHUNK_PAGES)
+#define ARENA_ALIGN		16
+
+static EFI_PHYSICAL_ADDRESS chunks[ARENA_MAX_CHUNKS];
+static UINTN nb_chunks;
+static UINTN cur;		/* Current chunk */
+static UINTN used;		/* Bytes used in the current chunk */
+static UINTN depth;		/* Number of open scopes */
+
+arena_mark_t arena_mark(void)
+{
+	arena_mark_t mark = { .chunk = cur, .used = used };
+
+	depth++;
+	return mark;
+}
+
+void arena_release(arena_mark_t mark)
+{
+	if (!depth)
+		return;
+
+	cur = mark.chunk;
+	used = mark.used;
+	depth--;
+}
+
+void arena_reset(void)
+{
+	cur = 0;
+	used = 0;
+	depth = 0;
+}
+
+BOOLEAN arena_owns(const void *ptr)
+{
+	EFI_PHYSICAL_ADDRESS addr = (EFI_PHYSICAL_ADDRESS)(UINTN)ptr;
+	UINTN i;
+
+	for (i = 0; i < nb_chunks; i++)
+		if (addr >= chunks[i] && addr < chunks[i] + ARENA_CHUNK_SIZE)
+			return TRUE;
+
+	return FALSE;
+}
+
+static void *arena_alloc(UINTN size)
+{
+	EFI_STATUS ret;
+	void *ptr;
+
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if (cur < nb_chunks && used + size > ARENA_CHUNK_SIZE) {
+		if (cur + 1 >= ARENA_MAX_CHUNKS)
+			return NULL;
+		cur++;
+		used = 0;
+	}
+
+	/* Chunks are allocated on first use and never returned */
+	if (cur == nb_chunks) {
+		ret = uefi_call_wrapper(BS->AllocatePages, 4,
+					AllocateAnyPages, EfiBootServicesData,
+					ARENA_CHUNK_PAGES, &chunks[cur]);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to grow the arena");
+			return NULL;
+		}
+		mt_track(MT_AVB, (VOID *)(UINTN)chunks[cur], ARENA_CHUNK_SIZE);
+		nb_chunks++;
+	}
+
+	ptr = (void *)(UINTN)(chunks[cur] + used);
+	used += size;
+	return ptr;
+}
+
+void *arena_pool_alloc(UINTN size)
+{
+	void *ptr = NULL;
+
+	if (depth && size && size <= ARENA_MAX_ALLOC)
+		ptr = arena_alloc(size);
+
+	return ptr ? ptr : mt_pool_alloc(MT_AVB, size);
+}
+
+void arena_pool_free(void *ptr)
+{
+	if (!ptr || arena_owns(ptr))
+		return;
+
+	mt_pool_free(ptr);
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "protocol/DiskIo2.h"
+#include "async_io.h"
+#include "blkcache.h"
+#include "protocol.h"
+
+static EFI_GUID DiskIo2Protocol = EFI_DISK_IO2_PROTOCOL_GUID;
+
+struct async_request {
+	EFI_DISK_IO2_TOKEN token;
+	BOOLEAN pending;
+};
+
+struct async_io {
+	EFI_BLOCK_IO *bio;
+	EFI_DISK_IO *dio;
+	EFI_DISK_IO2_PROTOCOL *dio2;
+	struct async_request req[ASYNC_IO_MAX_REQUESTS];
+	/* Next request slot, also the oldest pending request */
+	UINTN next;
+};
+
+EFI_STATUS async_io_open(struct gpt_partition_interface *gparti,
+			 struct async_io **aio_p)
+{
+	EFI_STATUS ret;
+	struct async_io *aio;
+	UINTN i;
+
+	if (!gparti || !gparti->bio || !gparti->dio || !aio_p)
+		return EFI_INVALID_PARAMETER;
+
+	aio = AllocateZeroPool(sizeof(*aio));
+	if (!aio)
+		return EFI_OUT_OF_RESOURCES;
+
+	aio->bio = gparti->bio;
+	aio->dio = gparti->dio;
+
+	ret = handle_protocol_cached(gparti->handle, &DiskIo2Protocol,
+				     (VOID **)&aio->dio2);
+	if (EFI_ERROR(ret)) {
+		debug(L"Disk I/O 2 not supported, using synchronous I/O");
+		aio->dio2 = NULL;
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(aio->req); i++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, TPL_CALLBACK,
+					NULL, NULL, &aio->req[i].token.Event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create the I/O event");
+			while (i--)
+				uefi_call_wrapper(BS->CloseEvent, 1,
+						  aio->req[i].token.Event);
+			FreePool(aio);
+			return ret;
+		}
+	}
+
+out:
+	*aio_p = aio;
+	return EFI_SUCCESS;
+}
+
+BOOLEAN async_io_is_async(struct async_io *aio)
+{
+	return aio && aio->dio2;
+}
+
+EFI_STATUS async_io_wait(struct async_io *aio, UINTN id)
+{
+	EFI_STATUS ret;
+	struct async_request *req;
+
+	if (!aio || id >= ARRAY_SIZE(aio->req))
+		return EFI_INVALID_PARAMETER;
+
+	req = &aio->req[id];
+	if (!req->pending)
+		return EFI_SUCCESS;
+
+	/* WaitForEvent() is not allowed above TPL_APPLICATION, and the
+	   stream flash waits from the transport receive callbacks */
+	if (aio->dio2) {
+		do
+			ret = uefi_call_wrapper(BS->CheckEvent, 1,
+						req->token.Event);
+		while (ret == EFI_NOT_READY);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to wait for the I/O event");
+			return ret;
+		}
+	}
+
+	/* The request buffer may be reused only now */
+	req->pending = FALSE;
+	return req->token.TransactionStatus;
+}
+
+EFI_STATUS async_io_wait_all(struct async_io *aio)
+{
+	EFI_STATUS ret, status = EFI_SUCCESS;
+	UINTN i, id;
+
+	if (!aio)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < ARRAY_SIZE(aio->req); i++) {
+		id = (aio->next + i) % ARRAY_SIZE(aio->req);
+		ret = async_io_wait(aio, id);
+		if (EFI_ERROR(ret) && !EFI_ERROR(status))
+			status = ret;
+	}
+
+	return status;
+}
+
+static EFI_STATUS submit(struct async_io *aio, BOOLEAN write, UINT64 offset,
+			 UINTN size, VOID *buf, UINTN *id)
+{
+	EFI_STATUS ret;
+	struct async_request *req;
+	UINT32 media_id;
+
+	if (!aio || !buf || !id)
+		return EFI_INVALID_PARAMETER;
+
+	ret = async_io_wait(aio, aio->next);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	req = &aio->req[aio->next];
+	media_id = aio->bio->Media->MediaId;
+	if (write)
+		blkcache_invalidate(aio->bio, offset, size);
+
+	if (aio->dio2) {
+		req->token.TransactionStatus = EFI_SUCCESS;
+		if (write)
+			ret = uefi_call_wrapper(aio->dio2->WriteDiskEx, 6,
+						aio->dio2, media_id, offset,
+						&req->token, size, buf);
+		else
+			ret = uefi_call_wrapper(aio->dio2->ReadDiskEx, 6,
+						aio->dio2, media_id, offset,
+						&req->token, size, buf);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to queue the I/O request");
+			return ret;
+		}
+	} else {
+		if (write)
+			ret = uefi_call_wrapper(aio->dio->WriteDisk, 5,
+						aio->dio, media_id, offset,
+						size, buf);
+		else
+			ret = uefi_call_wrapper(aio->dio->ReadDisk, 5,
+						aio->dio, media_id, offset,
+						size, buf);
+		req->token.TransactionStatus = ret;
+	}
+
+	req->pending = TRUE;
+	*id = aio->next;
+	aio->next = (aio->next + 1) % ARRAY_SIZE(aio->req);
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS async_io_read(struct async_io *aio, UINT64 offset, UINTN size,
+			 VOID *buf, UINTN *id)
+{
+	return submit(aio, FALSE, offset, size, buf, id);
+}
+
+EFI_STATUS async_io_write(struct async_io *aio, UINT64 offset, UINTN size,
+			  VOID *buf, UINTN *id)
+{
+	return submit(aio, TRUE, offset, size, buf, id);
+}
+
+void async_io_close(struct async_io *aio)
+{
+	UINTN i;
+
+	if (!aio)
+		return;
+
+	async_io_wait_all(aio);
+
+	if (aio->dio2)
+		for (i = 0; i < ARRAY_SIZE(aio->req); i++)
+			uefi_call_wrapper(BS->CloseEvent, 1,
+					  aio->req[i].token.Event);
+
+	FreePool(aio);
+}
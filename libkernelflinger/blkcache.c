@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "blkcache.h"
+#include "bootprof.h"
+#include "prefetch.h"
+#include "misc.h"
+#ifdef DYNAMIC_PARTITIONS
+#include "lp_metadata.h"
+#endif
+
+static struct segment {
+	EFI_BLOCK_IO *bio;	/* NULL if the segment is free */
+	UINT32 media_id;
+	UINT64 index;		/* Disk offset / BLKCACHE_SEGMENT_SIZE */
+	UINTN len;		/* Shorter at the end of the disk */
+	UINT64 last_use;
+	UINT8 *data;
+} segments[BLKCACHE_SLOW_SEGMENTS];
+
+/* Active profile, see blkcache_set_slow_media() */
+static UINTN nb_segments = BLKCACHE_SEGMENTS;
+static UINTN max_readahead = BLKCACHE_MAX_READAHEAD;
+
+static UINT8 *pool;		/* Segments data followed by the read buffer */
+static UINT64 use_count;
+
+/* Sequential stream detection */
+static struct {
+	EFI_BLOCK_IO *bio;
+	UINT64 next;
+	UINTN readahead;
+} stream;
+
+static BOOLEAN blkcache_init(void)
+{
+	UINTN i;
+
+	if (pool)
+		return TRUE;
+
+	pool = AllocatePool((nb_segments + max_readahead) *
+			    BLKCACHE_SEGMENT_SIZE);
+	if (!pool)
+		return FALSE;
+
+	for (i = 0; i < nb_segments; i++)
+		segments[i].data = pool + i * BLKCACHE_SEGMENT_SIZE;
+
+	return TRUE;
+}
+
+static struct segment *lookup(EFI_BLOCK_IO *bio, UINT64 index)
+{
+	UINTN i;
+
+	for (i = 0; i < nb_segments; i++)
+		if (segments[i].bio == bio && segments[i].index == index &&
+		    segments[i].media_id == bio->Media->MediaId)
+			return &segments[i];
+
+	return NULL;
+}
+
+static struct segment *victim(void)
+{
+	struct segment *lru = &segments[0];
+	UINTN i;
+
+	for (i = 0; i < nb_segments; i++) {
+		if (!segments[i].bio)
+			return &segments[i];
+		if (segments[i].last_use < lru->last_use)
+			lru = &segments[i];
+	}
+
+	return lru;
+}
+
+/* Read COUNT segments starting at INDEX into the cache and return the
+   first one.  */
+static EFI_STATUS fill(struct gpt_partition_interface *gparti, UINT64 index,
+		       UINTN count, struct segment **seg_p)
+{
+	EFI_BLOCK_IO *bio = gparti->bio;
+	UINT8 *buf = pool + nb_segments * BLKCACHE_SEGMENT_SIZE;
+	UINT64 start, disk_size;
+	struct segment *seg;
+	EFI_STATUS ret;
+	UINTN len, i;
+
+	disk_size = (bio->Media->LastBlock + 1) * bio->Media->BlockSize;
+	start = index * BLKCACHE_SEGMENT_SIZE;
+	if (start >= disk_size)
+		return EFI_INVALID_PARAMETER;
+	len = min((UINT64)count * BLKCACHE_SEGMENT_SIZE, disk_size - start);
+
+	/* The boot I/O profile replay may have read it already */
+	bootprof_record(bio, start, len);
+	ret = prefetch_read(gparti, start, len, buf);
+	if (ret == EFI_NOT_FOUND)
+		ret = uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
+					bio->Media->MediaId, start, len, buf);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	for (i = 0; i * BLKCACHE_SEGMENT_SIZE < len; i++) {
+		seg = lookup(bio, index + i);
+		if (!seg) {
+			seg = victim();
+			seg->bio = bio;
+			seg->media_id = bio->Media->MediaId;
+			seg->index = index + i;
+			seg->len = min(len - i * BLKCACHE_SEGMENT_SIZE,
+				       (UINTN)BLKCACHE_SEGMENT_SIZE);
+			memcpy(seg->data, buf + i * BLKCACHE_SEGMENT_SIZE, seg->len);
+		}
+		seg->last_use = ++use_count;
+		if (!i)
+			*seg_p = seg;
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS blkcache_read(struct gpt_partition_interface *gparti,
+			 UINT64 offset, UINTN size, VOID *buf)
+{
+	EFI_BLOCK_IO *bio;
+	struct segment *seg;
+	UINT64 seg_start;
+	UINTN len;
+	EFI_STATUS ret;
+
+	if (!gparti || !gparti->bio || !gparti->dio || !buf)
+		return EFI_INVALID_PARAMETER;
+
+	bio = gparti->bio;
+	if (size > max_readahead * BLKCACHE_SEGMENT_SIZE || !blkcache_init())
+		return uefi_call_wrapper(gparti->dio->ReadDisk, 5, gparti->dio,
+					 bio->Media->MediaId, offset, size, buf);
+
+	if (stream.bio == bio && stream.next == offset)
+		stream.readahead = min(stream.readahead * 2, max_readahead);
+	else
+		stream.readahead = 1;
+	stream.bio = bio;
+	stream.next = offset + size;
+
+	while (size) {
+		seg = lookup(bio, offset / BLKCACHE_SEGMENT_SIZE);
+		if (seg)
+			seg->last_use = ++use_count;
+		else {
+			ret = fill(gparti, offset / BLKCACHE_SEGMENT_SIZE,
+				   stream.readahead, &seg);
+			if (EFI_ERROR(ret))
+				return ret;
+		}
+
+		seg_start = seg->index * BLKCACHE_SEGMENT_SIZE;
+		if (offset - seg_start >= seg->len)
+			return EFI_INVALID_PARAMETER;
+		len = min(size, (UINTN)(seg->len - (offset - seg_start)));
+		memcpy(buf, seg->data + (offset - seg_start), len);
+
+		buf = (UINT8 *)buf + len;
+		offset += len;
+		size -= len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+void blkcache_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size)
+{
+	UINT64 first, last;
+	UINTN i;
+
+	misc_invalidate(bio, offset, size);
+	prefetch_invalidate(bio, offset, size);
+#ifdef DYNAMIC_PARTITIONS
+	lp_invalidate(bio, offset, size);
+#endif
+
+	first = offset / BLKCACHE_SEGMENT_SIZE;
+	last = size ? (offset + size - 1) / BLKCACHE_SEGMENT_SIZE : first;
+
+	for (i = 0; i < nb_segments; i++) {
+		if (!segments[i].bio)
+			continue;
+		if (bio && (segments[i].bio != bio ||
+			    segments[i].index < first || segments[i].index > last))
+			continue;
+		segments[i].bio = NULL;
+	}
+
+	if (!bio || stream.bio == bio)
+		stream.bio = NULL;
+}
+
+void blkcache_set_slow_media(BOOLEAN slow)
+{
+	UINTN count = slow ? BLKCACHE_SLOW_SEGMENTS : BLKCACHE_SEGMENTS;
+	UINTN readahead = slow ? BLKCACHE_SLOW_MAX_READAHEAD :
+		BLKCACHE_MAX_READAHEAD;
+	UINTN i;
+
+	if (count == nb_segments && readahead == max_readahead)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(segments); i++)
+		segments[i].bio = NULL;
+	stream.bio = NULL;
+	if (pool) {
+		FreePool(pool);
+		pool = NULL;
+	}
+	nb_segments = count;
+	max_readahead = readahead;
+	debug(L"Block cache: %d segments, read-ahead up to %d", count,
+	      readahead);
+}
@@ -62,15 +62,20 @@ struct blobstore {
 	unsigned int hashmap[0]; /* of hashmap_sz */
 } __attribute__((packed));
 
-unsigned int hash_blob_key(char *key, enum blobtype type, unsigned int hsize)
+unsigned int blobstore_key_hash(const char *key)
 {
 	unsigned int hash_val;
 
 	/* based on libcutils hashmapHash() algorithm */
 	for (hash_val = 0; *key != '\0'; key++)
 		hash_val = hash_val * 31 + *key;
-	hash_val = hash_val * 31 + (unsigned int)type;
-	return hash_val % hsize;
+	return hash_val;
+}
+
+static unsigned int hash_blob_key(unsigned int key_hash, enum blobtype type,
+				  unsigned int hsize)
+{
+	return (key_hash * 31 + (unsigned int)type) % hsize;
 }
 
 
@@ -99,19 +104,32 @@ struct blobstore *blobstore_get(void *mem, unsigned int size)
 		return NULL;
 	}
 
+	if (!bs->hashmap_sz ||
+	    bs->hashmap_sz > (size - sizeof(*bs)) / sizeof(bs->hashmap[0])) {
+		error(L"bad blobstore hash table size %u", bs->hashmap_sz);
+		return NULL;
+	}
+
 	return bs;
 }
 
 
-int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
-		       void **data, unsigned int *size)
+static int metablock_fits(struct blobstore *bs, unsigned int offset)
+{
+	return offset <= bs->total_size &&
+		bs->total_size - offset >= sizeof(struct metablock);
+}
+
+int blobstore_get_item_hashed(struct blobstore *bs, const char *key,
+			      unsigned int key_hash, enum blobtype type,
+			      void **data, unsigned int *size)
 {
 	unsigned char *start;
 	unsigned int hash;
 	unsigned int offset;
 	struct metablock *mb;
 
-	hash = hash_blob_key(key, type, bs->hashmap_sz);
+	hash = hash_blob_key(key_hash, type, bs->hashmap_sz);
 	offset = bs->hashmap[hash];
 	start = (unsigned char *)bs;
 
@@ -122,7 +140,7 @@ int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
 		return -2;
 	}
 
-	if (offset >= bs->total_size) {
+	if (!metablock_fits(bs, offset)) {
 		error(L"bad offset in blobstore hash table");
 		return -1;
 	}
@@ -140,6 +158,10 @@ int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
 			return 0;
 		}
 		offset = mb->next_item_offset;
+		if (offset && !metablock_fits(bs, offset)) {
+			error(L"bad offset in blobstore meta block");
+			return -1;
+		}
 	} while (offset);
 
 	/* Not found */
@@ -147,4 +169,11 @@ int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
 	return -2;
 }
 
+int blobstore_get_item(struct blobstore *bs, char *key, enum blobtype type,
+		       void **data, unsigned int *size)
+{
+	return blobstore_get_item_hashed(bs, key, blobstore_key_hash(key),
+					 type, data, size);
+}
+
 
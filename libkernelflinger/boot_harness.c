@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#include <vars.h>
+
+#include "timer.h"
+#include "boottrace.h"
+#include "boot_harness.h"
+
+#define RUN_SIZE	256
+#define NAME_SIZE	16
+
+static void append_entry(CHAR8 *buf, UINTN size, const char *name, UINT64 usec)
+{
+	CHAR8 num[24];
+
+	if (buf[0])
+		strlcat(buf, (CHAR8 *)",", size);
+	strlcat(buf, (CHAR8 *)name, size);
+	strlcat(buf, (CHAR8 *)":", size);
+	itoa((int)usec, num, 10);
+	strlcat(buf, num, size);
+}
+
+/* The duration of each stage is the time elapsed since the previous
+   stage point.  The firmware stage is not traced.  */
+static void format_run(CHAR8 *buf, UINTN size)
+{
+	const struct boottrace_record *rec, *prev = NULL;
+	UINTN i, len;
+
+	buf[0] = '\0';
+	for (i = 0; i < boottrace_count(); i++) {
+		rec = boottrace_get(i);
+		if (rec->event != BT_STAGE || rec->type != BT_POINT)
+			continue;
+		if (prev)
+			append_entry(buf, size, boottime_stage_name(rec->arg),
+				     ticks_to_usec(rec->tsc - prev->tsc));
+		prev = rec;
+	}
+
+	len = strlen(buf);
+	if (len + 1 >= size)
+		return;
+	if (len)
+		buf[len++] = ',';
+	boottrace_summary(buf + len, size - len);
+	if (len && !buf[len])
+		buf[len - 1] = '\0';
+}
+
+static CHAR8 *get_str8(CHAR16 *name)
+{
+	EFI_STATUS ret;
+	CHAR8 *data;
+	UINTN size;
+
+	ret = get_efi_variable(&loader_guid, name, &size, (VOID **)&data, NULL);
+	if (EFI_ERROR(ret))
+		return NULL;
+
+	if (!size || data[size - 1] != '\0') {
+		FreePool(data);
+		return NULL;
+	}
+
+	return data;
+}
+
+static EFI_STATUS set_str8(CHAR16 *name, const CHAR8 *str)
+{
+	if (!str)
+		return del_efi_variable(&loader_guid, name);
+
+	return set_efi_variable(&loader_guid, name, strlen(str) + 1,
+				(VOID *)str, TRUE, FALSE);
+}
+
+UINTN boot_harness_runs(void)
+{
+	unsigned long runs;
+	EFI_STATUS ret;
+
+	ret = get_efi_variable_long_from_str8(&loader_guid,
+					      BOOT_HARNESS_RUNS_VAR, &runs);
+	if (EFI_ERROR(ret))
+		return 0;
+
+	return min(runs, (unsigned long)BOOT_HARNESS_MAX_RUNS);
+}
+
+static EFI_STATUS set_runs(UINTN runs)
+{
+	CHAR8 num[24];
+	EFI_STATUS ret;
+
+	if (!runs) {
+		ret = set_str8(BOOT_HARNESS_RUNS_VAR, NULL);
+		return ret == EFI_NOT_FOUND ? EFI_SUCCESS : ret;
+	}
+
+	itoa((int)runs, num, 10);
+	return set_str8(BOOT_HARNESS_RUNS_VAR, num);
+}
+
+EFI_STATUS boot_harness_arm(UINTN runs)
+{
+	EFI_STATUS ret;
+
+	if (runs > BOOT_HARNESS_MAX_RUNS)
+		return EFI_INVALID_PARAMETER;
+
+	ret = set_str8(BOOT_HARNESS_RESULTS_VAR, NULL);
+	if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND)
+		return ret;
+
+	return set_runs(runs);
+}
+
+EFI_STATUS boot_harness_set_budget(const CHAR8 *budget)
+{
+	EFI_STATUS ret;
+
+	ret = set_str8(BOOT_HARNESS_BUDGET_VAR, budget);
+	return !budget && ret == EFI_NOT_FOUND ? EFI_SUCCESS : ret;
+}
+
+CHAR8 *boot_harness_get_budget(void)
+{
+	return get_str8(BOOT_HARNESS_BUDGET_VAR);
+}
+
+CHAR8 *boot_harness_get_results(void)
+{
+	return get_str8(BOOT_HARNESS_RESULTS_VAR);
+}
+
+static BOOLEAN lookup(const CHAR8 *list, const CHAR8 *name, UINTN name_len,
+		      UINT64 *usec)
+{
+	const CHAR8 *entry, *colon;
+
+	for (entry = list; entry && *entry; entry = (CHAR8 *)strchr(entry, ',')) {
+		if (*entry == ',')
+			entry++;
+		colon = (CHAR8 *)strchr(entry, ':');
+		if (!colon)
+			break;
+		if ((UINTN)(colon - entry) == name_len &&
+		    !strncmp(entry, name, name_len)) {
+			*usec = strtoull((char *)colon + 1, NULL, 10);
+			return TRUE;
+		}
+		entry = colon;
+	}
+
+	return FALSE;
+}
+
+UINTN boot_harness_check(const CHAR8 *run, UINTN len, const CHAR8 *budget,
+			 boot_harness_report_t report)
+{
+	const CHAR8 *entry, *colon, *end = run + len;
+	CHAR8 name[NAME_SIZE];
+	UINT64 usec, limit;
+	UINTN nb = 0, name_len;
+
+	if (!run || !budget)
+		return 0;
+
+	for (entry = run; entry < end; entry = colon) {
+		colon = mem_find(entry, ':', end - entry);
+		if (!colon)
+			break;
+		name_len = colon - entry;
+		usec = strtoull((char *)colon + 1, (char **)&colon, 10);
+		if (colon < end)
+			colon++;
+
+		if (name_len >= sizeof(name) ||
+		    !lookup(budget, entry, name_len, &limit) || usec <= limit)
+			continue;
+
+		nb++;
+		if (report) {
+			memcpy(name, entry, name_len);
+			name[name_len] = '\0';
+			report(name, usec, limit);
+		}
+	}
+
+	return nb;
+}
+
+static void log_regression(const CHAR8 *name, UINT64 usec, UINT64 budget)
+{
+	error(L"Boot harness: %a took %ld us, budget is %ld us",
+	      name, usec, budget);
+}
+
+VOID boot_harness_run_done(VOID)
+{
+	CHAR8 run[RUN_SIZE], *budget, *results, *new;
+	EFI_STATUS ret;
+	UINTN runs, len, size, nb;
+
+	format_run(run, sizeof(run));
+	len = strlen(run);
+
+	budget = boot_harness_get_budget();
+	nb = boot_harness_check(run, len, budget, log_regression);
+	if (budget)
+		FreePool(budget);
+	info(L"Boot harness run, %d regression(s): %a", nb, run);
+
+	results = boot_harness_get_results();
+	if (results) {
+		size = strlen(results) + len + 2;
+		new = AllocatePool(size);
+		if (new) {
+			strcpy(new, results);
+			strlcat(new, (CHAR8 *)"\n", size);
+			strlcat(new, run, size);
+			ret = set_str8(BOOT_HARNESS_RESULTS_VAR, new);
+			FreePool(new);
+		} else
+			ret = EFI_OUT_OF_RESOURCES;
+		FreePool(results);
+	} else
+		ret = set_str8(BOOT_HARNESS_RESULTS_VAR, run);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to save the boot harness run");
+
+	runs = boot_harness_runs();
+	if (runs)
+		runs--;
+	ret = set_runs(runs);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to update the boot harness runs");
+		runs = 0;
+	}
+
+	reboot(runs ? NULL : L"bootloader", EfiResetCold);
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "vars.h"
+#include "prefetch.h"
+#include "bootprof.h"
+
+#define BOOT_IO_PROFILE_VAR	L"BootIOProfile"
+#define BOOTPROF_MAGIC		0x464f5250544f4f42ULL	/* "BOOTPROF" */
+#define BOOTPROF_VERSION	1
+
+/* Extents closer than this are read at once on replay */
+#define BOOTPROF_MERGE_GAP	(128 * 1024)
+#define BOOTPROF_MAX_SIZE	(4 * 1024 * 1024)
+
+struct bootprof_extent {
+	UINT64 offset;
+	UINT32 size;
+} __attribute__((packed));
+
+struct bootprof {
+	UINT64 magic;
+	UINT32 version;
+	UINT32 nb;
+	UINT8 key[BOOTPROF_KEY_SIZE];
+	struct bootprof_extent extents[BOOTPROF_MAX_EXTENTS];
+} __attribute__((packed));
+
+static struct bootprof stored;	/* Profile read by bootprof_replay() */
+static struct bootprof recorded;
+static EFI_BLOCK_IO *recording_bio;
+
+static UINTN bootprof_size(struct bootprof *prof)
+{
+	return offsetof(struct bootprof, extents) +
+		prof->nb * sizeof(*prof->extents);
+}
+
+void bootprof_start(void)
+{
+	struct gpt_partition_interface gparti;
+	EFI_STATUS ret;
+
+	ret = gpt_get_root_disk(&gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Boot I/O profile disabled");
+		return;
+	}
+
+	memset(&recorded, 0, sizeof(recorded));
+	recording_bio = gparti.bio;
+}
+
+void bootprof_record(EFI_BLOCK_IO *bio, UINT64 offset, UINTN size)
+{
+	struct bootprof_extent *ext;
+	UINT64 start, end;
+	UINTN i;
+
+	if (!recording_bio || bio != recording_bio)
+		return;
+
+	/* Reads are mostly sequential within a partition: extend an
+	   extent the read touches or follows */
+	for (i = 0; i < recorded.nb; i++) {
+		ext = &recorded.extents[i];
+		if (offset > ext->offset + ext->size ||
+		    offset + size < ext->offset)
+			continue;
+		start = min(offset, ext->offset);
+		end = max(offset + size, ext->offset + ext->size);
+		if (end - start > BOOTPROF_MAX_SIZE)
+			continue;
+		ext->offset = start;
+		ext->size = end - start;
+		return;
+	}
+
+	if (recorded.nb == ARRAY_SIZE(recorded.extents))
+		return;
+
+	ext = &recorded.extents[recorded.nb++];
+	ext->offset = offset;
+	ext->size = size;
+}
+
+void bootprof_stop(void)
+{
+	recording_bio = NULL;
+}
+
+/* At most BOOTPROF_MAX_EXTENTS extents: insertion sort */
+static void sort_extents(struct bootprof *prof)
+{
+	struct bootprof_extent tmp;
+	UINTN i, j;
+
+	for (i = 1; i < prof->nb; i++) {
+		tmp = prof->extents[i];
+		for (j = i; j > 0 && prof->extents[j - 1].offset > tmp.offset; j--)
+			prof->extents[j] = prof->extents[j - 1];
+		prof->extents[j] = tmp;
+	}
+}
+
+EFI_STATUS bootprof_replay(void)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	struct bootprof *prof;
+	struct bootprof_extent regions[BOOTPROF_MAX_EXTENTS];
+	UINTN size, nb, i, j, best;
+	UINT64 gap, best_gap, end, total;
+
+	ret = get_efi_variable(&loader_guid, BOOT_IO_PROFILE_VAR, &size,
+			       (VOID **)&prof, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (size < offsetof(struct bootprof, extents) ||
+	    prof->magic != BOOTPROF_MAGIC ||
+	    prof->version != BOOTPROF_VERSION ||
+	    prof->nb > BOOTPROF_MAX_EXTENTS ||
+	    size != bootprof_size(prof)) {
+		debug(L"Ignoring the invalid boot I/O profile");
+		FreePool(prof);
+		return EFI_COMPROMISED_DATA;
+	}
+	memcpy(&stored, prof, size);
+	FreePool(prof);
+
+	ret = gpt_get_root_disk(&gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* The profile is stored sorted: merge the neighbor extents,
+	   then the closest ones until they fit in the prefetch
+	   regions */
+	nb = 0;
+	for (i = 0; i < stored.nb; i++) {
+		if (nb && stored.extents[i].offset <=
+		    regions[nb - 1].offset + regions[nb - 1].size +
+		    BOOTPROF_MERGE_GAP) {
+			end = max(regions[nb - 1].offset + regions[nb - 1].size,
+				  stored.extents[i].offset + stored.extents[i].size);
+			regions[nb - 1].size = end - regions[nb - 1].offset;
+			continue;
+		}
+		regions[nb++] = stored.extents[i];
+	}
+
+	while (nb > BOOTPROF_MAX_REGIONS) {
+		best = 0;
+		best_gap = (UINT64)-1;
+		for (i = 0; i + 1 < nb; i++) {
+			gap = regions[i + 1].offset -
+				(regions[i].offset + regions[i].size);
+			if (gap < best_gap) {
+				best_gap = gap;
+				best = i;
+			}
+		}
+		end = max(regions[best].offset + regions[best].size,
+			  regions[best + 1].offset + regions[best + 1].size);
+		regions[best].size = end - regions[best].offset;
+		for (j = best + 1; j + 1 < nb; j++)
+			regions[j] = regions[j + 1];
+		nb--;
+	}
+
+	for (i = 0, total = 0; i < nb; i++) {
+		total += regions[i].size;
+		if (total > BOOTPROF_MAX_SIZE)
+			break;
+		ret = prefetch_disk(&gparti, regions[i].offset, regions[i].size);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to prefetch the boot I/O profile");
+			break;
+		}
+	}
+
+	debug(L"Boot I/O profile: %d extents prefetched in %d reads",
+	      stored.nb, i);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS bootprof_commit(const UINT8 *key, UINTN key_size)
+{
+	EFI_STATUS ret;
+
+	if (!recording_bio)
+		return EFI_NOT_STARTED;
+	recording_bio = NULL;
+
+	recorded.magic = BOOTPROF_MAGIC;
+	recorded.version = BOOTPROF_VERSION;
+	if (key)
+		memcpy(recorded.key, key, min(key_size, sizeof(recorded.key)));
+	sort_extents(&recorded);
+
+	/* The same build reads the same data: only a new build or a
+	   change of the boot flow rewrites the variable */
+	if (stored.nb == recorded.nb &&
+	    !memcmp(&stored, &recorded, bootprof_size(&recorded)))
+		return EFI_SUCCESS;
+
+	ret = set_efi_variable(&loader_guid, BOOT_IO_PROFILE_VAR,
+			       bootprof_size(&recorded), &recorded, TRUE, FALSE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to store the boot I/O profile");
+
+	return ret;
+}
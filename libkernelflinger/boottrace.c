@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "timer.h"
+#include "boottrace.h"
+
+static struct boottrace_record ring[BOOTTRACE_SIZE];
+static UINTN next;
+static UINTN count;
+
+static const char *event_names[BT_EVENT_LAST] = {
+	[BT_STAGE] = "stage",
+	[BT_GPT_LOAD] = "gpt",
+	[BT_BOOTIMG_LOAD] = "bootimg",
+	[BT_AVB_VERIFY] = "avb",
+	[BT_AVB_READ] = "avb_read",
+	[BT_AVB_HASH] = "avb_hash",
+	[BT_TRUSTY_LOAD] = "tos_load",
+	[BT_TRUSTY_START] = "tos_start",
+	[BT_ACPI_INSTALL] = "acpi",
+	[BT_UI_DRAW] = "ui",
+	[BT_VAR_READ] = "var",
+	[BT_TPM_CMD] = "tpm",
+	[BT_HECI_CMD] = "heci",
+	[BT_EXIT_BS] = "exit_bs"
+};
+
+void boottrace(enum boottrace_event event, enum boottrace_type type, UINT32 arg)
+{
+	struct boottrace_record *rec = &ring[next];
+
+	rec->tsc = timer_ticks();
+	rec->event = event;
+	rec->type = type;
+	rec->arg = arg;
+
+	next = (next + 1) % BOOTTRACE_SIZE;
+	if (count < BOOTTRACE_SIZE)
+		count++;
+}
+
+UINTN boottrace_count(void)
+{
+	return count;
+}
+
+const struct boottrace_record *boottrace_get(UINTN index)
+{
+	if (index >= count)
+		return NULL;
+
+	return &ring[(next + BOOTTRACE_SIZE - count + index) % BOOTTRACE_SIZE];
+}
+
+const char *boottrace_event_name(UINT16 event)
+{
+	if (event >= BT_EVENT_LAST)
+		return "unknown";
+	return event_names[event];
+}
+
+UINT64 boottrace_total_usec(enum boottrace_event event)
+{
+	const struct boottrace_record *rec;
+	UINT64 begin = 0, ticks = 0;
+	UINTN i, depth = 0;
+
+	/* Nested scopes of the same event are only accounted once */
+	for (i = 0; i < count; i++) {
+		rec = boottrace_get(i);
+		if (rec->event != event)
+			continue;
+		if (rec->type == BT_BEGIN) {
+			if (depth++ == 0)
+				begin = rec->tsc;
+		} else if (rec->type == BT_END && depth) {
+			if (--depth == 0)
+				ticks += rec->tsc - begin;
+		}
+	}
+
+	return ticks_to_usec(ticks);
+}
+
+void boottrace_summary(CHAR8 *buf, UINTN size)
+{
+	CHAR8 num[24];
+	UINT64 usec;
+	UINTN event;
+
+	if (!buf || !size)
+		return;
+
+	buf[0] = '\0';
+	for (event = BT_STAGE + 1; event < BT_EVENT_LAST; event++) {
+		usec = boottrace_total_usec(event);
+		if (!usec)
+			continue;
+		if (buf[0])
+			strlcat(buf, (CHAR8 *)",", size);
+		strlcat(buf, (CHAR8 *)event_names[event], size);
+		strlcat(buf, (CHAR8 *)":", size);
+		itoa((int)usec, num, 10);
+		strlcat(buf, num, size);
+	}
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "cmdline.h"
+
+#define CMDLINE_FRAGS_STEP	32
+
+void cmdline_init(cmdline_t *cl)
+{
+	memset(cl, 0, sizeof(*cl));
+}
+
+void cmdline_free(cmdline_t *cl)
+{
+	UINTN i;
+
+	for (i = 0; i < cl->nb; i++)
+		if (cl->frags[i].owned)
+			FreePool((VOID *)cl->frags[i].str);
+	if (cl->frags)
+		FreePool(cl->frags);
+	cmdline_init(cl);
+}
+
+static EFI_STATUS add_frag(cmdline_t *cl, const CHAR8 *str, UINTN len,
+			   BOOLEAN front, BOOLEAN owned)
+{
+	struct cmdline_frag *frags;
+
+	if (cl->nb == cl->max) {
+		frags = ReallocatePool(cl->frags, cl->max * sizeof(*frags),
+				       (cl->max + CMDLINE_FRAGS_STEP) * sizeof(*frags));
+		if (!frags)
+			return EFI_OUT_OF_RESOURCES;
+		cl->frags = frags;
+		cl->max += CMDLINE_FRAGS_STEP;
+	}
+
+	cl->frags[cl->nb].str = str;
+	cl->frags[cl->nb].len = len;
+	cl->frags[cl->nb].front = front;
+	cl->frags[cl->nb].owned = owned;
+	cl->nb++;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS add_formatted(cmdline_t *cl, BOOLEAN front,
+				CHAR16 *fmt, va_list args)
+{
+	CHAR16 *str16;
+	CHAR8 *str;
+	UINTN len;
+	EFI_STATUS ret;
+
+	str16 = VPoolPrint(fmt, args);
+	if (!str16)
+		return EFI_OUT_OF_RESOURCES;
+
+	len = StrLen(str16);
+	str = AllocatePool(len + 1);
+	if (!str) {
+		FreePool(str16);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	ret = str_to_stra(str, str16, len + 1);
+	FreePool(str16);
+	if (EFI_ERROR(ret)) {
+		error(L"Non-ascii characters in command line");
+		FreePool(str);
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ret = add_frag(cl, str, len, front, TRUE);
+	if (EFI_ERROR(ret))
+		FreePool(str);
+
+	return ret;
+}
+
+EFI_STATUS cmdline_prepend(cmdline_t *cl, CHAR16 *fmt, ...)
+{
+	va_list args;
+	EFI_STATUS ret;
+
+	va_start(args, fmt);
+	ret = add_formatted(cl, TRUE, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+EFI_STATUS cmdline_append(cmdline_t *cl, CHAR16 *fmt, ...)
+{
+	va_list args;
+	EFI_STATUS ret;
+
+	va_start(args, fmt);
+	ret = add_formatted(cl, FALSE, fmt, args);
+	va_end(args);
+
+	return ret;
+}
+
+EFI_STATUS cmdline_prepend_ref(cmdline_t *cl, const CHAR8 *str, UINTN len)
+{
+	return add_frag(cl, str, len, TRUE, FALSE);
+}
+
+EFI_STATUS cmdline_append_ref(cmdline_t *cl, const CHAR8 *str, UINTN len)
+{
+	return add_frag(cl, str, len, FALSE, FALSE);
+}
+
+UINTN cmdline_len(cmdline_t *cl)
+{
+	UINTN i, len = 0, nb = 0;
+
+	for (i = 0; i < cl->nb; i++) {
+		if (!cl->frags[i].len)
+			continue;
+		len += cl->frags[i].len;
+		nb++;
+	}
+
+	return nb ? len + nb - 1 : 0;
+}
+
+static CHAR8 *emit(CHAR8 *dst, CHAR8 *start, struct cmdline_frag *frag)
+{
+	if (!frag->len)
+		return dst;
+	if (dst != start)
+		*dst++ = ' ';
+	memcpy(dst, frag->str, frag->len);
+	return dst + frag->len;
+}
+
+EFI_STATUS cmdline_build(cmdline_t *cl, CHAR8 *buf, UINTN size)
+{
+	CHAR8 *dst = buf;
+	UINTN i;
+
+	if (!buf || size < cmdline_len(cl) + 1)
+		return EFI_BUFFER_TOO_SMALL;
+
+	for (i = cl->nb; i > 0; i--)
+		if (cl->frags[i - 1].front)
+			dst = emit(dst, buf, &cl->frags[i - 1]);
+
+	for (i = 0; i < cl->nb; i++)
+		if (!cl->frags[i].front)
+			dst = emit(dst, buf, &cl->frags[i]);
+
+	*dst = '\0';
+	return EFI_SUCCESS;
+}
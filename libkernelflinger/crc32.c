@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+#ifdef USE_PCLMUL_CRC32
+#include <immintrin.h>
+#endif
+
+#include "crc32.h"
+
+#define CRC32_POLY 0xEDB88320
+
+/* Slice-by-8 lookup tables, built on first use */
+static UINT32 crc_table[8][256];
+static BOOLEAN crc_table_ready;
+
+static void crc32_init(void)
+{
+	UINT32 c;
+	UINTN i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+		crc_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc_table[j][i] = (crc_table[j - 1][i] >> 8) ^
+				crc_table[0][crc_table[j - 1][i] & 0xff];
+
+	crc_table_ready = TRUE;
+}
+
+static UINT32 crc32_slice8(UINT32 c, const UINT8 *p, UINTN len)
+{
+	UINT32 one, two;
+
+	while (len && ((UINTN)p & 7)) {
+		c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+		len--;
+	}
+
+	for (; len >= 8; len -= 8, p += 8) {
+		one = *(const UINT32 *)p ^ c;
+		two = *(const UINT32 *)(p + 4);
+		c = crc_table[7][one & 0xff] ^
+			crc_table[6][(one >> 8) & 0xff] ^
+			crc_table[5][(one >> 16) & 0xff] ^
+			crc_table[4][one >> 24] ^
+			crc_table[3][two & 0xff] ^
+			crc_table[2][(two >> 8) & 0xff] ^
+			crc_table[1][(two >> 16) & 0xff] ^
+			crc_table[0][two >> 24];
+	}
+
+	while (len--)
+		c = crc_table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+
+	return c;
+}
+
+#ifdef USE_PCLMUL_CRC32
+/* Folding CRC32 computation using the carry-less multiplication
+   instruction, see "Fast CRC Computation for Generic Polynomials
+   Using PCLMULQDQ Instruction", Intel white paper.  LEN must be a
+   multiple of 16 and at least 64.  */
+static UINT32 crc32_pclmul(UINT32 crc, const UINT8 *buf, UINTN len)
+{
+	static const UINT64 __attribute__((aligned(16))) k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+	static const UINT64 __attribute__((aligned(16))) k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+	static const UINT64 __attribute__((aligned(16))) k5k0[] = { 0x0163cd6124, 0x0000000000 };
+	static const UINT64 __attribute__((aligned(16))) poly[] = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((__m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((__m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((__m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((__m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((__m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* Fold by 4 */
+	for (; len >= 64; len -= 64, buf += 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((__m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((__m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((__m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((__m128i *)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+	}
+
+	/* Fold into 128 bits */
+	x0 = _mm_load_si128((__m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold the remaining 16 bytes blocks */
+	for (; len >= 16; len -= 16, buf += 16) {
+		x2 = _mm_loadu_si128((__m128i *)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	}
+
+	/* Fold 128 bits to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((__m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((__m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+
+static BOOLEAN has_pclmul(void)
+{
+	static enum { UNKNOWN, NO, YES } pclmul = UNKNOWN;
+	UINT32 reg[4];
+
+	if (pclmul == UNKNOWN) {
+		cpuid(1, reg);
+		/* ECX bit 1: PCLMULQDQ, ECX bit 19: SSE4.1 */
+		pclmul = (reg[2] & (1 << 1)) && (reg[2] & (1 << 19)) ? YES : NO;
+	}
+
+	return pclmul == YES;
+}
+#endif
+
+UINT32 crc32_update(UINT32 crc, const VOID *data, UINTN size)
+{
+	const UINT8 *p = data;
+	UINT32 c = ~crc;
+#ifdef USE_PCLMUL_CRC32
+	UINTN len;
+#endif
+
+	if (!crc_table_ready)
+		crc32_init();
+
+#ifdef USE_PCLMUL_CRC32
+	if (size >= 64 && has_pclmul()) {
+		len = size & ~(UINTN)15;
+		c = crc32_pclmul(c, p, len);
+		p += len;
+		size -= len;
+	}
+#endif
+
+	return ~crc32_slice8(c, p, size);
+}
+
+/* CRC32 combination using GF(2) matrix operators, as done by zlib */
+static UINT32 gf2_matrix_times(const UINT32 *mat, UINT32 vec)
+{
+	UINT32 sum = 0;
+
+	for (; vec; vec >>= 1, mat++)
+		if (vec & 1)
+			sum ^= *mat;
+
+	return sum;
+}
+
+static void gf2_matrix_square(UINT32 *square, const UINT32 *mat)
+{
+	UINTN n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+UINT32 crc32_combine(UINT32 crc1, UINT32 crc2, UINT64 len2)
+{
+	UINT32 even[32], odd[32];
+	UINT32 row;
+	UINTN n;
+
+	if (!len2)
+		return crc1;
+
+	/* Operator for one zero bit in ODD */
+	odd[0] = CRC32_POLY;
+	for (n = 1, row = 1; n < 32; n++, row <<= 1)
+		odd[n] = row;
+
+	/* Operators for two and four zero bits */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	/* Apply LEN2 zero bytes to CRC1 */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (!len2)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2);
+
+	return crc1 ^ crc2;
+}
+
+UINT32 crc32_repeat(UINT32 crc, const VOID *data, UINTN size, UINT64 count)
+{
+	UINT32 block_crc;
+	UINT64 block_len;
+
+	block_crc = crc32_update(0, data, size);
+	block_len = size;
+
+	/* Square-and-multiply over the number of repetitions */
+	for (; count; count >>= 1) {
+		if (count & 1)
+			crc = crc32_combine(crc, block_crc, block_len);
+		block_crc = crc32_combine(block_crc, block_crc, block_len);
+		block_len <<= 1;
+	}
+
+	return crc;
+}
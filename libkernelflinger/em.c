@@ -32,6 +32,7 @@
 
 #include "acpi.h"
 #include "lib.h"
+#include "protocol.h"
 #include "protocol/ChargingAppletProtocol.h"
 
 #include "em.h"
@@ -53,8 +54,8 @@ static EFI_STATUS get_battery_status(struct battery_status *status)
         CHARGING_APPLET_PROTOCOL *charging_protocol;
         EFI_STATUS ret;
 
-        ret = LibLocateProtocol(&gChargingAppletProtocolGuid,
-                                (VOID **)&charging_protocol);
+        ret = locate_protocol_cached(&gChargingAppletProtocolGuid,
+                                     (VOID **)&charging_protocol);
         if (EFI_ERROR(ret))
                 goto error;
 
@@ -76,14 +77,14 @@ error:
         return ret;
 }
 
-BOOLEAN is_charger_plugged_in(void)
+static EFI_STATUS get_charger_plugged(BOOLEAN *plugged)
 {
         CHARGING_APPLET_PROTOCOL *charging_protocol;
         CHARGER_TYPE type;
         EFI_STATUS ret;
 
-        ret = LibLocateProtocol(&gChargingAppletProtocolGuid,
-                                (VOID **)&charging_protocol);
+        ret = locate_protocol_cached(&gChargingAppletProtocolGuid,
+                                     (VOID **)&charging_protocol);
         if (EFI_ERROR(ret))
                 goto error;
 
@@ -92,11 +93,111 @@ BOOLEAN is_charger_plugged_in(void)
         if (EFI_ERROR(ret))
                 goto error;
 
-        return type != ChargerUndefined;
+        *plugged = type != ChargerUndefined;
+        return EFI_SUCCESS;
 
 error:
         efi_perror(ret, L"Failed to get charger status");
-        return FALSE;
+        return ret;
+}
+
+/* Battery and charger status refreshed in the background by the
+   em_start_polling() timer.  The charging protocol is only called
+   from the timer notification while it runs so that a refresh never
+   interrupts another call.  */
+static struct {
+        EFI_EVENT event;
+        EFI_STATUS ret;
+        struct battery_status status;
+        BOOLEAN charger_plugged;
+} poll;
+
+static void poll_refresh(void)
+{
+        poll.ret = get_battery_status(&poll.status);
+        if (EFI_ERROR(get_charger_plugged(&poll.charger_plugged)))
+                poll.charger_plugged = FALSE;
+}
+
+static void EFIAPI poll_notify(__attribute__((__unused__)) EFI_EVENT event,
+                               __attribute__((__unused__)) VOID *context)
+{
+        poll_refresh();
+}
+
+EFI_STATUS em_start_polling(UINT32 period_ms)
+{
+        EFI_STATUS ret;
+
+        if (poll.event)
+                return EFI_SUCCESS;
+
+        poll_refresh();
+        if (poll.ret == EFI_NOT_FOUND || poll.ret == EFI_UNSUPPORTED)
+                return poll.ret;
+
+        ret = uefi_call_wrapper(BS->CreateEvent, 5,
+                                EVT_TIMER | EVT_NOTIFY_SIGNAL, TPL_CALLBACK,
+                                poll_notify, NULL, &poll.event);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to create the battery polling event");
+                poll.event = NULL;
+                return ret;
+        }
+
+        ret = uefi_call_wrapper(BS->SetTimer, 3, poll.event, TimerPeriodic,
+                                (UINT64)period_ms * 10000);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to start the battery polling timer");
+                em_stop_polling();
+        }
+
+        return ret;
+}
+
+void em_stop_polling(void)
+{
+        if (!poll.event)
+                return;
+
+        uefi_call_wrapper(BS->CloseEvent, 1, poll.event);
+        poll.event = NULL;
+}
+
+/* Read the polled status if the polling is running, query the
+   charging protocol otherwise.  */
+static EFI_STATUS read_battery_status(struct battery_status *status,
+                                      BOOLEAN *charger_plugged)
+{
+        EFI_STATUS ret;
+        EFI_TPL tpl;
+
+        if (!poll.event) {
+                if (status)
+                        return get_battery_status(status);
+                ret = get_charger_plugged(charger_plugged);
+                if (EFI_ERROR(ret))
+                        *charger_plugged = FALSE;
+                return ret;
+        }
+
+        tpl = uefi_call_wrapper(BS->RaiseTPL, 1, TPL_CALLBACK);
+        ret = poll.ret;
+        if (status)
+                *status = poll.status;
+        if (charger_plugged)
+                *charger_plugged = poll.charger_plugged;
+        uefi_call_wrapper(BS->RestoreTPL, 1, tpl);
+
+        return ret;
+}
+
+BOOLEAN is_charger_plugged_in(void)
+{
+        BOOLEAN plugged = FALSE;
+
+        read_battery_status(NULL, &plugged);
+        return plugged;
 }
 
 BOOLEAN is_battery_below_boot_OS_threshold(void)
@@ -106,7 +207,7 @@ BOOLEAN is_battery_below_boot_OS_threshold(void)
         UINTN value, threshold;
         UINT8 ia_apps_to_use;
 
-        ret = get_battery_status(&status);
+        ret = read_battery_status(&status, NULL);
         if (EFI_ERROR(ret))
                 return FALSE;
 
@@ -143,7 +244,7 @@ EFI_STATUS get_battery_voltage(UINTN *voltage)
         struct battery_status status;
         EFI_STATUS ret;
 
-        ret = get_battery_status(&status);
+        ret = read_battery_status(&status, NULL);
         if (EFI_ERROR(ret))
                 return ret;
 
@@ -169,4 +270,13 @@ EFI_STATUS get_battery_voltage(__attribute__((__unused__)) UINTN *voltage)
         debug(L"WARNING: charging protocol is disabled");
         return EFI_UNSUPPORTED;
 }
+
+EFI_STATUS em_start_polling(__attribute__((__unused__)) UINT32 period_ms)
+{
+        return EFI_UNSUPPORTED;
+}
+
+void em_stop_polling(void)
+{
+}
 #endif  /* USE_CHARGING_APPLET */
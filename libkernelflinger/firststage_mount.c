@@ -42,78 +42,144 @@
 #include "storage.h"
 
 #ifdef AUTO_DISKBUS
-static CHAR8 csum(void *base, UINTN n)
+/* The disk bus placeholder of the first stage mount device paths is
+   replaced with the boot device PCI device and function, "ff.ff/"
+   becoming for instance "1a.0//".  */
+static const CHAR8 DISKBUS_PATTERN[] = "/0000:00:ff.ff/";
+#define DISKBUS_PATTERN_LEN	(sizeof(DISKBUS_PATTERN) - 1)
+#define DISKBUS_SUFFIX_LEN	6
+
+/* Offsets of the disk bus suffixes in the built-in table, found on
+   the first patch, and the disk bus they hold */
+#define AML_DISKBUS_MAX		8
+static struct {
+	BOOLEAN patched;
+	UINTN count;
+	UINTN offsets[AML_DISKBUS_MAX];
+	CHAR8 diskbus[DISKBUS_SUFFIX_LEN];
+} aml_diskbus;
+
+static EFI_STATUS get_diskbus(CHAR8 diskbus[DISKBUS_SUFFIX_LEN])
 {
-	CHAR8 *p;
-	CHAR8 sum;
-	UINTN bytesDone;
+	CHAR8 str[DISKBUS_SUFFIX_LEN];
+	PCI_DEVICE_PATH *boot_device;
+	UINTN i;
 
-	p = (CHAR8 *)base;
+	boot_device = get_boot_device();
+	if (!boot_device) {
+		error(L"Boot device not found!");
+		return EFI_DEVICE_ERROR;
+	}
+
+	efi_snprintf(str, sizeof(str), (CHAR8 *)"%02x.%x",
+		     boot_device->Device, boot_device->Function);
 
-	sum = 0;
-	for (bytesDone = 0; bytesDone < n; bytesDone++) {
-		sum += *p;
-		p++;
+	/* in BIOS, format string "%x" doesn't work in a standard way,
+	 * it output uper case of "A" to "F" of hex number in stead of
+	 * "a" to "f" and cause a mismatch with kernel
+	 */
+	for (i = 0; str[i] && i < DISKBUS_SUFFIX_LEN - 1; i++)
+		diskbus[i] = tolower(str[i]);
+	for (; i < DISKBUS_SUFFIX_LEN; i++)
+		diskbus[i] = '/';
+
+	return EFI_SUCCESS;
+}
+
+/* Write DISKBUS at OFFSET and update the table checksum with the
+   difference of the byte sums instead of summing the whole table */
+static void write_diskbus(CHAR8 *ssdt, UINTN offset,
+			  const CHAR8 diskbus[DISKBUS_SUFFIX_LEN])
+{
+	struct ACPI_DESC_HEADER *header = (struct ACPI_DESC_HEADER *)ssdt;
+	CHAR8 delta = 0;
+	UINTN i;
+
+	for (i = 0; i < DISKBUS_SUFFIX_LEN; i++) {
+		delta += diskbus[i] - ssdt[offset + i];
+		ssdt[offset + i] = diskbus[i];
 	}
+	header->checksum -= delta;
+}
 
-	return sum;
+/* Offset of the disk bus suffix of the next placeholder at or after
+   *POS, 0 if there is none */
+static UINTN find_diskbus(CHAR8 *ssdt, UINTN ssdt_len, UINTN *pos)
+{
+	const CHAR8 *p;
+	UINTN offset;
+
+	while (*pos + DISKBUS_PATTERN_LEN <= ssdt_len) {
+		p = mem_find(ssdt + *pos, DISKBUS_PATTERN[0],
+			     ssdt_len - DISKBUS_PATTERN_LEN + 1 - *pos);
+		if (!p)
+			break;
+
+		offset = p - ssdt;
+		*pos = offset + 1;
+		if (!memcmp(p, DISKBUS_PATTERN, DISKBUS_PATTERN_LEN)) {
+			*pos = offset + DISKBUS_PATTERN_LEN;
+			return offset + DISKBUS_PATTERN_LEN - DISKBUS_SUFFIX_LEN;
+		}
+	}
+
+	return 0;
 }
 
 EFI_STATUS revise_diskbus_from_ssdt(CHAR8 *ssdt, UINTN ssdt_len)
 {
-	const CHAR8 *pattern = (CHAR8 *)"/0000:00:ff.ff/";
-	const UINTN diskbus_sufix_len = 6; /* Sample: "ff.ff/" or "ff.f//" */
-	UINTN pattern_len;
-	struct ACPI_DESC_HEADER *header;
-	UINTN header_len;
-	CHAR8 *p, *max_end, *i;
-	PCI_DEVICE_PATH *boot_device;
+	CHAR8 diskbus[DISKBUS_SUFFIX_LEN];
+	UINTN pos, offset;
+	EFI_STATUS ret;
 
-	header_len = sizeof(struct ACPI_DESC_HEADER);
-	if (ssdt_len < header_len) {
+	if (ssdt_len < sizeof(struct ACPI_DESC_HEADER)) {
 		error(L"ACPI: invalid parameter for revise diskbus.");
 		return EFI_INVALID_PARAMETER;
 	}
 
-	/* Initialize the variables. */
-	pattern_len = strlen(pattern);
-	boot_device = get_boot_device();
-	if (!boot_device) {
-		error(L"Boot device not found!");
-		return EFI_DEVICE_ERROR;
-	}
-
-	p = ssdt + header_len;
-	max_end = ssdt + ssdt_len - pattern_len;
+	ret = get_diskbus(diskbus);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	/* Find and revise the diskbus. */
-	while (p < max_end) {
-		/* Find the diskbus. */
-		if (*p != pattern[0] || memcmp(p, pattern, pattern_len)) {
-			p++;
-			continue;
-		}
+	pos = sizeof(struct ACPI_DESC_HEADER);
+	while ((offset = find_diskbus(ssdt, ssdt_len, &pos)))
+		write_diskbus(ssdt, offset, diskbus);
 
-		/* Revise the diskbus. */
-		p += pattern_len - diskbus_sufix_len;
-		efi_snprintf(p, diskbus_sufix_len, (CHAR8 *)"%02x.%x",
-			     boot_device->Device, boot_device->Function);
+	return EFI_SUCCESS;
+}
 
-		/* in BIOS, format string "%x" doesn't work in a standard way,
-		 * it output uper case of "A" to "F" of hex number in stead of
-		 * "a" to "f" and cause a mismatch with kernel
-		 */
-		for(i = p; i < p + diskbus_sufix_len; i++)
-			*i = tolower(*i);
+/* The built-in table is patched in place: the placeholders are only
+   searched once, and written again only if the boot device changes */
+static EFI_STATUS revise_diskbus_from_aml(CHAR8 *ssdt, UINTN ssdt_len)
+{
+	CHAR8 diskbus[DISKBUS_SUFFIX_LEN];
+	UINTN i, pos, offset;
+	EFI_STATUS ret;
 
-		p += strlen(p);
-		*p++ = '/';
-	}
+	ret = get_diskbus(diskbus);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!aml_diskbus.patched) {
+		if (ssdt_len < sizeof(struct ACPI_DESC_HEADER))
+			return EFI_INVALID_PARAMETER;
+
+		aml_diskbus.count = 0;
+		pos = sizeof(struct ACPI_DESC_HEADER);
+		while ((offset = find_diskbus(ssdt, ssdt_len, &pos))) {
+			if (aml_diskbus.count == AML_DISKBUS_MAX) {
+				error(L"Too many disk bus placeholders");
+				return EFI_BUFFER_TOO_SMALL;
+			}
+			aml_diskbus.offsets[aml_diskbus.count++] = offset;
+		}
+	} else if (!memcmp(aml_diskbus.diskbus, diskbus, sizeof(diskbus)))
+		return EFI_SUCCESS;
 
-	/* Update the header information. */
-	header = (struct ACPI_DESC_HEADER *)ssdt;
-	header->checksum = 0;
-	header->checksum = ~csum((void *)ssdt, ssdt_len) + 1;
+	for (i = 0; i < aml_diskbus.count; i++)
+		write_diskbus(ssdt, aml_diskbus.offsets[i], diskbus);
+	memcpy(aml_diskbus.diskbus, diskbus, sizeof(diskbus));
+	aml_diskbus.patched = TRUE;
 
 	return EFI_SUCCESS;
 }
@@ -134,7 +200,7 @@ EFI_STATUS install_firststage_mount_aml(enum boot_target target)
 		debug(L"Install firststage_mount_ssdt, target=%d", target);
 
 #ifdef AUTO_DISKBUS
-		ret = revise_diskbus_from_ssdt((CHAR8 *)ssdt, ssdt_len);
+		ret = revise_diskbus_from_aml((CHAR8 *)ssdt, ssdt_len);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"ACPI: fail to revise diskbus");
 			return ret;
@@ -32,6 +32,8 @@
  *
  */
 
+#define LOG_MODULE LOG_MODULE_GPT
+
 #include <efi.h>
 #include <efilib.h>
 #include <lib.h>
@@ -39,6 +41,14 @@
 #include "gpt.h"
 #include "gpt_bin.h"
 #include "storage.h"
+#include "crc32.h"
+#include "vars.h"
+#include "boottrace.h"
+#include "blkcache.h"
+#include "timer.h"
+#include "async_io.h"
+#include "io_buffer.h"
+#include "protocol.h"
 
 #define PROTECTIVE_MBR 0xEE
 
@@ -79,6 +89,10 @@ struct mbr {
 
 #define GPT_REVISION 0x00010000
 
+/* Size of the partition name hash index, a power of two.  Every
+   partition can be indexed under two names, see gpt_build_index().  */
+#define GPT_INDEX_SIZE (4 * GPT_ENTRIES)
+
 struct gpt_disk {
 	EFI_BLOCK_IO *bio;
 	EFI_DISK_IO *dio;
@@ -87,20 +101,38 @@ struct gpt_disk {
 	logical_unit_t log_unit;
 	struct gpt_header gpt_hd;
 	struct gpt_partition partitions[GPT_ENTRIES];
+	BOOLEAN indexed;
+	UINT8 index[GPT_INDEX_SIZE];
 };
 
 /* Allow to scan and flash only one disk at a time
  * this disk could be emmc user area or emmc gpp */
 static struct gpt_disk sdisk;
 
+/* Incremented each time the cached partition table is reloaded or
+   modified, see gpt_cache_generation() */
+static UINT32 generation;
+
+/* Block IO interface reinstallation requested by gpt_refresh() and
+   not done yet, see gpt_defer_refresh() */
+static struct {
+	BOOLEAN deferred;
+	BOOLEAN pending;
+	EFI_HANDLE handle;
+	EFI_BLOCK_IO *bio;
+} refresh;
+
+/* Write cache flushes, see gpt_defer_flush() */
+static struct {
+	BOOLEAN deferred;
+	EFI_BLOCK_IO *pending;
+	struct gpt_flush_stats stats;
+} flush;
+
 static EFI_STATUS calculate_crc32(void *data, UINTN size, UINT32 *crc)
 {
-	EFI_STATUS ret;
-
-	ret = uefi_call_wrapper(BS->CalculateCrc32, 3, data, size, crc);
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"CalculateCrc32 failed");
-	return ret;
+	*crc = crc32_update(0, data, size);
+	return EFI_SUCCESS;
 }
 
 static EFI_STATUS set_header_crc32(struct gpt_header *gh)
@@ -249,6 +281,129 @@ static EFI_STATUS gpt_list_partition_on_disk(struct gpt_disk *disk)
 	return EFI_SUCCESS;
 }
 
+#ifdef USE_GPT_CACHE
+/* The partition array of each logical unit is saved in an EFI
+   variable along with the GPT header it was read with.  On the next
+   boots, if the primary GPT header on the disk is unchanged, the
+   partition array is taken from the variable instead of the disk.
+   Only the used entries are saved, the others are zeroes.  */
+#define GPT_CACHE_VAR	L"GptCache%d"
+#define GPT_CACHE_MAGIC	0x43545047	/* "GPTC" */
+
+struct gpt_cache {
+	UINT32 magic;
+	UINT32 nb_entries;
+	struct gpt_header gpt_hd;
+	struct gpt_partition partitions[0];
+} __attribute__((packed));
+
+static void gpt_cache_var_name(logical_unit_t log_unit, CHAR16 *name,
+			       UINTN size)
+{
+	SPrint(name, size, GPT_CACHE_VAR, log_unit);
+}
+
+static EFI_STATUS gpt_load_cache(struct gpt_disk *disk)
+{
+	EFI_STATUS ret;
+	CHAR16 name[16];
+	struct gpt_cache *cache;
+	UINTN size, entries_size;
+	UINT32 flags, crc;
+
+	if (disk->gpt_hd.my_lba != 1 ||
+	    disk->gpt_hd.number_of_entries > GPT_ENTRIES ||
+	    disk->gpt_hd.size_of_entry != sizeof(struct gpt_partition))
+		return EFI_UNSUPPORTED;
+
+	gpt_cache_var_name(disk->log_unit, name, sizeof(name));
+	ret = get_efi_variable(&fastboot_guid, name, &size,
+			       (VOID **)&cache, &flags);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = EFI_NOT_FOUND;
+	if (size < sizeof(*cache) || cache->magic != GPT_CACHE_MAGIC ||
+	    cache->nb_entries > disk->gpt_hd.number_of_entries ||
+	    size != sizeof(*cache) +
+	    cache->nb_entries * sizeof(struct gpt_partition))
+		goto out;
+
+	/* The disk GUID, the LBAs and both CRC32 must be the same */
+	if (memcmp(&cache->gpt_hd, &disk->gpt_hd, sizeof(disk->gpt_hd)))
+		goto out;
+
+	entries_size = disk->gpt_hd.number_of_entries * sizeof(struct gpt_partition);
+	ZeroMem(disk->partitions, entries_size);
+	memcpy(disk->partitions, cache->partitions,
+	       cache->nb_entries * sizeof(struct gpt_partition));
+
+	calculate_crc32(disk->partitions, entries_size, &crc);
+	if (crc != disk->gpt_hd.entries_crc32) {
+		ret = EFI_COMPROMISED_DATA;
+		goto out;
+	}
+
+	debug(L"Partition array of logical unit %d loaded from %s",
+	      disk->log_unit, name);
+	ret = EFI_SUCCESS;
+
+out:
+	FreePool(cache);
+	return ret;
+}
+
+static void gpt_save_cache(struct gpt_disk *disk)
+{
+	EFI_STATUS ret;
+	CHAR16 name[16];
+	struct gpt_cache *cache, *saved;
+	UINTN nb_entries, size, saved_size;
+	BOOLEAN unchanged;
+
+	if (disk->gpt_hd.my_lba != 1 ||
+	    disk->gpt_hd.size_of_entry != sizeof(struct gpt_partition))
+		return;
+
+	for (nb_entries = disk->gpt_hd.number_of_entries; nb_entries; nb_entries--)
+		if (CompareGuid(&disk->partitions[nb_entries - 1].type,
+				&NullGuid))
+			break;
+
+	size = sizeof(*cache) + nb_entries * sizeof(struct gpt_partition);
+	cache = AllocatePool(size);
+	if (!cache)
+		return;
+
+	cache->magic = GPT_CACHE_MAGIC;
+	cache->nb_entries = nb_entries;
+	memcpy(&cache->gpt_hd, &disk->gpt_hd, sizeof(cache->gpt_hd));
+	memcpy(cache->partitions, disk->partitions,
+	       nb_entries * sizeof(struct gpt_partition));
+
+	/* Spare the flash wear and the variable store reclaim when
+	   the saved copy is already up to date */
+	gpt_cache_var_name(disk->log_unit, name, sizeof(name));
+	ret = get_efi_variable(&fastboot_guid, name, &saved_size,
+			       (VOID **)&saved, NULL);
+	if (!EFI_ERROR(ret)) {
+		unchanged = saved_size == size && !memcmp(saved, cache, size);
+		FreePool(saved);
+		if (unchanged)
+			goto out;
+	}
+
+	ret = set_efi_variable(&fastboot_guid, name, size, cache, TRUE, FALSE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to save the partition array cache");
+
+out:
+	FreePool(cache);
+}
+#endif
+
+static void gpt_build_index(void);
+
 /* Given the logical unit, find the disk and caches
  * information into the global sdisk variable */
 static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
@@ -269,6 +424,7 @@ static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
 		efi_perror(ret, L"Failed to locate Block IO Protocol");
 		return ret;
 	}
+	boottrace_begin(BT_GPT_LOAD, log_unit);
 	debug(L"Found %d block io protocols", nb_handle);
 
 	for (i = 0; i < nb_handle && !found; i++) {
@@ -286,6 +442,7 @@ static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
 
 		sdisk.handle = handles[i];
 		sdisk.log_unit = log_unit;
+		generation++;
 		found = TRUE;
 	}
 	if (!found) {
@@ -294,42 +451,162 @@ static EFI_STATUS gpt_cache_partition(logical_unit_t log_unit)
 		goto free_handles;
 	}
 
+#ifdef USE_GPT_CACHE
+	if (is_gpt_device(&sdisk.gpt_hd) && !EFI_ERROR(gpt_load_cache(&sdisk))) {
+		gpt_build_index();
+		ret = EFI_SUCCESS;
+		goto free_handles;
+	}
+#endif
+
 	ret = gpt_list_partition_on_disk(&sdisk);
 	/* ignore if there are no gpt partition on the system disk */
 	if (EFI_ERROR(ret)) {
 		ZeroMem(&sdisk.gpt_hd, sizeof(struct gpt_header));
 	}
+#ifdef USE_GPT_CACHE
+	else
+		gpt_save_cache(&sdisk);
+#endif
+	gpt_build_index();
 	ret = EFI_SUCCESS;
 
 free_handles:
+	boottrace_end(BT_GPT_LOAD, log_unit);
 	FreePool(handles);
 	return ret;
 }
 
 void gpt_free_cache(void)
 {
+	gpt_flush_pending();
+
 	ZeroMem(&sdisk, sizeof(sdisk));
+	generation++;
 }
 
-EFI_STATUS gpt_sync(void)
+UINT32 gpt_cache_generation(void)
 {
-	EFI_STATUS ret;
+	return generation;
+}
 
-	if (!sdisk.bio)
-		return EFI_SUCCESS;
+static EFI_STATUS flush_blocks(EFI_BLOCK_IO *bio)
+{
+	EFI_STATUS ret;
+	uint64_t start = timer_ticks();
 
-	ret = uefi_call_wrapper(sdisk.bio->FlushBlocks, 1, sdisk.bio);
+	ret = uefi_call_wrapper(bio->FlushBlocks, 1, bio);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to flush block io interface");
 
+	flush.stats.flushes++;
+	flush.stats.usec += ticks_to_usec(timer_ticks() - start);
+	if (flush.pending == bio)
+		flush.pending = NULL;
+
 	return ret;
 }
 
+EFI_STATUS gpt_sync(void)
+{
+	if (!sdisk.bio)
+		return EFI_SUCCESS;
+
+	return flush_blocks(sdisk.bio);
+}
+
+EFI_STATUS gpt_sync_data(void)
+{
+	if (!sdisk.bio)
+		return EFI_SUCCESS;
+
+	if (!flush.deferred)
+		return gpt_sync();
+
+	if (flush.pending && flush.pending != sdisk.bio)
+		gpt_flush_pending();
+	flush.pending = sdisk.bio;
+	flush.stats.deferred++;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS gpt_flush_pending(void)
+{
+	if (!flush.pending)
+		return EFI_SUCCESS;
+
+	return flush_blocks(flush.pending);
+}
+
+EFI_STATUS gpt_defer_flush(BOOLEAN defer)
+{
+	flush.deferred = defer;
+	return defer ? EFI_SUCCESS : gpt_flush_pending();
+}
+
+BOOLEAN gpt_flush_deferred(void)
+{
+	return flush.deferred;
+}
+
+const struct gpt_flush_stats *gpt_get_flush_stats(void)
+{
+	return &flush.stats;
+}
+
+void gpt_reset_flush_stats(void)
+{
+	memset(&flush.stats, 0, sizeof(flush.stats));
+}
+
+EFI_STATUS gpt_commit_refresh(void)
+{
+	EFI_STATUS ret;
+
+	if (!refresh.pending)
+		return EFI_SUCCESS;
+
+	refresh.pending = FALSE;
+	ret = uefi_call_wrapper(BS->ReinstallProtocolInterface, 4, refresh.handle,
+				&BlockIoProtocol, refresh.bio, refresh.bio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to Reinstall block io interface on System disk");
+		return ret;
+	}
+
+	/* The partition handles have been destroyed and recreated */
+	protocol_cache_invalidate();
+
+	/* The firmware rebuilt the partition handles and the disk IO
+	   interface of the disk, the cached partition table is still
+	   valid */
+	if (sdisk.handle != refresh.handle)
+		return EFI_SUCCESS;
+
+	ret = uefi_call_wrapper(BS->HandleProtocol, 3, sdisk.handle,
+				&DiskIoProtocol, (VOID *)&sdisk.dio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get disk io protocol");
+		gpt_free_cache();
+		return ret;
+	}
+	generation++;
+
+	return EFI_SUCCESS;
+}
+
+void gpt_defer_refresh(BOOLEAN defer)
+{
+	if (!defer)
+		gpt_commit_refresh();
+	refresh.deferred = defer;
+}
+
 EFI_STATUS gpt_refresh(void)
 {
 	EFI_STATUS ret;
 
-	ret = gpt_sync();
+	ret = gpt_sync_data();
 	if (EFI_ERROR(ret))
 		return ret;
 
@@ -337,15 +614,17 @@ EFI_STATUS gpt_refresh(void)
 	if (!sdisk.bio)
 		return EFI_SUCCESS;
 
-	ret = uefi_call_wrapper(BS->ReinstallProtocolInterface, 4, sdisk.handle, &BlockIoProtocol, sdisk.bio, sdisk.bio);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to Reinstall block io interface on System disk");
-		return ret;
+	if (refresh.pending && refresh.handle != sdisk.handle) {
+		ret = gpt_commit_refresh();
+		if (EFI_ERROR(ret))
+			return ret;
 	}
-	/* invalid gpt cache to force to get new handle next time */
-	gpt_free_cache();
 
-	return EFI_SUCCESS;
+	refresh.pending = TRUE;
+	refresh.handle = sdisk.handle;
+	refresh.bio = sdisk.bio;
+
+	return refresh.deferred ? EFI_SUCCESS : gpt_commit_refresh();
 }
 
 EFI_STATUS gpt_get_root_disk(struct gpt_partition_interface *gpart, logical_unit_t log_unit)
@@ -367,6 +646,92 @@ EFI_STATUS gpt_get_root_disk(struct gpt_partition_interface *gpart, logical_unit
 	return EFI_SUCCESS;
 }
 
+static EFI_STATUS disk_io_rw(struct gpt_partition_interface *gpart,
+			     BOOLEAN write, UINT64 offset, UINTN size,
+			     VOID *buf)
+{
+	UINT32 media_id = gpart->bio->Media->MediaId;
+
+	if (write)
+		return uefi_call_wrapper(gpart->dio->WriteDisk, 5, gpart->dio,
+					 media_id, offset, size, buf);
+
+	return uefi_call_wrapper(gpart->dio->ReadDisk, 5, gpart->dio,
+				 media_id, offset, size, buf);
+}
+
+static EFI_STATUS block_io_rw(struct gpt_partition_interface *gpart,
+			      BOOLEAN write, EFI_LBA lba, UINTN size,
+			      VOID *buf)
+{
+	EFI_BLOCK_IO *bio = gpart->bio;
+
+	if (write)
+		return uefi_call_wrapper(bio->WriteBlocks, 5, bio,
+					 bio->Media->MediaId, lba, size, buf);
+
+	return uefi_call_wrapper(bio->ReadBlocks, 5, bio,
+				 bio->Media->MediaId, lba, size, buf);
+}
+
+/* Many Disk I/O implementations split the requests and go through a
+   bounce buffer even for whole blocks.  The block aligned part of a
+   request whose buffer meets the media IoAlign is sent straight to
+   the Block I/O protocol, only the partial head and tail blocks are
+   left to the Disk I/O read-modify-write.  */
+static EFI_STATUS gpt_disk_rw(struct gpt_partition_interface *gpart,
+			      BOOLEAN write, UINT64 offset, UINTN size,
+			      VOID *buf)
+{
+	EFI_BLOCK_IO_MEDIA *media;
+	UINT8 *p = buf;
+	UINTN head, len;
+	EFI_STATUS ret;
+
+	if (!gpart || !gpart->bio || !gpart->dio || (size && !buf))
+		return EFI_INVALID_PARAMETER;
+
+	media = gpart->bio->Media;
+	head = offset % media->BlockSize;
+	if (head)
+		head = min(size, media->BlockSize - head);
+	len = ALIGN_DOWN(size - head, media->BlockSize);
+
+	if (!len || (media->IoAlign > 1 &&
+		     (UINTN)(p + head) % media->IoAlign))
+		return disk_io_rw(gpart, write, offset, size, buf);
+
+	if (head) {
+		ret = disk_io_rw(gpart, write, offset, head, p);
+		if (EFI_ERROR(ret))
+			return ret;
+		offset += head;
+		p += head;
+	}
+
+	ret = block_io_rw(gpart, write, offset / media->BlockSize, len, p);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	size -= head + len;
+	if (!size)
+		return EFI_SUCCESS;
+
+	return disk_io_rw(gpart, write, offset + len, size, p + len);
+}
+
+EFI_STATUS gpt_disk_read(struct gpt_partition_interface *gpart,
+			 UINT64 offset, UINTN size, VOID *buf)
+{
+	return gpt_disk_rw(gpart, FALSE, offset, size, buf);
+}
+
+EFI_STATUS gpt_disk_write(struct gpt_partition_interface *gpart,
+			  UINT64 offset, UINTN size, VOID *buf)
+{
+	return gpt_disk_rw(gpart, TRUE, offset, size, buf);
+}
+
 /* OneAndroid adds the "android_" prefix to the Android partition
    labels for the android partitions. However, we also have to support
    non-android partitions which are not prefixed with the "android_"
@@ -375,46 +740,91 @@ EFI_STATUS gpt_get_root_disk(struct gpt_partition_interface *gpart, logical_unit
    L"android_" LABEL strings. */
 
 static const CHAR16 ANDROID_PREFIX[] = L"android_";
+#define ANDROID_PREFIX_LEN (ARRAY_SIZE(ANDROID_PREFIX) - 1)
 
-static CHAR16 *make_android_label(const CHAR16 *label)
+static BOOLEAN has_android_prefix(const CHAR16 *name)
 {
-	static CHAR16 android_label[GPT_NAME_LEN];
-	static CHAR16 *suffix = &android_label[ARRAY_SIZE(ANDROID_PREFIX) - 1];
-	UINTN label_size = StrLen(label) * sizeof(CHAR16);
+	return !memcmp(name, ANDROID_PREFIX, ANDROID_PREFIX_LEN * sizeof(CHAR16));
+}
 
-	if (!*android_label)
-		memcpy(android_label, ANDROID_PREFIX, sizeof(ANDROID_PREFIX));
+/* The partition lookups are served by an open-addressed hash index
+   built when the partition table is cached.  A partition is indexed
+   under its name and, if it has the "android_" prefix, under its name
+   without the prefix too.  A slot holds the partition entry number
+   plus one, zero marks a free slot.  */
 
-	if (label_size + sizeof(ANDROID_PREFIX) > sizeof(android_label))
-		return NULL;
+static UINTN hash_name(const CHAR16 *name)
+{
+	UINT32 h = 2166136261U;
+	UINTN i;
 
-	memcpy(suffix, label, label_size + sizeof(CHAR16));
-	return android_label;
+	for (i = 0; i < GPT_NAME_LEN && name[i]; i++) {
+		h ^= name[i];
+		h *= 16777619U;
+	}
+
+	return h & (GPT_INDEX_SIZE - 1);
 }
 
-static struct gpt_partition *gpt_find_partition(const CHAR16 *label)
+static void index_insert(const CHAR16 *name, UINTN p)
+{
+	UINTN slot;
+
+	for (slot = hash_name(name); sdisk.index[slot];
+	     slot = (slot + 1) & (GPT_INDEX_SIZE - 1))
+		;
+	sdisk.index[slot] = p + 1;
+}
+
+static void gpt_build_index(void)
 {
+	struct gpt_partition *part;
 	UINTN p;
-	CHAR16 *android_label;
 
-	android_label = make_android_label(label);
+	memset(sdisk.index, 0, sizeof(sdisk.index));
 
 	for (p = 0; p < sdisk.gpt_hd.number_of_entries; p++) {
-		struct gpt_partition *part;
-
 		part = &sdisk.partitions[p];
 		if (!CompareGuid(&part->type, &NullGuid))
 			continue;
 
-		if (StrCmp(part->name, label) &&
-		    (!android_label || StrCmp(part->name, android_label)))
-			continue;
+		index_insert(part->name, p);
+		if (has_android_prefix(part->name))
+			index_insert(&part->name[ANDROID_PREFIX_LEN], p);
+	}
+
+	sdisk.indexed = TRUE;
+}
+
+static BOOLEAN match_label(struct gpt_partition *part, const CHAR16 *label)
+{
+	if (!StrCmp(part->name, label))
+		return TRUE;
+
+	return has_android_prefix(part->name) &&
+		!StrCmp(&part->name[ANDROID_PREFIX_LEN], label);
+}
+
+static struct gpt_partition *gpt_find_partition(const CHAR16 *label)
+{
+	UINTN slot, p, found = GPT_ENTRIES;
 
-		debug(L"Found label %s in partition %d", label, p);
-		return part;
+	if (!sdisk.indexed)
+		gpt_build_index();
+
+	/* Keep the first matching entry like a table walk would */
+	for (slot = hash_name(label); sdisk.index[slot];
+	     slot = (slot + 1) & (GPT_INDEX_SIZE - 1)) {
+		p = sdisk.index[slot] - 1;
+		if (p < found && match_label(&sdisk.partitions[p], label))
+			found = p;
 	}
 
-	return NULL;
+	if (found == GPT_ENTRIES)
+		return NULL;
+
+	debug(L"Found label %s in partition %d", label, found);
+	return &sdisk.partitions[found];
 }
 
 /* OneAndroid adds the "android_" prefix to the Android partition
@@ -424,13 +834,11 @@ static struct gpt_partition *gpt_find_partition(const CHAR16 *label)
 
 static void copy_part(struct gpt_partition *in, struct gpt_partition *out)
 {
-	static const UINTN PREFIX_LEN = ARRAY_SIZE(ANDROID_PREFIX) - 1;
-
 	CopyMem(out, in, sizeof(*in));
-	if (!memcmp(in->name, ANDROID_PREFIX, PREFIX_LEN * sizeof(CHAR16)))
+	if (has_android_prefix(in->name))
 		CopyMem(out->name,
-			&in->name[PREFIX_LEN],
-			sizeof(out->name) - PREFIX_LEN * sizeof(CHAR16));
+			&in->name[ANDROID_PREFIX_LEN],
+			sizeof(out->name) - ANDROID_PREFIX_LEN * sizeof(CHAR16));
 }
 
 EFI_STATUS gpt_get_partition_by_label(const CHAR16 *label,
@@ -586,65 +994,141 @@ static VOID gpt_fill_entries(UINTN part_count, struct gpt_bin_part *gbp, struct
 	}
 }
 
-static EFI_STATUS gpt_write_mbr(void)
+static void gpt_build_mbr(struct mbr *mbr)
 {
-	struct mbr mbr;
-	EFI_STATUS ret;
-
-	/* Write protective MBR */
-	ZeroMem(&mbr, sizeof(mbr));
-	mbr.sig = 0xAA55;
-	mbr.entries[0].type = PROTECTIVE_MBR;
-	mbr.entries[0].first_lba = 1;
+	ZeroMem(mbr, sizeof(*mbr));
+	mbr->sig = 0xAA55;
+	mbr->entries[0].type = PROTECTIVE_MBR;
+	mbr->entries[0].first_lba = 1;
 	if (sdisk.bio->Media->LastBlock > 0xFFFFFFFFULL)
-		mbr.entries[0].lba_count = 0xFFFFFFFFULL;
+		mbr->entries[0].lba_count = 0xFFFFFFFFULL;
 	else
-		mbr.entries[0].lba_count = sdisk.bio->Media->LastBlock;
+		mbr->entries[0].lba_count = sdisk.bio->Media->LastBlock;
+}
 
-	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
-				440, sizeof(struct mbr), &mbr);
-	if (EFI_ERROR(ret))
-		error(L"Couldn't write MBR");
+/* A GPT copy, its header block and its entries array, is contiguous
+   on the disk: the entries follow the header of the primary copy and
+   precede the header of the backup one.  It is built in IMAGE to be
+   written with a single block aligned request.  The entries array is
+   copied as is, only the header block and the array tail padding are
+   zeroed.  */
+static UINTN gpt_build_table_image(struct gpt_header *gh, UINT8 *image)
+{
+	UINTN bs = sdisk.bio->Media->BlockSize;
+	UINTN entries_size = gh->number_of_entries * gh->size_of_entry;
+	UINTN entries_blocks_size = ALIGN(entries_size, bs);
+	UINT8 *header, *entries;
+
+	if (gh->entries_lba > gh->my_lba) {
+		header = image;
+		entries = image + bs;
+	} else {
+		entries = image;
+		header = image + entries_blocks_size;
+	}
 
-	return ret;
+	ZeroMem(header, bs);
+	CopyMem(header, gh, sizeof(*gh));
+	CopyMem(entries, sdisk.partitions, entries_size);
+	ZeroMem(entries + entries_size, entries_blocks_size - entries_size);
+
+	return bs + entries_blocks_size;
 }
 
-static EFI_STATUS gpt_write_table_to_disk(struct gpt_header *gh)
+/* The primary copy, the backup copy and the protective MBR are three
+   independent requests: they are in flight at the same time when the
+   firmware provides asynchronous disk I/O.  */
+static EFI_STATUS gpt_write_tables_to_disk(struct gpt_header *gh,
+					   struct gpt_header *gh_backup)
 {
-	UINT64 entries_offset, header_offset, entries_size;
-	EFI_STATUS ret;
+	struct gpt_partition_interface disk = {
+		.bio = sdisk.bio,
+		.dio = sdisk.dio,
+		.handle = sdisk.handle
+	};
+	UINTN bs = sdisk.bio->Media->BlockSize;
+	UINTN size, image_size, backup_size, id;
+	struct async_io *aio;
+	EFI_STATUS ret, ret2;
+	UINT8 *image;
+	struct mbr mbr;
 
-	entries_size = gh->number_of_entries * gh->size_of_entry;
-	header_offset = gh->my_lba * sdisk.bio->Media->BlockSize;
-	entries_offset = gh->entries_lba * sdisk.bio->Media->BlockSize;
+	ret = io_buffer_get(sdisk.bio, 1, (VOID **)&image, &size);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
-				header_offset, sizeof(struct gpt_header), gh);
-	if (EFI_ERROR(ret)) {
-		error(L"Couldn't write GPT header");
+	image_size = gpt_build_table_image(gh, image);
+	backup_size = gpt_build_table_image(gh_backup, image + image_size);
+	gpt_build_mbr(&mbr);
+
+	ret = async_io_open(&disk, &aio);
+	if (EFI_ERROR(ret))
 		return ret;
+
+	debug(L"Write primary GPT at %lld, alternate GPT at %lld",
+	      gh->my_lba, gh_backup->entries_lba);
+	ret = async_io_write(aio, gh->my_lba * bs, image_size, image, &id);
+	if (EFI_ERROR(ret)) {
+		error(L"Couldn't write primary GPT");
+		goto close;
+	}
+
+	ret = async_io_write(aio, gh_backup->entries_lba * bs, backup_size,
+			     image + image_size, &id);
+	if (EFI_ERROR(ret)) {
+		error(L"Couldn't write alternate GPT");
+		goto close;
 	}
 
-	ret = uefi_call_wrapper(sdisk.dio->WriteDisk, 5, sdisk.dio, sdisk.bio->Media->MediaId,
-				entries_offset, entries_size,
-				sdisk.partitions);
+	debug(L"Write protective MBR");
+	ret = async_io_write(aio, 440, sizeof(mbr), &mbr, &id);
 	if (EFI_ERROR(ret))
-		error(L"Couldn't write GPT entries array");
+		error(L"Couldn't write MBR");
 
+close:
+	ret2 = async_io_wait_all(aio);
+	if (!EFI_ERROR(ret))
+		ret = ret2;
+	async_io_close(aio);
 	return ret;
 }
 
-static EFI_STATUS gpt_write_partition_tables(void)
+/* Whether the partitions the firmware built its partition handles
+   from differ from the ones being written.  OLD is the header of the
+   table previously cached, NULL if unknown.  */
+static BOOLEAN gpt_layout_changed(struct gpt_header *old)
+{
+	struct gpt_header *gh = &sdisk.gpt_hd;
+
+	return !old || !is_gpt_device(old) ||
+		old->entries_crc32 != gh->entries_crc32 ||
+		old->number_of_entries != gh->number_of_entries ||
+		old->size_of_entry != gh->size_of_entry ||
+		old->first_usable_lba != gh->first_usable_lba ||
+		old->last_usable_lba != gh->last_usable_lba;
+}
+
+/* Write the cached partition table to the disk.  The cache is kept as
+   it is what has been written, the partition handles are only rebuilt
+   if the layout changed.  */
+static EFI_STATUS gpt_write_partition_tables(struct gpt_header *old)
 {
 	EFI_STATUS ret;
 	UINT64 entries_size;
 	struct gpt_header *gh;
-	struct gpt_header *gh_backup;
+	struct gpt_header gh_backup;
+	UINTN bs = sdisk.bio->Media->BlockSize;
 	UINT32 crc;
 
 	gh = &sdisk.gpt_hd;
+	blkcache_invalidate(NULL, 0, 0);
 
 	entries_size = gh->number_of_entries * gh->size_of_entry;
+	if (!entries_size || entries_size > sizeof(sdisk.partitions)) {
+		error(L"Invalid GPT entries array size %lld", entries_size);
+		return EFI_INVALID_PARAMETER;
+	}
+
 	gh->my_lba = 1;
 	gh->alternate_lba = sdisk.bio->Media->LastBlock;
 	gh->entries_lba = 2;
@@ -659,41 +1143,36 @@ static EFI_STATUS gpt_write_partition_tables(void)
 	if (EFI_ERROR(ret))
 		return ret;
 
-	debug(L"Write first GPT Header at %d", gh->my_lba);
-	ret = gpt_write_table_to_disk(gh);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to write primary GPT header");
-		return ret;
-	}
-
-	gh_backup = AllocatePool(sizeof(struct gpt_header));
-	if (!gh_backup) {
-		error(L"Cannot allocate alternate GPT header");
-		return EFI_OUT_OF_RESOURCES;
-	}
-
-	CopyMem(gh_backup, gh, sizeof(struct gpt_header));
+	CopyMem(&gh_backup, gh, sizeof(gh_backup));
 
-	gh_backup->my_lba = gh->alternate_lba;
-	gh_backup->alternate_lba = gh->my_lba;
-	gh_backup->entries_lba = gh_backup->my_lba - entries_size / sdisk.bio->Media->BlockSize;
+	gh_backup.my_lba = gh->alternate_lba;
+	gh_backup.alternate_lba = gh->my_lba;
+	gh_backup.entries_lba = gh_backup.my_lba - ALIGN(entries_size, bs) / bs;
 
-	ret = set_header_crc32(gh_backup);
+	ret = set_header_crc32(&gh_backup);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	debug(L"Write alternate GPT Header at %d", gh_backup->my_lba);
-	ret = gpt_write_table_to_disk(gh_backup);
-	FreePool(gh_backup);
+	ret = gpt_write_tables_to_disk(gh, &gh_backup);
 	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to write alternate GPT header");
+		efi_perror(ret, L"Failed to write the GPT");
 		return ret;
 	}
-	debug(L"Write protective MBR");
-	ret = gpt_write_mbr();
+
+#ifdef USE_GPT_CACHE
+	gpt_save_cache(&sdisk);
+#endif
+
+	/* The partition table must be durable */
+	ret = gpt_sync();
 	if (EFI_ERROR(ret))
 		return ret;
 
+	if (!gpt_layout_changed(old)) {
+		debug(L"Partition layout unchanged");
+		return EFI_SUCCESS;
+	}
+
 	return gpt_refresh();
 }
 
@@ -701,6 +1180,7 @@ EFI_STATUS gpt_create(struct gpt_header *gh, UINTN gh_size,
 		      UINT64 start_lba, UINTN part_count, struct gpt_bin_part *gbp, logical_unit_t log_unit)
 {
 	EFI_STATUS ret;
+	struct gpt_header old;
 
 	if (gh && gbp)
 		return EFI_INVALID_PARAMETER;
@@ -709,6 +1189,8 @@ EFI_STATUS gpt_create(struct gpt_header *gh, UINTN gh_size,
 	if (EFI_ERROR(ret))
 		return ret;
 
+	memcpy(&old, &sdisk.gpt_hd, sizeof(old));
+
 	if (gh) {
 		if (CompareMem(gh->signature, EFI_PTAB_HEADER_ID, sizeof(gh->signature)) ||
 		    gh_size != GPT_HEADER_SIZE + sizeof(sdisk.partitions))
@@ -742,7 +1224,9 @@ EFI_STATUS gpt_create(struct gpt_header *gh, UINTN gh_size,
 
 out:
 	sdisk.label_prefix_removed = FALSE;
-	return gpt_write_partition_tables();
+	sdisk.indexed = FALSE;
+	generation++;
+	return gpt_write_partition_tables(&old);
 }
 
 static EFI_STATUS get_partition_guid(const CHAR16 *label, EFI_GUID *guid,
@@ -811,8 +1295,9 @@ EFI_STATUS gpt_swap_partition(const CHAR16 *label1, const CHAR16 *label2, logica
 
 	part2->starting_lba = save1.starting_lba;
 	part2->ending_lba = save1.ending_lba;
+	generation++;
 
-	return gpt_write_partition_tables();
+	return gpt_write_partition_tables(NULL);
 }
 
 static HARDDRIVE_DEVICE_PATH *get_hd_device_path(EFI_DEVICE_PATH *p)
@@ -843,6 +1328,11 @@ EFI_STATUS gpt_get_partition_handle(const CHAR16 *label,
 
 	*handle = NULL;
 
+	/* The partition handles must reflect the last refresh */
+	ret = gpt_commit_refresh();
+	if (EFI_ERROR(ret))
+		return ret;
+
 	ret = gpt_get_partition_by_label(label, &gpart, log_unit);
 	if (EFI_ERROR(ret)) {
 		error(L"Partition '%s' not found", label);
@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "io_buffer.h"
+
+static struct io_buffer {
+	VOID *free_addr;
+	VOID *data;
+	UINTN size;
+	BOOLEAN has_pattern;
+	UINT32 pattern;
+} buffers[IO_BUFFER_COUNT];
+
+UINTN io_buffer_size(EFI_BLOCK_IO *bio)
+{
+	UINT64 granularity = 0;
+	UINTN size = IO_BUFFER_SIZE;
+
+	if (bio->Revision >= EFI_BLOCK_IO_INTERFACE_REVISION3)
+		granularity = (UINT64)bio->Media->OptimalTransferLengthGranularity *
+			bio->Media->BlockSize;
+
+	if (granularity && granularity <= IO_BUFFER_MAX_SIZE)
+		size = ((size + granularity - 1) / granularity) * granularity;
+	size = min(size, (UINTN)IO_BUFFER_MAX_SIZE);
+
+	/* Whole blocks only */
+	return size - size % bio->Media->BlockSize;
+}
+
+static EFI_STATUS get_buffer(EFI_BLOCK_IO *bio, UINTN index,
+			     struct io_buffer **b_p, UINTN *size)
+{
+	struct io_buffer *b;
+	UINTN needed, align;
+	EFI_STATUS ret;
+
+	if (!bio || index >= ARRAY_SIZE(buffers) || !size)
+		return EFI_INVALID_PARAMETER;
+
+	b = &buffers[index];
+	needed = io_buffer_size(bio);
+	align = bio->Media->IoAlign;
+
+	if (!b->free_addr || b->size < needed ||
+	    (align > 1 && (UINTN)b->data % align)) {
+		if (b->free_addr)
+			FreePool(b->free_addr);
+		b->free_addr = NULL;
+		b->has_pattern = FALSE;
+
+		ret = alloc_aligned(&b->free_addr, &b->data, needed, align);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to allocate a %ld bytes I/O buffer",
+				   needed);
+			b->free_addr = NULL;
+			return ret;
+		}
+		b->size = needed;
+	}
+
+	*b_p = b;
+	*size = needed;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS io_buffer_get(EFI_BLOCK_IO *bio, UINTN index, VOID **buf, UINTN *size)
+{
+	struct io_buffer *b;
+	EFI_STATUS ret;
+
+	if (!buf)
+		return EFI_INVALID_PARAMETER;
+
+	ret = get_buffer(bio, index, &b, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* The caller overwrites the content */
+	b->has_pattern = FALSE;
+	*buf = b->data;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS io_buffer_get_pattern(EFI_BLOCK_IO *bio, UINTN index, UINT32 pattern,
+				 VOID **buf, UINTN *size)
+{
+	struct io_buffer *b;
+	EFI_STATUS ret;
+	UINT32 *words;
+	UINTN i;
+
+	if (!buf)
+		return EFI_INVALID_PARAMETER;
+
+	ret = get_buffer(bio, index, &b, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!b->has_pattern || b->pattern != pattern) {
+		words = b->data;
+		for (i = 0; i < b->size / sizeof(*words); i++)
+			words[i] = pattern;
+		b->pattern = pattern;
+		b->has_pattern = TRUE;
+	}
+
+	*buf = b->data;
+	return EFI_SUCCESS;
+}
@@ -68,6 +68,12 @@
 
 #include "lib.h"
 #include "vars.h"
+#include "boottrace.h"
+#include "misc.h"
+#include "random.h"
+#ifdef RPMB_STORAGE
+#include "rpmb_storage.h"
+#endif
 
 
 EFI_HANDLE g_parent_image;
@@ -309,10 +315,14 @@ char *strcasestr(const char *s, const char *find)
 
 CHAR16 *stra_to_str(const CHAR8 *stra)
 {
-        UINTN len, i;
+        return stran_to_str(stra, strlena(stra));
+}
+
+CHAR16 *stran_to_str(const CHAR8 *stra, UINTN len)
+{
+        UINTN i;
         CHAR16 *str;
 
-        len = strlena(stra);
         str = AllocatePool((len + 1) * sizeof(CHAR16));
 
         if (!str)
@@ -413,7 +423,7 @@ int efi_snprintf(CHAR8 *str, UINTN size, const CHAR8 *format, ...)
 }
 
 
-EFI_STATUS get_efi_variable(const EFI_GUID *guid, CHAR16 *key,
+static EFI_STATUS read_efi_variable(const EFI_GUID *guid, CHAR16 *key,
                 UINTN *size_p, VOID **data_p, UINT32 *flags_p)
 {
         VOID *data;
@@ -452,6 +462,509 @@ EFI_STATUS get_efi_variable(const EFI_GUID *guid, CHAR16 *key,
 }
 
 
+#define EFI_VAR_CACHE_SIZE      32
+#define EFI_VAR_CACHE_MAX_DATA  512
+
+/* Read-through cache of the variables, including the missing ones,
+   which Kernelflinger owns.  STATUS, FLAGS, SIZE and DATA are the
+   current value of the variable.  While writes are deferred, it may
+   not be in the variable store yet: DIRTY is then set and STORED and
+   STORED_FLAGS describe the variable in the store.  */
+static struct efi_var_cache {
+        EFI_GUID guid;
+        CHAR16 *name;
+        EFI_STATUS status;      /* EFI_SUCCESS or EFI_NOT_FOUND */
+        UINT32 flags;
+        UINTN size;
+        VOID *data;
+        BOOLEAN dirty;
+        BOOLEAN stored;
+        UINT32 stored_flags;
+} var_cache[EFI_VAR_CACHE_SIZE];
+static UINTN var_cache_next;
+static BOOLEAN defer_writes;
+
+static BOOLEAN is_cacheable(const EFI_GUID *guid)
+{
+        return !memcmp(guid, &loader_guid, sizeof(*guid)) ||
+                !memcmp(guid, &fastboot_guid, sizeof(*guid));
+}
+
+static struct efi_var_cache *var_cache_lookup(const EFI_GUID *guid, CHAR16 *key)
+{
+        UINTN i;
+
+        for (i = 0; i < EFI_VAR_CACHE_SIZE; i++)
+                if (var_cache[i].name &&
+                    !memcmp(&var_cache[i].guid, guid, sizeof(*guid)) &&
+                    !StrCmp(var_cache[i].name, key))
+                        return &var_cache[i];
+
+        return NULL;
+}
+
+static void var_cache_drop(struct efi_var_cache *entry)
+{
+        FreePool(entry->name);
+        if (entry->data)
+                FreePool(entry->data);
+        memset(entry, 0, sizeof(*entry));
+}
+
+static void var_cache_forget(const EFI_GUID *guid, CHAR16 *key)
+{
+        struct efi_var_cache *entry;
+
+        entry = var_cache_lookup(guid, key);
+        if (entry)
+                var_cache_drop(entry);
+}
+
+/* Names of the variables of the store, listed with
+   GetNextVariableName() on first use.  It is dropped when a variable
+   is created or deleted.  */
+static struct {
+        BOOLEAN valid;
+        struct efi_var_name *names;
+        UINTN nb;
+        UINTN max;
+} var_index;
+
+static UINT32 var_name_hash(const CHAR16 *name)
+{
+        UINT32 hash = 2166136261;
+
+        for (; *name; name++)
+                hash = (hash ^ *name) * 16777619;
+
+        return hash;
+}
+
+static void var_index_drop(void)
+{
+        UINTN i;
+
+        for (i = 0; i < var_index.nb; i++)
+                FreePool(var_index.names[i].name);
+        if (var_index.names)
+                FreePool(var_index.names);
+        memset(&var_index, 0, sizeof(var_index));
+}
+
+static EFI_STATUS var_index_add(const CHAR16 *name, const EFI_GUID *guid)
+{
+        struct efi_var_name *names, *cur;
+        UINTN max;
+
+        if (var_index.nb == var_index.max) {
+                max = var_index.max ? var_index.max * 2 : 128;
+                names = ReallocatePool(var_index.names,
+                                       var_index.max * sizeof(*names),
+                                       max * sizeof(*names));
+                if (!names)
+                        return EFI_OUT_OF_RESOURCES;
+                var_index.names = names;
+                var_index.max = max;
+        }
+
+        cur = &var_index.names[var_index.nb];
+        cur->name = StrDuplicate(name);
+        if (!cur->name)
+                return EFI_OUT_OF_RESOURCES;
+        cur->guid = *guid;
+        cur->hash = var_name_hash(name);
+        var_index.nb++;
+
+        return EFI_SUCCESS;
+}
+
+static EFI_STATUS var_index_build(void)
+{
+        EFI_STATUS ret;
+        UINTN bufsize = 128, namesize;
+        CHAR16 *name, *bigger;
+        EFI_GUID guid;
+
+        if (var_index.valid)
+                return EFI_SUCCESS;
+
+        var_index_drop();
+        name = AllocateZeroPool(bufsize);
+        if (!name)
+                return EFI_OUT_OF_RESOURCES;
+
+        for (;;) {
+                namesize = bufsize;
+                ret = uefi_call_wrapper(RT->GetNextVariableName, 3, &namesize,
+                                        name, &guid);
+                if (ret == EFI_NOT_FOUND) {
+                        ret = EFI_SUCCESS;
+                        break;
+                }
+                if (ret == EFI_BUFFER_TOO_SMALL) {
+                        bigger = ReallocatePool(name, bufsize, namesize);
+                        if (!bigger) {
+                                ret = EFI_OUT_OF_RESOURCES;
+                                break;
+                        }
+                        name = bigger;
+                        bufsize = namesize;
+                        continue;
+                }
+                if (EFI_ERROR(ret)) {
+                        efi_perror(ret, L"GetNextVariableName failed");
+                        break;
+                }
+
+                ret = var_index_add(name, &guid);
+                if (EFI_ERROR(ret))
+                        break;
+        }
+
+        FreePool(name);
+        if (EFI_ERROR(ret)) {
+                var_index_drop();
+                return ret;
+        }
+
+        var_index.valid = TRUE;
+        return EFI_SUCCESS;
+}
+
+/* Write a variable to the store.  Attributes are only applied when a
+   variable is created: if it already exists with other attributes, it
+   is deleted first.  */
+static EFI_STATUS store_efi_variable(const EFI_GUID *guid, CHAR16 *key,
+                                     UINT32 flags, UINTN size, VOID *data,
+                                     BOOLEAN exists, UINT32 curflags)
+{
+        EFI_STATUS ret;
+
+        if (size && exists && curflags != flags) {
+                ret = uefi_call_wrapper(RT->SetVariable, 5, key, (EFI_GUID *)guid,
+                                        0, 0, NULL);
+                if (EFI_ERROR(ret) && ret != EFI_NOT_FOUND) {
+                        efi_perror(ret, L"Couldn't clear EFI variable");
+                        return ret;
+                }
+        }
+
+        ret = uefi_call_wrapper(RT->SetVariable, 5, key, (EFI_GUID *)guid,
+                                size ? flags : 0, size, size ? data : NULL);
+        if (!size && ret == EFI_NOT_FOUND)
+                ret = EFI_SUCCESS;
+        if (!size || !exists)
+                var_index.valid = FALSE;
+
+        return ret;
+}
+
+static EFI_STATUS var_cache_commit(struct efi_var_cache *entry)
+{
+        EFI_STATUS ret;
+
+        if (!entry->dirty)
+                return EFI_SUCCESS;
+
+        ret = store_efi_variable(&entry->guid, entry->name, entry->flags,
+                                 entry->status == EFI_SUCCESS ? entry->size : 0,
+                                 entry->data, entry->stored, entry->stored_flags);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to write the %s deferred variable",
+                           entry->name);
+                var_cache_drop(entry);
+                return ret;
+        }
+
+        entry->dirty = FALSE;
+        entry->stored = entry->status == EFI_SUCCESS;
+        entry->stored_flags = entry->flags;
+        return EFI_SUCCESS;
+}
+
+/* Return the entry of GUID:KEY, creating it if needed, with its
+   current value released.  */
+static struct efi_var_cache *var_cache_entry(const EFI_GUID *guid, CHAR16 *key)
+{
+        struct efi_var_cache *entry;
+
+        entry = var_cache_lookup(guid, key);
+        if (entry) {
+                if (entry->data)
+                        FreePool(entry->data);
+                entry->data = NULL;
+                return entry;
+        }
+
+        entry = &var_cache[var_cache_next];
+        var_cache_next = (var_cache_next + 1) % EFI_VAR_CACHE_SIZE;
+        if (entry->name) {
+                var_cache_commit(entry);
+                if (entry->name)
+                        var_cache_drop(entry);
+        }
+
+        entry->name = StrDuplicate(key);
+        if (!entry->name)
+                return NULL;
+        memcpy(&entry->guid, guid, sizeof(entry->guid));
+
+        return entry;
+}
+
+static EFI_STATUS var_cache_set(struct efi_var_cache *entry, EFI_STATUS status,
+                                UINT32 flags, UINTN size, VOID *data)
+{
+        if (status == EFI_SUCCESS) {
+                entry->data = AllocatePool(size);
+                if (!entry->data) {
+                        var_cache_drop(entry);
+                        return EFI_OUT_OF_RESOURCES;
+                }
+                memcpy(entry->data, data, size);
+        } else {
+                flags = 0;
+                size = 0;
+        }
+
+        entry->status = status;
+        entry->flags = flags;
+        entry->size = size;
+        return EFI_SUCCESS;
+}
+
+/* Record the value of a variable which is in the store */
+static void var_cache_store(const EFI_GUID *guid, CHAR16 *key,
+                            EFI_STATUS status, UINT32 flags,
+                            UINTN size, VOID *data)
+{
+        struct efi_var_cache *entry;
+
+        if (!is_cacheable(guid)) {
+                var_cache_forget(guid, key);
+                return;
+        }
+
+        if (status == EFI_SUCCESS && size > EFI_VAR_CACHE_MAX_DATA) {
+                var_cache_forget(guid, key);
+                return;
+        }
+
+        entry = var_cache_entry(guid, key);
+        if (!entry || EFI_ERROR(var_cache_set(entry, status, flags, size, data)))
+                return;
+
+        entry->dirty = FALSE;
+        entry->stored = status == EFI_SUCCESS;
+        entry->stored_flags = entry->flags;
+}
+
+/* Record a write to be committed later.  Return FALSE if the write
+   must be done right away.  */
+static BOOLEAN var_cache_defer(const EFI_GUID *guid, CHAR16 *key,
+                               EFI_STATUS status, UINT32 flags,
+                               UINTN size, VOID *data)
+{
+        struct efi_var_cache *entry;
+        VOID *copy = NULL;
+
+        if (!defer_writes || !is_cacheable(guid))
+                return FALSE;
+
+        /* The previous value must be known to commit the write */
+        entry = var_cache_lookup(guid, key);
+        if (!entry)
+                return FALSE;
+
+        if (status == EFI_SUCCESS &&
+            (size > EFI_VAR_CACHE_MAX_DATA || !(flags & EFI_VARIABLE_NON_VOLATILE)))
+                return FALSE;
+        if (status != EFI_SUCCESS && !entry->dirty &&
+            entry->stored && !(entry->stored_flags & EFI_VARIABLE_NON_VOLATILE))
+                return FALSE;
+
+        if (status == EFI_SUCCESS) {
+                copy = AllocatePool(size);
+                if (!copy)
+                        return FALSE;
+                memcpy(copy, data, size);
+        } else {
+                flags = 0;
+                size = 0;
+        }
+
+        if (entry->data)
+                FreePool(entry->data);
+        entry->data = copy;
+        entry->status = status;
+        entry->flags = flags;
+        entry->size = size;
+        entry->dirty = entry->stored || status == EFI_SUCCESS;
+        return TRUE;
+}
+
+void efi_variable_cache_invalidate(const EFI_GUID *guid, CHAR16 *key)
+{
+        var_cache_forget(guid, key);
+        var_index.valid = FALSE;
+}
+
+EFI_STATUS efi_variable_list(const struct efi_var_name **names, UINTN *nb)
+{
+        EFI_STATUS ret;
+
+        if (!names || !nb)
+                return EFI_INVALID_PARAMETER;
+
+        ret = var_index_build();
+        if (EFI_ERROR(ret))
+                return ret;
+
+        *names = var_index.names;
+        *nb = var_index.nb;
+        return EFI_SUCCESS;
+}
+
+/* Record the GUID of a NAME variable, FALSE if another one was
+   already found.  */
+static BOOLEAN var_find_record(const EFI_GUID *guid, BOOLEAN *found,
+                               EFI_GUID *found_guid)
+{
+        if (*found && memcmp(found_guid, guid, sizeof(*guid)))
+                return FALSE;
+
+        *found = TRUE;
+        *found_guid = *guid;
+        return TRUE;
+}
+
+EFI_STATUS efi_variable_find(CHAR16 *name, EFI_GUID *guid)
+{
+        struct efi_var_cache *entry;
+        BOOLEAN found = FALSE;
+        EFI_GUID found_guid;
+        EFI_STATUS ret;
+        UINT32 hash;
+        UINTN i;
+
+        ret = var_index_build();
+        if (EFI_ERROR(ret))
+                return ret;
+
+        hash = var_name_hash(name);
+        for (i = 0; i < var_index.nb; i++) {
+                if (var_index.names[i].hash != hash ||
+                    StrCmp(var_index.names[i].name, name))
+                        continue;
+
+                /* Skip the deferred deletions */
+                entry = var_cache_lookup(&var_index.names[i].guid, name);
+                if (entry && entry->status != EFI_SUCCESS)
+                        continue;
+
+                if (!var_find_record(&var_index.names[i].guid, &found,
+                                     &found_guid))
+                        goto duplicate;
+        }
+
+        /* The deferred creations are not in the store yet */
+        for (i = 0; i < EFI_VAR_CACHE_SIZE; i++) {
+                entry = &var_cache[i];
+                if (!entry->name || entry->status != EFI_SUCCESS ||
+                    entry->stored || StrCmp(entry->name, name))
+                        continue;
+
+                if (!var_find_record(&entry->guid, &found, &found_guid))
+                        goto duplicate;
+        }
+
+        if (!found)
+                return EFI_NOT_FOUND;
+
+        *guid = found_guid;
+        return EFI_SUCCESS;
+
+duplicate:
+        error(L"Found 2 variables named %s", name);
+        return EFI_UNSUPPORTED;
+}
+
+void efi_variable_defer_writes(BOOLEAN defer)
+{
+        if (!defer)
+                efi_variable_commit();
+        defer_writes = defer;
+}
+
+EFI_STATUS efi_variable_commit(void)
+{
+        EFI_STATUS ret = EFI_SUCCESS, ret2;
+        UINTN i;
+
+        for (i = 0; i < EFI_VAR_CACHE_SIZE; i++) {
+                if (!var_cache[i].name)
+                        continue;
+                ret2 = var_cache_commit(&var_cache[i]);
+                if (EFI_ERROR(ret2))
+                        ret = ret2;
+        }
+
+        return ret;
+}
+
+static EFI_STATUS get_cached_efi_variable(struct efi_var_cache *entry,
+                UINTN *size_p, VOID **data_p, UINT32 *flags_p)
+{
+        VOID *data;
+
+        if (entry->status != EFI_SUCCESS)
+                return entry->status;
+
+        data = AllocatePool(entry->size);
+        if (!data)
+                return EFI_OUT_OF_RESOURCES;
+        memcpy(data, entry->data, entry->size);
+
+        if (size_p)
+                *size_p = entry->size;
+        if (flags_p)
+                *flags_p = entry->flags;
+        *data_p = data;
+
+        return EFI_SUCCESS;
+}
+
+EFI_STATUS get_efi_variable(const EFI_GUID *guid, CHAR16 *key,
+                UINTN *size_p, VOID **data_p, UINT32 *flags_p)
+{
+        struct efi_var_cache *entry;
+        UINTN size = 0;
+        UINT32 flags = 0;
+        EFI_STATUS ret;
+
+        entry = var_cache_lookup(guid, key);
+        if (entry)
+                return get_cached_efi_variable(entry, size_p, data_p, flags_p);
+
+        boottrace_begin(BT_VAR_READ, 0);
+        ret = read_efi_variable(guid, key, &size, data_p, &flags);
+        boottrace_end(BT_VAR_READ, size);
+
+        if (ret == EFI_SUCCESS || ret == EFI_NOT_FOUND)
+                var_cache_store(guid, key, ret, flags, size,
+                                ret == EFI_SUCCESS ? *data_p : NULL);
+
+        if (!EFI_ERROR(ret)) {
+                if (size_p)
+                        *size_p = size;
+                if (flags_p)
+                        *flags_p = flags;
+        }
+
+        return ret;
+}
+
+
 CHAR16 *get_efi_variable_str(const EFI_GUID *guid, CHAR16 *key)
 {
         CHAR16 *data;
@@ -548,9 +1061,18 @@ EFI_STATUS del_efi_variable(const EFI_GUID *guid, CHAR16 *key)
 {
         EFI_STATUS ret;
 
+        if (var_cache_defer(guid, key, EFI_NOT_FOUND, 0, 0, NULL))
+                return EFI_SUCCESS;
+
         ret = uefi_call_wrapper(RT->SetVariable, 5, key, (EFI_GUID *)guid, 0, 0, NULL);
         if (ret == EFI_NOT_FOUND)
-                return EFI_SUCCESS;
+                ret = EFI_SUCCESS;
+        var_index.valid = FALSE;
+
+        if (EFI_ERROR(ret))
+                efi_variable_cache_invalidate(guid, key);
+        else
+                var_cache_store(guid, key, EFI_NOT_FOUND, 0, 0, NULL);
 
         return ret;
 }
@@ -563,6 +1085,8 @@ EFI_STATUS set_efi_variable(const EFI_GUID *guid, CHAR16 *key,
         UINT32 curflags, flags = EFI_VARIABLE_BOOTSERVICE_ACCESS;
         UINTN cursize;
         VOID *curdata;
+        BOOLEAN exists;
+        struct efi_var_cache *entry;
 
         if (nonvol)
                 flags |= EFI_VARIABLE_NON_VOLATILE;
@@ -580,16 +1104,29 @@ EFI_STATUS set_efi_variable(const EFI_GUID *guid, CHAR16 *key,
                 return ret;
         if (ret == EFI_SUCCESS)
                 FreePool(curdata);
-        if (ret == EFI_SUCCESS && curflags != flags) {
-                ret = del_efi_variable((EFI_GUID *)guid, key);
-                if (EFI_ERROR(ret)) {
-                        efi_perror(ret, L"Couldn't clear EFI variable");
-                        return ret;
-                }
+
+        exists = ret == EFI_SUCCESS;
+
+        if (size && var_cache_defer(guid, key, EFI_SUCCESS, flags, size, data))
+                return EFI_SUCCESS;
+
+        /* This write supersedes any pending one but the store still
+           holds the previous value.  */
+        entry = var_cache_lookup(guid, key);
+        if (entry && entry->dirty) {
+                exists = entry->stored;
+                curflags = entry->stored_flags;
         }
 
-        return uefi_call_wrapper(RT->SetVariable, 5, key, (EFI_GUID *)guid, flags,
-                                 size, data);
+        ret = store_efi_variable(guid, key, flags, size, data, exists, curflags);
+        if (EFI_ERROR(ret))
+                efi_variable_cache_invalidate(guid, key);
+        else if (size)
+                var_cache_store(guid, key, EFI_SUCCESS, flags, size, data);
+        else
+                var_cache_store(guid, key, EFI_NOT_FOUND, 0, 0, NULL);
+
+        return ret;
 }
 
 
@@ -913,12 +1450,54 @@ CHAR16 *StrStr(const CHAR16 *s, const CHAR16 *find)
 
 VOID pause(UINTN seconds)
 {
+        log_flush();
         uefi_call_wrapper(BS->Stall, 1, seconds * 1000000);
 }
 
+BOOLEAN wait_for_key(UINT64 timeout_usecs)
+{
+        EFI_STATUS ret;
+        EFI_EVENT events[2];
+        UINTN index;
+
+        events[0] = ST->ConIn->WaitForKey;
+        if (uefi_call_wrapper(BS->CheckEvent, 1, events[0]) == EFI_SUCCESS)
+                return TRUE;
+
+        ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0,
+                                NULL, NULL, &events[1]);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to create the key wait timer");
+                uefi_call_wrapper(BS->Stall, 1, timeout_usecs);
+                return uefi_call_wrapper(BS->CheckEvent, 1,
+                                         events[0]) == EFI_SUCCESS;
+        }
+
+        /* The timer period is in 100ns units */
+        ret = uefi_call_wrapper(BS->SetTimer, 3, events[1], TimerRelative,
+                                timeout_usecs * 10);
+        if (!EFI_ERROR(ret))
+                ret = uefi_call_wrapper(BS->WaitForEvent, 3, 2, events,
+                                        &index);
+        uefi_call_wrapper(BS->CloseEvent, 1, events[1]);
+        if (EFI_ERROR(ret)) {
+                efi_perror(ret, L"Failed to wait for a key stroke");
+                return FALSE;
+        }
+
+        return index == 0;
+}
+
 
 VOID halt_system(VOID)
 {
+        log_flush();
+        log_flush_to_partition();
+        efi_variable_commit();
+        misc_commit();
+#ifdef RPMB_STORAGE
+        rpmb_storage_commit();
+#endif
         uefi_call_wrapper(RT->ResetSystem, 4, EfiResetShutdown, EFI_SUCCESS,
                           0, NULL);
         error(L"Failed to halt the device ... looping forever");
@@ -940,6 +1519,13 @@ VOID reboot(CHAR16 *target, EFI_RESET_TYPE type)
                 }
         }
 
+        log_flush();
+        log_flush_to_partition();
+        efi_variable_commit();
+        misc_commit();
+#ifdef RPMB_STORAGE
+        rpmb_storage_commit();
+#endif
         uefi_call_wrapper(RT->ResetSystem, 4, type, EFI_SUCCESS,
                           0, target);
         error(L"Failed to reboot the device ... looping forever");
@@ -976,61 +1562,430 @@ int memcmp(const void *s1, const void *s2, size_t n)
         return CompareMem(s1, s2, n);
 }
 
+/* The memory copy and fill kernels are selected at first use from
+   CPUID.  Below MEM_SMALL_SIZE bytes, straight line code is used.
+   Below MEM_ERMS_THRESHOLD bytes, vector loops beat the start-up cost
+   of "rep movsb" even on processors with Enhanced REP MOVSB.  The
+   kernels do not use the AVX registers: the firmware interrupt and
+   event notification paths, which call these functions as well, do
+   not preserve their upper halves.  */
+#define MEM_SMALL_SIZE          64
+#define MEM_ERMS_THRESHOLD      2048
+
+#define CPUID_1_EDX_SSE2        (1 << 26)
+#define CPUID_7_EBX_ERMS        (1 << 9)
+#define CR4_OSFXSR              (1 << 9)
+
+/* The compiler rejects SSE registers in the clobber list when it is
+   not allowed to use them itself: there is nothing to preserve then.  */
+#ifdef __SSE__
+#define XMM_CLOBBERS "xmm0", "xmm1", "xmm2", "xmm3",
+#else
+#define XMM_CLOBBERS
+#endif
+
+static struct {
+        volatile BOOLEAN initialized;
+        BOOLEAN sse2;
+        BOOLEAN erms;
+} mem_cpu;
+
+static void mem_cpu_init(void)
+{
+        UINT32 reg[4], ext[4] = { 0 };
+#ifndef __LP64__
+        UINTN cr4;
+#endif
+
+        if (mem_cpu.initialized)
+                return;
+
+        cpuid(0, reg);
+        if (reg[0] >= 7)
+                cpuid_count(7, 0, ext);
+        cpuid(1, reg);
+
+#ifdef __LP64__
+        mem_cpu.sse2 = TRUE;
+#else
+        /* SSE2 support and SSE enabled by the firmware */
+        asm volatile("mov %%cr4, %0" : "=r" (cr4));
+        mem_cpu.sse2 = (reg[3] & CPUID_1_EDX_SSE2) && (cr4 & CR4_OSFXSR);
+#endif
+
+        mem_cpu.erms = !!(ext[1] & CPUID_7_EBX_ERMS);
+
+        __sync_synchronize();
+        mem_cpu.initialized = TRUE;
+}
+
+static inline BOOLEAN has_sse2(void)
+{
+        mem_cpu_init();
+        return mem_cpu.sse2;
+}
+
+typedef UINT64 unaligned_u64 __attribute__((aligned(1), may_alias));
+typedef UINT32 unaligned_u32 __attribute__((aligned(1), may_alias));
+typedef UINT16 unaligned_u16 __attribute__((aligned(1), may_alias));
+
+/* Copy less than MEM_SMALL_SIZE bytes with possibly overlapping head
+   and tail accesses.  All the loads are done before the stores so it
+   handles overlapping buffers.  There is no loop the compiler could
+   turn back into a memcpy() call.  */
+static inline void small_copy(UINT8 *d, const UINT8 *s, UINTN n)
+{
+        UINT64 a, b, c, e, f, g, h, i;
+
+        if (n >= 32) {
+                a = *(unaligned_u64 *)s;
+                b = *(unaligned_u64 *)(s + 8);
+                c = *(unaligned_u64 *)(s + 16);
+                e = *(unaligned_u64 *)(s + 24);
+                f = *(unaligned_u64 *)(s + n - 32);
+                g = *(unaligned_u64 *)(s + n - 24);
+                h = *(unaligned_u64 *)(s + n - 16);
+                i = *(unaligned_u64 *)(s + n - 8);
+                *(unaligned_u64 *)d = a;
+                *(unaligned_u64 *)(d + 8) = b;
+                *(unaligned_u64 *)(d + 16) = c;
+                *(unaligned_u64 *)(d + 24) = e;
+                *(unaligned_u64 *)(d + n - 32) = f;
+                *(unaligned_u64 *)(d + n - 24) = g;
+                *(unaligned_u64 *)(d + n - 16) = h;
+                *(unaligned_u64 *)(d + n - 8) = i;
+        } else if (n >= 16) {
+                a = *(unaligned_u64 *)s;
+                b = *(unaligned_u64 *)(s + 8);
+                c = *(unaligned_u64 *)(s + n - 16);
+                e = *(unaligned_u64 *)(s + n - 8);
+                *(unaligned_u64 *)d = a;
+                *(unaligned_u64 *)(d + 8) = b;
+                *(unaligned_u64 *)(d + n - 16) = c;
+                *(unaligned_u64 *)(d + n - 8) = e;
+        } else if (n >= 8) {
+                a = *(unaligned_u64 *)s;
+                b = *(unaligned_u64 *)(s + n - 8);
+                *(unaligned_u64 *)d = a;
+                *(unaligned_u64 *)(d + n - 8) = b;
+        } else if (n >= 4) {
+                a = *(unaligned_u32 *)s;
+                b = *(unaligned_u32 *)(s + n - 4);
+                *(unaligned_u32 *)d = a;
+                *(unaligned_u32 *)(d + n - 4) = b;
+        } else if (n >= 2) {
+                a = *(unaligned_u16 *)s;
+                b = *(unaligned_u16 *)(s + n - 2);
+                *(unaligned_u16 *)d = a;
+                *(unaligned_u16 *)(d + n - 2) = b;
+        } else if (n)
+                *d = *s;
+}
+
+static inline void small_fill(UINT8 *d, UINT64 v, UINTN n)
+{
+        if (n >= 32) {
+                *(unaligned_u64 *)d = v;
+                *(unaligned_u64 *)(d + 8) = v;
+                *(unaligned_u64 *)(d + 16) = v;
+                *(unaligned_u64 *)(d + 24) = v;
+                *(unaligned_u64 *)(d + n - 32) = v;
+                *(unaligned_u64 *)(d + n - 24) = v;
+                *(unaligned_u64 *)(d + n - 16) = v;
+                *(unaligned_u64 *)(d + n - 8) = v;
+        } else if (n >= 16) {
+                *(unaligned_u64 *)d = v;
+                *(unaligned_u64 *)(d + 8) = v;
+                *(unaligned_u64 *)(d + n - 16) = v;
+                *(unaligned_u64 *)(d + n - 8) = v;
+        } else if (n >= 8) {
+                *(unaligned_u64 *)d = v;
+                *(unaligned_u64 *)(d + n - 8) = v;
+        } else if (n >= 4) {
+                *(unaligned_u32 *)d = v;
+                *(unaligned_u32 *)(d + n - 4) = v;
+        } else if (n >= 2) {
+                *(unaligned_u16 *)d = v;
+                *(unaligned_u16 *)(d + n - 2) = v;
+        } else if (n)
+                *d = v;
+}
+
+static inline void rep_movsb(UINT8 *d, const UINT8 *s, UINTN n)
+{
+        asm volatile("rep movsb"
+                     : "+D" (d), "+S" (s), "+c" (n)
+                     :
+                     : "memory");
+}
+
+static inline void rep_movsb_backward(UINT8 *d, const UINT8 *s, UINTN n)
+{
+        d += n - 1;
+        s += n - 1;
+        asm volatile("std\n\t"
+                     "rep movsb\n\t"
+                     "cld"
+                     : "+D" (d), "+S" (s), "+c" (n)
+                     :
+                     : "memory", "cc");
+}
+
+static inline void rep_stosb(UINT8 *p, UINT8 value, UINTN n)
+{
+        asm volatile("rep stosb"
+                     : "+D" (p), "+c" (n)
+                     : "a" (value)
+                     : "memory");
+}
+
+/* Copy N bytes, N being a non-zero multiple of the 4 registers block
+   size.  Each block is entirely loaded before being stored so that a
+   forward copy to a lower overlapping address is safe.  */
+#define DEFINE_VECTOR_COPY(name, load, store, reg, width)               \
+static void name(UINT8 *d, const UINT8 *s, UINTN n)                     \
+{                                                                       \
+        asm volatile("1:\n\t"                                           \
+                     load " (%1), %%" reg "0\n\t"                       \
+                     load " " #width "(%1), %%" reg "1\n\t"             \
+                     load " 2*" #width "(%1), %%" reg "2\n\t"           \
+                     load " 3*" #width "(%1), %%" reg "3\n\t"           \
+                     store " %%" reg "0, (%0)\n\t"                      \
+                     store " %%" reg "1, " #width "(%0)\n\t"            \
+                     store " %%" reg "2, 2*" #width "(%0)\n\t"          \
+                     store " %%" reg "3, 3*" #width "(%0)\n\t"          \
+                     "add $4*" #width ", %0\n\t"                        \
+                     "add $4*" #width ", %1\n\t"                        \
+                     "sub $4*" #width ", %2\n\t"                        \
+                     "jnz 1b"                                           \
+                     : "+r" (d), "+r" (s), "+r" (n)                     \
+                     :                                                  \
+                     : XMM_CLOBBERS "memory", "cc"); \
+}
+
+DEFINE_VECTOR_COPY(sse2_copy, "movdqu", "movdqu", "xmm", 16)
+DEFINE_VECTOR_COPY(sse2_copy_aligned, "movdqa", "movdqa", "xmm", 16)
+
+/* Backward flavor of sse2_copy() for memmove() */
+static void sse2_copy_backward(UINT8 *d, const UINT8 *s, UINTN n)
+{
+        d += n;
+        s += n;
+        asm volatile("1:\n\t"
+                     "sub $64, %0\n\t"
+                     "sub $64, %1\n\t"
+                     "movdqu (%1), %%xmm0\n\t"
+                     "movdqu 16(%1), %%xmm1\n\t"
+                     "movdqu 32(%1), %%xmm2\n\t"
+                     "movdqu 48(%1), %%xmm3\n\t"
+                     "movdqu %%xmm0, (%0)\n\t"
+                     "movdqu %%xmm1, 16(%0)\n\t"
+                     "movdqu %%xmm2, 32(%0)\n\t"
+                     "movdqu %%xmm3, 48(%0)\n\t"
+                     "sub $64, %2\n\t"
+                     "jnz 1b"
+                     : "+r" (d), "+r" (s), "+r" (n)
+                     :
+                     : XMM_CLOBBERS "memory", "cc");
+}
+
+static void sse2_fill(UINT8 *d, const UINT64 pattern[2], UINTN n)
+{
+        asm volatile("movdqu (%2), %%xmm0\n\t"
+                     "1:\n\t"
+                     "movdqu %%xmm0, (%0)\n\t"
+                     "movdqu %%xmm0, 16(%0)\n\t"
+                     "movdqu %%xmm0, 32(%0)\n\t"
+                     "movdqu %%xmm0, 48(%0)\n\t"
+                     "add $64, %0\n\t"
+                     "sub $64, %1\n\t"
+                     "jnz 1b"
+                     : "+r" (d), "+r" (n)
+                     : "r" (pattern)
+                     : XMM_CLOBBERS "memory", "cc");
+}
+
 void *memset(void *s, int c, size_t n)
 {
-        SetMem(s, n, (UINT8)c);
+        UINT64 pattern[2];
+        UINT8 *p = s;
+        UINTN block;
+
+        pattern[0] = pattern[1] = (UINT8)c * 0x0101010101010101ULL;
+        if (n < MEM_SMALL_SIZE) {
+                small_fill(p, pattern[0], n);
+                return s;
+        }
+
+        mem_cpu_init();
+        if (mem_cpu.erms && n >= MEM_ERMS_THRESHOLD) {
+                rep_stosb(p, (UINT8)c, n);
+                return s;
+        }
+
+        if (!mem_cpu.sse2) {
+                rep_stosb(p, (UINT8)c, n);
+                return s;
+        }
+
+        block = n & ~(UINTN)63;
+        if (block)
+                sse2_fill(p, pattern, block);
+
+        small_fill(p + block, pattern[0], n - block);
         return s;
 }
 
 void *memcpy(void *dest, const void *source, size_t count)
 {
-        CopyMem(dest, source, (UINTN)count);
+        UINT8 *d = dest;
+        const UINT8 *s = source;
+        UINTN block;
+
+        if (count < MEM_SMALL_SIZE) {
+                small_copy(d, s, count);
+                return dest;
+        }
+
+        mem_cpu_init();
+        if (!mem_cpu.sse2) {
+                rep_movsb(d, s, count);
+                return dest;
+        }
+
+        /* Aligned fast path for whole pages */
+        if (!(((UINTN)d | (UINTN)s | count) & (EFI_PAGE_SIZE - 1))) {
+                sse2_copy_aligned(d, s, count);
+                return dest;
+        }
+
+        if (mem_cpu.erms && count >= MEM_ERMS_THRESHOLD) {
+                rep_movsb(d, s, count);
+                return dest;
+        }
+
+        block = count & ~(UINTN)63;
+        if (block)
+                sse2_copy(d, s, block);
+
+        small_copy(d + block, s + block, count - block);
         return dest;
 }
 
 void *memmove(void *dst, const void *src, size_t n)
 {
-        size_t offs;
-        ssize_t i;
+        UINT8 *d = dst;
+        const UINT8 *s = src;
+        UINTN block;
 
-        if (src > dst)
+        /* A forward copy is safe unless DST starts within SRC */
+        if ((UINTN)d - (UINTN)s >= n)
                 return memcpy(dst, src, n);
 
-        offs = n - (n % sizeof(unsigned long));
-
-        for (i = (n % sizeof(unsigned long)) - 1; i >= 0; i--)
-                ((UINT8 *)dst)[i + offs] = ((UINT8 *)src)[i + offs];
+        if (n < MEM_SMALL_SIZE) {
+                small_copy(d, s, n);
+                return dst;
+        }
 
-        for (i = n / sizeof(unsigned long) - 1; i >= 0; i--)
-                ((unsigned long *)dst)[i] = ((unsigned long *)src)[i];
+        if (!has_sse2()) {
+                rep_movsb_backward(d, s, n);
+                return dst;
+        }
 
+        /* Highest addresses first: the tail then the blocks */
+        block = n & ~(UINTN)63;
+        small_copy(d + block, s + block, n - block);
+        sse2_copy_backward(d, s, block);
         return dst;
 }
 
-void * __memmove_chk(void * dst, const void * src, size_t len, size_t destlen)
-    __attribute__((weak));
-void * __memmove_chk(void * dst, const void * src, size_t len, size_t destlen)
+void zero_memory_nt(VOID *buf, UINTN len)
+{
+        UINT8 *p = buf;
+        UINTN head, body;
+
+        head = min(len, (UINTN)(-(UINTN)p & 63));
+        rep_stosb(p, 0, head);
+        p += head;
+        len -= head;
+
+        body = len & ~(UINTN)63;
+        if (body && has_sse2()) {
+                len -= body;
+                asm volatile("pxor %%xmm0, %%xmm0\n\t"
+                             "1:\n\t"
+                             "movntdq %%xmm0, (%0)\n\t"
+                             "movntdq %%xmm0, 16(%0)\n\t"
+                             "movntdq %%xmm0, 32(%0)\n\t"
+                             "movntdq %%xmm0, 48(%0)\n\t"
+                             "add $64, %0\n\t"
+                             "sub $64, %1\n\t"
+                             "jnz 1b\n\t"
+                             "sfence"
+                             : "+r" (p), "+r" (body)
+                             :
+                             : XMM_CLOBBERS "memory", "cc");
+        }
+
+        rep_stosb(p, 0, len);
+}
+
+/* Offset of the first byte equal to PATTERN[0] in the N bytes at S,
+   N being a non-zero multiple of 16, or N if there is none.  */
+static UINTN sse2_find(const UINT8 *s, const UINT8 pattern[16], UINTN n)
 {
-        if (destlen < len)
-                panic(L"%a Error: destlen(%d) is less than len(%d)", __func__, destlen, len);
+        UINTN i = 0;
+        UINT32 mask;
 
-        return memmove(dst, src, len);
+        asm volatile("movdqu (%3), %%xmm0\n\t"
+                     "1:\n\t"
+                     "movdqu (%2,%0), %%xmm1\n\t"
+                     "pcmpeqb %%xmm0, %%xmm1\n\t"
+                     "pmovmskb %%xmm1, %1\n\t"
+                     "test %1, %1\n\t"
+                     "jnz 2f\n\t"
+                     "add $16, %0\n\t"
+                     "cmp %4, %0\n\t"
+                     "jb 1b\n\t"
+                     "2:"
+                     : "+&r" (i), "=&r" (mask)
+                     : "r" (s), "r" (pattern), "r" (n)
+                     : XMM_CLOBBERS "memory", "cc");
+
+        return mask ? i + __builtin_ctz(mask) : n;
 }
 
-static int compare_memory_descriptor(const void *a, const void *b)
+const void *mem_find(const void *s, int c, UINTN n)
 {
-        const EFI_MEMORY_DESCRIPTOR *m1 = a, *m2 = b;
+        const UINT8 *p = s;
+        UINT8 pattern[16];
+        UINTN block, i;
 
-        if (m1->PhysicalStart < m2->PhysicalStart)
-                return -1;
-        if (m1->PhysicalStart > m2->PhysicalStart)
-                return 1;
-        return 0;
+        block = n & ~(UINTN)15;
+        if (block >= MEM_SMALL_SIZE && has_sse2()) {
+                memset(pattern, c, sizeof(pattern));
+                i = sse2_find(p, pattern, block);
+                if (i < block)
+                        return p + i;
+                p += block;
+                n -= block;
+        }
+
+        for (; n; n--, p++)
+                if (*p == (UINT8)c)
+                        return p;
+
+        return NULL;
 }
 
-void sort_memory_map(void *descr, UINTN nr_descr, UINTN descr_sz)
+void * __memmove_chk(void * dst, const void * src, size_t len, size_t destlen)
+    __attribute__((weak));
+void * __memmove_chk(void * dst, const void * src, size_t len, size_t destlen)
 {
-        qsort(descr, nr_descr, descr_sz, compare_memory_descriptor);
+        if (destlen < len)
+                panic(L"%a Error: destlen(%d) is less than len(%d)", __func__, destlen, len);
+
+        return memmove(dst, src, len);
 }
 
 static BOOLEAN is_a_leap_year(INTN year)
@@ -1064,47 +2019,33 @@ UINT64 efi_time_to_ctime(EFI_TIME *time)
                 (UINT64)time->Second;
 }
 
-VOID cpuid(UINT32 op, UINT32 reg[4])
+VOID cpuid_count(UINT32 op, UINT32 count, UINT32 reg[4])
 {
 #if __LP64__
         asm volatile("xchg{q}\t{%%}rbx, %q1\n\t"
                      "cpuid\n\t"
                      "xchg{q}\t{%%}rbx, %q1\n\t"
                      : "=a" (reg[0]), "=&r" (reg[1]), "=c" (reg[2]), "=d" (reg[3])
-                     : "a" (op));
+                     : "a" (op), "c" (count));
 #else
         asm volatile("pushl %%ebx      \n\t" /* save %ebx */
                      "cpuid            \n\t"
                      "movl %%ebx, %1   \n\t" /* save what cpuid just put in %ebx */
                      "popl %%ebx       \n\t" /* restore the old %ebx */
                      : "=a"(reg[0]), "=r"(reg[1]), "=c"(reg[2]), "=d"(reg[3])
-                     : "a"(op)
+                     : "a"(op), "c"(count)
                      : "cc");
 #endif
 }
 
-EFI_STATUS generate_random_numbers(CHAR8 *data, UINTN size)
+VOID cpuid(UINT32 op, UINT32 reg[4])
 {
-#define RDRAND_SUPPORT (1 << 30)
-        uint32_t reg[4];
-        int ret;
-        UINTN i, j;
-        unsigned int random;
-
-        cpuid(1, reg);
-        if (!(reg[2] & RDRAND_SUPPORT))
-                return EFI_UNSUPPORTED;
-
-        for (i = 0; i < size; ) {
-                ret = __builtin_ia32_rdrand32_step(&random);
-                if (ret != 1)
-                        return EFI_UNSUPPORTED;
-
-                for (j = 0; j < sizeof(random) && i < size; j++, i++)
-                        data[i] = ((unsigned char *)&random)[j];
-        }
+        cpuid_count(op, 0, reg);
+}
 
-        return EFI_SUCCESS;
+EFI_STATUS generate_random_numbers(CHAR8 *data, UINTN size)
+{
+        return random_get(data, size);
 }
 
 BOOLEAN no_device_unlock()
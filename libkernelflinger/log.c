@@ -36,6 +36,7 @@
 #include "log.h"
 #include "lib.h"
 #include "vars.h"
+#include "gpt.h"
 
 static SERIAL_IO_INTERFACE *serial;
 
@@ -54,6 +55,11 @@ static CHAR8 buf8[BUFFER_SIZE];
 static CHAR8 log_buf[LOG_BUF_SIZE];
 static UINTN pos, last_pos;
 
+#ifndef LOG_RING_SIZE_KB
+#define LOG_RING_SIZE_KB 64
+#endif
+#define LOG_RING_SIZE	(LOG_RING_SIZE_KB * 1024)
+
 EFI_STATUS log_flush_to_var(BOOLEAN nonvol)
 {
 	static volatile BOOLEAN running;
@@ -64,6 +70,14 @@ EFI_STATUS log_flush_to_var(BOOLEAN nonvol)
 	if (running)
 		return EFI_ALREADY_STARTED;
 
+	log_flush();
+
+#ifdef LOG_PARTITION
+	/* The log partition takes over the variable */
+	(void)nonvol;
+	return EFI_SUCCESS;
+#endif
+
 	running = TRUE;
 
 #ifdef USER
@@ -117,6 +131,293 @@ static void log_append_to_buffer(CHAR8 *msg, UINTN length)
 	pos += length;
 }
 
+#ifdef LOG_PARTITION
+/* The partition buffer holds the messages not written yet, preceded
+   by the beginning of the partially written block at the ring head.
+   The block size of the partition must not exceed
+   LOG_PART_MAX_BLOCK.  */
+#define LOG_PART_BUF_SIZE	(64 * 1024)
+#define LOG_PART_MAX_BLOCK	4096
+
+static struct log_part {
+	CHAR8 buf[LOG_PART_BUF_SIZE + 2 * LOG_PART_MAX_BLOCK];
+	UINTN len;
+	UINT64 base;		/* Ring offset of BUF, block aligned */
+	UINTN lost;
+	BOOLEAN busy;
+	BOOLEAN opened;
+	struct gpt_partition_interface gparti;
+	struct log_part_header hdr;
+} part;
+
+#define PART_ALIGN_DOWN(x)	((x) & ~((UINT64)part.hdr.block_size - 1))
+#define PART_ALIGN_UP(x)	PART_ALIGN_DOWN((x) + part.hdr.block_size - 1)
+
+static void log_append_to_part(CHAR8 *msg, UINTN length)
+{
+	if (part.busy)
+		return;
+
+	if (part.len + length > LOG_PART_BUF_SIZE) {
+		part.lost += length;
+		return;
+	}
+
+	memcpy(part.buf + part.len, msg, length);
+	part.len += length;
+}
+
+static EFI_STATUS part_io(BOOLEAN write, UINT64 offset, UINTN size, VOID *buf)
+{
+	EFI_DISK_IO *dio = part.gparti.dio;
+	UINT64 start = part.gparti.part.starting_lba *
+		part.gparti.bio->Media->BlockSize;
+
+	if (write)
+		return uefi_call_wrapper(dio->WriteDisk, 5, dio,
+					 part.gparti.bio->Media->MediaId,
+					 start + offset, size, buf);
+
+	return uefi_call_wrapper(dio->ReadDisk, 5, dio,
+				 part.gparti.bio->Media->MediaId,
+				 start + offset, size, buf);
+}
+
+/* Read or write SIZE bytes at OFFSET of the data ring, OFFSET + SIZE
+   may go past the end of the ring */
+static EFI_STATUS part_ring_io(BOOLEAN write, UINT64 offset, UINTN size,
+			       CHAR8 *buf)
+{
+	EFI_STATUS ret;
+	UINTN first;
+
+	first = min((UINT64)size, part.hdr.data_size - offset);
+	ret = part_io(write, part.hdr.data_offset + offset, first, buf);
+	if (EFI_ERROR(ret) || first == size)
+		return ret;
+
+	return part_io(write, part.hdr.data_offset, size - first, buf + first);
+}
+
+static EFI_STATUS part_write_header(void)
+{
+	CHAR8 block[LOG_PART_MAX_BLOCK];
+
+	memset(block, 0, part.hdr.block_size);
+	memcpy(block, &part.hdr, sizeof(part.hdr));
+	return part_io(TRUE, 0, part.hdr.block_size, block);
+}
+
+static void part_init_header(UINT32 block_size, UINT64 data_size)
+{
+	memset(&part.hdr, 0, sizeof(part.hdr));
+	memcpy(part.hdr.magic, LOG_PART_MAGIC, sizeof(LOG_PART_MAGIC));
+	part.hdr.version = LOG_PART_VERSION;
+	part.hdr.block_size = block_size;
+	part.hdr.data_offset = LOG_PART_DATA_OFFSET;
+	part.hdr.data_size = data_size;
+}
+
+/* Locate the partition and load the partially written block at the
+   ring head in front of the buffered messages */
+static EFI_STATUS part_open(void)
+{
+	EFI_STATUS ret;
+	UINT32 block_size;
+	UINT64 size, data_size;
+	UINTN head_len;
+
+	if (part.opened)
+		return EFI_SUCCESS;
+
+	ret = gpt_get_partition_by_label(CONVERT_TO_WIDE(LOG_PARTITION),
+					 &part.gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	block_size = part.gparti.bio->Media->BlockSize;
+	if (block_size > LOG_PART_MAX_BLOCK || (block_size & (block_size - 1)))
+		return EFI_UNSUPPORTED;
+
+	size = (part.gparti.part.ending_lba + 1 - part.gparti.part.starting_lba) *
+		block_size;
+	if (size < LOG_PART_DATA_OFFSET + sizeof(part.buf))
+		return EFI_BUFFER_TOO_SMALL;
+	data_size = (size - LOG_PART_DATA_OFFSET) & ~((UINT64)block_size - 1);
+
+	ret = part_io(FALSE, 0, sizeof(part.hdr), &part.hdr);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (memcmp(part.hdr.magic, LOG_PART_MAGIC, sizeof(LOG_PART_MAGIC)) ||
+	    part.hdr.version != LOG_PART_VERSION ||
+	    part.hdr.block_size != block_size ||
+	    part.hdr.data_offset != LOG_PART_DATA_OFFSET ||
+	    part.hdr.data_size != data_size ||
+	    part.hdr.head >= data_size)
+		part_init_header(block_size, data_size);
+
+	part.base = PART_ALIGN_DOWN(part.hdr.head);
+	head_len = part.hdr.head - part.base;
+	if (head_len) {
+		memmove(part.buf + head_len, part.buf, part.len);
+		ret = part_ring_io(FALSE, part.base, head_len, part.buf);
+		if (EFI_ERROR(ret)) {
+			memmove(part.buf, part.buf + head_len, part.len);
+			return ret;
+		}
+		part.len += head_len;
+	}
+
+	part.opened = TRUE;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS part_flush(void)
+{
+	EFI_STATUS ret;
+	UINTN size, head_len, done;
+
+	ret = part_open();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	head_len = part.hdr.head - part.base;
+	if (part.len == head_len)
+		return EFI_SUCCESS;
+
+	/* Pad the last block */
+	size = PART_ALIGN_UP(part.len);
+	memset(part.buf + part.len, 0, size - part.len);
+	ret = part_ring_io(TRUE, part.base, size, part.buf);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	part.hdr.head = (part.base + part.len) % part.hdr.data_size;
+	part.hdr.written += part.len - head_len;
+	ret = part_write_header();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	done = PART_ALIGN_DOWN(part.len);
+	memmove(part.buf, part.buf + done, part.len - done);
+	part.len -= done;
+	part.base = (part.base + done) % part.hdr.data_size;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS log_flush_to_partition(void)
+{
+	EFI_STATUS ret;
+
+#ifdef USER
+	if (!is_UEFI() || !device_is_provisioning())
+		return EFI_SUCCESS;
+#endif
+
+	if (part.busy)
+		return EFI_ALREADY_STARTED;
+
+	log_flush();
+
+	part.busy = TRUE;
+	ret = part_flush();
+	part.busy = FALSE;
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (part.lost) {
+		SPrint(buf16, sizeof(buf16), L"%ld bytes of log lost\n",
+		       part.lost);
+		part.lost = 0;
+		if (!EFI_ERROR(str_to_stra(buf8, buf16, StrLen(buf16) + 1)))
+			log_append_to_part(buf8, strlen(buf8));
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS log_read_partition(CHAR8 **buf, UINTN *size)
+{
+	EFI_STATUS ret;
+	UINT64 start;
+
+	if (!buf || !size)
+		return EFI_INVALID_PARAMETER;
+
+	ret = log_flush_to_partition();
+	if (EFI_ERROR(ret))
+		return ret;
+	if (!part.opened)
+		return EFI_NOT_FOUND;
+
+	/* Once the ring has wrapped, the end of the block at the head
+	   has been overwritten by the padding */
+	if (part.hdr.written > part.hdr.head) {
+		start = PART_ALIGN_UP(part.hdr.head) % part.hdr.data_size;
+		*size = (part.hdr.head + part.hdr.data_size - start) %
+			part.hdr.data_size;
+		if (!*size)
+			*size = part.hdr.data_size;
+	} else {
+		start = 0;
+		*size = part.hdr.head;
+	}
+
+	*buf = AllocatePool(*size + 1);
+	if (!*buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = part_ring_io(FALSE, start, *size, *buf);
+	if (EFI_ERROR(ret)) {
+		FreePool(*buf);
+		return ret;
+	}
+	(*buf)[*size] = '\0';
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS log_reset_partition(void)
+{
+	EFI_STATUS ret;
+
+	part.busy = TRUE;
+	ret = part_open();
+	if (!EFI_ERROR(ret)) {
+		part_init_header(part.hdr.block_size, part.hdr.data_size);
+		part.base = 0;
+		part.len = 0;
+		ret = part_write_header();
+	}
+	part.busy = FALSE;
+
+	return ret;
+}
+#else
+static void log_append_to_part(__attribute__((unused)) CHAR8 *msg,
+			       __attribute__((unused)) UINTN length)
+{
+}
+
+EFI_STATUS log_flush_to_partition(void)
+{
+	return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS log_read_partition(__attribute__((unused)) CHAR8 **buf,
+			      __attribute__((unused)) UINTN *size)
+{
+	return EFI_UNSUPPORTED;
+}
+
+EFI_STATUS log_reset_partition(void)
+{
+	return EFI_UNSUPPORTED;
+}
+#endif
+
 static EFI_STATUS serial_init()
 {
 	EFI_STATUS ret;
@@ -140,34 +441,521 @@ static EFI_STATUS serial_init()
 	return EFI_SUCCESS;
 }
 
-void vlog(const CHAR16 *fmt, va_list args)
+/* Write a formatted message to the serial port and to the log
+   buffer */
+static void log_output(const CHAR16 *msg)
 {
 	UINTN length;
 
-	if (!serial && EFI_ERROR(serial_init()))
-		return;
-
-	length = VSPrint(buf16, sizeof(buf16), (CHAR16 *)fmt, args) + 1;
+	length = StrLen((CHAR16 *)msg) + 1;
+	if (length > BUFFER_SIZE)
+		length = BUFFER_SIZE;
 
-	if (EFI_ERROR(str_to_stra(buf8, buf16, length)))
+	if (EFI_ERROR(str_to_stra(buf8, msg, length)))
 		return;
 
 	/* Drop the NUL termination character */
-	length--;
+	length = strlen(buf8);
 	if (EFI_ERROR(uefi_call_wrapper(serial->Write, 3, serial, &length, buf8)))
 		return;
 
 	log_append_to_buffer(buf8, length);
+	log_append_to_part(buf8, length);
+}
+
+#if LOG_RING_SIZE
+/* The messages are recorded in a ring and formatted and written to
+   the serial port by log_flush(), on the BSP.  Recording does not
+   call any UEFI service: it can be done from the Application
+   Processors.  The space is reserved with an atomic operation and
+   a record is only read once committed.
+
+   A record holds the format string and the raw arguments.  Since
+   the formatting is deferred, the strings, GUID and time arguments
+   are copied in the record.  A format which cannot be recorded
+   that way is formatted right away into a text record.  */
+enum log_record_type {
+	LOG_RECORD_FORMAT,
+	LOG_RECORD_TEXT,
+	LOG_RECORD_PAD
+};
+
+struct log_record {
+	UINT32 size;
+	UINT8 type;
+	UINT8 level;
+	UINT8 nargs;
+	volatile UINT8 committed;
+	/* LOG_RECORD_FORMAT: UINT64 args[nargs], the format string and
+	   the copied arguments.  LOG_RECORD_TEXT: the message.  */
+	UINT64 data[0];
+};
+
+#define RECORD_ALIGN(x)	(((x) + sizeof(UINT64) - 1) & ~(sizeof(UINT64) - 1))
+
+#define LOG_MAX_ARGS	12
+#define LOG_MAX_STR	256
+
+enum log_arg {
+	ARG_VALUE,
+	ARG_STR8,
+	ARG_STR16,
+	ARG_GUID,
+	ARG_TIME
+};
+
+static struct log_ring {
+	UINT64 data[LOG_RING_SIZE / sizeof(UINT64)];
+	volatile UINTN head;
+	volatile UINTN tail;
+	volatile UINT32 dropped;
+	BOOLEAN flushing;
+	UINT32 bsp_id;
+	BOOLEAN bsp_known;
+} ring;
+
+static UINT32 apic_id(void)
+{
+	UINT32 reg[4];
+
+	cpuid(1, reg);
+	return reg[1] >> 24;
+}
+
+static BOOLEAN on_bsp(void)
+{
+	return ring.bsp_known && apic_id() == ring.bsp_id;
+}
+
+/* Reserve SIZE bytes.  A record does not wrap around the end of the
+   ring, the end is skipped if it is too short.  */
+static struct log_record *ring_reserve(UINTN size)
+{
+	UINTN head, off, need;
+	struct log_record *pad;
+
+	size = RECORD_ALIGN(size);
+	if (size > LOG_RING_SIZE / 4)
+		return NULL;
+
+	do {
+		head = ring.head;
+		off = head % LOG_RING_SIZE;
+		need = size;
+		if (off + size > LOG_RING_SIZE)
+			need += LOG_RING_SIZE - off;
+		if (head + need - ring.tail > LOG_RING_SIZE)
+			return NULL;
+	} while (!__sync_bool_compare_and_swap(&ring.head, head, head + need));
+
+	if (need != size) {
+		if (LOG_RING_SIZE - off >= sizeof(*pad)) {
+			pad = (struct log_record *)((CHAR8 *)ring.data + off);
+			pad->size = LOG_RING_SIZE - off;
+			pad->type = LOG_RECORD_PAD;
+			__sync_synchronize();
+			pad->committed = TRUE;
+		}
+		off = 0;
+	}
+
+	return (struct log_record *)((CHAR8 *)ring.data + off);
+}
+
+static void ring_commit(struct log_record *rec, UINTN size, UINT8 type, UINT8 level)
+{
+	rec->size = RECORD_ALIGN(size);
+	rec->type = type;
+	rec->level = level;
+	__sync_synchronize();
+	rec->committed = TRUE;
+}
+
+static BOOLEAN parse_format(const CHAR16 *fmt, UINT8 *types, UINTN *nargs)
+{
+	const CHAR16 *p;
+	UINTN n = 0;
+
+	for (p = fmt; *p; p++) {
+		if (*p != '%')
+			continue;
+
+		for (p++; *p; p++) {
+			if (*p == '*') {
+				if (n == LOG_MAX_ARGS)
+					return FALSE;
+				types[n++] = ARG_VALUE;
+				continue;
+			}
+			if ((*p >= '0' && *p <= '9') || *p == '-' || *p == '.' ||
+			    *p == 'l')
+				continue;
+			break;
+		}
+
+		if (*p == '%')
+			continue;
+
+		if (n == LOG_MAX_ARGS)
+			return FALSE;
+
+		switch (*p) {
+		case 'a':
+			types[n++] = ARG_STR8;
+			break;
+		case 's':
+			types[n++] = ARG_STR16;
+			break;
+		case 'g':
+			types[n++] = ARG_GUID;
+			break;
+		case 't':
+			types[n++] = ARG_TIME;
+			break;
+		case 'c':
+		case 'd':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'p':
+		case 'r':
+			types[n++] = ARG_VALUE;
+			break;
+		default:
+			return FALSE;
+		}
+	}
+
+	*nargs = n;
+	return TRUE;
+}
+
+static UINTN arg_size(UINT8 type, UINT64 value)
+{
+	UINTN len;
+
+	if (!value)
+		return 0;
+
+	switch (type) {
+	case ARG_STR8:
+		len = strnlen((CHAR8 *)(UINTN)value, LOG_MAX_STR - 1);
+		return len + 1;
+	case ARG_STR16:
+		for (len = 0; len < LOG_MAX_STR - 1 && ((CHAR16 *)(UINTN)value)[len]; len++)
+			;
+		return (len + 1) * sizeof(CHAR16);
+	case ARG_GUID:
+		return sizeof(EFI_GUID);
+	case ARG_TIME:
+		return sizeof(EFI_TIME);
+	default:
+		return 0;
+	}
+}
+
+/* The arguments of a variadic function are all 64 bits wide on
+   x86_64: the raw values can be passed again to SPrint().  On 32
+   bits, the messages are formatted when they are recorded.  Return
+   EFI_UNSUPPORTED if FMT cannot be recorded as is.  */
+static EFI_STATUS record_format(UINT8 level, const CHAR16 *fmt, va_list args)
+{
+#ifdef __LP64__
+	UINT8 types[LOG_MAX_ARGS];
+	UINTN sizes[LOG_MAX_ARGS];
+	UINT64 values[LOG_MAX_ARGS];
+	UINTN nargs, i, size, fmt_size;
+	struct log_record *rec;
+	CHAR8 *cur;
+
+	if (!parse_format(fmt, types, &nargs))
+		return EFI_UNSUPPORTED;
+
+	fmt_size = (StrLen((CHAR16 *)fmt) + 1) * sizeof(CHAR16);
+	size = sizeof(*rec) + nargs * sizeof(UINT64) + fmt_size;
+	for (i = 0; i < nargs; i++) {
+		values[i] = va_arg(args, UINT64);
+		sizes[i] = arg_size(types[i], values[i]);
+		size += sizes[i];
+	}
+
+	rec = ring_reserve(size);
+	if (!rec)
+		return EFI_BUFFER_TOO_SMALL;
+
+	cur = (CHAR8 *)(rec->data + nargs);
+	memcpy(cur, fmt, fmt_size);
+	cur += fmt_size;
+	for (i = 0; i < nargs; i++) {
+		rec->data[i] = values[i];
+		if (!sizes[i])
+			continue;
+
+		memcpy(cur, (VOID *)(UINTN)values[i], sizes[i]);
+		if (types[i] == ARG_STR8)
+			cur[sizes[i] - 1] = '\0';
+		else if (types[i] == ARG_STR16)
+			((CHAR16 *)cur)[sizes[i] / sizeof(CHAR16) - 1] = 0;
+		rec->data[i] = (UINTN)cur;
+		cur += sizes[i];
+	}
+
+	rec->nargs = nargs;
+	ring_commit(rec, size, LOG_RECORD_FORMAT, level);
+	return EFI_SUCCESS;
+#else
+	(void)level;
+	(void)fmt;
+	(void)args;
+	return EFI_UNSUPPORTED;
+#endif
+}
+
+static EFI_STATUS record_text(UINT8 level, const CHAR16 *fmt, va_list args)
+{
+	CHAR16 msg16[BUFFER_SIZE];
+	struct log_record *rec;
+	UINTN length;
+
+	length = VSPrint(msg16, sizeof(msg16), (CHAR16 *)fmt, args) + 1;
+
+	rec = ring_reserve(sizeof(*rec) + length * sizeof(CHAR16));
+	if (!rec)
+		return EFI_BUFFER_TOO_SMALL;
+
+	memcpy(rec->data, msg16, length * sizeof(CHAR16));
+	ring_commit(rec, sizeof(*rec) + length * sizeof(CHAR16),
+		    LOG_RECORD_TEXT, level);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS ring_record(UINT8 level, const CHAR16 *fmt, va_list args)
+{
+	EFI_STATUS ret;
+	va_list copy;
+
+	va_copy(copy, args);
+	ret = record_format(level, fmt, copy);
+	va_end(copy);
+	if (ret == EFI_UNSUPPORTED)
+		ret = record_text(level, fmt, args);
+
+	return ret;
+}
+
+static void log_output_record(struct log_record *rec)
+{
+	UINT64 a[LOG_MAX_ARGS] = { 0 };
+	CHAR16 *fmt;
+
+	if (rec->type == LOG_RECORD_TEXT) {
+		log_output((CHAR16 *)rec->data);
+		return;
+	}
+
+	memcpy(a, rec->data, rec->nargs * sizeof(*a));
+	fmt = (CHAR16 *)(rec->data + rec->nargs);
+	SPrint(buf16, sizeof(buf16), fmt, a[0], a[1], a[2], a[3], a[4], a[5],
+	       a[6], a[7], a[8], a[9], a[10], a[11]);
+	log_output(buf16);
+}
+
+void log_flush(void)
+{
+	struct log_record *rec;
+	UINTN off;
+	UINT32 dropped;
+
+	if (ring.tail == ring.head && !ring.dropped)
+		return;
+
+	if (!on_bsp() || ring.flushing)
+		return;
+
+	if (!serial && EFI_ERROR(serial_init()))
+		return;
+
+	ring.flushing = TRUE;
+	while (ring.tail != ring.head) {
+		off = ring.tail % LOG_RING_SIZE;
+		if (LOG_RING_SIZE - off < sizeof(*rec)) {
+			ring.tail += LOG_RING_SIZE - off;
+			continue;
+		}
+
+		rec = (struct log_record *)((CHAR8 *)ring.data + off);
+		if (!rec->committed)
+			break;
+		__sync_synchronize();
+
+		if (rec->type != LOG_RECORD_PAD)
+			log_output_record(rec);
+
+		/* The released space is zeroed so that a record being
+		   filled is never seen as committed */
+		off = rec->size;
+		memset(rec, 0, off);
+		__sync_synchronize();
+		ring.tail += off;
+	}
+
+	dropped = __sync_lock_test_and_set(&ring.dropped, 0);
+	if (dropped) {
+		SPrint(buf16, sizeof(buf16), L"%d log messages dropped\n", dropped);
+		log_output(buf16);
+	}
+	ring.flushing = FALSE;
+}
+
+void vlog_at(UINT8 level, const CHAR16 *fmt, va_list args)
+{
+	EFI_STATUS ret;
+	va_list copy;
+
+	/* The first message is logged by the BSP */
+	if (!ring.bsp_known) {
+		ring.bsp_id = apic_id();
+		ring.bsp_known = TRUE;
+	}
+
+	va_copy(copy, args);
+	ret = ring_record(level, fmt, copy);
+	va_end(copy);
+
+	/* The BSP makes room when the ring is full, the APs drop the
+	   message */
+	if (EFI_ERROR(ret) && on_bsp()) {
+		log_flush();
+		ret = ring_record(level, fmt, args);
+	}
+	if (EFI_ERROR(ret))
+		__sync_fetch_and_add(&ring.dropped, 1);
+
+	/* Warnings and errors are written right away */
+	if (level >= LOG_LEVEL_WARNING)
+		log_flush();
+}
+#else
+void log_flush(void)
+{
+}
+
+void vlog_at(__attribute__((unused)) UINT8 level, const CHAR16 *fmt,
+	     va_list args)
+{
+	if (!serial && EFI_ERROR(serial_init()))
+		return;
+
+	VSPrint(buf16, sizeof(buf16), (CHAR16 *)fmt, args);
+	log_output(buf16);
+}
+#endif
+
+void log_at(UINT8 level, const CHAR16 *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vlog_at(level, fmt, args);
+	va_end(args);
+}
+
+void vlog(const CHAR16 *fmt, va_list args)
+{
+	if (log_enabled(LOG_LEVEL_INFO))
+		vlog_at(LOG_LEVEL_INFO, fmt, args);
 }
 
 void log(const CHAR16 *fmt, ...)
 {
 	va_list args;
 
-	if (!serial && EFI_ERROR(serial_init()))
+	if (!log_enabled(LOG_LEVEL_INFO))
 		return;
 
 	va_start(args, fmt);
-	vlog(fmt, args);
+	vlog_at(LOG_LEVEL_INFO, fmt, args);
 	va_end(args);
 }
+
+#ifndef LOG_DEFAULT_LEVEL
+#define LOG_DEFAULT_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+UINT8 log_levels[LOG_MODULE_COUNT] = {
+	[0 ... LOG_MODULE_COUNT - 1] = LOG_DEFAULT_LEVEL
+};
+
+static const char *LOG_MODULE_NAMES[] = {
+	[LOG_MODULE_DEFAULT] = "default",
+	[LOG_MODULE_GPT] = "gpt",
+	[LOG_MODULE_SPARSE] = "sparse",
+	[LOG_MODULE_FLASH] = "flash",
+	[LOG_MODULE_FASTBOOT] = "fastboot"
+};
+
+static const char *LOG_LEVEL_NAMES[] = {
+	[LOG_LEVEL_DEBUG] = "debug",
+	[LOG_LEVEL_INFO] = "info",
+	[LOG_LEVEL_WARNING] = "warning",
+	[LOG_LEVEL_ERROR] = "error"
+};
+
+EFI_STATUS log_load_levels(void)
+{
+	EFI_STATUS ret;
+	UINT8 *levels;
+	UINTN size, i;
+
+	ret = get_efi_variable(&loader_guid, LOG_LEVEL_VAR, &size,
+			       (VOID **)&levels, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Unknown modules are ignored, missing ones keep the default */
+	for (i = 0; i < min(size, (UINTN)LOG_MODULE_COUNT); i++)
+		if (levels[i] <= LOG_LEVEL_ERROR)
+			log_levels[i] = levels[i];
+
+	FreePool(levels);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS log_save_levels(void)
+{
+	return set_efi_variable(&loader_guid, LOG_LEVEL_VAR,
+				sizeof(log_levels), log_levels, TRUE, FALSE);
+}
+
+const char *log_module_name(UINTN module)
+{
+	return module < ARRAY_SIZE(LOG_MODULE_NAMES) ?
+		LOG_MODULE_NAMES[module] : NULL;
+}
+
+const char *log_level_name(UINT8 level)
+{
+	return level < ARRAY_SIZE(LOG_LEVEL_NAMES) ?
+		LOG_LEVEL_NAMES[level] : NULL;
+}
+
+static INTN find_name(const char **names, UINTN nb, const char *name)
+{
+	UINTN i;
+
+	for (i = 0; i < nb; i++)
+		if (!strcmp((CHAR8 *)names[i], (CHAR8 *)name))
+			return i;
+
+	return -1;
+}
+
+INTN log_module_from_name(const char *name)
+{
+	return find_name(LOG_MODULE_NAMES, ARRAY_SIZE(LOG_MODULE_NAMES), name);
+}
+
+INTN log_level_from_name(const char *name)
+{
+	return find_name(LOG_LEVEL_NAMES, ARRAY_SIZE(LOG_LEVEL_NAMES), name);
+}
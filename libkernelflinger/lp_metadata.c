@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <openssl/sha.h>
+
+#include "lib.h"
+#include "vars.h"
+#include "gpt.h"
+#include "slot.h"
+#include "lp_metadata.h"
+
+/* On-disk format of the LP metadata, see Android system/core/fs_mgr/
+   liblp/include/liblp/metadata_format.h.  The first
+   LP_PARTITION_RESERVED_BYTES of super are not used, they are
+   followed by the geometry, its backup copy, the primary metadata
+   slots and the backup metadata slots.  */
+#define LP_PARTITION_RESERVED_BYTES	4096
+#define LP_METADATA_GEOMETRY_MAGIC	0x616c4467
+#define LP_METADATA_GEOMETRY_SIZE	4096
+#define LP_METADATA_HEADER_MAGIC	0x414C5030
+#define LP_METADATA_MAJOR_VERSION	10
+#define LP_METADATA_MAX_SIZE		(1024 * 1024)
+#define LP_SECTOR_SIZE			512
+#define LP_TARGET_TYPE_LINEAR		0
+#define LP_TARGET_TYPE_ZERO		1
+
+struct lp_geometry {
+	UINT32 magic;
+	UINT32 struct_size;
+	UINT8 checksum[32];
+	UINT32 metadata_max_size;
+	UINT32 metadata_slot_count;
+	UINT32 logical_block_size;
+} __attribute__((packed));
+
+struct lp_table_descriptor {
+	UINT32 offset;
+	UINT32 num_entries;
+	UINT32 entry_size;
+} __attribute__((packed));
+
+struct lp_header {
+	UINT32 magic;
+	UINT16 major_version;
+	UINT16 minor_version;
+	UINT32 header_size;
+	UINT8 header_checksum[32];
+	UINT32 tables_size;
+	UINT8 tables_checksum[32];
+	struct lp_table_descriptor partitions;
+	struct lp_table_descriptor extents;
+	struct lp_table_descriptor groups;
+	struct lp_table_descriptor block_devices;
+} __attribute__((packed));
+
+/* Header of the version 10.2, with the flags */
+#define LP_HEADER_MAX_SIZE	256
+
+struct lp_metadata_partition {
+	char name[LP_NAME_LEN];
+	UINT32 attributes;
+	UINT32 first_extent_index;
+	UINT32 num_extents;
+	UINT32 group_index;
+} __attribute__((packed));
+
+struct lp_metadata_extent {
+	UINT64 num_sectors;
+	UINT32 target_type;
+	UINT64 target_data;
+	UINT32 target_source;
+} __attribute__((packed));
+
+/* Parsed metadata of the active slot */
+static struct {
+	BOOLEAN loaded;
+	UINT32 gpt_generation;
+	const char *slot;
+	struct gpt_partition_interface super;
+	UINT64 metadata_end;	/* Disk offset of the end of the metadata */
+	struct lp_partition *parts;
+	UINT32 nb_parts;
+	struct lp_extent *extents;
+} lp;
+
+static EFI_STATUS read_super(struct gpt_partition_interface *super,
+			     UINT64 offset, UINTN len, VOID *buf)
+{
+	UINT64 super_size;
+
+	super_size = (super->part.ending_lba + 1 - super->part.starting_lba) *
+		super->bio->Media->BlockSize;
+	if (offset > super_size || len > super_size - offset)
+		return EFI_END_OF_MEDIA;
+
+	return uefi_call_wrapper(super->dio->ReadDisk, 5, super->dio,
+				 super->bio->Media->MediaId,
+				 super->part.starting_lba * super->bio->Media->BlockSize +
+				 offset, len, buf);
+}
+
+static BOOLEAN checksum_ok(VOID *data, UINTN len, UINT8 *checksum)
+{
+	UINT8 expected[SHA256_DIGEST_LENGTH];
+	UINT8 digest[SHA256_DIGEST_LENGTH];
+
+	memcpy(expected, checksum, sizeof(expected));
+	memset(checksum, 0, sizeof(expected));
+	SHA256(data, len, digest);
+	memcpy(checksum, expected, sizeof(expected));
+
+	return !memcmp(digest, expected, sizeof(digest));
+}
+
+static EFI_STATUS read_geometry(struct gpt_partition_interface *super,
+				struct lp_geometry *geo)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	/* Primary, then backup copy */
+	for (i = 0; i < 2; i++) {
+		ret = read_super(super, LP_PARTITION_RESERVED_BYTES +
+				 i * LP_METADATA_GEOMETRY_SIZE, sizeof(*geo), geo);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		if (geo->magic == LP_METADATA_GEOMETRY_MAGIC &&
+		    geo->struct_size == sizeof(*geo) &&
+		    checksum_ok(geo, sizeof(*geo), geo->checksum) &&
+		    geo->metadata_slot_count &&
+		    geo->metadata_max_size &&
+		    geo->metadata_max_size <= LP_METADATA_MAX_SIZE &&
+		    !(geo->metadata_max_size % LP_SECTOR_SIZE))
+			return EFI_SUCCESS;
+
+		debug(L"Invalid LP geometry copy %d", i);
+	}
+
+	return EFI_NOT_FOUND;
+}
+
+static BOOLEAN table_ok(struct lp_header *hdr, struct lp_table_descriptor *desc,
+			UINTN entry_size)
+{
+	return desc->entry_size == entry_size &&
+		desc->offset <= hdr->tables_size &&
+		desc->num_entries <= (hdr->tables_size - desc->offset) / entry_size;
+}
+
+/* Read and check the metadata at OFFSET of super, *BUF gets the
+   header followed by the tables */
+static EFI_STATUS read_metadata(struct gpt_partition_interface *super,
+				struct lp_geometry *geo, UINT64 offset,
+				UINT8 **buf)
+{
+	struct lp_header *hdr;
+	UINT8 digest[SHA256_DIGEST_LENGTH];
+	UINT8 *data;
+	EFI_STATUS ret;
+
+	data = AllocatePool(geo->metadata_max_size);
+	if (!data)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = read_super(super, offset, geo->metadata_max_size, data);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	ret = EFI_COMPROMISED_DATA;
+	hdr = (struct lp_header *)data;
+	if (hdr->magic != LP_METADATA_HEADER_MAGIC ||
+	    hdr->major_version != LP_METADATA_MAJOR_VERSION ||
+	    hdr->header_size < sizeof(*hdr) ||
+	    hdr->header_size > LP_HEADER_MAX_SIZE ||
+	    hdr->tables_size > geo->metadata_max_size - hdr->header_size ||
+	    !checksum_ok(hdr, hdr->header_size, hdr->header_checksum) ||
+	    !table_ok(hdr, &hdr->partitions, sizeof(struct lp_metadata_partition)) ||
+	    !table_ok(hdr, &hdr->extents, sizeof(struct lp_metadata_extent))) {
+		debug(L"Invalid LP metadata header at 0x%llx", offset);
+		goto err;
+	}
+
+	SHA256(data + hdr->header_size, hdr->tables_size, digest);
+	if (memcmp(digest, hdr->tables_checksum, sizeof(digest))) {
+		debug(L"Invalid LP metadata tables at 0x%llx", offset);
+		goto err;
+	}
+
+	*buf = data;
+	return EFI_SUCCESS;
+
+err:
+	FreePool(data);
+	return ret;
+}
+
+static void lp_free(void)
+{
+	if (lp.parts)
+		FreePool(lp.parts);
+	if (lp.extents)
+		FreePool(lp.extents);
+	lp.parts = NULL;
+	lp.extents = NULL;
+	lp.nb_parts = 0;
+	lp.loaded = FALSE;
+}
+
+static EFI_STATUS parse_extents(struct lp_metadata_extent *mext, UINT32 nb,
+				UINT64 super_size, struct lp_extent *ext)
+{
+	UINT32 i;
+
+	for (i = 0; i < nb; i++) {
+		if (mext[i].num_sectors > super_size / LP_SECTOR_SIZE)
+			return EFI_COMPROMISED_DATA;
+
+		ext[i].size = mext[i].num_sectors * LP_SECTOR_SIZE;
+		ext[i].zero = mext[i].target_type == LP_TARGET_TYPE_ZERO;
+		ext[i].offset = 0;
+		if (ext[i].zero)
+			continue;
+
+		/* Only the super partition itself is supported as
+		   block device */
+		if (mext[i].target_type != LP_TARGET_TYPE_LINEAR ||
+		    mext[i].target_source != 0)
+			return EFI_UNSUPPORTED;
+
+		if (mext[i].target_data > super_size / LP_SECTOR_SIZE ||
+		    ext[i].size > super_size - mext[i].target_data * LP_SECTOR_SIZE)
+			return EFI_COMPROMISED_DATA;
+		ext[i].offset = mext[i].target_data * LP_SECTOR_SIZE;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS parse_metadata(UINT8 *data, UINT64 super_size)
+{
+	struct lp_header *hdr = (struct lp_header *)data;
+	UINT8 *tables = data + hdr->header_size;
+	struct lp_metadata_partition *mpart;
+	struct lp_partition *part;
+	EFI_STATUS ret;
+	UINT32 i, j;
+
+	lp.parts = AllocateZeroPool(max(hdr->partitions.num_entries, 1U) *
+				    sizeof(*lp.parts));
+	lp.extents = AllocatePool(max(hdr->extents.num_entries, 1U) *
+				  sizeof(*lp.extents));
+	if (!lp.parts || !lp.extents)
+		return EFI_OUT_OF_RESOURCES;
+
+	ret = parse_extents((struct lp_metadata_extent *)(tables + hdr->extents.offset),
+			    hdr->extents.num_entries, super_size, lp.extents);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Invalid LP metadata extent");
+		return ret;
+	}
+
+	mpart = (struct lp_metadata_partition *)(tables + hdr->partitions.offset);
+	for (i = 0; i < hdr->partitions.num_entries; i++, mpart++) {
+		if (mpart->first_extent_index > hdr->extents.num_entries ||
+		    mpart->num_extents > hdr->extents.num_entries - mpart->first_extent_index) {
+			error(L"Invalid LP metadata partition %d", i);
+			return EFI_COMPROMISED_DATA;
+		}
+
+		part = &lp.parts[lp.nb_parts++];
+		for (j = 0; j < LP_NAME_LEN && mpart->name[j]; j++)
+			part->name[j] = mpart->name[j];
+		part->name[j] = '\0';
+		part->attributes = mpart->attributes;
+		part->nb_extents = mpart->num_extents;
+		part->extents = &lp.extents[mpart->first_extent_index];
+		for (j = 0; j < part->nb_extents; j++)
+			part->size += part->extents[j].size;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS lp_load(void)
+{
+	struct gpt_partition_interface super;
+	struct lp_geometry geo;
+	const char *slot;
+	UINT64 super_size, offset;
+	UINT8 *data = NULL;
+	UINTN index;
+	EFI_STATUS ret;
+
+	slot = slot_get_active();
+	if (lp.loaded && lp.gpt_generation == gpt_cache_generation() &&
+	    lp.slot == slot)
+		return EFI_SUCCESS;
+
+	lp_free();
+
+	ret = gpt_get_partition_by_label(SUPER_LABEL, &super, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = read_geometry(&super, &geo);
+	if (EFI_ERROR(ret)) {
+		error(L"No valid LP geometry in the super partition");
+		return ret;
+	}
+
+	/* The metadata slots follow the order of the A/B slots */
+	index = slot ? (UINTN)(slot[1] - 'a') : 0;
+	if (index >= geo.metadata_slot_count)
+		index = 0;
+
+	offset = LP_PARTITION_RESERVED_BYTES + 2 * LP_METADATA_GEOMETRY_SIZE +
+		index * geo.metadata_max_size;
+	ret = read_metadata(&super, &geo, offset, &data);
+	if (EFI_ERROR(ret)) {
+		debug(L"Primary LP metadata is invalid, trying the backup");
+		offset += (UINT64)geo.metadata_slot_count * geo.metadata_max_size;
+		ret = read_metadata(&super, &geo, offset, &data);
+	}
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"No valid LP metadata for slot %d", index);
+		return ret;
+	}
+
+	super_size = (super.part.ending_lba + 1 - super.part.starting_lba) *
+		super.bio->Media->BlockSize;
+	ret = parse_metadata(data, super_size);
+	FreePool(data);
+	if (EFI_ERROR(ret)) {
+		lp_free();
+		return ret;
+	}
+
+	lp.super = super;
+	lp.metadata_end = super.part.starting_lba * super.bio->Media->BlockSize +
+		LP_PARTITION_RESERVED_BYTES + 2 * LP_METADATA_GEOMETRY_SIZE +
+		2 * (UINT64)geo.metadata_slot_count * geo.metadata_max_size;
+	lp.slot = slot;
+	lp.gpt_generation = gpt_cache_generation();
+	lp.loaded = TRUE;
+	debug(L"%d logical partitions in LP metadata slot %d", lp.nb_parts, index);
+
+	return EFI_SUCCESS;
+}
+
+static struct lp_partition *find_partition(const CHAR16 *name)
+{
+	UINT32 i;
+
+	for (i = 0; i < lp.nb_parts; i++)
+		if (!StrCmp(lp.parts[i].name, name))
+			return &lp.parts[i];
+
+	return NULL;
+}
+
+EFI_STATUS lp_get_partition(const CHAR16 *name, const struct lp_partition **part,
+			    struct gpt_partition_interface *super)
+{
+	CHAR16 label[LP_NAME_LEN + 1];
+	struct lp_partition *found;
+	EFI_STATUS ret;
+	UINTN len;
+
+	if (!name || !part)
+		return EFI_INVALID_PARAMETER;
+
+	ret = lp_load();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	found = find_partition(name);
+	len = StrLen(name);
+	if (!found && lp.slot && len + 2 <= LP_NAME_LEN) {
+		memcpy(label, name, len * sizeof(*name));
+		label[len] = lp.slot[0];
+		label[len + 1] = lp.slot[1];
+		label[len + 2] = '\0';
+		found = find_partition(label);
+	}
+	if (!found)
+		return EFI_NOT_FOUND;
+
+	*part = found;
+	if (super)
+		*super = lp.super;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS lp_get_partition_interface(const CHAR16 *name,
+				      struct gpt_partition_interface *gparti)
+{
+	const struct lp_partition *part;
+	UINT32 block_size;
+	EFI_STATUS ret;
+
+	if (!gparti)
+		return EFI_INVALID_PARAMETER;
+
+	ret = lp_get_partition(name, &part, gparti);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	block_size = gparti->bio->Media->BlockSize;
+	if (part->nb_extents != 1 || part->extents[0].zero ||
+	    part->extents[0].offset % block_size ||
+	    part->extents[0].size % block_size) {
+		debug(L"Logical partition %s is not a single aligned extent", part->name);
+		return EFI_UNSUPPORTED;
+	}
+
+	gparti->part.starting_lba += part->extents[0].offset / block_size;
+	gparti->part.ending_lba = gparti->part.starting_lba +
+		part->extents[0].size / block_size - 1;
+	gparti->part.attrs.whole = 0;
+	ZeroMem(gparti->part.name, sizeof(gparti->part.name));
+	memcpy(gparti->part.name, part->name,
+	       min(StrLen(part->name), (UINTN)GPT_NAME_LEN - 1) * sizeof(CHAR16));
+
+	return EFI_SUCCESS;
+}
+
+void lp_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size)
+{
+	UINT64 start;
+
+	if (!lp.loaded)
+		return;
+
+	start = lp.super.part.starting_lba * lp.super.bio->Media->BlockSize;
+	if (bio && (bio != lp.super.bio || offset >= lp.metadata_end ||
+		    offset + size <= start))
+		return;
+
+	lp_free();
+}
@@ -0,0 +1,830 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "lz4.h"
+#include "mp_pool.h"
+
+#define LZ4_MAGIC		0x184D2204
+#define LZ4_LEGACY_MAGIC	0x184C2102
+#define LZ4_SKIPPABLE_MAGIC	0x184D2A50
+#define LZ4_SKIPPABLE_MASK	0xFFFFFFF0
+
+#define FLG_VERSION_MASK	0xC0
+#define FLG_VERSION		0x40
+#define FLG_BLOCK_INDEP		(1 << 5)
+#define FLG_BLOCK_CHECKSUM	(1 << 4)
+#define FLG_CONTENT_SIZE	(1 << 3)
+#define FLG_CONTENT_CHECKSUM	(1 << 2)
+#define FLG_DICT_ID		(1 << 0)
+
+#define BLOCK_UNCOMPRESSED	0x80000000
+#define WINDOW_SIZE		(64 * 1024)
+#define MIN_MATCH		4
+/* The last match must start 12 bytes before the end of the block and
+   the last 5 bytes are always literals */
+#define MF_LIMIT		12
+#define LAST_LITERALS		5
+#define MAX_DISTANCE		(WINDOW_SIZE - 1)
+#define BD_BLOCK_MAX_1MB	(6 << 4)
+/* FLG, BD, content size, dictionary ID and header checksum */
+#define MAX_DESCRIPTOR_SIZE	(2 + 8 + 4 + 1)
+
+/* xxHash32, used by the frame header, block and content checksums */
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME32_4 0x27D4EB2FU
+#define PRIME32_5 0x165667B1U
+
+struct xxh32 {
+	UINT32 v[4];
+	UINT64 total_len;
+	UINT8 mem[16];
+	UINT32 memsize;
+};
+
+static inline UINT32 rotl32(UINT32 x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline UINT32 read_le32(const UINT8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static inline UINT32 xxh32_round(UINT32 acc, UINT32 input)
+{
+	return rotl32(acc + input * PRIME32_2, 13) * PRIME32_1;
+}
+
+static void xxh32_init(struct xxh32 *x)
+{
+	memset(x, 0, sizeof(*x));
+	x->v[0] = PRIME32_1 + PRIME32_2;
+	x->v[1] = PRIME32_2;
+	x->v[2] = 0;
+	x->v[3] = -PRIME32_1;
+}
+
+static void xxh32_stripe(struct xxh32 *x, const UINT8 *p)
+{
+	x->v[0] = xxh32_round(x->v[0], read_le32(p));
+	x->v[1] = xxh32_round(x->v[1], read_le32(p + 4));
+	x->v[2] = xxh32_round(x->v[2], read_le32(p + 8));
+	x->v[3] = xxh32_round(x->v[3], read_le32(p + 12));
+}
+
+static void xxh32_update(struct xxh32 *x, const UINT8 *p, UINTN len)
+{
+	UINTN fill;
+
+	x->total_len += len;
+
+	if (x->memsize) {
+		fill = min(len, sizeof(x->mem) - x->memsize);
+		memcpy(x->mem + x->memsize, p, fill);
+		x->memsize += fill;
+		p += fill;
+		len -= fill;
+		if (x->memsize < sizeof(x->mem))
+			return;
+		xxh32_stripe(x, x->mem);
+		x->memsize = 0;
+	}
+
+	for (; len >= sizeof(x->mem); len -= sizeof(x->mem), p += sizeof(x->mem))
+		xxh32_stripe(x, p);
+
+	memcpy(x->mem, p, len);
+	x->memsize = len;
+}
+
+static UINT32 xxh32_digest(struct xxh32 *x)
+{
+	const UINT8 *p = x->mem;
+	UINT32 len = x->memsize;
+	UINT32 h;
+
+	if (x->total_len >= sizeof(x->mem))
+		h = rotl32(x->v[0], 1) + rotl32(x->v[1], 7) +
+			rotl32(x->v[2], 12) + rotl32(x->v[3], 18);
+	else
+		h = x->v[2] + PRIME32_5;
+
+	h += (UINT32)x->total_len;
+
+	for (; len >= 4; len -= 4, p += 4)
+		h = rotl32(h + read_le32(p) * PRIME32_3, 17) * PRIME32_4;
+	for (; len; len--, p++)
+		h = rotl32(h + *p * PRIME32_5, 11) * PRIME32_1;
+
+	h ^= h >> 15;
+	h *= PRIME32_2;
+	h ^= h >> 13;
+	h *= PRIME32_3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static UINT32 xxh32(const UINT8 *p, UINTN len)
+{
+	struct xxh32 x;
+
+	xxh32_init(&x);
+	xxh32_update(&x, p, len);
+	return xxh32_digest(&x);
+}
+
+enum lz4_state {
+	LZ4_STATE_MAGIC,
+	LZ4_STATE_DESCRIPTOR,
+	LZ4_STATE_BLOCK_SIZE,
+	LZ4_STATE_BLOCK_DATA,
+	LZ4_STATE_CONTENT_CHECKSUM,
+	LZ4_STATE_SKIP_SIZE,
+	LZ4_STATE_SKIP,
+	LZ4_STATE_ERROR
+};
+
+static struct lz4_stream {
+	enum lz4_state state;
+	lz4_output_t output;
+	BOOLEAN frame_done;
+	/* Bytes consumed in the current state */
+	UINTN consumed;
+	UINT8 hdr[MAX_DESCRIPTOR_SIZE];
+	UINTN hdr_size;
+	UINT8 flg;
+	UINTN block_max;
+	UINTN block_size;
+	BOOLEAN block_compressed;
+	UINT32 skip_size;
+	struct xxh32 content;
+	/* Input block buffer */
+	UINT8 *in;
+	/* History window followed by the block output area */
+	UINT8 *win;
+	UINTN hist;
+} lz;
+
+BOOLEAN is_lz4_frame(VOID *data, UINTN size)
+{
+	if (size < sizeof(UINT32) + 3)
+		return FALSE;
+
+	return read_le32(data) == LZ4_MAGIC;
+}
+
+static void free_buffers(void)
+{
+	if (lz.in) {
+		FreePool(lz.in);
+		lz.in = NULL;
+	}
+	if (lz.win) {
+		FreePool(lz.win);
+		lz.win = NULL;
+	}
+}
+
+/* Consume up to WANTED - LZ.CONSUMED bytes of DATA into DST if not
+   NULL and return the number of bytes consumed.  */
+static UINTN take(void *dst, UINTN wanted, UINT8 *data, UINTN size)
+{
+	UINTN len = min(wanted - lz.consumed, size);
+
+	if (dst)
+		memcpy((UINT8 *)dst + lz.consumed, data, len);
+	lz.consumed += len;
+
+	return len;
+}
+
+/* Decode the SIZE bytes LZ4 block IP into OSTART which can hold OMAX
+   bytes.  A match cannot refer below LOWEST.  It neither logs nor
+   calls any UEFI service so that it can run on the Application
+   Processors.  */
+static BOOLEAN decode(const UINT8 *ip, UINTN size, UINT8 *ostart, UINTN omax,
+		      const UINT8 *lowest, UINTN *produced)
+{
+	const UINT8 *iend = ip + size;
+	UINT8 *op = ostart;
+	UINT8 *oend = ostart + omax;
+	const UINT8 *match;
+	UINTN len, offset;
+	UINT8 token, b;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		/* Literals */
+		len = token >> 4;
+		if (len == 15)
+			do {
+				if (ip >= iend)
+					return FALSE;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		if (len > (UINTN)(iend - ip) || len > (UINTN)(oend - op))
+			return FALSE;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* The last sequence only has literals */
+		if (ip == iend)
+			break;
+
+		/* Match */
+		if (iend - ip < 2)
+			return FALSE;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > (UINTN)(op - lowest))
+			return FALSE;
+
+		len = token & 15;
+		if (len == 15)
+			do {
+				if (ip >= iend)
+					return FALSE;
+				b = *ip++;
+				len += b;
+			} while (b == 255);
+		len += MIN_MATCH;
+		if (len > (UINTN)(oend - op))
+			return FALSE;
+
+		match = op - offset;
+		if (offset >= len) {
+			memcpy(op, match, len);
+			op += len;
+		} else
+			while (len--)
+				*op++ = *match++;
+	}
+
+	*produced = op - ostart;
+	return TRUE;
+}
+
+static EFI_STATUS decode_block(UINT8 *ip, UINTN size, UINTN *produced)
+{
+	UINT8 *ostart = lz.win + lz.hist;
+	UINT8 *lowest = lz.flg & FLG_BLOCK_INDEP ? ostart : lz.win;
+
+	if (!decode(ip, size, ostart, lz.block_max, lowest, produced)) {
+		error(L"Malformed LZ4 block");
+		return EFI_COMPROMISED_DATA;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS process_block(void)
+{
+	EFI_STATUS ret;
+	UINTN produced, total;
+
+	if (lz.flg & FLG_BLOCK_CHECKSUM &&
+	    xxh32(lz.in, lz.block_size) != read_le32(lz.in + lz.block_size)) {
+		error(L"LZ4 block checksum mismatch");
+		return EFI_CRC_ERROR;
+	}
+
+	if (lz.block_compressed) {
+		ret = decode_block(lz.in, lz.block_size, &produced);
+		if (EFI_ERROR(ret))
+			return ret;
+	} else {
+		memcpy(lz.win + lz.hist, lz.in, lz.block_size);
+		produced = lz.block_size;
+	}
+
+	if (lz.flg & FLG_CONTENT_CHECKSUM)
+		xxh32_update(&lz.content, lz.win + lz.hist, produced);
+
+	ret = lz.output(lz.win + lz.hist, produced);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Keep the last 64 KB for the next linked block */
+	if (lz.flg & FLG_BLOCK_INDEP) {
+		lz.hist = 0;
+		return EFI_SUCCESS;
+	}
+
+	total = lz.hist + produced;
+	if (total > WINDOW_SIZE) {
+		memmove(lz.win, lz.win + total - WINDOW_SIZE, WINDOW_SIZE);
+		lz.hist = WINDOW_SIZE;
+	} else
+		lz.hist = total;
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS parse_descriptor(void)
+{
+	static const UINTN BLOCK_MAX[] = {
+		64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024
+	};
+	UINT8 bd = lz.hdr[1], id;
+	UINTN block_max;
+
+	if (lz.hdr[lz.hdr_size - 1] != ((xxh32(lz.hdr, lz.hdr_size - 1) >> 8) & 0xFF)) {
+		error(L"LZ4 frame descriptor checksum mismatch");
+		return EFI_CRC_ERROR;
+	}
+
+	id = (bd >> 4) & 0x7;
+	if (id < 4) {
+		error(L"Invalid LZ4 block maximum size");
+		return EFI_COMPROMISED_DATA;
+	}
+	block_max = BLOCK_MAX[id - 4];
+
+	if (lz.block_max != block_max) {
+		free_buffers();
+		lz.in = AllocatePool(block_max + sizeof(UINT32));
+		lz.win = AllocatePool(WINDOW_SIZE + block_max);
+		if (!lz.in || !lz.win) {
+			free_buffers();
+			error(L"Failed to allocate LZ4 buffers");
+			return EFI_OUT_OF_RESOURCES;
+		}
+		lz.block_max = block_max;
+	}
+
+	lz.hist = 0;
+	xxh32_init(&lz.content);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS step(UINT8 *data, UINTN size, UINTN *used)
+{
+	EFI_STATUS ret;
+	UINT32 value;
+
+	switch (lz.state) {
+	case LZ4_STATE_MAGIC:
+		*used = take(lz.hdr, sizeof(UINT32), data, size);
+		if (lz.consumed < sizeof(UINT32))
+			return EFI_SUCCESS;
+		lz.consumed = 0;
+		value = read_le32(lz.hdr);
+		if ((value & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+			lz.state = LZ4_STATE_SKIP_SIZE;
+			return EFI_SUCCESS;
+		}
+		if (value != LZ4_MAGIC) {
+			error(L"Invalid LZ4 frame magic 0x%08x", value);
+			return EFI_COMPROMISED_DATA;
+		}
+		lz.frame_done = FALSE;
+		lz.hdr_size = 3;
+		lz.state = LZ4_STATE_DESCRIPTOR;
+		return EFI_SUCCESS;
+
+	case LZ4_STATE_DESCRIPTOR:
+		*used = take(lz.hdr, lz.hdr_size, data, size);
+		if (lz.consumed < lz.hdr_size)
+			return EFI_SUCCESS;
+		if (lz.consumed == 3) {
+			lz.flg = lz.hdr[0];
+			if ((lz.flg & FLG_VERSION_MASK) != FLG_VERSION) {
+				error(L"Unsupported LZ4 frame version");
+				return EFI_UNSUPPORTED;
+			}
+			if (lz.flg & FLG_DICT_ID) {
+				error(L"LZ4 frames with dictionary are not supported");
+				return EFI_UNSUPPORTED;
+			}
+			if (lz.flg & FLG_CONTENT_SIZE) {
+				lz.hdr_size += sizeof(UINT64);
+				return EFI_SUCCESS;
+			}
+		}
+		ret = parse_descriptor();
+		if (EFI_ERROR(ret))
+			return ret;
+		lz.consumed = 0;
+		lz.state = LZ4_STATE_BLOCK_SIZE;
+		return EFI_SUCCESS;
+
+	case LZ4_STATE_BLOCK_SIZE:
+		*used = take(lz.hdr, sizeof(UINT32), data, size);
+		if (lz.consumed < sizeof(UINT32))
+			return EFI_SUCCESS;
+		lz.consumed = 0;
+		value = read_le32(lz.hdr);
+		if (!value) {
+			if (lz.flg & FLG_CONTENT_CHECKSUM)
+				lz.state = LZ4_STATE_CONTENT_CHECKSUM;
+			else {
+				lz.frame_done = TRUE;
+				lz.state = LZ4_STATE_MAGIC;
+			}
+			return EFI_SUCCESS;
+		}
+		lz.block_compressed = !(value & BLOCK_UNCOMPRESSED);
+		lz.block_size = value & ~BLOCK_UNCOMPRESSED;
+		if (lz.block_size > lz.block_max) {
+			error(L"LZ4 block too large, %d", lz.block_size);
+			return EFI_COMPROMISED_DATA;
+		}
+		lz.state = LZ4_STATE_BLOCK_DATA;
+		return EFI_SUCCESS;
+
+	case LZ4_STATE_BLOCK_DATA:
+		value = lz.block_size;
+		if (lz.flg & FLG_BLOCK_CHECKSUM)
+			value += sizeof(UINT32);
+		*used = take(lz.in, value, data, size);
+		if (lz.consumed < value)
+			return EFI_SUCCESS;
+		lz.consumed = 0;
+		lz.state = LZ4_STATE_BLOCK_SIZE;
+		return process_block();
+
+	case LZ4_STATE_CONTENT_CHECKSUM:
+		*used = take(lz.hdr, sizeof(UINT32), data, size);
+		if (lz.consumed < sizeof(UINT32))
+			return EFI_SUCCESS;
+		if (read_le32(lz.hdr) != xxh32_digest(&lz.content)) {
+			error(L"LZ4 content checksum mismatch");
+			return EFI_CRC_ERROR;
+		}
+		lz.consumed = 0;
+		lz.frame_done = TRUE;
+		lz.state = LZ4_STATE_MAGIC;
+		return EFI_SUCCESS;
+
+	case LZ4_STATE_SKIP_SIZE:
+		*used = take(lz.hdr, sizeof(UINT32), data, size);
+		if (lz.consumed < sizeof(UINT32))
+			return EFI_SUCCESS;
+		lz.consumed = 0;
+		lz.skip_size = read_le32(lz.hdr);
+		lz.state = LZ4_STATE_SKIP;
+		return EFI_SUCCESS;
+
+	case LZ4_STATE_SKIP:
+		*used = take(NULL, lz.skip_size, data, size);
+		if (lz.consumed < lz.skip_size)
+			return EFI_SUCCESS;
+		lz.consumed = 0;
+		lz.state = LZ4_STATE_MAGIC;
+		return EFI_SUCCESS;
+
+	default:
+		return EFI_INVALID_PARAMETER;
+	}
+}
+
+EFI_STATUS lz4_stream_start(lz4_output_t output)
+{
+	if (!output)
+		return EFI_INVALID_PARAMETER;
+
+	free_buffers();
+	memset(&lz, 0, sizeof(lz));
+	lz.state = LZ4_STATE_MAGIC;
+	lz.output = output;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS lz4_stream_write(VOID *data, UINTN size)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINT8 *p = data;
+	UINTN used;
+
+	if (lz.state == LZ4_STATE_ERROR)
+		return EFI_INVALID_PARAMETER;
+
+	while (size) {
+		used = 0;
+		ret = step(p, size, &used);
+		if (EFI_ERROR(ret)) {
+			lz.state = LZ4_STATE_ERROR;
+			break;
+		}
+		p += used;
+		size -= used;
+	}
+
+	return ret;
+}
+
+EFI_STATUS lz4_stream_end(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	if (lz.state == LZ4_STATE_ERROR)
+		ret = EFI_INVALID_PARAMETER;
+	else if (lz.state != LZ4_STATE_MAGIC || lz.consumed || !lz.frame_done) {
+		error(L"LZ4 stream truncated");
+		ret = EFI_END_OF_FILE;
+	}
+
+	free_buffers();
+	lz.block_max = 0;
+	return ret;
+}
+
+/* LZ4 frame encoder */
+static UINT8 *write_len(UINT8 *op, UINTN len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+static UINT8 *write_sequence(UINT8 *op, UINT8 *oend, const UINT8 *literals,
+			     UINTN lit, UINTN offset, UINTN match)
+{
+	UINT8 *token;
+
+	/* Token, literals length, literals, offset and match length */
+	if ((UINTN)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1)
+		return NULL;
+
+	token = op++;
+
+	*token = min(lit, (UINTN)15) << 4;
+	if (lit >= 15)
+		op = write_len(op, lit - 15);
+	memcpy(op, literals, lit);
+	op += lit;
+
+	if (!offset)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	match -= MIN_MATCH;
+	*token |= min(match, (UINTN)15);
+	if (match >= 15)
+		op = write_len(op, match - 15);
+
+	return op;
+}
+
+static inline UINT32 hash_seq(UINT32 seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Greedy compression of the SIZE bytes of SRC into at most CAPACITY
+   bytes.  Return the compressed size, or 0 if it does not fit.  The
+   search step grows with the consecutive misses so that incompressible
+   data is skipped quickly.  */
+static UINTN compress_block(const UINT8 *src, UINTN size, UINT8 *dst,
+			    UINTN capacity, UINT32 *table)
+{
+	const UINT8 *ip = src, *anchor = src, *ref;
+	const UINT8 *mflimit = src + size - MF_LIMIT;
+	const UINT8 *matchlimit = src + size - LAST_LITERALS;
+	UINT8 *op = dst, *oend = dst + capacity;
+	UINTN len, attempts = 1 << 6;
+	UINT32 seq, h;
+
+	memset(table, 0, LZ4_HASH_SIZE * sizeof(*table));
+
+	if (size <= MF_LIMIT)
+		goto last_literals;
+
+	for (ip++; ip < mflimit; ) {
+		seq = read_le32(ip);
+		h = hash_seq(seq);
+		ref = src + table[h];
+		table[h] = ip - src;
+
+		if ((UINTN)(ip - ref) > MAX_DISTANCE || read_le32(ref) != seq) {
+			ip += attempts++ >> 6;
+			continue;
+		}
+		attempts = 1 << 6;
+
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+
+		for (len = MIN_MATCH; ip + len < matchlimit && ip[len] == ref[len]; len++)
+			;
+
+		op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+		if (!op)
+			return 0;
+
+		ip += len;
+		anchor = ip;
+	}
+
+last_literals:
+	op = write_sequence(op, oend, anchor, src + size - anchor, 0, 0);
+	return op ? (UINTN)(op - dst) : 0;
+}
+
+UINTN lz4_frame_header(VOID *buf)
+{
+	UINT8 *p = buf;
+
+	p[0] = LZ4_MAGIC & 0xFF;
+	p[1] = (LZ4_MAGIC >> 8) & 0xFF;
+	p[2] = (LZ4_MAGIC >> 16) & 0xFF;
+	p[3] = LZ4_MAGIC >> 24;
+	p[4] = FLG_VERSION | FLG_BLOCK_INDEP;
+	p[5] = BD_BLOCK_MAX_1MB;
+	p[6] = (xxh32(p + 4, 2) >> 8) & 0xFF;
+
+	return LZ4_FRAME_HEADER_SIZE;
+}
+
+UINTN lz4_frame_block(const VOID *src, UINTN size, VOID *dst, UINT32 *table)
+{
+	UINT8 *p = dst;
+	UINT32 block_size;
+
+	if (!size)
+		return 0;
+
+	block_size = compress_block(src, size, p + LZ4_BLOCK_HEADER_SIZE,
+				    size - 1, table);
+	if (!block_size) {
+		memcpy(p + LZ4_BLOCK_HEADER_SIZE, src, size);
+		block_size = size | BLOCK_UNCOMPRESSED;
+	}
+
+	p[0] = block_size & 0xFF;
+	p[1] = (block_size >> 8) & 0xFF;
+	p[2] = (block_size >> 16) & 0xFF;
+	p[3] = block_size >> 24;
+
+	return LZ4_BLOCK_HEADER_SIZE + (block_size & ~BLOCK_UNCOMPRESSED);
+}
+
+UINTN lz4_frame_end(VOID *buf)
+{
+	memset(buf, 0, LZ4_FRAME_END_SIZE);
+	return LZ4_FRAME_END_SIZE;
+}
+
+/* LZ4 legacy format: the block offsets are collected on the BSP, the
+   blocks are then decoded in parallel, each to its
+   LZ4_LEGACY_BLOCK_SIZE slot of the output.  */
+static struct lz4_legacy {
+	UINTN count;
+	struct {
+		const UINT8 *src;
+		UINT32 size;
+		UINTN produced;
+		BOOLEAN failed;
+	} blocks[LZ4_LEGACY_MAX_BLOCKS];
+	UINT8 *dst;
+} legacy;
+
+BOOLEAN is_lz4_legacy(VOID *data, UINTN size)
+{
+	if (size < 2 * sizeof(UINT32))
+		return FALSE;
+
+	return read_le32(data) == LZ4_LEGACY_MAGIC;
+}
+
+/* Concatenated streams repeat the magic number.  Up to three trailing
+   bytes are ignored, like the Linux kernel does.  */
+static EFI_STATUS legacy_parse(const UINT8 *p, UINTN size)
+{
+	const UINT8 *end = p + size;
+	UINT32 block_size;
+
+	legacy.count = 0;
+	while ((UINTN)(end - p) >= sizeof(UINT32)) {
+		block_size = read_le32(p);
+		p += sizeof(UINT32);
+		if (block_size == LZ4_LEGACY_MAGIC)
+			continue;
+
+		if (!block_size || block_size > (UINTN)(end - p))
+			return EFI_COMPROMISED_DATA;
+		if (legacy.count == ARRAY_SIZE(legacy.blocks))
+			return EFI_BUFFER_TOO_SMALL;
+
+		legacy.blocks[legacy.count].src = p;
+		legacy.blocks[legacy.count].size = block_size;
+		legacy.count++;
+		p += block_size;
+	}
+
+	return legacy.count ? EFI_SUCCESS : EFI_COMPROMISED_DATA;
+}
+
+EFI_STATUS lz4_legacy_block_count(VOID *data, UINTN size, UINTN *count)
+{
+	EFI_STATUS ret;
+
+	if (!data || !count || !is_lz4_legacy(data, size))
+		return EFI_INVALID_PARAMETER;
+
+	ret = legacy_parse(data, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	*count = legacy.count;
+	return EFI_SUCCESS;
+}
+
+static void legacy_decode(UINTN start, UINTN end,
+			  __attribute__((__unused__)) VOID *ctx)
+{
+	UINT8 *dst;
+	UINTN i;
+
+	for (i = start; i < end; i++) {
+		dst = legacy.dst + i * LZ4_LEGACY_BLOCK_SIZE;
+		legacy.blocks[i].failed =
+			!decode(legacy.blocks[i].src, legacy.blocks[i].size,
+				dst, LZ4_LEGACY_BLOCK_SIZE, dst,
+				&legacy.blocks[i].produced);
+	}
+}
+
+EFI_STATUS lz4_legacy_decompress(VOID *src, UINTN size, VOID *dst,
+				 UINTN dst_size, UINTN *produced)
+{
+	EFI_STATUS ret;
+	UINT8 *out;
+	UINTN i;
+
+	if (!src || !dst || !produced || !is_lz4_legacy(src, size))
+		return EFI_INVALID_PARAMETER;
+
+	ret = legacy_parse(src, size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (dst_size / LZ4_LEGACY_BLOCK_SIZE < legacy.count)
+		return EFI_BUFFER_TOO_SMALL;
+
+	legacy.dst = dst;
+	ret = parallel_for(legacy.count, 1, legacy_decode, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Only the last block is expected to be short but the
+	   decompressed data is kept contiguous anyway */
+	out = dst;
+	for (i = 0; i < legacy.count; i++) {
+		if (legacy.blocks[i].failed) {
+			error(L"Malformed LZ4 legacy block %d", i);
+			return EFI_COMPROMISED_DATA;
+		}
+		if (out != legacy.dst + i * LZ4_LEGACY_BLOCK_SIZE)
+			memmove(out, legacy.dst + i * LZ4_LEGACY_BLOCK_SIZE,
+				legacy.blocks[i].produced);
+		out += legacy.blocks[i].produced;
+	}
+
+	*produced = out - (UINT8 *)dst;
+	return EFI_SUCCESS;
+}
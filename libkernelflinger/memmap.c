@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "memmap.h"
+
+#define DESCR(descr, i, sz)						\
+	((EFI_MEMORY_DESCRIPTOR *)((UINT8 *)(descr) + (i) * (sz)))
+
+/* The insertion sort gives up after INSERTION_BUDGET moves per
+   descriptor on average.  */
+#define INSERTION_BUDGET	4
+
+#define RADIX_BITS	8
+#define RADIX_SIZE	(1 << RADIX_BITS)
+#define RADIX_PASSES	((64 - EFI_PAGE_SHIFT + RADIX_BITS - 1) / RADIX_BITS)
+#define DIGIT(key, pass)	(((key) >> ((pass) * RADIX_BITS)) & (RADIX_SIZE - 1))
+
+/* Descriptors added to the memory map by the growth of the fetch
+   buffer, with some margin.  */
+#define MEMMAP_SLACK		8
+#define MEMMAP_MAX_RETRY	3
+
+typedef struct sort_key {
+	UINT64 page;
+	UINT16 index;
+} sort_key_t;
+
+static sort_key_t keys[MEMMAP_MAX_DESCR], keys_tmp[MEMMAP_MAX_DESCR];
+static UINT16 histogram[RADIX_PASSES][RADIX_SIZE];
+
+static struct {
+	UINT8 *raw;		/* GetMemoryMap() buffer */
+	UINT8 *sorted;
+	UINTN size;		/* Size of each buffer */
+	BOOLEAN valid;
+	UINTN key;
+	UINTN nr_descr;
+	UINTN descr_sz;
+} cache;
+
+static int compare_memory_descriptor(const void *a, const void *b)
+{
+	const EFI_MEMORY_DESCRIPTOR *m1 = a, *m2 = b;
+
+	if (m1->PhysicalStart < m2->PhysicalStart)
+		return -1;
+	if (m1->PhysicalStart > m2->PhysicalStart)
+		return 1;
+	return 0;
+}
+
+/* Return FALSE if the budget is exhausted.  The array is then left
+   partially sorted.  */
+static BOOLEAN insertion_sort(UINT8 *descr, UINTN nr, UINTN sz)
+{
+	UINT8 tmp[MEMMAP_MAX_DESCR_SZ];
+	UINTN i, j, budget = nr * INSERTION_BUDGET;
+	EFI_PHYSICAL_ADDRESS start;
+
+	for (i = 1; i < nr; i++) {
+		start = DESCR(descr, i, sz)->PhysicalStart;
+		for (j = i; j > 0; j--)
+			if (DESCR(descr, j - 1, sz)->PhysicalStart <= start)
+				break;
+		if (j == i)
+			continue;
+
+		if (i - j > budget)
+			return FALSE;
+		budget -= i - j;
+
+		memcpy(tmp, DESCR(descr, i, sz), sz);
+		memmove(DESCR(descr, j + 1, sz), DESCR(descr, j, sz), (i - j) * sz);
+		memcpy(DESCR(descr, j, sz), tmp, sz);
+	}
+
+	return TRUE;
+}
+
+/* LSD radix sort of the page numbers.  The passes on digits shared by
+   all the descriptors are skipped.  */
+static void radix_sort(UINT8 *descr, UINTN nr, UINTN sz)
+{
+	UINT8 tmp[MEMMAP_MAX_DESCR_SZ];
+	sort_key_t *src = keys, *dst = keys_tmp, *swp;
+	UINTN i, j, k, pass, digit, pos, count;
+
+	memset(histogram, 0, sizeof(histogram));
+	for (i = 0; i < nr; i++) {
+		src[i].page = DESCR(descr, i, sz)->PhysicalStart >> EFI_PAGE_SHIFT;
+		src[i].index = i;
+		for (pass = 0; pass < RADIX_PASSES; pass++)
+			histogram[pass][DIGIT(src[i].page, pass)]++;
+	}
+
+	for (pass = 0; pass < RADIX_PASSES; pass++) {
+		if (histogram[pass][DIGIT(src[0].page, pass)] == nr)
+			continue;
+
+		for (pos = 0, digit = 0; digit < RADIX_SIZE; digit++) {
+			count = histogram[pass][digit];
+			histogram[pass][digit] = pos;
+			pos += count;
+		}
+		for (i = 0; i < nr; i++)
+			dst[histogram[pass][DIGIT(src[i].page, pass)]++] = src[i];
+
+		swp = src;
+		src = dst;
+		dst = swp;
+	}
+
+	/* Position i receives the descriptor SRC[i].index: apply the
+	   permutation one cycle at a time.  */
+	for (i = 0; i < nr; i++) {
+		if (src[i].index == i)
+			continue;
+
+		memcpy(tmp, DESCR(descr, i, sz), sz);
+		for (j = i; src[j].index != i; j = k) {
+			k = src[j].index;
+			memcpy(DESCR(descr, j, sz), DESCR(descr, k, sz), sz);
+			src[j].index = j;
+		}
+		memcpy(DESCR(descr, j, sz), tmp, sz);
+		src[j].index = j;
+	}
+}
+
+void sort_memory_map(void *descr, UINTN nr_descr, UINTN descr_sz)
+{
+	if (descr_sz > MEMMAP_MAX_DESCR_SZ) {
+		qsort(descr, nr_descr, descr_sz, compare_memory_descriptor);
+		return;
+	}
+
+	if (insertion_sort(descr, nr_descr, descr_sz))
+		return;
+
+	if (nr_descr <= MEMMAP_MAX_DESCR)
+		radix_sort(descr, nr_descr, descr_sz);
+	else
+		qsort(descr, nr_descr, descr_sz, compare_memory_descriptor);
+}
+
+UINTN memmap_coalesce(void *descr, UINTN nr_descr, UINTN descr_sz)
+{
+	EFI_MEMORY_DESCRIPTOR *prev, *cur;
+	UINTN i, nr;
+
+	if (!nr_descr)
+		return 0;
+
+	for (nr = 1, i = 1; i < nr_descr; i++) {
+		prev = DESCR(descr, nr - 1, descr_sz);
+		cur = DESCR(descr, i, descr_sz);
+		if (cur->Type == prev->Type &&
+		    cur->Attribute == prev->Attribute &&
+		    prev->PhysicalStart + prev->NumberOfPages * EFI_PAGE_SIZE ==
+		    cur->PhysicalStart) {
+			prev->NumberOfPages += cur->NumberOfPages;
+			continue;
+		}
+
+		if (nr != i)
+			memcpy(DESCR(descr, nr, descr_sz), cur, descr_sz);
+		nr++;
+	}
+
+	return nr;
+}
+
+static EFI_STATUS grow_buffers(UINTN size)
+{
+	UINT8 *buf;
+
+	buf = AllocatePool(size * 2);
+	if (!buf)
+		return EFI_OUT_OF_RESOURCES;
+
+	if (cache.raw)
+		FreePool(cache.raw);
+	cache.raw = buf;
+	cache.sorted = buf + size;
+	cache.size = size;
+	cache.valid = FALSE;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS memmap_get(CHAR8 **descr, UINTN *nr_descr, UINTN *descr_sz,
+		      UINTN *key)
+{
+	EFI_STATUS ret;
+	UINTN size, map_key, sz, retry;
+	UINT32 ver;
+
+	if (!descr || !nr_descr || !descr_sz)
+		return EFI_INVALID_PARAMETER;
+
+	/* Once the buffers are large enough, fetching the memory map
+	   does not change it.  */
+	for (retry = 0; ; retry++) {
+		size = cache.size;
+		sz = sizeof(EFI_MEMORY_DESCRIPTOR);
+		ret = uefi_call_wrapper(BS->GetMemoryMap, 5, &size,
+					(EFI_MEMORY_DESCRIPTOR *)cache.raw,
+					&map_key, &sz, &ver);
+		if (ret != EFI_BUFFER_TOO_SMALL || retry == MEMMAP_MAX_RETRY)
+			break;
+
+		ret = grow_buffers(size + MEMMAP_SLACK * sz);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to allocate the memory map buffers");
+			return ret;
+		}
+	}
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get the current memory map");
+		return ret;
+	}
+
+	if (!cache.valid || cache.key != map_key) {
+		memcpy(cache.sorted, cache.raw, size);
+		sort_memory_map(cache.sorted, size / sz, sz);
+		cache.nr_descr = memmap_coalesce(cache.sorted, size / sz, sz);
+		cache.descr_sz = sz;
+		cache.key = map_key;
+		cache.valid = TRUE;
+	}
+
+	*descr = (CHAR8 *)cache.sorted;
+	*nr_descr = cache.nr_descr;
+	*descr_sz = cache.descr_sz;
+	if (key)
+		*key = map_key;
+
+	return EFI_SUCCESS;
+}
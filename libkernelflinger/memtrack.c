@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+
+#ifdef MEMTRACK
+
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "memtrack.h"
+
+struct memtrack_record {
+	const void *ptr;	/* NULL if the record is free */
+	UINTN size;
+	const char *file;
+	UINT32 line;
+	enum memtrack_tag tag;
+};
+
+static struct memtrack_record records[MEMTRACK_MAX_RECORDS];
+static struct memtrack_stats stats[MT_TAG_LAST + 1];
+static UINT64 dropped;
+
+static const char *tag_names[MT_TAG_LAST] = {
+	[MT_MISC] = "misc",
+	[MT_DOWNLOAD] = "download",
+	[MT_FLASH] = "flash",
+	[MT_SPARSE] = "sparse",
+	[MT_HASH] = "hash",
+	[MT_BOOTIMG] = "bootimg",
+	[MT_AVB] = "avb"
+};
+
+/* __FILE__ carries the build path */
+static const char *file_name(const char *path)
+{
+	const char *name = path;
+
+	for (; *path; path++)
+		if (*path == '/')
+			name = path + 1;
+
+	return name;
+}
+
+static struct memtrack_record *lookup(const void *ptr)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(records); i++)
+		if (records[i].ptr == ptr)
+			return &records[i];
+
+	return NULL;
+}
+
+static void account(struct memtrack_stats *s, UINTN size, BOOLEAN alloc)
+{
+	if (alloc) {
+		s->live += size;
+		s->allocs++;
+		s->peak = max(s->peak, s->live);
+	} else {
+		s->live -= size;
+		s->frees++;
+	}
+}
+
+static void release(struct memtrack_record *rec)
+{
+	account(&stats[rec->tag], rec->size, FALSE);
+	account(&stats[MT_TAG_LAST], rec->size, FALSE);
+	rec->ptr = NULL;
+}
+
+void memtrack_add(enum memtrack_tag tag, const void *ptr, UINTN size,
+		  const char *file, UINT32 line)
+{
+	struct memtrack_record *rec;
+
+	if (!ptr || tag >= MT_TAG_LAST)
+		return;
+
+	/* A stale record left by an untracked free */
+	rec = lookup(ptr);
+	if (rec)
+		release(rec);
+	else
+		rec = lookup(NULL);
+
+	if (!rec) {
+		dropped++;
+		return;
+	}
+
+	rec->ptr = ptr;
+	rec->size = size;
+	rec->file = file_name(file);
+	rec->line = line;
+	rec->tag = tag;
+	account(&stats[tag], size, TRUE);
+	account(&stats[MT_TAG_LAST], size, TRUE);
+}
+
+void memtrack_del(const void *ptr)
+{
+	struct memtrack_record *rec;
+
+	if (!ptr)
+		return;
+
+	rec = lookup(ptr);
+	if (rec)
+		release(rec);
+}
+
+void memtrack_failure(enum memtrack_tag tag, UINTN size,
+		      const char *file, UINT32 line)
+{
+	if (tag >= MT_TAG_LAST)
+		return;
+
+	stats[tag].failures++;
+	stats[tag].last_failure = size;
+	stats[MT_TAG_LAST].failures++;
+	stats[MT_TAG_LAST].last_failure = size;
+	error(L"%a:%d: failed to allocate %ld bytes, %ld bytes live",
+	      file_name(file), line, (UINT64)size, stats[MT_TAG_LAST].live);
+}
+
+void *memtrack_pool(enum memtrack_tag tag, UINTN size, BOOLEAN zero,
+		    const char *file, UINT32 line)
+{
+	void *ptr;
+
+	ptr = zero ? AllocateZeroPool(size) : AllocatePool(size);
+	if (ptr)
+		memtrack_add(tag, ptr, size, file, line);
+	else
+		memtrack_failure(tag, size, file, line);
+
+	return ptr;
+}
+
+void memtrack_free_pool(void *ptr)
+{
+	memtrack_del(ptr);
+	FreePool(ptr);
+}
+
+EFI_STATUS memtrack_alloc_aligned(enum memtrack_tag tag, VOID **free_addr,
+				  VOID **aligned_addr, UINTN size, UINTN align,
+				  const char *file, UINT32 line)
+{
+	EFI_STATUS ret;
+
+	/* The buffer is released with FreePool(FREE_ADDR) */
+	ret = alloc_aligned(free_addr, aligned_addr, size, align);
+	if (EFI_ERROR(ret))
+		memtrack_failure(tag, size + align, file, line);
+	else
+		memtrack_add(tag, *free_addr, size + align, file, line);
+
+	return ret;
+}
+
+const char *memtrack_tag_name(enum memtrack_tag tag)
+{
+	if (tag == MT_TAG_LAST)
+		return "total";
+
+	return tag < MT_TAG_LAST ? tag_names[tag] : "unknown";
+}
+
+const struct memtrack_stats *memtrack_get_stats(enum memtrack_tag tag)
+{
+	return tag <= MT_TAG_LAST ? &stats[tag] : NULL;
+}
+
+static BOOLEAN same_site(const struct memtrack_site *site,
+			 const struct memtrack_record *rec)
+{
+	return site->line == rec->line && site->tag == rec->tag &&
+		!strcmp((CHAR8 *)site->file, (CHAR8 *)rec->file);
+}
+
+UINTN memtrack_get_sites(struct memtrack_site *sites, UINTN max)
+{
+	struct memtrack_site tmp;
+	UINTN i, j, nb = 0;
+
+	for (i = 0; i < ARRAY_SIZE(records); i++) {
+		if (!records[i].ptr)
+			continue;
+
+		for (j = 0; j < nb; j++)
+			if (same_site(&sites[j], &records[i]))
+				break;
+
+		if (j == nb) {
+			if (nb == max)
+				continue;
+			sites[j].file = records[i].file;
+			sites[j].line = records[i].line;
+			sites[j].tag = records[i].tag;
+			sites[j].count = 0;
+			sites[j].live = 0;
+			nb++;
+		}
+
+		sites[j].count++;
+		sites[j].live += records[i].size;
+	}
+
+	/* At most a few dozen sites: insertion sort */
+	for (i = 1; i < nb; i++) {
+		tmp = sites[i];
+		for (j = i; j > 0 && sites[j - 1].live < tmp.live; j--)
+			sites[j] = sites[j - 1];
+		sites[j] = tmp;
+	}
+
+	return nb;
+}
+
+UINT64 memtrack_dropped(void)
+{
+	return dropped;
+}
+
+void memtrack_reset_peaks(void)
+{
+	UINTN i;
+
+	for (i = 0; i <= MT_TAG_LAST; i++)
+		stats[i].peak = stats[i].live;
+}
+
+#endif	/* MEMTRACK */
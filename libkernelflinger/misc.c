@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "vars.h"
+#include "android.h"
+#include "uefi_utils.h"
+#include "blkcache.h"
+#include "misc.h"
+
+#define MISC_REGION_SIZE	sizeof(struct bootloader_message_ab)
+
+static struct {
+	BOOLEAN loaded;
+	UINT32 gpt_generation;
+	struct gpt_partition_interface gparti;
+	UINT64 start;		/* Absolute disk offset of the region */
+	UINTN size;		/* Block aligned */
+	UINT8 *data;
+	UINTN dirty_begin;
+	UINTN dirty_end;	/* 0 if nothing is dirty */
+} misc;
+
+static BOOLEAN defer_writes;
+static BOOLEAN committing;
+
+static EFI_STATUS misc_load(void)
+{
+	struct gpt_partition_interface gparti;
+	UINT64 part_size;
+	UINTN size;
+	EFI_STATUS ret;
+
+	if (misc.loaded && misc.gpt_generation == gpt_cache_generation())
+		return EFI_SUCCESS;
+
+	if (misc.dirty_end)
+		error(L"Partition table changed, misc updates are lost");
+	misc.loaded = FALSE;
+	misc.dirty_end = 0;
+
+	ret = gpt_get_partition_by_label(MISC_LABEL, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	part_size = (gparti.part.ending_lba - gparti.part.starting_lba + 1) *
+		gparti.bio->Media->BlockSize;
+	size = ALIGN(MISC_REGION_SIZE, gparti.bio->Media->BlockSize);
+	if (size > part_size)
+		size = part_size;
+
+	if (misc.data && misc.size != size) {
+		FreePool(misc.data);
+		misc.data = NULL;
+	}
+	if (!misc.data) {
+		misc.data = AllocatePool(size);
+		if (!misc.data)
+			return EFI_OUT_OF_RESOURCES;
+	}
+
+	misc.gparti = gparti;
+	misc.start = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	misc.size = size;
+
+	ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+				gparti.bio->Media->MediaId,
+				misc.start, misc.size, misc.data);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read the misc partition");
+		return ret;
+	}
+
+	misc.gpt_generation = gpt_cache_generation();
+	misc.loaded = TRUE;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS misc_read(UINT64 offset, UINTN size, VOID *buf)
+{
+	EFI_STATUS ret;
+
+	if (!buf)
+		return EFI_INVALID_PARAMETER;
+
+	ret = misc_load();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (offset > misc.size || size > misc.size - offset)
+		return EFI_NOT_FOUND;
+
+	memcpy(buf, misc.data + offset, size);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS misc_write(UINT64 offset, UINTN size, const VOID *buf)
+{
+	EFI_STATUS ret;
+
+	if (!buf)
+		return EFI_INVALID_PARAMETER;
+
+	ret = misc_load();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (offset > misc.size || size > misc.size - offset)
+		return EFI_NOT_FOUND;
+
+	if (!size)
+		return EFI_SUCCESS;
+
+	memcpy(misc.data + offset, buf, size);
+	if (!misc.dirty_end) {
+		misc.dirty_begin = offset;
+		misc.dirty_end = offset + size;
+	} else {
+		misc.dirty_begin = min(misc.dirty_begin, (UINTN)offset);
+		misc.dirty_end = max(misc.dirty_end, (UINTN)(offset + size));
+	}
+
+	return defer_writes ? EFI_SUCCESS : misc_commit();
+}
+
+EFI_STATUS misc_commit(void)
+{
+	UINTN block_size, begin, end;
+	EFI_STATUS ret;
+
+	if (!misc.loaded || !misc.dirty_end)
+		return EFI_SUCCESS;
+
+	block_size = misc.gparti.bio->Media->BlockSize;
+	begin = ALIGN_DOWN(misc.dirty_begin, block_size);
+	end = min(ALIGN(misc.dirty_end, block_size), misc.size);
+
+	committing = TRUE;
+	blkcache_invalidate(misc.gparti.bio, misc.start + begin, end - begin);
+	committing = FALSE;
+
+	ret = uefi_call_wrapper(misc.gparti.dio->WriteDisk, 5, misc.gparti.dio,
+				misc.gparti.bio->Media->MediaId,
+				misc.start + begin, end - begin,
+				misc.data + begin);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to write the misc partition");
+		return ret;
+	}
+
+	misc.dirty_end = 0;
+	return EFI_SUCCESS;
+}
+
+void misc_defer_writes(BOOLEAN defer)
+{
+	if (!defer)
+		misc_commit();
+	defer_writes = defer;
+}
+
+void misc_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size)
+{
+	if (!misc.loaded || committing)
+		return;
+
+	if (bio && (bio != misc.gparti.bio || offset >= misc.start + misc.size ||
+		    offset + size <= misc.start))
+		return;
+
+	if (misc.dirty_end)
+		debug(L"misc partition overwritten, pending updates dropped");
+	misc.loaded = FALSE;
+	misc.dirty_end = 0;
+}
@@ -49,14 +49,35 @@ static EMMC_DEVICE_PATH *get_emmc_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
+/* SEC_FEATURE_SUPPORT: TRIM and secure garbage collection support */
+#define SEC_GB_CL_EN		(1 << 4)
+/* DISCARD is supported since eMMC 4.5, EXT_CSD revision 6 */
+#define EXT_CSD_REV_DISCARD	6
+
+/* The EXT_CSD is read once per session */
+static struct mmc_info {
+	EFI_SD_HOST_IO_PROTOCOL *sdio;
+	UINTN erase_grp_size;	/* In sectors */
+	UINTN erase_timeout;	/* In ms per erase group */
+	UINTN trim_timeout;	/* In ms per erase group */
+	BOOLEAN trim;
+	BOOLEAN discard;
+	BOOLEAN erased_zeroes;	/* Erased and trimmed blocks read as 0 */
+} mmc_info;
+
 static EFI_STATUS get_mmc_info(EFI_SD_HOST_IO_PROTOCOL *sdio,
-			       UINTN *erase_grp_size, UINTN *timeout)
+			       struct mmc_info **info)
 {
 	EXT_CSD *ext_csd;
 	void *rawbuffer;
 	UINT32 status;
 	EFI_STATUS ret;
 
+	if (mmc_info.sdio == sdio) {
+		*info = &mmc_info;
+		return EFI_SUCCESS;
+	}
+
 	ret = alloc_aligned(&rawbuffer, (void **)&ext_csd, sizeof(*ext_csd),
 			    sdio->HostCapability.BoundarySize);
 	if (EFI_ERROR(ret))
@@ -73,11 +94,22 @@ static EFI_STATUS get_mmc_info(EFI_SD_HOST_IO_PROTOCOL *sdio,
 	/* Erase group size is 512Kbyte × HC_ERASE_GRP_SIZE so it's
 	 * 1024 x HC_ERASE_GRP_SIZE in sector count timeout is 300ms x
 	 * ERASE_TIMEOUT_MULT per erase group*/
-	*erase_grp_size = 1024 * ext_csd->HC_ERASE_GRP_SIZE;
-	*timeout = 300 * ext_csd->ERASE_TIMEOUT_MULT;
+	mmc_info.erase_grp_size = 1024 * ext_csd->HC_ERASE_GRP_SIZE;
+	mmc_info.erase_timeout = 300 * ext_csd->ERASE_TIMEOUT_MULT;
+	/* TRIM and DISCARD timeout is 300ms x TRIM_MULT */
+	mmc_info.trim_timeout = ext_csd->TRIM_MULT ? 300 * ext_csd->TRIM_MULT :
+		mmc_info.erase_timeout;
+	mmc_info.trim = !!(ext_csd->SEC_FEATURE_SUPPORT & SEC_GB_CL_EN);
+	mmc_info.discard = mmc_info.trim &&
+		ext_csd->EXT_CSD_REV >= EXT_CSD_REV_DISCARD;
+	mmc_info.erased_zeroes = !ext_csd->ERASED_MEM_CONT;
+	mmc_info.sdio = sdio;
+	*info = &mmc_info;
 
 	debug(L"eMMC parameter: erase grp size %d sectors, timeout %d ms",
-	      *erase_grp_size, *timeout);
+	      mmc_info.erase_grp_size, mmc_info.erase_timeout);
+	debug(L"eMMC parameter: trim %d, discard %d, timeout %d ms",
+	      mmc_info.trim, mmc_info.discard, mmc_info.trim_timeout);
 
 out:
 	FreePool(rawbuffer);
@@ -144,14 +176,12 @@ static BOOLEAN is_emmc(EFI_DEVICE_PATH *p)
 	return EFI_ERROR(ret) || type == MMCCard;
 }
 
-static EFI_STATUS mmc_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
-				   EFI_LBA start, EFI_LBA end)
+static EFI_STATUS get_mmc(EFI_HANDLE handle, EFI_SD_HOST_IO_PROTOCOL **sdio,
+			  struct mmc_info **info)
 {
 	EFI_STATUS ret;
-	EFI_SD_HOST_IO_PROTOCOL *sdio;
 	EFI_HANDLE sdio_handle = NULL;
 	EFI_DEVICE_PATH *dev_path;
-	UINTN erase_grp_size = 0, timeout = 0;
 
 	dev_path = DevicePathFromHandle(handle);
 	if (!dev_path) {
@@ -159,55 +189,81 @@ static EFI_STATUS mmc_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
 		return EFI_UNSUPPORTED;
 	}
 
-	ret = sdio_get(dev_path, &sdio_handle, &sdio);
+	ret = sdio_get(dev_path, &sdio_handle, sdio);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get SDIO protocol");
 		return ret;
 	}
 
-	ret = get_mmc_info(sdio, &erase_grp_size, &timeout);
-	if (EFI_ERROR(ret)) {
+	ret = get_mmc_info(*sdio, info);
+	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to get erase group size");
-		return ret;
-	}
 
-	return sdio_erase(sdio, bio, start, end,
-			  CARD_ADDRESS, erase_grp_size, timeout, TRUE);
+	return ret;
 }
 
-static EFI_STATUS mmc_get_erase_block_size(EFI_HANDLE handle, UINTN *erase_blk_size)
+/* DISCARD leaves the blocks content indeterminate, TRIM makes them
+   read as the erased memory content.  Both work on write blocks: the
+   whole range is sent as a single command.  Without TRIM support, the
+   range is erased by groups and the unaligned head and tail are
+   filled up with zeroes.  */
+static EFI_STATUS mmc_erase(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+			    EFI_LBA start, EFI_LBA end, BOOLEAN zeroes)
 {
 	EFI_STATUS ret;
 	EFI_SD_HOST_IO_PROTOCOL *sdio;
-	EFI_HANDLE sdio_handle = NULL;
-	EFI_DEVICE_PATH *dev_path;
-	UINTN erase_grp_size = 0, timeout = 0;
+	struct mmc_info *info;
+	UINTN groups;
+	UINT32 arg;
 
-	dev_path = DevicePathFromHandle(handle);
-	if (!dev_path) {
-		error(L"Failed to get device path");
+	ret = get_mmc(handle, &sdio, &info);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* Only TRIM zeroes a range cheaply enough for write_zeroes */
+	if (zeroes && (!info->erased_zeroes || !info->trim))
 		return EFI_UNSUPPORTED;
-	}
 
-	ret = sdio_get(dev_path, &sdio_handle, &sdio);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get SDIO protocol");
-		return ret;
-	}
+	if (!info->trim || !info->erase_grp_size)
+		return sdio_erase(sdio, bio, start, end, CARD_ADDRESS,
+				  info->erase_grp_size, info->erase_timeout, TRUE);
 
-	ret = get_mmc_info(sdio, &erase_grp_size, &timeout);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get erase group size");
+	arg = !zeroes && info->discard ? MMC_DISCARD_ARG : MMC_TRIM_ARG;
+	groups = end / info->erase_grp_size - start / info->erase_grp_size + 1;
+	return sdio_erase_range(sdio, start, end, arg, info->trim_timeout * groups,
+				CARD_ADDRESS, TRUE);
+}
+
+static EFI_STATUS mmc_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				   EFI_LBA start, EFI_LBA end)
+{
+	return mmc_erase(handle, bio, start, end, FALSE);
+}
+
+static EFI_STATUS mmc_write_zeroes(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				   EFI_LBA start, EFI_LBA end)
+{
+	return mmc_erase(handle, bio, start, end, TRUE);
+}
+
+static EFI_STATUS mmc_get_erase_block_size(EFI_HANDLE handle, UINTN *erase_blk_size)
+{
+	EFI_STATUS ret;
+	EFI_SD_HOST_IO_PROTOCOL *sdio;
+	struct mmc_info *info;
+
+	ret = get_mmc(handle, &sdio, &info);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
-	*erase_blk_size = erase_grp_size;
+	*erase_blk_size = info->erase_grp_size;
 
 	return EFI_SUCCESS;
 }
 
 struct storage STORAGE(STORAGE_EMMC) = {
 	.erase_blocks = mmc_erase_blocks,
+	.write_zeroes = mmc_write_zeroes,
 	.check_logical_unit = mmc_check_logical_unit,
 	.get_erase_block_size = mmc_get_erase_block_size,
 	.probe = is_emmc,
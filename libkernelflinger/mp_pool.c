@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+#include <efi.h>
+#include <efilib.h>
+#include <lib.h>
+
+#include "protocol/MpService.h"
+#include "mp_pool.h"
+
+static EFI_GUID MpServicesProtocol = EFI_MP_SERVICES_PROTOCOL_GUID;
+
+static struct mp_pool {
+	BOOLEAN initialized;
+	EFI_MP_SERVICES_PROTOCOL *mp;
+	EFI_EVENT event;
+	UINTN cpu_count;
+} pool;
+
+static struct mp_job {
+	mp_work_t fn;
+	VOID *ctx;
+	UINTN count;
+	UINTN chunk;
+	volatile UINTN next;
+	BOOLEAN started;
+	BOOLEAN on_aps;
+	/* Status of a detached job, NULL otherwise */
+	EFI_STATUS *status;
+} job;
+
+static void mp_pool_init(void)
+{
+	EFI_STATUS ret;
+	UINTN nb_cpu, nb_enabled;
+
+	if (pool.initialized)
+		return;
+
+	pool.initialized = TRUE;
+	pool.cpu_count = 1;
+
+	ret = LibLocateProtocol(&MpServicesProtocol, (VOID **)&pool.mp);
+	if (EFI_ERROR(ret) || !pool.mp) {
+		debug(L"MP services not available, running serially");
+		pool.mp = NULL;
+		return;
+	}
+
+	ret = uefi_call_wrapper(pool.mp->GetNumberOfProcessors, 3, pool.mp,
+				&nb_cpu, &nb_enabled);
+	if (EFI_ERROR(ret) || nb_enabled < 2) {
+		pool.mp = NULL;
+		return;
+	}
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, TPL_CALLBACK,
+				NULL, NULL, &pool.event);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the MP pool event");
+		pool.mp = NULL;
+		return;
+	}
+
+	pool.cpu_count = nb_enabled;
+	debug(L"MP pool uses %d processors", pool.cpu_count);
+}
+
+UINTN mp_pool_cpu_count(void)
+{
+	mp_pool_init();
+	return pool.cpu_count;
+}
+
+static void run_chunks(struct mp_job *j)
+{
+	UINTN start;
+
+	for (;;) {
+		start = __sync_fetch_and_add(&j->next, j->chunk);
+		if (start >= j->count)
+			break;
+		j->fn(start, min(start + j->chunk, j->count), j->ctx);
+	}
+}
+
+static VOID EFIAPI ap_procedure(VOID *arg)
+{
+	run_chunks(arg);
+}
+
+static EFI_STATUS start_job(UINTN count, UINTN chunk, mp_work_t fn, VOID *ctx,
+			   BOOLEAN blocking)
+{
+	EFI_STATUS ret;
+
+	if (!fn || !chunk)
+		return EFI_INVALID_PARAMETER;
+
+	if (job.started) {
+		if (!job.status)
+			return EFI_NOT_READY;
+		mp_pool_wait();
+	}
+
+	mp_pool_init();
+
+	job.fn = fn;
+	job.ctx = ctx;
+	job.count = count;
+	job.chunk = chunk;
+	job.next = 0;
+	job.on_aps = FALSE;
+	job.status = NULL;
+	job.started = TRUE;
+
+	/* Not worth waking up the APs for a single chunk the BSP would
+	   otherwise wait for.  A non-blocking job overlaps with whatever
+	   the BSP does until mp_pool_wait() though.  */
+	if (!pool.mp || (blocking && count <= chunk))
+		return EFI_SUCCESS;
+
+	__sync_synchronize();
+	ret = uefi_call_wrapper(pool.mp->StartupAllAPs, 7, pool.mp,
+				ap_procedure, FALSE,
+				blocking ? NULL : pool.event, 0,
+				&job, NULL);
+	if (EFI_ERROR(ret)) {
+		debug(L"Failed to start the APs, %r, running serially", ret);
+		return EFI_SUCCESS;
+	}
+
+	job.on_aps = !blocking;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS mp_pool_start(UINTN count, UINTN chunk, mp_work_t fn, VOID *ctx)
+{
+	return start_job(count, chunk, fn, ctx, FALSE);
+}
+
+EFI_STATUS mp_pool_wait(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	if (!job.started)
+		return EFI_NOT_STARTED;
+
+	run_chunks(&job);
+
+	if (job.on_aps) {
+		do
+			ret = uefi_call_wrapper(BS->CheckEvent, 1, pool.event);
+		while (ret == EFI_NOT_READY);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to wait for the APs");
+	}
+
+	__sync_synchronize();
+	job.started = FALSE;
+	if (job.status) {
+		*job.status = ret;
+		job.status = NULL;
+	}
+	return ret;
+}
+
+EFI_STATUS mp_pool_start_detached(UINTN count, UINTN chunk, mp_work_t fn,
+				  VOID *ctx, EFI_STATUS *status)
+{
+	EFI_STATUS ret;
+
+	if (!status)
+		return EFI_INVALID_PARAMETER;
+
+	ret = start_job(count, chunk, fn, ctx, FALSE);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	*status = EFI_NOT_READY;
+	job.status = status;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS mp_pool_join(EFI_STATUS *status)
+{
+	if (*status != EFI_NOT_READY)
+		return *status;
+
+	return mp_pool_wait();
+}
+
+EFI_STATUS parallel_for(UINTN count, UINTN chunk, mp_work_t fn, VOID *ctx)
+{
+	EFI_STATUS ret;
+
+	/* In blocking mode the firmware polls the APs itself, it does not
+	   depend on timer events and works at any TPL.  */
+	ret = start_job(count, chunk, fn, ctx, TRUE);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return mp_pool_wait();
+}
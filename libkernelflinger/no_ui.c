@@ -101,6 +101,11 @@ void ui_free(void)
 	/* Nothing to do */
 }
 
+EFI_STATUS ui_vendor_splash_join(VOID)
+{
+	return EFI_SUCCESS;
+}
+
 void ui_wait_for_key_release(void)
 {
 	/* Nothing to do */
@@ -176,7 +181,10 @@ static BOOLEAN test_key(BOOLEAN check_code, ui_events_t event)
 	EFI_STATUS ret = EFI_SUCCESS;
 	BOOLEAN result = TRUE;
 
-	uefi_call_wrapper(BS->Stall, 1, get_hold_key_stall_time() * 1000);
+	/* A held key repeats: no key stroke within the stall time means
+	 * it has been released */
+	if (!wait_for_key(get_hold_key_stall_time() * 1000))
+		return FALSE;
 
 	ret = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2,
 					ST->ConIn, &key);
@@ -200,15 +208,31 @@ static BOOLEAN test_key(BOOLEAN check_code, ui_events_t event)
 
 BOOLEAN ui_enforce_key_held(UINT32 milliseconds, ui_events_t event)
 {
-	BOOLEAN ret = TRUE;
-	UINT32 i;
-	int stall_time = get_hold_key_stall_time();
-
-	for (i = 0; i < (milliseconds / stall_time); i++) {
-		ret = test_key(TRUE, event);
-		if (!ret) {
-			break;
-		}
+	EFI_STATUS ret;
+	EFI_EVENT deadline;
+	BOOLEAN held;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0,
+				NULL, NULL, &deadline);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the key hold timer");
+		return FALSE;
 	}
-	return ret;
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, deadline, TimerRelative,
+				(UINT64)milliseconds * 10000);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set the key hold timer");
+		uefi_call_wrapper(BS->CloseEvent, 1, deadline);
+		return FALSE;
+	}
+
+	/* The key must keep repeating until the deadline */
+	do {
+		held = test_key(TRUE, event);
+	} while (held && uefi_call_wrapper(BS->CheckEvent, 1, deadline)
+		 == EFI_NOT_READY);
+
+	uefi_call_wrapper(BS->CloseEvent, 1, deadline);
+	return held;
 }
@@ -32,6 +32,7 @@
 
 #include <lib.h>
 #include "storage.h"
+#include "protocol.h"
 
 #include "protocol/NvmExpressHci.h"
 #include "protocol/DevicePath.h"
@@ -39,14 +40,29 @@
 
 #define EFI_TIMER_PERIOD_SECONDS(Seconds)     ((UINT64)(Seconds) * 10000000)
 #define NVME_GENERIC_TIMEOUT                  (EFI_TIMER_PERIOD_SECONDS(5))
+#define NVME_DSM_TIMEOUT                      (EFI_TIMER_PERIOD_SECONDS(60))
 #define NVME_MAX_WRITE_ZEROS_BLOCKS           0x10000
+#define NVME_MAX_DSM_RANGES                   256
+#define NVME_MAX_DSM_RANGE_BLOCKS             0xFFFFFFFF
+/* Number of Write Zeroes commands in flight */
+#define NVME_MAX_INFLIGHT                     8
 
+#define NVME_CTRL_ONCS_DSM                    (1 << 2)
 #define NVME_CTRL_ONCS_WRITE_ZEROES           (1 << 3)
+#define NVME_CTRL_VWC_PRESENT                 (1 << 0)
+/* Deallocated blocks read as zeroes */
+#define NVME_NS_DLFEAT_READ_MASK              0x7
+#define NVME_NS_DLFEAT_READ_ZEROES            0x1
 
-#define NVME_RW_FUA               (1 << 14)
+#define NVME_CMD_FLUSH            0x00
 #define NVME_CMD_WRITE_ZEROS      0x08
+#define NVME_CMD_DSM              0x09
+#define NVME_DSM_ATTR_DEALLOCATE  (1 << 2)
 #define NVME_CONTROLLER_ID        0
 
+/* Status Code and Status Code Type of the completion queue entry */
+#define NVME_CQE_STATUS(dw3)      (((dw3) >> 17) & 0x7FF)
+
 #define MSG_NVME_NAMESPACE_DP     0x17
 
 #define ATTR_UNUSED __attribute__((unused))
@@ -57,18 +73,38 @@ typedef struct {
 	UINT64                          NamespaceUuid;
 } NVME_NAMESPACE_DEVICE_PATH;
 
+typedef struct {
+	UINT32                          Attributes;
+	UINT32                          Length;
+	UINT64                          StartingLba;
+} NVME_DSM_RANGE;
+
+struct nvme_request {
+	EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET packet;
+	EFI_NVM_EXPRESS_COMMAND                  command;
+	EFI_NVM_EXPRESS_COMPLETION               completion;
+	EFI_EVENT                                event;
+	BOOLEAN                                  busy;
+};
+
+/* Commands are submitted with a completion event when the driver
+   supports non-blocking I/O, and waited for in submission order.  */
+struct nvme_queue {
+	EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *passthru;
+	UINT32 nsid;
+	BOOLEAN nonblocking;
+	UINTN next;
+	struct nvme_request req[NVME_MAX_INFLIGHT];
+};
 
-EFI_STATUS get_nvme_passthru(EFI_DEVICE_PATH *FilePath, VOID **Interface)
+
+EFI_STATUS get_nvme_passthru(EFI_HANDLE Handle, VOID **Interface)
 {
 	EFI_GUID gEfiNvmExpressPassThruProtocolGuid = EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL_GUID;
 	EFI_STATUS              Status;
-	EFI_HANDLE              Device;
 
-	Status = uefi_call_wrapper(BS->LocateDevicePath, 3, &gEfiNvmExpressPassThruProtocolGuid, &FilePath, &Device);
-	if (!EFI_ERROR(Status)) {
-		Status = uefi_call_wrapper(BS->HandleProtocol, 3, Device, &gEfiNvmExpressPassThruProtocolGuid, Interface);
-		debug(L"Locate NvmExpressPassThru: ret=%d", Status);
-	}
+	Status = device_protocol_cached(Handle, &gEfiNvmExpressPassThruProtocolGuid, Interface);
+	debug(L"Locate NvmExpressPassThru: ret=%d", Status);
 
 	if (EFI_ERROR(Status))
 		*Interface = NULL;
@@ -87,14 +123,15 @@ static NVME_NAMESPACE_DEVICE_PATH *get_nvme_device_path(EFI_DEVICE_PATH *p)
 	return NULL;
 }
 
-static BOOLEAN is_nvme_supported_write_zeros(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru)
+/* CNS is 1 to identify the controller, 0 to identify the NSID
+   namespace */
+static EFI_STATUS nvme_identify(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru,
+				UINT32 NamespaceId, UINT32 Cns,
+				VOID *Data, UINT32 Length)
 {
-	NVME_ADMIN_CONTROLLER_DATA CtrlData;
-
 	EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET CommandPacket;
 	EFI_NVM_EXPRESS_COMMAND                  Command;
 	EFI_NVM_EXPRESS_COMPLETION               Completion;
-	EFI_STATUS                               Status;
 
 	ZeroMem(&CommandPacket, sizeof(EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET));
 	ZeroMem(&Command, sizeof(EFI_NVM_EXPRESS_COMMAND));
@@ -105,76 +142,283 @@ static BOOLEAN is_nvme_supported_write_zeros(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL
 	/* According to Nvm Express 1.1 spec Figure 38, When not used, the field shall be cleared to 0h.
 	 * For the Identify command, the Namespace Identifier is only used for the Namespace data structure.
 	 */
-	Command.Nsid        = 0;
+	Command.Nsid        = NamespaceId;
 
 	CommandPacket.NvmeCmd        = &Command;
 	CommandPacket.NvmeCompletion = &Completion;
-	CommandPacket.TransferBuffer = (VOID *) &CtrlData;
-	CommandPacket.TransferLength = sizeof(NVME_ADMIN_CONTROLLER_DATA);
+	CommandPacket.TransferBuffer = Data;
+	CommandPacket.TransferLength = Length;
 	CommandPacket.CommandTimeout = NVME_GENERIC_TIMEOUT;
 	CommandPacket.QueueType      = NVME_ADMIN_QUEUE;
 
-	/* Set bit 0 (Cns bit) to 1 to identify a controller */
-	Command.Cdw10                = 1;
+	Command.Cdw10                = Cns;
 	Command.Flags                = CDW10_VALID;
 
-	Status = NvmePassthru->PassThru(NvmePassthru, NVME_CONTROLLER_ID, &CommandPacket, NULL);
-	if (EFI_ERROR(Status))
+	return NvmePassthru->PassThru(NvmePassthru, NVME_CONTROLLER_ID, &CommandPacket, NULL);
+}
+
+/* Deallocation is only used as an erase method if the deallocated
+   blocks are guaranteed to read as zeroes. */
+static BOOLEAN is_nvme_dsm_zeroing(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru,
+				   NVME_ADMIN_CONTROLLER_DATA *CtrlData,
+				   UINT32 NamespaceId)
+{
+	NVME_ADMIN_NAMESPACE_DATA *NsData;
+	EFI_STATUS Status;
+	BOOLEAN res;
+
+	if (!(CtrlData->Oncs & NVME_CTRL_ONCS_DSM))
 		return FALSE;
 
-	if (CtrlData.Oncs & NVME_CTRL_ONCS_WRITE_ZEROES)
-		return TRUE;
+	NsData = AllocatePool(sizeof(*NsData));
+	if (!NsData)
+		return FALSE;
+
+	Status = nvme_identify(NvmePassthru, NamespaceId, 0, NsData, sizeof(*NsData));
+	res = !EFI_ERROR(Status) &&
+		(NsData->Dlfeat & NVME_NS_DLFEAT_READ_MASK) == NVME_NS_DLFEAT_READ_ZEROES;
+	FreePool(NsData);
 
-	return FALSE;
+	return res;
 }
 
-EFI_STATUS nvme_erase_blocks_impl(
-	EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru,
-	UINT32 NamespaceId,
-	UINT64 Lba,
-	UINT32 Blocks
-)
+static void nvme_queue_init(struct nvme_queue *q,
+			    EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru,
+			    UINT32 NamespaceId)
 {
-	EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET CommandPacket;
-	EFI_NVM_EXPRESS_COMMAND                  Command;
-	EFI_NVM_EXPRESS_COMPLETION               Completion;
-	EFI_STATUS                               Status;
+	EFI_STATUS ret;
+	UINTN i;
+
+	ZeroMem(q, sizeof(*q));
+	q->passthru = NvmePassthru;
+	q->nsid = NamespaceId;
+
+	if (!NvmePassthru->Mode ||
+	    !(NvmePassthru->Mode->Attributes & EFI_NVM_EXPRESS_PASS_THRU_ATTRIBUTES_NONBLOCKIO))
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(q->req); i++) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, TPL_CALLBACK,
+					NULL, NULL, &q->req[i].event);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create the NVMe event");
+			while (i--)
+				uefi_call_wrapper(BS->CloseEvent, 1, q->req[i].event);
+			return;
+		}
+	}
+	q->nonblocking = TRUE;
+}
 
-	ZeroMem(&CommandPacket, sizeof(EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET));
-	ZeroMem(&Command, sizeof(EFI_NVM_EXPRESS_COMMAND));
-	ZeroMem(&Completion, sizeof(EFI_NVM_EXPRESS_COMPLETION));
+static EFI_STATUS nvme_request_status(struct nvme_request *req)
+{
+	UINT32 status = NVME_CQE_STATUS(req->completion.DW3);
 
-	CommandPacket.NvmeCmd        = &Command;
-	CommandPacket.NvmeCompletion = &Completion;
+	if (status) {
+		debug(L"NVMe command 0x%x failed, status 0x%x",
+		      req->command.Cdw0.Opcode, status);
+		return EFI_DEVICE_ERROR;
+	}
 
-	CommandPacket.NvmeCmd->Cdw0.Opcode = NVME_CMD_WRITE_ZEROS;
-	CommandPacket.NvmeCmd->Nsid  = NamespaceId;
+	return EFI_SUCCESS;
+}
 
-	CommandPacket.TransferBuffer = (VOID *)NULL;
-	CommandPacket.TransferLength = 0;
+static EFI_STATUS nvme_queue_wait(struct nvme_request *req)
+{
+	EFI_STATUS ret;
+	UINTN index;
 
-	CommandPacket.CommandTimeout = NVME_GENERIC_TIMEOUT;
-	CommandPacket.QueueType      = NVME_IO_QUEUE;
+	if (!req->busy)
+		return EFI_SUCCESS;
 
-	CommandPacket.NvmeCmd->Cdw10 = (UINT32)Lba;
-	CommandPacket.NvmeCmd->Cdw11 = (UINT32)(Lba >> 32);
+	req->busy = FALSE;
+	ret = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &req->event, &index);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	/* Set Force Unit Access bit (bit 30) to use write-through behaviour */
-	CommandPacket.NvmeCmd->Cdw12 = ((Blocks - 1) & 0xFFFF) | (NVME_RW_FUA << 16);
+	return nvme_request_status(req);
+}
 
-	CommandPacket.MetadataBuffer = NULL;
-	CommandPacket.MetadataLength = 0;
+/* Return the next request slot, waiting for the command it holds */
+static EFI_STATUS nvme_queue_get(struct nvme_queue *q, struct nvme_request **req_p)
+{
+	struct nvme_request *req = &q->req[q->next];
+	EFI_STATUS ret;
 
-	CommandPacket.NvmeCmd->Flags = CDW10_VALID | CDW11_VALID | CDW12_VALID;
+	ret = nvme_queue_wait(req);
+	if (EFI_ERROR(ret))
+		return ret;
 
-	Status = NvmePassthru->PassThru(NvmePassthru, NamespaceId, &CommandPacket, NULL);
-	if (EFI_ERROR(Status))
-		debug(L"NvmePassthru(NVME_CMD_WRITE_ZEROS) failed, ret = %d", Status);
+	q->next = (q->next + 1) % ARRAY_SIZE(q->req);
 
-	return Status;
+	ZeroMem(&req->packet, sizeof(req->packet));
+	ZeroMem(&req->command, sizeof(req->command));
+	ZeroMem(&req->completion, sizeof(req->completion));
+	req->packet.NvmeCmd        = &req->command;
+	req->packet.NvmeCompletion = &req->completion;
+	req->packet.QueueType      = NVME_IO_QUEUE;
+	req->packet.CommandTimeout = NVME_GENERIC_TIMEOUT;
+	req->command.Nsid          = q->nsid;
+
+	*req_p = req;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS nvme_queue_submit(struct nvme_queue *q, struct nvme_request *req)
+{
+	EFI_STATUS ret;
+
+	ret = q->passthru->PassThru(q->passthru, q->nsid, &req->packet,
+				    q->nonblocking ? req->event : NULL);
+	if (EFI_ERROR(ret)) {
+		debug(L"NvmePassthru(0x%x) failed, ret = %d", req->command.Cdw0.Opcode, ret);
+		return ret;
+	}
+
+	if (!q->nonblocking)
+		return nvme_request_status(req);
+
+	req->busy = TRUE;
+	return EFI_SUCCESS;
+}
+
+/* Wait for all the commands in flight */
+static EFI_STATUS nvme_queue_drain(struct nvme_queue *q)
+{
+	EFI_STATUS ret = EFI_SUCCESS, ret2;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(q->req); i++) {
+		ret2 = nvme_queue_wait(&q->req[(q->next + i) % ARRAY_SIZE(q->req)]);
+		if (EFI_ERROR(ret2) && !EFI_ERROR(ret))
+			ret = ret2;
+	}
+
+	return ret;
 }
 
-static EFI_STATUS nvme_erase_blocks(
+static EFI_STATUS nvme_queue_close(struct nvme_queue *q)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	ret = nvme_queue_drain(q);
+	if (q->nonblocking)
+		for (i = 0; i < ARRAY_SIZE(q->req); i++)
+			uefi_call_wrapper(BS->CloseEvent, 1, q->req[i].event);
+
+	return ret;
+}
+
+static EFI_STATUS nvme_flush(struct nvme_queue *q)
+{
+	struct nvme_request *req;
+	EFI_STATUS ret;
+
+	ret = nvme_queue_get(q, &req);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	req->command.Cdw0.Opcode = NVME_CMD_FLUSH;
+	return nvme_queue_submit(q, req);
+}
+
+/* Deallocate up to NVME_MAX_DSM_RANGES ranges of NVME_MAX_DSM_RANGE_BLOCKS
+   blocks per Dataset Management command.  */
+static EFI_STATUS nvme_deallocate(struct nvme_queue *q, EFI_LBA start, EFI_LBA end)
+{
+	NVME_DSM_RANGE *ranges;
+	struct nvme_request *req;
+	VOID *free_addr;
+	EFI_STATUS ret;
+	UINT32 align;
+	UINTN nr;
+
+	align = q->passthru->Mode ? q->passthru->Mode->IoAlign : 0;
+	ret = alloc_aligned(&free_addr, (VOID **)&ranges,
+			    NVME_MAX_DSM_RANGES * sizeof(*ranges), align);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	/* END is inclusive */
+	while (start <= end) {
+		for (nr = 0; nr < NVME_MAX_DSM_RANGES && start <= end; nr++) {
+			ranges[nr].Attributes = 0;
+			ranges[nr].StartingLba = start;
+			ranges[nr].Length = min(end - start + 1,
+						(EFI_LBA)NVME_MAX_DSM_RANGE_BLOCKS);
+			start += ranges[nr].Length;
+		}
+
+		/* The command owns the ranges buffer until it completes */
+		ret = nvme_queue_get(q, &req);
+		if (EFI_ERROR(ret))
+			break;
+
+		req->command.Cdw0.Opcode = NVME_CMD_DSM;
+		req->command.Cdw10 = nr - 1;
+		req->command.Cdw11 = NVME_DSM_ATTR_DEALLOCATE;
+		req->command.Flags = CDW10_VALID | CDW11_VALID;
+		req->packet.TransferBuffer = ranges;
+		req->packet.TransferLength = nr * sizeof(*ranges);
+		req->packet.CommandTimeout = NVME_DSM_TIMEOUT;
+
+		ret = nvme_queue_submit(q, req);
+		if (EFI_ERROR(ret))
+			break;
+
+		ret = nvme_queue_wait(req);
+		if (EFI_ERROR(ret))
+			break;
+	}
+
+	FreePool(free_addr);
+	return ret;
+}
+
+/* The Write Zeroes commands are not Force Unit Access, several of
+   them are in flight and a single Flush makes them durable.  */
+static EFI_STATUS nvme_write_zeroes_cmds(struct nvme_queue *q, BOOLEAN flush,
+					 EFI_LBA start, EFI_LBA end)
+{
+	struct nvme_request *req;
+	EFI_STATUS ret = EFI_SUCCESS;
+	UINT32 num;
+	EFI_LBA blk;
+
+	/* END is inclusive */
+	for (blk = start; blk <= end; blk += num) {
+		if (end - blk + 1 >= NVME_MAX_WRITE_ZEROS_BLOCKS)
+			num = NVME_MAX_WRITE_ZEROS_BLOCKS;
+		else
+			num = end - blk + 1;
+
+		ret = nvme_queue_get(q, &req);
+		if (EFI_ERROR(ret))
+			return ret;
+
+		req->command.Cdw0.Opcode = NVME_CMD_WRITE_ZEROS;
+		req->command.Cdw10 = (UINT32)blk;
+		req->command.Cdw11 = (UINT32)(blk >> 32);
+		req->command.Cdw12 = (num - 1) & 0xFFFF;
+		req->command.Flags = CDW10_VALID | CDW11_VALID | CDW12_VALID;
+
+		ret = nvme_queue_submit(q, req);
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	/* A Flush only covers the commands completed before its
+	 * submission
+	 */
+	ret = nvme_queue_drain(q);
+	if (EFI_ERROR(ret) || !flush)
+		return ret;
+
+	return nvme_flush(q);
+}
+
+static EFI_STATUS nvme_write_zeroes(
 	EFI_HANDLE handle,
 	ATTR_UNUSED EFI_BLOCK_IO *bio,
 	EFI_LBA start,
@@ -182,12 +426,13 @@ static EFI_STATUS nvme_erase_blocks(
 )
 {
 	EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *NvmePassthru;
+	NVME_ADMIN_CONTROLLER_DATA *CtrlData;
 	NVME_NAMESPACE_DEVICE_PATH *nvme_dp;
+	struct nvme_queue q;
 	EFI_DEVICE_PATH *dp;
-	EFI_STATUS ret;
+	EFI_STATUS ret, ret2;
 	UINT32 NamespaceId = 0;
-	UINT32 num;
-	EFI_LBA blk;
+	BOOLEAN dsm, write_zeroes, flush;
 
 	/* No UEFI platform can support NVME_CMD_WRITE_ZERROS correctly to erase blocks,
 	 * what's worse, this command can cause some platform crash. It's better to shift
@@ -196,38 +441,63 @@ static EFI_STATUS nvme_erase_blocks(
 	if (is_UEFI())
 		return EFI_UNSUPPORTED;
 
-	debug(L"nvme_erase_blocks: 0x%X blocks", end - start + 1);
+	debug(L"nvme_write_zeroes: 0x%X blocks", end - start + 1);
 	dp = DevicePathFromHandle(handle);
 	if (!dp) {
 		error(L"Failed to get device path from handle");
 		return EFI_INVALID_PARAMETER;
 	}
 
-	ret = get_nvme_passthru(dp, (VOID **) &NvmePassthru);
+	ret = get_nvme_passthru(handle, (VOID **) &NvmePassthru);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	if (!is_nvme_supported_write_zeros(NvmePassthru))
-		return EFI_UNSUPPORTED;
-
 	nvme_dp = get_nvme_device_path(dp);
 	ret = NvmePassthru->GetNamespace(NvmePassthru, (EFI_DEVICE_PATH_PROTOCOL *)nvme_dp, &NamespaceId);
 	debug(L"GetNamespace() ret=%d, NamespaceId=%d", ret, NamespaceId);
 
-	for (blk = start;  blk < end; ) {
-		if (end - blk >= NVME_MAX_WRITE_ZEROS_BLOCKS)
-			num = NVME_MAX_WRITE_ZEROS_BLOCKS;
-		else
-			num = end - blk;
+	CtrlData = AllocatePool(sizeof(*CtrlData));
+	if (!CtrlData)
+		return EFI_OUT_OF_RESOURCES;
 
-		ret = nvme_erase_blocks_impl(NvmePassthru, NamespaceId, blk, num);
-		if (EFI_ERROR(ret))
-			return EFI_UNSUPPORTED;
+	ret = nvme_identify(NvmePassthru, NVME_CONTROLLER_ID, 1, CtrlData, sizeof(*CtrlData));
+	if (EFI_ERROR(ret)) {
+		FreePool(CtrlData);
+		return EFI_UNSUPPORTED;
+	}
+
+	dsm = is_nvme_dsm_zeroing(NvmePassthru, CtrlData, NamespaceId);
+	write_zeroes = (CtrlData->Oncs & NVME_CTRL_ONCS_WRITE_ZEROES) != 0;
+	flush = (CtrlData->Vwc & NVME_CTRL_VWC_PRESENT) != 0;
+	FreePool(CtrlData);
+
+	if (!dsm && !write_zeroes)
+		return EFI_UNSUPPORTED;
+
+	nvme_queue_init(&q, NvmePassthru, NamespaceId);
 
-		blk += num;
+	ret = EFI_UNSUPPORTED;
+	if (dsm) {
+		ret = nvme_deallocate(&q, start, end);
+		if (EFI_ERROR(ret))
+			debug(L"NVMe deallocation failed, ret = %d", ret);
 	}
+	if (EFI_ERROR(ret) && write_zeroes)
+		ret = nvme_write_zeroes_cmds(&q, flush, start, end);
 
-	return ret;
+	ret2 = nvme_queue_close(&q);
+	if (!EFI_ERROR(ret))
+		ret = ret2;
+
+	/* Let the caller fall back on writing zeroes from memory */
+	return EFI_ERROR(ret) ? EFI_UNSUPPORTED : EFI_SUCCESS;
+}
+
+/* Write Zeroes is also the way to erase the blocks */
+static EFI_STATUS nvme_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				    EFI_LBA start, EFI_LBA end)
+{
+	return nvme_write_zeroes(handle, bio, start, end);
 }
 
 static EFI_STATUS nvme_check_logical_unit(ATTR_UNUSED EFI_DEVICE_PATH *p, logical_unit_t log_unit)
@@ -242,6 +512,7 @@ static BOOLEAN is_nvme(EFI_DEVICE_PATH *p)
 
 struct storage STORAGE(STORAGE_NVME) = {
 	.erase_blocks = nvme_erase_blocks,
+	.write_zeroes = nvme_write_zeroes,
 	.check_logical_unit = nvme_check_logical_unit,
 	.probe = is_nvme,
 	.name = L"NVME"
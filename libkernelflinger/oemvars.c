@@ -40,47 +40,75 @@ enum vartype {
 	VAR_TYPE_BLOB
 };
 
+/* A variable definition of the oemvars file.  VALUE is NULL for a
+   deletion */
+struct oemvar {
+	EFI_GUID guid;
+	CHAR16 *name;
+	uint32_t attributes;
+	UINTN size;
+	char *value;
+};
+
 typedef struct oemvars_ctx {
 	EFI_GUID guid;
 	const EFI_GUID *restricted_guid;
 	BOOLEAN silent_write_error;
+	struct oemvar *vars;
+	UINTN nb_vars;
+	UINTN max_vars;
 } oemvars_ctx_t;
 
-static BOOLEAN parse_oemvar_guid_line(char *line, EFI_GUID *g)
+#define OEMVARS_TABLE_MIN	32
+
+#define GUID_STRING_LEN	36
+
+static BOOLEAN parse_oemvar_guid_line(text_slice_t line, EFI_GUID *g)
 {
 	EFI_STATUS ret;
-	const CHAR8 *prefix = (CHAR8 *) "GUID";
+	char guid[GUID_STRING_LEN + 1];
+	const char *prefix = "GUID";
 
-	skip_whitespace(&line);
+	slice_skip_whitespace(&line);
 
-	if (strncmp(prefix, (CHAR8 *)line, strlen(prefix)) != 0)
+	if (!slice_starts_with(&line, prefix))
 		return FALSE;
 
-	line += strlen(prefix);
-	skip_whitespace(&line);
-	if (*line++ != '=')
+	line.str += strlen((CHAR8 *)prefix);
+	line.len -= strlen((CHAR8 *)prefix);
+	slice_skip_whitespace(&line);
+	if (!line.len || *line.str != '=')
 		return FALSE;
-	skip_whitespace(&line);
-
-	ret = stra_to_guid(line, g);
+	line.str++;
+	line.len--;
+	slice_skip_whitespace(&line);
+
+	/* stra_to_guid() only looks at the first GUID_STRING_LEN
+	   characters of a NUL terminated string */
+	line.len = min(line.len, (UINTN)GUID_STRING_LEN);
+	memcpy(guid, line.str, line.len);
+	guid[line.len] = '\0';
+	ret = stra_to_guid(guid, g);
 	if (EFI_ERROR(ret))
 		return FALSE;
 
 	return TRUE;
 }
 
-/* Implements modify-in-place "URL-like" escaping: "%[0-9a-fA-F]{2}"
- * converts to the specified byte; no other modifications are
- * performed (including "+" for space!).  Returns the number of output
- * bytes */
-static UINTN unescape_oemvar_val(char *val)
+/* Implements "URL-like" escaping: "%[0-9a-fA-F]{2}" converts to the
+ * specified byte; no other modifications are performed (including
+ * "+" for space!).  OUT, at least VAL->len + 1 bytes long, gets the
+ * NUL terminated result.  Returns the number of output bytes, NUL
+ * excluded */
+static UINTN unescape_oemvar_val(char *out, const text_slice_t *val)
 {
-	char *p = val, *out = val;
+	const char *p = val->str, *end = val->str + val->len;
+	char *start = out;
 	unsigned int byte;
 	char value[3] = { '\0', '\0', '\0' };
 	char *tmp;
-	while (*p) {
-		if (p[0] != '%') {
+	while (p < end) {
+		if (p[0] != '%' || end - p < 3) {
 			*out++ = *p++;
 			continue;
 		}
@@ -95,14 +123,14 @@ static UINTN unescape_oemvar_val(char *val)
 			*out++ = *p++;
 		}
 	}
-	*out++ = '\0';
-	return out - val;
+	*out = '\0';
+	return out - start;
 }
 
-static int parse_oemvar_attributes(char **linep, uint32_t *attributesp, enum vartype *typep)
+static int parse_oemvar_attributes(text_slice_t *line, uint32_t *attributesp, enum vartype *typep)
 {
-	char *line = *linep;
-	char *pos, *end;
+	text_slice_t attrs;
+	UINTN i;
 	/* No point in writing volatile values. Default to both boot and runtime
 	 * access, can remove runtime access with 'b' flag */
 	uint32_t attributes = EFI_VARIABLE_NON_VOLATILE |
@@ -111,26 +139,21 @@ static int parse_oemvar_attributes(char **linep, uint32_t *attributesp, enum var
 	enum vartype type = VAR_TYPE_UNKNOWN;
 
 	/* skip leading whitespace */
-	skip_whitespace(&line);
+	slice_skip_whitespace(line);
 
 	/* Defaults if no attrs set */
-	if (*line != '[')
+	if (!line->len || *line->str != '[')
 		goto out;
 
-	line++;
-	pos = line;
-	end = (char *)strchr((CHAR8 *)line, ']');
-	if (!end) {
+	attrs.str = line->str + 1;
+	attrs.len = line->len - 1;
+	if (!slice_split(&attrs, ']', line)) {
 		error(L"Unclosed attributes specification");
 		return -1;
 	}
-	*end = '\0';
-	line = end + 1;
 
-	debug(L"found attributes [%a]", pos);
-
-	while (*pos) {
-		switch (*pos) {
+	for (i = 0; i < attrs.len; i++) {
+		switch (attrs.str[i]) {
 		case 'd':
 			debug(L"raw data type selected");
 			if (type != VAR_TYPE_UNKNOWN) {
@@ -148,10 +171,9 @@ static int parse_oemvar_attributes(char **linep, uint32_t *attributesp, enum var
 			attributes |= EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS;
 			break;
 		default:
-			error(L"Unknown attribute code '%c'", *pos);
+			error(L"Unknown attribute code '%c'", attrs.str[i]);
 			return -1;
 		}
-		pos++;
 	}
 
  out:
@@ -159,28 +181,69 @@ static int parse_oemvar_attributes(char **linep, uint32_t *attributesp, enum var
 		type = VAR_TYPE_STRING;
 
 	*typep = type;
-	*linep = line;
 	*attributesp = attributes;
 
 	return 0;
 }
 
-static EFI_STATUS parse_line(char *line, VOID *context)
+static void free_oemvar(struct oemvar *var)
+{
+	FreePool(var->name);
+	if (var->value)
+		FreePool(var->value);
+}
+
+/* Add VAR to the table of CTX.  A later definition of the same
+   variable replaces the earlier one, only the last value is
+   written */
+static EFI_STATUS add_oemvar(oemvars_ctx_t *ctx, struct oemvar *var)
+{
+	struct oemvar *vars;
+	UINTN i;
+
+	for (i = 0; i < ctx->nb_vars; i++)
+		if (!memcmp(&ctx->vars[i].guid, &var->guid, sizeof(var->guid)) &&
+		    !StrCmp(ctx->vars[i].name, var->name)) {
+			free_oemvar(&ctx->vars[i]);
+			ctx->vars[i] = *var;
+			return EFI_SUCCESS;
+		}
+
+	if (ctx->nb_vars == ctx->max_vars) {
+		UINTN max = ctx->max_vars ? ctx->max_vars * 2 : OEMVARS_TABLE_MIN;
+
+		vars = AllocatePool(max * sizeof(*vars));
+		if (!vars)
+			return EFI_OUT_OF_RESOURCES;
+		if (ctx->vars) {
+			memcpy(vars, ctx->vars, ctx->nb_vars * sizeof(*vars));
+			FreePool(ctx->vars);
+		}
+		ctx->vars = vars;
+		ctx->max_vars = max;
+	}
+
+	ctx->vars[ctx->nb_vars++] = *var;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS parse_line(text_slice_t *line, VOID *context)
 {
 	EFI_STATUS ret;
 	uint32_t attributes = 0;
 	enum vartype type;
 	CHAR16 *varname;
-	UINTN vallen;
-	char  *var, *val, *p;
+	struct oemvar oemvar;
+	UINTN vallen = 0;
+	text_slice_t var, val;
+	char *valbuf = NULL;
 	oemvars_ctx_t *ctx = (oemvars_ctx_t *)context;
 
 	/* Snip comments */
-	if ((p = (char *)strchr((CHAR8 *)line, '#')))
-		*p = 0;
+	slice_split(line, '#', NULL);
 
 	/* GUID line syntax */
-	if (parse_oemvar_guid_line(line, &ctx->guid)) {
+	if (parse_oemvar_guid_line(*line, &ctx->guid)) {
 		debug(L"current guid set to %g", &ctx->guid);
 		return EFI_SUCCESS;
 	}
@@ -189,44 +252,44 @@ static EFI_STATUS parse_line(char *line, VOID *context)
 	    memcmp(&ctx->guid, ctx->restricted_guid, sizeof(ctx->guid)))
 		return EFI_SUCCESS;
 
-	if (parse_oemvar_attributes(&line, &attributes, &type)) {
+	if (parse_oemvar_attributes(line, &attributes, &type)) {
 		error(L"Invalid attribute specification");
 		return EFI_INVALID_PARAMETER;
 	}
 
 	/* Variable definition? */
-	skip_whitespace(&line);
-	var = line;
-	val = NULL;
-	while (*line && !isspace(*line)) line++;
-	if (*line) {
-		*line++ = 0;
-		skip_whitespace(&line);
-		val = line;
-	}
+	slice_skip_whitespace(line);
+	var.str = line->str;
+	for (var.len = 0; var.len < line->len; var.len++)
+		if (isspace(var.str[var.len]))
+			break;
 
-	if (!*var)
+	if (!var.len)
 		return EFI_SUCCESS;
 
-	if (val) {
-		switch (type) {
-		case VAR_TYPE_BLOB:
-			vallen = unescape_oemvar_val(val) - 1;
-			break;
-		case VAR_TYPE_STRING:
-			vallen = unescape_oemvar_val(val);
-			break;
-		default:
+	/* The value is unescaped in a copy as the data is not ours */
+	if (var.len < line->len) {
+		val.str = var.str + var.len + 1;
+		val.len = line->len - var.len - 1;
+		slice_skip_whitespace(&val);
+
+		if (type != VAR_TYPE_BLOB && type != VAR_TYPE_STRING)
 			return EFI_INVALID_PARAMETER;
-		}
-	} else {
-		vallen = 0;
+
+		valbuf = AllocatePool(val.len + 1);
+		if (!valbuf)
+			return EFI_OUT_OF_RESOURCES;
+
+		vallen = unescape_oemvar_val(valbuf, &val);
+		if (type == VAR_TYPE_STRING)
+			vallen++;
 	}
 
-	varname = stra_to_str((CHAR8 *)var);
+	varname = stran_to_str((CHAR8 *)var.str, var.len);
 	if (!varname) {
 		error(L"Failed to convert varname string.");
-		return EFI_INVALID_PARAMETER;
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
 	}
 
 	if (!memcmp(&ctx->guid, &fastboot_guid, sizeof(ctx->guid))) {
@@ -239,32 +302,101 @@ static EFI_STATUS parse_line(char *line, VOID *context)
 
 		if (i == FASTBOOT_SECURED_VARS_SIZE) {
 			error(L"fastboot GUID is reserved for Kernelflinger use");
-			return EFI_ACCESS_DENIED;
+			ret = EFI_ACCESS_DENIED;
+			goto out;
 		}
 
-		if (!(attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS))
-			return EFI_ACCESS_DENIED;
+		if (!(attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)) {
+			ret = EFI_ACCESS_DENIED;
+			goto out;
+		}
 #else
 		error(L"fastboot GUID is reserved for Kernelflinger use");
-		return EFI_ACCESS_DENIED;
+		ret = EFI_ACCESS_DENIED;
+		goto out;
 #endif
 	}
 
-	debug(L"Setting oemvar: %a", var);
-	ret = uefi_call_wrapper(RT->SetVariable, 5, varname,
-				&ctx->guid, attributes,
-				vallen, val);
-	FreePool(varname);
-	/* Delete a non-existent variable is permitted.  */
-	if (EFI_ERROR(ret) && !(ret == EFI_NOT_FOUND && vallen == 0)) {
-		if (!ctx->silent_write_error) {
-			efi_perror(ret, L"EFI variable setting failed");
-			return ret;
+	oemvar.guid = ctx->guid;
+	oemvar.name = varname;
+	oemvar.attributes = attributes;
+	oemvar.size = vallen;
+	oemvar.value = valbuf;
+	ret = add_oemvar(ctx, &oemvar);
+	if (!EFI_ERROR(ret))
+		return EFI_SUCCESS;
+
+out:
+	if (varname)
+		FreePool(varname);
+	if (valbuf)
+		FreePool(valbuf);
+	return ret;
+}
+
+/* The authenticated variables are read without their authentication
+   descriptor: they can't be compared to the file value */
+static BOOLEAN oemvar_is_current(struct oemvar *var)
+{
+	EFI_STATUS ret;
+	UINTN size;
+	VOID *data;
+	UINT32 flags;
+	BOOLEAN current;
+
+	if (var->attributes & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS)
+		return FALSE;
+
+	ret = get_efi_variable(&var->guid, var->name, &size, &data, &flags);
+	if (ret == EFI_NOT_FOUND)
+		return var->size == 0;
+	if (EFI_ERROR(ret))
+		return FALSE;
+
+	current = var->size && flags == var->attributes &&
+		size == var->size && !memcmp(data, var->value, size);
+	FreePool(data);
+	return current;
+}
+
+static EFI_STATUS write_oemvars(oemvars_ctx_t *ctx)
+{
+	EFI_STATUS ret;
+	struct oemvar *var;
+	UINTN i, unchanged = 0, written = 0, deleted = 0;
+
+	for (i = 0; i < ctx->nb_vars; i++) {
+		var = &ctx->vars[i];
+
+		if (oemvar_is_current(var)) {
+			unchanged++;
+			continue;
 		}
-		debug(L"EFI variable setting failed: %r", ret);
-		debug(L"silent error is on, continue anyway");
+
+		debug(L"Setting oemvar: %s", var->name);
+		ret = uefi_call_wrapper(RT->SetVariable, 5, var->name,
+					&var->guid, var->attributes,
+					var->size, var->value);
+		efi_variable_cache_invalidate(&var->guid, var->name);
+		/* Delete a non-existent variable is permitted.  */
+		if (EFI_ERROR(ret) && !(ret == EFI_NOT_FOUND && var->size == 0)) {
+			if (!ctx->silent_write_error) {
+				efi_perror(ret, L"EFI variable setting failed");
+				return ret;
+			}
+			debug(L"EFI variable setting failed: %r", ret);
+			debug(L"silent error is on, continue anyway");
+			continue;
+		}
+
+		if (var->size)
+			written++;
+		else
+			deleted++;
 	}
 
+	debug(L"oemvars: %d unchanged, %d written, %d deleted",
+	      unchanged, written, deleted);
 	return EFI_SUCCESS;
 }
 
@@ -303,6 +435,11 @@ static EFI_STATUS parse_line(char *line, VOID *context)
  *   GUID = xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
  *
  * will change the GUID used for subsequent lines.
+ *
+ * The whole file is parsed before any variable is written: a syntax
+ * error leaves the variables untouched.  When a variable is defined
+ * several times, only its last definition is written, and variables
+ * which already hold the requested value are not written again.
  */
 static EFI_STATUS _flash_oemvars(VOID *data, UINTN size,
 				 const EFI_GUID *restricted_guid,
@@ -313,9 +450,19 @@ static EFI_STATUS _flash_oemvars(VOID *data, UINTN size,
 		.restricted_guid = restricted_guid,
 		.silent_write_error = silent_error
 	};
+	EFI_STATUS ret;
+	UINTN i;
 
 	debug(L"Parsing and setting values from oemvars file");
-	return parse_text_buffer(data, size, parse_line, &ctx);
+	ret = parse_text_slices(data, size, parse_line, &ctx);
+	if (!EFI_ERROR(ret))
+		ret = write_oemvars(&ctx);
+
+	for (i = 0; i < ctx.nb_vars; i++)
+		free_oemvar(&ctx.vars[i]);
+	if (ctx.vars)
+		FreePool(ctx.vars);
+	return ret;
 }
 
 EFI_STATUS flash_oemvars_silent_write_error(VOID *data, UINTN size,
@@ -89,7 +89,7 @@
 #define PAGE_ATTRIBUTES	(1 << 7 | 1 << 1 | 1)	/* 2MB page - read/write - present */
 #define DIR_BITS	(32 - PAGE_BITS)
 #define DIR_ATTRIBUTES	(1)			/* Directory is present */
-#define MAX_MEMMAP_SZ	(128 * PAGE_SIZE)
+#define MAX_MEMMAP_SZ	(256 * PAGE_SIZE)
 #define MIN_MEMMAP_SZ	(32 * PAGE_SIZE)
 
 static struct memmap_context {
@@ -236,6 +236,12 @@ static EFI_STATUS memmap(EFI_PHYSICAL_ADDRESS addr)
 	if (!ctx.initialized)
 		return EFI_NOT_READY;
 
+	/* Consecutive accesses, a page at a time for instance, mostly
+	   fall in the current window: spare the directory update and
+	   the TLB flush.  */
+	if (addr >= ctx.dst.start && addr < ctx.dst.end)
+		return EFI_SUCCESS;
+
 	addr &= ~(PAGE_SIZE - 1);
 	ctx.dst.start = addr;
 	for (src = ctx.src.start; src < ctx.src.end; src += PAGE_SIZE) {
@@ -261,8 +267,15 @@ EFI_STATUS pae_map(EFI_PHYSICAL_ADDRESS addr, unsigned char **to, UINT64 *len)
 		if (addr > UINT32_MAX - *len)
 			*len = UINT32_MAX - addr;
 
-		if (addr + *len <= ctx.dst.start || addr >= ctx.dst.end)
+		/* The window linear addresses are not identity mapped
+		   once it has been moved.  */
+		if (!ctx.initialized || addr + *len <= ctx.src.start ||
+		    addr >= ctx.src.end)
+			return EFI_SUCCESS;
+		if (addr < ctx.src.start) {
+			*len = ctx.src.start - addr;
 			return EFI_SUCCESS;
+		}
 	}
 
 	ret = memmap(addr);
@@ -275,6 +288,11 @@ EFI_STATUS pae_map(EFI_PHYSICAL_ADDRESS addr, unsigned char **to, UINT64 *len)
 	return EFI_SUCCESS;
 }
 
+UINT64 pae_max_map_size(void)
+{
+	return ctx.initialized ? ctx.size : (UINT64)UINT32_MAX + 1;
+}
+
 EFI_STATUS pae_exit(void)
 {
 	if (!ctx.initialized)
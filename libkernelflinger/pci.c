@@ -30,6 +30,8 @@
 
 #include <efi.h>
 #include "log.h"
+#include "lib.h"
+#include "acpi.h"
 #include "pci.h"
 #include "protocol.h"
 
@@ -79,3 +81,198 @@ EFI_STATUS get_pci_ids(IN EFI_PCI_IO *pciio, OUT pci_device_ids_t *ids)
 	return uefi_call_wrapper(pciio->Pci.Read, 5, pciio, EfiPciIoWidthUint16,
 				 0, 2, ids);
 }
+
+#pragma pack(1)
+struct mcfg_allocation {
+	UINT64 base;
+	UINT16 segment;
+	UINT8 start_bus;
+	UINT8 end_bus;
+	UINT32 reserved;
+};
+
+struct MCFG_TABLE {
+	struct ACPI_DESC_HEADER header;
+	UINT64 reserved;
+	struct mcfg_allocation allocation[];
+};
+#pragma pack()
+
+#define PCI_MAX_BUS		255
+#define PCI_MAX_DEVICE		31
+#define PCI_MAX_FUNCTION	7
+#define PCI_HEADER_MULTI_FUNCTION	0x80
+
+/* Segment 0 MMCONFIG window, looked up once */
+static struct {
+	BOOLEAN initialized;
+	UINT8 *base;		/* NULL if the I/O ports must be used */
+	UINT8 start_bus;
+	UINT8 end_bus;
+} ecam;
+
+static struct {
+	struct pci_function *functions;
+	UINTN count;
+} snapshot;
+
+static void ecam_init(void)
+{
+	struct MCFG_TABLE *mcfg;
+	UINTN i, count;
+
+	if (ecam.initialized)
+		return;
+	ecam.initialized = TRUE;
+
+	if (EFI_ERROR(get_acpi_table((const CHAR8 *)"MCFG", (VOID **)&mcfg)))
+		return;
+
+	if (mcfg->header.length < sizeof(*mcfg))
+		return;
+
+	count = (mcfg->header.length - sizeof(*mcfg)) /
+		sizeof(mcfg->allocation[0]);
+	for (i = 0; i < count; i++) {
+		if (mcfg->allocation[i].segment != 0)
+			continue;
+		ecam.base = (UINT8 *)(UINTN)mcfg->allocation[i].base;
+		ecam.start_bus = mcfg->allocation[i].start_bus;
+		ecam.end_bus = mcfg->allocation[i].end_bus;
+		debug(L"PCI MMCONFIG at 0x%lx, buses %d-%d",
+		      mcfg->allocation[i].base, ecam.start_bus, ecam.end_bus);
+		return;
+	}
+}
+
+static inline UINT32 port_read_config32(UINT8 bus, UINT8 device,
+					UINT8 function, UINT16 offset)
+{
+	UINT32 address = 0x80000000 | bus << 16 | device << 11 |
+		function << 8 | offset;
+	UINT32 val;
+
+	__asm__ __volatile__("outl %0, %w1" : : "a"(address), "Nd"(0xcf8));
+	__asm__ __volatile__("inl %w1, %0" : "=a"(val) : "Nd"(0xcfc));
+	return val;
+}
+
+UINTN pci_config_size(void)
+{
+	ecam_init();
+	return ecam.base ? PCI_CONFIG_SIZE : PCI_LEGACY_CONFIG_SIZE;
+}
+
+EFI_STATUS pci_config_read(UINT8 bus, UINT8 device, UINT8 function,
+			   UINT16 offset, VOID *buf, UINTN size)
+{
+	volatile UINT32 *regs;
+	UINT32 *dst = buf;
+	UINTN i;
+
+	ecam_init();
+	if (!buf || device > PCI_MAX_DEVICE || function > PCI_MAX_FUNCTION ||
+	    (offset | size) & 3 || offset + size > pci_config_size())
+		return EFI_INVALID_PARAMETER;
+
+	if (ecam.base && (bus < ecam.start_bus || bus > ecam.end_bus)) {
+		for (i = 0; i < size / sizeof(*dst); i++)
+			dst[i] = 0xffffffff;
+		return EFI_SUCCESS;
+	}
+
+	if (!ecam.base) {
+		for (i = 0; i < size / sizeof(*dst); i++)
+			dst[i] = port_read_config32(bus, device, function,
+						    offset + i * sizeof(*dst));
+		return EFI_SUCCESS;
+	}
+
+	regs = (volatile UINT32 *)(ecam.base +
+				   ((UINTN)(bus - ecam.start_bus) << 20 |
+				    device << 15 | function << 12 | offset));
+	for (i = 0; i < size / sizeof(*dst); i++)
+		dst[i] = regs[i];
+
+	return EFI_SUCCESS;
+}
+
+static BOOLEAN function_present(UINT8 bus, UINT8 device, UINT8 function,
+				struct pci_function *f)
+{
+	UINT32 header[10];
+
+	if (EFI_ERROR(pci_config_read(bus, device, function, 0, header,
+				      sizeof(header))))
+		return FALSE;
+
+	if (header[0] == 0xffffffff || header[0] == 0x00000000 ||
+	    header[0] == 0x0000ffff || header[0] == 0xffff0000)
+		return FALSE;
+
+	f->bus = bus;
+	f->device = device;
+	f->function = function;
+	f->vendor_id = header[0] & 0xffff;
+	f->device_id = header[0] >> 16;
+	f->revision = header[2] & 0xff;
+	f->class_interface = (header[2] >> 8) & 0xff;
+	f->class_sub = (header[2] >> 16) & 0xff;
+	f->class_base = header[2] >> 24;
+	f->header_type = (header[3] >> 16) & 0xff;
+	memcpy(f->bar, &header[4], sizeof(f->bar));
+
+	return TRUE;
+}
+
+/* Store up to CAPACITY present functions in FUNCTIONS, if not NULL,
+ * and return how many were found */
+static UINTN scan(struct pci_function *functions, UINTN capacity)
+{
+	struct pci_function f;
+	UINTN bus, device, function, count = 0;
+
+	for (bus = 0; bus <= PCI_MAX_BUS; bus++) {
+		for (device = 0; device <= PCI_MAX_DEVICE; device++) {
+			for (function = 0; function <= PCI_MAX_FUNCTION;
+			     function++) {
+				if (!function_present(bus, device, function,
+						      &f)) {
+					if (function == 0)
+						break;
+					continue;
+				}
+				if (functions && count < capacity)
+					functions[count] = f;
+				count++;
+				if (function == 0 &&
+				    !(f.header_type & PCI_HEADER_MULTI_FUNCTION))
+					break;
+			}
+		}
+	}
+
+	return count;
+}
+
+EFI_STATUS pci_get_functions(const struct pci_function **functions,
+			     UINTN *count)
+{
+	if (!functions || !count)
+		return EFI_INVALID_PARAMETER;
+
+	if (!snapshot.functions) {
+		snapshot.count = scan(NULL, 0);
+		snapshot.functions = AllocatePool(max(snapshot.count, (UINTN)1) *
+						  sizeof(*snapshot.functions));
+		if (!snapshot.functions)
+			return EFI_OUT_OF_RESOURCES;
+		snapshot.count = min(snapshot.count,
+				     scan(snapshot.functions, snapshot.count));
+		debug(L"%d PCI functions found", snapshot.count);
+	}
+
+	*functions = snapshot.functions;
+	*count = snapshot.count;
+	return EFI_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "async_io.h"
+#include "prefetch.h"
+
+static struct prefetch_region {
+	EFI_BLOCK_IO *bio;
+	UINT64 offset;		/* Absolute disk byte offset */
+	UINTN size;
+	VOID *data;
+	struct async_io *aio;	/* Read in progress */
+	UINTN id;
+} regions[PREFETCH_MAX_REGIONS];
+static UINTN prefetched_size;
+
+static void region_free(struct prefetch_region *region)
+{
+	if (region->aio)
+		async_io_close(region->aio);
+	if (region->data) {
+		FreePool(region->data);
+		prefetched_size -= region->size;
+	}
+	memset(region, 0, sizeof(*region));
+}
+
+EFI_STATUS prefetch_disk(struct gpt_partition_interface *gparti,
+			 UINT64 offset, UINTN size)
+{
+	EFI_STATUS ret;
+	struct prefetch_region *region = NULL;
+	UINTN i;
+
+	if (!gparti || !size)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < ARRAY_SIZE(regions); i++) {
+		if (!regions[i].data) {
+			if (!region)
+				region = &regions[i];
+			continue;
+		}
+		if (regions[i].bio == gparti->bio && offset >= regions[i].offset &&
+		    offset + size <= regions[i].offset + regions[i].size)
+			return EFI_SUCCESS;
+	}
+	if (!region || size > PREFETCH_MAX_SIZE - prefetched_size)
+		return EFI_OUT_OF_RESOURCES;
+
+	region->data = AllocatePool(size);
+	if (!region->data)
+		return EFI_OUT_OF_RESOURCES;
+	region->size = size;
+	prefetched_size += size;
+
+	ret = async_io_open(gparti, &region->aio);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	region->bio = gparti->bio;
+	region->offset = offset;
+
+	ret = async_io_read(region->aio, region->offset, size, region->data,
+			    &region->id);
+	if (EFI_ERROR(ret))
+		goto err;
+
+	return EFI_SUCCESS;
+
+err:
+	region_free(region);
+	return ret;
+}
+
+EFI_STATUS prefetch_partition(const CHAR16 *label, UINT64 offset, UINTN size)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface gparti;
+	UINT64 part_start, part_size;
+
+	if (!label || !size)
+		return EFI_INVALID_PARAMETER;
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	part_start = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	part_size = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) *
+		gparti.bio->Media->BlockSize;
+	if (offset >= part_size)
+		return EFI_INVALID_PARAMETER;
+	size = min(size, (UINTN)(part_size - offset));
+
+	ret = prefetch_disk(&gparti, part_start + offset, size);
+	if (!EFI_ERROR(ret))
+		debug(L"Prefetching %d bytes of %s", size, label);
+
+	return ret;
+}
+
+EFI_STATUS prefetch_read(struct gpt_partition_interface *gparti,
+			 UINT64 offset, UINTN size, VOID *buf)
+{
+	EFI_STATUS ret;
+	struct prefetch_region *region;
+	UINTN i;
+
+	if (!gparti || !buf)
+		return EFI_INVALID_PARAMETER;
+
+	for (i = 0; i < ARRAY_SIZE(regions); i++) {
+		region = &regions[i];
+		if (!region->data || region->bio != gparti->bio ||
+		    offset < region->offset ||
+		    offset - region->offset > region->size ||
+		    size > region->size - (offset - region->offset))
+			continue;
+
+		if (region->aio) {
+			ret = async_io_wait(region->aio, region->id);
+			async_io_close(region->aio);
+			region->aio = NULL;
+			if (EFI_ERROR(ret)) {
+				efi_perror(ret, L"Prefetch read failed");
+				region_free(region);
+				return EFI_NOT_FOUND;
+			}
+		}
+
+		memcpy(buf, region->data + (offset - region->offset), size);
+		return EFI_SUCCESS;
+	}
+
+	return EFI_NOT_FOUND;
+}
+
+void prefetch_invalidate(EFI_BLOCK_IO *bio, UINT64 offset, UINT64 size)
+{
+	struct prefetch_region *region;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(regions); i++) {
+		region = &regions[i];
+		if (!region->data)
+			continue;
+		if (bio && (region->bio != bio ||
+			    offset >= region->offset + region->size ||
+			    offset + size <= region->offset))
+			continue;
+		region_free(region);
+	}
+}
+
+void prefetch_release(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(regions); i++)
+		if (regions[i].data)
+			region_free(&regions[i]);
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "protocol.h"
+
+/* Protocol interface cache: the storage, file system and charger
+   interfaces are resolved again on every erase, flash or battery
+   query.  The result of these lookups, failures included, is kept in
+   a small round robin table indexed by handle and GUID.
+
+   The first lookup of a GUID registers a notify event for it with
+   RegisterProtocolNotify(): the firmware signals it each time an
+   interface of that GUID is installed or reinstalled and the entries
+   of the GUID are then dropped by the next lookup.  The event has no
+   notify function so that nothing points into this image once it is
+   unloaded.  The removal of an interface is not notified, the code
+   which can make handles go away, gpt_commit_refresh() for instance,
+   calls protocol_cache_invalidate().  */
+#define PROTOCOL_CACHE_SIZE	32
+#define PROTOCOL_NOTIFY_SIZE	16
+
+enum lookup_type {
+	LOOKUP_HANDLE,		/* The handle itself, any handle if NULL */
+	LOOKUP_DEVICE_PATH	/* The closest handle on its device path */
+};
+
+static struct protocol_entry {
+	BOOLEAN used;
+	enum lookup_type type;
+	EFI_HANDLE handle;
+	EFI_GUID guid;
+	EFI_STATUS status;
+	VOID *interface;
+} entries[PROTOCOL_CACHE_SIZE];
+static UINTN entries_next;
+
+static struct protocol_notify {
+	EFI_GUID guid;
+	EFI_EVENT event;
+	VOID *registration;
+} notify[PROTOCOL_NOTIFY_SIZE];
+static UINTN notify_count;
+
+static void drop_guid(EFI_GUID *guid)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(entries); i++)
+		if (entries[i].used && !CompareGuid(&entries[i].guid, guid))
+			memset(&entries[i], 0, sizeof(entries[i]));
+}
+
+/* Drop the entries of GUID if an interface has been installed since
+   the last lookup.  Return FALSE if its lookups cannot be cached.  */
+static BOOLEAN watch_guid(EFI_GUID *guid)
+{
+	struct protocol_notify *n;
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < notify_count; i++) {
+		n = &notify[i];
+		if (CompareGuid(&n->guid, guid))
+			continue;
+
+		/* CheckEvent() also clears the signaled state */
+		ret = uefi_call_wrapper(BS->CheckEvent, 1, n->event);
+		if (ret == EFI_SUCCESS)
+			drop_guid(guid);
+		return TRUE;
+	}
+
+	if (notify_count == ARRAY_SIZE(notify))
+		return FALSE;
+
+	n = &notify[notify_count];
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, TPL_CALLBACK,
+				NULL, NULL, &n->event);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create protocol notify event");
+		return FALSE;
+	}
+
+	ret = uefi_call_wrapper(BS->RegisterProtocolNotify, 3, guid,
+				n->event, &n->registration);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to register protocol notify event");
+		uefi_call_wrapper(BS->CloseEvent, 1, n->event);
+		return FALSE;
+	}
+
+	memcpy(&n->guid, guid, sizeof(n->guid));
+	notify_count++;
+	return TRUE;
+}
+
+static EFI_STATUS firmware_lookup(enum lookup_type type, EFI_HANDLE handle,
+				  EFI_GUID *guid, VOID **interface)
+{
+	EFI_DEVICE_PATH *path;
+	EFI_HANDLE device;
+	EFI_STATUS ret;
+
+	if (type == LOOKUP_HANDLE) {
+		if (!handle)
+			return LibLocateProtocol(guid, interface);
+		return handle_protocol(handle, guid, interface);
+	}
+
+	path = DevicePathFromHandle(handle);
+	if (!path)
+		return EFI_INVALID_PARAMETER;
+
+	ret = locate_device_path(guid, &path, &device);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return handle_protocol(device, guid, interface);
+}
+
+static EFI_STATUS lookup(enum lookup_type type, EFI_HANDLE handle,
+			 EFI_GUID *guid, VOID **interface)
+{
+	struct protocol_entry *entry;
+	BOOLEAN cacheable;
+	EFI_STATUS ret;
+	UINTN i;
+
+	if (!guid || !interface)
+		return EFI_INVALID_PARAMETER;
+
+	cacheable = watch_guid(guid);
+	for (i = 0; cacheable && i < ARRAY_SIZE(entries); i++) {
+		entry = &entries[i];
+		if (!entry->used || entry->type != type ||
+		    entry->handle != handle || CompareGuid(&entry->guid, guid))
+			continue;
+
+		*interface = entry->interface;
+		return entry->status;
+	}
+
+	ret = firmware_lookup(type, handle, guid, interface);
+	/* Transient errors are not cached */
+	if (!cacheable ||
+	    (EFI_ERROR(ret) && ret != EFI_UNSUPPORTED && ret != EFI_NOT_FOUND))
+		return ret;
+
+	entry = &entries[entries_next];
+	entries_next = (entries_next + 1) % ARRAY_SIZE(entries);
+	entry->used = TRUE;
+	entry->type = type;
+	entry->handle = handle;
+	memcpy(&entry->guid, guid, sizeof(entry->guid));
+	entry->status = ret;
+	entry->interface = EFI_ERROR(ret) ? NULL : *interface;
+
+	return ret;
+}
+
+EFI_STATUS handle_protocol_cached(EFI_HANDLE handle, EFI_GUID *protocol,
+				  void **interface)
+{
+	if (!handle)
+		return EFI_INVALID_PARAMETER;
+
+	return lookup(LOOKUP_HANDLE, handle, protocol, interface);
+}
+
+EFI_STATUS locate_protocol_cached(EFI_GUID *protocol, void **interface)
+{
+	return lookup(LOOKUP_HANDLE, NULL, protocol, interface);
+}
+
+EFI_STATUS device_protocol_cached(EFI_HANDLE handle, EFI_GUID *protocol,
+				  void **interface)
+{
+	if (!handle)
+		return EFI_INVALID_PARAMETER;
+
+	return lookup(LOOKUP_DEVICE_PATH, handle, protocol, interface);
+}
+
+void protocol_cache_invalidate(void)
+{
+	memset(entries, 0, sizeof(entries));
+	entries_next = 0;
+}
@@ -41,6 +41,10 @@
 #define UFS_SECURITY_PROTOCOL_IN	0xa2
 #define UFS_SECURITY_PROTOCOL_OUT	0xb5
 #define UFS_RPMB_LUN			0x44c1
+/* Blocks per RPMB authenticated data write request.  It must not
+   exceed the bRPMB_ReadWriteSize of the device geometry descriptor,
+   which is not queried: keep it to the smallest multi-block size.  */
+#define UFS_RPMB_WRITE_FRAMES		2
 
 
 struct command_descriptor_block_unmap {
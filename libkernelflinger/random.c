@@ -0,0 +1,279 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <immintrin.h>
+
+#include "lib.h"
+#include "aesni.h"
+#include "mp_pool.h"
+#include "random.h"
+
+#define TARGET_RDRAND	__attribute__((target("rdrnd")))
+#define TARGET_RDSEED	__attribute__((target("rdseed")))
+#define TARGET_AES	__attribute__((target("aes,sse2")))
+
+/* Intel recommends 10 RDRAND attempts before reporting a failure.
+   RDSEED fails much more often under load, it is given more attempts
+   with a pause between them.  */
+#define RDRAND_RETRIES		10
+#define RDSEED_RETRIES		100
+
+#define AES_BLOCK_SIZE		AESNI_BLOCK_SIZE
+#define AES_256_ROUNDS		AESNI_256_ROUNDS
+#define DRBG_KEY_SIZE		AESNI_256_KEY_SIZE
+/* Blocks encrypted per AES pipeline pass and per parallel chunk */
+#define CTR_LANES		4
+#define CTR_CHUNK_BLOCKS	4096
+
+static struct {
+	BOOLEAN probed;
+	BOOLEAN rdrand;
+	BOOLEAN rdseed;
+} cpu;
+
+static struct {
+	BOOLEAN seeded;
+	struct aesni_256_key key;
+	UINT64 ctr[2];		/* Low, high */
+	UINT64 output;		/* Bytes generated since the last seeding */
+} drbg;
+
+static void cpu_probe(void)
+{
+	UINT32 reg[4];
+
+	if (cpu.probed)
+		return;
+	cpu.probed = TRUE;
+
+	cpuid(0, reg);
+	if (reg[0] >= 7) {
+		cpuid_count(7, 0, reg);
+		cpu.rdseed = !!(reg[1] & (1 << 18));
+	}
+
+	cpuid(1, reg);
+	cpu.rdrand = !!(reg[2] & (1 << 30));
+}
+
+static TARGET_RDRAND BOOLEAN rdrand64(UINT64 *val)
+{
+	UINTN retry;
+
+	for (retry = 0; retry < RDRAND_RETRIES; retry++) {
+#ifdef __LP64__
+		if (_rdrand64_step((unsigned long long *)val))
+			return TRUE;
+#else
+		UINT32 *half = (UINT32 *)val;
+
+		if (_rdrand32_step(&half[0]) &&
+		    _rdrand32_step(&half[1]))
+			return TRUE;
+#endif
+	}
+
+	return FALSE;
+}
+
+static TARGET_RDSEED BOOLEAN rdseed64(UINT64 *val)
+{
+	UINTN retry;
+
+	for (retry = 0; retry < RDSEED_RETRIES; retry++) {
+#ifdef __LP64__
+		if (_rdseed64_step((unsigned long long *)val))
+			return TRUE;
+#else
+		UINT32 *half = (UINT32 *)val;
+
+		if (_rdseed32_step(&half[0]) &&
+		    _rdseed32_step(&half[1]))
+			return TRUE;
+#endif
+		_mm_pause();
+	}
+
+	return FALSE;
+}
+
+EFI_STATUS random_get(VOID *buf, UINTN size)
+{
+	UINT8 *dst = buf;
+	UINT64 val;
+	UINTN len;
+
+	if (!buf)
+		return EFI_INVALID_PARAMETER;
+
+	cpu_probe();
+	if (!cpu.rdrand)
+		return EFI_UNSUPPORTED;
+
+	while (size) {
+		if (!rdrand64(&val))
+			return EFI_DEVICE_ERROR;
+		len = min(size, sizeof(val));
+		memcpy(dst, &val, len);
+		dst += len;
+		size -= len;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS drbg_seed(void)
+{
+	UINT64 seed[(DRBG_KEY_SIZE + AES_BLOCK_SIZE) / sizeof(UINT64)];
+	BOOLEAN ok = TRUE;
+	UINTN i;
+
+	for (i = 0; ok && i < ARRAY_SIZE(seed); i++)
+		ok = cpu.rdseed ? rdseed64(&seed[i]) : rdrand64(&seed[i]);
+	if (!ok)
+		return EFI_DEVICE_ERROR;
+
+	aesni_256_set_key((UINT8 *)seed, &drbg.key);
+	memcpy(drbg.ctr, (UINT8 *)seed + DRBG_KEY_SIZE, sizeof(drbg.ctr));
+	memset(seed, 0, sizeof(seed));
+	drbg.output = 0;
+	drbg.seeded = TRUE;
+
+	return EFI_SUCCESS;
+}
+
+static inline TARGET_AES __m128i ctr_block(const UINT64 ctr[2], UINT64 index)
+{
+	UINT64 lo = ctr[0] + index;
+	UINT64 hi = ctr[1] + (lo < ctr[0]);
+
+	return _mm_set_epi64x(hi, lo);
+}
+
+struct ctr_job {
+	UINT8 *dst;
+	UINTN blocks;
+	UINT64 ctr[2];
+	const __m128i *rk;
+};
+
+/* Encrypt the counter blocks [START, END) of JOB, CTR_LANES at a
+   time to keep the AES units busy.  */
+static TARGET_AES void ctr_encrypt(UINTN start, UINTN end, VOID *ctx)
+{
+	struct ctr_job *job = ctx;
+	__m128i b[CTR_LANES];
+	UINTN i, j, r, lanes;
+
+	start *= CTR_CHUNK_BLOCKS;
+	end = min(end * CTR_CHUNK_BLOCKS, job->blocks);
+
+	for (i = start; i < end; i += lanes) {
+		lanes = min(end - i, (UINTN)CTR_LANES);
+		for (j = 0; j < lanes; j++)
+			b[j] = _mm_xor_si128(ctr_block(job->ctr, i + j),
+					     job->rk[0]);
+		for (r = 1; r < AES_256_ROUNDS; r++)
+			for (j = 0; j < lanes; j++)
+				b[j] = _mm_aesenc_si128(b[j], job->rk[r]);
+		for (j = 0; j < lanes; j++)
+			_mm_storeu_si128((__m128i *)(job->dst + (i + j) *
+						     AES_BLOCK_SIZE),
+					 _mm_aesenclast_si128(b[j],
+							      job->rk[AES_256_ROUNDS]));
+	}
+}
+
+static void ctr_advance(UINT64 blocks)
+{
+	UINT64 lo = drbg.ctr[0];
+
+	drbg.ctr[0] += blocks;
+	drbg.ctr[1] += drbg.ctr[0] < lo;
+}
+
+EFI_STATUS random_bulk(VOID *buf, UINTN size)
+{
+	UINT8 tail[AES_BLOCK_SIZE], key[DRBG_KEY_SIZE];
+	struct ctr_job job;
+	EFI_STATUS ret;
+
+	if (!buf)
+		return EFI_INVALID_PARAMETER;
+
+	cpu_probe();
+	if (!aesni_is_supported() || (!cpu.rdseed && !cpu.rdrand))
+		return random_get(buf, size);
+
+	if (!drbg.seeded || drbg.output >= RANDOM_RESEED_SIZE) {
+		ret = drbg_seed();
+		if (EFI_ERROR(ret))
+			return ret;
+	}
+
+	job.rk = (const __m128i *)drbg.key.rk;
+	memcpy(job.ctr, drbg.ctr, sizeof(job.ctr));
+	job.dst = buf;
+	job.blocks = size / AES_BLOCK_SIZE;
+	if (job.blocks) {
+		ret = parallel_for((job.blocks + CTR_CHUNK_BLOCKS - 1) /
+				   CTR_CHUNK_BLOCKS, 1, ctr_encrypt, &job);
+		if (EFI_ERROR(ret))
+			return ret;
+		ctr_advance(job.blocks);
+	}
+
+	if (size % AES_BLOCK_SIZE) {
+		memcpy(job.ctr, drbg.ctr, sizeof(job.ctr));
+		job.dst = tail;
+		job.blocks = 1;
+		ctr_encrypt(0, 1, &job);
+		ctr_advance(1);
+		memcpy((UINT8 *)buf + size - size % AES_BLOCK_SIZE, tail,
+		       size % AES_BLOCK_SIZE);
+	}
+
+	/* Replace the key so that the output of this request cannot be
+	   recomputed from the DRBG state later on */
+	memcpy(job.ctr, drbg.ctr, sizeof(job.ctr));
+	job.dst = key;
+	job.blocks = sizeof(key) / AES_BLOCK_SIZE;
+	ctr_encrypt(0, 1, &job);
+	ctr_advance(job.blocks);
+	aesni_256_set_key(key, &drbg.key);
+
+	memset(key, 0, sizeof(key));
+	memset(tail, 0, sizeof(tail));
+	drbg.output += size;
+
+	return EFI_SUCCESS;
+}
@@ -36,11 +36,13 @@
 #include "protocol/SdHostIo.h"
 #include "rpmb.h"
 #include "gpt.h"
+#include "blkcache.h"
 #include "rpmb_storage_common.h"
 #include "rpmb_ufs.h"
 #include "rpmb_emmc.h"
 #include "rpmb_virtual.h"
 #include "rpmb_nvme.h"
+#include "rpmb_memory.h"
 #include "storage.h"
 
 #define MAGIC_KEY_OFFSET		0
@@ -100,6 +102,7 @@ static EFI_STATUS rpmb_simulate_read_write_teedata_partition(
 		if (EFI_ERROR(ret))
 			efi_perror(ret, L"read partition %s failed", gparti.part.name);
 	} else {
+		blkcache_invalidate(gparti.bio, partoffset + offset, len);
 		ret = uefi_call_wrapper(gparti.dio->WriteDisk, 5,
 				gparti.dio, gparti.bio->Media->MediaId, partoffset + offset, len, data);
 		if (EFI_ERROR(ret))
@@ -216,6 +219,12 @@ EFI_STATUS rpmb_init(EFI_HANDLE disk_handle)
 	enum storage_type type;
 	EFI_STATUS ret;
 
+#ifdef RPMB_MEMORY
+	storage_rpmb_ops = get_memory_storage_rpmb_ops();
+	debug(L"Use the memory RPMB");
+	return storage_rpmb_ops->get_storage_protocol(&rpmb_dev, disk_handle);
+#endif
+
 	ret = get_boot_device_type(&type);
 
 	if (EFI_ERROR(ret)) {
@@ -224,6 +233,7 @@ EFI_STATUS rpmb_init(EFI_HANDLE disk_handle)
 	}
 
 	switch (type) {
+#ifdef STORAGE_BACKEND_UFS
 	case STORAGE_UFS:
 		storage_rpmb_ops = get_ufs_storage_rpmb_ops();
 		if (!storage_rpmb_ops) {
@@ -237,6 +247,8 @@ EFI_STATUS rpmb_init(EFI_HANDLE disk_handle)
 		}
 		error(L"init ufs rpmb using pass through failed");
 		break;
+#endif
+#ifdef STORAGE_BACKEND_EMMC
 	case STORAGE_EMMC:
 		storage_rpmb_ops = get_emmc_storage_rpmb_ops(disk_handle);
 		if (!storage_rpmb_ops) {
@@ -249,6 +261,8 @@ EFI_STATUS rpmb_init(EFI_HANDLE disk_handle)
 		}
 		error(L"init emmc rpmb protocol failed");
 		break;
+#endif
+#ifdef STORAGE_BACKEND_VIRTUAL
 	case STORAGE_VIRTUAL:
 		storage_rpmb_ops = get_virtual_storage_rpmb_ops();
 		if (!storage_rpmb_ops) {
@@ -261,7 +275,8 @@ EFI_STATUS rpmb_init(EFI_HANDLE disk_handle)
 		}
 		error(L"init virtual media rpmb using pass through failed");
 		break;
-#ifdef NVME_RPMB
+#endif
+#if defined(NVME_RPMB) && defined(STORAGE_BACKEND_NVME)
 	case STORAGE_NVME:
 		storage_rpmb_ops = get_nvme_storage_rpmb_ops();
 		if (!storage_rpmb_ops) {
@@ -383,3 +398,19 @@ EFI_STATUS write_rpmb_data_frame(void *rpmb_dev, const rpmb_data_frame *data_in_
 {
 	return storage_rpmb_ops->write_rpmb_data_frame(rpmb_dev, data_in_frame, in_cnt, data_out_frame, out_cnt);
 }
+
+EFI_STATUS rpmb_session_begin(void *rpmb_dev)
+{
+	if (!storage_rpmb_ops || !storage_rpmb_ops->session_begin)
+		return EFI_SUCCESS;
+
+	return storage_rpmb_ops->session_begin(rpmb_dev);
+}
+
+EFI_STATUS rpmb_session_end(void *rpmb_dev)
+{
+	if (!storage_rpmb_ops || !storage_rpmb_ops->session_end)
+		return EFI_SUCCESS;
+
+	return storage_rpmb_ops->session_end(rpmb_dev);
+}
@@ -50,6 +50,14 @@
 typedef EFI_SD_HOST_IO_PROTOCOL * rpmb_dev_sdio_t;
 static rpmb_dev_sdio_t def_rpmb_dev_sdio;
 
+/* While an RPMB session is open the RPMB partition stays selected:
+   the requests neither read the EXT_CSD nor switch the partition.
+   SAVED_PART is restored when the outermost session ends.  */
+static struct {
+	UINTN depth;
+	UINT8 saved_part;
+} session;
+
 typedef union {
 	UINT32 data;
 	struct {
@@ -260,6 +268,11 @@ static EFI_STATUS emmc_get_current_part_switch_part_passthru(void *rpmb_dev, UIN
 	if (!passthru || !current_part)
 		return EFI_INVALID_PARAMETER;
 
+	if (session.depth) {
+		*current_part = switch_part;
+		return EFI_SUCCESS;
+	}
+
 	ret = get_emmc_partition_num_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get current partition");
@@ -278,6 +291,46 @@ static EFI_STATUS emmc_get_current_part_switch_part_passthru(void *rpmb_dev, UIN
 	return ret;
 }
 
+static EFI_STATUS emmc_restore_part_passthru(void *rpmb_dev, UINT8 part)
+{
+	if (session.depth)
+		return EFI_SUCCESS;
+
+	return emmc_partition_switch_passthru(rpmb_dev, part);
+}
+
+static EFI_STATUS emmc_session_begin_passthru(void *rpmb_dev)
+{
+	EFI_STATUS ret;
+
+	if (session.depth) {
+		session.depth++;
+		return EFI_SUCCESS;
+	}
+
+	ret = emmc_get_current_part_switch_part_passthru(rpmb_dev, &session.saved_part,
+							 RPMB_PARTITION);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	session.depth = 1;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS emmc_session_end_passthru(void *rpmb_dev)
+{
+	if (!session.depth)
+		return EFI_NOT_STARTED;
+
+	if (--session.depth)
+		return EFI_SUCCESS;
+
+	if (session.saved_part == RPMB_PARTITION)
+		return EFI_SUCCESS;
+
+	return emmc_partition_switch_passthru(rpmb_dev, session.saved_part);
+}
+
 static EFI_STATUS emmc_rpmb_send_blockcount_passthru(void *rpmb_dev, UINT8 count, BOOLEAN is_rel_write)
 {
 	EFI_STATUS ret;
@@ -501,7 +554,7 @@ EFI_STATUS emmc_read_rpmb_data_passthru(void *rpmb_dev, UINT16 blk_count, UINT16
 		memcpy((UINT8 *)buffer + i * 256, data_out_frame[i].data, 256);
 
 out:
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -555,7 +608,7 @@ EFI_STATUS emmc_get_counter_passthru(void *rpmb_dev, UINT32 *write_counter, cons
 	debug(L"current counter is 0x%0x", *write_counter);
 
 out:
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -638,7 +691,7 @@ EFI_STATUS emmc_write_rpmb_data_passthru(void *rpmb_dev, UINT16 blk_count, UINT1
 	}
 
 out:
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -689,7 +742,7 @@ EFI_STATUS emmc_program_key_passthru(void *rpmb_dev, const void *key, RPMB_RESPO
 		goto out;
 
 out:
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -731,7 +784,7 @@ EFI_STATUS emmc_program_rpmb_key_frame_passthru(void *rpmb_dev, const rpmb_data_
 		goto out;
 
 out:
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -763,7 +816,7 @@ EFI_STATUS emmc_get_rpmb_counter_frame_passthru(void *rpmb_dev, const rpmb_data_
 	ret = emmc_rpmb_request_response_passthru(rpmb_dev, (rpmb_data_frame *)data_in_frame, data_out_frame,
 		in_cnt, out_cnt, RPMB_RESPONSE_COUNTER_READ, rpmb_result);
 
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -794,7 +847,7 @@ EFI_STATUS emmc_read_rpmb_data_frame_passthru(void *rpmb_dev, const rpmb_data_fr
 	ret = emmc_rpmb_request_response_passthru(rpmb_dev, (rpmb_data_frame *)data_in_frame, data_out_frame, in_cnt,
 			out_cnt, RPMB_RESPONSE_AUTH_READ, &rpmb_result);
 
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -832,7 +885,7 @@ EFI_STATUS emmc_write_rpmb_data_frame_passthru(void *rpmb_dev, const rpmb_data_f
 		ret = emmc_rpmb_request_response_passthru(rpmb_dev, data_out_frame, data_out_frame, out_cnt, out_cnt,
 			RPMB_RESPONSE_AUTH_WRITE, &rpmb_result);
 out:
-	ret_switch_partition = emmc_partition_switch_passthru(rpmb_dev, current_part);
+	ret_switch_partition = emmc_restore_part_passthru(rpmb_dev, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -854,7 +907,9 @@ rpmb_ops_func_t emmc_rpmb_ops_passthru = {
 	.program_rpmb_key_frame = emmc_program_key_frame_passthru,
 	.get_rpmb_counter_frame = emmc_get_counter_frame_passthru,
 	.read_rpmb_data_frame = emmc_read_rpmb_data_frame_passthru,
-	.write_rpmb_data_frame = emmc_write_rpmb_data_frame_passthru
+	.write_rpmb_data_frame = emmc_write_rpmb_data_frame_passthru,
+	.session_begin = emmc_session_begin_passthru,
+	.session_end = emmc_session_end_passthru
 };
 #endif  // USE_SD_PASS_THRU
 
@@ -1007,6 +1062,11 @@ static EFI_STATUS emmc_get_current_part_switch_part_sdio(EFI_SD_HOST_IO_PROTOCOL
 	if (!sdio || !current_part)
 		return EFI_INVALID_PARAMETER;
 
+	if (session.depth) {
+		*current_part = switch_part;
+		return EFI_SUCCESS;
+	}
+
 	ret = get_emmc_partition_num_sdio(sdio, current_part);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to get current partition");
@@ -1025,6 +1085,52 @@ static EFI_STATUS emmc_get_current_part_switch_part_sdio(EFI_SD_HOST_IO_PROTOCOL
 	return ret;
 }
 
+static EFI_STATUS emmc_restore_part_sdio(EFI_SD_HOST_IO_PROTOCOL *sdio, UINT8 part)
+{
+	if (session.depth)
+		return EFI_SUCCESS;
+
+	return emmc_partition_switch_sdio(sdio, part);
+}
+
+static EFI_STATUS emmc_session_begin_sdio(void *rpmb_dev)
+{
+	EFI_STATUS ret;
+	EFI_SD_HOST_IO_PROTOCOL *sdio = (EFI_SD_HOST_IO_PROTOCOL *)rpmb_dev;
+
+	if (session.depth) {
+		session.depth++;
+		return EFI_SUCCESS;
+	}
+
+	if (!sdio)
+		sdio = def_rpmb_dev_sdio;
+
+	ret = emmc_get_current_part_switch_part_sdio(sdio, &session.saved_part,
+						     RPMB_PARTITION);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	session.depth = 1;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS emmc_session_end_sdio(void *rpmb_dev)
+{
+	EFI_SD_HOST_IO_PROTOCOL *sdio = (EFI_SD_HOST_IO_PROTOCOL *)rpmb_dev;
+
+	if (!session.depth)
+		return EFI_NOT_STARTED;
+
+	if (--session.depth)
+		return EFI_SUCCESS;
+
+	if (session.saved_part == RPMB_PARTITION)
+		return EFI_SUCCESS;
+
+	return emmc_partition_switch_sdio(sdio, session.saved_part);
+}
+
 static EFI_STATUS emmc_rpmb_send_blockcount_sdio(EFI_SD_HOST_IO_PROTOCOL *sdio,
 		UINT8 count, BOOLEAN is_rel_write)
 {
@@ -1242,7 +1348,7 @@ EFI_STATUS emmc_read_rpmb_data_sdio(void *rpmb_dev, UINT16 blk_count, UINT16 blk
 		memcpy((UINT8 *)buffer + i * 256, data_out_frame[i].data, 256);
 
 out:
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1300,7 +1406,7 @@ EFI_STATUS emmc_get_counter_sdio(void *rpmb_dev, UINT32 *write_counter, const vo
 	debug(L"current counter is 0x%0x", *write_counter);
 
 out:
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1384,7 +1490,7 @@ EFI_STATUS emmc_write_rpmb_data_sdio(void *rpmb_dev, UINT16 blk_count, UINT16 bl
 	}
 
 out:
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1432,7 +1538,7 @@ EFI_STATUS emmc_program_key_sdio(void *rpmb_dev, const void *key, RPMB_RESPONSE_
 		goto out;
 
 out:
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1475,7 +1581,7 @@ EFI_STATUS emmc_program_key_frame_sdio(void *rpmb_dev, const rpmb_data_frame *da
 		goto out;
 
 out:
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1512,7 +1618,7 @@ EFI_STATUS emmc_get_counter_frame_sdio(void *rpmb_dev, const rpmb_data_frame *da
 		efi_perror(ret, L"Failed to read RPMB_RESPONSE_COUNTER_READ");
 	}
 
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1543,7 +1649,7 @@ EFI_STATUS emmc_read_rpmb_data_frame_sdio(void *rpmb_dev, const rpmb_data_frame
 	ret = emmc_rpmb_request_response_sdio(sdio, (rpmb_data_frame *)data_in_frame, data_out_frame, in_cnt, out_cnt,
 		RPMB_RESPONSE_AUTH_READ, &rpmb_result);
 
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1585,7 +1691,7 @@ EFI_STATUS emmc_write_rpmb_data_frame_sdio(void *rpmb_dev, const rpmb_data_frame
 		goto out;
 
 out:
-	ret_switch_partition = emmc_partition_switch_sdio(sdio, current_part);
+	ret_switch_partition = emmc_restore_part_sdio(sdio, current_part);
 	if (EFI_ERROR(ret_switch_partition)) {
 		efi_perror(ret, L"Failed to switch emmc current partition");
 		ret = ret_switch_partition;
@@ -1608,8 +1714,9 @@ rpmb_ops_func_t emmc_rpmb_ops_sdio = {
 	.program_rpmb_key_frame = emmc_program_key_frame_sdio,
 	.get_rpmb_counter_frame = emmc_get_counter_frame_sdio,
 	.read_rpmb_data_frame = emmc_read_rpmb_data_frame_sdio,
-	.write_rpmb_data_frame = emmc_write_rpmb_data_frame_sdio
-
+	.write_rpmb_data_frame = emmc_write_rpmb_data_frame_sdio,
+	.session_begin = emmc_session_begin_sdio,
+	.session_end = emmc_session_end_sdio
 };
 
 rpmb_ops_func_t* get_emmc_storage_rpmb_ops(EFI_HANDLE disk_handle)
@@ -0,0 +1,672 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <lib.h>
+#include "rpmb_memory.h"
+#include "rpmb_storage_common.h"
+
+#define RPMB_BLOCK_SIZE			256
+#define USER_PARTITION			0
+#define UNUSED_PARAM			__attribute__((__unused__))
+
+static struct {
+	UINT8 *data;
+	UINT8 key[RPMB_KEY_SIZE];
+	BOOLEAN key_programmed;
+	UINT32 write_counter;
+	UINT8 current_part;
+	/* Result of the last write request, returned to the next
+	   RPMB_REQUEST_STATUS request */
+	rpmb_data_frame result;
+	/* Read request waiting for rpmb_get_response() */
+	rpmb_data_frame request;
+	BOOLEAN request_pending;
+} dev;
+
+static struct {
+	UINTN depth;
+	UINT8 saved_part;
+} session;
+
+static struct rpmb_memory_stats stats;
+
+static INT32 calc_mac(rpmb_data_frame *frames, UINT32 cnt, const UINT8 *key,
+		      UINT8 mac[RPMB_MAC_SIZE])
+{
+	stats.hmacs++;
+	return rpmb_calc_hmac_sha256(frames, cnt, key, RPMB_KEY_SIZE,
+				     mac, RPMB_MAC_SIZE);
+}
+
+static INT32 check_mac(const UINT8 *key, rpmb_data_frame *frames, UINT32 cnt)
+{
+	stats.hmacs++;
+	return rpmb_check_mac(key, frames, cnt);
+}
+
+static void switch_partition(UINT8 part)
+{
+	if (dev.current_part == part)
+		return;
+
+	dev.current_part = part;
+	stats.partition_switches++;
+}
+
+/*
+ * Device side
+ */
+
+static void set_result(UINT16 resp, RPMB_RESPONSE_RESULT result)
+{
+	memset(&dev.result, 0, sizeof(dev.result));
+	dev.result.req_resp = CPU_TO_BE16_SWAP(resp);
+	dev.result.result = CPU_TO_BE16_SWAP((UINT16)result);
+	dev.result.write_counter = CPU_TO_BE32_SWAP(dev.write_counter);
+}
+
+static RPMB_RESPONSE_RESULT process_key_write(const rpmb_data_frame *in, UINT32 in_cnt)
+{
+	if (in_cnt != 1)
+		return RPMB_RES_GENERAL_FAILURE;
+
+	if (dev.key_programmed)
+		return RPMB_RES_GENERAL_FAILURE;
+
+	memcpy(dev.key, in->key_mac, RPMB_KEY_SIZE);
+	dev.key_programmed = TRUE;
+	return RPMB_RES_OK;
+}
+
+static RPMB_RESPONSE_RESULT process_auth_write(const rpmb_data_frame *in, UINT32 in_cnt)
+{
+	UINT8 mac[RPMB_MAC_SIZE];
+	UINT16 addr, count;
+	UINT32 i;
+
+	if (!dev.key_programmed)
+		return RPMB_RES_NO_AUTH_KEY_PROGRAM;
+
+	addr = BE16_TO_CPU_SWAP(in[0].address);
+	count = BE16_TO_CPU_SWAP(in[0].block_count);
+	if (count != in_cnt)
+		return RPMB_RES_GENERAL_FAILURE;
+	if ((UINT32)addr + count > RPMB_MEMORY_BLOCKS)
+		return RPMB_RES_ADDRESS_FAILURE;
+
+	if (!calc_mac((rpmb_data_frame *)in, in_cnt, dev.key, mac) ||
+	    memcmp(mac, in[in_cnt - 1].key_mac, RPMB_MAC_SIZE))
+		return RPMB_RES_AUTH_FAILURE;
+
+	if (BE32_TO_CPU_SWAP(in[0].write_counter) != dev.write_counter)
+		return RPMB_RES_COUNTER_FAILURE;
+	if (dev.write_counter == (UINT32)-1)
+		return RPMB_RES_WRITE_COUNTER_EXPIRED;
+
+	for (i = 0; i < in_cnt; i++)
+		memcpy(dev.data + (addr + i) * RPMB_BLOCK_SIZE,
+		       in[i].data, RPMB_BLOCK_SIZE);
+	dev.write_counter++;
+	stats.blocks_written += in_cnt;
+
+	return RPMB_RES_OK;
+}
+
+static void process_counter_read(const rpmb_data_frame *in, rpmb_data_frame *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->req_resp = CPU_TO_BE16_SWAP(RPMB_RESPONSE_COUNTER_READ);
+	memcpy(out->nonce, in->nonce, RPMB_NONCE_SIZE);
+
+	if (!dev.key_programmed) {
+		out->result = CPU_TO_BE16_SWAP((UINT16)RPMB_RES_NO_AUTH_KEY_PROGRAM);
+		return;
+	}
+
+	out->write_counter = CPU_TO_BE32_SWAP(dev.write_counter);
+	calc_mac(out, 1, dev.key, out->key_mac);
+}
+
+static void process_auth_read(const rpmb_data_frame *in, rpmb_data_frame *out, UINT32 out_cnt)
+{
+	RPMB_RESPONSE_RESULT result = RPMB_RES_OK;
+	UINT16 addr;
+	UINT32 i;
+
+	addr = BE16_TO_CPU_SWAP(in->address);
+	if (!dev.key_programmed)
+		result = RPMB_RES_NO_AUTH_KEY_PROGRAM;
+	else if ((UINT32)addr + out_cnt > RPMB_MEMORY_BLOCKS)
+		result = RPMB_RES_ADDRESS_FAILURE;
+
+	memset(out, 0, sizeof(*out) * out_cnt);
+	for (i = 0; i < out_cnt; i++) {
+		out[i].req_resp = CPU_TO_BE16_SWAP(RPMB_RESPONSE_AUTH_READ);
+		out[i].result = CPU_TO_BE16_SWAP((UINT16)result);
+		out[i].address = in->address;
+		out[i].block_count = CPU_TO_BE16_SWAP((UINT16)out_cnt);
+		memcpy(out[i].nonce, in->nonce, RPMB_NONCE_SIZE);
+		if (result == RPMB_RES_OK)
+			memcpy(out[i].data, dev.data + (addr + i) * RPMB_BLOCK_SIZE,
+			       RPMB_BLOCK_SIZE);
+	}
+
+	if (result != RPMB_RES_OK)
+		return;
+
+	stats.blocks_read += out_cnt;
+	calc_mac(out, out_cnt, dev.key, out[out_cnt - 1].key_mac);
+}
+
+/* Execute a request on the device: IN_CNT frames are sent and OUT_CNT
+   frames are read back */
+static EFI_STATUS process(const rpmb_data_frame *in, UINT32 in_cnt,
+			  rpmb_data_frame *out, UINT32 out_cnt)
+{
+	UINT16 req;
+
+	if (!dev.data || !in || !in_cnt || (out_cnt && !out))
+		return EFI_INVALID_PARAMETER;
+
+	stats.requests++;
+	stats.frames += in_cnt + out_cnt;
+
+	req = BE16_TO_CPU_SWAP(in[0].req_resp);
+	switch (req) {
+	case RPMB_REQUEST_KEY_WRITE:
+		set_result(RPMB_RESPONSE_KEY_WRITE, process_key_write(in, in_cnt));
+		break;
+	case RPMB_REQUEST_AUTH_WRITE:
+		set_result(RPMB_RESPONSE_AUTH_WRITE, process_auth_write(in, in_cnt));
+		dev.result.address = in[0].address;
+		if (dev.key_programmed)
+			calc_mac(&dev.result, 1, dev.key, dev.result.key_mac);
+		break;
+	case RPMB_REQUEST_COUNTER_READ:
+		if (out_cnt != 1)
+			return EFI_INVALID_PARAMETER;
+		process_counter_read(in, out);
+		return EFI_SUCCESS;
+	case RPMB_REQUEST_AUTH_READ:
+		if (!out_cnt)
+			return EFI_INVALID_PARAMETER;
+		process_auth_read(in, out, out_cnt);
+		return EFI_SUCCESS;
+	case RPMB_REQUEST_STATUS:
+		if (out_cnt != 1)
+			return EFI_INVALID_PARAMETER;
+		memcpy(out, &dev.result, sizeof(*out));
+		return EFI_SUCCESS;
+	default:
+		error(L"Unsupported RPMB request 0x%04x", req);
+		return EFI_UNSUPPORTED;
+	}
+
+	/* Write requests: the optional output frame is the result
+	   register, read with a RPMB_REQUEST_STATUS request */
+	if (out_cnt) {
+		stats.requests++;
+		memcpy(out, &dev.result, sizeof(*out));
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Outside of a session, each request switches to the RPMB partition
+   and back, like the eMMC does */
+static void request_begin(void)
+{
+	if (!session.depth)
+		switch_partition(RPMB_PARTITION);
+}
+
+static void request_end(void)
+{
+	if (!session.depth)
+		switch_partition(USER_PARTITION);
+}
+
+static EFI_STATUS exchange(const rpmb_data_frame *in, UINT32 in_cnt,
+			   rpmb_data_frame *out, UINT32 out_cnt)
+{
+	EFI_STATUS ret;
+
+	request_begin();
+	ret = process(in, in_cnt, out, out_cnt);
+	request_end();
+
+	return ret;
+}
+
+static EFI_STATUS check_response(rpmb_data_frame *frame, UINT16 expected,
+				 RPMB_RESPONSE_RESULT *result)
+{
+	UINT16 res_result;
+
+	if (BE16_TO_CPU_SWAP(frame->req_resp) != expected) {
+		error(L"The response is not expected, expected resp = 0x%04x, received resp = 0x%04x",
+		      expected, BE16_TO_CPU_SWAP(frame->req_resp));
+		return EFI_ABORTED;
+	}
+
+	res_result = BE16_TO_CPU_SWAP(frame->result);
+	if (result)
+		*result = (RPMB_RESPONSE_RESULT)res_result;
+	if (res_result) {
+		debug(L"RPMB operation failed, result 0x%04x", res_result);
+		return EFI_ABORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/*
+ * Host side
+ */
+
+static EFI_STATUS memory_rpmb_get_protocol(void **rpmb_dev, UNUSED_PARAM EFI_HANDLE disk_handle)
+{
+	if (!rpmb_dev)
+		return EFI_INVALID_PARAMETER;
+
+	if (!dev.data) {
+		dev.data = AllocateZeroPool(RPMB_MEMORY_BLOCKS * RPMB_BLOCK_SIZE);
+		if (!dev.data)
+			return EFI_OUT_OF_RESOURCES;
+		debug(L"Memory RPMB of %d blocks", RPMB_MEMORY_BLOCKS);
+	}
+
+	*rpmb_dev = &dev;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS memory_rpmb_get_partition_num(UNUSED_PARAM void *rpmb_dev, UINT8 *current_part)
+{
+	if (!current_part)
+		return EFI_INVALID_PARAMETER;
+
+	*current_part = dev.current_part;
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS memory_rpmb_partition_switch(UNUSED_PARAM void *rpmb_dev, UINT8 part)
+{
+	switch_partition(part);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS memory_rpmb_program_key(void *rpmb_dev, const void *key,
+					  RPMB_RESPONSE_RESULT *result)
+{
+	EFI_STATUS ret;
+	rpmb_data_frame data_frame, status_frame;
+
+	if (!key || !result)
+		return EFI_INVALID_PARAMETER;
+
+	memset(&data_frame, 0, sizeof(data_frame));
+	data_frame.req_resp = CPU_TO_BE16_SWAP(RPMB_REQUEST_KEY_WRITE);
+	memcpy(data_frame.key_mac, key, RPMB_KEY_SIZE);
+
+	ret = memory_rpmb_get_protocol(&rpmb_dev, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = exchange(&data_frame, 1, &status_frame, 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return check_response(&status_frame, RPMB_RESPONSE_KEY_WRITE, result);
+}
+
+static EFI_STATUS memory_rpmb_get_counter(void *rpmb_dev, UINT32 *write_counter,
+					  const void *key, RPMB_RESPONSE_RESULT *result)
+{
+	EFI_STATUS ret;
+	rpmb_data_frame counter_frame, status_frame;
+
+	if (!write_counter || !result)
+		return EFI_INVALID_PARAMETER;
+
+	ret = memory_rpmb_get_protocol(&rpmb_dev, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memset(&counter_frame, 0, sizeof(counter_frame));
+	counter_frame.req_resp = CPU_TO_BE16_SWAP(RPMB_REQUEST_COUNTER_READ);
+	ret = generate_random_numbers((CHAR8 *)counter_frame.nonce, RPMB_NONCE_SIZE);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to generate random numbers");
+		return ret;
+	}
+
+	ret = exchange(&counter_frame, 1, &status_frame, 1);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = check_response(&status_frame, RPMB_RESPONSE_COUNTER_READ, result);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (key && !check_mac(key, &status_frame, 1)) {
+		debug(L"rpmb_check_mac failed");
+		return EFI_ABORTED;
+	}
+
+	if (memcmp(counter_frame.nonce, status_frame.nonce, RPMB_NONCE_SIZE)) {
+		debug(L"Random is not expected in out data frame");
+		return EFI_ABORTED;
+	}
+
+	*write_counter = BE32_TO_CPU_SWAP(status_frame.write_counter);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS memory_rpmb_read_data(void *rpmb_dev, UINT16 blk_count, UINT16 blk_addr,
+					void *buffer, const void *key,
+					RPMB_RESPONSE_RESULT *result)
+{
+	EFI_STATUS ret;
+	rpmb_data_frame data_in_frame;
+	rpmb_data_frame *data_out_frame;
+	UINT32 i;
+
+	if (!buffer || !result || !blk_count)
+		return EFI_INVALID_PARAMETER;
+
+	ret = memory_rpmb_get_protocol(&rpmb_dev, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	data_out_frame = AllocatePool(sizeof(*data_out_frame) * blk_count);
+	if (!data_out_frame)
+		return EFI_OUT_OF_RESOURCES;
+
+	memset(&data_in_frame, 0, sizeof(data_in_frame));
+	data_in_frame.address = CPU_TO_BE16_SWAP(blk_addr);
+	data_in_frame.req_resp = CPU_TO_BE16_SWAP(RPMB_REQUEST_AUTH_READ);
+	ret = generate_random_numbers((CHAR8 *)data_in_frame.nonce, RPMB_NONCE_SIZE);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to generate random numbers");
+		goto out;
+	}
+
+	ret = exchange(&data_in_frame, 1, data_out_frame, blk_count);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	ret = check_response(&data_out_frame[0], RPMB_RESPONSE_AUTH_READ, result);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	if (key && !check_mac(key, data_out_frame, blk_count)) {
+		debug(L"rpmb_check_mac failed");
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	if (memcmp(data_in_frame.nonce, data_out_frame[blk_count - 1].nonce, RPMB_NONCE_SIZE)) {
+		debug(L"Random is not expected in out data frame");
+		ret = EFI_ABORTED;
+		goto out;
+	}
+
+	for (i = 0; i < blk_count; i++)
+		memcpy((UINT8 *)buffer + i * RPMB_BLOCK_SIZE, data_out_frame[i].data,
+		       RPMB_BLOCK_SIZE);
+
+out:
+	FreePool(data_out_frame);
+	return ret;
+}
+
+static EFI_STATUS memory_rpmb_write_data(void *rpmb_dev, UINT16 blk_count, UINT16 blk_addr,
+					 void *buffer, const void *key,
+					 RPMB_RESPONSE_RESULT *result)
+{
+	EFI_STATUS ret;
+	UINT32 write_counter;
+	rpmb_data_frame status_frame;
+	rpmb_data_frame *data_in_frame;
+	UINT32 i;
+
+	if (!buffer || !result || !key || !blk_count)
+		return EFI_INVALID_PARAMETER;
+
+	ret = memory_rpmb_get_counter(rpmb_dev, &write_counter, key, result);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get counter");
+		return ret;
+	}
+
+	data_in_frame = AllocateZeroPool(sizeof(*data_in_frame) * blk_count);
+	if (!data_in_frame)
+		return EFI_OUT_OF_RESOURCES;
+
+	for (i = 0; i < blk_count; i++) {
+		data_in_frame[i].address = CPU_TO_BE16_SWAP(blk_addr);
+		data_in_frame[i].block_count = CPU_TO_BE16_SWAP(blk_count);
+		data_in_frame[i].req_resp = CPU_TO_BE16_SWAP(RPMB_REQUEST_AUTH_WRITE);
+		data_in_frame[i].write_counter = CPU_TO_BE32_SWAP(write_counter);
+		memcpy(data_in_frame[i].data, (UINT8 *)buffer + i * RPMB_BLOCK_SIZE,
+		       RPMB_BLOCK_SIZE);
+	}
+
+	if (!calc_mac(data_in_frame, blk_count, key, data_in_frame[blk_count - 1].key_mac)) {
+		ret = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	ret = exchange(data_in_frame, blk_count, &status_frame, 1);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	ret = check_response(&status_frame, RPMB_RESPONSE_AUTH_WRITE, result);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	if (!check_mac(key, &status_frame, 1)) {
+		debug(L"rpmb_check_mac failed");
+		ret = EFI_ABORTED;
+		goto out;
+	}
+
+	if (write_counter >= BE32_TO_CPU_SWAP(status_frame.write_counter)) {
+		error(L"RPMB write counter not incremented, returned counter is 0x%08x",
+		      BE32_TO_CPU_SWAP(status_frame.write_counter));
+		ret = EFI_ABORTED;
+	}
+
+out:
+	FreePool(data_in_frame);
+	return ret;
+}
+
+static EFI_STATUS memory_rpmb_send_request(UNUSED_PARAM void *rpmb_dev,
+					   rpmb_data_frame *data_frame, UINT8 count,
+					   UNUSED_PARAM BOOLEAN is_rel_write)
+{
+	UINT16 req;
+
+	if (!data_frame || !count)
+		return EFI_INVALID_PARAMETER;
+
+	/* The read requests are executed when their response is
+	   fetched, the number of response frames is not known yet */
+	req = BE16_TO_CPU_SWAP(data_frame->req_resp);
+	if (req == RPMB_REQUEST_AUTH_READ || req == RPMB_REQUEST_COUNTER_READ ||
+	    req == RPMB_REQUEST_STATUS) {
+		memcpy(&dev.request, data_frame, sizeof(dev.request));
+		dev.request_pending = TRUE;
+		return EFI_SUCCESS;
+	}
+
+	return exchange(data_frame, count, NULL, 0);
+}
+
+static EFI_STATUS memory_rpmb_get_response(UNUSED_PARAM void *rpmb_dev,
+					   rpmb_data_frame *data_frame, UINT8 count)
+{
+	if (!dev.request_pending)
+		return EFI_NOT_READY;
+
+	dev.request_pending = FALSE;
+	return exchange(&dev.request, 1, data_frame, count);
+}
+
+static EFI_STATUS memory_rpmb_write_frame(const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
+					  rpmb_data_frame *data_out_frame, UINT32 out_cnt,
+					  UINT16 expected)
+{
+	EFI_STATUS ret;
+
+	if (!data_in_frame || (out_cnt && !data_out_frame))
+		return EFI_INVALID_PARAMETER;
+
+	ret = exchange(data_in_frame, in_cnt, data_out_frame, out_cnt ? 1 : 0);
+	if (EFI_ERROR(ret) || !out_cnt)
+		return ret;
+
+	return check_response(data_out_frame, expected, NULL);
+}
+
+static EFI_STATUS memory_rpmb_program_key_frame(UNUSED_PARAM void *rpmb_dev,
+						const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
+						rpmb_data_frame *data_out_frame, UINT32 out_cnt)
+{
+	return memory_rpmb_write_frame(data_in_frame, in_cnt, data_out_frame, out_cnt,
+				       RPMB_RESPONSE_KEY_WRITE);
+}
+
+static EFI_STATUS memory_rpmb_write_data_frame(UNUSED_PARAM void *rpmb_dev,
+					       const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
+					       rpmb_data_frame *data_out_frame, UINT32 out_cnt)
+{
+	return memory_rpmb_write_frame(data_in_frame, in_cnt, data_out_frame, out_cnt,
+				       RPMB_RESPONSE_AUTH_WRITE);
+}
+
+static EFI_STATUS memory_rpmb_read_frame(const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
+					 rpmb_data_frame *data_out_frame, UINT32 out_cnt,
+					 UINT16 expected)
+{
+	EFI_STATUS ret;
+
+	if (!data_in_frame || !data_out_frame)
+		return EFI_INVALID_PARAMETER;
+
+	ret = exchange(data_in_frame, in_cnt, data_out_frame, out_cnt);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	return check_response(data_out_frame, expected, NULL);
+}
+
+static EFI_STATUS memory_rpmb_get_counter_frame(UNUSED_PARAM void *rpmb_dev,
+						const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
+						rpmb_data_frame *data_out_frame, UINT32 out_cnt)
+{
+	return memory_rpmb_read_frame(data_in_frame, in_cnt, data_out_frame, out_cnt,
+				      RPMB_RESPONSE_COUNTER_READ);
+}
+
+static EFI_STATUS memory_rpmb_read_data_frame(UNUSED_PARAM void *rpmb_dev,
+					      const rpmb_data_frame *data_in_frame, UINT32 in_cnt,
+					      rpmb_data_frame *data_out_frame, UINT32 out_cnt)
+{
+	return memory_rpmb_read_frame(data_in_frame, in_cnt, data_out_frame, out_cnt,
+				      RPMB_RESPONSE_AUTH_READ);
+}
+
+static EFI_STATUS memory_rpmb_session_begin(UNUSED_PARAM void *rpmb_dev)
+{
+	if (session.depth++)
+		return EFI_SUCCESS;
+
+	session.saved_part = dev.current_part;
+	switch_partition(RPMB_PARTITION);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS memory_rpmb_session_end(UNUSED_PARAM void *rpmb_dev)
+{
+	if (!session.depth)
+		return EFI_NOT_STARTED;
+
+	if (--session.depth)
+		return EFI_SUCCESS;
+
+	switch_partition(session.saved_part);
+	return EFI_SUCCESS;
+}
+
+static rpmb_ops_func_t memory_rpmb_ops = {
+	.get_storage_protocol = memory_rpmb_get_protocol,
+	.program_rpmb_key = memory_rpmb_program_key,
+	.get_storage_partition_num = memory_rpmb_get_partition_num,
+	.storage_partition_switch = memory_rpmb_partition_switch,
+	.get_rpmb_counter = memory_rpmb_get_counter,
+	.read_rpmb_data = memory_rpmb_read_data,
+	.write_rpmb_data = memory_rpmb_write_data,
+	.rpmb_send_request = memory_rpmb_send_request,
+	.rpmb_get_response = memory_rpmb_get_response,
+	.program_rpmb_key_frame = memory_rpmb_program_key_frame,
+	.get_rpmb_counter_frame = memory_rpmb_get_counter_frame,
+	.read_rpmb_data_frame = memory_rpmb_read_data_frame,
+	.write_rpmb_data_frame = memory_rpmb_write_data_frame,
+	.session_begin = memory_rpmb_session_begin,
+	.session_end = memory_rpmb_session_end
+};
+
+rpmb_ops_func_t *get_memory_storage_rpmb_ops(void)
+{
+	return &memory_rpmb_ops;
+}
+
+const struct rpmb_memory_stats *rpmb_memory_get_stats(void)
+{
+	return &stats;
+}
+
+void rpmb_memory_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void rpmb_memory_reset(void)
+{
+	if (dev.data)
+		memset(dev.data, 0, RPMB_MEMORY_BLOCKS * RPMB_BLOCK_SIZE);
+	memset(dev.key, 0, sizeof(dev.key));
+	dev.key_programmed = FALSE;
+	dev.write_counter = 0;
+	dev.request_pending = FALSE;
+	memset(&dev.result, 0, sizeof(dev.result));
+}
@@ -98,6 +98,158 @@ static UINT32 get_rollback_index_block_addr(VOID)
 		return RPMB_ROLLBACK_INDEX_BLOCK_ADDR_NATIVE;
 }
 
+/* The device state block is followed by the rollback index blocks.
+ * They are read by a single authenticated read at first use of the
+ * physical RPMB and the later reads are served from memory.  The
+ * writes update the in-memory copy and the modified blocks are
+ * written back by rpmb_storage_commit().
+ */
+#if RPMB_ROLLBACK_INDEX_BLOCK_ADDR_NATIVE != RPMB_DEVICE_STATE_BLOCK_ADDR_NATIVE + RPMB_DEVICE_STATE_BLOCK_COUNT || \
+	RPMB_ROLLBACK_INDEX_BLOCK_ADDR_VIRTUAL != RPMB_DEVICE_STATE_BLOCK_ADDR_VIRTUAL + RPMB_DEVICE_STATE_BLOCK_COUNT
+#error The rollback index blocks must follow the device state block
+#endif
+#define RPMB_CACHE_BLOCK_COUNT \
+	(RPMB_DEVICE_STATE_BLOCK_COUNT + RPMB_ROLLBACK_INDEX_BLOCK_TOTAL_COUNT)
+
+static BOOLEAN rpmb_real;
+
+static void rpmb_real_session_begin(void)
+{
+	EFI_STATUS ret;
+
+	if (!rpmb_real)
+		return;
+
+	ret = rpmb_session_begin(NULL);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to open an RPMB session");
+}
+
+static void rpmb_real_session_end(void)
+{
+	EFI_STATUS ret;
+
+	if (!rpmb_real)
+		return;
+
+	ret = rpmb_session_end(NULL);
+	if (EFI_ERROR(ret) && ret != EFI_NOT_STARTED)
+		efi_perror(ret, L"Failed to close the RPMB session");
+}
+
+static struct {
+	BOOLEAN loaded;
+	UINT16 dirty;		/* Bitmap of the modified blocks */
+	UINT8 data[RPMB_CACHE_BLOCK_COUNT * RPMB_BLOCK_SIZE];
+} rpmb_cache;
+static BOOLEAN defer_writes;
+
+static void rpmb_cache_invalidate(void)
+{
+	if (rpmb_cache.dirty)
+		error(L"Dropping the modified RPMB blocks");
+	memset(&rpmb_cache, 0, sizeof(rpmb_cache));
+}
+
+static EFI_STATUS rpmb_cache_load(void)
+{
+	EFI_STATUS ret;
+	RPMB_RESPONSE_RESULT rpmb_result;
+
+	if (rpmb_cache.loaded)
+		return EFI_SUCCESS;
+
+	ret = read_rpmb_data(NULL, RPMB_CACHE_BLOCK_COUNT, RPMB_DEVICE_STATE_BLOCK_ADDR,
+			     rpmb_cache.data, rpmb_key, &rpmb_result);
+	debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	rpmb_cache.loaded = TRUE;
+	return EFI_SUCCESS;
+}
+
+/* OFFSET is relative to the device state block */
+static EFI_STATUS rpmb_cache_read(UINTN offset, void *buffer, UINTN size)
+{
+	EFI_STATUS ret;
+
+	ret = rpmb_cache_load();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	memcpy(buffer, rpmb_cache.data + offset, size);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS rpmb_cache_write(UINTN offset, const void *buffer, UINTN size)
+{
+	EFI_STATUS ret;
+	UINTN blk;
+
+	ret = rpmb_cache_load();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!memcmp(rpmb_cache.data + offset, buffer, size))
+		return EFI_SUCCESS;
+
+	memcpy(rpmb_cache.data + offset, buffer, size);
+	for (blk = offset / RPMB_BLOCK_SIZE;
+	     blk <= (offset + size - 1) / RPMB_BLOCK_SIZE; blk++)
+		rpmb_cache.dirty |= 1 << blk;
+
+	return defer_writes ? EFI_SUCCESS : rpmb_storage_commit();
+}
+
+EFI_STATUS rpmb_storage_commit(void)
+{
+	EFI_STATUS ret;
+	RPMB_RESPONSE_RESULT rpmb_result;
+	UINT16 first, last;
+
+	if (!rpmb_cache.loaded || !rpmb_cache.dirty)
+		return EFI_SUCCESS;
+
+	ret = EFI_SUCCESS;
+	rpmb_real_session_begin();
+
+	/* Each run of modified blocks is written by a single
+	   reliable write request */
+	for (first = 0; first < RPMB_CACHE_BLOCK_COUNT; first = last) {
+		if (!(rpmb_cache.dirty & (1 << first))) {
+			last = first + 1;
+			continue;
+		}
+		for (last = first + 1; last < RPMB_CACHE_BLOCK_COUNT; last++)
+			if (!(rpmb_cache.dirty & (1 << last)))
+				break;
+
+		ret = write_rpmb_data(NULL, last - first, RPMB_DEVICE_STATE_BLOCK_ADDR + first,
+				      rpmb_cache.data + first * RPMB_BLOCK_SIZE,
+				      rpmb_key, &rpmb_result);
+		debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to write RPMB blocks %d to %d",
+				   first, last - 1);
+			/* The RPMB content is unknown, read it again next time */
+			memset(&rpmb_cache, 0, sizeof(rpmb_cache));
+			break;
+		}
+		rpmb_cache.dirty &= ~(((1 << (last - first)) - 1) << first);
+	}
+
+	rpmb_real_session_end();
+	return ret;
+}
+
+void rpmb_storage_defer_writes(BOOLEAN defer)
+{
+	if (!defer)
+		rpmb_storage_commit();
+	defer_writes = defer;
+}
+
 EFI_STATUS set_rpmb_derived_key_ex(IN VOID *kbuf, IN size_t kbuf_len, IN size_t num_key, IN int is_firmware_key)
 {
 	static int firmware_key_set = 0;
@@ -173,11 +325,15 @@ void clear_rpmb_key(void)
 	}
 
 	memset(rpmb_key, 0, RPMB_KEY_SIZE);
+	rpmb_hmac_clear_key();
+	rpmb_cache_invalidate();
 }
 
 void set_rpmb_key(UINT8 *key)
 {
 	memcpy(rpmb_key, key, RPMB_KEY_SIZE);
+	rpmb_hmac_set_key(key);
+	rpmb_cache_invalidate();
 }
 
 void get_rpmb_key(UINT8 *key)
@@ -233,6 +389,7 @@ EFI_STATUS erase_rpmb_all_blocks(void)
 	sbflags = is_eom_and_secureboot_enabled();
 
 	if (sbflags) {
+		rpmb_cache_invalidate();
 		ret = write_rpmb_data(NULL, RPMB_ALL_BLOCK_TOTAL_COUNT, 0, rpmb_buffer, rpmb_key, &rpmb_result);
 		debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
 		if (EFI_ERROR(ret)) {
@@ -317,6 +474,7 @@ static EFI_STATUS program_rpmb_key_real(UINT8 *key)
 	RPMB_RESPONSE_RESULT rpmb_result;
 
 	memcpy(rpmb_key, key, RPMB_KEY_SIZE);
+	rpmb_cache_invalidate();
 	ret = program_rpmb_key(NULL, (const void *)key, &rpmb_result);
 
 	if (EFI_ERROR(ret)) {
@@ -343,18 +501,9 @@ static EFI_STATUS rpmb_read_counter_real(const void *key, RPMB_RESPONSE_RESULT *
 static EFI_STATUS write_rpmb_device_state_real(UINT8 state)
 {
 	EFI_STATUS ret;
-	RPMB_RESPONSE_RESULT rpmb_result;
+	UINT8 data[2] = { DEVICE_STATE_MAGIC, state };
 
-	ret = read_rpmb_data(NULL, RPMB_DEVICE_STATE_BLOCK_COUNT, RPMB_DEVICE_STATE_BLOCK_ADDR, rpmb_buffer, rpmb_key, &rpmb_result);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to read device state");
-		return ret;
-	}
-
-	rpmb_buffer[0] = DEVICE_STATE_MAGIC;
-	rpmb_buffer[1] = state;
-	ret = write_rpmb_data(NULL, RPMB_DEVICE_STATE_BLOCK_COUNT, RPMB_DEVICE_STATE_BLOCK_ADDR, rpmb_buffer, rpmb_key, &rpmb_result);
-	debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
+	ret = rpmb_cache_write(0, data, sizeof(data));
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to write device state");
 		return ret;
@@ -365,47 +514,36 @@ static EFI_STATUS write_rpmb_device_state_real(UINT8 state)
 static EFI_STATUS read_rpmb_device_state_real(UINT8 *state)
 {
 	EFI_STATUS ret;
-	RPMB_RESPONSE_RESULT rpmb_result;
+	UINT8 data[2];
 
-	ret = read_rpmb_data(NULL, RPMB_DEVICE_STATE_BLOCK_COUNT, RPMB_DEVICE_STATE_BLOCK_ADDR, rpmb_buffer, rpmb_key, &rpmb_result);
-	debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
+	ret = rpmb_cache_read(0, data, sizeof(data));
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read device state");
 		return ret;
 	}
 
-	if (rpmb_buffer[0] != DEVICE_STATE_MAGIC) {
+	if (data[0] != DEVICE_STATE_MAGIC) {
 		return EFI_NOT_FOUND;
 	}
-	*state = rpmb_buffer[1];
-	debug(L"magic=%2x,state=%2x", rpmb_buffer[0], rpmb_buffer[1]);
+	*state = data[1];
+	debug(L"magic=%2x,state=%2x", data[0], data[1]);
 	return EFI_SUCCESS;
 }
 
+/* Offset of the rollback index in the RPMB cache */
+static UINTN rollback_index_offset(size_t index)
+{
+	return RPMB_DEVICE_STATE_BLOCK_COUNT * RPMB_BLOCK_SIZE + index * sizeof(UINT64);
+}
+
 static EFI_STATUS write_rpmb_rollback_index_real(size_t index, UINT64 in_rollback_index)
 {
 	EFI_STATUS ret;
-	RPMB_RESPONSE_RESULT rpmb_result;
-	UINT16 blk_addr = RPMB_ROLLBACK_INDEX_BLOCK_ADDR;
-	UINT16 blk_offset;
-
-	blk_addr += index / RPMB_ROLLBACK_INDEX_COUNT_PER_BLOCK;
-	blk_offset = (index % RPMB_ROLLBACK_INDEX_COUNT_PER_BLOCK) * sizeof(UINT64);
 
-	ret = read_rpmb_data(NULL, 1, blk_addr, rpmb_buffer, rpmb_key, &rpmb_result);
-	debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to read rollback index");
-		return ret;
-	}
-
-	if (!memcmp(&in_rollback_index, rpmb_buffer + blk_offset, sizeof(UINT64))) {
-		return EFI_SUCCESS;
-	}
+	if (index >= RPMB_ROLLBACK_INDEX_COUNT_PER_BLOCK * RPMB_ROLLBACK_INDEX_BLOCK_TOTAL_COUNT)
+		return EFI_INVALID_PARAMETER;
 
-	memcpy(rpmb_buffer + blk_offset, &in_rollback_index, sizeof(UINT64));
-	ret = write_rpmb_data(NULL, 1, blk_addr, rpmb_buffer, rpmb_key, &rpmb_result);
-	debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
+	ret = rpmb_cache_write(rollback_index_offset(index), &in_rollback_index, sizeof(UINT64));
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to write rollback index");
 		return ret;
@@ -416,19 +554,15 @@ static EFI_STATUS write_rpmb_rollback_index_real(size_t index, UINT64 in_rollbac
 static EFI_STATUS read_rpmb_rollback_index_real(size_t index, UINT64 *out_rollback_index)
 {
 	EFI_STATUS ret;
-	RPMB_RESPONSE_RESULT rpmb_result;
-	UINT16 blk_addr = RPMB_ROLLBACK_INDEX_BLOCK_ADDR;
-	UINT16 blk_offset;
 
-	blk_addr += index / RPMB_ROLLBACK_INDEX_COUNT_PER_BLOCK;
-	blk_offset = (index % RPMB_ROLLBACK_INDEX_COUNT_PER_BLOCK) * sizeof(UINT64);
-	ret = read_rpmb_data(NULL, 1, blk_addr, rpmb_buffer, rpmb_key, &rpmb_result);
-	debug(L"ret=%d, rpmb_result=%d", ret, rpmb_result);
+	if (index >= RPMB_ROLLBACK_INDEX_COUNT_PER_BLOCK * RPMB_ROLLBACK_INDEX_BLOCK_TOTAL_COUNT)
+		return EFI_INVALID_PARAMETER;
+
+	ret = rpmb_cache_read(rollback_index_offset(index), out_rollback_index, sizeof(UINT64));
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Failed to read rollback index");
 		return ret;
 	}
-	memcpy(out_rollback_index, rpmb_buffer + blk_offset, sizeof(UINT64));
 	debug(L"rollback index=%16x", *out_rollback_index);
 	return EFI_SUCCESS;
 }
@@ -703,6 +837,9 @@ EFI_STATUS rpmb_key_init(void)
 		return ret;
 	}
 
+	/* The key lookup and the cache fill share the same RPMB session */
+	rpmb_real_session_begin();
+
 	for (i = 0; i < number_derived_key; i++) {
 		memcpy(key, out_key + i * RPMB_KEY_SIZE, RPMB_KEY_SIZE);
 		dump_rpmb_key(key);
@@ -729,7 +866,7 @@ EFI_STATUS rpmb_key_init(void)
 		ret = program_rpmb_key_in_sim_real(key);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"RPMB key program failed");
-			return ret;
+			goto err_get_rpmb_key;
 		}
 	} else {
 		debug(L"RPMB already programmed");
@@ -739,7 +876,11 @@ EFI_STATUS rpmb_key_init(void)
 	// Should output this info, since there maybe some error log about some keys failed at before.
 	log(L"Init RPMB key successfully\n");
 
+	if (rpmb_real && EFI_ERROR(rpmb_cache_load()))
+		debug(L"Failed to read the RPMB device state and rollback index blocks");
+
 err_get_rpmb_key:
+	rpmb_real_session_end();
 	memset(key, 0, sizeof(key));
 
 	return ret;
@@ -778,6 +919,7 @@ EFI_STATUS rpmb_storage_init(void)
 	}
 #endif
 
+	rpmb_real = real;
 	if (real) {
 		debug(L"Use physical RPMB");
 		rpmb__sim_real_storage_ops.is_rpmb_programed = is_rpmb_programed_real;
@@ -35,11 +35,92 @@
 #include <openssl/rand.h>
 
 #include "rpmb_storage_common.h"
+#ifdef USE_IPP_SHA256
+#include "sha256_ipps.h"
+#endif
 
 /* length of the part of the frame used for HMAC computation */
 #define HMAC_DATA_LEN \
 	(sizeof(rpmb_data_frame) - offsetof(rpmb_data_frame, data))
 
+#ifdef USE_IPP_SHA256
+#define HMAC_BLOCK_SIZE		64
+
+/* SHA-256 states after the inner and outer padded key block.  The
+   RPMB key does not change during the boot: the pads are computed
+   once and each HMAC starts from these states.  */
+static struct {
+	BOOLEAN valid;
+	UINT8 key[RPMB_KEY_SIZE];
+	SHA256_IPPS_CTX inner;
+	SHA256_IPPS_CTX outer;
+} key_schedule;
+
+void rpmb_hmac_set_key(const UINT8 key[RPMB_KEY_SIZE])
+{
+	UINT8 pad[HMAC_BLOCK_SIZE];
+	UINTN i;
+
+	if (!sha256_ipps_is_supported())
+		return;
+
+	if (key_schedule.valid && !memcmp(key_schedule.key, key, RPMB_KEY_SIZE))
+		return;
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(pad, key, RPMB_KEY_SIZE);
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] ^= 0x36;
+	ippsSHA256_Init(&key_schedule.inner);
+	ippsSHA256_Update(&key_schedule.inner, pad, sizeof(pad));
+
+	for (i = 0; i < sizeof(pad); i++)
+		pad[i] ^= 0x36 ^ 0x5c;
+	ippsSHA256_Init(&key_schedule.outer);
+	ippsSHA256_Update(&key_schedule.outer, pad, sizeof(pad));
+
+	memset(pad, 0, sizeof(pad));
+	memcpy(key_schedule.key, key, RPMB_KEY_SIZE);
+	key_schedule.valid = TRUE;
+}
+
+void rpmb_hmac_clear_key(void)
+{
+	memset(&key_schedule, 0, sizeof(key_schedule));
+}
+
+static INT32 rpmb_calc_hmac_sha256_ipps(rpmb_data_frame *frames, UINT8 blocks_cnt,
+		const UINT8 key[], UINT8 mac[])
+{
+	SHA256_IPPS_CTX ctx;
+	uint32_t digest[RPMB_MAC_SIZE / sizeof(uint32_t)];
+	UINT32 i;
+
+	rpmb_hmac_set_key(key);
+
+	memcpy(&ctx, &key_schedule.inner, sizeof(ctx));
+	for (i = 0; i < blocks_cnt; i++)
+		ippsSHA256_Update(&ctx, frames[i].data, HMAC_DATA_LEN);
+	ippsSHA256_Final(&ctx, digest);
+
+	memcpy(&ctx, &key_schedule.outer, sizeof(ctx));
+	ippsSHA256_Update(&ctx, (uint8_t *)digest, sizeof(digest));
+	ippsSHA256_Final(&ctx, digest);
+
+	memcpy(mac, digest, RPMB_MAC_SIZE);
+	memset(&ctx, 0, sizeof(ctx));
+	return 1;
+}
+#else
+void rpmb_hmac_set_key(__attribute__((__unused__)) const UINT8 key[RPMB_KEY_SIZE])
+{
+}
+
+void rpmb_hmac_clear_key(void)
+{
+}
+#endif
+
 INT32 rpmb_calc_hmac_sha256(rpmb_data_frame *frames, UINT8 blocks_cnt,
 		const UINT8 key[], UINT32 key_size,
 		UINT8 mac[], UINT32 mac_size)
@@ -48,6 +129,12 @@ INT32 rpmb_calc_hmac_sha256(rpmb_data_frame *frames, UINT8 blocks_cnt,
 	INT32 ret = 1;
 	UINT32 i;
 
+#ifdef USE_IPP_SHA256
+	if (key_size == RPMB_KEY_SIZE && mac_size == RPMB_MAC_SIZE &&
+	    sha256_ipps_is_supported())
+		return rpmb_calc_hmac_sha256_ipps(frames, blocks_cnt, key, mac);
+#endif
+
 	HMAC_CTX_init(&ctx);
 	ret = HMAC_Init_ex(&ctx, key, key_size, EVP_sha256(), NULL);
 	if (ret == 0)
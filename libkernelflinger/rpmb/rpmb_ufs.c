@@ -362,7 +362,7 @@ EFI_STATUS ufs_write_rpmb_data_passthru(void *rpmb_dev, UINT16 blk_count, UINT16
 	UINT32 write_counter;
 	rpmb_data_frame status_frame;
 	rpmb_data_frame *data_in_frame = NULL;
-	UINT32 i;
+	UINT32 i, j, count;
 	UINT8 mac[RPMB_DATA_MAC];
 	EFI_EXT_SCSI_PASS_THRU_PROTOCOL *passthru = (EFI_EXT_SCSI_PASS_THRU_PROTOCOL *)rpmb_dev;
 
@@ -373,7 +373,7 @@ EFI_STATUS ufs_write_rpmb_data_passthru(void *rpmb_dev, UINT16 blk_count, UINT16
 	if (!buffer || !result || !passthru)
 		return EFI_INVALID_PARAMETER;
 
-	data_in_frame = AllocatePool(sizeof(rpmb_data_frame));
+	data_in_frame = AllocatePool(sizeof(rpmb_data_frame) * UFS_RPMB_WRITE_FRAMES);
 	if (!data_in_frame) {
 		ret = EFI_OUT_OF_RESOURCES;
 		goto out;
@@ -385,23 +385,29 @@ EFI_STATUS ufs_write_rpmb_data_passthru(void *rpmb_dev, UINT16 blk_count, UINT16
 		goto out;
 	}
 
-	for (i = 0; i < blk_count; i++) {
-		memset(data_in_frame, 0, sizeof(rpmb_data_frame));
-		data_in_frame->address = CPU_TO_BE16_SWAP(blk_addr + i);
-		data_in_frame->block_count = CPU_TO_BE16_SWAP(1);
-		data_in_frame->req_resp = CPU_TO_BE16_SWAP(RPMB_REQUEST_AUTH_WRITE);
-		data_in_frame->write_counter = CPU_TO_BE32_SWAP(write_counter);
-		memcpy(&data_in_frame->data, (UINT8 *)buffer + i * 256, 256);
+	/* Each request writes up to UFS_RPMB_WRITE_FRAMES blocks, all
+	   the frames carry the request address, block count and write
+	   counter and the last one the MAC of the whole request */
+	for (i = 0; i < blk_count; i += count) {
+		count = min((UINT32)blk_count - i, (UINT32)UFS_RPMB_WRITE_FRAMES);
+		memset(data_in_frame, 0, sizeof(rpmb_data_frame) * count);
+		for (j = 0; j < count; j++) {
+			data_in_frame[j].address = CPU_TO_BE16_SWAP(blk_addr + i);
+			data_in_frame[j].block_count = CPU_TO_BE16_SWAP(count);
+			data_in_frame[j].req_resp = CPU_TO_BE16_SWAP(RPMB_REQUEST_AUTH_WRITE);
+			data_in_frame[j].write_counter = CPU_TO_BE32_SWAP(write_counter);
+			memcpy(&data_in_frame[j].data, (UINT8 *)buffer + (i + j) * 256, 256);
+		}
 
-		if (rpmb_calc_hmac_sha256(data_in_frame, 1,
+		if (rpmb_calc_hmac_sha256(data_in_frame, count,
 				key, RPMB_KEY_SIZE,
 				mac, RPMB_MAC_SIZE) == 0) {
 			ret = EFI_INVALID_PARAMETER;
 			goto out;
 		}
 
-		memcpy(data_in_frame->key_mac, mac, RPMB_DATA_MAC);
-		ret = ufs_rpmb_send_request_passthru(rpmb_dev, data_in_frame, 1, TRUE);
+		memcpy(data_in_frame[count - 1].key_mac, mac, RPMB_DATA_MAC);
+		ret = ufs_rpmb_send_request_passthru(rpmb_dev, data_in_frame, count, TRUE);
 		if (EFI_ERROR(ret)) {
 			efi_perror(ret, L"Failed to send request to rpmb");
 			goto out;
@@ -34,6 +34,7 @@
 #include "protocol/AtaPassThru.h"
 #include "protocol/Atapi.h"
 #include "storage.h"
+#include "protocol.h"
 
 #define TRIM_SUPPORTED_BIT		0x01
 #define BIT5				0x20
@@ -301,7 +302,6 @@ static EFI_STATUS sata_erase_blocks(EFI_HANDLE handle,
 	EFI_STATUS ret;
 	EFI_GUID AtaPassThruProtocolGuid = EFI_ATA_PASS_THRU_PROTOCOL_GUID;
 	EFI_DEVICE_PATH *dp;
-	EFI_HANDLE ata_handle;
 	SATA_DEVICE_PATH *sata_dp;
 	EFI_ATA_PASS_THRU_PROTOCOL *ata;
 	UINT16 max_dsm_block_nb;
@@ -312,22 +312,14 @@ static EFI_STATUS sata_erase_blocks(EFI_HANDLE handle,
 		return EFI_INVALID_PARAMETER;
 	}
 
-	sata_dp = (SATA_DEVICE_PATH *)dp;
-	ret = uefi_call_wrapper(BS->LocateDevicePath, 3, &AtaPassThruProtocolGuid,
-				(EFI_DEVICE_PATH **)&sata_dp, &ata_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to locate ATA root device");
-		return ret;
-	}
-
 	sata_dp = get_sata_device_path(dp);
 	if (!sata_dp) {
 		error(L"Failed to get ATA device path");
 		return EFI_NOT_FOUND;
 	}
 
-	ret = uefi_call_wrapper(BS->HandleProtocol, 3, ata_handle,
-				&AtaPassThruProtocolGuid, (void *)&ata);
+	ret = device_protocol_cached(handle, &AtaPassThruProtocolGuid,
+				     (void **)&ata);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"failed to get ATA protocol");
 		return ret;
@@ -101,9 +101,9 @@ EFI_STATUS sdio_get_card_info(EFI_SD_HOST_IO_PROTOCOL *sdio,
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_LBA start,
-				   EFI_LBA end, UINTN timeout, UINT16 card_address,
-				   BOOLEAN emmc)
+EFI_STATUS sdio_erase_range(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_LBA start,
+			    EFI_LBA end, UINT32 arg, UINTN timeout,
+			    UINT16 card_address, BOOLEAN emmc)
 {
 	EFI_STATUS ret;
 	UINT32 status;
@@ -118,7 +118,7 @@ static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_LBA start,
 	}
 	if (status & STATUS_ERROR_MASK) {
 		error(L"Failed set erase group start, status=0x%08x", status);
-		return ret;
+		return EFI_DEVICE_ERROR;
 	}
 
 	ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio,
@@ -130,10 +130,10 @@ static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_LBA start,
 	}
 	if (status & STATUS_ERROR_MASK) {
 		error(L"Failed set erase group end, status=0x%08x", status);
-		return ret;
+		return EFI_DEVICE_ERROR;
 	}
 
-	ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio, ERASE, 0x80000000,
+	ret = uefi_call_wrapper(sdio->SendCommand, 9, sdio, ERASE, arg,
 				NoData, NULL, 0, ResponseR1, timeout, &status);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Erase command Failed");
@@ -141,7 +141,7 @@ static EFI_STATUS sdio_erase_group(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_LBA start,
 	}
 	if (status & STATUS_ERROR_MASK) {
 		error(L"Erase Failed, status=0x%08x", status);
-		return ret;
+		return EFI_DEVICE_ERROR;
 	}
 
 	do {
@@ -206,5 +206,6 @@ EFI_STATUS sdio_erase(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_BLOCK_IO *bio,
 		return ret;
 
 	timeout = erase_timeout * ((end + 1 - start) / erase_grp_size);
-	return sdio_erase_group(sdio, start, end, timeout, card_address, emmc);
+	return sdio_erase_range(sdio, start, end, MMC_SECURE_ERASE_ARG, timeout,
+				card_address, emmc);
 }
@@ -41,6 +41,12 @@
 
 #define SDIO_DFLT_TIMEOUT	3000
 
+/* eMMC ERASE (CMD38) arguments */
+#define MMC_ERASE_ARG		0x00000000
+#define MMC_TRIM_ARG		0x00000001
+#define MMC_DISCARD_ARG		0x00000003
+#define MMC_SECURE_ERASE_ARG	0x80000000
+
 EFI_STATUS sdio_get(EFI_DEVICE_PATH *p,
 		    EFI_HANDLE *handle,
 		    EFI_SD_HOST_IO_PROTOCOL **sdio);
@@ -48,6 +54,11 @@ EFI_STATUS sdio_get_card_info(EFI_SD_HOST_IO_PROTOCOL *sdio,
 			      EFI_HANDLE handle,
 			      CARD_TYPE *type,
 			      UINT16 *address);
+/* Send the ERASE command with ARG for the [START, END] range, without
+   any alignment adjustment.  */
+EFI_STATUS sdio_erase_range(EFI_SD_HOST_IO_PROTOCOL *sdio, UINT64 start,
+			    UINT64 end, UINT32 arg, UINTN timeout,
+			    UINT16 card_address, BOOLEAN emmc);
 EFI_STATUS sdio_erase(EFI_SD_HOST_IO_PROTOCOL *sdio, EFI_BLOCK_IO *bio,
 		      UINT64 start, UINT64 end, UINT16 card_address,
 		      UINTN erase_grp_size, UINTN erase_timeout,
@@ -200,11 +200,107 @@ static UINT64 get_signing_time(PKCS7 *p7)
         return efi_time_to_ctime(&t);
 }
 
+/* Every authenticated action request is a new PKCS7 blob signed by
+ * the same trusted certificate. The certificate matching the trusted
+ * SHA256 is kept, together with an X509 store holding it, so that the
+ * following requests neither hash every embedded certificate nor
+ * rebuild the store. The trust anchor public key, and the Montgomery
+ * context OpenSSL attaches to it on first use, survive across
+ * requests. */
+static struct {
+        unsigned char sha256[SHA256_DIGEST_LENGTH];
+        X509 *cert;
+        X509_STORE *store;
+} trusted;
+
+static void trusted_cache_drop(void)
+{
+        if (trusted.store)
+                X509_STORE_free(trusted.store);
+        if (trusted.cert)
+                X509_free(trusted.cert);
+        memset(&trusted, 0, sizeof(trusted));
+}
+
+static BOOLEAN pkcs7_has_cached_cert(PKCS7 *p7)
+{
+        STACK_OF(X509) *certs = NULL;
+        int i;
+
+        switch (OBJ_obj2nid(p7->type)) {
+        case NID_pkcs7_signed:
+                certs = p7->d.sign->cert;
+                break;
+        case NID_pkcs7_signedAndEnveloped:
+                certs = p7->d.signed_and_enveloped->cert;
+                break;
+        default:
+                break;
+        }
+
+        if (!certs)
+                return FALSE;
+
+        /* X509_cmp() compares the digests OpenSSL computed when it
+         * decoded the certificates, then their DER encodings. */
+        for (i = 0; i < sk_X509_num(certs); i++)
+                if (!X509_cmp(sk_X509_value(certs, i), trusted.cert))
+                        return TRUE;
+
+        return FALSE;
+}
+
+static X509_STORE *get_trusted_store(PKCS7 *p7, const unsigned char *cert_sha256)
+{
+        X509 *x509;
+
+        if (trusted.store &&
+            !memcmp(trusted.sha256, cert_sha256, sizeof(trusted.sha256))) {
+                if (!pkcs7_has_cached_cert(p7)) {
+                        error(L"Could not find the root certificate");
+                        return NULL;
+                }
+                return trusted.store;
+        }
+
+        trusted_cache_drop();
+
+        x509 = find_cert_in_pkcs7(p7, cert_sha256);
+        if (!x509) {
+                error(L"Could not find the root certificate");
+                return NULL;
+        }
+
+        trusted.cert = X509_dup(x509);
+        if (!trusted.cert) {
+                error(L"Failed to copy the trusted certificate");
+                goto err;
+        }
+
+        trusted.store = X509_STORE_new();
+        if (!trusted.store) {
+                error(L"Failed to create x509 store");
+                goto err;
+        }
+
+        if (X509_STORE_add_cert(trusted.store, trusted.cert) != 1) {
+                error(L"Failed to add trusted certificate to store");
+                goto err;
+        }
+
+        EVP_add_digest(EVP_sha256());
+        memcpy(trusted.sha256, cert_sha256, sizeof(trusted.sha256));
+        return trusted.store;
+
+err:
+        trusted_cache_drop();
+        return NULL;
+}
+
 EFI_STATUS verify_pkcs7(const unsigned char *cert_sha256, UINTN cert_size,
                         const VOID *pkcs7, UINTN pkcs7_size,
                         VOID **data_p, int *size)
 {
-        X509 *x509;
         PKCS7 *p7 = NULL;
         X509_STORE *store = NULL;
         BIO *p7_bio = NULL, *data_bio = NULL;
@@ -230,27 +326,13 @@ EFI_STATUS verify_pkcs7(const unsigned char *cert_sha256, UINTN cert_size,
                 goto done;
         }
 
-        x509 = find_cert_in_pkcs7(p7, cert_sha256);
-        if (!x509) {
-                error(L"Could not find the root certificate");
-                goto done;
-        }
-
         signing_time = get_signing_time(p7);
         if (!signing_time)
                 goto done;
 
-        store = X509_STORE_new();
-        if (!store) {
-                error(L"Failed to create x509 store");
-                goto done;
-        }
-
-        ret = X509_STORE_add_cert(store, x509);
-        if (ret != 1) {
-                error(L"Failed to add trusted certificate to store");
+        store = get_trusted_store(p7, cert_sha256);
+        if (!store)
                 goto done;
-        }
 
         data_bio = BIO_new(BIO_s_mem());
         if (!data_bio) {
@@ -258,7 +340,6 @@ EFI_STATUS verify_pkcs7(const unsigned char *cert_sha256, UINTN cert_size,
                 goto done;
         }
 
-        EVP_add_digest(EVP_sha256());
         X509_VERIFY_PARAM_set_time(store->param, signing_time);
         ret = PKCS7_verify(p7, NULL, store, NULL, data_bio, 0);
         if (ret != 1) {
@@ -286,8 +367,6 @@ done:
                 BIO_free(p7_bio);
         if (p7)
                 PKCS7_free(p7);
-        if (store)
-                X509_STORE_free(store);
         if (data_bio)
                 BIO_free(data_bio);
 
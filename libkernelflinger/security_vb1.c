@@ -120,6 +120,58 @@ static EFI_STATUS get_hash_buffer(UINTN nid, VOID **hash, UINTN *hashsz)
 
 
 
+/* SHA256 state of the first LEN bytes of the boot image BOOTIMAGE,
+   hashed by the loader while the image was read from the disk.  The
+   SHA256 signatures are then completed with the AuthenticatedAttributes
+   only.  */
+static struct {
+        const VOID *bootimage;
+        UINTN len;
+#ifdef USE_IPP_SHA256
+        SHA256_IPPS_CTX ctx;
+#else
+        SHA256_CTX ctx;
+#endif
+} loaded;
+
+void bootimage_hash_update(const VOID *bootimage, UINTN offset, UINTN len)
+{
+        if (offset == 0) {
+                loaded.bootimage = bootimage;
+                loaded.len = 0;
+#ifdef USE_IPP_SHA256
+                ippsSHA256_Init(&loaded.ctx);
+#else
+                SHA256_Init(&loaded.ctx);
+#endif
+        }
+
+        if (!bootimage || loaded.bootimage != bootimage ||
+            loaded.len != offset) {
+                loaded.bootimage = NULL;
+                return;
+        }
+
+#ifdef USE_IPP_SHA256
+        ippsSHA256_Update(&loaded.ctx, (uint8_t *)bootimage + offset, len);
+#else
+        SHA256_Update(&loaded.ctx, (UINT8 *)bootimage + offset, len);
+#endif
+        loaded.len += len;
+}
+
+void bootimage_hash_discard(const VOID *bootimage)
+{
+        if (loaded.bootimage == bootimage)
+                loaded.bootimage = NULL;
+}
+
+static BOOLEAN bootimage_hash_loaded(const VOID *bootimage, UINTN imgsize)
+{
+        return loaded.bootimage && loaded.bootimage == bootimage &&
+                loaded.len == imgsize;
+}
+
 static EFI_STATUS hash_bootimage(struct boot_signature *bs,
                 VOID *bootimage, UINTN imgsize, void **hash, UINTN *hashsz)
 {
@@ -130,6 +182,25 @@ static EFI_STATUS hash_bootimage(struct boot_signature *bs,
         if (EFI_ERROR(eret))
                 return eret;
 
+        if (nid == NID_sha256WithRSAEncryption &&
+            bootimage_hash_loaded(bootimage, imgsize)) {
+#ifdef USE_IPP_SHA256
+                SHA256_IPPS_CTX ctx = loaded.ctx;
+
+                ippsSHA256_Update(&ctx, (uint8_t *)bs->attributes.data,
+                                  bs->attributes.data_sz);
+                ippsSHA256_Final(&ctx, (uint32_t *)*hash);
+#else
+                SHA256_CTX sha_ctx = loaded.ctx;
+
+                SHA256_Update(&sha_ctx, bs->attributes.data,
+                              bs->attributes.data_sz);
+                SHA256_Final(*hash, &sha_ctx);
+                OPENSSL_cleanse(&sha_ctx, sizeof(sha_ctx));
+#endif
+                return EFI_SUCCESS;
+        }
+
         /* Hash the bootimage + the AuthenticatedAttributes data */
         switch (nid) {
         case NID_sha1WithRSAEncryption:
@@ -214,24 +285,20 @@ static int get_rsa_verify_nid(int nid)
 }
 
 
-static EFI_STATUS check_bootimage(CHAR8 *bootimage, UINTN imgsize,
+/* HASH is the boot image and AuthenticatedAttributes digest: it is
+   computed once for both the OEM and the embedded certificates.  */
+static EFI_STATUS check_bootimage(VOID *hash, UINTN hash_sz,
                                   struct boot_signature *sig, X509 *cert)
 {
-        VOID *hash;
-        UINTN hash_sz;
         EFI_STATUS ret;
         int rsa_ret;
         EVP_PKEY *pkey = NULL;
         RSA *rsa;
 
-        ret = hash_bootimage(sig, bootimage, imgsize, &hash, &hash_sz);
-        if (EFI_ERROR(ret))
-                return EFI_ACCESS_DENIED;
-
         ret = EFI_ACCESS_DENIED;
         pkey = get_rsa_pubkey(cert);
         if (!pkey)
-                goto free_hash;
+                return ret;
 
         rsa = EVP_PKEY_get1_RSA(pkey);
         if (!rsa)
@@ -247,8 +314,6 @@ static EFI_STATUS check_bootimage(CHAR8 *bootimage, UINTN imgsize,
 
 free_pkey:
         EVP_PKEY_free(pkey);
-free_hash:
-        FreePool(hash);
         return ret;
 }
 
@@ -368,6 +433,8 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
         UINT8 verify_state = BOOT_STATE_RED;
         CHAR16 *target_tmp;
         EVP_PKEY *oemkey = NULL;
+        VOID *hash = NULL;
+        UINTN hash_sz;
         EFI_STATUS ret;
 
         if (!bootimage || !der_cert || !target)
@@ -399,7 +466,15 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
         }
 
         debug(L"verifying boot image");
-        ret = check_bootimage(bootimage, imgsize, sig, cert);
+        ret = hash_bootimage(sig, bootimage, imgsize, &hash, &hash_sz);
+        /* The loader state is only good for one verification */
+        bootimage_hash_discard(bootimage);
+        if (EFI_ERROR(ret)) {
+                debug(L"Failed to hash the boot image");
+                goto done;
+        }
+
+        ret = check_bootimage(hash, hash_sz, sig, cert);
         if (!EFI_ERROR(ret)) {
                 verify_state = BOOT_STATE_GREEN;
                 if (verifier_cert)
@@ -413,7 +488,7 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
         }
 
         debug(L"Bootimage does not verify against the OEM key, trying included certificate");
-        ret = check_bootimage(bootimage, imgsize, sig, sig->certificate);
+        ret = check_bootimage(hash, hash_sz, sig, sig->certificate);
         if (EFI_ERROR(ret))
                 goto done;
 
@@ -431,6 +506,8 @@ UINT8 verify_android_boot_image(IN VOID *bootimage, IN VOID *der_cert,
         verify_state = BOOT_STATE_GREEN;
 
 done:
+        if (hash)
+                FreePool(hash);
         if (oemkey)
                 EVP_PKEY_free(oemkey);
         X509_free(cert);
@@ -30,6 +30,7 @@
 
 #include <stdint.h>
 #include <immintrin.h>
+#include <lib.h>
 
 #include "sha256_ipps.h"
 
@@ -253,6 +254,23 @@ static void sha256_update(uint32_t *digest, uint8_t *data, uint32_t num_blks)
 }
 
 
+BOOLEAN sha256_ipps_is_supported(void)
+{
+	static enum { UNKNOWN, NO, YES } sha_ni = UNKNOWN;
+	UINT32 reg[4], ext[4] = { 0 };
+
+	if (sha_ni == UNKNOWN) {
+		cpuid(0, reg);
+		if (reg[0] >= 7)
+			cpuid_count(7, 0, ext);
+		cpuid(1, reg);
+		/* EBX bit 29: SHA, ECX bit 19: SSE4.1 */
+		sha_ni = (ext[1] & (1 << 29)) && (reg[2] & (1 << 19)) ? YES : NO;
+	}
+
+	return sha_ni == YES;
+}
+
 void ippsSHA256_Init(SHA256_IPPS_CTX *ctx)
 {
 	ctx->len = 0;
@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+#include <immintrin.h>
+#include <openssl/sha.h>
+
+#include "lib.h"
+#include "sha256_mb.h"
+#ifdef USE_IPP_SHA256
+#include "sha256_ipps.h"
+#endif
+
+#define TARGET_AVX2	__attribute__((target("avx2")))
+#define TARGET_AVX512	__attribute__((target("avx512f")))
+
+#define CPUID_1_ECX_OSXSAVE	(1 << 27)
+#define CPUID_1_ECX_AVX		(1 << 28)
+#define CPUID_7_EBX_AVX2	(1 << 5)
+#define CPUID_7_EBX_AVX512F	(1 << 16)
+#define XCR0_AVX		0x06	/* SSE and AVX state */
+#define XCR0_AVX512		0xe6	/* and opmask, ZMM0-15 and ZMM16-31 */
+
+static const UINT32 K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const UINT32 H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static struct {
+	BOOLEAN probed;
+	BOOLEAN avx2;
+	BOOLEAN avx512;
+} cpu;
+
+static void cpu_probe(void)
+{
+	UINT32 reg[4], ext[4] = { 0 };
+
+	if (cpu.probed)
+		return;
+
+	cpuid(0, reg);
+	if (reg[0] >= 7)
+		cpuid_count(7, 0, ext);
+	cpuid(1, reg);
+
+	cpu.avx2 = (reg[2] & CPUID_1_ECX_OSXSAVE) && (reg[2] & CPUID_1_ECX_AVX) &&
+		(ext[1] & CPUID_7_EBX_AVX2);
+	cpu.avx512 = cpu.avx2 && (ext[1] & CPUID_7_EBX_AVX512F);
+	cpu.probed = TRUE;
+}
+
+UINTN sha256_mb_lanes(void)
+{
+	UINT32 xcr0_lo, xcr0_hi;
+
+	cpu_probe();
+	if (!cpu.avx2)
+		return 0;
+
+	/* The firmware must have enabled the AVX state on the running
+	   processor, which may be an AP.  */
+	asm volatile("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+	if (cpu.avx512 && (xcr0_lo & XCR0_AVX512) == XCR0_AVX512)
+		return 16;
+	if ((xcr0_lo & XCR0_AVX) == XCR0_AVX)
+		return 8;
+	return 0;
+}
+
+static inline UINT32 get_be32(const UINT8 *p)
+{
+	return (UINT32)p[0] << 24 | (UINT32)p[1] << 16 | (UINT32)p[2] << 8 | p[3];
+}
+
+static inline void put_be32(UINT8 *p, UINT32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+#define ROR256(x, n)	_mm256_or_si256(_mm256_srli_epi32(x, n),	\
+					_mm256_slli_epi32(x, 32 - (n)))
+#define XOR256(x, y, z)	_mm256_xor_si256(_mm256_xor_si256(x, y), z)
+
+/* One block of the first 8 lanes */
+static TARGET_AVX2 void sha256_mb_block_avx2(struct sha256_mb_mgr *mgr)
+{
+	__m256i a, b, c, d, e, f, g, h, t1, t2, s0, s1;
+	__m256i w[16];
+	UINTN i;
+
+	a = _mm256_load_si256((__m256i *)mgr->state[0]);
+	b = _mm256_load_si256((__m256i *)mgr->state[1]);
+	c = _mm256_load_si256((__m256i *)mgr->state[2]);
+	d = _mm256_load_si256((__m256i *)mgr->state[3]);
+	e = _mm256_load_si256((__m256i *)mgr->state[4]);
+	f = _mm256_load_si256((__m256i *)mgr->state[5]);
+	g = _mm256_load_si256((__m256i *)mgr->state[6]);
+	h = _mm256_load_si256((__m256i *)mgr->state[7]);
+
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			w[i] = _mm256_load_si256((__m256i *)mgr->block[i]);
+		} else {
+			s0 = w[(i - 15) & 15];
+			s0 = XOR256(ROR256(s0, 7), ROR256(s0, 18), _mm256_srli_epi32(s0, 3));
+			s1 = w[(i - 2) & 15];
+			s1 = XOR256(ROR256(s1, 17), ROR256(s1, 19), _mm256_srli_epi32(s1, 10));
+			w[i & 15] = _mm256_add_epi32(_mm256_add_epi32(w[i & 15], s0),
+						     _mm256_add_epi32(w[(i - 7) & 15], s1));
+		}
+
+		t1 = _mm256_add_epi32(h, XOR256(ROR256(e, 6), ROR256(e, 11), ROR256(e, 25)));
+		t1 = _mm256_add_epi32(t1, _mm256_xor_si256(_mm256_and_si256(e, f),
+							   _mm256_andnot_si256(e, g)));
+		t1 = _mm256_add_epi32(t1, _mm256_add_epi32(_mm256_set1_epi32(K[i]), w[i & 15]));
+		t2 = _mm256_add_epi32(XOR256(ROR256(a, 2), ROR256(a, 13), ROR256(a, 22)),
+				      _mm256_or_si256(_mm256_and_si256(a, _mm256_or_si256(b, c)),
+						      _mm256_and_si256(b, c)));
+		h = g;
+		g = f;
+		f = e;
+		e = _mm256_add_epi32(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm256_add_epi32(t1, t2);
+	}
+
+#define STORE256(i, x)							\
+	_mm256_store_si256((__m256i *)mgr->state[i],			\
+			   _mm256_add_epi32(x, _mm256_load_si256((__m256i *)mgr->state[i])))
+	STORE256(0, a);
+	STORE256(1, b);
+	STORE256(2, c);
+	STORE256(3, d);
+	STORE256(4, e);
+	STORE256(5, f);
+	STORE256(6, g);
+	STORE256(7, h);
+#undef STORE256
+}
+
+#define XOR512(x, y, z)	_mm512_xor_si512(_mm512_xor_si512(x, y), z)
+
+/* One block of the 16 lanes */
+static TARGET_AVX512 void sha256_mb_block_avx512(struct sha256_mb_mgr *mgr)
+{
+	__m512i a, b, c, d, e, f, g, h, t1, t2, s0, s1;
+	__m512i w[16];
+	UINTN i;
+
+	a = _mm512_load_si512(mgr->state[0]);
+	b = _mm512_load_si512(mgr->state[1]);
+	c = _mm512_load_si512(mgr->state[2]);
+	d = _mm512_load_si512(mgr->state[3]);
+	e = _mm512_load_si512(mgr->state[4]);
+	f = _mm512_load_si512(mgr->state[5]);
+	g = _mm512_load_si512(mgr->state[6]);
+	h = _mm512_load_si512(mgr->state[7]);
+
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			w[i] = _mm512_load_si512(mgr->block[i]);
+		} else {
+			s0 = w[(i - 15) & 15];
+			s0 = XOR512(_mm512_ror_epi32(s0, 7), _mm512_ror_epi32(s0, 18),
+				    _mm512_srli_epi32(s0, 3));
+			s1 = w[(i - 2) & 15];
+			s1 = XOR512(_mm512_ror_epi32(s1, 17), _mm512_ror_epi32(s1, 19),
+				    _mm512_srli_epi32(s1, 10));
+			w[i & 15] = _mm512_add_epi32(_mm512_add_epi32(w[i & 15], s0),
+						     _mm512_add_epi32(w[(i - 7) & 15], s1));
+		}
+
+		/* Ch and Maj as ternary logic functions of (e, f, g) and (a, b, c) */
+		t1 = _mm512_add_epi32(h, XOR512(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11),
+						_mm512_ror_epi32(e, 25)));
+		t1 = _mm512_add_epi32(t1, _mm512_ternarylogic_epi32(e, f, g, 0xca));
+		t1 = _mm512_add_epi32(t1, _mm512_add_epi32(_mm512_set1_epi32(K[i]), w[i & 15]));
+		t2 = _mm512_add_epi32(XOR512(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13),
+					     _mm512_ror_epi32(a, 22)),
+				      _mm512_ternarylogic_epi32(a, b, c, 0xe8));
+		h = g;
+		g = f;
+		f = e;
+		e = _mm512_add_epi32(d, t1);
+		d = c;
+		c = b;
+		b = a;
+		a = _mm512_add_epi32(t1, t2);
+	}
+
+#define STORE512(i, x)							\
+	_mm512_store_si512(mgr->state[i],				\
+			   _mm512_add_epi32(x, _mm512_load_si512(mgr->state[i])))
+	STORE512(0, a);
+	STORE512(1, b);
+	STORE512(2, c);
+	STORE512(3, d);
+	STORE512(4, e);
+	STORE512(5, f);
+	STORE512(6, g);
+	STORE512(7, h);
+#undef STORE512
+}
+
+/* Load the current block of the message of lane L, padding
+   included, in the transposed block buffer.  */
+static void lane_load(struct sha256_mb_mgr *mgr, UINTN l)
+{
+	struct sha256_mb_lane *lane = &mgr->lane[l];
+	struct sha256_mb_job *job = lane->job;
+	UINT64 total = job->prefix_len + job->len;
+	UINT64 pos = lane->block * SHA256_MB_BLOCK_SIZE;
+	UINT8 buf[SHA256_MB_BLOCK_SIZE];
+	const UINT8 *p = buf;
+	UINTN i, n = 0, count;
+
+	if (pos >= job->prefix_len && pos + SHA256_MB_BLOCK_SIZE <= total) {
+		p = job->data + (pos - job->prefix_len);
+		goto load;
+	}
+
+	if (pos < job->prefix_len) {
+		n = min(job->prefix_len - pos, (UINT64)SHA256_MB_BLOCK_SIZE);
+		memcpy(buf, job->prefix + pos, n);
+	}
+	if (n < SHA256_MB_BLOCK_SIZE && pos + n < total) {
+		count = min(total - pos - n, (UINT64)(SHA256_MB_BLOCK_SIZE - n));
+		memcpy(buf + n, job->data + (pos + n - job->prefix_len), count);
+		n += count;
+	}
+	if (n < SHA256_MB_BLOCK_SIZE)
+		memset(buf + n, 0, SHA256_MB_BLOCK_SIZE - n);
+	if (total >= pos && total - pos < SHA256_MB_BLOCK_SIZE)
+		buf[total - pos] = 0x80;
+	if (lane->block == lane->nb_blocks - 1) {
+		put_be32(buf + 56, (UINT32)(total >> 29));
+		put_be32(buf + 60, (UINT32)(total << 3));
+	}
+
+load:
+	for (i = 0; i < 16; i++)
+		mgr->block[i][l] = get_be32(p + i * 4);
+}
+
+/* Hash one block of all the busy lanes and move the completed jobs
+   to the done list.  */
+static void sha256_mb_step(struct sha256_mb_mgr *mgr)
+{
+	struct sha256_mb_lane *lane;
+	UINTN l, i;
+
+	for (l = 0; l < mgr->nb_lanes; l++)
+		if (mgr->lane[l].job)
+			lane_load(mgr, l);
+
+	if (mgr->nb_lanes == 16)
+		sha256_mb_block_avx512(mgr);
+	else
+		sha256_mb_block_avx2(mgr);
+
+	for (l = 0; l < mgr->nb_lanes; l++) {
+		lane = &mgr->lane[l];
+		if (!lane->job || ++lane->block < lane->nb_blocks)
+			continue;
+
+		for (i = 0; i < 8; i++)
+			put_be32(lane->job->digest + i * 4, mgr->state[i][l]);
+		mgr->done[mgr->nb_done++] = lane->job;
+		lane->job = NULL;
+		mgr->busy--;
+	}
+}
+
+static struct sha256_mb_job *pop_done(struct sha256_mb_mgr *mgr)
+{
+	if (!mgr->nb_done)
+		return NULL;
+	return mgr->done[--mgr->nb_done];
+}
+
+static void sha256_one(struct sha256_mb_job *job)
+{
+	SHA256_CTX sha;
+
+#ifdef USE_IPP_SHA256
+	if (sha256_ipps_is_supported()) {
+		SHA256_IPPS_CTX ipps;
+		const UINT8 *data = job->data;
+		UINTN len, chunk;
+
+		ippsSHA256_Init(&ipps);
+		if (job->prefix_len)
+			ippsSHA256_Update(&ipps, (uint8_t *)job->prefix, job->prefix_len);
+		for (len = job->len; len; len -= chunk, data += chunk) {
+			chunk = min(len, (UINTN)1024 * 1024 * 1024);
+			ippsSHA256_Update(&ipps, (uint8_t *)data, chunk);
+		}
+		ippsSHA256_Final(&ipps, (uint32_t *)job->digest);
+		return;
+	}
+#endif
+
+	SHA256_Init(&sha);
+	if (job->prefix_len)
+		SHA256_Update(&sha, job->prefix, job->prefix_len);
+	SHA256_Update(&sha, job->data, job->len);
+	SHA256_Final(job->digest, &sha);
+}
+
+void sha256_mb_init(struct sha256_mb_mgr *mgr)
+{
+	memset(mgr, 0, sizeof(*mgr));
+	mgr->nb_lanes = sha256_mb_lanes();
+#ifdef USE_IPP_SHA256
+	/* The SHA extensions hash one stream faster than 8 AVX2 lanes */
+	if (mgr->nb_lanes == 8 && sha256_ipps_is_supported())
+		mgr->nb_lanes = 0;
+#endif
+}
+
+struct sha256_mb_job *sha256_mb_submit(struct sha256_mb_mgr *mgr,
+				       struct sha256_mb_job *job)
+{
+	struct sha256_mb_lane *lane;
+	UINTN l, i;
+
+	if (!mgr->nb_lanes) {
+		sha256_one(job);
+		return job;
+	}
+
+	/* There always is a free lane: the manager steps as soon as
+	   all of them are busy.  */
+	for (l = 0; mgr->lane[l].job; l++)
+		;
+
+	lane = &mgr->lane[l];
+	lane->job = job;
+	lane->block = 0;
+	lane->nb_blocks = (job->prefix_len + job->len + 8) / SHA256_MB_BLOCK_SIZE + 1;
+	for (i = 0; i < 8; i++)
+		mgr->state[i][l] = H0[i];
+	mgr->busy++;
+
+	while (mgr->busy == mgr->nb_lanes)
+		sha256_mb_step(mgr);
+
+	return pop_done(mgr);
+}
+
+struct sha256_mb_job *sha256_mb_flush(struct sha256_mb_mgr *mgr)
+{
+	while (!mgr->nb_done && mgr->busy)
+		sha256_mb_step(mgr);
+
+	return pop_done(mgr);
+}
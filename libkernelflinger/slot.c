@@ -35,7 +35,10 @@
 #include <gpt.h>
 #include <android.h>
 #include <slot.h>
+#include <slot_parts.h>
 #include <endian.h>
+#include <crc32.h>
+#include <misc.h>
 
 /* Constants.  */
 const CHAR16 *SLOT_STORAGE_PART = MISC_LABEL;
@@ -63,70 +66,32 @@ static char *cur_suffix;	/* Point to one of the suffixes, or
 static boot_ctrl_t boot_ctrl;
 static slot_metadata_t *slots = boot_ctrl.slot_info;
 
-static const CHAR16 *label_with_suffix(const CHAR16 *label, const char *suffix)
-{
-	static CHAR16 res_label[MAX_LABEL_LEN];
-	UINTN label_len, i, j;
-
-	label_len = StrLen(label);
-
-	res_label[0] = '\0';
-	if ((label_len + SUFFIX_LEN + 1) * sizeof(CHAR16) > sizeof(res_label)) {
-		error(L"Not enough space to build the actual label");
-		return res_label;
-	}
-
-	memcpy(res_label, label, label_len * sizeof(*label));
-	for (i = label_len, j = 0; j < SUFFIX_LEN; i++, j++)
-		res_label[i] = suffix[j];
-	res_label[label_len + SUFFIX_LEN] = '\0';
-
-	return res_label;
-}
-
 static UINTN get_part_nb_slot(const CHAR16 *label)
 {
-	EFI_STATUS ret;
-	UINTN i;
-	const CHAR16 *new_label;
-	struct gpt_partition_interface gparti;
-
-	for (i = 0; i < MAX_NB_SLOT; i++) {
-		new_label = label_with_suffix(label, suffixes[i]);
-		if (!new_label) {
-			error(L"Failed to create %s label with suffix", label);
-			return 0;
-		}
-
-		ret = gpt_get_partition_by_label(new_label, &gparti, LOGICAL_UNIT_USER);
-		if (ret == EFI_NOT_FOUND)
-			return i;
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to lookup for %s partition");
-			return 0;
-		}
-	}
+	const struct slot_part *part;
 
-	return i;
+	part = slot_part_lookup(label);
+	return part ? min(part->nb_slot, (UINTN)MAX_NB_SLOT) : 0;
 }
 
+/* The slot metadata lives in SLOT_STORAGE_PART, the misc partition,
+   along with the BCB.  Its updates are never deferred: a retry count
+   decrement must reach the disk before the boot attempt.  */
 static inline EFI_STATUS sync_boot_ctrl(BOOLEAN out)
 {
 	EFI_STATUS ret;
-	struct gpt_partition_interface gparti;
 	UINT64 offset;
 
-	ret = gpt_get_partition_by_label(SLOT_STORAGE_PART, &gparti, LOGICAL_UNIT_USER);
+	offset = offsetof(struct bootloader_message_ab, slot_suffix);
+
+	if (out)
+		return misc_read(offset, sizeof(boot_ctrl), &boot_ctrl);
+
+	ret = misc_write(offset, sizeof(boot_ctrl), &boot_ctrl);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	offset = gparti.part.starting_lba * gparti.bio->Media->BlockSize +
-		offsetof(struct bootloader_message_ab, slot_suffix);
-
-	return uefi_call_wrapper((out ? gparti.dio->ReadDisk : gparti.dio->WriteDisk),
-				 5, gparti.dio,
-				 gparti.bio->Media->MediaId,
-				 offset, sizeof(boot_ctrl), &boot_ctrl);
+	return misc_commit();
 }
 
 static EFI_STATUS read_boot_ctrl(void)
@@ -136,15 +101,9 @@ static EFI_STATUS read_boot_ctrl(void)
 
 static EFI_STATUS slot_crc32(UINT32 *crc32)
 {
-	EFI_STATUS ret;
-
-	ret = uefi_call_wrapper(BS->CalculateCrc32, 3, &boot_ctrl,
-				offsetof(struct bootloader_control, crc32_le),
-				crc32);
-	if (EFI_ERROR(ret))
-		efi_perror(ret, L"CalculateCrc32 boot service failed");
-
-	return ret;
+	*crc32 = crc32_update(0, &boot_ctrl,
+			      offsetof(struct bootloader_control, crc32_le));
+	return EFI_SUCCESS;
 }
 
 static EFI_STATUS write_boot_ctrl(void)
@@ -302,9 +261,7 @@ BOOLEAN use_slot(void)
 
 const CHAR16 *slot_label(const CHAR16 *base)
 {
-	EFI_STATUS ret;
-	const CHAR16 *label;
-	struct gpt_partition_interface gparti;
+	const struct slot_part *part;
 
 	if (!use_slot())
 		return base;
@@ -312,12 +269,11 @@ const CHAR16 *slot_label(const CHAR16 *base)
 	if (!base || !cur_suffix)
 		return NULL;
 
-	label = label_with_suffix(base, cur_suffix);
-	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
-	if (EFI_ERROR(ret))
+	part = slot_part_lookup(base);
+	if (!part || !part->labels[SUFFIX_INDEX(cur_suffix)][0])
 		return base;
 
-	return label;
+	return part->labels[SUFFIX_INDEX(cur_suffix)];
 }
 
 const CHAR16 *slot_base(const CHAR16 *label)
@@ -325,6 +281,7 @@ const CHAR16 *slot_base(const CHAR16 *label)
 	static CHAR16 res_base[MAX_LABEL_LEN];
 	UINTN label_len, base_len;
 	char suffix[SUFFIX_LEN + 1];
+	const struct slot_part *part;
 
 	if (!use_slot() || !label)
 		return label;
@@ -338,6 +295,10 @@ const CHAR16 *slot_base(const CHAR16 *label)
 	if (!is_suffix(suffix))
 		return NULL;
 
+	part = slot_part_lookup_label(label);
+	if (part)
+		return part->base;
+
 	base_len = label_len - SUFFIX_LEN;
 	memcpy(res_base, label, base_len * sizeof(CHAR16));
 	res_base[base_len] = '\0';
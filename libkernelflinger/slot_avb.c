@@ -36,6 +36,7 @@
 #include <gpt.h>
 #include <android.h>
 #include <slot.h>
+#include <slot_parts.h>
 #include <endian.h>
 #include <libavb_ab.h>
 #include <uefi_avb_ops.h>
@@ -91,28 +92,10 @@ static const CHAR16 *label_with_suffix(const CHAR16 *label, const char *suffix)
 
 UINTN get_part_nb_slot(const CHAR16 *label)
 {
-	EFI_STATUS ret;
-	UINTN i;
-	const CHAR16 *new_label;
-	struct gpt_partition_interface gparti;
+	const struct slot_part *part;
 
-	for (i = 0; i < MAX_NB_SLOT; i++) {
-		new_label = label_with_suffix(label, suffixes[i]);
-		if (!new_label) {
-			error(L"Failed to create %s label with suffix", label);
-			return 0;
-		}
-
-		ret = gpt_get_partition_by_label(new_label, &gparti, LOGICAL_UNIT_USER);
-		if (ret == EFI_NOT_FOUND)
-			return i;
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to lookup for %s partition");
-			return 0;
-		}
-	}
-
-	return i;
+	part = slot_part_lookup(label);
+	return part ? min(part->nb_slot, (UINTN)MAX_NB_SLOT) : 0;
 }
 
 static inline EFI_STATUS sync_boot_ctrl(BOOLEAN out)
@@ -286,8 +269,8 @@ BOOLEAN use_slot(void)
 
 const CHAR16 *slot_label(const CHAR16 *base)
 {
-	const CHAR16 *label;
-	UINTN nb_slot;
+	const struct slot_part *part;
+	const char *active;
 
 	if (!use_slot())
 		return base;
@@ -295,20 +278,22 @@ const CHAR16 *slot_label(const CHAR16 *base)
 	if (!base)
 		return NULL;
 
-	nb_slot = get_part_nb_slot(base);
-	if (!nb_slot) {
+	part = slot_part_lookup(base);
+	if (!part || !part->nb_slot) {
 		/*
 		 * Current partition scheme does not have slots.
 		 */
 		return base;
 	}
 
-	if (!base || !slot_get_active())
+	active = slot_get_active();
+	if (!active)
 		return NULL;
 
-	label = label_with_suffix(base, slot_get_active());
+	if (part->labels[SUFFIX_INDEX(active)][0])
+		return part->labels[SUFFIX_INDEX(active)];
 
-	return label;
+	return label_with_suffix(base, active);
 }
 
 const CHAR16 *slot_base(const CHAR16 *label)
@@ -316,6 +301,7 @@ const CHAR16 *slot_base(const CHAR16 *label)
 	static CHAR16 res_base[MAX_LABEL_LEN];
 	UINTN label_len, base_len;
 	char suffix[SUFFIX_LEN + 1];
+	const struct slot_part *part;
 
 	if (!use_slot() || !label)
 		return label;
@@ -329,6 +315,10 @@ const CHAR16 *slot_base(const CHAR16 *label)
 	if (!is_suffix(suffix))
 		return NULL;
 
+	part = slot_part_lookup_label(label);
+	if (part)
+		return part->base;
+
 	base_len = label_len - SUFFIX_LEN;
 	memcpy(res_base, label, base_len * sizeof(CHAR16));
 	res_base[base_len] = '\0';
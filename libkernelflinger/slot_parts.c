@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "gpt.h"
+#include "slot_parts.h"
+
+/* Size of the base name hash index, a power of two larger than the
+   number of partitions so that it never fills up.  */
+#define SLOT_PARTS_INDEX_SIZE	(2 * GPT_ENTRIES)
+
+static struct slot_part *parts;
+static UINTN nb_parts;
+static UINT8 parts_index[SLOT_PARTS_INDEX_SIZE];
+static BOOLEAN built;
+static UINT32 parts_generation;
+
+static UINTN hash_name(const CHAR16 *name, UINTN len)
+{
+	UINT32 h = 2166136261U;
+	UINTN i;
+
+	for (i = 0; i < len; i++) {
+		h ^= name[i];
+		h *= 16777619U;
+	}
+
+	return h & (SLOT_PARTS_INDEX_SIZE - 1);
+}
+
+/* Return the entry of the LEN first characters of BASE, or the free
+   index slot where it belongs in *SLOT_P.  */
+static struct slot_part *find_part(const CHAR16 *base, UINTN len,
+				   UINTN *slot_p)
+{
+	struct slot_part *part;
+	UINTN slot;
+
+	for (slot = hash_name(base, len); parts_index[slot];
+	     slot = (slot + 1) & (SLOT_PARTS_INDEX_SIZE - 1)) {
+		part = &parts[parts_index[slot] - 1];
+		if (!memcmp(part->base, base, len * sizeof(*base)) &&
+		    !part->base[len])
+			return part;
+	}
+
+	if (slot_p)
+		*slot_p = slot;
+	return NULL;
+}
+
+/* The slot index of LABEL, if it has a slot suffix */
+static BOOLEAN slot_suffix(const CHAR16 *label, UINTN len, UINTN *slot)
+{
+	if (len < 3 || len >= GPT_NAME_LEN || label[len - 2] != '_' ||
+	    label[len - 1] < 'a' || label[len - 1] >= 'a' + SLOT_PARTS_MAX_SLOT)
+		return FALSE;
+
+	*slot = label[len - 1] - 'a';
+	return TRUE;
+}
+
+static void add_part(const CHAR16 *label)
+{
+	struct slot_part *part;
+	UINTN len, slot, s;
+
+	len = StrLen(label);
+	if (!slot_suffix(label, len, &s))
+		return;
+
+	part = find_part(label, len - 2, &slot);
+	if (!part) {
+		part = &parts[nb_parts++];
+		ZeroMem(part, sizeof(*part));
+		memcpy(part->base, label, (len - 2) * sizeof(*label));
+		parts_index[slot] = nb_parts;
+	}
+
+	/* Keep the first partition like gpt_get_partition_by_label() */
+	if (!part->labels[s][0])
+		memcpy(part->labels[s], label, (len + 1) * sizeof(*label));
+}
+
+static void build_parts(void)
+{
+	EFI_STATUS ret;
+	struct gpt_partition_interface *gparts = NULL;
+	UINTN nb_gparts = 0, i, s;
+
+	if (parts)
+		FreePool(parts);
+	parts = NULL;
+	nb_parts = 0;
+	memset(parts_index, 0, sizeof(parts_index));
+	built = TRUE;
+
+	ret = gpt_list_partition(&gparts, &nb_gparts, LOGICAL_UNIT_USER);
+	parts_generation = gpt_cache_generation();
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to list the slot partitions");
+		return;
+	}
+	if (!nb_gparts)
+		return;
+
+	parts = AllocatePool(nb_gparts * sizeof(*parts));
+	if (!parts) {
+		error(L"Failed to allocate the slot partition table");
+		goto out;
+	}
+
+	for (i = 0; i < nb_gparts; i++)
+		add_part(gparts[i].part.name);
+
+	for (i = 0; i < nb_parts; i++) {
+		for (s = 0; s < SLOT_PARTS_MAX_SLOT && parts[i].labels[s][0]; s++)
+			;
+		parts[i].nb_slot = s;
+	}
+
+out:
+	FreePool(gparts);
+}
+
+static BOOLEAN parts_ready(void)
+{
+	if (!built || parts_generation != gpt_cache_generation())
+		build_parts();
+
+	return parts != NULL;
+}
+
+const struct slot_part *slot_part_lookup(const CHAR16 *base)
+{
+	struct slot_part *part;
+
+	if (!base || !parts_ready())
+		return NULL;
+
+	part = find_part(base, StrLen(base), NULL);
+	return part;
+}
+
+const struct slot_part *slot_part_lookup_label(const CHAR16 *label)
+{
+	struct slot_part *part;
+	UINTN len, s;
+
+	if (!label || !parts_ready())
+		return NULL;
+
+	len = StrLen(label);
+	if (!slot_suffix(label, len, &s))
+		return NULL;
+
+	part = find_part(label, len - 2, NULL);
+	if (!part || !part->labels[s][0])
+		return NULL;
+
+	return part;
+}
@@ -32,6 +32,7 @@
 
 #include <efi.h>
 #include <efilib.h>
+#include <lib.h>
 
 #include "smbios.h"
 
@@ -41,29 +42,122 @@ char *SMBIOS_UNDEFINED = "N/A";
 /* Allow cast to pointer from integer of different size.  */
 #pragma GCC diagnostic ignored "-Wint-to-pointer-cast"
 
-char *smbios_get_string(UINT8 type, UINT8 offset)
+#define SMBIOS3_TABLE_GUID \
+	{ 0xf2fd1544, 0x9794, 0x4a2c, { 0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94 } }
+
+/* SMBIOS 3.0 64-bit entry point */
+typedef struct {
+	UINT8 AnchorString[5];
+	UINT8 EntryPointStructureChecksum;
+	UINT8 EntryPointLength;
+	UINT8 MajorVersion;
+	UINT8 MinorVersion;
+	UINT8 DocRev;
+	UINT8 EntryPointRevision;
+	UINT8 Reserved;
+	UINT32 TableMaximumSize;
+	UINT64 TableAddress;
+} __attribute__((packed)) SMBIOS3_STRUCTURE_TABLE;
+
+#define SMBIOS_TYPE_END		127
+#define SMBIOS_MAX_STRINGS	16
+
+/* First structure of each type with its strings, built once by
+   smbios_build_index() */
+static struct smbios_index {
+	UINT8 *structs[256];
+	UINT8 nb_strings[256];
+	CHAR8 *strings[256][SMBIOS_MAX_STRINGS];
+} *smbios_index;
+
+static BOOLEAN smbios_table(UINT8 **start, UINT8 **end)
 {
+	EFI_GUID smbios3_guid = SMBIOS3_TABLE_GUID;
+	SMBIOS3_STRUCTURE_TABLE *table3;
 	SMBIOS_STRUCTURE_TABLE *table;
 	EFI_STATUS ret;
-	SMBIOS_STRUCTURE_POINTER sm_struct;
-	UINT8 i;
-	CHAR8 *str;
 
-	ret = LibGetSystemConfigurationTable(&SMBIOSTableGuid, (VOID**)&table);
+	ret = LibGetSystemConfigurationTable(&smbios3_guid, (VOID **)&table3);
+	if (!EFI_ERROR(ret) && !memcmp(table3->AnchorString, "_SM3_", 5)) {
+		*start = (UINT8 *)(UINTN)table3->TableAddress;
+		*end = *start + table3->TableMaximumSize;
+		return TRUE;
+	}
+
+	ret = LibGetSystemConfigurationTable(&SMBIOSTableGuid, (VOID **)&table);
 	if (EFI_ERROR(ret))
-		return SMBIOS_UNDEFINED;
+		return FALSE;
+
+	*start = (UINT8 *)table->TableAddress;
+	*end = *start + table->TableLength;
+	return TRUE;
+}
+
+static void smbios_build_index(void)
+{
+	SMBIOS_HEADER *hdr;
+	UINT8 *cur, *end, *str;
+	UINT8 type;
+	UINTN n;
 
-	sm_struct.Hdr = (SMBIOS_HEADER *)table->TableAddress;
-	for (i = 0; i < table->TableLength; i++) {
-		if (sm_struct.Hdr->Type == type)
+	smbios_index = AllocateZeroPool(sizeof(*smbios_index));
+	if (!smbios_index)
+		return;
+
+	if (!smbios_table(&cur, &end))
+		return;
+
+	while (cur + sizeof(*hdr) <= end) {
+		hdr = (SMBIOS_HEADER *)cur;
+		type = hdr->Type;
+		if (type == SMBIOS_TYPE_END || hdr->Length < sizeof(*hdr))
 			break;
-		LibGetSmbiosString(&sm_struct, -1);
+
+		/* The strings follow the formatted area, the structure
+		   ends with a double NUL */
+		str = cur + hdr->Length;
+		n = 0;
+		if (str < end && !*str)
+			str++;
+		while (str < end && *str) {
+			if (!smbios_index->structs[type] && n < SMBIOS_MAX_STRINGS)
+				smbios_index->strings[type][n] = (CHAR8 *)str;
+			n++;
+			while (str < end && *str)
+				str++;
+			str++;
+		}
+
+		if (!smbios_index->structs[type]) {
+			smbios_index->structs[type] = cur;
+			smbios_index->nb_strings[type] = min(n, (UINTN)SMBIOS_MAX_STRINGS);
+		}
+		cur = str + 1;
 	}
+}
+
+char *smbios_get_string(UINT8 type, UINT8 offset)
+{
+	SMBIOS_STRUCTURE_POINTER sm_struct;
+	CHAR8 *str;
+	UINT8 n;
+
+	if (!smbios_index)
+		smbios_build_index();
+	if (!smbios_index || !smbios_index->structs[type])
+		return SMBIOS_UNDEFINED;
+
+	sm_struct.Raw = smbios_index->structs[type];
+	if (offset >= sm_struct.Hdr->Length)
+		return SMBIOS_UNDEFINED;
 
-	if (i == table->TableLength)
+	n = sm_struct.Raw[offset];
+	if (!n)
 		return SMBIOS_UNDEFINED;
+	if (n <= smbios_index->nb_strings[type])
+		return (char *)smbios_index->strings[type][n - 1];
 
-	str = LibGetSmbiosString(&sm_struct, sm_struct.Raw[offset]);
+	str = LibGetSmbiosString(&sm_struct, n);
 
 	return str ? (char *)str : SMBIOS_UNDEFINED;
 }
@@ -33,9 +33,14 @@
 #include <log.h>
 #include <lib.h>
 #include "storage.h"
+#include "vars.h"
 #include "gpt.h"
+#include "blkcache.h"
+#include "async_io.h"
+#include "io_buffer.h"
 #include "pci.h"
 #include "protocol/EraseBlock.h"
+#include "protocol.h"
 #include "timer.h"
 
 static struct storage *cur_storage;
@@ -61,36 +66,98 @@ static BOOLEAN is_boot_device(EFI_DEVICE_PATH *p)
 		&& pci->Device == boot_device.Device;
 }
 
+#ifdef STORAGE_BACKEND_EMMC
 extern struct storage STORAGE(STORAGE_EMMC);
+#endif
+#ifdef STORAGE_BACKEND_UFS
 extern struct storage STORAGE(STORAGE_UFS);
+#endif
+#ifdef STORAGE_BACKEND_SDCARD
 extern struct storage STORAGE(STORAGE_SDCARD);
+#endif
+#ifdef STORAGE_BACKEND_SATA
 extern struct storage STORAGE(STORAGE_SATA);
+#endif
+#ifdef STORAGE_BACKEND_NVME
 extern struct storage STORAGE(STORAGE_NVME);
+#endif
+#ifdef STORAGE_BACKEND_VIRTUAL
 extern struct storage STORAGE(STORAGE_VIRTUAL);
+#endif
 #ifdef USB_STORAGE
 extern struct storage STORAGE(STORAGE_USB);
 #endif
+#ifdef STORAGE_BACKEND_GENERAL_BLOCK
 extern struct storage STORAGE(STORAGE_GENERAL_BLOCK);
+#endif
 
+#ifdef STORAGE_BACKEND_SINGLE
+/* Only one backend is built in: probe it directly instead of walking
+ * the backend table. */
+#define SINGLE_STORAGE(X) STORAGE(X)
+
+static struct storage *storage_backend(enum storage_type type)
+{
+	if (type != STORAGE_BACKEND_SINGLE)
+		return NULL;
+	return &SINGLE_STORAGE(STORAGE_BACKEND_SINGLE);
+}
 
 static EFI_STATUS identify_storage(EFI_DEVICE_PATH *device_path,
 				   enum storage_type filter,
 				   struct storage **storage,
 				   enum storage_type *type)
 {
-	enum storage_type st;
-	static struct storage *supported_storage[STORAGE_ALL] = {
-		&STORAGE(STORAGE_EMMC)
-		, &STORAGE(STORAGE_UFS)
-		, &STORAGE(STORAGE_SDCARD)
-		, &STORAGE(STORAGE_SATA)
-		, &STORAGE(STORAGE_NVME)
-		, &STORAGE(STORAGE_VIRTUAL)
+	struct storage *single = storage_backend(STORAGE_BACKEND_SINGLE);
+
+	if ((filter != STORAGE_BACKEND_SINGLE && filter != STORAGE_ALL) ||
+	    !single->probe(device_path))
+		return EFI_UNSUPPORTED;
+
+	debug(L"%s storage identified", single->name);
+	*storage = single;
+	*type = STORAGE_BACKEND_SINGLE;
+	return EFI_SUCCESS;
+}
+#else
+static struct storage *supported_storage[STORAGE_ALL] = {
+#ifdef STORAGE_BACKEND_EMMC
+	[STORAGE_EMMC] = &STORAGE(STORAGE_EMMC),
+#endif
+#ifdef STORAGE_BACKEND_UFS
+	[STORAGE_UFS] = &STORAGE(STORAGE_UFS),
+#endif
+#ifdef STORAGE_BACKEND_SDCARD
+	[STORAGE_SDCARD] = &STORAGE(STORAGE_SDCARD),
+#endif
+#ifdef STORAGE_BACKEND_SATA
+	[STORAGE_SATA] = &STORAGE(STORAGE_SATA),
+#endif
+#ifdef STORAGE_BACKEND_NVME
+	[STORAGE_NVME] = &STORAGE(STORAGE_NVME),
+#endif
+#ifdef STORAGE_BACKEND_VIRTUAL
+	[STORAGE_VIRTUAL] = &STORAGE(STORAGE_VIRTUAL),
+#endif
 #ifdef USB_STORAGE
-		, &STORAGE(STORAGE_USB)
+	[STORAGE_USB] = &STORAGE(STORAGE_USB),
+#endif
+#ifdef STORAGE_BACKEND_GENERAL_BLOCK
+	[STORAGE_GENERAL_BLOCK] = &STORAGE(STORAGE_GENERAL_BLOCK),
 #endif
-		, &STORAGE(STORAGE_GENERAL_BLOCK)
-	};
+};
+
+static struct storage *storage_backend(enum storage_type type)
+{
+	return type < STORAGE_ALL ? supported_storage[type] : NULL;
+}
+
+static EFI_STATUS identify_storage(EFI_DEVICE_PATH *device_path,
+				   enum storage_type filter,
+				   struct storage **storage,
+				   enum storage_type *type)
+{
+	enum storage_type st;
 
 	for (st = STORAGE_EMMC; st < STORAGE_ALL; st++) {
 		if ((filter == st || filter == STORAGE_ALL) &&
@@ -104,6 +171,7 @@ static EFI_STATUS identify_storage(EFI_DEVICE_PATH *device_path,
 
 	return EFI_UNSUPPORTED;
 }
+#endif
 
 BOOLEAN is_same_device(EFI_DEVICE_PATH *p, EFI_DEVICE_PATH *e)
 {
@@ -143,13 +211,159 @@ BOOLEAN is_same_device(EFI_DEVICE_PATH *p, EFI_DEVICE_PATH *e)
 	return TRUE;
 }
 
+/* Fingerprint of the boot device chosen by the last full scan.  It is
+ * followed by the device path of the selected Block IO handle.
+ */
+struct boot_device_fp {
+	UINT8 type;
+	UINT8 device;
+	UINT8 function;
+	UINT8 reserved;
+	UINT32 media_id;
+} __attribute__((packed));
+
+static BOOLEAN is_valid_device_path(EFI_DEVICE_PATH *p, UINTN size)
+{
+	UINTN len;
+
+	while (size >= sizeof(*p)) {
+		len = DevicePathNodeLength(p);
+		if (len < sizeof(*p) || len > size)
+			return FALSE;
+		if (IsDevicePathEnd(p))
+			return len == size;
+		size -= len;
+		p = NextDevicePathNode(p);
+	}
+
+	return FALSE;
+}
+
+static UINT32 get_media_id(EFI_HANDLE handle)
+{
+	EFI_BLOCK_IO *bio;
+	EFI_STATUS ret;
+
+	ret = handle_protocol_cached(handle, &BlockIoProtocol, (VOID **)&bio);
+	if (EFI_ERROR(ret))
+		return 0;
+
+	return bio->Media->MediaId;
+}
+
+/* Look up the handle of the saved boot device fingerprint and check
+ * that it still is the same storage without probing the other Block
+ * IO handles.
+ */
+static EFI_STATUS load_boot_device_fp(enum storage_type filter)
+{
+	EFI_STATUS ret;
+	struct boot_device_fp *fp;
+	UINTN size;
+	EFI_DEVICE_PATH *fp_path, *remaining, *device_path;
+	EFI_HANDLE handle;
+	PCI_DEVICE_PATH *pci;
+	enum storage_type type;
+	struct storage *backend;
+
+	ret = get_efi_variable(&loader_guid, BOOT_DEVICE_FP_VAR, &size,
+			       (VOID **)&fp, NULL);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = EFI_NOT_FOUND;
+	fp_path = (EFI_DEVICE_PATH *)(fp + 1);
+	if (size <= sizeof(*fp) ||
+	    !is_valid_device_path(fp_path, size - sizeof(*fp)))
+		goto out;
+
+	type = fp->type;
+	backend = storage_backend(type);
+	if (!backend || (filter != STORAGE_ALL && filter != type))
+		goto out;
+
+	remaining = fp_path;
+	ret = uefi_call_wrapper(BS->LocateDevicePath, 3, &BlockIoProtocol,
+				&remaining, &handle);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	ret = EFI_NOT_FOUND;
+	if (!IsDevicePathEnd(remaining))
+		goto out;
+
+	device_path = DevicePathFromHandle(handle);
+	if (!device_path || is_same_device(device_path, exclude_device))
+		goto out;
+
+	pci = get_pci_device_path(device_path);
+	if (!pci || pci->Device != fp->device || pci->Function != fp->function)
+		goto out;
+
+	if (get_media_id(handle) != fp->media_id ||
+	    !backend->probe(device_path))
+		goto out;
+
+	cur_storage = backend;
+	boot_device_type = type;
+	boot_device_handle = handle;
+	memcpy(&boot_device, pci, sizeof(boot_device));
+	ret = EFI_SUCCESS;
+
+out:
+	FreePool(fp);
+	return ret;
+}
+
+static void save_boot_device_fp(void)
+{
+	EFI_STATUS ret;
+	EFI_DEVICE_PATH *device_path;
+	struct boot_device_fp *fp, *cur;
+	UINTN size, cur_size, path_size;
+
+	device_path = DevicePathFromHandle(boot_device_handle);
+	if (!device_path)
+		return;
+
+	path_size = DevicePathSize(device_path);
+	size = sizeof(*fp) + path_size;
+	fp = AllocateZeroPool(size);
+	if (!fp)
+		return;
+
+	fp->type = boot_device_type;
+	fp->device = boot_device.Device;
+	fp->function = boot_device.Function;
+	fp->media_id = get_media_id(boot_device_handle);
+	memcpy(fp + 1, device_path, path_size);
+
+	ret = get_efi_variable(&loader_guid, BOOT_DEVICE_FP_VAR, &cur_size,
+			       (VOID **)&cur, NULL);
+	if (!EFI_ERROR(ret)) {
+		if (cur_size == size && !memcmp(cur, fp, size)) {
+			FreePool(cur);
+			goto out;
+		}
+		FreePool(cur);
+	}
+
+	ret = set_efi_variable(&loader_guid, BOOT_DEVICE_FP_VAR, size, fp,
+			       TRUE, FALSE);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to save the boot device fingerprint");
+
+out:
+	FreePool(fp);
+}
+
 EFI_STATUS identify_boot_device(enum storage_type filter)
 {
 	EFI_STATUS ret;
 	EFI_HANDLE *handles;
 	UINTN nb_handle = 0;
-	UINTN i;
-	EFI_DEVICE_PATH *device_path;
+	UINTN i, j, nb_probed = 0;
+	EFI_DEVICE_PATH *device_path, **probed;
 	PCI_DEVICE_PATH *pci = NULL;
 	struct storage *storage;
 	enum storage_type type;
@@ -158,6 +372,13 @@ EFI_STATUS identify_boot_device(enum storage_type filter)
 	enum storage_type new_boot_device_type;
 	struct storage *new_storage;
 
+	ret = load_boot_device_fp(filter);
+	if (!EFI_ERROR(ret)) {
+		debug(L"%s storage selected from the saved fingerprint",
+		      cur_storage->name);
+		return EFI_SUCCESS;
+	}
+
 	new_storage = NULL;
 	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol,
 				&BlockIoProtocol, NULL, &nb_handle, &handles);
@@ -166,6 +387,15 @@ EFI_STATUS identify_boot_device(enum storage_type filter)
 		return ret;
 	}
 
+	/* The partitions of a disk have their own Block IO handle
+	 * which leads to the same storage: probe each device once.
+	 */
+	probed = AllocatePool(nb_handle * sizeof(*probed));
+	if (!probed) {
+		FreePool(handles);
+		return EFI_OUT_OF_RESOURCES;
+	}
+
 	new_boot_device.Header.Type = 0;
 	for (i = 0; i < nb_handle; i++) {
 		device_path = DevicePathFromHandle(handles[i]);
@@ -179,6 +409,13 @@ EFI_STATUS identify_boot_device(enum storage_type filter)
 		if (is_same_device(device_path, exclude_device))
 			continue;
 
+		for (j = 0; j < nb_probed; j++)
+			if (is_same_device(device_path, probed[j]))
+				break;
+		if (j < nb_probed)
+			continue;
+		probed[nb_probed++] = device_path;
+
 		if (new_boot_device.Function == pci->Function &&
 				new_boot_device.Device == pci->Device &&
 				new_boot_device.Header.Type == pci->Header.Type &&
@@ -203,11 +440,13 @@ EFI_STATUS identify_boot_device(enum storage_type filter)
 			error(L"Multiple identifcal storage found! Can't make a decision");
 			new_storage = NULL;
 			new_boot_device.Header.Type = 0;
+			FreePool(probed);
 			FreePool(handles);
 			return EFI_UNSUPPORTED;
 		}
 	}
 
+	FreePool(probed);
 	FreePool(handles);
 
 	if (!new_storage) {
@@ -220,6 +459,7 @@ EFI_STATUS identify_boot_device(enum storage_type filter)
 	memcpy(&boot_device, &new_boot_device, sizeof(new_boot_device));
 
 	debug(L"%s storage selected", cur_storage->name);
+	save_boot_device_fp();
 	return EFI_SUCCESS;
 }
 
@@ -232,33 +472,33 @@ static BOOLEAN valid_storage(void)
 	return boot_device.Header.Type && cur_storage;
 }
 
-static EFI_STATUS media_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+/* Background erase started by storage_erase_blocks_async() */
+static struct {
+	EFI_EVENT event;	/* NULL if no erase is in progress */
+	EFI_ERASE_BLOCK_TOKEN token;
+} pending_erase;
+
+/* If TOKEN is not NULL, the Erase Block protocol is asked to erase
+ * the aligned part of the range without blocking.  The unaligned head
+ * and tail are always filled with zeroes synchronously.
+ */
+static EFI_STATUS media_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				     EFI_LBA start, EFI_LBA end,
+				     EFI_ERASE_BLOCK_TOKEN *token)
 {
-	EFI_DEVICE_PATH *dev_path;
 	EFI_GUID guid = EFI_ERASE_BLOCK_PROTOCOL_GUID;
 	EFI_ERASE_BLOCK_PROTOCOL *erase_blockp;
 	UINTN size, erase_granularity;
 	EFI_STATUS ret;
-	EFI_HANDLE storage_handle = NULL;
 	EFI_LBA left;
 
-	dev_path = DevicePathFromHandle(handle);
-	if (!dev_path) {
-		error(L"Failed to get device path");
-		return EFI_DEVICE_ERROR;
-	}
-
-	ret = uefi_call_wrapper(BS->LocateDevicePath, 3,
-			&guid, &dev_path, &storage_handle);
-	if (EFI_ERROR(ret))
-		return EFI_UNSUPPORTED;
-
-	ret = uefi_call_wrapper(BS->HandleProtocol, 3,
-			storage_handle, &guid, (void **)&erase_blockp);
+	ret = device_protocol_cached(handle, &guid, (void **)&erase_blockp);
 	if (EFI_ERROR(ret))
 		return EFI_UNSUPPORTED;
 
 	erase_granularity = erase_blockp->EraseLengthGranularity;
+	if (!erase_granularity)
+		erase_granularity = 1;
 
 	/* check if space to be erased is lesser than group size
 	 * in such a case we cannot afford a group erase.
@@ -267,6 +507,11 @@ static EFI_STATUS media_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_L
 		ret = fill_zero(bio, start, end);
 		if (EFI_ERROR(ret))
 			error(L"Failed to fill with zeros");
+		else if (token) {
+			/* Nothing left for the protocol to signal */
+			token->TransactionStatus = ret;
+			uefi_call_wrapper(BS->SignalEvent, 1, token->Event);
+		}
 
 		return ret;
 	}
@@ -293,7 +538,7 @@ static EFI_STATUS media_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_L
 
 	size = (end - start + 1) * bio->Media->BlockSize;
 	ret = uefi_call_wrapper(erase_blockp->EraseBlocks, 5, erase_blockp, bio->Media->MediaId,
-			start, NULL, size);
+			start, token, size);
 	if (EFI_ERROR(ret))
 		error(L"EFI_ERASE_BLOCK_PROTOCOL failed to erase block");
 
@@ -317,10 +562,13 @@ EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA st
 	if (!valid_storage())
 		return EFI_UNSUPPORTED;
 
+	blkcache_invalidate(bio, start * bio->Media->BlockSize,
+			    (end - start + 1) * bio->Media->BlockSize);
+
 	/* check if underlying BIOS supports ERASE_BLOCK_PROTOCOL
 	 * If so use ERASE_BLOCK_PROTOCOL to erase blocks.
 	 */
-	ret = media_erase_blocks(handle, bio, start, end);
+	ret = media_erase_blocks(handle, bio, start, end, NULL);
 	if (ret == EFI_SUCCESS || ret != EFI_UNSUPPORTED)
 		return ret;
 
@@ -328,37 +576,196 @@ EFI_STATUS storage_erase_blocks(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA st
 	return cur_storage->erase_blocks(handle, bio, start, end);
 }
 
+EFI_STATUS storage_erase_blocks_async(EFI_HANDLE handle, EFI_BLOCK_IO *bio,
+				      EFI_LBA start, EFI_LBA end)
+{
+	EFI_STATUS ret;
+
+	if (!valid_storage())
+		return EFI_UNSUPPORTED;
+
+	ret = storage_erase_wait();
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, 0, 0, NULL, NULL,
+				&pending_erase.event);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the erase event");
+		pending_erase.event = NULL;
+		return ret;
+	}
+
+	blkcache_invalidate(bio, start * bio->Media->BlockSize,
+			    (end - start + 1) * bio->Media->BlockSize);
+
+	pending_erase.token.Event = pending_erase.event;
+	pending_erase.token.TransactionStatus = EFI_SUCCESS;
+	ret = media_erase_blocks(handle, bio, start, end, &pending_erase.token);
+	if (EFI_ERROR(ret)) {
+		uefi_call_wrapper(BS->CloseEvent, 1, pending_erase.event);
+		pending_erase.event = NULL;
+	}
+
+	return ret;
+}
+
+EFI_STATUS storage_erase_wait(void)
+{
+	EFI_STATUS ret;
+	UINTN index;
+
+	if (!pending_erase.event)
+		return EFI_SUCCESS;
+
+	ret = uefi_call_wrapper(BS->WaitForEvent, 3, 1, &pending_erase.event,
+				&index);
+	if (!EFI_ERROR(ret))
+		ret = pending_erase.token.TransactionStatus;
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Background erase failed");
+
+	uefi_call_wrapper(BS->CloseEvent, 1, pending_erase.event);
+	pending_erase.event = NULL;
+	return ret;
+}
+
+static int compare_lba_range(const void *a, const void *b)
+{
+	const struct lba_range *ra = a, *rb = b;
+
+	if (ra->start == rb->start)
+		return 0;
+	return ra->start < rb->start ? -1 : 1;
+}
+
+UINTN merge_lba_ranges(struct lba_range *ranges, UINTN nb)
+{
+	UINTN i, n;
+
+	if (!nb)
+		return 0;
+
+	qsort(ranges, nb, sizeof(*ranges), compare_lba_range);
+	for (i = 1, n = 0; i < nb; i++) {
+		if (ranges[i].start <= ranges[n].end + 1) {
+			ranges[n].end = max(ranges[n].end, ranges[i].end);
+			continue;
+		}
+		ranges[++n] = ranges[i];
+	}
+
+	return n + 1;
+}
+
+EFI_STATUS storage_write_zeroes(EFI_HANDLE handle, EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+{
+	if (!valid_storage() || !cur_storage->write_zeroes)
+		return EFI_UNSUPPORTED;
+
+	if (end < start)
+		return EFI_INVALID_PARAMETER;
+
+	blkcache_invalidate(bio, start * bio->Media->BlockSize,
+			    (end - start + 1) * bio->Media->BlockSize);
+	return cur_storage->write_zeroes(handle, bio, start, end);
+}
+
+/* Return an asynchronous I/O context on the disk BIO belongs to, or
+   NULL if it cannot be found.  */
+static struct async_io *fill_open_async(EFI_BLOCK_IO *bio)
+{
+	struct gpt_partition_interface gparti;
+	struct async_io *aio = NULL;
+	EFI_HANDLE *handles;
+	EFI_BLOCK_IO *cur;
+	UINTN nb_handle, i;
+	EFI_STATUS ret;
+
+	ret = uefi_call_wrapper(BS->LocateHandleBuffer, 5, ByProtocol,
+				&BlockIoProtocol, NULL, &nb_handle, &handles);
+	if (EFI_ERROR(ret))
+		return NULL;
+
+	for (i = 0; i < nb_handle; i++) {
+		ret = uefi_call_wrapper(BS->HandleProtocol, 3, handles[i],
+					&BlockIoProtocol, (VOID **)&cur);
+		if (!EFI_ERROR(ret) && cur == bio)
+			break;
+	}
+
+	if (i < nb_handle) {
+		memset(&gparti, 0, sizeof(gparti));
+		gparti.handle = handles[i];
+		gparti.bio = bio;
+		ret = uefi_call_wrapper(BS->HandleProtocol, 3, handles[i],
+					&DiskIoProtocol, (VOID **)&gparti.dio);
+		if (EFI_ERROR(ret) || EFI_ERROR(async_io_open(&gparti, &aio)))
+			aio = NULL;
+	}
+
+	FreePool(handles);
+	return aio;
+}
+
+/* Up to FILL_QUEUE_DEPTH writes of the same PATTERN buffer are in
+   flight when the range needs more than one write.  */
 EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 			    VOID *pattern, UINTN pattern_blocks)
 {
+	struct async_io *aio = NULL;
+	UINTN ids[FILL_QUEUE_DEPTH], n;
 	EFI_LBA lba;
 	UINT64 size;
 	uint32_t total, print_sec, print_prev;
-	EFI_STATUS ret;
+	EFI_STATUS ret = EFI_SUCCESS, ret2;
 
 	debug(L"Fill lba %d -> %d", start, end);
 	if (end <= start)
 		return EFI_INVALID_PARAMETER;
 
+	blkcache_invalidate(bio, start * bio->Media->BlockSize,
+			    (end - start + 1) * bio->Media->BlockSize);
+
+	if (end - start + 1 > pattern_blocks)
+		aio = fill_open_async(bio);
+
 	total = end - start +1;
 	info_n(L"Erasing ");
 	print_sec = boottime_in_msec() / 1000;
 	print_prev = 0;
-	for (lba = start; lba <= end; lba += pattern_blocks) {
-		if (lba + pattern_blocks > end + 1)
-			size = end - lba + 1;
-		else
-			size = pattern_blocks;
-
-		ret = uefi_call_wrapper(bio->WriteBlocks, 5, bio, bio->Media->MediaId, lba,
-				bio->Media->BlockSize * size, pattern);
-		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed to erase block %ld", lba);
-			return ret;
-		}
+	for (lba = start, n = 0; lba <= end; lba += size, n++) {
+		size = min(end - lba + 1, (UINT64)pattern_blocks);
+
+		if (aio) {
+			if (n >= FILL_QUEUE_DEPTH) {
+				ret = async_io_wait(aio, ids[n % FILL_QUEUE_DEPTH]);
+				if (EFI_ERROR(ret))
+					break;
+			}
+			ret = async_io_write(aio, lba * bio->Media->BlockSize,
+					     bio->Media->BlockSize * size, pattern,
+					     &ids[n % FILL_QUEUE_DEPTH]);
+		} else
+			ret = uefi_call_wrapper(bio->WriteBlocks, 5, bio, bio->Media->MediaId, lba,
+						bio->Media->BlockSize * size, pattern);
+		if (EFI_ERROR(ret))
+			break;
 
 		print_progress(lba + size - start, total, boottime_in_msec() / 1000, &print_sec, &print_prev);
 	}
+
+	if (aio) {
+		ret2 = async_io_wait_all(aio);
+		if (!EFI_ERROR(ret))
+			ret = ret2;
+		async_io_close(aio);
+	}
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to erase block %ld", lba);
+		return ret;
+	}
+
 	print_progress(total, total, boottime_in_msec() / 1000, &print_sec, &print_prev);
 	info_n(L"\n");
 
@@ -368,20 +775,14 @@ EFI_STATUS fill_with(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end,
 EFI_STATUS fill_zero(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 {
 	EFI_STATUS ret;
-	VOID *emptyblock;
-	VOID *aligned_emptyblock;
+	VOID *buf;
+	UINTN size;
 
-	ret = alloc_aligned(&emptyblock, &aligned_emptyblock,
-			    bio->Media->BlockSize * N_BLOCK,
-			    bio->Media->IoAlign);
+	ret = io_buffer_get_pattern(bio, 0, 0, &buf, &size);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	ret = fill_with(bio, start, end, aligned_emptyblock, N_BLOCK);
-
-	FreePool(emptyblock);
-
-	return ret;
+	return fill_with(bio, start, end, buf, size / bio->Media->BlockSize);
 }
 
 EFI_STATUS storage_set_boot_device(EFI_HANDLE device)
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2019, Intel Corporation
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "lib.h"
+#include "gpt.h"
+#include "async_io.h"
+#include "timer.h"
+#include "storage_bench.h"
+
+static const UINTN BLOCK_SIZES[] = { 4 * 1024, 128 * 1024, 1024 * 1024 };
+static const UINTN QUEUE_DEPTHS[] = { 1, ASYNC_IO_MAX_REQUESTS };
+
+static const CHAR16 *SCRATCH_PARTITIONS[] = { L"userdata", L"data", L"cache" };
+
+static const char *TEST_NAMES[] = {
+	[STORAGE_BENCH_SEQ_READ] = "seq-read",
+	[STORAGE_BENCH_RAND_READ] = "rand-read",
+	[STORAGE_BENCH_SEQ_WRITE] = "seq-write",
+	[STORAGE_BENCH_RAND_WRITE] = "rand-write"
+};
+
+/* The random offsets sequence is the same on each run so that the
+   results can be compared between devices.  */
+#define RAND_SEED	0x2545f4914f6cdd1dULL
+
+static UINT64 xorshift64(UINT64 *state)
+{
+	UINT64 x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+BOOLEAN storage_bench_is_scratch(const CHAR16 *label)
+{
+	UINTN i;
+
+	if (!label)
+		return FALSE;
+
+	for (i = 0; i < ARRAY_SIZE(SCRATCH_PARTITIONS); i++)
+		if (!StrCmp(label, SCRATCH_PARTITIONS[i]))
+			return TRUE;
+
+	return FALSE;
+}
+
+const char *storage_bench_test_name(storage_bench_test_t test)
+{
+	if (test >= ARRAY_SIZE(TEST_NAMES))
+		return "unknown";
+	return TEST_NAMES[test];
+}
+
+UINT64 storage_bench_kib_per_sec(const struct storage_bench_result *result)
+{
+	return result->usec ? result->bytes * 1000000 / 1024 / result->usec : 0;
+}
+
+UINT64 storage_bench_iops(const struct storage_bench_result *result)
+{
+	return result->usec ? result->ops * 1000000 / result->usec : 0;
+}
+
+static EFI_STATUS run_test(struct async_io *aio, UINT64 base, UINT64 size,
+			   UINT8 *buf, struct storage_bench_result *res)
+{
+	UINTN ids[ASYNC_IO_MAX_REQUESTS];
+	UINT64 i, nb_ops, offset, seed = RAND_SEED, start;
+	BOOLEAN write = res->test == STORAGE_BENCH_SEQ_WRITE ||
+		res->test == STORAGE_BENCH_RAND_WRITE;
+	BOOLEAN random = res->test == STORAGE_BENCH_RAND_READ ||
+		res->test == STORAGE_BENCH_RAND_WRITE;
+	UINTN bs = res->block_size, qd = res->queue_depth;
+	EFI_STATUS ret = EFI_SUCCESS, wret;
+	UINT8 *data;
+
+	/* Every write request writes zeroes */
+	if (write)
+		ZeroMem(buf, bs * qd);
+
+	nb_ops = size / bs;
+	start = timer_ticks();
+	for (i = 0; i < nb_ops; i++) {
+		if (i >= qd) {
+			ret = async_io_wait(aio, ids[i % qd]);
+			if (EFI_ERROR(ret))
+				break;
+		}
+
+		offset = (random ? xorshift64(&seed) % nb_ops : i) * bs;
+		data = buf + (i % qd) * bs;
+		if (write)
+			ret = async_io_write(aio, base + offset, bs, data, &ids[i % qd]);
+		else
+			ret = async_io_read(aio, base + offset, bs, data, &ids[i % qd]);
+		if (EFI_ERROR(ret))
+			break;
+	}
+
+	wret = async_io_wait_all(aio);
+	if (EFI_ERROR(ret))
+		return ret;
+	if (EFI_ERROR(wret))
+		return wret;
+
+	res->usec = ticks_to_usec(timer_ticks() - start);
+	res->ops = nb_ops;
+	res->bytes = nb_ops * bs;
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS storage_bench(const CHAR16 *label, UINT64 size, UINTN block_size,
+			 UINTN queue_depth, BOOLEAN write,
+			 struct storage_bench_result *results, UINTN *nb_results)
+{
+	struct gpt_partition_interface gparti;
+	const UINTN *block_sizes = BLOCK_SIZES, *queue_depths = QUEUE_DEPTHS;
+	UINTN nb_block_sizes = ARRAY_SIZE(BLOCK_SIZES);
+	UINTN nb_queue_depths = ARRAY_SIZE(QUEUE_DEPTHS);
+	UINTN i, j, nb_tests, max_bs = 0, nb = 0;
+	UINT64 base, part_size;
+	storage_bench_test_t test;
+	struct async_io *aio;
+	VOID *buf, *aligned_buf;
+	EFI_STATUS ret;
+
+	if (!label || !results || !nb_results)
+		return EFI_INVALID_PARAMETER;
+
+	if (block_size) {
+		block_sizes = &block_size;
+		nb_block_sizes = 1;
+	}
+	if (queue_depth) {
+		if (queue_depth > ASYNC_IO_MAX_REQUESTS)
+			return EFI_INVALID_PARAMETER;
+		queue_depths = &queue_depth;
+		nb_queue_depths = 1;
+	}
+
+	ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to get partition %s", label);
+		return ret;
+	}
+
+	for (i = 0; i < nb_block_sizes; i++) {
+		if (!block_sizes[i] || block_sizes[i] > STORAGE_BENCH_MAX_BLOCK_SIZE ||
+		    block_sizes[i] % gparti.bio->Media->BlockSize)
+			return EFI_INVALID_PARAMETER;
+		max_bs = max(max_bs, block_sizes[i]);
+	}
+
+	base = gparti.part.starting_lba * gparti.bio->Media->BlockSize;
+	part_size = (gparti.part.ending_lba + 1 - gparti.part.starting_lba) *
+		gparti.bio->Media->BlockSize;
+	size = min(size ? size : STORAGE_BENCH_DEFAULT_SIZE, part_size);
+	if (size < max_bs)
+		return EFI_BAD_BUFFER_SIZE;
+
+	nb_tests = write && storage_bench_is_scratch(label) ? 4 : 2;
+
+	ret = alloc_aligned(&buf, &aligned_buf, max_bs * ASYNC_IO_MAX_REQUESTS,
+			    gparti.bio->Media->IoAlign);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to allocate the benchmark buffer");
+		return ret;
+	}
+
+	ret = async_io_open(&gparti, &aio);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to open the I/O context");
+		goto free_buf;
+	}
+
+	for (i = 0; i < nb_block_sizes; i++) {
+		for (j = 0; j < nb_queue_depths; j++) {
+			for (test = 0; test < nb_tests; test++) {
+				results[nb].test = test;
+				results[nb].block_size = block_sizes[i];
+				results[nb].queue_depth = queue_depths[j];
+				ret = run_test(aio, base, size, aligned_buf,
+					       &results[nb]);
+				if (EFI_ERROR(ret)) {
+					efi_perror(ret, L"%a test failed on %s",
+						   TEST_NAMES[test], label);
+					goto out;
+				}
+				nb++;
+			}
+		}
+	}
+
+out:
+	*nb_results = nb;
+	async_io_close(aio);
+free_buf:
+	FreePool(buf);
+	return ret;
+}
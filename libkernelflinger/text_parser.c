@@ -42,48 +42,130 @@ void skip_whitespace(char **line)
 	*line = cur;
 }
 
-EFI_STATUS parse_text_buffer(VOID *data, UINTN size,
-			     EFI_STATUS (*parse_line)(char *line, VOID *ctx),
-			     VOID *context)
+void slice_skip_whitespace(text_slice_t *s)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
-	char *buf, *line, *eol, *p;
-	int lineno = 0;
-
-	/* Extra byte so we can always terminate the last line. */
-	buf = AllocatePool(size + 1);
-	if (!buf) {
-		error(L"Failed to allocate text copy buffer");
-		return EFI_OUT_OF_RESOURCES;
+	while (s->len && isspace(*s->str)) {
+		s->str++;
+		s->len--;
 	}
-	memcpy(buf, data, size);
-	buf[size] = 0;
+}
+
+/* A NUL terminated DATA ends with a blank character too */
+static void slice_trim_end(text_slice_t *s)
+{
+	while (s->len && (isspace(s->str[s->len - 1]) ||
+			  s->str[s->len - 1] == '\0'))
+		s->len--;
+}
+
+BOOLEAN slice_split(text_slice_t *s, char c, text_slice_t *rest)
+{
+	const char *p;
+
+	p = mem_find(s->str, c, s->len);
+	if (!p)
+		return FALSE;
+
+	if (rest) {
+		rest->str = p + 1;
+		rest->len = s->len - (p + 1 - s->str);
+	}
+	s->len = p - s->str;
+	return TRUE;
+}
+
+BOOLEAN slice_starts_with(const text_slice_t *s, const char *prefix)
+{
+	UINTN len = strlen((CHAR8 *)prefix);
+
+	return s->len >= len && !memcmp(s->str, prefix, len);
+}
+
+void text_iter_init(text_iter_t *iter, const VOID *data, UINTN size)
+{
+	iter->cur = data;
+	iter->end = iter->cur + size;
+	iter->lineno = 0;
+}
 
-	for (line = buf; line - buf < (ssize_t)size; line = eol + 1) {
-		lineno++;
+BOOLEAN text_iter_next(text_iter_t *iter, text_slice_t *line)
+{
+	const char *eol;
 
-		/* Detect line and terminate. */
-		eol = (char *)strchr((CHAR8 *)line, '\n');
+	while (iter->cur < iter->end) {
+		iter->lineno++;
+		eol = mem_find(iter->cur, '\n', iter->end - iter->cur);
 		if (!eol)
-			eol = line + strlen((CHAR8 *)line);
-		*eol = 0;
+			eol = iter->end;
+
+		line->str = iter->cur;
+		line->len = eol - iter->cur;
+		iter->cur = eol < iter->end ? eol + 1 : eol;
+
+		slice_skip_whitespace(line);
+		slice_trim_end(line);
+		if (line->len)
+			return TRUE;
+	}
 
-		/* Snip space character for sanity. */
-		p = line + strlen((CHAR8 *)line);
-		while (p > line && isspace(*(p-1)))
-			*(--p) = 0;
+	return FALSE;
+}
 
-		skip_whitespace(&line);
-		if (*line == '\0')
-			continue;
+EFI_STATUS parse_text_slices(const VOID *data, UINTN size,
+			     EFI_STATUS (*parse_line)(text_slice_t *line, VOID *ctx),
+			     VOID *context)
+{
+	EFI_STATUS ret;
+	text_iter_t iter;
+	text_slice_t line;
+
+	text_iter_init(&iter, data, size);
+	while (text_iter_next(&iter, &line)) {
+		ret = parse_line(&line, context);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed at line %d", iter.lineno);
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS parse_text_buffer(VOID *data, UINTN size,
+			     EFI_STATUS (*parse_line)(char *line, VOID *ctx),
+			     VOID *context)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+	text_iter_t iter;
+	text_slice_t line;
+	char *buf = NULL;
+	UINTN cap = 0;
+
+	/* Only the current line is copied, in a buffer sized for the
+	   longest line so far.  */
+	text_iter_init(&iter, data, size);
+	while (text_iter_next(&iter, &line)) {
+		if (line.len + 1 > cap) {
+			if (buf)
+				FreePool(buf);
+			cap = max(line.len + 1, cap * 2);
+			buf = AllocatePool(cap);
+			if (!buf) {
+				error(L"Failed to allocate text copy buffer");
+				return EFI_OUT_OF_RESOURCES;
+			}
+		}
+		memcpy(buf, line.str, line.len);
+		buf[line.len] = '\0';
 
-		ret = parse_line(line, context);
+		ret = parse_line(buf, context);
 		if (EFI_ERROR(ret)) {
-			efi_perror(ret, L"Failed at line %d", lineno);
+			efi_perror(ret, L"Failed at line %d", iter.lineno);
 			break;
 		}
 	}
 
-	FreePool(buf);
+	if (buf)
+		FreePool(buf);
 	return ret;
 }
@@ -35,6 +35,7 @@
 #include <efilib.h>
 #include <lib.h>
 #include "timer.h"
+#include "boottrace.h"
 
 #define BOOT_STAGE_FIRMWARE "FWS"
 #define BOOT_STAGE_OSLOADER_INIT "LIS"
@@ -78,36 +79,132 @@ __RDTSC (void)
 	return (uint64_t) hi << 32 | lo;
 }
 
-uint32_t get_cpu_freq(void)
+#define CPUID_HYPERVISOR	(1U << 31)
+#define CPUID_TSC_LEAF		0x15
+#define CPUID_FREQ_LEAF		0x16
+#define CPUID_HV_BASE		0x40000000
+#define CPUID_HV_TIMING_LEAF	0x40000010
+#define MSR_PLATFORM_INFO	0xce
+#define CALIBRATION_USEC	5000
+
+static uint64_t tsc_hz;
+
+/* TSC frequency from CPUID leaf 0x15, that is crystal clock times the
+   TSC / crystal clock ratio, or from the leaf 0x16 base frequency if
+   the crystal clock is not enumerated.  */
+static uint64_t tsc_hz_from_cpuid(BOOLEAN hypervisor)
+{
+	UINT32 reg[4], max_leaf, crystal_hz;
+
+	cpuid(0, reg);
+	max_leaf = reg[0];
+
+	if (max_leaf >= CPUID_TSC_LEAF) {
+		cpuid(CPUID_TSC_LEAF, reg);
+		crystal_hz = reg[2];
+		if (reg[0] && reg[1] && crystal_hz)
+			return (uint64_t)crystal_hz * reg[1] / reg[0];
+	}
+
+	if (max_leaf >= CPUID_FREQ_LEAF) {
+		cpuid(CPUID_FREQ_LEAF, reg);
+		if (reg[0] & 0xffff)
+			return (uint64_t)(reg[0] & 0xffff) * 1000000;
+	}
+
+	/* VMware and KVM report the TSC frequency in kHz */
+	if (hypervisor) {
+		cpuid(CPUID_HV_BASE, reg);
+		if (reg[0] >= CPUID_HV_TIMING_LEAF) {
+			cpuid(CPUID_HV_TIMING_LEAF, reg);
+			if (reg[0])
+				return (uint64_t)reg[0] * 1000;
+		}
+	}
+
+	return 0;
+}
+
+/* Measure the TSC against the firmware Stall() service */
+static uint64_t tsc_hz_from_calibration(void)
+{
+	uint64_t start;
+	EFI_STATUS ret;
+
+	if (!BS)
+		return 0;
+
+	start = __RDTSC();
+	ret = uefi_call_wrapper(BS->Stall, 1, CALIBRATION_USEC);
+	if (EFI_ERROR(ret))
+		return 0;
+
+	return (__RDTSC() - start) * (1000000 / CALIBRATION_USEC);
+}
+
+static uint64_t get_tsc_hz(void)
 {
-	uint32_t cpu_freq;
-	uint32_t max_nb_ratio;
+	UINT32 reg[4];
+	BOOLEAN hypervisor;
 	msr_t platform_info;
 
-	platform_info.val = __RDMSR (0xce);
-	max_nb_ratio = (platform_info.lo >> 8) & 0xff;
-	cpu_freq = 100 * max_nb_ratio;
+	if (tsc_hz)
+		return tsc_hz;
+
+	cpuid(1, reg);
+	hypervisor = !!(reg[2] & CPUID_HYPERVISOR);
+
+	tsc_hz = tsc_hz_from_cpuid(hypervisor);
+
+	/* MSR_PLATFORM_INFO max non-turbo ratio on a 100 MHz bus
+	   clock.  RDMSR may fault in a virtual machine.  */
+	if (!tsc_hz && !hypervisor) {
+		platform_info.val = __RDMSR(MSR_PLATFORM_INFO);
+		tsc_hz = (uint64_t)((platform_info.lo >> 8) & 0xff) * 100000000;
+	}
 
-	return cpu_freq;
+	if (!tsc_hz)
+		tsc_hz = tsc_hz_from_calibration();
+
+	if (!tsc_hz)
+		time_stamp = FALSE;
+
+	return tsc_hz;
+}
+
+static uint64_t ticks_to(uint64_t ticks, uint64_t unit_per_sec)
+{
+	uint64_t hz = get_tsc_hz();
+
+	if (!hz)
+		return 0;
+
+	return ticks / hz * unit_per_sec + ticks % hz * unit_per_sec / hz;
+}
+
+uint32_t get_cpu_freq(void)
+{
+	return get_tsc_hz() / 1000000;
 }
 
 uint32_t boottime_in_msec(void)
 {
-	uint64_t tick;
-	uint32_t bt_us, bt_ms;
-	uint32_t cpu_freq;
+	return ticks_to(__RDTSC(), 1000);
+}
 
-	cpu_freq = get_cpu_freq();
-	if (cpu_freq == 0) {
-		 time_stamp = FALSE;
-		 return 0;
-	}
+uint64_t boottime_in_usec(void)
+{
+	return ticks_to(__RDTSC(), 1000000);
+}
 
-	tick = __RDTSC();
-	bt_us = (((unsigned) (tick >> 6)) / cpu_freq) << 6;
-	bt_ms = bt_us / 1000;
+uint64_t timer_ticks(void)
+{
+	return __RDTSC();
+}
 
-	return bt_ms;
+uint64_t ticks_to_usec(uint64_t ticks)
+{
+	return ticks_to(ticks, 1000000);
 }
 
 void set_boottime_stamp(int num)
@@ -115,9 +212,27 @@ void set_boottime_stamp(int num)
 	if ((num < 0) || (num >= TM_POINT_LAST) || (time_stamp == FALSE))
 		return;
 
+	boottrace(BT_STAGE, BT_POINT, num);
 	bt_stamp[num] = boottime_in_msec();
 }
 
+const char *boottime_stage_name(int num)
+{
+	static const char *names[TM_POINT_LAST] = {
+		[TM_EFI_MAIN] = BOOT_STAGE_FIRMWARE,
+		[TM_AVB_START] = BOOT_STAGE_OSLOADER_INIT,
+		[TM_VERIFY_BOOT_DONE] = BOOT_STAGE_VERIFY_BOOT,
+		[TM_LOAD_TOS_DONE] = BOOT_STAGE_LOAD_TOS,
+		[TM_LAUNCH_TRUSTY_DONE] = BOOT_STAGE_LAUNCH_TRUSTY,
+		[TM_PROCRSS_TRUSTY_DONE] = BOOT_STAGE_POST_TRUSTY,
+		[TM_JMP_KERNEL] = BOOT_STAGE_START_KERNEL
+	};
+
+	if (num < 0 || num >= TM_POINT_LAST)
+		return "unknown";
+	return names[num];
+}
+
 void set_efi_enter_point(unsigned int value)
 {
 	efi_enter_point = value;
@@ -37,6 +37,7 @@
 #include "tpm2_security.h"
 #include "Tpm2Help.h"
 #include "security.h"
+#include "timer.h"
 
 #ifdef BUILD_ANDROID_THINGS
 #define MAX_NV_NUMBER		4
@@ -107,20 +108,24 @@ static const attribute_matrix_t config_table[MAX_NV_NUMBER] = {
 	}
 };
 
-static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
-				TPM2B_DIGEST *policy_digest,
-				TPMS_AUTH_COMMAND *policy_session,
-				BOOLEAN is_trial)
+/* Policy session shared by the NV index operations of a batch, see
+   tpm2_batch_begin() */
+static struct {
+	UINTN depth;
+	BOOLEAN started;
+	TPMI_SH_AUTH_SESSION handle;
+	BOOLEAN pcr_valid;
+	TPML_PCR_SELECTION pcrs;
+	TPM2B_DIGEST pcr_digest;
+} batch;
+
+static EFI_STATUS start_policy_session(TPMI_SH_AUTH_SESSION *sessionhandle,
+				       BOOLEAN is_trial)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
 	TPM2B_ENCRYPTED_SECRET encryptedSalt;
 	TPMT_SYM_DEF symmetric = {.algorithm = TPM_ALG_NULL};
 	TPM2B_NONCE nonceCaller, nonceTpm;
-	TPM2B_DIGEST pcrDigest;
-	TPML_PCR_SELECTION pcrs;
-	TPML_DIGEST pcrValues;
-	UINT32 pcrUpdateCounter;
-	TPML_PCR_SELECTION pcrSelectionOut;
 
 	encryptedSalt.size = 0;
 	nonceCaller.size = DIGEST_SIZE;
@@ -143,21 +148,29 @@ static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
 				&nonceTpm);
 
 	memset(nonceCaller.buffer, 0, DIGEST_SIZE);
-	if (EFI_ERROR(ret)) {
+	if (EFI_ERROR(ret))
 		efi_perror(ret, L"StartAuthSession failed");
-		return ret;
-	}
 
-	pcrs.count = 1;
-	pcrs.pcrSelections[0].hash = TPM_ALG_SHA1;
-	pcrs.pcrSelections[0].sizeofSelect = 3;
-	pcrs.pcrSelections[0].pcrSelect[0] = 0;
-	pcrs.pcrSelections[0].pcrSelect[1] = 0;
-	pcrs.pcrSelections[0].pcrSelect[2] = 0;
-	Set_PcrSelect_Bit(pcrs.pcrSelections[0], PCR_7);
+	return ret;
+}
+
+static EFI_STATUS read_pcr_digest(TPML_PCR_SELECTION *pcrs, TPM2B_DIGEST *pcrDigest)
+{
+	EFI_STATUS ret;
+	TPML_DIGEST pcrValues;
+	UINT32 pcrUpdateCounter;
+	TPML_PCR_SELECTION pcrSelectionOut;
+
+	pcrs->count = 1;
+	pcrs->pcrSelections[0].hash = TPM_ALG_SHA1;
+	pcrs->pcrSelections[0].sizeofSelect = 3;
+	pcrs->pcrSelections[0].pcrSelect[0] = 0;
+	pcrs->pcrSelections[0].pcrSelect[1] = 0;
+	pcrs->pcrSelections[0].pcrSelect[2] = 0;
+	Set_PcrSelect_Bit(pcrs->pcrSelections[0], PCR_7);
 
 	//1. Read PCRs (&pcrSelectionOut MUST NOT be NULL!!!!!)
-	ret = Tpm2PcrRead(&pcrs, &pcrUpdateCounter, &pcrSelectionOut, &pcrValues);
+	ret = Tpm2PcrRead(pcrs, &pcrUpdateCounter, &pcrSelectionOut, &pcrValues);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Tpm2PcrRead failed");
 		return ret;
@@ -169,12 +182,40 @@ static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
 	}
 
 	// 2. Hash those PCRs together
-	pcrDigest.size = sizeof(pcrDigest) - sizeof(UINT16);
-	ret = Tpm2HashSequence(TPM_ALG_SHA256, pcrValues.count, &pcrValues.digests[0], &pcrDigest);
-	if (EFI_ERROR(ret)) {
+	pcrDigest->size = sizeof(*pcrDigest) - sizeof(UINT16);
+	ret = Tpm2HashSequence(TPM_ALG_SHA256, pcrValues.count, &pcrValues.digests[0], pcrDigest);
+	if (EFI_ERROR(ret))
 		efi_perror(ret, L"HashSequence failed");
+
+	return ret;
+}
+
+static void set_policy_session(TPMS_AUTH_COMMAND *policy_session,
+			       TPMI_SH_AUTH_SESSION sessionhandle)
+{
+	policy_session->sessionHandle = sessionhandle;
+	policy_session->hmac.size = 0;
+	policy_session->nonce.size = 0;
+	*((UINT8 *)((void *)&(policy_session->sessionAttributes))) = 0;
+	policy_session->sessionAttributes.continueSession = 1;
+}
+
+static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
+				TPM2B_DIGEST *policy_digest,
+				TPMS_AUTH_COMMAND *policy_session,
+				BOOLEAN is_trial)
+{
+	EFI_STATUS ret;
+	TPM2B_DIGEST pcrDigest;
+	TPML_PCR_SELECTION pcrs;
+
+	ret = start_policy_session(sessionhandle, is_trial);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = read_pcr_digest(&pcrs, &pcrDigest);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
 	//3. Apply selected PCRs' pcrDigest (as approvedPcrDigest) to policyDigest
 	ret = Tpm2PolicyPCR(*sessionhandle, &pcrDigest, &pcrs);
@@ -202,17 +243,89 @@ static EFI_STATUS build_pcr_policy(TPMI_SH_AUTH_SESSION *sessionhandle,
 	}
 
 	//5. Apply policy session handle
-	if (policy_session) {
-		policy_session->sessionHandle = *sessionhandle;
-		policy_session->hmac.size = 0;
-		policy_session->nonce.size = 0;
-		*((UINT8 *)((void *)&(policy_session->sessionAttributes))) = 0;
-		policy_session->sessionAttributes.continueSession = 1;
+	if (policy_session)
+		set_policy_session(policy_session, *sessionhandle);
+
+	return EFI_SUCCESS;
+}
+
+/* Provides a PCR policy session satisfied for one NV index command.
+   Within a batch, the session and the PCR digest are reused: the TPM
+   resets the policy of a session once it has authorized a command, so
+   only the PolicyPCR command is issued again.  */
+static EFI_STATUS policy_session_open(TPMI_SH_AUTH_SESSION *sessionhandle,
+				      TPMS_AUTH_COMMAND *policy_session)
+{
+	EFI_STATUS ret;
+
+	if (!batch.depth)
+		return build_pcr_policy(sessionhandle, NULL, policy_session, FALSE);
+
+	if (!batch.started) {
+		ret = start_policy_session(&batch.handle, FALSE);
+		if (EFI_ERROR(ret))
+			return ret;
+		batch.started = TRUE;
+	}
+
+	if (!batch.pcr_valid) {
+		ret = read_pcr_digest(&batch.pcrs, &batch.pcr_digest);
+		if (EFI_ERROR(ret))
+			return ret;
+		batch.pcr_valid = TRUE;
+	}
+
+	ret = Tpm2PolicyPCR(batch.handle, &batch.pcr_digest, &batch.pcrs);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"PolicyPCR failed");
+		return ret;
 	}
 
+	*sessionhandle = batch.handle;
+	set_policy_session(policy_session, batch.handle);
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS policy_session_close(TPMI_SH_AUTH_SESSION sessionhandle)
+{
+	EFI_STATUS ret;
+
+	if (batch.depth)
+		return EFI_SUCCESS;
+
+	ret = Tpm2FlushContext(sessionhandle);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"FlushContext failed");
+
+	return ret;
+}
+
+EFI_STATUS tpm2_batch_begin(void)
+{
+	batch.depth++;
 	return EFI_SUCCESS;
 }
 
+EFI_STATUS tpm2_batch_end(void)
+{
+	EFI_STATUS ret = EFI_SUCCESS;
+
+	if (!batch.depth)
+		return EFI_NOT_STARTED;
+
+	if (--batch.depth)
+		return EFI_SUCCESS;
+
+	if (batch.started) {
+		ret = Tpm2FlushContext(batch.handle);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"FlushContext of the batch session failed");
+	}
+	memset(&batch, 0, sizeof(batch));
+
+	return ret;
+}
+
 EFI_STATUS tpm2_create_nvindex(TPMI_RH_NV_INDEX nv_index,
 			       TPMA_NV attributes,
 			       UINT32 data_size)
@@ -260,7 +373,7 @@ EFI_STATUS tpm2_write_nvindex(TPMI_RH_NV_INDEX nv_index,
 	UINT16 written_size = 0;
 	UINT16 cur_size;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = policy_session_open(&session_handle, &session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
@@ -284,11 +397,9 @@ EFI_STATUS tpm2_write_nvindex(TPMI_RH_NV_INDEX nv_index,
 	}
 	memset(&nv_write_data, 0, sizeof(nv_write_data));
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
+	ret = policy_session_close(session_handle);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
 	return ret;
 }
@@ -299,7 +410,7 @@ EFI_STATUS tpm2_write_lock_nvindex(TPMI_RH_NV_INDEX nv_index)
 	TPMS_AUTH_COMMAND session_data = {0};
 	TPMI_SH_AUTH_SESSION session_handle = 0;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = policy_session_open(&session_handle, &session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
@@ -311,11 +422,9 @@ EFI_STATUS tpm2_write_lock_nvindex(TPMI_RH_NV_INDEX nv_index)
 		return ret;
 	}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
+	ret = policy_session_close(session_handle);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
 	return ret;
 }
@@ -331,7 +440,7 @@ EFI_STATUS tpm2_read_nvindex(TPMI_RH_NV_INDEX nv_index,
 	UINT16 read_size = 0;
 	UINT16 cur_size;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = policy_session_open(&session_handle, &session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
@@ -362,11 +471,9 @@ EFI_STATUS tpm2_read_nvindex(TPMI_RH_NV_INDEX nv_index,
 	*data_size = read_size;
 	memset(&nv_read_data, 0, sizeof(nv_read_data));
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
+	ret = policy_session_close(session_handle);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
 	return EFI_SUCCESS;
 }
@@ -377,7 +484,7 @@ EFI_STATUS tpm2_read_lock_nvindex(TPMI_RH_NV_INDEX nv_index)
 	TPMS_AUTH_COMMAND session_data = {0};
 	TPMI_SH_AUTH_SESSION session_handle = 0;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = policy_session_open(&session_handle, &session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
@@ -389,11 +496,9 @@ EFI_STATUS tpm2_read_lock_nvindex(TPMI_RH_NV_INDEX nv_index)
 		return ret;
 	}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
+	ret = policy_session_close(session_handle);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
 	return EFI_SUCCESS;
 }
@@ -404,7 +509,7 @@ static EFI_STATUS tpm2_set_nvbits(TPMI_RH_NV_INDEX nv_index, UINT64 set_bits)
 	TPMS_AUTH_COMMAND session_data = {0};
 	TPMI_SH_AUTH_SESSION session_handle = 0;
 
-	ret = build_pcr_policy(&session_handle, NULL, &session_data, FALSE);
+	ret = policy_session_open(&session_handle, &session_data);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"build PCR policy failed");
 		return ret;
@@ -416,11 +521,9 @@ static EFI_STATUS tpm2_set_nvbits(TPMI_RH_NV_INDEX nv_index, UINT64 set_bits)
 		return ret;
 	}
 
-	ret = Tpm2FlushContext(session_handle);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"%a - FlushContext failed", __func__);
+	ret = policy_session_close(session_handle);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
 
 	return EFI_SUCCESS;
 }
@@ -533,16 +636,19 @@ static EFI_STATUS create_index_and_write_lock(TPM_NV_INDEX nv_index, TPMA_NV att
 		return ret;
 	}
 
+	tpm2_batch_begin();
 	ret = tpm2_write_nvindex(nv_index, data_size, data, 0);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Write to NV Index failed, index: 0x%x, size: %d", nv_index, data_size);
-		return ret;
+		goto out;
 	}
 
 	ret = tpm2_write_lock_nvindex(nv_index);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Write lock to NV Index failed, index: 0x%x", nv_index);
 
+out:
+	tpm2_batch_end();
 	return ret;
 }
 
@@ -695,6 +801,7 @@ EFI_STATUS extend_trusty_seed_pcr_policy(void)
 	Digests.count = 1;
 	Digests.digests[0].hashAlg = TPM_ALG_SHA256;
 	PcrHandle = PCR_7;
+	batch.pcr_valid = FALSE;
 
 	DigestSize = GetHashSizeFromAlgo(Digests.digests[0].hashAlg);
 	memset((UINT8 *)&Digests.digests[0].digest, 0, DigestSize);
@@ -712,8 +819,10 @@ EFI_STATUS tpm2_read_trusty_seed(UINT8 seed[TRUSTY_SEED_SIZE])
 	EFI_STATUS ret2;
 	UINT16 seed_size = TRUSTY_SEED_SIZE;
 
+	tpm2_batch_begin();
 	ret = tpm2_read_nvindex(NV_INDEX_TRUSTYOS_SEED, &seed_size, seed, 0);
 	ret2 = tpm2_read_lock_nvindex(NV_INDEX_TRUSTYOS_SEED);  // Lock anyway
+	tpm2_batch_end();
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"Read trusty seed failed");
 		goto out;
@@ -807,6 +916,78 @@ EFI_STATUS tpm2_fuse_bootloader_policy(void *data, uint32_t size)
 	return ret;
 }
 
+static EFI_STATUS bench_command(enum tpm2_bench_test test)
+{
+	TPMI_YES_NO more_data;
+	TPMS_CAPABILITY_DATA cap_data;
+	TPM2B_DIGEST random;
+	TPM2B_NV_PUBLIC nv_public;
+	TPM2B_NAME nv_name;
+	TPML_PCR_SELECTION pcrs, pcrs_out;
+	TPML_DIGEST pcr_values;
+	UINT32 pcr_counter;
+
+	switch (test) {
+	case TPM2_BENCH_GET_CAPABILITY:
+		return Tpm2GetCapability(TPM_CAP_TPM_PROPERTIES, TPM_PT_PERMANENT, 1,
+					 &more_data, &cap_data);
+	case TPM2_BENCH_GET_RANDOM:
+		return Tpm2GetRandom(DIGEST_SIZE, &random);
+	case TPM2_BENCH_NV_READ_PUBLIC:
+		return Tpm2NvReadPublic(NV_INDEX_TRUSTYOS_SEED, &nv_public, &nv_name);
+	case TPM2_BENCH_PCR_READ:
+		memset(&pcrs, 0, sizeof(pcrs));
+		pcrs.count = 1;
+		pcrs.pcrSelections[0].hash = TPM_ALG_SHA256;
+		pcrs.pcrSelections[0].sizeofSelect = 3;
+		Set_PcrSelect_Bit(pcrs.pcrSelections[0], PCR_7);
+		return Tpm2PcrRead(&pcrs, &pcr_counter, &pcrs_out, &pcr_values);
+	default:
+		return EFI_INVALID_PARAMETER;
+	}
+}
+
+EFI_STATUS tpm2_bench(UINTN iterations, struct tpm2_bench_result results[TPM2_BENCH_LAST])
+{
+	EFI_STATUS ret;
+	UINT64 start, usec;
+	UINTN i, test;
+
+	if (!iterations || !results)
+		return EFI_INVALID_PARAMETER;
+
+	memset(results, 0, sizeof(*results) * TPM2_BENCH_LAST);
+	for (test = 0; test < TPM2_BENCH_LAST; test++) {
+		for (i = 0; i < iterations; i++) {
+			start = timer_ticks();
+			ret = bench_command(test);
+			usec = ticks_to_usec(timer_ticks() - start);
+			if (EFI_ERROR(ret)) {
+				debug(L"TPM %a benchmark command failed: %r",
+				      tpm2_bench_test_name(test), ret);
+				break;
+			}
+			results[test].count++;
+			results[test].total_usec += usec;
+			results[test].max_usec = max(results[test].max_usec, usec);
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+const char *tpm2_bench_test_name(enum tpm2_bench_test test)
+{
+	static const char *NAMES[TPM2_BENCH_LAST] = {
+		[TPM2_BENCH_GET_CAPABILITY] = "get-capability",
+		[TPM2_BENCH_GET_RANDOM] = "get-random",
+		[TPM2_BENCH_NV_READ_PUBLIC] = "nv-read-public",
+		[TPM2_BENCH_PCR_READ] = "pcr-read"
+	};
+
+	return test < TPM2_BENCH_LAST ? NAMES[test] : "unknown";
+}
+
 EFI_STATUS tpm2_init(void)
 {
 	EFI_STATUS ret;
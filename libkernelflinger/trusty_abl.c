@@ -46,6 +46,7 @@
 #include "gpt.h"
 #include "efilinux.h"
 #include "libelfloader.h"
+#include "memmap.h"
 #include <uefi_utils.h>
 
 #define TRUSTY_MEM_SIZE        0x1200000
@@ -158,33 +159,24 @@ static EFI_STATUS search_usable_memory(OUT EFI_PHYSICAL_ADDRESS *lp_mem,
 	IN EFI_PHYSICAL_ADDRESS min_addr,
 	IN EFI_PHYSICAL_ADDRESS max_addr)
 {
-	EFI_MEMORY_DESCRIPTOR entries[64];
+	CHAR8 *entries;
 	EFI_MEMORY_DESCRIPTOR *cur;
 	EFI_PHYSICAL_ADDRESS  start, end;
 	EFI_STATUS ret;
 	UINTN nr_entries;
 	UINTN entry_sz;
-	UINTN key;
 	UINTN i;
-	UINT32 descr_ver;
 
 	if (lp_mem == NULL)
 		return EFI_NOT_FOUND;
 
-	nr_entries = sizeof(entries);
-	ret = uefi_call_wrapper(BS->GetMemoryMap, 5, &nr_entries,
-				(EFI_MEMORY_DESCRIPTOR *)entries,
-				&key, &entry_sz, &descr_ver);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to get the current memory map");
+	ret = memmap_get(&entries, &nr_entries, &entry_sz, NULL);
+	if (EFI_ERROR(ret))
 		return ret;
-	}
-	nr_entries /= entry_sz;
-	sort_memory_map(entries, nr_entries, entry_sz);
 
 	*lp_mem = 0;
 	for (i = 0; i < nr_entries; i++) {
-		cur = (EFI_MEMORY_DESCRIPTOR *)(entries + i);
+		cur = (EFI_MEMORY_DESCRIPTOR *)(entries + i * entry_sz);
 		if (cur->Type != EfiConventionalMemory)
 			continue;
 
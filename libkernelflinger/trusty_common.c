@@ -42,6 +42,9 @@
 #include "power.h"
 #include "targets.h"
 #include "gpt.h"
+#include "slot.h"
+#include "prefetch.h"
+#include "blkcache.h"
 #include "efilinux.h"
 
 #ifdef USE_AVB
@@ -63,6 +66,7 @@ EFI_STATUS load_tos_image(OUT VOID **bootimage)
         verify_state_new = verify_state;
 
         ret = android_image_load_partition_avb("tos", bootimage, &verify_state_new, &slot_data);  // Do not try to switch slot if failed
+        prefetch_release();
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"TOS image loading failed");
                 return ret;
@@ -118,9 +122,11 @@ static EFI_STATUS tos_image_load_partition(IN const CHAR16 *label, OUT VOID **im
         partition_size = (gpart.part.ending_lba + 1 - gpart.part.starting_lba) *
                 gpart.bio->Media->BlockSize;
         debug(L"Reading TOS image header");
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
-                                partition_start,
-                                sizeof(aosp_header), &aosp_header);
+        ret = prefetch_read(&gpart, partition_start, sizeof(aosp_header),
+                            &aosp_header);
+        if (ret == EFI_NOT_FOUND)
+                ret = blkcache_read(&gpart, partition_start,
+                                    sizeof(aosp_header), &aosp_header);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk (aosp_header)");
                 return ret;
@@ -137,8 +143,10 @@ static EFI_STATUS tos_image_load_partition(IN const CHAR16 *label, OUT VOID **im
         }
 
         debug(L"Reading Tos image: %d bytes", img_size);
-        ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId, partition_start,
-                                img_size, bootimg);
+        ret = prefetch_read(&gpart, partition_start, img_size, bootimg);
+        if (ret == EFI_NOT_FOUND)
+                ret = uefi_call_wrapper(gpart.dio->ReadDisk, 5, gpart.dio, MediaId,
+                                        partition_start, img_size, bootimg);
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"ReadDisk Error for TOS image read");
                 FreePool(bootimg);
@@ -155,6 +163,7 @@ EFI_STATUS load_tos_image(OUT VOID **bootimage)
         UINT8 verify_state;
 
         ret = tos_image_load_partition(TOS_LABEL, bootimage);
+        prefetch_release();
         if (EFI_ERROR(ret)) {
                 efi_perror(ret, L"TOS image loading failed");
                 return ret;
@@ -188,3 +197,14 @@ cleanup_tos:
 }
 
 #endif // USE_AVB
+
+EFI_STATUS tos_image_prefetch(void)
+{
+        const CHAR16 *label;
+
+        label = slot_label(TOS_LABEL);
+        if (!label)
+                return EFI_NOT_FOUND;
+
+        return android_image_prefetch_partition(label);
+}
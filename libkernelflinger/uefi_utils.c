@@ -39,6 +39,10 @@
 #include "protocol.h"
 #include "uefi_utils.h"
 #include "options.h"
+#include "misc.h"
+#ifdef RPMB_STORAGE
+#include "rpmb_storage.h"
+#endif
 
 /* GUID for ESP partition on gmin */
 const EFI_GUID esp_ptn_guid = { 0x2568845d, 0x2332, 0x4675,
@@ -58,8 +62,8 @@ EFI_STATUS get_esp_fs(EFI_FILE_IO_INTERFACE **esp_fs)
 		return ret;
 	}
 
-	ret = handle_protocol(esp_handle, &SimpleFileSystemProtocol,
-			      (void **)&esp);
+	ret = handle_protocol_cached(esp_handle, &SimpleFileSystemProtocol,
+				     (void **)&esp);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"HandleProtocol for ESP partition failed");
 		return ret;
@@ -489,6 +493,11 @@ EFI_STATUS uefi_bios_update_capsule(EFI_HANDLE root_dir, CHAR16 *name)
 	}
 
 	debug(L"I am about to reset the system after BIOS capsules");
+	efi_variable_commit();
+	misc_commit();
+#ifdef RPMB_STORAGE
+	rpmb_storage_commit();
+#endif
 
 	uefi_call_wrapper(RT->ResetSystem, 4, resetType, EFI_SUCCESS, 0, NULL);
 
@@ -552,6 +561,11 @@ EFI_STATUS uefi_enter_binary(EFI_HANDLE part_handle, CHAR16 *path,
 		loaded_image->LoadOptionsSize = load_options_size;
 		loaded_image->LoadOptions = load_options;
 	}
+	efi_variable_commit();
+	misc_commit();
+#ifdef RPMB_STORAGE
+	rpmb_storage_commit();
+#endif
 	ret = uefi_call_wrapper(BS->StartImage, 3, image, NULL, NULL);
 
 out:
@@ -629,7 +643,7 @@ EFI_STATUS uefi_check_upgrade(EFI_LOADED_IMAGE *loaded_image,
 		goto out;
 	}
 
-	ret = handle_protocol(part_handle, &SimpleFileSystemProtocol, (void **)&io);
+	ret = handle_protocol_cached(part_handle, &SimpleFileSystemProtocol, (void **)&io);
 	if (EFI_ERROR(ret)) {
 		efi_perror(ret, L"HandleProtocol for FAT in partition %s failed", partition);
 		goto out;
@@ -32,6 +32,7 @@
 
 #include <lib.h>
 #include "storage.h"
+#include "protocol.h"
 #include "protocol/ufs.h"
 #include "protocol/ScsiPassThruExt.h"
 
@@ -60,9 +61,8 @@ static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EF
 	EFI_EXT_SCSI_PASS_THRU_SCSI_REQUEST_PACKET scsi_req;
 	struct unmap_parameter unmap;
 	struct command_descriptor_block_unmap cdb;
-	EFI_HANDLE scsi_handle;
 	EFI_DEVICE_PATH *dp = DevicePathFromHandle(handle);
-	EFI_DEVICE_PATH *scsi_dp = dp;
+	EFI_DEVICE_PATH *scsi_dp;
 	UINT8 target_bytes[TARGET_MAX_BYTES];
 	UINT8 *target = target_bytes;
 	UINT64 lun;
@@ -71,15 +71,8 @@ static EFI_STATUS ufs_erase_blocks(EFI_HANDLE handle, __attribute__((unused)) EF
 		error(L"Failed to get device path from handle");
 		return EFI_INVALID_PARAMETER;
 	}
-	ret = uefi_call_wrapper(BS->LocateDevicePath, 3, &ScsiPassThruProtocolGuid,
-				&scsi_dp, &scsi_handle);
-	if (EFI_ERROR(ret)) {
-		error(L"Failed to locate SCSI root device");
-		return ret;
-	}
-
-	ret = uefi_call_wrapper(BS->HandleProtocol, 3, scsi_handle,
-				&ScsiPassThruProtocolGuid, (void *)&scsi);
+	ret = device_protocol_cached(handle, &ScsiPassThruProtocolGuid,
+				     (void **)&scsi);
 	if (EFI_ERROR(ret)) {
 		error(L"failed to get scsi protocol");
 		return ret;
@@ -36,8 +36,16 @@
 #include <efilib.h>
 #include <lib.h>
 #include <ui.h>
-
-#define NOT_READY_USECS	(100 * 1000)
+#include "boottrace.h"
+#include "mp_pool.h"
+#include "upng.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef USE_SPLASH_CACHE
+#include "crc32.h"
+#include "uefi_utils.h"
+#endif
 
 /* Time between calls to ReadKeyStroke to check if it is being actively held
  * Smaller stall values seem to result in false reporting of no key pressed
@@ -54,6 +62,11 @@ typedef struct graphic {
 	UINT32 width;
 	UINT32 height;
 	UINT32 mode;
+	/* Linear framebuffer, NULL if the mode is PixelBltOnly or has
+	   an unknown pixel layout, see fb_detect() */
+	UINT32 *fb;
+	UINT32 stride;
+	BOOLEAN swap_rb;
 } graphic_t;
 
 static graphic_t graphic;
@@ -64,6 +77,17 @@ static UINTN default_textarea_y;
 
 static const char *VENDOR_IMG_NAME = "splash_intel";
 
+/* Vendor splash being decoded on an Application Processor, see
+   ui_display_vendor_splash_async() */
+static struct splash {
+	ui_image_t *image;
+	upng_t *upng;
+	EFI_STATUS status;
+#ifdef USE_SPLASH_CACHE
+	UINT32 image_crc;
+#endif
+} splash;
+
 static int get_hold_key_stall_time(void)
 {
 	EFI_STATUS ret;
@@ -91,8 +115,128 @@ out:
 	return hold_key_stall_time;
 }
 
-EFI_STATUS ui_init(UINTN *width_p, UINTN *height_p)
+/* Some firmwares implement the GOP Blt() pixel by pixel which makes
+   each frame cost several milliseconds.  When the current mode
+   exposes a linear framebuffer with a 32 bits per pixel layout, the
+   blt buffers are written straight into it instead.  */
+static void fb_detect(void)
+{
+	EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE *mode = graphic.output->Mode;
+	EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info = mode->Info;
+
+	graphic.fb = NULL;
+
+	switch (info->PixelFormat) {
+	case PixelBlueGreenRedReserved8BitPerColor:
+		graphic.swap_rb = FALSE;
+		break;
+	case PixelRedGreenBlueReserved8BitPerColor:
+		graphic.swap_rb = TRUE;
+		break;
+	default:
+		debug(L"No linear framebuffer, using Blt()");
+		return;
+	}
+
+	if (!mode->FrameBufferBase ||
+	    info->PixelsPerScanLine < graphic.width ||
+	    mode->FrameBufferSize < (UINT64)info->PixelsPerScanLine *
+	    graphic.height * sizeof(*graphic.fb))
+		return;
+
+	graphic.fb = (UINT32 *)(UINTN)mode->FrameBufferBase;
+	graphic.stride = info->PixelsPerScanLine;
+	debug(L"Linear framebuffer at 0x%lx, stride %d%s",
+	      mode->FrameBufferBase, graphic.stride,
+	      graphic.swap_rb ? L", RGB" : L"");
+}
+
+static inline UINT32 fb_pixel(UINT32 p)
+{
+	if (!graphic.swap_rb)
+		return p;
+	return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+}
+
+/* The framebuffer is usually mapped write-combining by the firmware:
+   non-temporal stores fill complete write-combining buffers and do
+   not pollute the cache with data that is never read back.  */
+static void fb_write_line(UINT32 *dst, const UINT32 *src, UINTN n)
+{
+#ifdef __SSE2__
+	const __m128i ga = _mm_set1_epi32(0xff00ff00);
+	const __m128i low = _mm_set1_epi32(0xff);
+	__m128i v, r, b;
+
+	for (; n && ((UINTN)dst & 15); n--)
+		*dst++ = fb_pixel(*src++);
+
+	for (; n >= 4; n -= 4, dst += 4, src += 4) {
+		v = _mm_loadu_si128((const __m128i *)src);
+		if (graphic.swap_rb) {
+			r = _mm_and_si128(_mm_srli_epi32(v, 16), low);
+			b = _mm_slli_epi32(_mm_and_si128(v, low), 16);
+			v = _mm_or_si128(_mm_and_si128(v, ga), _mm_or_si128(r, b));
+		}
+		_mm_stream_si128((__m128i *)dst, v);
+	}
+#endif
+	for (; n; n--)
+		*dst++ = fb_pixel(*src++);
+}
+
+static void fb_fill_line(UINT32 *dst, UINT32 p, UINTN n)
+{
+#ifdef __SSE2__
+	__m128i v = _mm_set1_epi32(p);
+
+	for (; n && ((UINTN)dst & 15); n--)
+		*dst++ = p;
+
+	for (; n >= 4; n -= 4, dst += 4)
+		_mm_stream_si128((__m128i *)dst, v);
+#endif
+	for (; n; n--)
+		*dst++ = p;
+}
+
+static inline void fb_flush(void)
+{
+#ifdef __SSE2__
+	_mm_sfence();
+#endif
+}
+
+static BOOLEAN fb_usable(UINTN x, UINTN y, UINTN width, UINTN height)
+{
+	return graphic.fb && x + width <= graphic.width &&
+		y + height <= graphic.height && x + width >= x &&
+		y + height >= y;
+}
+
+static void fb_draw(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, UINTN blt_width,
+		    UINTN src_x, UINTN src_y, UINTN x, UINTN y,
+		    UINTN width, UINTN height)
+{
+	UINT32 *src = (UINT32 *)blt + src_y * blt_width + src_x;
+	UINT32 *dst = graphic.fb + y * graphic.stride + x;
+
+	for (; height; height--, src += blt_width, dst += graphic.stride)
+		fb_write_line(dst, src, width);
+	fb_flush();
+}
+
+static void fb_fill(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color, UINTN x, UINTN y,
+		    UINTN width, UINTN height)
 {
+	UINT32 p = fb_pixel(*(UINT32 *)color);
+	UINT32 *dst = graphic.fb + y * graphic.stride + x;
+
+	for (; height; height--, dst += graphic.stride)
+		fb_fill_line(dst, p, width);
+	fb_flush();
+}
+
 	UINT32 mode;
 	UINTN info_size;
 	EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info;
@@ -140,6 +284,8 @@ EFI_STATUS ui_init(UINTN *width_p, UINTN *height_p)
 	if (!last_succeed)
 		return EFI_UNSUPPORTED;
 
+	fb_detect();
+
 	if (!ui_font_get_default()) {
 		error(L"Default font not available");
 		return EFI_UNSUPPORTED;
@@ -172,24 +318,161 @@ EFI_STATUS ui_init(UINTN *width_p, UINTN *height_p)
 	return EFI_SUCCESS;
 }
 
-EFI_STATUS ui_display_vendor_splash(VOID)
+#ifdef USE_SPLASH_CACHE
+/* The vendor splash, scaled for the current screen resolution, is
+   saved in an ESP file.  On the following boots, it is displayed with
+   one file read and one Blt() instead of decoding and scaling the PNG
+   image.  The cache is keyed by the CRC32 of the PNG image and the
+   screen resolution.  */
+#define SPLASH_CACHE_FILE	L"\\splash.blt"
+#define SPLASH_CACHE_MAGIC	0x48535053	/* "SPSH" */
+
+struct splash_cache {
+	UINT32 magic;
+	UINT32 image_crc;
+	UINT32 screen_width;
+	UINT32 screen_height;
+	UINT32 x;
+	UINT32 y;
+	UINT32 width;
+	UINT32 height;
+	UINT32 blt_crc;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL blt[0];
+} __attribute__((packed));
+
+static EFI_STATUS splash_cache_draw(ui_image_t *image, UINT32 image_crc)
 {
-	UINTN width, height, x, y, max_size;
-	ui_image_t *vendor;
+	EFI_STATUS ret;
+	EFI_FILE_IO_INTERFACE *io;
+	struct splash_cache *cache;
+	UINTN size;
+
+	ret = get_esp_fs(&io);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	if (!uefi_exist_file_root(io, SPLASH_CACHE_FILE))
+		return EFI_NOT_FOUND;
+
+	ret = uefi_read_file(io, SPLASH_CACHE_FILE, (VOID **)&cache, &size);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = EFI_NOT_FOUND;
+	if (size < sizeof(*cache) || cache->magic != SPLASH_CACHE_MAGIC ||
+	    cache->image_crc != image_crc ||
+	    cache->screen_width != graphic.width ||
+	    cache->screen_height != graphic.height ||
+	    (UINT64)cache->x + cache->width > graphic.width ||
+	    (UINT64)cache->y + cache->height > graphic.height ||
+	    size != sizeof(*cache) + ui_get_blt_size(cache->width, cache->height))
+		goto out;
+
+	if (crc32_update(0, cache->blt, size - sizeof(*cache)) != cache->blt_crc) {
+		ret = EFI_COMPROMISED_DATA;
+		goto out;
+	}
+
+	ret = ui_draw_blt(cache->blt, cache->x, cache->y,
+			  cache->width, cache->height);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to display image %a", image->name);
+
+out:
+	FreePool(cache);
+	return ret;
+}
+
+static void splash_cache_save(ui_image_t *image, UINT32 image_crc,
+			      UINTN x, UINTN y)
+{
+	EFI_STATUS ret;
+	EFI_FILE_IO_INTERFACE *io;
+	struct splash_cache *cache;
+	UINTN blt_size, size;
+
+	blt_size = ui_get_blt_size(image->width, image->height);
+	size = sizeof(*cache) + blt_size;
+	cache = AllocatePool(size);
+	if (!cache)
+		return;
+
+	cache->magic = SPLASH_CACHE_MAGIC;
+	cache->image_crc = image_crc;
+	cache->screen_width = graphic.width;
+	cache->screen_height = graphic.height;
+	cache->x = x;
+	cache->y = y;
+	cache->width = image->width;
+	cache->height = image->height;
+	memcpy(cache->blt, image->blt, blt_size);
+	cache->blt_crc = crc32_update(0, cache->blt, blt_size);
+
+	ret = get_esp_fs(&io);
+	if (EFI_ERROR(ret))
+		goto out;
+
+	/* The file is not truncated by uefi_write_file() */
+	if (uefi_exist_file_root(io, SPLASH_CACHE_FILE))
+		uefi_delete_file(io, SPLASH_CACHE_FILE);
+
+	ret = uefi_write_file(io, SPLASH_CACHE_FILE, cache, &size);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to save the splash cache");
+
+out:
+	FreePool(cache);
+}
+
+static EFI_STATUS splash_draw_and_save(ui_image_t *image, UINT32 image_crc,
+				       UINTN x, UINTN y, UINTN width, UINTN height)
+{
+	EFI_STATUS ret;
+	ui_image_t scaled;
+
+	ret = ui_image_scale(image, width, height, &scaled);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	ret = ui_image_draw(&scaled, x, y);
+	if (!EFI_ERROR(ret))
+		splash_cache_save(&scaled, image_crc, x, y);
+
+	FreePool(scaled.blt);
+	return ret;
+}
+#endif
 
+/* Clear the screen and look for the vendor splash.  *VENDOR is set
+   to NULL if the splash has been drawn from the cache.  */
+static EFI_STATUS splash_prepare(ui_image_t **vendor)
+{
 	if (!ui_is_ready())
 		return EFI_UNSUPPORTED;
 
 	ui_clear_screen();
 
-	/* Vendor splash */
-	vendor = ui_image_get(VENDOR_IMG_NAME);
-	if (!vendor) {
+	*vendor = ui_image_find(VENDOR_IMG_NAME);
+	if (!*vendor) {
 		efi_perror(EFI_UNSUPPORTED, L"Unable to get '%a' image",
 			   VENDOR_IMG_NAME);
 		return EFI_UNSUPPORTED;
 	}
 
+#ifdef USE_SPLASH_CACHE
+	splash.image_crc = crc32_update(0, (*vendor)->data, (*vendor)->size);
+	if (!EFI_ERROR(splash_cache_draw(*vendor, splash.image_crc)))
+		*vendor = NULL;
+#endif
+
+	return EFI_SUCCESS;
+}
+
+/* Scale and draw the decoded vendor splash */
+static EFI_STATUS splash_draw(ui_image_t *vendor)
+{
+	UINTN width, height, x, y, max_size;
+
 	if (!vendor->width || !vendor->height) {
 		efi_perror(EFI_UNSUPPORTED, L"'%a' image has invalid dimensions",
 			   VENDOR_IMG_NAME);
@@ -208,11 +491,102 @@ EFI_STATUS ui_display_vendor_splash(VOID)
 	x = (graphic.width / 2) - (width / 2);
 	y = (graphic.height / 2) - (height / 2);
 
+#ifdef USE_SPLASH_CACHE
+	return splash_draw_and_save(vendor, splash.image_crc, x, y, width, height);
+#else
 	return ui_image_draw_scale(vendor, x, y , width, height);
+#endif
+}
+
+EFI_STATUS ui_display_vendor_splash(VOID)
+{
+	EFI_STATUS ret;
+	ui_image_t *vendor;
+
+	ui_vendor_splash_join();
+
+	ret = splash_prepare(&vendor);
+	if (EFI_ERROR(ret) || !vendor)
+		return ret;
+
+	/* Vendor splash */
+	if (!ui_image_get(VENDOR_IMG_NAME)) {
+		efi_perror(EFI_UNSUPPORTED, L"Unable to get '%a' image",
+			   VENDOR_IMG_NAME);
+		return EFI_UNSUPPORTED;
+	}
+
+	return splash_draw(vendor);
+}
+
+static void splash_decode(UINTN start _unused, UINTN end _unused, VOID *ctx)
+{
+	upng_load_run(ctx);
+}
+
+EFI_STATUS ui_display_vendor_splash_async(VOID)
+{
+	EFI_STATUS ret;
+	ui_image_t *vendor;
+
+	ui_vendor_splash_join();
+
+	ret = splash_prepare(&vendor);
+	if (EFI_ERROR(ret) || !vendor)
+		return ret;
+
+	if (vendor->blt)
+		return splash_draw(vendor);
+
+	ret = upng_load_start(vendor->data, vendor->size, &splash.upng,
+			      &vendor->width, &vendor->height);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to load image %a", vendor->name);
+		return ret;
+	}
+
+	ret = mp_pool_start_detached(1, 1, splash_decode, splash.upng,
+				     &splash.status);
+	if (EFI_ERROR(ret)) {
+		upng_load_run(splash.upng);
+		splash.status = EFI_SUCCESS;
+	}
+
+	splash.image = vendor;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS ui_vendor_splash_join(VOID)
+{
+	ui_image_t *vendor = splash.image;
+	EFI_STATUS ret;
+
+	if (!vendor)
+		return EFI_SUCCESS;
+
+	splash.image = NULL;
+
+	/* The decoder may still be in use, it is leaked */
+	ret = mp_pool_join(&splash.status);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to decode image %a", vendor->name);
+		return ret;
+	}
+
+	ret = upng_load_end(splash.upng, &vendor->blt);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to load image %a", vendor->name);
+		return ret;
+	}
+
+	return splash_draw(vendor);
 }
 
 void ui_free(void)
 {
+	ui_vendor_splash_join();
+	ui_font_free_glyphs();
+
 	if (!default_textarea)
 		return;
 
@@ -239,6 +613,14 @@ EFI_STATUS ui_fill_area(UINTN x, UINTN y, UINTN width, UINTN height,
 	if (!ui_is_ready())
 		return EFI_UNSUPPORTED;
 
+	if (splash.image)
+		ui_vendor_splash_join();
+
+	if (fb_usable(x, y, width, height)) {
+		fb_fill(color, x, y, width, height);
+		return EFI_SUCCESS;
+	}
+
 	return uefi_call_wrapper(graphic.output->Blt, 10, graphic.output,
 				 color, EfiBltVideoFill, 0, 0, x, y, width, height, 0);
 }
@@ -294,8 +676,44 @@ EFI_STATUS ui_draw_blt(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, UINTN x, UINTN y,
 	if (!graphic.output)
 		return EFI_UNSUPPORTED;
 
-	ret = uefi_call_wrapper(graphic.output->Blt, 10, graphic.output, blt, EfiBltBufferToVideo,
-				0, 0, x, y, width, height, 0);
+	if (splash.image)
+		ui_vendor_splash_join();
+
+	boottrace_begin(BT_UI_DRAW, width * height);
+	if (fb_usable(x, y, width, height)) {
+		fb_draw(blt, width, 0, 0, x, y, width, height);
+		ret = EFI_SUCCESS;
+	} else
+		ret = uefi_call_wrapper(graphic.output->Blt, 10, graphic.output, blt,
+					EfiBltBufferToVideo, 0, 0, x, y, width, height, 0);
+	boottrace_end(BT_UI_DRAW, width * height);
+	if (EFI_ERROR(ret))
+		efi_perror(ret, L"Failed to display blt");
+
+	return ret;
+}
+
+EFI_STATUS ui_draw_blt_rect(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt, UINTN blt_width,
+			    UINTN src_x, UINTN src_y, UINTN x, UINTN y,
+			    UINTN width, UINTN height)
+{
+	EFI_STATUS ret;
+
+	if (!graphic.output)
+		return EFI_UNSUPPORTED;
+
+	if (splash.image)
+		ui_vendor_splash_join();
+
+	boottrace_begin(BT_UI_DRAW, width * height);
+	if (fb_usable(x, y, width, height)) {
+		fb_draw(blt, blt_width, src_x, src_y, x, y, width, height);
+		ret = EFI_SUCCESS;
+	} else
+		ret = uefi_call_wrapper(graphic.output->Blt, 10, graphic.output, blt,
+					EfiBltBufferToVideo, src_x, src_y, x, y,
+					width, height, blt_width * sizeof(*blt));
+	boottrace_end(BT_UI_DRAW, width * height);
 	if (EFI_ERROR(ret))
 		efi_perror(ret, L"Failed to display blt");
 
@@ -341,7 +759,7 @@ static void ui_internal_print(CHAR16 *fmt, va_list args, EFI_GRAPHICS_OUTPUT_BLT
 		return;
 
 	ui_textarea_newline(default_textarea, str, color, FALSE);
-	ui_textarea_draw(default_textarea, default_textarea_x, default_textarea_y);
+	ui_textarea_update(default_textarea, default_textarea_x, default_textarea_y);
 }
 
 static BOOLEAN no_newline = FALSE;
@@ -369,7 +787,7 @@ static void ui_internal_print_n(CHAR16 *fmt, va_list args, EFI_GRAPHICS_OUTPUT_B
 		return;
 
 	ui_textarea_n(default_textarea, str, color, FALSE);
-	ui_textarea_draw(default_textarea, default_textarea_x, default_textarea_y);
+	ui_textarea_update(default_textarea, default_textarea_x, default_textarea_y);
 }
 
 void ui_print(CHAR16 *fmt, ...)
@@ -467,7 +885,10 @@ static BOOLEAN test_key(BOOLEAN check_code, ui_events_t event)
 	EFI_STATUS ret = EFI_SUCCESS;
 	BOOLEAN result = TRUE;
 
-	uefi_call_wrapper(BS->Stall, 1, get_hold_key_stall_time() * 1000);
+	/* A held key repeats: no key stroke within the stall time means
+	 * it has been released */
+	if (!wait_for_key(get_hold_key_stall_time() * 1000))
+		return FALSE;
 
 	ret = uefi_call_wrapper(ST->ConIn->ReadKeyStroke, 2,
 					ST->ConIn, &key);
@@ -491,17 +912,33 @@ static BOOLEAN test_key(BOOLEAN check_code, ui_events_t event)
 
 BOOLEAN ui_enforce_key_held(UINT32 milliseconds, ui_events_t event)
 {
-	BOOLEAN ret = TRUE;
-	UINT32 i;
-	int stall_time = get_hold_key_stall_time();
+	EFI_STATUS ret;
+	EFI_EVENT deadline;
+	BOOLEAN held;
 
-	for (i = 0; i < (milliseconds / stall_time); i++) {
-		ret = test_key(TRUE, event);
-		if (!ret) {
-			break;
-		}
+	ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0,
+				NULL, NULL, &deadline);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to create the key hold timer");
+		return FALSE;
 	}
-	return ret;
+
+	ret = uefi_call_wrapper(BS->SetTimer, 3, deadline, TimerRelative,
+				(UINT64)milliseconds * 10000);
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to set the key hold timer");
+		uefi_call_wrapper(BS->CloseEvent, 1, deadline);
+		return FALSE;
+	}
+
+	/* The key must keep repeating until the deadline */
+	do {
+		held = test_key(TRUE, event);
+	} while (held && uefi_call_wrapper(BS->CheckEvent, 1, deadline)
+		 == EFI_NOT_READY);
+
+	uefi_call_wrapper(BS->CloseEvent, 1, deadline);
+	return held;
 }
 
 void ui_wait_for_key_release(void)
@@ -511,25 +948,55 @@ void ui_wait_for_key_release(void)
 
 ui_events_t ui_wait_for_event(UINTN timeout_secs, ui_events_t expected)
 {
-	UINT64 timeout_left;
-
-	timeout_left = timeout_secs * 1000000;
+	EFI_STATUS ret;
+	EFI_EVENT events[2];
+	UINTN nb_events = 1, index;
+	ui_events_t event = EV_TIMEOUT;
 
 	ui_wait_for_key_release();
-	do {
-		ui_events_t event = ui_read_input();
+
+	/* Sleep until a key stroke or the timeout, a zero timeout
+	 * waits forever */
+	events[0] = ST->ConIn->WaitForKey;
+	if (timeout_secs) {
+		ret = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0,
+					NULL, NULL, &events[1]);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to create the input timer");
+			return EV_TIMEOUT;
+		}
+		ret = uefi_call_wrapper(BS->SetTimer, 3, events[1],
+					TimerRelative,
+					(UINT64)timeout_secs * 10000000);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to set the input timer");
+			goto out;
+		}
+		nb_events++;
+	}
+
+	for (;;) {
+		ret = uefi_call_wrapper(BS->WaitForEvent, 3, nb_events,
+					events, &index);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to wait for an input");
+			break;
+		}
+		if (index != 0)
+			break;
+
+		/* Ignore the keys we don't care about */
+		event = ui_read_input();
 		if (event != EV_NONE &&
 		    (expected == EV_ANY || event == expected))
-			return event;
-
-		/* If we get here, either we had EFI_NOT_READY indicating
-		 * no pending keystroke, EFI_DEVICE_ERROR, or some key
-		 * we don't care about was pressed */
-		uefi_call_wrapper(BS->Stall, 1, NOT_READY_USECS);
-		timeout_left -= NOT_READY_USECS;
-	} while (timeout_left || timeout_secs == 0);
+			break;
+		event = EV_TIMEOUT;
+	}
 
-	return EV_TIMEOUT;
+out:
+	if (timeout_secs)
+		uefi_call_wrapper(BS->CloseEvent, 1, events[1]);
+	return event;
 }
 
 ui_events_t ui_wait_for_input(UINTN timeout_secs)
@@ -593,30 +1060,157 @@ void ui_get_scaled_dimension(UINTN orig_width, UINTN orig_height,
  *				f(Q21)(x-x1)(y2-y) +
  *				f(Q12)(x2-x)(y-y1) +
  *				f(Q22)(x-x1)(y-y1))
+ *
+ * The source coordinates are computed in 16.16 fixed point and the
+ * interpolation weights are 8 bits.  As x2 - x1 = y2 - y1 = 1, the
+ * interpolation is done along x then along y.
  */
+#define SCALE_FRAC_BITS		16
+#define WEIGHT_BITS		8
+#define WEIGHT_ONE		(1 << WEIGHT_BITS)
+
+static inline UINT32 scale_weight(UINT64 pos)
+{
+	return (pos >> (SCALE_FRAC_BITS - WEIGHT_BITS)) & (WEIGHT_ONE - 1);
+}
+
+/* The four bytes of a BGRA pixel are spread in 16-bit lanes so that
+   all of them are interpolated with two multiplications.  */
+static inline UINT64 pixel_spread(UINT32 p)
+{
+	return (p & 0x00ff00ff) | ((UINT64)(p & 0xff00ff00) << 24);
+}
+
+static inline UINT32 pixel_pack(UINT64 l)
+{
+	return (l & 0x00ff00ff) | ((l >> 24) & 0xff00ff00);
+}
+
+static inline UINT64 lanes_lerp(UINT64 a, UINT64 b, UINT32 w)
+{
+	return ((a * (WEIGHT_ONE - w) + b * w) >> WEIGHT_BITS) &
+		0x00ff00ff00ff00ffULL;
+}
+
+/* Integer ratio upscale: each pixel becomes a RATIO x RATIO square */
+static void scale_replicate(UINT32 *s, UINT32 *d, int sx, int sy, int ratio)
+{
+	UINT32 *line;
+	int i, j, k;
+
+	for (i = 0; i < sy; i++) {
+		line = d;
+		for (j = 0; j < sx; j++)
+			for (k = 0; k < ratio; k++)
+				*d++ = s[j];
+		for (k = 1; k < ratio; k++, d += sx * ratio)
+			memcpy(d, line, sx * ratio * sizeof(*d));
+		s += sx;
+	}
+}
+
+/* Interpolate source line S along x into the spread pixels L */
+static void scale_line(UINT32 *s, UINT64 *l, UINT32 *xtab, int sx, int dx)
+{
+	UINT32 x1, x2;
+	int j;
+
+	for (j = 0; j < dx; j++) {
+		x1 = xtab[j] >> WEIGHT_BITS;
+		x2 = min(x1 + 1, (UINT32)sx - 1);
+		l[j] = lanes_lerp(pixel_spread(s[x1]), pixel_spread(s[x2]),
+				  xtab[j] & (WEIGHT_ONE - 1));
+	}
+}
+
+/* Separable BGRA scaler.  The source column and weight of each
+   destination column are computed once, and the source lines
+   interpolated along x are kept for the next destination lines.  */
+static BOOLEAN scale_bgra(UINT32 *s, UINT32 *d, int sx, int sy, int dx, int dy)
+{
+	UINT64 ratio_x = ((UINT64)(sx - 1) << SCALE_FRAC_BITS) / dx;
+	UINT64 ratio_y = ((UINT64)(sy - 1) << SCALE_FRAC_BITS) / dy;
+	UINT64 *lines[2], *tmp, y;
+	INTN cached[2] = { -1, -1 };
+	UINT32 *xtab, fy;
+	INTN y1, y2;
+	int i, j;
+
+	xtab = AllocatePool((dx + 1) * sizeof(*xtab) + 2 * dx * sizeof(**lines));
+	if (!xtab)
+		return FALSE;
+	lines[0] = (UINT64 *)(xtab + dx + (dx & 1));
+	lines[1] = lines[0] + dx;
+
+	for (j = 0; j < dx; j++)
+		xtab[j] = (((j * ratio_x) >> SCALE_FRAC_BITS) << WEIGHT_BITS) |
+			scale_weight(j * ratio_x);
+
+	for (i = 0; i < dy; i++) {
+		y = i * ratio_y;
+		y1 = y >> SCALE_FRAC_BITS;
+		y2 = min(y1 + 1, (INTN)sy - 1);
+		fy = scale_weight(y);
+
+		if (cached[0] != y1 && cached[1] == y1) {
+			tmp = lines[0];
+			lines[0] = lines[1];
+			lines[1] = tmp;
+			cached[1] = cached[0];
+			cached[0] = y1;
+		}
+		if (cached[0] != y1) {
+			scale_line(s + y1 * sx, lines[0], xtab, sx, dx);
+			cached[0] = y1;
+		}
+		if (cached[1] != y2) {
+			scale_line(s + y2 * sx, lines[1], xtab, sx, dx);
+			cached[1] = y2;
+		}
+
+		for (j = 0; j < dx; j++)
+			*d++ = pixel_pack(lanes_lerp(lines[0][j], lines[1][j], fy));
+	}
+
+	FreePool(xtab);
+	return TRUE;
+}
+
 void ui_bilinear_scale(unsigned char *s, unsigned char *d,
 		       int sx, int sy, int dx, int dy,
 		       int depth)
 {
-	double ratio_x = (double)(sx - 1) / dx;
-	double ratio_y = (double)(sy - 1) / dy;
-	int i, j, k;
-	sx *= depth;
-	for (i = 0; i < dy; i++ )
+	UINT64 ratio_x = ((UINT64)(sx - 1) << SCALE_FRAC_BITS) / dx;
+	UINT64 ratio_y = ((UINT64)(sy - 1) << SCALE_FRAC_BITS) / dy;
+	UINT32 fx, fy, top, bottom;
+	int i, j, k, x1, x2, y1, y2;
+
+	if (depth == sizeof(UINT32)) {
+		if (dx == dy / sy * sx && dy % sy == 0 && dy / sy > 1) {
+			scale_replicate((UINT32 *)s, (UINT32 *)d, sx, sy, dy / sy);
+			return;
+		}
+		if (scale_bgra((UINT32 *)s, (UINT32 *)d, sx, sy, dx, dy))
+			return;
+	}
+
+	for (i = 0; i < dy; i++) {
+		y1 = (i * ratio_y) >> SCALE_FRAC_BITS;
+		y2 = min(y1 + 1, sy - 1);
+		fy = scale_weight(i * ratio_y);
 		for (j = 0; j < dx; j++) {
-			double x = j * ratio_x;
-			double y = i * ratio_y;
-			int x1 = x;
-			int x2 = x1 + 1;
-			int y1 = y;
-			int y2 = y1 + 1;
+			x1 = (j * ratio_x) >> SCALE_FRAC_BITS;
+			x2 = min(x1 + 1, sx - 1);
+			fx = scale_weight(j * ratio_x);
 			for (k = 0; k < depth; k++) {
-				d[j * depth + i * dx * depth + k] = (1 / ((x2 - x1) * (y2 - y1))) *
-					(s[x1 * depth + y1 * sx + k] * (x2 - x) * (y2 - y) +
-					 s[x2 * depth + y1 * sx + k] * (x - x1) * (y2 - y) +
-					 s[x1 * depth + y2 * sx + k] * (x2 - x) * (y - y1) +
-					 s[x2 * depth + y2 * sx + k] * (x - x1) * (y - y1));
+				top = s[(y1 * sx + x1) * depth + k] * (WEIGHT_ONE - fx) +
+					s[(y1 * sx + x2) * depth + k] * fx;
+				bottom = s[(y2 * sx + x1) * depth + k] * (WEIGHT_ONE - fx) +
+					s[(y2 * sx + x2) * depth + k] * fx;
+				*d++ = (top * (WEIGHT_ONE - fy) + bottom * fy) >>
+					(2 * WEIGHT_BITS);
 			}
 		}
+	}
 }
 
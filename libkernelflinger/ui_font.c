@@ -62,3 +62,149 @@ ui_font_t *ui_font_get(char *name)
 
 	return NULL;
 }
+
+/* Pre-blended glyphs cache.  Text is always drawn over a uniform
+   background, the blended glyph only depends on the font, the
+   character, the style and the two colors.  The cache is direct
+   mapped: a conflicting glyph replaces the previous one.  */
+#define GLYPH_CACHE_SIZE 128
+
+typedef struct glyph {
+	ui_font_t *font;
+	char c;
+	BOOLEAN bold;
+	UINT32 color;
+	UINT32 bg;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *tile;
+	UINTN tile_size;
+} glyph_t;
+
+static glyph_t glyph_cache[GLYPH_CACHE_SIZE];
+
+#define PIXEL_RGB_MASK 0x00ffffff
+
+/* Spread a BGRA pixel in four 16 bits lanes so that the channels can
+   be multiplied by an alpha value at once */
+static inline UINT64 pixel_spread(UINT32 p)
+{
+	return (p & 0x00ff00ff) | ((UINT64)(p & 0xff00ff00) << 24);
+}
+
+static inline UINT32 pixel_pack(UINT64 l)
+{
+	return (l & 0x00ff00ff) | ((l >> 24) & 0xff00ff00);
+}
+
+static inline UINT32 pixel_value(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *pixel)
+{
+	UINT32 value;
+
+	memcpy(&value, pixel, sizeof(value));
+	return value;
+}
+
+/* Blend COLOR, already spread, with an A alpha over the DST pixel.
+   The reserved byte of DST is preserved.  (x + 1 + (x >> 8)) >> 8 is
+   x / 255 for all the x values a lane can hold.  */
+static inline UINT32 pixel_blend(UINT32 dst, UINT64 color, UINT32 a)
+{
+	UINT64 l;
+
+	if (a == 0)
+		return dst;
+	if (a == 255)
+		return (pixel_pack(color) & PIXEL_RGB_MASK) | (dst & ~PIXEL_RGB_MASK);
+
+	l = pixel_spread(dst) * (255 - a) + color * a;
+	l = ((l + 0x0001000100010001ULL + ((l >> 8) & 0x00ff00ff00ff00ffULL)) >> 8) &
+		0x00ff00ff00ff00ffULL;
+
+	return (pixel_pack(l) & PIXEL_RGB_MASK) | (dst & ~PIXEL_RGB_MASK);
+}
+
+static unsigned char *glyph_texture(ui_font_t *font, char c, BOOLEAN bold)
+{
+	return font->texture + (c - 0x20) * font->cwidth +
+		(bold ? font->cheight * font->width : 0);
+}
+
+void ui_font_blend_glyph(ui_font_t *font, char c, BOOLEAN bold,
+			 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
+			 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *dst, UINTN dst_width)
+{
+	unsigned char *src = glyph_texture(font, c, bold);
+	UINT64 lanes = pixel_spread(pixel_value(color));
+	UINT32 *d = (UINT32 *)dst;
+	UINTN i, j;
+
+	for (j = 0; j < font->cheight; j++) {
+		for (i = 0; i < font->cwidth; i++)
+			d[i] = pixel_blend(d[i], lanes, src[i]);
+		src += font->width;
+		d += dst_width;
+	}
+}
+
+static UINTN glyph_hash(ui_font_t *font, char c, BOOLEAN bold,
+			UINT32 color, UINT32 bg)
+{
+	UINT32 h;
+
+	h = (UINT32)(UINTN)font ^ (UINT8)c ^ (bold ? 0x80 : 0);
+	h ^= color * 0x9e3779b1;
+	h ^= bg * 0x85ebca77;
+	h ^= h >> 16;
+
+	return h % GLYPH_CACHE_SIZE;
+}
+
+EFI_GRAPHICS_OUTPUT_BLT_PIXEL *ui_font_get_glyph(ui_font_t *font, char c, BOOLEAN bold,
+						 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
+						 EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg)
+{
+	UINT32 color_value = pixel_value(color), bg_value = pixel_value(bg);
+	glyph_t *glyph;
+	UINTN size, i;
+	UINT32 *tile;
+
+	glyph = &glyph_cache[glyph_hash(font, c, bold, color_value, bg_value)];
+	if (glyph->tile && glyph->font == font && glyph->c == c &&
+	    glyph->bold == bold && glyph->color == color_value &&
+	    glyph->bg == bg_value)
+		return glyph->tile;
+
+	size = font->cwidth * font->cheight;
+	if (glyph->tile_size != size) {
+		if (glyph->tile)
+			FreePool(glyph->tile);
+		glyph->tile_size = 0;
+		glyph->tile = AllocatePool(size * sizeof(*glyph->tile));
+		if (!glyph->tile)
+			return NULL;
+		glyph->tile_size = size;
+	}
+
+	tile = (UINT32 *)glyph->tile;
+	for (i = 0; i < size; i++)
+		tile[i] = bg_value;
+	ui_font_blend_glyph(font, c, bold, color, glyph->tile, font->cwidth);
+
+	glyph->font = font;
+	glyph->c = c;
+	glyph->bold = bold;
+	glyph->color = color_value;
+	glyph->bg = bg_value;
+
+	return glyph->tile;
+}
+
+void ui_font_free_glyphs(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(glyph_cache); i++)
+		if (glyph_cache[i].tile)
+			FreePool(glyph_cache[i].tile);
+
+	memset(glyph_cache, 0, sizeof(glyph_cache));
+}
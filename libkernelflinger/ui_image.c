@@ -40,19 +40,26 @@
 
 #include "res/img_res.h"
 
-ui_image_t *ui_image_get(const char *name)
+ui_image_t *ui_image_find(const char *name)
 {
 	unsigned int i;
-	EFI_STATUS ret;
-	ui_image_t *img = NULL;
 
 	for (i = 0 ; i < ARRAY_SIZE(ui_images) ; i++)
 		if (!strcmp((CHAR8 *)ui_images[i].name, (CHAR8 *)name))
-			break;
-	if (i == ARRAY_SIZE(ui_images))
+			return &ui_images[i];
+
+	return NULL;
+}
+
+ui_image_t *ui_image_get(const char *name)
+{
+	EFI_STATUS ret;
+	ui_image_t *img;
+
+	img = ui_image_find(name);
+	if (!img)
 		return NULL;
 
-	img = &ui_images[i];
 	if (!img->blt) {
 		ret = upng_load(img->data, img->size,
 				&img->blt, &img->width, &img->height);
@@ -75,39 +82,57 @@ EFI_STATUS ui_image_draw(ui_image_t *image, UINTN x, UINTN y)
 	return ret;
 }
 
-EFI_STATUS ui_image_draw_scale(ui_image_t *image, UINTN x, UINTN y, UINTN width, UINTN height)
+EFI_STATUS ui_image_scale(ui_image_t *image, UINTN width, UINTN height,
+			  ui_image_t *scaled)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
-	ui_image_t to_draw;
 	UINTN new_width, new_height;
 
 	ui_get_scaled_dimension(image->width, image->height,
 				width, height, &new_width, &new_height);
 
-	if (new_width == image->width && new_height == image->height)
-		return ui_image_draw(image, x, y);
-
-	memcpy(&to_draw, image, sizeof(to_draw));
-	to_draw.blt = AllocatePool(ui_get_blt_size(new_width, new_height));
-	if (!to_draw.blt) {
-		ret = EFI_OUT_OF_RESOURCES;
-		efi_perror(ret, L"Failed to allocate buffer");
-		goto out;
+	memcpy(scaled, image, sizeof(*scaled));
+	scaled->blt = AllocatePool(ui_get_blt_size(new_width, new_height));
+	if (!scaled->blt) {
+		efi_perror(EFI_OUT_OF_RESOURCES, L"Failed to allocate buffer");
+		return EFI_OUT_OF_RESOURCES;
 	}
 
-	to_draw.width = new_width;
-	to_draw.height = new_height;
+	scaled->width = new_width;
+	scaled->height = new_height;
+
+	if (new_width == image->width && new_height == image->height) {
+		memcpy(scaled->blt, image->blt,
+		       ui_get_blt_size(new_width, new_height));
+		return EFI_SUCCESS;
+	}
 
 	ui_bilinear_scale((unsigned char *)image->blt,
-			  (unsigned char *)to_draw.blt,
+			  (unsigned char *)scaled->blt,
 			  image->width, image->height,
-			  to_draw.width, to_draw.height,
+			  scaled->width, scaled->height,
 			  sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
 
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS ui_image_draw_scale(ui_image_t *image, UINTN x, UINTN y, UINTN width, UINTN height)
+{
+	EFI_STATUS ret;
+	ui_image_t to_draw;
+	UINTN new_width, new_height;
+
+	ui_get_scaled_dimension(image->width, image->height,
+				width, height, &new_width, &new_height);
+
+	if (new_width == image->width && new_height == image->height)
+		return ui_image_draw(image, x, y);
+
+	ret = ui_image_scale(image, width, height, &to_draw);
+	if (EFI_ERROR(ret))
+		return ret;
+
 	ret = ui_image_draw(&to_draw, x, y);
+	FreePool(to_draw.blt);
 
-out:
-	if (to_draw.blt)
-		FreePool(to_draw.blt);
 	return ret;
 }
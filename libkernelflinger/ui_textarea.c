@@ -57,7 +57,7 @@ ui_textarea_t *ui_textarea_create(UINTN line_nb, UINTN row_nb, ui_font_t *font,
 				  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color,
 				  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color)
 {
-	UINTN text_size;
+	UINTN text_size, i;
 
 	if (!font)
 		font = ui_font_get_default();
@@ -83,6 +83,18 @@ ui_textarea_t *ui_textarea_create(UINTN line_nb, UINTN row_nb, ui_font_t *font,
 		return NULL;
 	}
 
+	textarea->drawn = AllocateZeroPool(line_nb * (sizeof(*textarea->drawn) + row_nb));
+	if (!textarea->drawn) {
+		FreePool(textarea->text);
+		FreePool(textarea->blt);
+		FreePool(textarea);
+		return NULL;
+	}
+	for (i = 0; i < line_nb; i++)
+		textarea->drawn[i].chars = (char *)(textarea->drawn + line_nb) + i * row_nb;
+
+	textarea->drawn_valid = FALSE;
+	textarea->on_screen = FALSE;
 	textarea->current = -1;
 	textarea->color = color;
 	textarea->bg_color = bg_color;
@@ -90,84 +102,173 @@ ui_textarea_t *ui_textarea_create(UINTN line_nb, UINTN row_nb, ui_font_t *font,
 	return textarea;
 }
 
-static void ui_textarea_copy_char(unsigned char *src_p, UINTN src_row_bytes,
-				  unsigned char *dst_p, UINTN dst_row_bytes,
-				  int width, int height,
-				  EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color)
+/* Fill N pixels with BG_COLOR, black if NULL */
+static void ui_textarea_fill(EFI_GRAPHICS_OUTPUT_BLT_PIXEL *dst, UINTN n,
+			     EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color)
 {
-	int i, j;
-
-	for (j = 0; j < height; ++j) {
-		unsigned char* sx = src_p;
-		unsigned char* px = dst_p;
-		for (i = 0; i < width; ++i) {
-			unsigned char a = *sx++;
-			if (a == 255) {
-				*px++ = color->Blue;
-				*px++ = color->Green;
-				*px++ = color->Red;
-				px++;
-			} else if (a > 0) {
-				*px = (*px * (255-a) + color->Blue * a) / 255;
-				++px;
-				*px = (*px * (255-a) + color->Green * a) / 255;
-				++px;
-				*px = (*px * (255-a) + color->Red * a) / 255;
-				++px;
-				++px;
-			} else {
-				px += 4;
-			}
-		}
-		src_p += src_row_bytes;
-		dst_p += dst_row_bytes;
+	UINT32 pixel, *p = (UINT32 *)dst;
+
+	if (!bg_color) {
+		ZeroMem(dst, n * sizeof(*dst));
+		return;
+	}
+
+	memcpy(&pixel, bg_color, sizeof(pixel));
+	while (n--)
+		*p++ = pixel;
+}
+
+/* Characters of the text line CUR as displayed: 0 for the columns
+   without glyph */
+static void ui_textarea_line_chars(ui_textarea_t *textarea, UINTN cur,
+				   char *chars)
+{
+	unsigned char *s = (unsigned char *)textarea->text[cur].str;
+	UINTN j;
+
+	for (j = 0; j < textarea->row_nb; j++) {
+		chars[j] = s && *s > 0x20 && *s <= 0x7E ? *s : 0;
+		if (s && *s)
+			s++;
 	}
 }
 
-static void ui_textarea_refresh_blt(ui_textarea_t *textarea)
+static void ui_textarea_line_style(ui_textarea_t *textarea, UINTN cur,
+				   ui_textarea_line_t *line)
 {
-	UINTN cur, i, j, x, y = 0;
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color = textarea->color;
+
+	if (textarea->text[cur].color)
+		color = textarea->text[cur].color;
+
+	if (color)
+		line->color = *color;
+	else
+		ZeroMem(&line->color, sizeof(line->color));
+	line->bold = textarea->text[cur].bold;
+}
+
+static BOOLEAN ui_textarea_line_equal(ui_textarea_t *textarea,
+				      ui_textarea_line_t *a, ui_textarea_line_t *b)
+{
+	return !memcmp(&a->color, &b->color, sizeof(a->color)) &&
+		a->bold == b->bold && !memcmp(a->chars, b->chars, textarea->row_nb);
+}
+
+/* Redraw the FIRST to LAST columns of the line LINE_NB of the BLT
+   buffer */
+static void ui_textarea_draw_line(ui_textarea_t *textarea, UINTN line_nb,
+				  ui_textarea_line_t *line)
+{
+	static EFI_GRAPHICS_OUTPUT_BLT_PIXEL black;
 	ui_font_t *font = textarea->font;
-	UINTN pixel_size = sizeof(*textarea->blt);
-	UINTN row_size = textarea->width * pixel_size;
-	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *color;
-	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *bg_color = textarea->bg_color;
-
-	ZeroMem(textarea->blt,
-		textarea->width * textarea->height * sizeof(*textarea->blt));
-
-	for (i = 1; i <= textarea->line_nb; i++) {
-		cur = (textarea->current + i) % textarea->line_nb;
-
-		color = textarea->color;
-		if (textarea->text[cur].color)
-			color = textarea->text[cur].color;
-
-		if (bg_color) {
-			UINTN x1;
-			for (x1 = 0; x1 < textarea->height * textarea->width; x1++)
-				CopyMem(textarea->blt + x1, bg_color,
-					sizeof(bg_color));
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL *dst, *tile;
+	UINTN i, j;
+
+	dst = textarea->blt + line_nb * font->cheight * textarea->width;
+	for (i = 0; i < font->cheight; i++)
+		ui_textarea_fill(dst + i * textarea->width + line->first * font->cwidth,
+				 (line->last - line->first + 1) * font->cwidth,
+				 textarea->bg_color);
+
+	for (j = line->first; j <= line->last; j++) {
+		if (!line->chars[j])
+			continue;
+
+		tile = ui_font_get_glyph(font, line->chars[j], line->bold, &line->color,
+					 textarea->bg_color ? textarea->bg_color : &black);
+		if (!tile) {
+			ui_font_blend_glyph(font, line->chars[j], line->bold, &line->color,
+					    dst + j * font->cwidth, textarea->width);
+			continue;
+		}
+
+		for (i = 0; i < font->cheight; i++)
+			memcpy(dst + i * textarea->width + j * font->cwidth,
+			       tile + i * font->cwidth, font->cwidth * sizeof(*tile));
+	}
+}
+
+/* Scroll the drawn lines up by one when the text was moved up by a
+   new line, so that only the new last line has to be drawn */
+static BOOLEAN ui_textarea_scroll(ui_textarea_t *textarea, ui_textarea_line_t *line)
+{
+	UINTN i, cur, line_size;
+	char *chars;
+
+	if (textarea->line_nb < 2)
+		return FALSE;
+
+	for (i = 0; i < textarea->line_nb - 1; i++) {
+		cur = (textarea->current + i + 1) % textarea->line_nb;
+		ui_textarea_line_chars(textarea, cur, line->chars);
+		ui_textarea_line_style(textarea, cur, line);
+		if (!ui_textarea_line_equal(textarea, line, &textarea->drawn[i + 1]))
+			return FALSE;
+	}
+
+	line_size = textarea->font->cheight * textarea->width;
+	memmove(textarea->blt, textarea->blt + line_size,
+		(textarea->line_nb - 1) * line_size * sizeof(*textarea->blt));
+
+	chars = textarea->drawn[0].chars;
+	for (i = 0; i < textarea->line_nb - 1; i++)
+		textarea->drawn[i] = textarea->drawn[i + 1];
+	textarea->drawn[i].chars = chars;
+
+	return TRUE;
+}
+
+/* Update the BLT buffer with the current text.  Return TRUE if all
+   of it changed, otherwise the first and last fields of the drawn
+   lines give the changed columns.  */
+static BOOLEAN ui_textarea_refresh_blt(ui_textarea_t *textarea)
+{
+	UINTN cur, i, j;
+	char chars[textarea->row_nb];
+	ui_textarea_line_t line = { .chars = chars }, *drawn;
+	BOOLEAN all = TRUE, scrolled = FALSE;
+
+	if (textarea->drawn && textarea->drawn_valid)
+		all = scrolled = ui_textarea_scroll(textarea, &line);
+
+	for (i = 0; i < textarea->line_nb; i++) {
+		cur = (textarea->current + i + 1) % textarea->line_nb;
+
+		ui_textarea_line_chars(textarea, cur, line.chars);
+		ui_textarea_line_style(textarea, cur, &line);
+		line.first = 0;
+		line.last = textarea->row_nb - 1;
+
+		drawn = textarea->drawn ? &textarea->drawn[i] : NULL;
+		if (drawn && textarea->drawn_valid &&
+		    !(scrolled && i == textarea->line_nb - 1) &&
+		    !memcmp(&line.color, &drawn->color, sizeof(line.color)) &&
+		    line.bold == drawn->bold) {
+			for (j = 0; j < textarea->row_nb && chars[j] == drawn->chars[j]; j++)
+				;
+			line.first = j;
+			for (j = textarea->row_nb; j > line.first && chars[j - 1] == drawn->chars[j - 1]; j--)
+				;
+			line.last = j - 1;
 		}
 
-		unsigned char *s = (unsigned char *)textarea->text[cur].str;
-		for (x = 0, j = 0; s && *s && j < textarea->row_nb; s++, x += font->cwidth, j++) {
-			if (*s <= 0x20 || *s > 0x7E)
-				continue;
-			if (*s == '\n')
-				break;
-
-			unsigned char* src_p = font->texture + ((*s - 0x20) * font->cwidth)
-				+ (textarea->text[cur].bold ? font->cheight * font->width : 0);
-			unsigned char* dst_p = ((unsigned char *)textarea->blt)
-				+ (y * row_size)
-				+ (x * pixel_size);
-
-			ui_textarea_copy_char(src_p, font->width, dst_p, row_size,
-					      font->cwidth, font->cheight, color);
+		if (line.first <= line.last)
+			ui_textarea_draw_line(textarea, i, &line);
+
+		if (drawn) {
+			memcpy(drawn->chars, chars, textarea->row_nb);
+			drawn->color = line.color;
+			drawn->bold = line.bold;
+			drawn->first = line.first;
+			drawn->last = line.last;
 		}
-		y += font->cheight;
 	}
+
+	if (textarea->drawn)
+		textarea->drawn_valid = TRUE;
+
+	return all;
 }
 
 EFI_STATUS ui_textarea_display_text(const ui_textline_t *text, ui_font_t *font,
@@ -196,6 +297,9 @@ EFI_STATUS ui_textarea_display_text(const ui_textline_t *text, ui_font_t *font,
 	textarea.bg_color = bg_color;
 	textarea.font = font;
 	textarea.current = -1;
+	textarea.drawn = NULL;
+	textarea.drawn_valid = FALSE;
+	textarea.on_screen = FALSE;
 
 	ret = ui_textarea_allocate_blt(&textarea);
 	if (EFI_ERROR(ret))
@@ -209,6 +313,7 @@ EFI_STATUS ui_textarea_display_text(const ui_textline_t *text, ui_font_t *font,
 void ui_textarea_free(ui_textarea_t *textarea)
 {
 	ui_textarea_clear(textarea);
+	FreePool(textarea->drawn);
 	FreePool(textarea->blt);
 	FreePool(textarea->text);
 	FreePool(textarea);
@@ -292,6 +397,7 @@ EFI_STATUS ui_textarea_draw_scale(ui_textarea_t *textarea, UINTN x, UINTN *y,
 	EFI_STATUS ret;
 
 	ui_textarea_refresh_blt(textarea);
+	textarea->on_screen = FALSE;
 
 	ui_get_scaled_dimension(textarea->width, textarea->height,
 				width, height, &new_width, &new_height);
@@ -313,6 +419,51 @@ EFI_STATUS ui_textarea_draw_scale(ui_textarea_t *textarea, UINTN x, UINTN *y,
 
 EFI_STATUS ui_textarea_draw(ui_textarea_t *textarea, UINTN x, UINTN y)
 {
+	EFI_STATUS ret;
+
 	ui_textarea_refresh_blt(textarea);
-	return ui_draw_blt(textarea->blt, x, y, textarea->width, textarea->height);
+	ret = ui_draw_blt(textarea->blt, x, y, textarea->width, textarea->height);
+
+	textarea->on_screen = !EFI_ERROR(ret);
+	textarea->screen_x = x;
+	textarea->screen_y = y;
+
+	return ret;
+}
+
+EFI_STATUS ui_textarea_update(ui_textarea_t *textarea, UINTN x, UINTN y)
+{
+	EFI_STATUS ret;
+	ui_textarea_line_t *line;
+	UINTN i, cwidth, cheight;
+
+	if (!textarea->drawn || !textarea->on_screen ||
+	    textarea->screen_x != x || textarea->screen_y != y)
+		return ui_textarea_draw(textarea, x, y);
+
+	if (ui_textarea_refresh_blt(textarea)) {
+		ret = ui_draw_blt(textarea->blt, x, y, textarea->width, textarea->height);
+		textarea->on_screen = !EFI_ERROR(ret);
+		return ret;
+	}
+
+	cwidth = textarea->font->cwidth;
+	cheight = textarea->font->cheight;
+	for (i = 0; i < textarea->line_nb; i++) {
+		line = &textarea->drawn[i];
+		if (line->first > line->last)
+			continue;
+
+		ret = ui_draw_blt_rect(textarea->blt, textarea->width,
+				       line->first * cwidth, i * cheight,
+				       x + line->first * cwidth, y + i * cheight,
+				       (line->last - line->first + 1) * cwidth,
+				       cheight);
+		if (EFI_ERROR(ret)) {
+			textarea->on_screen = FALSE;
+			return ret;
+		}
+	}
+
+	return EFI_SUCCESS;
 }
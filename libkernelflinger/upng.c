@@ -70,6 +70,16 @@
 #define DISTANCE_BUFFER_SIZE		(NUM_DISTANCE_SYMBOLS * 2)
 #define CODE_LENGTH_BUFFER_SIZE		(NUM_DISTANCE_SYMBOLS * 2)
 
+/* Codes of up to HUFFMAN_FAST_BITS bits are decoded with a single
+   table lookup, longer codes walk the tree */
+#define HUFFMAN_FAST_BITS	9
+#define HUFFMAN_FAST_SIZE	(1 << HUFFMAN_FAST_BITS)
+
+/* The inflate input buffer is followed by INFLATE_PADDING zero bytes
+   so that the 64-bit bit window can be loaded anywhere the decoder
+   bound checks let the bit pointer go */
+#define INFLATE_PADDING 32
+
 #define SET_ERROR(upng,code) do { \
 		(upng)->error = (code); \
 		(upng)->error_line = __LINE__; \
@@ -114,7 +124,7 @@ typedef enum upng_format {
 	UPNG_LUMINANCE_ALPHA8
 } upng_format;
 
-typedef struct {
+struct upng {
 	unsigned	width;
 	unsigned	height;
 
@@ -130,7 +140,16 @@ typedef struct {
 
 	upng_state	state;
 	upng_source	source;
-} upng_t;
+
+	/* Convert the RGBA8 pixels to EFI BLT pixels while unfiltering */
+	BOOLEAN		blt;
+
+	/* Concatenated IDAT chunks and their inflated content */
+	unsigned char	*compressed;
+	unsigned long	 compressed_size;
+	unsigned char	*inflated;
+	unsigned long	 inflated_size;
+};
 
 typedef struct huffman_tree {
 	unsigned *tree2d;
@@ -138,6 +157,9 @@ typedef struct huffman_tree {
 				  can get */
 	unsigned  numcodes;	/* Number of symbols in the alphabet =
 				   number of codes */
+	/* (symbol << 4) | code length indexed by the next
+	   HUFFMAN_FAST_BITS bits, 0 for the longer codes */
+	UINT16	  fast[HUFFMAN_FAST_SIZE];
 } huffman_tree;
 
 /* The base lengths represented by codes 257-285 */
@@ -219,23 +241,32 @@ static const unsigned FIXED_DISTANCE_TREE[NUM_DISTANCE_SYMBOLS * 2] = {
 	29, 30, 31, 0, 0
 };
 
-static unsigned char read_bit(unsigned long *bitpointer, const unsigned char *bitstream)
+typedef UINT64 unaligned_u64 __attribute__((aligned(1), may_alias));
+typedef UINT32 unaligned_u32 __attribute__((aligned(1), may_alias));
+
+/* Return at least 57 bits of the bitstream starting at BITPOINTER,
+   first bit in the least significant bit */
+static inline UINT64 peek_bits(unsigned long bitpointer, const unsigned char *bitstream)
 {
-	unsigned char result = ((bitstream[(*bitpointer) >> 3] >>
-				 ((*bitpointer) & 0x7)) & 1);
-	(*bitpointer)++;
-	return result;
+	return *(const unaligned_u64 *)(bitstream + (bitpointer >> 3)) >>
+		(bitpointer & 0x7);
 }
 
 static unsigned read_bits(unsigned long *bitpointer, const unsigned char *bitstream,
 			  unsigned long nbits)
 {
-	unsigned result = 0, i;
-	for (i = 0; i < nbits; i++)
-		result |= ((unsigned)read_bit(bitpointer, bitstream)) << i;
+	unsigned result;
+
+	result = peek_bits(*bitpointer, bitstream) & ((1UL << nbits) - 1);
+	(*bitpointer) += nbits;
 	return result;
 }
 
+static unsigned char read_bit(unsigned long *bitpointer, const unsigned char *bitstream)
+{
+	return read_bits(bitpointer, bitstream, 1);
+}
+
 /* The buffer must be numcodes * 2 in size! */
 static void huffman_tree_init(huffman_tree* tree, unsigned* buffer,
 			      unsigned numcodes, unsigned maxbitlen)
@@ -245,6 +276,32 @@ static void huffman_tree_init(huffman_tree* tree, unsigned* buffer,
 	tree->maxbitlen = maxbitlen;
 }
 
+/* Fill the fast lookup table entries of the codes below NODE.  CODE
+   holds the DEPTH bits leading to NODE, in stream order.  */
+static void huffman_tree_fill_fast(huffman_tree *tree, unsigned node,
+				   unsigned code, unsigned depth)
+{
+	unsigned bit, ct, c, i;
+
+	for (bit = 0; bit < 2; bit++) {
+		ct = tree->tree2d[2 * node + bit];
+		c = code | (bit << depth);
+
+		if (ct < tree->numcodes) {
+			for (i = c; i < HUFFMAN_FAST_SIZE; i += 1 << (depth + 1))
+				tree->fast[i] = (ct << 4) | (depth + 1);
+		} else if (depth + 1 < HUFFMAN_FAST_BITS &&
+			   ct - tree->numcodes < tree->numcodes)
+			huffman_tree_fill_fast(tree, ct - tree->numcodes, c, depth + 1);
+	}
+}
+
+static void huffman_tree_build_fast(huffman_tree *tree)
+{
+	memset(tree->fast, 0, sizeof(tree->fast));
+	huffman_tree_fill_fast(tree, 0, 0, 0);
+}
+
 /* Given the code lengths (as stored in the PNG file), generate the
    tree as defined by Deflate. maxbitlen is the maximum bits that a
    code in the tree can have. Return value is error.*/
@@ -340,11 +397,13 @@ static void huffman_tree_create_lengths(upng_t* upng, huffman_tree* tree,
 						   remaining 32767's */
 		}
 	}
+
+	huffman_tree_build_fast(tree);
 }
 
-static unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in,
-				      unsigned long *bp, const huffman_tree* codetree,
-				      unsigned long inlength)
+static unsigned huffman_decode_symbol_slow(upng_t *upng, const unsigned char *in,
+					   unsigned long *bp, const huffman_tree* codetree,
+					   unsigned long inlength)
 {
 	unsigned treepos = 0, ct;
 	unsigned char bit;
@@ -371,6 +430,27 @@ static unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in,
 	}
 }
 
+static inline unsigned huffman_decode_symbol(upng_t *upng, const unsigned char *in,
+					     unsigned long *bp, const huffman_tree* codetree,
+					     unsigned long inlength)
+{
+	unsigned entry;
+
+	/* error: End of input memory reached without endcode */
+	if (((*bp) >> 3) > inlength) {
+		SET_ERROR(upng, EFI_INVALID_PARAMETER);
+		return 0;
+	}
+
+	entry = codetree->fast[peek_bits(*bp, in) & (HUFFMAN_FAST_SIZE - 1)];
+	if (entry) {
+		(*bp) += entry & 0xf;
+		return entry >> 4;
+	}
+
+	return huffman_decode_symbol_slow(upng, in, bp, codetree, inlength);
+}
+
 /* Get the tree of a deflated block with dynamic tree, the tree itself
    is also Huffman compressed with a known tree*/
 static void get_tree_inflate_dynamic(upng_t* upng, huffman_tree* codetree,
@@ -573,6 +653,8 @@ static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outs
 				  NUM_DEFLATE_CODE_SYMBOLS, DEFLATE_CODE_BITLEN);
 		huffman_tree_init(&codetreeD, (unsigned*)FIXED_DISTANCE_TREE,
 				  NUM_DISTANCE_SYMBOLS, DISTANCE_BITLEN);
+		huffman_tree_build_fast(&codetree);
+		huffman_tree_build_fast(&codetreeD);
 	} else if (btype == 2) {
 		/* dynamic trees */
 		unsigned codelengthcodetree_buffer[CODE_LENGTH_BUFFER_SIZE];
@@ -611,7 +693,8 @@ static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outs
 			/* Part 1: get length base */
 			unsigned long length = LENGTH_BASE[code - FIRST_LENGTH_CODE_INDEX];
 			unsigned codeD, distance, numextrabitsD;
-			unsigned long start, forward, backward, numextrabits;
+			unsigned long numextrabits, n;
+			unsigned char *dst;
 
 			/* Part 2: get extra bits and add the value of
 			 * that to length */
@@ -652,22 +735,33 @@ static void inflate_huffman(upng_t* upng, unsigned char* out, unsigned long outs
 
 			/* Part 5: fill in all the out[n] values based
 			 * on the length and dist */
-			start = (*pos);
-			backward = start - distance;
-
-			if ((*pos) + length >= outsize) {
+			if ((*pos) + length >= outsize || distance > (*pos)) {
 				SET_ERROR(upng, EFI_INVALID_PARAMETER);
 				return;
 			}
 
-			for (forward = 0; forward < length; forward++) {
-				out[(*pos)++] = out[backward];
-				backward++;
-
-				if (backward >= start) {
-					backward = start - distance;
-				}
+			/* Copy a word at a time when the source does
+			   not overlap the current word and there is
+			   room for the last word overrun */
+			dst = out + (*pos);
+			if (distance >= sizeof(UINT64) &&
+			    (*pos) + length + sizeof(UINT64) <= outsize) {
+				for (n = 0; n < length; n += sizeof(UINT64))
+					*(unaligned_u64 *)(dst + n) =
+						*(unaligned_u64 *)(dst + n - distance);
+			} else if (distance >= sizeof(UINT32) &&
+				   (*pos) + length + sizeof(UINT32) <= outsize) {
+				/* Repeated RGBA pixels */
+				for (n = 0; n < length; n += sizeof(UINT32))
+					*(unaligned_u32 *)(dst + n) =
+						*(unaligned_u32 *)(dst + n - distance);
+			} else if (distance == 1) {
+				memset(dst, dst[-1], length);
+			} else {
+				for (n = 0; n < length; n++)
+					dst[n] = dst[n - distance];
 			}
+			(*pos) += length;
 		}
 	}
 }
@@ -678,7 +772,7 @@ static void inflate_uncompressed(upng_t* upng, unsigned char* out,
 				 unsigned long inlength)
 {
 	unsigned long p;
-	unsigned len, nlen, n;
+	unsigned len, nlen;
 
 	/* Go to first boundary of byte */
 	while (((*bp) & 0x7) != 0) {
@@ -715,9 +809,9 @@ static void inflate_uncompressed(upng_t* upng, unsigned char* out,
 		return;
 	}
 
-	for (n = 0; n < len; n++) {
-		out[(*pos)++] = in[p++];
-	}
+	memcpy(out + (*pos), in + p, len);
+	(*pos) += len;
+	p += len;
 
 	(*bp) = p * 8;
 }
@@ -808,7 +902,7 @@ static EFI_STATUS uz_inflate(upng_t* upng, unsigned char *out, unsigned long out
 }
 
 /* Paeth predictor, used by PNG filter type 4 */
-static int paeth_predictor(int a, int b, int c)
+static inline int paeth_predictor(int a, int b, int c)
 {
 	int p = a + b - c;
 	int pa = p > a ? p - a : a - p;
@@ -823,6 +917,52 @@ static int paeth_predictor(int a, int b, int c)
 		return c;
 }
 
+/* Four bytes at a time arithmetic, without carry from one byte to the
+   next */
+static inline UINT32 bytes_add(UINT32 a, UINT32 b)
+{
+	return ((a & 0x7f7f7f7f) + (b & 0x7f7f7f7f)) ^ ((a ^ b) & 0x80808080);
+}
+
+static inline UINT32 bytes_avg(UINT32 a, UINT32 b)
+{
+	return (a & b) + (((a ^ b) & 0xfefefefe) >> 1);
+}
+
+#define WORD(p, i)	(((unaligned_u32 *)(p))[(i)])
+
+/* Unfilter a scanline of pixels made of whole 32-bit words, one word
+   at a time.  It covers the RGBA8 and RGBA16 formats.  */
+static void unfilter_scanline_words(unsigned char *recon,
+				    const unsigned char *scanline,
+				    const unsigned char *precon, unsigned long bytewidth,
+				    unsigned char filterType, unsigned long length)
+{
+	unsigned long i, words = length / 4, wb = bytewidth / 4;
+
+	switch (filterType) {
+	case 1:
+		for (i = 0; i < wb; i++)
+			WORD(recon, i) = WORD(scanline, i);
+		for (i = wb; i < words; i++)
+			WORD(recon, i) = bytes_add(WORD(scanline, i), WORD(recon, i - wb));
+		break;
+	case 2:
+		for (i = 0; i < words; i++)
+			WORD(recon, i) = bytes_add(WORD(scanline, i), WORD(precon, i));
+		break;
+	case 3:
+		for (i = 0; i < wb; i++)
+			WORD(recon, i) = bytes_add(WORD(scanline, i),
+						   (WORD(precon, i) >> 1) & 0x7f7f7f7f);
+		for (i = wb; i < words; i++)
+			WORD(recon, i) = bytes_add(WORD(scanline, i),
+						   bytes_avg(WORD(recon, i - wb),
+							     WORD(precon, i)));
+		break;
+	}
+}
+
 static void unfilter_scanline(upng_t* upng, unsigned char *recon,
 			      const unsigned char *scanline,
 			      const unsigned char *precon, unsigned long bytewidth,
@@ -843,10 +983,18 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon,
 	   recon and scanline MAY be the same memory address! precon
 	   must be disjoint. */
 	unsigned long i;
+
+	if (bytewidth % 4 == 0 && filterType >= 1 && filterType <= 3 &&
+	    (precon || filterType == 1)) {
+		unfilter_scanline_words(recon, scanline, precon, bytewidth,
+					filterType, length);
+		return;
+	}
+
 	switch (filterType) {
 	case 0:
-		for (i = 0; i < length; i++)
-			recon[i] = scanline[i];
+		if (recon != scanline)
+			memmove(recon, scanline, length);
 		break;
 	case 1:
 		for (i = 0; i < bytewidth; i++)
@@ -878,14 +1026,14 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon,
 	case 4:
 		if (precon) {
 			for (i = 0; i < bytewidth; i++)
-				recon[i] = (unsigned char)(scanline[i] + paeth_predictor(0, precon[i], 0));
+				recon[i] = (unsigned char)(scanline[i] + precon[i]);
 			for (i = bytewidth; i < length; i++)
 				recon[i] = (unsigned char)(scanline[i] + paeth_predictor(recon[i - bytewidth], precon[i], precon[i - bytewidth]));
 		} else {
 			for (i = 0; i < bytewidth; i++)
 				recon[i] = scanline[i];
 			for (i = bytewidth; i < length; i++)
-				recon[i] = (unsigned char)(scanline[i] + paeth_predictor(recon[i - bytewidth], 0, 0));
+				recon[i] = (unsigned char)(scanline[i] + recon[i - bytewidth]);
 		}
 		break;
 	default:
@@ -894,6 +1042,19 @@ static void unfilter_scanline(upng_t* upng, unsigned char *recon,
 	}
 }
 
+/* Convert a line of RGBA8 pixels to EFI BLT pixels, reserved byte
+   cleared */
+static void rgba_to_blt(unsigned char *line, unsigned long length)
+{
+	unsigned long i;
+	UINT32 x;
+
+	for (i = 0; i < length / 4; i++) {
+		x = WORD(line, i);
+		WORD(line, i) = ((x & 0xff) << 16) | (x & 0xff00) | ((x >> 16) & 0xff);
+	}
+}
+
 static void unfilter(upng_t* upng, unsigned char *out, const unsigned char *in,
 		     unsigned w, unsigned h, unsigned bpp)
 {
@@ -913,6 +1074,7 @@ static void unfilter(upng_t* upng, unsigned char *out, const unsigned char *in,
 
 	unsigned y;
 	unsigned char *prevline = 0;
+	BOOLEAN blt = upng->blt && bpp == 32;
 
 	/* Bytewidth is used for filtering, is 1 when bpp < 8, number
 	   of bytes per pixel otherwise */
@@ -931,8 +1093,16 @@ static void unfilter(upng_t* upng, unsigned char *out, const unsigned char *in,
 			return;
 		}
 
+		/* The previous line is converted once it is not
+		   needed anymore, while it is still in the cache */
+		if (blt && prevline)
+			rgba_to_blt(prevline, linebytes);
+
 		prevline = &out[outindex];
 	}
+
+	if (blt && prevline)
+		rgba_to_blt(prevline, linebytes);
 }
 
 static void remove_padding_bits(unsigned char *out, const unsigned char *in,
@@ -1120,15 +1290,19 @@ static EFI_STATUS upng_header(upng_t* upng)
 }
 
 /* Read a PNG, the result will be in the same color type as the PNG
- * (hence "generic") */
-static EFI_STATUS upng_decode(upng_t* upng)
+ * (hence "generic").  The decoding is done in three steps:
+ * upng_decode_start() checks the chunks and allocates the buffers,
+ * upng_decode_data() inflates and unfilters the image and
+ * upng_decode_end() releases the intermediate buffers.
+ * upng_decode_data() does not call any UEFI service so that it can
+ * run on an Application Processor. */
+static EFI_STATUS upng_decode_start(upng_t* upng)
 {
 	const unsigned char *chunk;
 	unsigned char* compressed;
 	unsigned char* inflated;
 	unsigned long compressed_size = 0, compressed_index = 0;
 	unsigned long inflated_size;
-	EFI_STATUS error;
 
 	/* If we have an error state, bail now */
 	if (upng->error != EFI_SUCCESS) {
@@ -1204,11 +1378,12 @@ static EFI_STATUS upng_decode(upng_t* upng)
 
 	/* Allocate enough space for the (compressed and filtered)
 	 * image data */
-	compressed = (unsigned char*)AllocatePool(compressed_size);
+	compressed = (unsigned char*)AllocatePool(compressed_size + INFLATE_PADDING);
 	if (compressed == NULL) {
 		SET_ERROR(upng, EFI_OUT_OF_RESOURCES);
 		return upng->error;
 	}
+	memset(compressed + compressed_size, 0, INFLATE_PADDING);
 
 	/* Scan through the chunks again, this time copying the values
 	 * into our compressed buffer.  there's no reason to validate
@@ -1243,30 +1418,47 @@ static EFI_STATUS upng_decode(upng_t* upng)
 		return upng->error;
 	}
 
-	/* Decompress image data */
-	error = uz_inflate(upng, inflated, inflated_size, compressed, compressed_size);
-	if (error != EFI_SUCCESS) {
-		FreePool(compressed);
-		FreePool(inflated);
-		return upng->error;
-	}
-
-	/* Free the compressed data */
-	FreePool(compressed);
-
 	/* Allocate final image buffer */
 	upng->size = (upng->height * upng->width * upng_get_bpp(upng) + 7) / 8;
 	upng->buffer = (unsigned char*)AllocatePool(upng->size);
 	if (upng->buffer == NULL) {
+		FreePool(compressed);
 		FreePool(inflated);
 		upng->size = 0;
 		SET_ERROR(upng, EFI_OUT_OF_RESOURCES);
 		return upng->error;
 	}
 
+	upng->compressed = compressed;
+	upng->compressed_size = compressed_size;
+	upng->inflated = inflated;
+	upng->inflated_size = inflated_size;
+
+	return upng->error;
+}
+
+static void upng_decode_data(upng_t* upng)
+{
+	if (upng->error != EFI_SUCCESS || !upng->inflated)
+		return;
+
+	/* Decompress image data */
+	if (uz_inflate(upng, upng->inflated, upng->inflated_size,
+		       upng->compressed, upng->compressed_size) != EFI_SUCCESS)
+		return;
+
 	/* Unfilter scanlines */
-	post_process_scanlines(upng, upng->buffer, inflated, upng);
-	FreePool(inflated);
+	post_process_scanlines(upng, upng->buffer, upng->inflated, upng);
+}
+
+static EFI_STATUS upng_decode_end(upng_t* upng)
+{
+	if (!upng->inflated)
+		return upng->error;
+
+	FreePool(upng->compressed);
+	FreePool(upng->inflated);
+	upng->compressed = upng->inflated = NULL;
 
 	if (upng->error != EFI_SUCCESS) {
 		FreePool(upng->buffer);
@@ -1279,42 +1471,66 @@ static EFI_STATUS upng_decode(upng_t* upng)
 	return upng->error;
 }
 
-static inline EFI_GRAPHICS_OUTPUT_BLT_PIXEL
-swap_color(EFI_GRAPHICS_OUTPUT_BLT_PIXEL color)
+EFI_STATUS upng_load_start(const char *data, UINTN size, upng_t **upng_p,
+			   UINTN *width, UINTN *height)
 {
-	EFI_GRAPHICS_OUTPUT_BLT_PIXEL swapped = {
-		.Blue = color.Red,
-		.Red = color.Blue,
-		.Green = color.Green
-	};
-	return swapped;
+	upng_t *upng;
+	EFI_STATUS ret;
+
+	upng = AllocateZeroPool(sizeof(*upng));
+	if (!upng)
+		return EFI_OUT_OF_RESOURCES;
+
+	upng->color_type = UPNG_RGBA;
+	upng->color_depth = 8;
+	upng->format = UPNG_RGBA8;
+	upng->state = UPNG_NEW;
+	upng->error = EFI_SUCCESS;
+	upng->source.buffer = (const unsigned char *)data;
+	upng->source.size = size;
+	upng->blt = TRUE;
+
+	ret = upng_decode_start(upng);
+	if (EFI_ERROR(ret) || !upng->inflated) {
+		FreePool(upng);
+		return EFI_ERROR(ret) ? ret : EFI_INVALID_PARAMETER;
+	}
+
+	*upng_p = upng;
+	*width = upng->width;
+	*height = upng->height;
+
+	return EFI_SUCCESS;
+}
+
+void upng_load_run(upng_t *upng)
+{
+	upng_decode_data(upng);
+}
+
+EFI_STATUS upng_load_end(upng_t *upng, EFI_GRAPHICS_OUTPUT_BLT_PIXEL **blt)
+{
+	EFI_STATUS ret;
+
+	ret = upng_decode_end(upng);
+	if (!EFI_ERROR(ret))
+		*blt = (EFI_GRAPHICS_OUTPUT_BLT_PIXEL *)upng->buffer;
+
+	FreePool(upng);
+	return ret;
 }
 
 EFI_STATUS upng_load(const char *data, UINTN size,
 		     EFI_GRAPHICS_OUTPUT_BLT_PIXEL **blt,
 		     UINTN *width, UINTN *height)
 {
-	upng_t upng = {
-		.color_type = UPNG_RGBA,
-		.color_depth = 8,
-		.format = UPNG_RGBA8,
-		.state = UPNG_NEW,
-		.error = EFI_SUCCESS,
-		.source.buffer = data,
-		.source.size = size
-	};
+	upng_t *upng;
 	EFI_STATUS ret;
-	UINTN i;
 
-	ret = upng_decode(&upng);
+	ret = upng_load_start(data, size, &upng, width, height);
 	if (EFI_ERROR(ret))
 		return ret;
 
-	*blt = (EFI_GRAPHICS_OUTPUT_BLT_PIXEL *)upng.buffer;
-	*width = upng.width;
-	*height = upng.height;
-	for (i = 0; i < *width * *height; i++)
-		(*blt)[i] = swap_color((*blt)[i]);
-
-	return EFI_SUCCESS;
+	upng_load_run(upng);
+	return upng_load_end(upng, blt);
 }
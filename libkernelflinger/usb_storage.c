@@ -76,8 +76,45 @@ typedef struct {
 	UINT8             Reserverd2[4];
 } USB_BOOT_REQUEST_SENSE_DATA;
 #define USB_REQUEST_SENSE_OPCODE (0x03)
+#define USB_INQUIRY_OPCODE (0x12)
 #define USB_WRITE_SAME16_OPCODE (0x93)
 
+/* Vital Product Data pages */
+#define VPD_BLOCK_LIMITS		0xB0
+#define VPD_LOGICAL_BLOCK_PROVISIONING	0xB2
+#define VPD_MAX_LENGTH			64
+
+/* Logical Block Provisioning VPD page, byte 5 */
+#define LBP_UNMAP			(1 << 7)	/* LBPU */
+#define LBP_WRITE_SAME16_UNMAP		(1 << 6)	/* LBPWS */
+#define LBP_READ_ZEROES			(1 << 2)	/* LBPRZ */
+
+/* Number of block descriptors of an UNMAP parameter list */
+#define UNMAP_MAX_DESCRIPTORS		64
+
+struct unmap_parameter_list {
+	__be16 data_length;
+	__be16 block_desc_length;
+	__be32 reserved;
+	struct unmap_block_descriptor block_desc[UNMAP_MAX_DESCRIPTORS];
+} __attribute__((packed));
+
+/* The device capabilities are probed once with the Block Limits and
+   Logical Block Provisioning VPD pages.  A command which fails clears
+   its capability so that it is not retried on the next ranges.  */
+static struct usb_caps {
+	EFI_HANDLE handle;
+	BOOLEAN unmap;
+	BOOLEAN write_same;
+	BOOLEAN write_same_unmap;
+	BOOLEAN unmap_zeroes;		/* Unmapped blocks read as zeroes */
+	UINT32 max_unmap_lba;
+	UINT32 max_unmap_desc;
+	UINT64 max_write_same;
+	UINT32 max_transfer;		/* In blocks, 0 if not reported */
+} usb_caps[4];
+static UINTN usb_caps_next;
+
 static USB_DEVICE_PATH *get_usb_device_path(EFI_DEVICE_PATH *p)
 {
 	for (; !IsDevicePathEndType(p); p = NextDevicePathNode(p))
@@ -117,54 +154,167 @@ static EFI_STATUS scsi_request_sense(void)
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS scsi_unmap(EFI_LBA start, EFI_LBA end)
+static EFI_STATUS scsi_inquiry_vpd(UINT8 page, UINT8 *data, UINT8 len)
 {
 	EFI_STATUS status;
-	struct command_descriptor_block_unmap cdb;
-	struct unmap_parameter unmap;
-
-	ZeroMem(&cdb, sizeof(cdb));
-	cdb.op_code = UFS_UNMAP;
-	cdb.param_length = htobe16(sizeof(unmap));
-
-	ZeroMem(&unmap, sizeof(unmap));
-	unmap.data_length = htobe16(sizeof(unmap) - sizeof(unmap.data_length));
-	unmap.block_desc_length = htobe16(sizeof(unmap.block_desc));
-	unmap.block_desc.lba = htobe64(start);
-	unmap.block_desc.count = htobe32(end - start + 1);
-
+	UINT8 cdb[6];
 	UINT32 timeout = USB_BOOT_GENERAL_CMD_TIMEOUT;
 	UINT32 cmd_status;
+
+	ZeroMem(cdb, sizeof(cdb));
+	cdb[0] = USB_INQUIRY_OPCODE;
+	cdb[1] = 0x1;		/* EVPD */
+	cdb[2] = page;
+	cdb[4] = len;
+
+	ZeroMem(data, len);
 	status = UsbBotExecCommandWithRetry(Context,
-					    &cdb,
+					    cdb,
 					    sizeof(cdb),
-					    EfiUsbDataOut,
-					    &unmap,
-					    sizeof(unmap),
+					    EfiUsbDataIn,
+					    data,
+					    len,
 					    0,
 					    timeout,
 					    &cmd_status);
-	if (EFI_ERROR (status))
+	if (EFI_ERROR(status))
 		return status;
 
-	if (cmd_status) {
-		return scsi_request_sense();
+	if (cmd_status || data[1] != page) {
+		scsi_request_sense();
+		return EFI_UNSUPPORTED;
 	}
+
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS scsi_write_same16(EFI_BLOCK_IO *bio,
+static UINT32 get_be32(UINT8 *p)
+{
+	return be32toh(*(UINT32 *)p);
+}
+
+static struct usb_caps *get_caps(EFI_HANDLE handle)
+{
+	struct usb_caps *caps;
+	UINT8 vpd[VPD_MAX_LENGTH];
+	EFI_STATUS status;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(usb_caps); i++)
+		if (usb_caps[i].handle == handle)
+			return &usb_caps[i];
+
+	caps = &usb_caps[usb_caps_next];
+	usb_caps_next = (usb_caps_next + 1) % ARRAY_SIZE(usb_caps);
+
+	ZeroMem(caps, sizeof(*caps));
+	caps->handle = handle;
+	caps->write_same = TRUE;
+	caps->max_unmap_desc = 1;
+
+	/* Without the Logical Block Provisioning page, UNMAP is tried
+	   once with a single descriptor */
+	status = scsi_inquiry_vpd(VPD_LOGICAL_BLOCK_PROVISIONING, vpd, 8);
+	if (EFI_ERROR(status)) {
+		caps->unmap = TRUE;
+		caps->write_same_unmap = TRUE;
+	} else {
+		caps->unmap = !!(vpd[5] & LBP_UNMAP);
+		caps->write_same_unmap = !!(vpd[5] & LBP_WRITE_SAME16_UNMAP);
+		caps->unmap_zeroes = !!(vpd[5] & LBP_READ_ZEROES);
+	}
+
+	status = scsi_inquiry_vpd(VPD_BLOCK_LIMITS, vpd, sizeof(vpd));
+	if (!EFI_ERROR(status)) {
+		caps->max_transfer = get_be32(&vpd[8]);
+		caps->max_unmap_lba = get_be32(&vpd[20]);
+		caps->max_unmap_desc = min(get_be32(&vpd[24]),
+					   (UINT32)UNMAP_MAX_DESCRIPTORS);
+		caps->max_write_same = be64toh(*(UINT64 *)&vpd[36]);
+		if (!caps->max_unmap_lba || !caps->max_unmap_desc)
+			caps->unmap = FALSE;
+	}
+
+	debug(L"USB storage: unmap %d (%d blocks x %d), write same %d, unmap zeroes %d, max transfer %d",
+	      caps->unmap, caps->max_unmap_lba, caps->max_unmap_desc,
+	      caps->write_same_unmap, caps->unmap_zeroes, caps->max_transfer);
+
+	return caps;
+}
+
+/* Unmap [START, END] with as few UNMAP commands as possible, each
+   one carrying up to MAX_UNMAP_DESC block descriptors.  */
+static EFI_STATUS scsi_unmap(struct usb_caps *caps, EFI_LBA start, EFI_LBA end)
+{
+	EFI_STATUS status;
+	struct command_descriptor_block_unmap cdb;
+	struct unmap_parameter_list *unmap;
+	UINT32 timeout = USB_BOOT_GENERAL_CMD_TIMEOUT;
+	UINT32 cmd_status, max_count, count, len;
+	UINTN n;
+
+	unmap = AllocatePool(sizeof(*unmap));
+	if (!unmap)
+		return EFI_OUT_OF_RESOURCES;
+
+	max_count = caps->max_unmap_lba ? caps->max_unmap_lba : (UINT32)-1;
+	status = EFI_SUCCESS;
+	while (start <= end) {
+		ZeroMem(unmap, sizeof(*unmap));
+		for (n = 0; n < caps->max_unmap_desc && start <= end; n++) {
+			count = min(end - start + 1, (UINT64)max_count);
+			unmap->block_desc[n].lba = htobe64(start);
+			unmap->block_desc[n].count = htobe32(count);
+			start += count;
+		}
+
+		len = offsetof(struct unmap_parameter_list, block_desc) +
+			n * sizeof(unmap->block_desc[0]);
+		unmap->data_length = htobe16(len - sizeof(unmap->data_length));
+		unmap->block_desc_length = htobe16(n * sizeof(unmap->block_desc[0]));
+
+		ZeroMem(&cdb, sizeof(cdb));
+		cdb.op_code = UFS_UNMAP;
+		cdb.param_length = htobe16(len);
+
+		status = UsbBotExecCommandWithRetry(Context,
+						    &cdb,
+						    sizeof(cdb),
+						    EfiUsbDataOut,
+						    unmap,
+						    len,
+						    0,
+						    timeout,
+						    &cmd_status);
+		if (EFI_ERROR(status))
+			break;
+
+		if (cmd_status) {
+			status = scsi_request_sense();
+			if (EFI_ERROR(status))
+				break;
+		}
+	}
+
+	FreePool(unmap);
+	return status;
+}
+
+/* The range is split in commands of at most MAX_WRITE_SAME blocks */
+static EFI_STATUS scsi_write_same16(struct usb_caps *caps,
+				    EFI_BLOCK_IO *bio,
 				    EFI_LBA start,
 				    EFI_LBA end,
 				    UINTN block_size,
 				    BOOLEAN unmap)
 {
-	EFI_STATUS              status;
+	EFI_STATUS              status = EFI_SUCCESS;
 	UINT32 cmd_status;
 	UINT8 write_same[16];
 	UINT32 timeout = USB_BOOT_GENERAL_CMD_TIMEOUT;
 	VOID *emptyblock;
 	VOID *aligned_emptyblock;
+	UINT64 max_count, count;
 
 	status = alloc_aligned (&emptyblock,
 				&aligned_emptyblock,
@@ -176,53 +326,80 @@ static EFI_STATUS scsi_write_same16(EFI_BLOCK_IO *bio,
 		return status;
 	}
 
-	ZeroMem(write_same, sizeof(write_same));
-	write_same[0] = USB_WRITE_SAME16_OPCODE;
-	if (unmap)
-		write_same[1] = 0x1 << 3; //set UNMAP bit to perform an unmap operation
-	*((UINT64 *)&(write_same[2])) = htobe64(start);
-	*((UINT32 *)&(write_same[10])) = htobe32(end - start + 1);
-	status = UsbBotExecCommandWithRetry (Context,
-					     write_same,
-					     sizeof(write_same),
-					     EfiUsbDataOut,
-					     aligned_emptyblock,
-					     block_size,
-					     0,
-					     timeout,
-					     &cmd_status);
-	if (EFI_ERROR (status)) {
-		FreePool(emptyblock);
-		return status;
-	}
+	max_count = caps->max_write_same ? caps->max_write_same : (UINT32)-1;
+	max_count = min(max_count, (UINT64)(UINT32)-1);
+	for (; start <= end; start += count) {
+		count = min(end - start + 1, max_count);
+
+		ZeroMem(write_same, sizeof(write_same));
+		write_same[0] = USB_WRITE_SAME16_OPCODE;
+		if (unmap)
+			write_same[1] = 0x1 << 3; //set UNMAP bit to perform an unmap operation
+		*((UINT64 *)&(write_same[2])) = htobe64(start);
+		*((UINT32 *)&(write_same[10])) = htobe32(count);
+		status = UsbBotExecCommandWithRetry (Context,
+						     write_same,
+						     sizeof(write_same),
+						     EfiUsbDataOut,
+						     aligned_emptyblock,
+						     block_size,
+						     0,
+						     timeout,
+						     &cmd_status);
+		if (EFI_ERROR (status))
+			break;
 
-	if (cmd_status) {
-		FreePool(emptyblock);
-		return scsi_request_sense();
+		if (cmd_status) {
+			status = scsi_request_sense();
+			if (EFI_ERROR(status))
+				break;
+		}
 	}
 
 	FreePool(emptyblock);
-	return  EFI_SUCCESS;
+	return status;
 }
 
-#define BLOCKS (0x2000)
-static EFI_STATUS clean_blocks(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
+/* Size of the zero buffer the blocks are cleaned with, each WRITE(10)
+   command transfers as much of it as the device accepts */
+#define CLEAN_BUFFER_SIZE	(16 * 1024 * 1024)
+#define WRITE10_MAX_BLOCKS	0xFFFF
+
+static UINT32 clean_blocks_per_command(struct usb_caps *caps, EFI_BLOCK_IO *bio)
+{
+	UINT32 blocks = CLEAN_BUFFER_SIZE / bio->Media->BlockSize;
+
+	blocks = min(blocks, (UINT32)WRITE10_MAX_BLOCKS);
+	if (caps->max_transfer)
+		blocks = min(blocks, caps->max_transfer);
+
+	return blocks;
+}
+
+static EFI_STATUS clean_blocks(struct usb_caps *caps, EFI_BLOCK_IO *bio,
+			       EFI_LBA start, EFI_LBA end)
 {
 	EFI_STATUS              status;
 	VOID *emptyblock;
 	VOID *aligned_emptyblock;
 
-	status = scsi_write_same16 (bio,
-				    start,
-				    end,
-				    bio->Media->BlockSize,
-				    FALSE);
-	if (!EFI_ERROR(status))
-		return status;
+	if (caps->write_same) {
+		status = scsi_write_same16 (caps,
+					    bio,
+					    start,
+					    end,
+					    bio->Media->BlockSize,
+					    FALSE);
+		if (!EFI_ERROR(status))
+			return status;
+		caps->write_same = FALSE;
+	}
+
+	UINT32 max_blocks = clean_blocks_per_command(caps, bio);
 
 	status = alloc_aligned (&emptyblock,
 				&aligned_emptyblock,
-				bio->Media->BlockSize * BLOCKS,
+				bio->Media->BlockSize * max_blocks,
 				bio->Media->IoAlign);
 
 	if (EFI_ERROR(status)) {
@@ -231,31 +408,36 @@ static EFI_STATUS clean_blocks(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 	}
 
 	UINT32 cmd_status;
-	UINT32 timeout = USB_BOOT_GENERAL_CMD_TIMEOUT;
+	UINT32 timeout;
 	USB_BOOT_WRITE10_CMD  WriteCmd;
 	EFI_LBA lba;
-	UINT32 size;
+	UINT64 size;
 	UINT32 blocks;
 
 	ZeroMem (&WriteCmd, sizeof (USB_BOOT_WRITE10_CMD));
 	WriteCmd.OpCode = EFI_SCSI_OP_WRITE_10;
 	WriteCmd.Lun    = 0;
-	*((UINT16 *) WriteCmd.TransferLen) = htobe16 (BLOCKS);
 
-	lba = start;
+	/* Leave the slowest devices one second per MiB on top of the
+	   general command timeout */
+	timeout = USB_BOOT_GENERAL_CMD_TIMEOUT +
+		(bio->Media->BlockSize * max_blocks / (1024 * 1024)) * USB_MASS_1_SECOND;
+
 	size  =  end  - start + 1;
 
 	info_n(L"Erasing ");
 	uint32_t print_sec = boottime_in_msec() / 1000;
 	uint32_t print_prev = 0;
-	for(blocks =  size / BLOCKS; blocks > 0; blocks--) {
+	for (lba = start; lba <= end; lba += blocks) {
+		blocks = min(end - lba + 1, (UINT64)max_blocks);
 		*((UINT32 *) WriteCmd.Lba) = htobe32 (lba);
+		*((UINT16 *) WriteCmd.TransferLen) = htobe16 (blocks);
 		status = UsbBotExecCommandWithRetry (Context,
 						     &WriteCmd,
 						     sizeof(WriteCmd),
 						     EfiUsbDataOut,
 						     aligned_emptyblock,
-						     bio->Media->BlockSize * BLOCKS,
+						     bio->Media->BlockSize * blocks,
 						     0,
 						     timeout,
 						     &cmd_status);
@@ -266,37 +448,23 @@ static EFI_STATUS clean_blocks(EFI_BLOCK_IO *bio, EFI_LBA start, EFI_LBA end)
 		}
 
 		print_progress(lba - start, size, boottime_in_msec() / 1000, &print_sec, &print_prev);
-		lba += BLOCKS;
 	}
 
-	*((UINT32 *) WriteCmd.Lba) = htobe32 (lba);
-	*((UINT16 *) WriteCmd.TransferLen) = htobe16 (size % BLOCKS);
-	status = UsbBotExecCommandWithRetry (Context,
-					     &WriteCmd,
-					     sizeof(WriteCmd),
-					     EfiUsbDataOut,
-					     aligned_emptyblock,
-					     (bio->Media->BlockSize) * (size % BLOCKS),
-					     0,
-					     timeout,
-					     &cmd_status);
-	if (EFI_ERROR(status)) {
-		FreePool(emptyblock);
-		return status;
-	}
+	FreePool(emptyblock);
 	print_progress(size, size, boottime_in_msec() / 1000, &print_sec, &print_prev);
 	info_n(L"\n");
 
 	return EFI_SUCCESS;
 }
 
-static EFI_STATUS usb_erase_blocks(__attribute__((unused)) EFI_HANDLE handle,
+static EFI_STATUS usb_erase_blocks(EFI_HANDLE handle,
 				   EFI_BLOCK_IO *bio,
 				   EFI_LBA start,
 				   EFI_LBA end)
 {
 	EFI_STATUS              status;
 	EFI_USB_IO_PROTOCOL           *UsbIo;
+	struct usb_caps *caps;
 
 	status = uefi_call_wrapper (BS->HandleProtocol,
 				    3,
@@ -308,25 +476,40 @@ static EFI_STATUS usb_erase_blocks(__attribute__((unused)) EFI_HANDLE handle,
 	if (Context == NULL)
 		return EFI_UNSUPPORTED;
 
-	status = scsi_unmap(start, end);
-	if (status == EFI_UNSUPPORTED) {
-		status = scsi_write_same16 (bio,
+	caps = get_caps(handle);
+	status = EFI_UNSUPPORTED;
+	if (caps->unmap) {
+		status = scsi_unmap(caps, start, end);
+		if (EFI_ERROR(status))
+			caps->unmap = FALSE;
+	}
+	if (EFI_ERROR(status) && caps->write_same_unmap) {
+		status = scsi_write_same16 (caps,
+					    bio,
 					    start,
 					    end,
 					    bio->Media->BlockSize,
 					    TRUE);
-		if (status == EFI_UNSUPPORTED)
-			debug(L"neither unmap nor write same with unmap are supported");
+		if (EFI_ERROR(status))
+			caps->write_same_unmap = FALSE;
 	}
+	if (EFI_ERROR(status))
+		debug(L"neither unmap nor write same with unmap are supported");
 
 	/*
 	 * UNMAP is not a command that forces the SCSI to immediately erase data.
 	 * It simply notifies the SCSI which LBAs are no longer needed.
 	 * in addition, there are considerable usb mass storage devices don't
 	 * support unmap or write_same_with_unmap command, so clean these blocks
-	 * even unmap failed, this can be a time-consumming operation.
+	 * even unmap failed, this can be a time-consumming operation.  The
+	 * cleaning is only skipped if the device reports that the unmapped
+	 * blocks read as zeroes.
 	 */
-	status =  clean_blocks(bio, start, end);
+	if (!EFI_ERROR(status) && caps->unmap_zeroes)
+		goto out;
+
+	status =  clean_blocks(caps, bio, start, end);
+out:
 	if (Context) {
 		FreePool(Context);
 		Context = NULL;
@@ -334,6 +517,51 @@ static EFI_STATUS usb_erase_blocks(__attribute__((unused)) EFI_HANDLE handle,
 	return status;
 }
 
+/* WRITE SAME without the UNMAP bit writes the zero block to the whole
+   range: it reads back as zeroes, unlike an unmapped range.  */
+static EFI_STATUS usb_write_zeroes(EFI_HANDLE handle,
+				   EFI_BLOCK_IO *bio,
+				   EFI_LBA start,
+				   EFI_LBA end)
+{
+	EFI_STATUS              status;
+	EFI_USB_IO_PROTOCOL           *UsbIo;
+	struct usb_caps *caps;
+
+	status = uefi_call_wrapper (BS->HandleProtocol,
+				    3,
+				    handle,
+				    &gEfiUsbIoProtocolGuid,
+				    (void **)&UsbIo
+				    );
+	if (EFI_ERROR(status))
+		return EFI_UNSUPPORTED;
+
+	UsbBotInit(UsbIo, &Context);
+	if (Context == NULL)
+		return EFI_UNSUPPORTED;
+
+	caps = get_caps(handle);
+	status = EFI_UNSUPPORTED;
+	if (caps->write_same) {
+		status = scsi_write_same16 (caps,
+					    bio,
+					    start,
+					    end,
+					    bio->Media->BlockSize,
+					    FALSE);
+		if (EFI_ERROR(status)) {
+			debug(L"write same is not supported");
+			caps->write_same = FALSE;
+			status = EFI_UNSUPPORTED;
+		}
+	}
+
+	FreePool(Context);
+	Context = NULL;
+	return status;
+}
+
 static EFI_STATUS usb_check_logical_unit (__attribute__((unused)) EFI_DEVICE_PATH *p,
 					  logical_unit_t log_unit)
 {
@@ -347,6 +575,7 @@ static BOOLEAN is_usb(EFI_DEVICE_PATH *p)
 
 struct storage STORAGE(STORAGE_USB) = {
 	.erase_blocks = usb_erase_blocks,
+	.write_zeroes = usb_write_zeroes,
 	.check_logical_unit = usb_check_logical_unit,
 	.probe = is_usb,
 	.name = L"USB"
@@ -34,12 +34,14 @@
 #include <efilib.h>
 #include <stdio.h>
 #include <openssl/evp.h>
+#include "lib.h"
 #include "uefi_utils.h"
 #include "protocol.h"
 #include "gpt.h"
 #include "log.h"
 #include "vars.h"
 #include "security.h"
+#include "mp_pool.h"
 
 #define IASIMAGE_MAX_SUB_IMAGE      32
 #define EVP_MAX_MD_SIZE             64
@@ -125,50 +127,159 @@ static EFI_STATUS get_partition_io(CHAR16 *label, EFI_FILE_IO_INTERFACE **io)
 	return ret;
 }
 
-/*Get buffer sha256 hash value*/
-static void hash_buffer(CHAR8 *buffer, UINT64 len, CHAR8 *hash)
+/* The sub-files are read by IAS_CHUNK_SIZE chunks into two buffers
+   reused for all of them: a chunk is hashed on an Application
+   Processor while the next one, of the same sub-file or of the
+   following one, is being read.  Each sub-file has its own SHA256
+   context and the digests are compared once all of them are
+   hashed.  */
+#define IAS_CHUNK_SIZE (1024 * 1024)
+
+struct file_hash {
+	EVP_MD_CTX ctx;
+	CHAR8 *data;
+	UINTN len;
+	BOOLEAN started;
+};
+
+struct file_hasher {
+	CHAR8 *chunk[2];
+	UINTN cur;
+	BOOLEAN pending;
+	EFI_STATUS status;
+};
+
+static void hash_chunk(UINTN start _unused, UINTN end _unused, VOID *ctx)
 {
-	EVP_MD_CTX mdctx;
+	struct file_hash *fh = ctx;
 
-	EVP_MD_CTX_init(&mdctx);
-	EVP_DigestInit_ex(&mdctx, EVP_sha256(), NULL);
-	EVP_DigestUpdate(&mdctx, buffer, len);
-	EVP_DigestFinal_ex(&mdctx, hash, NULL);
-	EVP_MD_CTX_cleanup(&mdctx);
+	EVP_DigestUpdate(&fh->ctx, fh->data, fh->len);
 }
 
-/*Check if input hash matches the real hash of the file with that filename*/
-static EFI_STATUS verify_file_hash(CHAR8* filename,
-				EFI_FILE_IO_INTERFACE *io,
-				CHAR8* hash,
-				UINT32 hashLen,
-				BOOLEAN* verify_pass)
+static EFI_STATUS hasher_join(struct file_hasher *h)
 {
-	EFI_STATUS ret = EFI_SUCCESS;
-	CHAR8 *data;
-	UINTN size = 0;
-	CHAR8 realHash[EVP_MAX_MD_SIZE] = {0};
-	CHAR16 *file;
+	if (!h->pending)
+		return EFI_SUCCESS;
 
-	file = stra_to_str((CHAR8*)(filename));
-	ret = uefi_read_file(io, file, (VOID **)&data, &size);
-	if (EFI_ERROR(ret)) {
-		efi_perror(ret, L"Failed to read %s",file);
-		*verify_pass = FALSE;
-		goto out;
+	h->pending = FALSE;
+	return mp_pool_join(&h->status);
+}
+
+/*Hash the FILENAME file, the last chunk may still be hashed on return*/
+static EFI_STATUS hash_file(struct file_hasher *h, EFI_FILE_IO_INTERFACE *io,
+			    CHAR16 *filename, struct file_hash *fh)
+{
+	EFI_STATUS ret;
+	EFI_FILE *file;
+	UINTN size;
+
+	ret = uefi_open_file(io, filename, &file);
+	if (EFI_ERROR(ret))
+		return ret;
+
+	EVP_MD_CTX_init(&fh->ctx);
+	EVP_DigestInit_ex(&fh->ctx, EVP_sha256(), NULL);
+	fh->started = TRUE;
+
+	for (;;) {
+		size = IAS_CHUNK_SIZE;
+		ret = uefi_call_wrapper(file->Read, 3, file, &size,
+					h->chunk[h->cur]);
+		if (EFI_ERROR(ret) || !size)
+			break;
+
+		/* The previous chunk is in the other buffer but it may
+		   be one of this sub-file */
+		ret = hasher_join(h);
+		if (EFI_ERROR(ret))
+			break;
+
+		fh->data = h->chunk[h->cur];
+		fh->len = size;
+		if (EFI_ERROR(mp_pool_start_detached(1, 1, hash_chunk, fh,
+						     &h->status)))
+			hash_chunk(0, 1, fh);
+		else
+			h->pending = TRUE;
+		h->cur ^= 1;
 	}
-	hash_buffer(data, size, realHash);
-	FreePool(data);
-	if (memcmp(hash, realHash, hashLen)) {
-		*verify_pass = FALSE;
-		error(L"'%s' verify failure", file);
+
+	uefi_call_wrapper(file->Close, 1, file);
+	return ret;
+}
+
+/*Check if the hashes match the real hashes of the NUM_FILES/2 files*/
+static EFI_STATUS verify_file_hashes(IASIMAGE_DATA *file, UINT32 num_files,
+				     EFI_FILE_IO_INTERFACE *io,
+				     BOOLEAN *verify_pass)
+{
+	EFI_STATUS ret = EFI_SUCCESS, join_ret;
+	struct file_hasher h = { .status = EFI_SUCCESS };
+	struct file_hash fh[IASIMAGE_MAX_SUB_IMAGE / 2];
+	CHAR16 *name[IASIMAGE_MAX_SUB_IMAGE / 2];
+	CHAR8 realHash[EVP_MAX_MD_SIZE];
+	UINT32 i, n = num_files / 2;
+
+	*verify_pass = FALSE;
+	if (num_files > IASIMAGE_MAX_SUB_IMAGE) {
+		error(L"Too many sub files");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	ZeroMem(fh, sizeof(fh));
+	ZeroMem(name, sizeof(name));
+
+	h.chunk[0] = AllocatePool(IAS_CHUNK_SIZE);
+	h.chunk[1] = AllocatePool(IAS_CHUNK_SIZE);
+	if (!h.chunk[0] || !h.chunk[1]) {
+		ret = EFI_OUT_OF_RESOURCES;
 		goto out;
 	}
-	Print(L"'%s' verify pass\n", file);
+
+	for (i = 0; i < n; i++) {
+		name[i] = stran_to_str((CHAR8 *)file[2 * i].addr,
+				       file[2 * i].size);
+		if (!name[i]) {
+			ret = EFI_OUT_OF_RESOURCES;
+			break;
+		}
+
+		ret = hash_file(&h, io, name[i], &fh[i]);
+		if (EFI_ERROR(ret)) {
+			efi_perror(ret, L"Failed to read %s", name[i]);
+			break;
+		}
+	}
+
+	join_ret = hasher_join(&h);
+	if (!EFI_ERROR(ret))
+		ret = join_ret;
+	if (EFI_ERROR(ret))
+		goto out;
+
 	*verify_pass = TRUE;
+	for (i = 0; i < n; i++) {
+		EVP_DigestFinal_ex(&fh[i].ctx, realHash, NULL);
+		if (file[2 * i + 1].size > sizeof(realHash) ||
+		    memcmp(file[2 * i + 1].addr, realHash, file[2 * i + 1].size)) {
+			*verify_pass = FALSE;
+			error(L"'%s' verify failure", name[i]);
+			continue;
+		}
+		Print(L"'%s' verify pass\n", name[i]);
+	}
 
 out:
-	FreePool(filename);
+	for (i = 0; i < n; i++) {
+		if (fh[i].started)
+			EVP_MD_CTX_cleanup(&fh[i].ctx);
+		if (name[i])
+			FreePool(name[i]);
+	}
+	if (h.chunk[0])
+		FreePool(h.chunk[0]);
+	if (h.chunk[1])
+		FreePool(h.chunk[1]);
 	return ret;
 }
 
@@ -267,7 +378,6 @@ free_pkey:
 EFI_STATUS verify_vbmeta_ias(CHAR16 *label, CHAR16* fileName, BOOLEAN* verify_pass)
 {
 	EFI_STATUS ret = EFI_SUCCESS;
-	UINT32 index;
 	UINT32 num_files;
 	UINTN size = 0;
 	VOID *iasimage = NULL;
@@ -309,13 +419,7 @@ EFI_STATUS verify_vbmeta_ias(CHAR16 *label, CHAR16* fileName, BOOLEAN* verify_pa
 		goto out;
 	}
 
-	for (index = 0; index < num_files; index+=2) {
-		ret = verify_file_hash( (CHAR8*)file[index].addr, io,
-					(CHAR8*)(file[index + 1].addr),
-					file[index + 1].size, verify_pass);
-		if (EFI_ERROR(ret) || *verify_pass == FALSE)
-			goto out;
-	}
+	ret = verify_file_hashes(file, num_files, io, verify_pass);
 out:
 	FreePool((VOID*)iasimage);
 	return ret;
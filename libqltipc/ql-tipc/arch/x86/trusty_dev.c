@@ -170,6 +170,16 @@ int trusty_dev_shutdown_ipc(struct trusty_dev *dev,
                                  buf, buf_size);
 }
 
+int trusty_dev_nop(struct trusty_dev *dev)
+{
+    int32_t ret;
+
+    do {
+        ret = trusty_std_call32(dev, SMC_SC_NOP, 0, 0, 0);
+    } while (ret == SM_ERR_NOP_INTERRUPTED);
+
+    return ret == SM_ERR_NOP_DONE ? 0 : -1;
+}
 
 static int trusty_init_api_version(struct trusty_dev *dev)
 {
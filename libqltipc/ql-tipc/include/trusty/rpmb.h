@@ -95,5 +95,15 @@ int rpmb_storage_send(void *rpmb_dev,
  * Implementation is platform specific.
  */
 void *rpmb_storage_get_ctx(void);
+/*
+ * Open and close a batch of RPMB storage requests which can share the
+ * RPMB partition selection. Implementation is platform specific.
+ * Returns one of trusty_err.
+ *
+ * @rpmb_dev: Context of RPMB device, initialized with
+ *            rpmb_storage_get_ctx
+ */
+int rpmb_storage_session_begin(void *rpmb_dev);
+int rpmb_storage_session_end(void *rpmb_dev);
 
 #endif /* TRUSTY_RPMB_H_ */
@@ -78,5 +78,12 @@ int trusty_dev_exec_ipc(struct trusty_dev *dev, struct ns_mem_page_info *buf,
  */
 int trusty_dev_shutdown_ipc(struct trusty_dev *dev,
                             struct ns_mem_page_info *buf, uint32_t buf_size);
+/*
+ * Lets the secure side run its pending work. Returns 0 once the secure
+ * side is idle, a negative value otherwise.
+ *
+ * @dev:      trusty device, initialized with trusty_dev_init
+ */
+int trusty_dev_nop(struct trusty_dev *dev);
 
 #endif /* TRUSTY_TRUSTY_DEV_H_ */
@@ -55,9 +55,19 @@ static int sync_ipc_on_disconnect(struct trusty_ipc_chan *chan)
     return TRUSTY_EVENT_HANDLED;
 }
 
+/* Number of event polls before yielding to the secure side */
+#define WAIT_SPIN_POLLS 4
+
+/*
+ * Waits for an event on @chan. The events are reported per channel: other
+ * channels may have requests in flight, their events stay pending until
+ * they are waited for. Quick replies are caught by the first polls, after
+ * that every poll follows a run of the secure side pending work.
+ */
 static int wait_for_complete(struct trusty_ipc_chan *chan)
 {
     int rc;
+    unsigned int polls = 0;
 
     chan->complete = 0;
     for (;;) {
@@ -68,7 +78,8 @@ static int wait_for_complete(struct trusty_ipc_chan *chan)
         if (chan->complete)
             break;
 
-        trusty_ipc_dev_idle(chan->dev);
+        if (++polls >= WAIT_SPIN_POLLS)
+            trusty_ipc_dev_idle(chan->dev);
     }
 
     return chan->complete;
@@ -447,6 +447,9 @@ int trusty_ipc_dev_recv(struct trusty_ipc_dev *dev, handle_t chan,
 
 void trusty_ipc_dev_idle(struct trusty_ipc_dev *dev)
 {
-    trusty_idle(dev->tdev);
+    /* Run the secure side until it has nothing left to do: the awaited
+       event is then most likely pending */
+    if (trusty_dev_nop(dev->tdev))
+        trusty_idle(dev->tdev);
 }
 
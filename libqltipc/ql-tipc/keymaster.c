@@ -47,17 +47,30 @@ static const size_t max_send_size = 4000;
 #ifndef NELEMS
 #define NELEMS(x) (sizeof(x) / sizeof((x)[0]))
 #endif
-static int km_send_request(uint32_t cmd, const void *req, size_t req_len)
+/* Maximum number of request fields, see km_send_request() */
+#define KM_MAX_REQ_IOVS 8
+
+/* Sends the |cmd| request made of the |req_iovs_cnt| fields described
+ * by |req_iovs|. The fields are gathered straight into the shared IPC
+ * buffer: the requests are not serialized in an intermediate buffer.
+ */
+static int km_send_request(uint32_t cmd, const struct trusty_ipc_iovec *req_iovs,
+                           size_t req_iovs_cnt)
 {
     struct keymaster_message header = { .cmd = cmd };
-    int num_iovecs = req ? 2 : 1;
-
-    struct trusty_ipc_iovec req_iovs[2] = {
+    struct trusty_ipc_iovec iovs[KM_MAX_REQ_IOVS + 1] = {
         { .base = &header, .len = sizeof(header) },
-        { .base = (void*)req, .len = req_len },
     };
+    size_t i;
 
-    return trusty_ipc_send(&km_chan, req_iovs, num_iovecs, true);
+    if (req_iovs_cnt > KM_MAX_REQ_IOVS) {
+        return TRUSTY_ERR_INVALID_ARGS;
+    }
+    for (i = 0; i < req_iovs_cnt; i++) {
+        iovs[i + 1] = req_iovs[i];
+    }
+
+    return trusty_ipc_send(&km_chan, iovs, req_iovs_cnt + 1, true);
 }
 
 /* Checks that the command opcode in |header| matches |ex-ected_cmd|. Checks
@@ -187,14 +200,15 @@ static int km_read_data_response(uint32_t cmd, int32_t *error,
  * caller expects an additional data buffer to be returned from the secure
  * side.
  */
-static int km_do_tipc(uint32_t cmd, bool handle_rpmb, void* req,
-                      uint32_t req_len, void* resp_data,
+static int km_do_tipc(uint32_t cmd, bool handle_rpmb,
+                      const struct trusty_ipc_iovec *req_iovs,
+                      size_t req_iovs_cnt, void* resp_data,
                       uint32_t* resp_data_len)
 {
     int rc = TRUSTY_ERR_GENERIC;
     struct km_no_response resp_header  = { .error = 0 };
 
-    rc = km_send_request(cmd, req, req_len);
+    rc = km_send_request(cmd, req_iovs, req_iovs_cnt);
     if (rc < 0) {
         trusty_error("%s: failed (%d) to send km request\n", __func__, rc);
         return rc;
@@ -378,57 +392,40 @@ int trusty_set_boot_params(uint32_t os_version, uint32_t os_patchlevel,
                            const uint8_t* verified_boot_hash,
                            uint32_t verified_boot_hash_size)
 {
-    struct km_boot_params params = {
-        .os_version = os_version,
-        .os_patchlevel = os_patchlevel,
-        .device_locked = (uint32_t)device_locked,
-        .verified_boot_state = (uint32_t)verified_boot_state,
-        .verified_boot_key_hash_size = verified_boot_key_hash_size,
-        .verified_boot_key_hash = (uint8_t *)verified_boot_key_hash,
-        .verified_boot_hash_size = verified_boot_hash_size,
-        .verified_boot_hash = verified_boot_hash
+    uint32_t locked = (uint32_t)device_locked;
+    uint32_t state = (uint32_t)verified_boot_state;
+    /* Same layout as km_boot_params_serialize() */
+    struct trusty_ipc_iovec req_iovs[] = {
+        { .base = &os_version, .len = sizeof(os_version) },
+        { .base = &os_patchlevel, .len = sizeof(os_patchlevel) },
+        { .base = &locked, .len = sizeof(locked) },
+        { .base = &state, .len = sizeof(state) },
+        { .base = &verified_boot_key_hash_size,
+          .len = sizeof(verified_boot_key_hash_size) },
+        { .base = (void *)verified_boot_key_hash,
+          .len = verified_boot_key_hash_size },
+        { .base = &verified_boot_hash_size,
+          .len = sizeof(verified_boot_hash_size) },
+        { .base = (void *)verified_boot_hash, .len = verified_boot_hash_size },
     };
-    uint8_t *req = NULL;
-    uint32_t req_size = 0;
-    int rc = km_boot_params_serialize(&params, &req, &req_size);
-
-    if (rc < 0) {
-        trusty_error("failed (%d) to serialize request\n", rc);
-        goto end;
-    }
-    rc = km_do_tipc(KM_SET_BOOT_PARAMS, false, req, req_size, NULL, NULL);
 
-end:
-    if (req) {
-        trusty_free(req);
-    }
-    return rc;
+    return km_do_tipc(KM_SET_BOOT_PARAMS, false, req_iovs, NELEMS(req_iovs),
+                      NULL, NULL);
 }
 
 static int trusty_send_attestation_data(uint32_t cmd, const uint8_t *data,
                                         uint32_t data_size,
                                         keymaster_algorithm_t algorithm)
 {
-    struct km_attestation_data attestation_data = {
-        .algorithm = (uint32_t)algorithm,
-        .data_size = data_size,
-        .data = (uint8_t *)data,
+    uint32_t alg = (uint32_t)algorithm;
+    /* Same layout as km_attestation_data_serialize() */
+    struct trusty_ipc_iovec req_iovs[] = {
+        { .base = &alg, .len = sizeof(alg) },
+        { .base = &data_size, .len = sizeof(data_size) },
+        { .base = (void *)data, .len = data_size },
     };
-    uint8_t *req = NULL;
-    uint32_t req_size = 0;
-    int rc = km_attestation_data_serialize(&attestation_data, &req, &req_size);
 
-    if (rc < 0) {
-        trusty_error("failed (%d) to serialize request\n", rc);
-        goto end;
-    }
-    rc = km_do_tipc(cmd, true, req, req_size, NULL, NULL);
-
-end:
-    if (req) {
-        trusty_free(req);
-    }
-    return rc;
+    return km_do_tipc(cmd, true, req_iovs, NELEMS(req_iovs), NULL, NULL);
 }
 
 int trusty_set_attestation_key(const uint8_t *key, uint32_t key_size,
@@ -448,23 +445,12 @@ int trusty_append_attestation_cert_chain(const uint8_t *cert,
 
 int trusty_retrieve_keybox(uint8_t *keybox, uint32_t keybox_size)
 {
-    struct km_provision_data provision_data = {
-        .data_size = keybox_size,
-        .data = (uint8_t *)keybox,
+    /* Same layout as km_provision_data_serialize() */
+    struct trusty_ipc_iovec req_iovs[] = {
+        { .base = &keybox_size, .len = sizeof(keybox_size) },
+        { .base = keybox, .len = keybox_size },
     };
-    uint8_t *req = NULL;
-    uint32_t req_size = 0;
-    int rc = km_provision_data_serialize(&provision_data, &req, &req_size);
 
-    if (rc < 0) {
-        trusty_error("failed (%d) to serialize request\n", rc);
-        goto end;
-    }
-    rc = km_do_tipc(KM_PROVISION_KEYBOX, true, req, req_size, NULL, NULL);
-
-end:
-    if (req) {
-        trusty_free(req);
-    }
-    return rc;
+    return km_do_tipc(KM_PROVISION_KEYBOX, true, req_iovs, NELEMS(req_iovs),
+                      NULL, NULL);
 }
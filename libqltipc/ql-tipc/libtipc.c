@@ -93,17 +93,39 @@ static int rpmb_write_keybox_magic_data(uint32_t data)
 #endif
 }
 
+/* The keybox magic lives in an authenticated RPMB block: it is read
+ * once per boot and then tracked here, so that trusty_ipc_init() and
+ * km_tipc_init() do not each pay for an RPMB read frame, and so that
+ * the provisioning write happens once, only if the marker changes. */
+static uint32_t keybox_magic;
+static bool keybox_magic_loaded;
+
+static int keybox_magic_load(void)
+{
+    int rc;
+
+    if (keybox_magic_loaded)
+        return 0;
+
+    rc = rpmb_read_keybox_magic_data(&keybox_magic);
+    if (rc != 0)
+        return rc;
+
+    keybox_magic_loaded = true;
+    return 0;
+}
+
 int is_keybox_retrieved(void)
 {
-    uint32_t data = 0;
     int rc = 0;
 
-    rc = rpmb_read_keybox_magic_data(&data);
+    rc = keybox_magic_load();
     if (rc != 0) {
         trusty_error("Reading keybox provision magic data failed.\n");
+        return 0;
     }
 
-    return (data == KEYBOX_PROVISION_MAGIC_DATA);
+    return (keybox_magic == KEYBOX_PROVISION_MAGIC_DATA);
 }
 
 int set_keybox_provision_magic_data(void)
@@ -111,12 +133,17 @@ int set_keybox_provision_magic_data(void)
     uint32_t data = KEYBOX_PROVISION_MAGIC_DATA;
     int rc = 0;
 
+    if (keybox_magic_loaded && keybox_magic == data)
+        return 0;
+
     rc = rpmb_write_keybox_magic_data(data);
     if (rc != 0) {
         trusty_error("Writing keybox provision magic data failed (%d)\n", rc);
         return rc;
     }
 
+    keybox_magic = data;
+    keybox_magic_loaded = true;
     return 0;
 }
 
@@ -40,6 +40,8 @@ struct trusty_ipc_chan proxy_chan;
 struct storage_msg req_msg;
 static uint8_t req_buf[4096];
 static uint8_t read_buf[4096];
+/* First error of the pending batched messages */
+static int32_t batch_result = STORAGE_NO_ERROR;
 
 /*
  * Read RPMB request from storage service. Writes message to @msg
@@ -77,7 +79,9 @@ static int proxy_read_request(struct trusty_ipc_chan *chan,
 }
 
 /*
- * Send RPMB response to storage service
+ * Send RPMB response to storage service. Messages flagged with
+ * STORAGE_MSG_FLAG_BATCH are not answered: their first error is
+ * reported in the response to the message closing the batch.
  *
  * @chan:     proxy ipc channel
  * @msg:      address of storage message header
@@ -93,6 +97,16 @@ static int proxy_send_response(struct trusty_ipc_chan *chan,
         { .base = resp, .len = resp_len }
     };
 
+    if (msg->flags & STORAGE_MSG_FLAG_BATCH) {
+        if (batch_result == STORAGE_NO_ERROR)
+            batch_result = msg->result;
+        return TRUSTY_ERR_NONE;
+    }
+
+    if (msg->result == STORAGE_NO_ERROR)
+        msg->result = batch_result;
+    batch_result = STORAGE_NO_ERROR;
+
     msg->cmd |= STORAGE_RESP_BIT;
     return trusty_ipc_send(chan, resp_iovs, resp ? 2 : 1, false);
 }
@@ -325,6 +339,11 @@ int rpmb_storage_proxy_init(struct trusty_ipc_dev *dev, void *rpmb_dev)
 int rpmb_storage_proxy_poll(void)
 {
     int rc = 0;
+    bool session;
+
+    /* The requests of a burst share the RPMB partition selection */
+    session = !is_use_sim_rpmb() && !rpmb_storage_session_begin(proxy_rpmb);
+
     while ((rc != TRUSTY_EVENT_NONE) && (proxy_chan.handle != INVALID_IPC_HANDLE)){
         /* Check for RPMB events */
         rc = trusty_ipc_poll_for_event(&proxy_chan);
@@ -332,9 +351,15 @@ int rpmb_storage_proxy_poll(void)
 #ifndef USER
             trusty_error("%a: failed (%d) to get rpmb event\n", __func__, rc);
 #endif
-            return rc;
+            break;
         }
     }
+
+    if (session)
+        rpmb_storage_session_end(proxy_rpmb);
+
+    if (rc < 0)
+        return rc;
     return (proxy_chan.handle)? TRUSTY_ERR_NONE : TRUSTY_ERR_CHANNEL_CLOSED;
 }
 
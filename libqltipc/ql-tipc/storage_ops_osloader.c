@@ -44,6 +44,16 @@ void *rpmb_storage_get_ctx(void)
     return rpmb_dev;
 }
 
+int rpmb_storage_session_begin(void *rpmb_dev)
+{
+    return EFI_ERROR(rpmb_session_begin(rpmb_dev)) ? -1 : 0;
+}
+
+int rpmb_storage_session_end(void *rpmb_dev)
+{
+    return EFI_ERROR(rpmb_session_end(rpmb_dev)) ? -1 : 0;
+}
+
 /*
  *                rel_write       write      read
  * RPMB_READ          0             1        1~N
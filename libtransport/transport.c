@@ -31,17 +31,222 @@
  */
 
 #include <lib.h>
+#include <timer.h>
 #include <transport.h>
 
 static transport_t *transports;
 static UINTN nb_transport;
 static transport_t *current;
 
+static start_callback_t start_callback;
+static data_callback_t rx_callback;
+static data_callback_t tx_callback;
+
+/* Transports started together.  Until one is selected, the first
+   read of the session is posted on every connected transport, in its
+   own probe buffer.  */
+static struct slot {
+	transport_t *trans;
+	BOOLEAN started;
+	BOOLEAN connected;
+	BOOLEAN reading;
+	UINT8 probe[TRANSPORT_PROBE_SIZE];
+} slots[TRANSPORT_MAX];
+static UINTN nb_started;
+static BOOLEAN session_started;
+static BOOLEAN stop_others;
+static transport_t *paused;
+
+static struct {
+	BOOLEAN pending;
+	void *buf;
+	UINT32 size;
+} probe;
+
+static transport_stats_t stats;
+static uint64_t rx_start, tx_start;
+static UINT32 rx_size, tx_size;
+static uint64_t rx_done;
+
+static EFI_EVENT idle_timer;
+static uint64_t last_activity;
+static BOOLEAN activity;
+
+static struct idle_task {
+	idle_task_t task;
+	void *ctx;
+} idle_tasks[TRANSPORT_MAX_IDLE_TASKS];
+static UINTN idle_head, idle_count;
+
+static void account(transport_dir_stats_t *dir, uint64_t start,
+		    unsigned len, UINT32 size)
+{
+	UINT64 usec;
+
+	usec = ticks_to_usec(timer_ticks() - start);
+	dir->bytes += len;
+	dir->transfers++;
+	dir->usec += usec;
+	dir->max_usec = max(dir->max_usec, usec);
+	dir->histogram[transport_histogram_bucket(usec)]++;
+	if (usec > TRANSPORT_STALL_USEC)
+		dir->stalls++;
+
+	if (!dir->min_len || len < dir->min_len)
+		dir->min_len = len;
+	dir->max_len = max(dir->max_len, (UINT64)len);
+	if (len < size)
+		dir->partial++;
+}
+
+static void transport_rx_cb(void *buf, unsigned len)
+{
+	account(&stats.rx, rx_start, len, rx_size);
+	rx_done = timer_ticks();
+	activity = TRUE;
+	rx_callback(buf, len);
+}
+
+static void transport_tx_cb(void *buf, unsigned len)
+{
+	account(&stats.tx, tx_start, len, tx_size);
+	activity = TRUE;
+	tx_callback(buf, len);
+}
+
+static void slot_probe(struct slot *slot)
+{
+	EFI_STATUS ret;
+
+	slot->reading = TRUE;
+	ret = slot->trans->read(slot->probe, min(probe.size, (UINT32)TRANSPORT_PROBE_SIZE));
+	if (EFI_ERROR(ret)) {
+		efi_perror(ret, L"Failed to read on %a transport layer",
+			   slot->trans->name);
+		slot->reading = FALSE;
+	}
+}
+
+static void probe_all(void)
+{
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(slots); i++)
+		if (slots[i].started && slots[i].connected && !slots[i].reading)
+			slot_probe(&slots[i]);
+}
+
+static void slot_start_cb(UINTN i)
+{
+	struct slot *slot = &slots[i];
+
+	slot->connected = TRUE;
+	if (current) {
+		if (current == slot->trans)
+			start_callback();
+		return;
+	}
+
+	if (!session_started) {
+		session_started = TRUE;
+		start_callback();
+		return;
+	}
+
+	if (probe.pending && slot->started && !slot->reading)
+		slot_probe(slot);
+}
+
+/* The first transport on which the host sends data gets the session,
+   the others are stopped from the next transport_run() call.  */
+static void slot_rx_cb(UINTN i, void *buf, unsigned len)
+{
+	struct slot *slot = &slots[i];
+
+	if (current) {
+		if (current == slot->trans)
+			transport_rx_cb(buf, len);
+		return;
+	}
+
+	slot->reading = FALSE;
+	if (!probe.pending)
+		return;
+
+	probe.pending = FALSE;
+	len = min(len, probe.size);
+	memcpy(probe.buf, buf, len);
+
+	current = slot->trans;
+	stop_others = TRUE;
+	debug(L"%a transport layer selected", current->name);
+
+	transport_rx_cb(probe.buf, len);
+}
+
+static void slot_tx_cb(UINTN i, void *buf, unsigned len)
+{
+	if (current == slots[i].trans)
+		transport_tx_cb(buf, len);
+}
+
+#define SLOT_CALLBACKS(i)						\
+	static void start_cb_##i(void)					\
+	{								\
+		slot_start_cb(i);					\
+	}								\
+	static void rx_cb_##i(void *buf, unsigned len)			\
+	{								\
+		slot_rx_cb(i, buf, len);				\
+	}								\
+	static void tx_cb_##i(void *buf, unsigned len)			\
+	{								\
+		slot_tx_cb(i, buf, len);				\
+	}
+
+SLOT_CALLBACKS(0)
+SLOT_CALLBACKS(1)
+SLOT_CALLBACKS(2)
+SLOT_CALLBACKS(3)
+
+static const struct {
+	start_callback_t start;
+	data_callback_t rx;
+	data_callback_t tx;
+} slot_callbacks[TRANSPORT_MAX] = {
+	{ start_cb_0, rx_cb_0, tx_cb_0 },
+	{ start_cb_1, rx_cb_1, tx_cb_1 },
+	{ start_cb_2, rx_cb_2, tx_cb_2 },
+	{ start_cb_3, rx_cb_3, tx_cb_3 }
+};
+
+static void stop_unselected(void)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	stop_others = FALSE;
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (!slots[i].started || slots[i].trans == current)
+			continue;
+
+		ret = slots[i].trans->stop();
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to stop %a transport layer",
+				   slots[i].trans->name);
+		slots[i].started = FALSE;
+		nb_started--;
+	}
+}
+
 EFI_STATUS transport_register(transport_t *trans, UINTN nb)
 {
 	if (!trans || !nb)
 		return EFI_INVALID_PARAMETER;
 
+	if (nb > TRANSPORT_MAX)
+		return EFI_BUFFER_TOO_SMALL;
+
 	transports = trans;
 	nb_transport = nb;
 
@@ -54,60 +259,332 @@ void transport_unregister(void)
 	nb_transport = 0;
 }
 
+/* A paused transport is resumed by its own start(), the others are
+   stopped.  */
+static void release_paused(void)
+{
+	EFI_STATUS ret;
+	UINTN i;
+
+	for (i = 0; i < nb_transport; i++)
+		if (&transports[i] == paused)
+			break;
+
+	if (paused && i == nb_transport) {
+		ret = paused->stop();
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to stop paused %a transport layer",
+				   paused->name);
+	}
+	paused = NULL;
+}
+
+/* All the supported transports are started.  The session goes to the
+   only one which started, or to the first on which the host sends
+   data.  */
 EFI_STATUS transport_start(start_callback_t start_cb,
 			   data_callback_t rx_cb,
 			   data_callback_t tx_cb)
 {
-	EFI_STATUS ret = EFI_NOT_READY;
+	EFI_STATUS ret = EFI_NOT_READY, status;
+	struct slot *slot;
 	UINTN i;
 
 	if (!start_cb || !rx_cb || !tx_cb)
 		return EFI_INVALID_PARAMETER;
 
+	start_callback = start_cb;
+	rx_callback = rx_cb;
+	tx_callback = tx_cb;
+	rx_done = 0;
+	last_activity = timer_ticks();
+
+	current = NULL;
+	nb_started = 0;
+	session_started = FALSE;
+	stop_others = FALSE;
+	probe.pending = FALSE;
+
+	release_paused();
+
+	if (!idle_timer) {
+		status = uefi_call_wrapper(BS->CreateEvent, 5, EVT_TIMER, 0,
+					   NULL, NULL, &idle_timer);
+		if (EFI_ERROR(status)) {
+			efi_perror(status, L"Failed to create the idle timer");
+			idle_timer = NULL;
+		}
+	}
+
 	for (i = 0; i < nb_transport; i++) {
-		current = &transports[i];
-		ret = current->start(start_cb, rx_cb, tx_cb);
-		if (!EFI_ERROR(ret))
-			break;
-		current = NULL;
+		slot = &slots[i];
+		slot->trans = &transports[i];
+		slot->started = slot->connected = slot->reading = FALSE;
 
-		if (ret == EFI_UNSUPPORTED) {
-			debug(L"%a transport layer is not supported, skipping",
-			      transports[i].name);
+		status = slot->trans->start(slot_callbacks[i].start,
+					    slot_callbacks[i].rx,
+					    slot_callbacks[i].tx);
+		if (EFI_ERROR(status)) {
+			ret = status;
+			if (status == EFI_UNSUPPORTED)
+				debug(L"%a transport layer is not supported, skipping",
+				      slot->trans->name);
+			else
+				efi_perror(status, L"Failed to initialize %a transport layer",
+					   slot->trans->name);
 			continue;
 		}
-		efi_perror(ret, L"Failed to initialize %a transport layer",
-			   transports[i].name);
-		break;
+
+		slot->started = TRUE;
+		nb_started++;
+		debug(L"%a transport layer started", slot->trans->name);
 	}
 
-	if (current)
-		debug(L"%a transport layer selected", current->name);
+	if (!nb_started)
+		return ret;
+
+	if (nb_started > 1) {
+		/* A transport may have connected while starting */
+		if (probe.pending)
+			probe_all();
+		return EFI_SUCCESS;
+	}
+
+	for (i = 0; !slots[i].started; i++)
+		;
+	current = slots[i].trans;
+	debug(L"%a transport layer selected", current->name);
+
+	if (probe.pending) {
+		probe.pending = FALSE;
+		ret = transport_read(probe.buf, probe.size);
+		if (EFI_ERROR(ret))
+			efi_perror(ret, L"Failed to read on %a transport layer",
+				   current->name);
+	}
+
+	return EFI_SUCCESS;
+}
+
+static EFI_STATUS transport_halt(BOOLEAN pause)
+{
+	EFI_STATUS ret = nb_started ? EFI_SUCCESS : EFI_NOT_STARTED, status;
+	transport_t *trans;
+	UINTN i;
+
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		if (!slots[i].started)
+			continue;
+
+		trans = slots[i].trans;
+		if (pause && trans == current && trans->pause) {
+			status = trans->pause();
+			if (!EFI_ERROR(status))
+				paused = trans;
+		} else
+			status = trans->stop();
+		if (EFI_ERROR(status))
+			ret = status;
+		slots[i].started = FALSE;
+	}
+	nb_started = 0;
+	current = NULL;
+	probe.pending = FALSE;
+
+	if (idle_timer) {
+		uefi_call_wrapper(BS->CloseEvent, 1, idle_timer);
+		idle_timer = NULL;
+	}
+	idle_head = idle_count = 0;
 
 	return ret;
 }
 
 EFI_STATUS transport_stop(void)
+{
+	return transport_halt(FALSE);
+}
+
+EFI_STATUS transport_pause(void)
+{
+	return transport_halt(TRUE);
+}
+
+EFI_STATUS transport_queue_idle_task(idle_task_t task, void *ctx)
+{
+	struct idle_task *t;
+
+	if (!task)
+		return EFI_INVALID_PARAMETER;
+
+	if (idle_count == ARRAY_SIZE(idle_tasks))
+		return EFI_OUT_OF_RESOURCES;
+
+	t = &idle_tasks[(idle_head + idle_count) % ARRAY_SIZE(idle_tasks)];
+	t->task = task;
+	t->ctx = ctx;
+	idle_count++;
+
+	return EFI_SUCCESS;
+}
+
+static void run_idle_task(void)
+{
+	struct idle_task t = idle_tasks[idle_head];
+
+	idle_head = (idle_head + 1) % ARRAY_SIZE(idle_tasks);
+	idle_count--;
+	stats.idle_tasks++;
+	t.task(t.ctx);
+}
+
+/* Wait for the next firmware timer tick.  The firmware halts the
+   processor in WaitForEvent() until an interrupt fires.  */
+static void idle_sleep(void)
 {
 	EFI_STATUS ret;
+	uint64_t start;
+	UINTN index;
 
-	ret = current ? current->stop() : EFI_NOT_STARTED;
-	current = NULL;
+	ret = uefi_call_wrapper(BS->SetTimer, 3, idle_timer, TimerRelative,
+				TRANSPORT_IDLE_SLEEP_TICK);
+	if (EFI_ERROR(ret))
+		return;
 
-	return ret;
+	start = timer_ticks();
+	uefi_call_wrapper(BS->WaitForEvent, 3, 1, &idle_timer, &index);
+	stats.sleep_usec += ticks_to_usec(timer_ticks() - start);
 }
 
 EFI_STATUS transport_run(void)
 {
-	return current ? current->run() : EFI_NOT_STARTED;
+	EFI_STATUS ret = EFI_SUCCESS, status;
+	uint64_t now;
+	UINTN i;
+
+	if (!nb_started)
+		return EFI_NOT_STARTED;
+
+	if (stop_others)
+		stop_unselected();
+
+	if (current)
+		ret = current->run();
+	else
+		for (i = 0; i < ARRAY_SIZE(slots); i++) {
+			if (!slots[i].started)
+				continue;
+			status = slots[i].trans->run();
+			if (EFI_ERROR(status))
+				ret = status;
+		}
+
+	/* The completion handlers can also run from the firmware timer
+	   notifications, between two iterations */
+	now = timer_ticks();
+	if (activity) {
+		activity = FALSE;
+		last_activity = now;
+		return ret;
+	}
+
+	/* The quiet transport loop is the fastboot and adb idle point */
+	log_flush();
+	if (idle_count)
+		run_idle_task();
+	else if (idle_timer &&
+		 ticks_to_usec(now - last_activity) > TRANSPORT_IDLE_SLEEP_USEC)
+		idle_sleep();
+
+	return ret;
 }
 
 EFI_STATUS transport_read(void *buf, UINT32 size)
 {
-	return current ? current->read(buf, size) : EFI_NOT_STARTED;
+	UINT64 usec;
+
+	if (!current && !session_started)
+		return EFI_NOT_STARTED;
+
+	rx_start = timer_ticks();
+	rx_size = size;
+	last_activity = rx_start;
+	if (rx_done) {
+		usec = ticks_to_usec(rx_start - rx_done);
+		stats.rearm_usec += usec;
+		stats.rearm_max_usec = max(stats.rearm_max_usec, usec);
+		stats.rearms++;
+		rx_done = 0;
+	}
+
+	if (!current) {
+		probe.pending = TRUE;
+		probe.buf = buf;
+		probe.size = size;
+		probe_all();
+		return EFI_SUCCESS;
+	}
+
+	return current->read(buf, size);
 }
 
 EFI_STATUS transport_write(void *buf, UINT32 size)
 {
-	return current ? current->write(buf, size) : EFI_NOT_STARTED;
+	if (!current)
+		return EFI_NOT_STARTED;
+
+	tx_start = timer_ticks();
+	tx_size = size;
+	last_activity = tx_start;
+	return current->write(buf, size);
+}
+
+EFI_STATUS transport_writev(const transport_iov_t *iov, UINTN iovcnt)
+{
+	UINTN i;
+
+	if (!iov || !iovcnt || iovcnt > TRANSPORT_MAX_IOV)
+		return EFI_INVALID_PARAMETER;
+
+	if (!current)
+		return EFI_NOT_STARTED;
+
+	if (!current->writev)
+		return EFI_UNSUPPORTED;
+
+	tx_start = timer_ticks();
+	for (tx_size = 0, i = 0; i < iovcnt; i++)
+		tx_size += iov[i].len;
+	last_activity = tx_start;
+	return current->writev(iov, iovcnt);
+}
+
+BOOLEAN transport_has_writev(void)
+{
+	return current && current->writev;
+}
+
+UINT32 transport_transfer_unit(void)
+{
+	return current ? current->transfer_unit : 0;
+}
+
+const transport_stats_t *transport_get_stats(void)
+{
+	return &stats;
+}
+
+void transport_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+UINTN transport_histogram_bucket(UINT64 usec)
+{
+	UINTN bucket = 0;
+
+	for (; usec && bucket < TRANSPORT_HISTOGRAM_SIZE - 1; usec >>= 1)
+		bucket++;
+
+	return bucket;
 }
@@ -41,6 +41,23 @@
 #include "unittest.h"
 #include "blobstore.h"
 #include "watchdog.h"
+#include "crc32.h"
+#include "mp_pool.h"
+#include "cmdline.h"
+#include "timer.h"
+#include "rpmb_memory.h"
+#include "gpt.h"
+#include "slot.h"
+#include "vars.h"
+#include "upng.h"
+#include "aes_gcm.h"
+#include <openssl/sha.h>
+#ifdef USE_IPP_SHA256
+#include "sha256_ipps.h"
+#endif
+#ifdef USE_AVB
+#include "libavb/libavb.h"
+#endif
 
 /*
  * This is the hardware second timeout value
@@ -84,6 +101,782 @@ static VOID test_keys(VOID)
         }
 }
 
+static VOID test_crc32(VOID)
+{
+        static const CHAR8 check[] = "123456789";
+        static UINT8 buf[4096];
+        const UINT32 pattern = 0xdeadbeef;
+        UINT32 crc, expected;
+        EFI_STATUS ret;
+        UINTN i;
+
+        crc = crc32_update(0, check, sizeof(check) - 1);
+        if (crc != 0xcbf43926) {
+                Print(L"crc32 check value 0x%08x is wrong, test Failed\n", crc);
+                return;
+        }
+
+        for (i = 0; i < sizeof(buf); i += sizeof(pattern))
+                memcpy(&buf[i], &pattern, sizeof(pattern));
+        expected = crc32_update(crc, buf, sizeof(buf));
+
+        crc = crc32_repeat(crc32_update(0, check, sizeof(check) - 1), &pattern,
+                           sizeof(pattern), sizeof(buf) / sizeof(pattern));
+        if (crc != expected) {
+                Print(L"crc32 repeat 0x%08x != 0x%08x, test Failed\n", crc, expected);
+                return;
+        }
+
+        crc = crc32_combine(crc32_update(0, buf, 1000),
+                            crc32_update(0, buf + 1000, sizeof(buf) - 1000),
+                            sizeof(buf) - 1000);
+        if (crc != crc32_update(0, buf, sizeof(buf))) {
+                Print(L"crc32 combine 0x%08x is wrong, test Failed\n", crc);
+                return;
+        }
+
+        /* Compare with the firmware on every size and alignment the
+           PCLMULQDQ and slice-by-8 paths handle differently */
+        for (i = 0; i < sizeof(buf); i++)
+                buf[i] = i * 31 + (i >> 8);
+        for (i = 1; i < 300; i++) {
+                ret = uefi_call_wrapper(BS->CalculateCrc32, 3, buf + (i & 7),
+                                        i * 13, &expected);
+                if (EFI_ERROR(ret)) {
+                        Print(L"CalculateCrc32 failed %r, test Failed\n", ret);
+                        return;
+                }
+                crc = crc32_update(0, buf + (i & 7), i * 13);
+                if (crc != expected) {
+                        Print(L"crc32 of %d bytes 0x%08x != firmware 0x%08x, test Failed\n",
+                              i * 13, crc, expected);
+                        return;
+                }
+        }
+
+        Print(L"crc32 test Succeeded\n");
+}
+
+/* NIST GCM specification test case 14 */
+static const UINT8 GCM_KAT_CIPHER[] = {
+        0xce, 0xa7, 0x40, 0x3d, 0x4d, 0x60, 0x6b, 0x6e,
+        0x07, 0x4e, 0xc5, 0xd3, 0xba, 0xf3, 0x9d, 0x18,
+        0xd0, 0xd1, 0xc8, 0xa7, 0x99, 0x99, 0x6b, 0xf0,
+        0x26, 0x5b, 0x98, 0xb5, 0xd4, 0x8a, 0xb9, 0x19
+};
+
+static VOID test_aes_gcm(VOID)
+{
+        static const UINTN sizes[] = { 0, 1, 15, 16, 17, 63, 64, 65, 1000, 1100 };
+        static UINT8 plain[1100], out[1100 + GCM_TAG_SIZE];
+        static UINT8 expected[1100 + GCM_TAG_SIZE];
+        UINT8 iv[GCM_IV_SIZE], aad[37];
+        struct gcm_key key;
+        size_t out_size, expected_size;
+        UINTN i, j;
+        int rc;
+
+        memset(&key, 0, sizeof(key));
+        memset(iv, 0, sizeof(iv));
+        memset(plain, 0, sizeof(plain));
+        rc = aes_256_gcm_encrypt(&key, iv, sizeof(iv), NULL, 0, plain, 16,
+                                 out, &out_size);
+        if (rc || out_size != sizeof(GCM_KAT_CIPHER) ||
+            memcmp(out, GCM_KAT_CIPHER, out_size)) {
+                Print(L"aes_gcm known answer is wrong, test Failed\n");
+                return;
+        }
+
+        /* The AES-NI path, when the processor has it, must match the
+           OpenSSL one bit for bit on every size and tail length */
+        for (i = 0; i < sizeof(key); i++)
+                key.byte[i] = i * 13 + 1;
+        for (i = 0; i < sizeof(aad); i++)
+                aad[i] = i * 7;
+        for (i = 0; i < sizeof(plain); i++)
+                plain[i] = i * 31 + (i >> 8);
+
+        for (i = 0; i < ARRAY_SIZE(sizes); i++)
+                for (j = 0; j < sizeof(aad); j += 12) {
+                        iv[0] = i;
+                        aes_gcm_force_software(TRUE);
+                        rc = aes_256_gcm_encrypt(&key, iv, sizeof(iv), aad, j,
+                                                 plain, sizes[i], expected,
+                                                 &expected_size);
+                        aes_gcm_force_software(FALSE);
+                        if (!rc)
+                                rc = aes_256_gcm_encrypt(&key, iv, sizeof(iv),
+                                                         aad, j, plain, sizes[i],
+                                                         out, &out_size);
+                        if (rc || out_size != expected_size ||
+                            memcmp(out, expected, out_size)) {
+                                Print(L"aes_gcm %d bytes, %d bytes of aad mismatch, test Failed\n",
+                                      sizes[i], j);
+                                return;
+                        }
+
+                        rc = aes_256_gcm_decrypt(&key, iv, sizeof(iv), aad, j,
+                                                 expected, expected_size,
+                                                 out, &out_size);
+                        if (rc || out_size != sizes[i] ||
+                            memcmp(out, plain, out_size)) {
+                                Print(L"aes_gcm %d bytes decryption failed, test Failed\n",
+                                      sizes[i]);
+                                return;
+                        }
+
+                        expected[expected_size - 1] ^= 1;
+                        rc = aes_256_gcm_decrypt(&key, iv, sizeof(iv), aad, j,
+                                                 expected, expected_size,
+                                                 out, &out_size);
+                        if (rc != AES_GCM_ERR_AUTH_FAILED) {
+                                Print(L"aes_gcm %d bytes forged tag accepted, test Failed\n",
+                                      sizes[i]);
+                                return;
+                        }
+                }
+
+        Print(L"aes_gcm test Succeeded\n");
+}
+
+static VOID test_cmdline(VOID)
+{
+        static const CHAR8 expected[] = "p2 p1=1 base a1=x vb";
+        CHAR8 buf[sizeof(expected)];
+        cmdline_t cl;
+        EFI_STATUS ret;
+
+        cmdline_init(&cl);
+        ret = cmdline_append_ref(&cl, (CHAR8 *)"base args", 4);
+        if (!EFI_ERROR(ret))
+                ret = cmdline_prepend(&cl, L"p1=%d", 1);
+        if (!EFI_ERROR(ret))
+                ret = cmdline_append(&cl, L"a1=%a", "x");
+        if (!EFI_ERROR(ret))
+                ret = cmdline_prepend(&cl, L"p2");
+        if (!EFI_ERROR(ret))
+                ret = cmdline_append_ref(&cl, (CHAR8 *)"", 0);
+        if (!EFI_ERROR(ret))
+                ret = cmdline_append_ref(&cl, (CHAR8 *)"vb", 2);
+        if (EFI_ERROR(ret)) {
+                Print(L"cmdline fragment add failed %r, test Failed\n", ret);
+                goto out;
+        }
+
+        if (cmdline_len(&cl) != sizeof(expected) - 1) {
+                Print(L"cmdline length %d is wrong, test Failed\n",
+                      cmdline_len(&cl));
+                goto out;
+        }
+
+        ret = cmdline_build(&cl, buf, sizeof(buf));
+        if (EFI_ERROR(ret) || strcmp(buf, expected)) {
+                Print(L"cmdline '%a' is wrong, test Failed\n", buf);
+                goto out;
+        }
+
+        Print(L"cmdline test Succeeded\n");
+out:
+        cmdline_free(&cl);
+}
+
+static void mp_pool_fill(UINTN start, UINTN end, VOID *ctx)
+{
+        UINT32 *values = ctx;
+
+        for (; start < end; start++)
+                values[start] = start * 3;
+}
+
+static VOID test_mp_pool(VOID)
+{
+        static UINT32 values[100000];
+        EFI_STATUS ret;
+        UINTN i;
+
+        ret = parallel_for(ARRAY_SIZE(values), 1000, mp_pool_fill, values);
+        if (EFI_ERROR(ret)) {
+                Print(L"parallel_for failed %r, test Failed\n", ret);
+                return;
+        }
+
+        for (i = 0; i < ARRAY_SIZE(values); i++)
+                if (values[i] != i * 3) {
+                        Print(L"item %d not processed, test Failed\n", i);
+                        return;
+                }
+
+        Print(L"mp_pool test Succeeded on %d processors\n", mp_pool_cpu_count());
+}
+
+#define MEMBENCH_SIZE (4 * 1024 * 1024)
+
+static VOID membench_report(CHAR16 *name, UINTN size, UINTN loops,
+                            UINT32 begin)
+{
+        UINT32 elapsed = boottime_in_msec() - begin;
+        UINT64 total = (UINT64)size * loops;
+
+        if (!elapsed)
+                elapsed = 1;
+        Print(L"%s %d bytes: %ld MB/s\n", name, size,
+              (total * 1000 / elapsed) / (1024 * 1024));
+}
+
+static VOID test_memory(VOID)
+{
+        static const UINTN sizes[] = { 64, 512, EFI_PAGE_SIZE,
+                                       MEMBENCH_SIZE / 2 - 3 };
+        EFI_PHYSICAL_ADDRESS addr = 0;
+        EFI_STATUS ret;
+        UINT8 *src, *dst;
+        UINTN i, j, loops, size;
+        UINT32 begin;
+
+        /* Page aligned buffers to exercise the aligned fast path */
+        ret = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages,
+                                EfiLoaderData,
+                                EFI_SIZE_TO_PAGES(2 * MEMBENCH_SIZE), &addr);
+        if (EFI_ERROR(ret)) {
+                Print(L"Failed to allocate the buffers, test Failed\n");
+                return;
+        }
+        src = (UINT8 *)(UINTN)addr;
+        dst = src + MEMBENCH_SIZE;
+
+        for (i = 0; i < MEMBENCH_SIZE; i++)
+                src[i] = i * 7;
+
+        for (size = 0; size < 300; size++) {
+                memset(dst, 0xAA, size + 64);
+                memcpy(dst + 1, src + 3, size);
+                if (memcmp(dst + 1, src + 3, size) || dst[0] != 0xAA ||
+                    dst[size + 1] != 0xAA) {
+                        Print(L"memcpy of %d bytes is wrong, test Failed\n",
+                              size);
+                        goto out;
+                }
+                memcpy(dst, src, size + 16);
+                memmove(dst + 5, dst, size + 16);
+                if (memcmp(dst + 5, src, size + 16)) {
+                        Print(L"memmove of %d bytes is wrong, test Failed\n",
+                              size);
+                        goto out;
+                }
+                memset(dst, 0xAA, size + 64);
+                dst[size + 1] = '\n';
+                if (mem_find(dst + 1, '\n', size + 63) != dst + size + 1 ||
+                    mem_find(dst + 1, '\n', size)) {
+                        Print(L"mem_find of %d bytes is wrong, test Failed\n",
+                              size);
+                        goto out;
+                }
+        }
+
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+                size = sizes[i];
+                loops = (256 * 1024 * 1024) / size;
+
+                begin = boottime_in_msec();
+                for (j = 0; j < loops; j++)
+                        memcpy(dst, src, size);
+                membench_report(L"memcpy", size, loops, begin);
+
+                begin = boottime_in_msec();
+                for (j = 0; j < loops; j++)
+                        memset(dst, j, size);
+                membench_report(L"memset", size, loops, begin);
+
+                begin = boottime_in_msec();
+                for (j = 0; j < loops; j++)
+                        memmove(dst + 1, dst, size);
+                membench_report(L"memmove", size, loops, begin);
+
+                memset(dst, 0, size);
+                begin = boottime_in_msec();
+                for (j = 0; j < loops; j++)
+                        if (mem_find(dst, '\n', size))
+                                break;
+                membench_report(L"mem_find", size, loops, begin);
+        }
+
+        Print(L"memory test Succeeded\n");
+out:
+        uefi_call_wrapper(BS->FreePages, 2, addr,
+                          EFI_SIZE_TO_PAGES(2 * MEMBENCH_SIZE));
+}
+
+#define RPMB_TEST_BLOCKS 4
+
+static VOID rpmb_report(const CHAR16 *workload)
+{
+        const struct rpmb_memory_stats *stats = rpmb_memory_get_stats();
+
+        Print(L"%s: %ld requests, %ld frames, %ld HMACs, %ld partition switches\n",
+              workload, stats->requests, stats->frames, stats->hmacs,
+              stats->partition_switches);
+        rpmb_memory_reset_stats();
+}
+
+static VOID test_rpmb(VOID)
+{
+        rpmb_ops_func_t *ops = get_memory_storage_rpmb_ops();
+        UINT8 key[RPMB_KEY_SIZE], wrong_key[RPMB_KEY_SIZE];
+        UINT8 data[RPMB_TEST_BLOCKS * 256], buf[sizeof(data)];
+        RPMB_RESPONSE_RESULT result;
+        EFI_STATUS ret;
+        UINT32 counter;
+        void *dev;
+        UINTN i;
+
+        for (i = 0; i < sizeof(key); i++) {
+                key[i] = i;
+                wrong_key[i] = ~i;
+        }
+        for (i = 0; i < sizeof(data); i++)
+                data[i] = i * 13;
+
+        ret = ops->get_storage_protocol(&dev, NULL);
+        if (EFI_ERROR(ret)) {
+                Print(L"Failed to initialize the memory RPMB, test Failed\n");
+                return;
+        }
+        rpmb_memory_reset();
+        rpmb_memory_reset_stats();
+
+        ret = ops->get_rpmb_counter(dev, &counter, key, &result);
+        if (!EFI_ERROR(ret) || result != RPMB_RES_NO_AUTH_KEY_PROGRAM) {
+                Print(L"Counter read without key, test Failed\n");
+                return;
+        }
+
+        ret = ops->program_rpmb_key(dev, key, &result);
+        if (EFI_ERROR(ret)) {
+                Print(L"Key programming failed, test Failed\n");
+                return;
+        }
+        ret = ops->program_rpmb_key(dev, key, &result);
+        if (!EFI_ERROR(ret) || result != RPMB_RES_GENERAL_FAILURE) {
+                Print(L"Key programmed twice, test Failed\n");
+                return;
+        }
+        rpmb_report(L"key programming");
+
+        ret = ops->write_rpmb_data(dev, RPMB_TEST_BLOCKS, 2, data, key, &result);
+        if (EFI_ERROR(ret)) {
+                Print(L"Write failed, result %d, test Failed\n", result);
+                return;
+        }
+        ret = ops->read_rpmb_data(dev, RPMB_TEST_BLOCKS, 2, buf, key, &result);
+        if (EFI_ERROR(ret) || memcmp(buf, data, sizeof(data))) {
+                Print(L"Read back failed, test Failed\n");
+                return;
+        }
+        ret = ops->read_rpmb_data(dev, RPMB_TEST_BLOCKS, 2, buf, wrong_key, &result);
+        if (!EFI_ERROR(ret)) {
+                Print(L"Read MAC not checked, test Failed\n");
+                return;
+        }
+        ret = ops->write_rpmb_data(dev, 1, 0, data, wrong_key, &result);
+        if (!EFI_ERROR(ret)) {
+                Print(L"Write with the wrong key accepted, test Failed\n");
+                return;
+        }
+        rpmb_report(L"multi-block write and reads");
+
+        for (i = 0; i < RPMB_TEST_BLOCKS; i++) {
+                ret = ops->write_rpmb_data(dev, 1, i, data + i * 256, key, &result);
+                if (EFI_ERROR(ret)) {
+                        Print(L"Single block write failed, test Failed\n");
+                        return;
+                }
+        }
+        rpmb_report(L"single block writes");
+
+        ops->session_begin(dev);
+        for (i = 0; i < RPMB_TEST_BLOCKS; i++) {
+                ret = ops->write_rpmb_data(dev, 1, i, data + i * 256, key, &result);
+                if (EFI_ERROR(ret)) {
+                        ops->session_end(dev);
+                        Print(L"Session write failed, test Failed\n");
+                        return;
+                }
+        }
+        ops->session_end(dev);
+        if (rpmb_memory_get_stats()->partition_switches != 2) {
+                Print(L"Session did not share the partition switch, test Failed\n");
+                return;
+        }
+        rpmb_report(L"single block writes in a session");
+
+        ret = ops->get_rpmb_counter(dev, &counter, key, &result);
+        if (EFI_ERROR(ret) || counter != 1 + 2 * RPMB_TEST_BLOCKS) {
+                Print(L"Unexpected write counter %d, test Failed\n", counter);
+                return;
+        }
+
+        rpmb_memory_reset();
+        Print(L"rpmb test Succeeded\n");
+}
+
+/* Benchmarks: each kernel runs ITERATIONS times on every working set
+ * size, 'bench [kernel|all] [iterations] [size]'.  The TSC cycles of
+ * each run are sorted to report the minimum, the median and the 99th
+ * percentile.  The report is printed, logged to the serial port and
+ * saved in the volatile BENCH_VAR loader variable.
+ */
+#define BENCH_ITERATIONS 101
+#define BENCH_MAX_ITERATIONS 1001
+#define BENCH_MAX_SIZE (4 * 1024 * 1024)
+#define BENCH_VAR L"UnittestBench"
+
+static const UINTN BENCH_SIZES[] = { EFI_PAGE_SIZE, 64 * 1024,
+                                     1024 * 1024, BENCH_MAX_SIZE };
+
+static UINTN test_argc;
+static CHAR16 **test_argv;
+
+struct bench_ctx {
+        UINT8 *src;
+        UINT8 *dst;
+        UINTN size;
+        VOID *priv;
+};
+
+/* A sized kernel runs on each working set size, the other kernels
+   set the input size themselves in their setup function.  */
+struct bench_kernel {
+        CHAR16 *name;
+        BOOLEAN sized;
+        EFI_STATUS (*setup)(struct bench_ctx *ctx);
+        VOID (*run)(struct bench_ctx *ctx);
+};
+
+static volatile UINT32 bench_sink;
+static UINT64 bench_samples[BENCH_MAX_ITERATIONS];
+static CHAR8 bench_report[4096];
+static UINTN bench_report_len;
+
+static VOID bench_print(const char *fmt, ...)
+{
+        CHAR8 line[256];
+        va_list args;
+        int len;
+
+        va_start(args, fmt);
+        len = efi_vsnprintf(line, sizeof(line), (CHAR8 *)fmt, args);
+        va_end(args);
+        if (len <= 0)
+                return;
+
+        Print(L"%a\n", line);
+        log(L"%a\n", line);
+        if (bench_report_len + len + 1 < sizeof(bench_report)) {
+                memcpy(bench_report + bench_report_len, line, len);
+                bench_report_len += len;
+                bench_report[bench_report_len++] = '\n';
+        }
+}
+
+static VOID bench_memcpy(struct bench_ctx *ctx)
+{
+        memcpy(ctx->dst, ctx->src, ctx->size);
+}
+
+static VOID bench_memset(struct bench_ctx *ctx)
+{
+        memset(ctx->dst, 0x5A, ctx->size);
+}
+
+static VOID bench_crc32(struct bench_ctx *ctx)
+{
+        bench_sink = crc32_update(0, ctx->src, ctx->size);
+}
+
+static VOID bench_sha256(struct bench_ctx *ctx)
+{
+        UINT8 md[SHA256_DIGEST_LENGTH];
+
+        SHA256(ctx->src, ctx->size, md);
+        bench_sink = md[0];
+}
+
+/* The tag is accounted in the working set size so that the output
+   fits in the destination buffer */
+static VOID bench_aes_gcm(struct bench_ctx *ctx)
+{
+        static const UINT8 iv[GCM_IV_SIZE];
+        size_t out_size;
+
+        bench_sink = aes_256_gcm_encrypt(ctx->priv, iv, sizeof(iv), NULL, 0,
+                                         ctx->src,
+                                         ctx->size - min(ctx->size, (UINTN)GCM_TAG_SIZE),
+                                         ctx->dst, &out_size);
+}
+
+static EFI_STATUS bench_aes_gcm_setup(struct bench_ctx *ctx)
+{
+        static struct gcm_key key;
+
+        ctx->priv = &key;
+        return EFI_SUCCESS;
+}
+
+static VOID bench_aes_gcm_sw(struct bench_ctx *ctx)
+{
+        aes_gcm_force_software(TRUE);
+        bench_aes_gcm(ctx);
+        aes_gcm_force_software(FALSE);
+}
+
+#ifdef USE_IPP_SHA256
+static EFI_STATUS bench_sha256_ipps_setup(struct bench_ctx *ctx _unused)
+{
+        return sha256_ipps_is_supported() ? EFI_SUCCESS : EFI_UNSUPPORTED;
+}
+
+static VOID bench_sha256_ipps(struct bench_ctx *ctx)
+{
+        SHA256_IPPS_CTX sha;
+        UINT32 md[SHA256_DIGEST_LENGTH / sizeof(UINT32)];
+
+        ippsSHA256_Init(&sha);
+        ippsSHA256_Update(&sha, ctx->src, ctx->size);
+        ippsSHA256_Final(&sha, md);
+        bench_sink = md[0];
+}
+#endif
+
+static EFI_STATUS bench_gpt_setup(struct bench_ctx *ctx)
+{
+        struct gpt_partition_interface gparti;
+
+        ctx->priv = (VOID *)slot_label(BOOT_LABEL);
+        if (!ctx->priv)
+                return EFI_NOT_FOUND;
+        return gpt_get_partition_by_label(ctx->priv, &gparti,
+                                          LOGICAL_UNIT_USER);
+}
+
+static VOID bench_gpt(struct bench_ctx *ctx)
+{
+        struct gpt_partition_interface gparti;
+
+        bench_sink = gpt_get_partition_by_label(ctx->priv, &gparti,
+                                                LOGICAL_UNIT_USER);
+}
+
+#ifdef USE_AVB
+/* libavb SHA and RSA verification of the vbmeta partition */
+static EFI_STATUS bench_vbmeta_setup(struct bench_ctx *ctx)
+{
+        struct gpt_partition_interface gparti;
+        const CHAR16 *label;
+        EFI_STATUS ret;
+
+        label = slot_label(VBMETA_LABEL);
+        if (!label)
+                return EFI_NOT_FOUND;
+        ret = gpt_get_partition_by_label(label, &gparti, LOGICAL_UNIT_USER);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        ctx->size = 64 * 1024;
+        ret = uefi_call_wrapper(gparti.dio->ReadDisk, 5, gparti.dio,
+                                gparti.bio->Media->MediaId,
+                                gparti.part.starting_lba * gparti.bio->Media->BlockSize,
+                                ctx->size, ctx->src);
+        if (EFI_ERROR(ret))
+                return ret;
+
+        if (avb_vbmeta_image_verify(ctx->src, ctx->size, NULL, NULL) !=
+            AVB_VBMETA_VERIFY_RESULT_OK)
+                return EFI_UNSUPPORTED;
+
+        return EFI_SUCCESS;
+}
+
+static VOID bench_vbmeta(struct bench_ctx *ctx)
+{
+        bench_sink = avb_vbmeta_image_verify(ctx->src, ctx->size, NULL, NULL);
+}
+#endif
+
+#ifdef USE_UI
+static const char *BENCH_IMG_NAME = "splash_intel";
+
+static EFI_STATUS bench_upng_setup(struct bench_ctx *ctx)
+{
+        ui_image_t *image = ui_image_find(BENCH_IMG_NAME);
+
+        if (!image)
+                return EFI_NOT_FOUND;
+        ctx->priv = image;
+        ctx->size = image->size;
+        return EFI_SUCCESS;
+}
+
+static VOID bench_upng(struct bench_ctx *ctx)
+{
+        ui_image_t *image = ctx->priv;
+        EFI_GRAPHICS_OUTPUT_BLT_PIXEL *blt;
+        UINTN width, height;
+
+        if (!EFI_ERROR(upng_load((const char *)image->data, image->size,
+                                 &blt, &width, &height)))
+                FreePool(blt);
+}
+
+/* Scale the decoded image up by 3/2 */
+static EFI_STATUS bench_scale_setup(struct bench_ctx *ctx)
+{
+        ui_image_t *image = ui_image_get(BENCH_IMG_NAME);
+
+        if (!image)
+                return EFI_NOT_FOUND;
+
+        ctx->size = (image->width * 3 / 2) * (image->height * 3 / 2) *
+                sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL);
+        ctx->priv = image;
+        return ctx->size <= BENCH_MAX_SIZE ? EFI_SUCCESS : EFI_BUFFER_TOO_SMALL;
+}
+
+static VOID bench_scale(struct bench_ctx *ctx)
+{
+        ui_image_t *image = ctx->priv;
+
+        ui_bilinear_scale((unsigned char *)image->blt, ctx->dst,
+                          image->width, image->height,
+                          image->width * 3 / 2, image->height * 3 / 2,
+                          sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+}
+#endif
+
+static const struct bench_kernel BENCH_KERNELS[] = {
+        { L"memcpy", TRUE, NULL, bench_memcpy },
+        { L"memset", TRUE, NULL, bench_memset },
+        { L"crc32", TRUE, NULL, bench_crc32 },
+        { L"sha256", TRUE, NULL, bench_sha256 },
+        { L"aes_gcm", TRUE, bench_aes_gcm_setup, bench_aes_gcm },
+        { L"aes_gcm_sw", TRUE, bench_aes_gcm_setup, bench_aes_gcm_sw },
+#ifdef USE_IPP_SHA256
+        { L"sha256_ipps", TRUE, bench_sha256_ipps_setup, bench_sha256_ipps },
+#endif
+        { L"gpt", FALSE, bench_gpt_setup, bench_gpt },
+#ifdef USE_AVB
+        { L"vbmeta", FALSE, bench_vbmeta_setup, bench_vbmeta },
+#endif
+#ifdef USE_UI
+        { L"upng", FALSE, bench_upng_setup, bench_upng },
+        { L"scale", FALSE, bench_scale_setup, bench_scale },
+#endif
+};
+
+static int bench_cmp(const void *a, const void *b)
+{
+        UINT64 x = *(const UINT64 *)a, y = *(const UINT64 *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static VOID bench_run(const struct bench_kernel *kernel,
+                      struct bench_ctx *ctx, UINTN iterations)
+{
+        UINT64 start, median, bpc;
+        UINTN i;
+
+        /* Warm up the caches and the lazy initializations */
+        kernel->run(ctx);
+
+        for (i = 0; i < iterations; i++) {
+                start = timer_ticks();
+                kernel->run(ctx);
+                bench_samples[i] = timer_ticks() - start;
+        }
+
+        qsort(bench_samples, iterations, sizeof(*bench_samples), bench_cmp);
+        median = max(bench_samples[iterations / 2], (UINT64)1);
+        bpc = (UINT64)ctx->size * 1000 / median;
+        bench_print("%s %d bytes: min %ld median %ld p99 %ld cycles, %ld.%03ld bytes/cycle",
+                    kernel->name, ctx->size, bench_samples[0], median,
+                    bench_samples[(iterations * 99) / 100], bpc / 1000,
+                    bpc % 1000);
+}
+
+static VOID test_bench(VOID)
+{
+        const struct bench_kernel *kernel;
+        EFI_PHYSICAL_ADDRESS addr = 0;
+        struct bench_ctx ctx;
+        CHAR16 *name = L"all";
+        UINTN iterations = BENCH_ITERATIONS, size = 0;
+        UINTN i, j;
+        EFI_STATUS ret;
+
+        if (test_argc > 0)
+                name = test_argv[0];
+        if (test_argc > 1)
+                iterations = min(max(Atoi(test_argv[1]), (UINTN)1),
+                                 (UINTN)BENCH_MAX_ITERATIONS);
+        if (test_argc > 2)
+                size = min(Atoi(test_argv[2]), (UINTN)BENCH_MAX_SIZE);
+
+        ret = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages,
+                                EfiLoaderData,
+                                EFI_SIZE_TO_PAGES(2 * BENCH_MAX_SIZE), &addr);
+        if (EFI_ERROR(ret)) {
+                Print(L"Failed to allocate the buffers, test Failed\n");
+                return;
+        }
+
+        bench_report_len = 0;
+        bench_print("bench: %d iterations, %d MHz", iterations, get_cpu_freq());
+
+        for (i = 0; i < ARRAY_SIZE(BENCH_KERNELS); i++) {
+                kernel = &BENCH_KERNELS[i];
+                if (StrCmp(name, L"all") && StrCmp(name, kernel->name))
+                        continue;
+
+                memset(&ctx, 0, sizeof(ctx));
+                ctx.src = (UINT8 *)(UINTN)addr;
+                ctx.dst = ctx.src + BENCH_MAX_SIZE;
+                for (j = 0; j < BENCH_MAX_SIZE; j++)
+                        ctx.src[j] = j * 7;
+
+                if (kernel->setup) {
+                        ret = kernel->setup(&ctx);
+                        if (EFI_ERROR(ret)) {
+                                bench_print("%s: skipped, %r", kernel->name, ret);
+                                continue;
+                        }
+                }
+
+                if (!kernel->sized)
+                        bench_run(kernel, &ctx, iterations);
+                else if (size) {
+                        ctx.size = size;
+                        bench_run(kernel, &ctx, iterations);
+                } else
+                        for (j = 0; j < ARRAY_SIZE(BENCH_SIZES); j++) {
+                                ctx.size = BENCH_SIZES[j];
+                                bench_run(kernel, &ctx, iterations);
+                        }
+        }
+
+        uefi_call_wrapper(BS->FreePages, 2, addr,
+                          EFI_SIZE_TO_PAGES(2 * BENCH_MAX_SIZE));
+        log_flush();
+
+        ret = set_efi_variable(&loader_guid, BENCH_VAR, bench_report_len,
+                               bench_report, FALSE, TRUE);
+        if (EFI_ERROR(ret)) {
+                Print(L"Failed to save the report, %r, test Failed\n", ret);
+                return;
+        }
+
+        Print(L"bench test Succeeded\n");
+}
+
 #ifdef USE_UI
 static UINT8 fake_hash[] = {0x12, 0x34, 0x56, 0x78, 0x90, 0xAB};
 
@@ -115,14 +908,24 @@ static struct test_suite {
         { L"ux", test_ux },
 #endif
         { L"keys", test_keys },
+        { L"crc32", test_crc32 },
+        { L"aes_gcm", test_aes_gcm },
+        { L"cmdline", test_cmdline },
+        { L"mp_pool", test_mp_pool },
+        { L"memory", test_memory },
+        { L"rpmb", test_rpmb },
+        { L"bench", test_bench },
         { L"watchdog", test_watchdog }
 };
 
-VOID unittest_main(CHAR16 *testname)
+VOID unittest_main(CHAR16 *testname, UINTN argc, CHAR16 **argv)
 {
         BOOLEAN found = FALSE;
         UINTN i;
 
+        test_argc = argc;
+        test_argv = argv;
+
         for (i = 0; i < ARRAY_SIZE(TEST_SUITES); i++)
                 if (!testname || !StrCmp(L"all", testname) ||
                     !StrCmp(TEST_SUITES[i].name, testname)) {
@@ -33,6 +33,8 @@
 #ifndef UNITTEST_H
 #define UNITTEST_H
 
-VOID unittest_main(CHAR16 *testname);
+/* ARGV are the ARGC arguments following TESTNAME, only the bench
+   suite uses them.  */
+VOID unittest_main(CHAR16 *testname, UINTN argc, CHAR16 **argv);
 
 #endif
@@ -605,7 +605,7 @@ VOID ux_display_vendor_splash(VOID) {
 	if (get_display_splash()) {
 		if (EFI_ERROR(ux_init_screen()))
 			return;
-		ui_display_vendor_splash();
+		ui_display_vendor_splash_async();
 		log(L"vendor splash shown\n");
 	}
 }